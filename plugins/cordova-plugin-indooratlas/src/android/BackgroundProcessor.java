@@ -0,0 +1,448 @@
+package com.ialocation.plugin;
+
+import com.indooratlas.android.sdk.IARegion;
+
+import org.json.JSONArray;
+import org.json.JSONException;
+import org.json.JSONObject;
+
+import java.util.ArrayList;
+import java.util.LinkedHashMap;
+import java.util.Map;
+
+/**
+ * Evaluates geofence and proximity triggers and aggregates occupancy in the
+ * native layer while the app is in the background, so that the WebView is
+ * only woken for actionable events.
+ *
+ * In the foreground every event still goes to JavaScript as before and the
+ * processor only keeps its trigger state up to date. In background mode the
+ * listener hands positions and region events to the processor instead of the
+ * watch callbacks. A trigger that fires is delivered to the background
+ * callback if it asks to wake JavaScript and posted as a local notification
+ * if it has one. Positions are counted per cell in an occupancy batch that is
+ * delivered once per batch interval, when the batch is full, or when the app
+ * returns to the foreground. The interval is also timed on the TimingWheel,
+ * so a batch is delivered even when no further position arrives.
+ *
+ * Positions arrive on the positioning queue and region events on the geofence
+ * queue, hence the methods are synchronized.
+ */
+public final class BackgroundProcessor {
+    public static final int TRANSITION_ENTER = 1;
+    public static final int TRANSITION_EXIT = 2;
+    public static final int ANY_FLOOR = Integer.MIN_VALUE;
+
+    public static final long DEFAULT_BATCH_INTERVAL_MS = 15 * 60 * 1000;
+    public static final int DEFAULT_BATCH_MAX_SAMPLES = 3600;
+    public static final int DEFAULT_CELL_LEVEL = 10;
+    public static final long DEFAULT_COOLDOWN_MS = 60 * 1000;
+    // Longer gaps between fixes are not counted as dwell time
+    private static final long MAX_DWELL_GAP_MS = 30 * 1000;
+    // A proximity trigger exits at this multiple of its radius, so fixes jittering on the edge do not re-fire it
+    private static final double EXIT_HYSTERESIS = 1.2;
+
+    /**
+     * Receives what the processor decides to surface
+     */
+    public interface Sink {
+        /**
+         * Delivers an event to JavaScript, waking the WebView
+         * @param event
+         */
+        void deliver(JSONObject event);
+
+        /**
+         * Posts a local notification
+         * @param triggerId
+         * @param title
+         * @param text
+         */
+        void notify(String triggerId, String title, String text);
+    }
+
+    private static final class Trigger {
+        String id;
+        // Region triggers match a region id, the others a circle in the venue frame
+        String regionId;
+        int floor;
+        double latitude;
+        double longitude;
+        int east;
+        int north;
+        long enterRadiusSquared;
+        long exitRadiusSquared;
+        int transitions;
+        boolean wake;
+        String title;
+        String text;
+        long cooldownMs;
+        boolean inside;
+        // Separate cooldowns, an exit shortly after the enter must still fire
+        long lastEnterMs = Long.MIN_VALUE;
+        long lastExitMs = Long.MIN_VALUE;
+    }
+
+    private final Sink mSink;
+    private final TimingWheel mTimingWheel;
+    private final ArrayList<Trigger> mTriggers = new ArrayList<Trigger>();
+    private boolean mEnabled;
+    private boolean mBackground;
+    private long mBatchIntervalMs = DEFAULT_BATCH_INTERVAL_MS;
+    private int mBatchMaxSamples = DEFAULT_BATCH_MAX_SAMPLES;
+    private int mCellLevel = DEFAULT_CELL_LEVEL;
+    private int mVenueKey;
+
+    // Occupancy batch: cell id -> {samples, dwell ms}
+    private final LinkedHashMap<Long, long[]> mOccupancy = new LinkedHashMap<Long, long[]>();
+    private int mBatchSamples;
+    private long mBatchStartMs;
+    private long mLastSampleMs;
+    private long mLastCell = CellId.NONE;
+    private TimingWheel.Timeout mBatchTimer;
+
+    private long mPositions;
+    private long mRegionEvents;
+    private long mHandled;
+    private long mDelivered;
+    private long mNotified;
+    private long mFired;
+    private long mBatches;
+
+    /**
+     * @param sink
+     * @param timingWheel times the batch interval, null if the caller only
+     *                    wants batches flushed by the position timestamps
+     */
+    public BackgroundProcessor(Sink sink, TimingWheel timingWheel) {
+        mSink = sink;
+        mTimingWheel = timingWheel;
+    }
+
+    /**
+     * Replaces the triggers and batching rules and enables the processor
+     * @param options {triggers: [...], batchIntervalMs, batchMaxSamples, cellLevel}
+     * @param frame venue frame for triggers given by coordinates, may be null if there are none
+     * @throws JSONException
+     */
+    public synchronized void configure(JSONObject options, VenueFrame frame) throws JSONException {
+        ArrayList<Trigger> triggers = new ArrayList<Trigger>();
+        JSONArray list = options.optJSONArray("triggers");
+        for (int i = 0; list != null && i < list.length(); i++) {
+            triggers.add(parseTrigger(list.getJSONObject(i), frame));
+        }
+        int cellLevel = options.optInt("cellLevel", DEFAULT_CELL_LEVEL);
+        if (cellLevel < 0 || cellLevel > CellId.MAX_LEVEL) {
+            throw new IllegalArgumentException("cellLevel must be within 0.." + CellId.MAX_LEVEL);
+        }
+        flush();
+        mTriggers.clear();
+        mTriggers.addAll(triggers);
+        mBatchIntervalMs = Math.max(1000, options.optLong("batchIntervalMs", DEFAULT_BATCH_INTERVAL_MS));
+        mBatchMaxSamples = Math.max(1, options.optInt("batchMaxSamples", DEFAULT_BATCH_MAX_SAMPLES));
+        mCellLevel = cellLevel;
+        mEnabled = true;
+    }
+
+    private static Trigger parseTrigger(JSONObject json, VenueFrame frame) throws JSONException {
+        Trigger trigger = new Trigger();
+        trigger.id = json.getString("id");
+        if (json.has("regionId")) {
+            trigger.regionId = json.getString("regionId");
+        } else {
+            if (frame == null) {
+                throw new IllegalArgumentException("No venue frame for trigger " + trigger.id);
+            }
+            trigger.latitude = json.getDouble("latitude");
+            trigger.longitude = json.getDouble("longitude");
+            trigger.east = frame.east(trigger.latitude, trigger.longitude);
+            trigger.north = frame.north(trigger.latitude, trigger.longitude);
+            long radius = Math.round(json.getDouble("radius") * 1000);
+            long exitRadius = Math.round(radius * EXIT_HYSTERESIS);
+            trigger.enterRadiusSquared = radius * radius;
+            trigger.exitRadiusSquared = exitRadius * exitRadius;
+            trigger.floor = json.has("floor") ? json.getInt("floor") : ANY_FLOOR;
+        }
+        String on = json.optString("on", "enter");
+        trigger.transitions = "both".equals(on) ? TRANSITION_ENTER | TRANSITION_EXIT
+                : "exit".equals(on) ? TRANSITION_EXIT : TRANSITION_ENTER;
+        trigger.wake = json.optBoolean("wake", true);
+        JSONObject notification = json.optJSONObject("notification");
+        if (notification != null) {
+            trigger.title = notification.optString("title", "");
+            trigger.text = notification.optString("text", "");
+        }
+        trigger.cooldownMs = json.optLong("cooldownMs", DEFAULT_COOLDOWN_MS);
+        return trigger;
+    }
+
+    /**
+     * Projects the proximity triggers into a new venue frame, the one the
+     * positions passed to onPosition are in from now on
+     * @param frame
+     */
+    public synchronized void setFrame(VenueFrame frame) {
+        for (int i = 0; i < mTriggers.size(); i++) {
+            Trigger trigger = mTriggers.get(i);
+            if (trigger.regionId == null) {
+                trigger.east = frame.east(trigger.latitude, trigger.longitude);
+                trigger.north = frame.north(trigger.latitude, trigger.longitude);
+            }
+        }
+    }
+
+    /**
+     * Disables the processor, delivering what is left of the occupancy batch
+     */
+    public synchronized void disable() {
+        flush();
+        mTriggers.clear();
+        mEnabled = false;
+    }
+
+    /**
+     * Called when the app goes to the background or returns. Returning delivers the occupancy batch.
+     * @param background
+     */
+    public synchronized void setBackground(boolean background) {
+        mBackground = background;
+        if (!background) {
+            flush();
+        }
+    }
+
+    public synchronized boolean isEnabled() {
+        return mEnabled;
+    }
+
+    /**
+     * True when events are handled natively instead of being sent to the watch callbacks
+     * @return
+     */
+    public synchronized boolean isActive() {
+        return mEnabled && mBackground;
+    }
+
+    /**
+     * Evaluates a position
+     * @param timeMs
+     * @param floor
+     * @param east millimetres in the venue frame
+     * @param north millimetres in the venue frame
+     * @return true if the position was handled natively and must not be sent to the watches
+     */
+    public synchronized boolean onPosition(long timeMs, int floor, int east, int north) {
+        if (!mEnabled) {
+            return false;
+        }
+        mPositions++;
+        for (int i = 0; i < mTriggers.size(); i++) {
+            Trigger trigger = mTriggers.get(i);
+            if (trigger.regionId != null) {
+                continue;
+            }
+            boolean sameFloor = trigger.floor == ANY_FLOOR || trigger.floor == floor;
+            long distanceSquared = VenueFrame.distanceSquared(east, north, trigger.east, trigger.north);
+            if (!trigger.inside && sameFloor && distanceSquared <= trigger.enterRadiusSquared) {
+                trigger.inside = true;
+                fire(trigger, TRANSITION_ENTER, timeMs);
+            } else if (trigger.inside && (!sameFloor || distanceSquared > trigger.exitRadiusSquared)) {
+                trigger.inside = false;
+                fire(trigger, TRANSITION_EXIT, timeMs);
+            }
+        }
+        if (!mBackground) {
+            return false;
+        }
+        addSample(timeMs, CellId.fromLocal(mVenueKey, floor, east, north, mCellLevel));
+        mHandled++;
+        return true;
+    }
+
+    /**
+     * Evaluates a region transition
+     * @param regionId
+     * @param regionType
+     * @param transition TRANSITION_ENTER or TRANSITION_EXIT
+     * @param timeMs
+     * @return true if the event was handled natively and must not be sent to the region watches
+     */
+    public synchronized boolean onRegion(String regionId, int regionType, int transition, long timeMs) {
+        if (!mEnabled) {
+            return false;
+        }
+        mRegionEvents++;
+        if (regionType == IARegion.TYPE_VENUE && transition == TRANSITION_ENTER) {
+            if (mVenueKey != CellId.venueKey(regionId)) {
+                // Cells of different venues must not be merged into one batch
+                flush();
+                mVenueKey = CellId.venueKey(regionId);
+            }
+        }
+        for (int i = 0; i < mTriggers.size(); i++) {
+            Trigger trigger = mTriggers.get(i);
+            if (regionId.equals(trigger.regionId)) {
+                trigger.inside = transition == TRANSITION_ENTER;
+                fire(trigger, transition, timeMs);
+            }
+        }
+        if (!mBackground) {
+            return false;
+        }
+        mHandled++;
+        return true;
+    }
+
+    private void fire(Trigger trigger, int transition, long timeMs) {
+        if ((trigger.transitions & transition) == 0) {
+            return;
+        }
+        long lastFiredMs = transition == TRANSITION_ENTER ? trigger.lastEnterMs : trigger.lastExitMs;
+        if (lastFiredMs != Long.MIN_VALUE && timeMs - lastFiredMs < trigger.cooldownMs) {
+            return;
+        }
+        if (transition == TRANSITION_ENTER) {
+            trigger.lastEnterMs = timeMs;
+        } else {
+            trigger.lastExitMs = timeMs;
+        }
+        mFired++;
+        TraceRecorder.instant("background", "trigger");
+        // In the foreground JavaScript is awake anyway, a notification would only duplicate the event
+        if (mBackground && trigger.title != null) {
+            mNotified++;
+            mSink.notify(trigger.id, trigger.title, trigger.text);
+        }
+        if (trigger.wake || !mBackground) {
+            try {
+                JSONObject event = new JSONObject();
+                event.put("type", "trigger");
+                event.put("triggerId", trigger.id);
+                event.put("transitionType", transition);
+                event.put("timestamp", timeMs);
+                event.put("background", mBackground);
+                deliver(event);
+            } catch (JSONException ex) {
+                throw new IllegalStateException(ex.getMessage());
+            }
+        }
+    }
+
+    private void addSample(long timeMs, long cell) {
+        if (mBatchSamples == 0) {
+            mBatchStartMs = timeMs;
+            scheduleFlush();
+        } else if (mLastCell != CellId.NONE) {
+            long gap = timeMs - mLastSampleMs;
+            if (gap > 0 && gap <= MAX_DWELL_GAP_MS) {
+                mOccupancy.get(mLastCell)[1] += gap;
+            }
+        }
+        long[] counts = mOccupancy.get(cell);
+        if (counts == null) {
+            counts = new long[2];
+            mOccupancy.put(cell, counts);
+        }
+        counts[0]++;
+        mBatchSamples++;
+        mLastCell = cell;
+        mLastSampleMs = timeMs;
+        if (mBatchSamples >= mBatchMaxSamples || timeMs - mBatchStartMs >= mBatchIntervalMs) {
+            flush();
+        }
+    }
+
+    /**
+     * Flushes the batch just started after the batch interval, unless it has
+     * been delivered by then
+     */
+    private void scheduleFlush() {
+        if (mTimingWheel == null) {
+            return;
+        }
+        final long batch = mBatches;
+        mBatchTimer = mTimingWheel.schedule(mBatchIntervalMs, new Runnable() {
+            @Override
+            public void run() {
+                // Delivering persists the event, keep that off the wheel thread
+                TaskScheduler.getShared().submit(TaskScheduler.LANE_BACKGROUND, CostAccounting.TIMERS, new Runnable() {
+                    @Override
+                    public void run() {
+                        synchronized (BackgroundProcessor.this) {
+                            if (mBatches == batch) {
+                                mBatchTimer = null;
+                                flush();
+                            }
+                        }
+                    }
+                });
+            }
+        });
+    }
+
+    /**
+     * Delivers the occupancy batch, if any, and cancels its timer
+     */
+    private void flush() {
+        if (mBatchTimer != null) {
+            mBatchTimer.cancel();
+            mBatchTimer = null;
+        }
+        if (mBatchSamples == 0) {
+            return;
+        }
+        try {
+            JSONArray cells = new JSONArray();
+            for (Map.Entry<Long, long[]> entry : mOccupancy.entrySet()) {
+                JSONObject cell = new JSONObject();
+                cell.put("cellId", CellId.toToken(entry.getKey()));
+                cell.put("samples", entry.getValue()[0]);
+                cell.put("dwellMs", entry.getValue()[1]);
+                cells.put(cell);
+            }
+            JSONObject event = new JSONObject();
+            event.put("type", "occupancy");
+            event.put("from", mBatchStartMs);
+            event.put("to", mLastSampleMs);
+            event.put("samples", mBatchSamples);
+            event.put("cells", cells);
+            mBatches++;
+            deliver(event);
+        } catch (JSONException ex) {
+            throw new IllegalStateException(ex.getMessage());
+        } finally {
+            mOccupancy.clear();
+            mBatchSamples = 0;
+            mLastCell = CellId.NONE;
+        }
+    }
+
+    private void deliver(JSONObject event) {
+        mDelivered++;
+        TraceRecorder.begin("bridge", "sendBackgroundEvent");
+        CostAccounting.enter();
+        try {
+            mSink.deliver(event);
+        } finally {
+            CostAccounting.exit(CostAccounting.BRIDGE, "background");
+            TraceRecorder.end("bridge", "sendBackgroundEvent");
+        }
+    }
+
+    /**
+     * Counters since the processor was created
+     * @return {positions, regionEvents, handled, delivered, notified, triggersFired, batches}
+     * @throws JSONException
+     */
+    public synchronized JSONObject getStats() throws JSONException {
+        JSONObject stats = new JSONObject();
+        stats.put("positions", mPositions);
+        stats.put("regionEvents", mRegionEvents);
+        stats.put("handled", mHandled);
+        stats.put("delivered", mDelivered);
+        stats.put("notified", mNotified);
+        stats.put("triggersFired", mFired);
+        stats.put("batches", mBatches);
+        return stats;
+    }
+}
@@ -0,0 +1,1745 @@
+package com.ialocation.plugin;
+
+import com.indooratlas.android.sdk.IARegion;
+
+import org.json.JSONArray;
+import org.json.JSONException;
+import org.json.JSONObject;
+
+import java.io.BufferedInputStream;
+import java.io.BufferedReader;
+import java.io.ByteArrayInputStream;
+import java.io.DataInputStream;
+import java.io.File;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.InputStreamReader;
+import java.io.OutputStream;
+import java.io.RandomAccessFile;
+import java.io.UnsupportedEncodingException;
+import java.net.HttpURLConnection;
+import java.net.InetAddress;
+import java.net.ServerSocket;
+import java.net.Socket;
+import java.net.URL;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.BitSet;
+import java.util.Random;
+import java.util.Timer;
+import java.util.TimerTask;
+import java.util.concurrent.CancellationException;
+import java.util.concurrent.CountDownLatch;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Future;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.atomic.AtomicInteger;
+import java.util.zip.InflaterInputStream;
+
+/**
+ * Micro benchmarks for the native layer, run on demand through the
+ * runBenchmark action. Each benchmark returns a JSON report.
+ */
+public final class Benchmarks {
+    private static final long TIMEOUT_SECONDS = 60;
+    private static volatile long sSink;
+
+    private Benchmarks() {
+    }
+
+    /**
+     * Interface for one way of running tasks in the comparison
+     */
+    private interface Dispatcher {
+        void dispatch(Runnable runnable);
+    }
+
+    /**
+     * Runs the named benchmark and returns its report
+     * @param name
+     * @param options
+     * @param threadPool Cordova's plugin thread pool, the current ad-hoc baseline
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject run(String name, JSONObject options, ExecutorService threadPool) throws JSONException {
+        if ("scheduler".equals(name)) {
+            int tasks = Math.max(1, options.optInt("tasks", 2000));
+            int work = options.optInt("work", 20000);
+            return scheduler(tasks, work, threadPool);
+        }
+        if ("timingWheel".equals(name)) {
+            int timers = Math.max(1, options.optInt("timers", 100000));
+            return timingWheel(timers);
+        }
+        if ("fetchScheduler".equals(name)) {
+            int requests = Math.max(1, options.optInt("requests", 120));
+            int keys = Math.max(1, options.optInt("keys", 40));
+            int latencyMs = options.optInt("latencyMs", 100);
+            double failureRate = options.optDouble("failureRate", 0.1);
+            double cancelRate = options.optDouble("cancelRate", 0.1);
+            int missing = Math.max(0, options.optInt("missing", 4));
+            return fetchScheduler(requests, keys, latencyMs, failureRate, cancelRate, missing, threadPool);
+        }
+        if ("costAccounting".equals(name)) {
+            int tasks = Math.max(1, options.optInt("tasks", 20));
+            int workMs = Math.max(2, options.optInt("workMs", 20));
+            return costAccounting(tasks, workMs);
+        }
+        if ("backgroundReplay".equals(name)) {
+            int fixes = Math.max(1, options.optInt("fixes", 3600));
+            int intervalMs = Math.max(1, options.optInt("intervalMs", 1000));
+            int triggers = Math.max(0, options.optInt("triggers", 8));
+            return backgroundReplay(fixes, intervalMs, triggers, options.optJSONArray("trace"));
+        }
+        if ("uplink".equals(name)) {
+            int fixes = Math.max(1, options.optInt("fixes", 3600));
+            int eventEvery = Math.max(0, options.optInt("eventEvery", 60));
+            int batchEvents = Math.max(1, options.optInt("batchEvents", Uplink.DEFAULT_BATCH_EVENTS));
+            int latencyMs = Math.max(0, options.optInt("latencyMs", 20));
+            double failureRate = options.optDouble("failureRate", 0.2);
+            double dropRate = options.optDouble("dropRate", 0.1);
+            return uplink(fixes, eventEvery, batchEvents, latencyMs, failureRate, dropRate);
+        }
+        if ("cellId".equals(name)) {
+            return cellId(Math.max(1, options.optInt("cells", 1000)));
+        }
+        if ("routeBuffer".equals(name)) {
+            int legs = Math.max(1, options.optInt("legs", 500));
+            int routes = Math.max(2, options.optInt("routes", 100));
+            return routeBuffer(legs, routes);
+        }
+        if ("deferred".equals(name)) {
+            int chains = Math.max(1, options.optInt("chains", 64));
+            int stallMs = Math.max(20, options.optInt("stallMs", 500));
+            return deferred(chains, stallMs);
+        }
+        if ("eventQueueRecovery".equals(name)) {
+            int events = Math.max(2, options.optInt("events", 300));
+            int tornBytes = Math.max(1, options.optInt("tornBytes", 7));
+            return eventQueueRecovery(events, tornBytes);
+        }
+        if ("streamChannel".equals(name)) {
+            return streamChannel();
+        }
+        throw new IllegalArgumentException("Unknown benchmark " + name);
+    }
+
+    /**
+     * Compares throughput and queueing latency of a thread per task, Cordova's
+     * thread pool and the shared TaskScheduler for short CPU bound tasks
+     * @param taskCount
+     * @param work
+     * @param threadPool
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject scheduler(int taskCount, int work, final ExecutorService threadPool) throws JSONException {
+        final TaskScheduler scheduler = TaskScheduler.getShared();
+        JSONArray results = new JSONArray();
+        results.put(measure("threadPerTask", taskCount, work, new Dispatcher() {
+            @Override
+            public void dispatch(Runnable runnable) {
+                new Thread(runnable).start();
+            }
+        }));
+        results.put(measure("cordovaThreadPool", taskCount, work, new Dispatcher() {
+            @Override
+            public void dispatch(Runnable runnable) {
+                threadPool.execute(runnable);
+            }
+        }));
+        results.put(measure("taskScheduler", taskCount, work, new Dispatcher() {
+            @Override
+            public void dispatch(Runnable runnable) {
+                scheduler.submit(TaskScheduler.LANE_INTERACTIVE, runnable);
+            }
+        }));
+
+        JSONObject report = new JSONObject();
+        report.put("benchmark", "scheduler");
+        report.put("tasks", taskCount);
+        report.put("work", work);
+        report.put("cores", Runtime.getRuntime().availableProcessors());
+        report.put("schedulerThreads", scheduler.getThreadCount());
+        report.put("results", results);
+        return report;
+    }
+
+    /**
+     * Schedules the given number of timers with delays between one second and
+     * one minute, cancels half of them and expires the rest, on a TimingWheel
+     * and on java.util.Timer. The wheel is advanced by hand so expiry does not
+     * wait for the clock; Timer cannot be, so only its insert and cancel
+     * (including purge) costs are reported.
+     * @param timerCount
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject timingWheel(int timerCount) throws JSONException {
+        long[] delays = new long[timerCount];
+        Random random = new Random(42);
+        for (int i = 0; i < timerCount; i++) {
+            delays[i] = 1000 + random.nextInt(59000);
+        }
+        final int[] fired = new int[1];
+        Runnable task = new Runnable() {
+            @Override
+            public void run() {
+                fired[0]++;
+            }
+        };
+
+        TimingWheel wheel = new TimingWheel(TimingWheel.DEFAULT_TICK_MS);
+        TimingWheel.Timeout[] timeouts = new TimingWheel.Timeout[timerCount];
+        long start = System.nanoTime();
+        for (int i = 0; i < timerCount; i++) {
+            timeouts[i] = wheel.schedule(delays[i], task);
+        }
+        long insert = System.nanoTime() - start;
+        int pendingAfterInsert = wheel.size();
+        start = System.nanoTime();
+        for (int i = 0; i < timerCount; i += 2) {
+            timeouts[i].cancel();
+        }
+        long cancel = System.nanoTime() - start;
+        start = System.nanoTime();
+        wheel.advanceTo(wheel.nowMs() + 60000);
+        long expire = System.nanoTime() - start;
+
+        JSONObject wheelResult = new JSONObject();
+        wheelResult.put("name", "timingWheel");
+        wheelResult.put("pending", pendingAfterInsert);
+        wheelResult.put("insertNsPerTimer", (double) insert / timerCount);
+        wheelResult.put("cancelNsPerTimer", (double) cancel / ((timerCount + 1) / 2));
+        wheelResult.put("expireNsPerTimer", fired[0] > 0 ? (double) expire / fired[0] : 0);
+        wheelResult.put("expired", fired[0]);
+        wheelResult.put("remaining", wheel.size());
+
+        Timer timer = new Timer("IABenchmarkTimer", true);
+        TimerTask[] tasks = new TimerTask[timerCount];
+        start = System.nanoTime();
+        for (int i = 0; i < timerCount; i++) {
+            tasks[i] = new TimerTask() {
+                @Override
+                public void run() {
+                }
+            };
+            timer.schedule(tasks[i], delays[i]);
+        }
+        insert = System.nanoTime() - start;
+        start = System.nanoTime();
+        for (int i = 0; i < timerCount; i += 2) {
+            tasks[i].cancel();
+        }
+        timer.purge();
+        cancel = System.nanoTime() - start;
+        timer.cancel();
+
+        JSONObject timerResult = new JSONObject();
+        timerResult.put("name", "javaUtilTimer");
+        timerResult.put("pending", timerCount);
+        timerResult.put("insertNsPerTimer", (double) insert / timerCount);
+        timerResult.put("cancelNsPerTimer", (double) cancel / ((timerCount + 1) / 2));
+
+        JSONArray results = new JSONArray();
+        results.put(wheelResult);
+        results.put(timerResult);
+        JSONObject report = new JSONObject();
+        report.put("benchmark", "timingWheel");
+        report.put("timers", timerCount);
+        report.put("results", results);
+        return report;
+    }
+
+    /**
+     * Loopback HTTP server standing in for a resource backend. Answers every
+     * request with a fixed size body after the injected latency, or with 503
+     * at the given rate, and records how many requests it served at once.
+     */
+    private static final class StandInServer implements Runnable {
+        static final int BODY_BYTES = 20000;
+        final ServerSocket socket;
+        final int latencyMs;
+        final double failureRate;
+        final Random random = new Random(7);
+        final AtomicInteger requests = new AtomicInteger();
+        final AtomicInteger active = new AtomicInteger();
+        final AtomicInteger maxActive = new AtomicInteger();
+
+        StandInServer(int latencyMs, double failureRate) throws IOException {
+            this.socket = new ServerSocket(0, 64, InetAddress.getByName("127.0.0.1"));
+            this.latencyMs = latencyMs;
+            this.failureRate = failureRate;
+        }
+
+        String host() {
+            return "127.0.0.1:" + socket.getLocalPort();
+        }
+
+        @Override
+        public void run() {
+            while (!socket.isClosed()) {
+                final Socket client;
+                try {
+                    client = socket.accept();
+                } catch (IOException ex) {
+                    return;
+                }
+                new Thread(new Runnable() {
+                    @Override
+                    public void run() {
+                        serve(client);
+                    }
+                }).start();
+            }
+        }
+
+        private void serve(Socket client) {
+            int now = active.incrementAndGet();
+            int max;
+            while (now > (max = maxActive.get()) && !maxActive.compareAndSet(max, now)) {
+            }
+            requests.incrementAndGet();
+            try {
+                BufferedReader reader = new BufferedReader(new InputStreamReader(client.getInputStream(), "US-ASCII"));
+                String requestLine = reader.readLine();
+                String line;
+                while ((line = reader.readLine()) != null && line.length() > 0) {
+                }
+                Thread.sleep(latencyMs);
+                boolean fail;
+                synchronized (random) {
+                    fail = random.nextDouble() < failureRate;
+                }
+                OutputStream out = client.getOutputStream();
+                if (requestLine != null && requestLine.startsWith("GET /missing/")) {
+                    out.write("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n".getBytes("US-ASCII"));
+                } else if (fail) {
+                    out.write("HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n".getBytes("US-ASCII"));
+                } else {
+                    out.write(("HTTP/1.1 200 OK\r\nContent-Length: " + BODY_BYTES + "\r\nConnection: close\r\n\r\n").getBytes("US-ASCII"));
+                    out.write(new byte[BODY_BYTES]);
+                }
+                out.flush();
+            } catch (IOException ex) {
+                // Client gave up, e.g. a cancelled fetch
+            } catch (InterruptedException ex) {
+                Thread.currentThread().interrupt();
+            } finally {
+                active.decrementAndGet();
+                try {
+                    client.close();
+                } catch (IOException ex) {
+                    // Nothing to do
+                }
+            }
+        }
+
+        void close() {
+            try {
+                socket.close();
+            } catch (IOException ex) {
+                // Nothing to do
+            }
+        }
+    }
+
+    /**
+     * Runs a burst of requests with mixed priorities through a FetchScheduler
+     * against two loopback stand-in hosts, with some requests for the same
+     * resource and some cancelled right away. Reports completion latency per
+     * priority, how many requests reached the servers and the highest
+     * concurrency either server saw, which must not exceed the per host cap.
+     * Then fetches resources a third host does not have: each must reach it
+     * once, without retries, and leave its cap whole.
+     * @param requestCount
+     * @param keyCount
+     * @param latencyMs
+     * @param failureRate
+     * @param cancelRate
+     * @param missingCount requests for resources that do not exist
+     * @param threadPool runs the blocking HTTP requests
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject fetchScheduler(int requestCount, int keyCount, int latencyMs, double failureRate,
+                                            double cancelRate, int missingCount, final ExecutorService threadPool)
+            throws JSONException {
+        StandInServer[] servers = new StandInServer[3];
+        try {
+            for (int i = 0; i < servers.length; i++) {
+                servers[i] = new StandInServer(latencyMs, i < 2 ? failureRate : 0);
+                new Thread(servers[i], "IAStandInServer-" + i).start();
+            }
+        } catch (IOException ex) {
+            for (StandInServer server : servers) {
+                if (server != null) {
+                    server.close();
+                }
+            }
+            throw new IllegalStateException(ex.getMessage());
+        }
+
+        FetchScheduler scheduler = new FetchScheduler(FetchScheduler.DEFAULT_MAX_CONCURRENT,
+                FetchScheduler.DEFAULT_MAX_PER_HOST, TimingWheel.getShared());
+        Random random = new Random(42);
+        final CountDownLatch done = new CountDownLatch(requestCount);
+        final long[][] latencies = new long[3][requestCount];
+        final int[] latencyCounts = new int[3];
+        final AtomicInteger failed = new AtomicInteger();
+        final AtomicInteger cancelled = new AtomicInteger();
+        long start = System.nanoTime();
+        for (int i = 0; i < requestCount; i++) {
+            int key = random.nextInt(keyCount);
+            final StandInServer server = servers[key % 2];
+            final String url = "http://" + server.host() + "/resource/" + key;
+            final int priority = random.nextInt(3);
+            final long submitted = System.nanoTime();
+            Deferred<Integer> request = scheduler.fetch(url, server.host(), priority, standInFetcher(url, threadPool));
+            request.whenComplete(new Deferred.Callback<Integer>() {
+                @Override
+                public void onSuccess(Integer value) {
+                    synchronized (latencies) {
+                        latencies[priority][latencyCounts[priority]++] = System.nanoTime() - submitted;
+                    }
+                    done.countDown();
+                }
+
+                @Override
+                public void onFailure(Exception error) {
+                    // A cancel that comes after the fetch completed neither fails nor counts
+                    (error instanceof CancellationException ? cancelled : failed).incrementAndGet();
+                    done.countDown();
+                }
+            });
+            if (random.nextDouble() < cancelRate) {
+                request.cancel();
+            }
+        }
+        boolean completed;
+        try {
+            completed = done.await(TIMEOUT_SECONDS, TimeUnit.SECONDS);
+        } catch (InterruptedException ex) {
+            completed = false;
+        }
+        long elapsed = System.nanoTime() - start;
+
+        StandInServer missingServer = servers[2];
+        final CountDownLatch missingDone = new CountDownLatch(missingCount);
+        final AtomicInteger missingFailed = new AtomicInteger();
+        for (int i = 0; i < missingCount; i++) {
+            String url = "http://" + missingServer.host() + "/missing/" + i;
+            scheduler.fetch(url, missingServer.host(), FetchScheduler.PRIORITY_VISIBLE, standInFetcher(url, threadPool))
+                    .whenComplete(new Deferred.Callback<Integer>() {
+                        @Override
+                        public void onSuccess(Integer value) {
+                            missingDone.countDown();
+                        }
+
+                        @Override
+                        public void onFailure(Exception error) {
+                            missingFailed.incrementAndGet();
+                            missingDone.countDown();
+                        }
+                    });
+        }
+        try {
+            completed &= missingDone.await(TIMEOUT_SECONDS, TimeUnit.SECONDS);
+        } catch (InterruptedException ex) {
+            completed = false;
+        }
+
+        JSONObject report = new JSONObject();
+        report.put("benchmark", "fetchScheduler");
+        report.put("requests", requestCount);
+        report.put("keys", keyCount);
+        report.put("latencyMs", latencyMs);
+        report.put("failureRate", failureRate);
+        report.put("completed", completed);
+        report.put("elapsedMs", elapsed / 1e6);
+        report.put("cancelled", cancelled.get());
+        report.put("failed", failed.get());
+        String[] names = {"visible", "navigation", "prefetch"};
+        synchronized (latencies) {
+            for (int p = 0; p < 3; p++) {
+                if (latencyCounts[p] > 0) {
+                    long[] sorted = Arrays.copyOf(latencies[p], latencyCounts[p]);
+                    Arrays.sort(sorted);
+                    report.put(names[p] + "P50LatencyMs", percentile(sorted, 0.50) / 1e6);
+                }
+            }
+        }
+        int serverRequests = 0;
+        int maxPerHost = 0;
+        for (int i = 0; i < 2; i++) {
+            serverRequests += servers[i].requests.get();
+            maxPerHost = Math.max(maxPerHost, servers[i].maxActive.get());
+        }
+        for (StandInServer server : servers) {
+            server.close();
+        }
+        report.put("serverRequests", serverRequests);
+        report.put("maxConcurrentPerHost", maxPerHost);
+        report.put("perHostCap", FetchScheduler.DEFAULT_MAX_PER_HOST);
+        JSONObject schedulerReport = scheduler.getReport();
+        report.put("missingRequests", missingCount);
+        report.put("missingFailed", missingFailed.get());
+        report.put("missingServerRequests", missingServer.requests.get());
+        report.put("missingHostCap", schedulerReport.getJSONObject("hosts").getJSONObject(missingServer.host()).getInt("cap"));
+        report.put("scheduler", schedulerReport);
+        return report;
+    }
+
+    private static FetchScheduler.Fetcher<Integer> standInFetcher(final String url, final ExecutorService threadPool) {
+        return new FetchScheduler.Fetcher<Integer>() {
+            @Override
+            public FetchScheduler.Cancellable start(final FetchScheduler.Result<Integer> result) {
+                final Future<?> future = threadPool.submit(new Runnable() {
+                    @Override
+                    public void run() {
+                        httpGet(url, result);
+                    }
+                });
+                return new FetchScheduler.Cancellable() {
+                    @Override
+                    public void cancel() {
+                        future.cancel(true);
+                    }
+                };
+            }
+        };
+    }
+
+    private static void httpGet(String url, FetchScheduler.Result<Integer> result) {
+        HttpURLConnection connection = null;
+        try {
+            connection = (HttpURLConnection) new URL(url).openConnection();
+            connection.setConnectTimeout(10000);
+            connection.setReadTimeout(10000);
+            int status = connection.getResponseCode();
+            if (status != HttpURLConnection.HTTP_OK) {
+                result.failure(new IOException("HTTP " + status), status >= 500);
+                return;
+            }
+            InputStream in = connection.getInputStream();
+            byte[] buffer = new byte[8192];
+            int total = 0;
+            int read;
+            while ((read = in.read(buffer)) > 0) {
+                total += read;
+            }
+            in.close();
+            result.success(total, total);
+        } catch (IOException ex) {
+            result.failure(ex, true);
+        } finally {
+            if (connection != null) {
+                connection.disconnect();
+            }
+        }
+    }
+
+    /**
+     * Checks CostAccounting against synthetic workloads run on the shared
+     * scheduler: busy tasks must be charged about their wall time as CPU,
+     * sleeping tasks almost none, and a task whose second half runs in a
+     * nested bracket must split its CPU evenly between the two subsystems.
+     * Also reports the cost of an enter/exit pair.
+     * @param taskCount tasks per workload
+     * @param workMs duration of each task
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject costAccounting(int taskCount, final int workMs) throws JSONException {
+        final String[] subsystems = {"synthetic.busy", "synthetic.sleep", "synthetic.outer", "synthetic.inner"};
+        long[][] before = new long[subsystems.length][];
+        for (int i = 0; i < subsystems.length; i++) {
+            before[i] = CostAccounting.totals(subsystems[i]);
+        }
+
+        TaskScheduler scheduler = TaskScheduler.getShared();
+        final CountDownLatch done = new CountDownLatch(3 * taskCount);
+        final long workNanos = workMs * 1000000L;
+        for (int i = 0; i < taskCount; i++) {
+            scheduler.submit(TaskScheduler.LANE_BACKGROUND, subsystems[0], new Runnable() {
+                @Override
+                public void run() {
+                    spinFor(workNanos);
+                    done.countDown();
+                }
+            });
+            scheduler.submit(TaskScheduler.LANE_BACKGROUND, subsystems[1], new Runnable() {
+                @Override
+                public void run() {
+                    try {
+                        Thread.sleep(workMs);
+                    } catch (InterruptedException ex) {
+                        Thread.currentThread().interrupt();
+                    }
+                    done.countDown();
+                }
+            });
+            scheduler.submit(TaskScheduler.LANE_BACKGROUND, subsystems[2], new Runnable() {
+                @Override
+                public void run() {
+                    spinFor(workNanos / 2);
+                    CostAccounting.enter();
+                    spinFor(workNanos / 2);
+                    CostAccounting.exit(subsystems[3], "nested");
+                    done.countDown();
+                }
+            });
+        }
+        boolean completed;
+        try {
+            completed = done.await(TIMEOUT_SECONDS, TimeUnit.SECONDS);
+            // Tasks are charged right after they return, wait for the last ones
+            long deadline = System.nanoTime() + TimeUnit.SECONDS.toNanos(5);
+            while (completed && CostAccounting.totals(subsystems[2])[2] - before[2][2] < taskCount
+                    && System.nanoTime() < deadline) {
+                Thread.sleep(1);
+            }
+        } catch (InterruptedException ex) {
+            completed = false;
+        }
+
+        long[][] delta = new long[subsystems.length][];
+        JSONObject workloads = new JSONObject();
+        for (int i = 0; i < subsystems.length; i++) {
+            long[] after = CostAccounting.totals(subsystems[i]);
+            delta[i] = new long[after.length];
+            for (int k = 0; k < after.length; k++) {
+                delta[i][k] = after[k] - before[i][k];
+            }
+            JSONObject entry = new JSONObject();
+            entry.put("cpuMs", delta[i][0] / 1e6);
+            entry.put("wallMs", delta[i][1] / 1e6);
+            entry.put("calls", delta[i][2]);
+            entry.put("wakeups", delta[i][3]);
+            workloads.put(subsystems[i], entry);
+        }
+
+        double busyRatio = delta[0][1] > 0 ? (double) delta[0][0] / delta[0][1] : 0;
+        double sleepRatio = delta[1][1] > 0 ? (double) delta[1][0] / delta[1][1] : 0;
+        double nestedSplit = delta[3][0] > 0 ? (double) delta[2][0] / delta[3][0] : 0;
+        boolean wakeupsOk = delta[0][3] == taskCount && delta[1][3] == taskCount && delta[2][3] == taskCount
+                && delta[3][2] == taskCount && delta[3][3] == 0;
+
+        int pairs = 100000;
+        long start = System.nanoTime();
+        for (int i = 0; i < pairs; i++) {
+            CostAccounting.enter();
+            CostAccounting.exit("synthetic.overhead", "empty");
+        }
+        long overhead = System.nanoTime() - start;
+
+        JSONObject report = new JSONObject();
+        report.put("benchmark", "costAccounting");
+        report.put("tasks", taskCount);
+        report.put("workMs", workMs);
+        report.put("completed", completed);
+        report.put("workloads", workloads);
+        report.put("busyCpuToWall", busyRatio);
+        report.put("sleepCpuToWall", sleepRatio);
+        report.put("outerToInnerCpu", nestedSplit);
+        report.put("wakeupsOk", wakeupsOk);
+        // CPU may fall short of wall time when the device is loaded, hence the slack
+        report.put("attributionOk", completed && wakeupsOk && busyRatio > 0.7 && sleepRatio < 0.1
+                && nestedSplit > 0.65 && nestedSplit < 1.35);
+        report.put("nsPerEnterExit", (double) overhead / pairs);
+        return report;
+    }
+
+    /**
+     * A recorded or synthetic session: positions and region transitions in time order
+     */
+    private static final class ReplayTrace {
+        static final int FIX = 0;
+
+        final long[] time;
+        // FIX or a BackgroundProcessor transition
+        final int[] kind;
+        final int[] floor;
+        final int[] east;
+        final int[] north;
+        final String[] regionId;
+        final int[] regionType;
+        int size;
+
+        ReplayTrace(int capacity) {
+            time = new long[capacity];
+            kind = new int[capacity];
+            floor = new int[capacity];
+            east = new int[capacity];
+            north = new int[capacity];
+            regionId = new String[capacity];
+            regionType = new int[capacity];
+        }
+
+        void fix(long t, int f, int e, int n) {
+            time[size] = t;
+            kind[size] = FIX;
+            floor[size] = f;
+            east[size] = e;
+            north[size] = n;
+            size++;
+        }
+
+        void region(long t, String id, int type, int transition) {
+            time[size] = t;
+            kind[size] = transition;
+            regionId[size] = id;
+            regionType[size] = type;
+            size++;
+        }
+    }
+
+    /**
+     * Replays a session through the BackgroundProcessor twice, once as if the
+     * app were in the foreground, where every position and region event wakes
+     * JavaScript, and once in the background, where only the events the
+     * processor delivers do. Reports the JavaScript wakeups of both, the
+     * notifications posted and the native CPU time per event.
+     * @param fixCount positions in the synthetic session
+     * @param intervalMs time between positions
+     * @param triggerCount proximity triggers placed along the walk
+     * @param recorded optional recorded session as [timeMs, floor, eastMeters, northMeters] fixes
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject backgroundReplay(int fixCount, int intervalMs, int triggerCount, JSONArray recorded) throws JSONException {
+        ReplayTrace trace;
+        if (recorded != null) {
+            trace = new ReplayTrace(recorded.length());
+            for (int i = 0; i < recorded.length(); i++) {
+                JSONArray fix = recorded.getJSONArray(i);
+                trace.fix(fix.getLong(0), fix.getInt(1), (int) Math.round(fix.getDouble(2) * 1000),
+                        (int) Math.round(fix.getDouble(3) * 1000));
+            }
+        } else {
+            trace = syntheticWalk(fixCount, intervalMs);
+        }
+
+        // Proximity triggers on points of the walk, half of them only notify
+        Random random = new Random(7);
+        VenueFrame frame = new VenueFrame(60.17, 24.94);
+        JSONArray triggers = new JSONArray();
+        for (int i = 0; i < triggerCount && trace.size > 0; i++) {
+            int at;
+            do {
+                at = random.nextInt(trace.size);
+            } while (trace.kind[at] != ReplayTrace.FIX);
+            JSONObject trigger = new JSONObject();
+            trigger.put("id", "proximity-" + i);
+            trigger.put("latitude", frame.latitude(trace.east[at], trace.north[at]));
+            trigger.put("longitude", frame.longitude(trace.east[at], trace.north[at]));
+            trigger.put("floor", trace.floor[at]);
+            trigger.put("radius", 5);
+            trigger.put("on", "both");
+            trigger.put("cooldownMs", 5 * 60 * 1000);
+            if (i % 2 == 1) {
+                trigger.put("wake", false);
+                trigger.put("notification", new JSONObject().put("title", "Nearby").put("text", "Trigger " + i));
+            }
+            triggers.put(trigger);
+        }
+        triggers.put(new JSONObject().put("id", "floor-1").put("regionId", "floorplan-1"));
+        JSONObject config = new JSONObject();
+        config.put("triggers", triggers);
+        config.put("batchIntervalMs", 15 * 60 * 1000);
+
+        JSONObject foreground = replay(trace, config, frame, false);
+        JSONObject background = replay(trace, config, frame, true);
+
+        JSONObject report = new JSONObject();
+        report.put("benchmark", "backgroundReplay");
+        report.put("events", trace.size);
+        report.put("recorded", recorded != null);
+        report.put("foreground", foreground);
+        report.put("background", background);
+        long foregroundWakeups = foreground.getLong("jsWakeups");
+        long backgroundWakeups = background.getLong("jsWakeups");
+        report.put("wakeupReduction", backgroundWakeups > 0 ? (double) foregroundWakeups / backgroundWakeups : foregroundWakeups);
+        return report;
+    }
+
+    private static ReplayTrace syntheticWalk(int fixCount, int intervalMs) {
+        // Fixes plus the region transitions of a floor change every ten minutes
+        int floorChangeEvery = Math.max(1, 600000 / intervalMs);
+        ReplayTrace trace = new ReplayTrace(fixCount + 2 * (fixCount / floorChangeEvery) + 2);
+        Random random = new Random(42);
+        double x = 50000, y = 30000, heading = 0;
+        double step = 1.2 * intervalMs;
+        int floor = 0;
+        long t = 0;
+        trace.region(t, "venue-1", IARegion.TYPE_VENUE, BackgroundProcessor.TRANSITION_ENTER);
+        trace.region(t, "floorplan-0", IARegion.TYPE_FLOOR_PLAN, BackgroundProcessor.TRANSITION_ENTER);
+        for (int i = 0; i < fixCount; i++) {
+            t += intervalMs;
+            if (i > 0 && i % floorChangeEvery == 0) {
+                trace.region(t, "floorplan-" + floor, IARegion.TYPE_FLOOR_PLAN, BackgroundProcessor.TRANSITION_EXIT);
+                floor = 1 - floor;
+                trace.region(t, "floorplan-" + floor, IARegion.TYPE_FLOOR_PLAN, BackgroundProcessor.TRANSITION_ENTER);
+            }
+            heading += (random.nextDouble() - 0.5);
+            x += step * Math.cos(heading);
+            y += step * Math.sin(heading);
+            // Stay inside a 100 m x 60 m building
+            if (x < 0 || x > 100000) {
+                heading = Math.PI - heading;
+                x = Math.max(0, Math.min(100000, x));
+            }
+            if (y < 0 || y > 60000) {
+                heading = -heading;
+                y = Math.max(0, Math.min(60000, y));
+            }
+            trace.fix(t, floor, (int) x, (int) y);
+        }
+        return trace;
+    }
+
+    private static JSONObject replay(ReplayTrace trace, JSONObject config, VenueFrame frame, boolean background) throws JSONException {
+        final long[] sink = new long[2];
+        BackgroundProcessor processor = new BackgroundProcessor(new BackgroundProcessor.Sink() {
+            @Override
+            public void deliver(JSONObject event) {
+                sink[0]++;
+            }
+
+            @Override
+            public void notify(String triggerId, String title, String text) {
+                sink[1]++;
+            }
+        }, null);
+        processor.configure(config, frame);
+        processor.setBackground(background);
+
+        String subsystem = background ? "synthetic.background" : "synthetic.foreground";
+        long[] before = CostAccounting.totals(subsystem);
+        long direct = 0;
+        for (int i = 0; i < trace.size; i++) {
+            CostAccounting.enter();
+            boolean handled = trace.kind[i] == ReplayTrace.FIX
+                    ? processor.onPosition(trace.time[i], trace.floor[i], trace.east[i], trace.north[i])
+                    : processor.onRegion(trace.regionId[i], trace.regionType[i], trace.kind[i], trace.time[i]);
+            CostAccounting.exit(subsystem, "replay");
+            if (!handled) {
+                // Sent to the watch callbacks, as without a processor
+                direct++;
+            }
+        }
+        // Returning to the foreground delivers the last batch
+        processor.setBackground(false);
+        long[] after = CostAccounting.totals(subsystem);
+
+        JSONObject result = processor.getStats();
+        result.put("direct", direct);
+        result.put("jsWakeups", direct + sink[0]);
+        result.put("notifications", sink[1]);
+        result.put("cpuNsPerEvent", trace.size > 0 ? (double) (after[0] - before[0]) / trace.size : 0);
+        return result;
+    }
+
+    /**
+     * Loopback stand-in for the uplink backend. Decodes every batch and
+     * records which offsets it received, so that gaps and duplicates show,
+     * and checks that each event follows the fix it was queued after.
+     * Answers 503 at failureRate without taking the batch, and at dropRate
+     * takes the batch but closes the connection without answering, like a
+     * response lost on the way back.
+     */
+    private static final class UplinkStandInServer implements Runnable {
+        final ServerSocket socket;
+        final int latencyMs;
+        final double failureRate;
+        final double dropRate;
+        final Random random = new Random(11);
+        final BitSet received = new BitSet();
+        int requests;
+        int failures;
+        int drops;
+        int duplicates;
+        int decodeErrors;
+        int orderErrors;
+
+        UplinkStandInServer(int latencyMs, double failureRate, double dropRate) throws IOException {
+            this.socket = new ServerSocket(0, 16, InetAddress.getByName("127.0.0.1"));
+            this.latencyMs = latencyMs;
+            this.failureRate = failureRate;
+            this.dropRate = dropRate;
+        }
+
+        String url() {
+            return "http://127.0.0.1:" + socket.getLocalPort() + "/batch";
+        }
+
+        @Override
+        public void run() {
+            while (!socket.isClosed()) {
+                try {
+                    Socket client = socket.accept();
+                    try {
+                        serve(client);
+                    } finally {
+                        client.close();
+                    }
+                } catch (IOException ex) {
+                    // Closed, or the client went away
+                }
+            }
+        }
+
+        private void serve(Socket client) throws IOException {
+            DataInputStream in = new DataInputStream(new BufferedInputStream(client.getInputStream()));
+            int length = 0;
+            long first = -1;
+            long last = -2;
+            String line;
+            while ((line = readLine(in)).length() > 0) {
+                int colon = line.indexOf(':');
+                if (colon < 0) {
+                    continue;
+                }
+                String name = line.substring(0, colon).trim();
+                String value = line.substring(colon + 1).trim();
+                if ("Content-Length".equalsIgnoreCase(name)) {
+                    length = Integer.parseInt(value);
+                } else if ("X-IA-Offsets".equalsIgnoreCase(name)) {
+                    int dash = value.indexOf('-');
+                    first = Long.parseLong(value.substring(0, dash));
+                    last = Long.parseLong(value.substring(dash + 1));
+                }
+            }
+            byte[] body = new byte[length];
+            in.readFully(body);
+            try {
+                Thread.sleep(latencyMs);
+            } catch (InterruptedException ex) {
+                Thread.currentThread().interrupt();
+            }
+            double roll;
+            synchronized (this) {
+                requests++;
+                roll = random.nextDouble();
+            }
+            OutputStream out = client.getOutputStream();
+            if (roll < failureRate) {
+                synchronized (this) {
+                    failures++;
+                }
+                out.write("HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n".getBytes("US-ASCII"));
+                out.flush();
+                return;
+            }
+            int items = decodedItems(body);
+            synchronized (this) {
+                if (first < 0 || items != last - first + 1) {
+                    decodeErrors++;
+                }
+                for (long offset = first; offset >= 0 && offset <= last; offset++) {
+                    if (received.get((int) offset)) {
+                        duplicates++;
+                    }
+                    received.set((int) offset);
+                }
+                if (roll < failureRate + dropRate) {
+                    drops++;
+                    return;
+                }
+            }
+            out.write("HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n".getBytes("US-ASCII"));
+            out.flush();
+        }
+
+        /**
+         * Number of fixes and events in a deflated batch, -1 if it does not
+         * decode. Counts the events that do not carry the time of the fix
+         * before them as order errors.
+         */
+        private int decodedItems(byte[] body) {
+            try {
+                DataInputStream in = new DataInputStream(new InflaterInputStream(new ByteArrayInputStream(body)));
+                byte[] magic = new byte[4];
+                in.readFully(magic);
+                if (magic[0] != 'I' || magic[1] != 'A' || magic[2] != 'U' || magic[3] != 2) {
+                    return -1;
+                }
+                int fixes = (int) readVarint(in);
+                long[] times = new long[fixes];
+                long time = 0;
+                for (int i = 0; i < fixes; i++) {
+                    long zigzag = readVarint(in);
+                    time += (zigzag >>> 1) ^ -(zigzag & 1);
+                    times[i] = time;
+                }
+                for (int i = 0; i < 4 * fixes; i++) {
+                    readVarint(in);
+                }
+                int events = (int) readVarint(in);
+                int fixesBefore = 0;
+                int misordered = 0;
+                for (int i = 0; i < events; i++) {
+                    fixesBefore += (int) readVarint(in);
+                    byte[] json = new byte[(int) readVarint(in)];
+                    in.readFully(json);
+                    JSONObject event = new JSONObject(new String(json, "UTF-8"));
+                    if (fixesBefore > fixes
+                            || (fixesBefore > 0 && times[fixesBefore - 1] != event.optLong("timestamp"))) {
+                        misordered++;
+                    }
+                }
+                synchronized (this) {
+                    orderErrors += misordered;
+                }
+                return fixes + events;
+            } catch (IOException ex) {
+                return -1;
+            } catch (JSONException ex) {
+                return -1;
+            }
+        }
+
+        private static long readVarint(DataInputStream in) throws IOException {
+            long value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                int b = in.readUnsignedByte();
+                value |= (long) (b & 0x7f) << shift;
+                if ((b & 0x80) == 0) {
+                    return value;
+                }
+            }
+            throw new IOException("Bad varint");
+        }
+
+        private static String readLine(DataInputStream in) throws IOException {
+            StringBuilder line = new StringBuilder();
+            int c;
+            while ((c = in.read()) >= 0 && c != '\n') {
+                if (c != '\r') {
+                    line.append((char) c);
+                }
+            }
+            return line.toString();
+        }
+
+        synchronized int receivedCount() {
+            return received.cardinality();
+        }
+
+        void close() {
+            try {
+                socket.close();
+            } catch (IOException ex) {
+                // Nothing to do
+            }
+        }
+    }
+
+    /**
+     * Feeds a synthetic walk of fixes, with an event every eventEvery fixes,
+     * through an Uplink against a loopback stand-in backend that fails and
+     * drops requests. Reports whether every item arrived, how many arrived
+     * twice or out of order, and the requests and bytes against one JSON request per item.
+     * @param fixCount
+     * @param eventEvery
+     * @param batchEvents
+     * @param latencyMs
+     * @param failureRate
+     * @param dropRate
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject uplink(int fixCount, int eventEvery, int batchEvents, int latencyMs,
+                                    double failureRate, double dropRate) throws JSONException {
+        UplinkStandInServer server;
+        try {
+            server = new UplinkStandInServer(latencyMs, failureRate, dropRate);
+        } catch (IOException ex) {
+            throw new IllegalStateException(ex.getMessage());
+        }
+        new Thread(server, "IAUplinkStandIn").start();
+        File dir = new File(System.getProperty("java.io.tmpdir"), "ia-uplink-benchmark-" + System.nanoTime());
+        Uplink uplink;
+        try {
+            uplink = new Uplink(dir, Uplink.HTTP, TimingWheel.getShared());
+        } catch (IOException ex) {
+            server.close();
+            throw new IllegalStateException(ex.getMessage());
+        }
+        JSONObject options = new JSONObject();
+        options.put("url", server.url());
+        options.put("batchEvents", batchEvents);
+        options.put("intervalMs", 100);
+        options.put("backoffBaseMs", 20);
+        options.put("backoffMaxMs", 500);
+        uplink.configure(options);
+
+        Random random = new Random(42);
+        double latitude = 60.1699;
+        double longitude = 24.9384;
+        long timeMs = 1600000000000L;
+        int items = 0;
+        long jsonBytes = 0;
+        long start = System.nanoTime();
+        for (int i = 0; i < fixCount; i++) {
+            timeMs += 1000;
+            latitude += (random.nextDouble() - 0.5) * 2e-5;
+            longitude += (random.nextDouble() - 0.5) * 4e-5;
+            int floor = (i / 600) % 3;
+            float accuracy = 2 + random.nextFloat() * 4;
+            uplink.onFix(timeMs, latitude, longitude, floor, accuracy);
+            JSONObject fix = new JSONObject();
+            fix.put("type", "fix");
+            fix.put("t", timeMs);
+            fix.put("lat", latitude);
+            fix.put("lon", longitude);
+            fix.put("floor", floor);
+            fix.put("acc", accuracy);
+            jsonBytes += fix.toString().length();
+            items++;
+            if (eventEvery > 0 && i % eventEvery == 0) {
+                JSONObject event = new JSONObject();
+                event.put("type", "region");
+                event.put("regionId", "region-" + random.nextInt(20));
+                event.put("timestamp", timeMs);
+                event.put("regionType", IARegion.TYPE_FLOOR_PLAN);
+                event.put("transitionType", random.nextBoolean() ? 1 : 2);
+                uplink.onEvent(event);
+                jsonBytes += event.toString().length();
+                items++;
+            }
+        }
+        boolean completed = false;
+        long deadline = System.nanoTime() + TimeUnit.SECONDS.toNanos(TIMEOUT_SECONDS);
+        while (System.nanoTime() < deadline) {
+            if (uplink.getStats().getLong("pending") == 0) {
+                completed = true;
+                break;
+            }
+            try {
+                Thread.sleep(20);
+            } catch (InterruptedException ex) {
+                break;
+            }
+        }
+        long elapsed = System.nanoTime() - start;
+        uplink.disable();
+        JSONObject stats = uplink.getStats();
+        server.close();
+        File[] files = dir.listFiles();
+        for (int i = 0; files != null && i < files.length; i++) {
+            files[i].delete();
+        }
+        dir.delete();
+
+        JSONObject report = new JSONObject();
+        report.put("benchmark", "uplink");
+        report.put("items", items);
+        report.put("batchEvents", batchEvents);
+        report.put("failureRate", failureRate);
+        report.put("dropRate", dropRate);
+        report.put("completed", completed);
+        report.put("elapsedMs", elapsed / 1e6);
+        synchronized (server) {
+            report.put("received", server.receivedCount());
+            report.put("missing", items - server.receivedCount());
+            report.put("duplicates", server.duplicates);
+            report.put("decodeErrors", server.decodeErrors);
+            report.put("orderErrors", server.orderErrors);
+            report.put("serverRequests", server.requests);
+            report.put("injectedFailures", server.failures);
+            report.put("injectedDrops", server.drops);
+            report.put("requestReduction", server.requests > 0 ? (double) items / server.requests : 0);
+        }
+        long wireBytes = stats.getLong("wireBytes");
+        report.put("jsonBytes", jsonBytes);
+        report.put("wireBytes", wireBytes);
+        report.put("wireBytesPerItem", (double) wireBytes / items);
+        report.put("compressionRatio", wireBytes > 0 ? (double) jsonBytes / wireBytes : 0);
+        report.put("uplink", stats);
+        return report;
+    }
+
+    /**
+     * Checks CellId on random cells of a 200 m floor: ids round trip through
+     * their centre and token, children lie in their parent's id range,
+     * neighbours are mutual, and a covering contains the points inside its
+     * polygon. Reports the cost of an encode and the token of a fixed point,
+     * which must be the same on iOS.
+     * @param cellCount
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject cellId(int cellCount) throws JSONException {
+        int venueKey = CellId.venueKey("venue-1");
+        Random random = new Random(42);
+        boolean roundTripOk = true;
+        boolean tokenOk = true;
+        boolean hierarchyOk = true;
+        boolean neighboursOk = true;
+        for (int i = 0; i < cellCount; i++) {
+            double x = (random.nextDouble() - 0.5) * 200;
+            double y = (random.nextDouble() - 0.5) * 200;
+            int floor = random.nextInt(10) - 3;
+            int level = random.nextInt(CellId.MAX_LEVEL + 1);
+            long id = CellId.fromPoint(venueKey, floor, x, y, level);
+            double[] center = CellId.center(id);
+            roundTripOk &= CellId.isValid(id) && CellId.level(id) == level && CellId.floor(id) == floor
+                    && CellId.venue(id) == venueKey && CellId.fromPoint(venueKey, floor, center[0], center[1], level) == id;
+            tokenOk &= CellId.fromToken(CellId.toToken(id)) == id;
+            hierarchyOk &= CellId.contains(id, CellId.fromPoint(venueKey, floor, x, y, CellId.MAX_LEVEL));
+            if (level > 0) {
+                long parent = CellId.parent(id);
+                boolean isChild = false;
+                for (int k = 0; k < 4; k++) {
+                    isChild |= CellId.child(parent, k) == id;
+                }
+                hierarchyOk &= isChild && CellId.contains(parent, id)
+                        && CellId.rangeMin(parent) <= CellId.rangeMin(id) && CellId.rangeMax(id) <= CellId.rangeMax(parent);
+            }
+            for (long neighbour : CellId.neighbours(id)) {
+                boolean mutual = false;
+                for (long back : CellId.neighbours(neighbour)) {
+                    mutual |= back == id;
+                }
+                neighboursOk &= mutual && neighbour != id && CellId.level(neighbour) == level;
+            }
+        }
+
+        // A triangle covered down to 25 cm cells
+        double[] polygon = { -20, -10, 30, -10, -20, 25 };
+        long[] covering = CellId.cover(venueKey, 0, polygon, 14);
+        boolean coverOk = true;
+        for (int i = 0; i < cellCount; i++) {
+            double x = -20 + random.nextDouble() * 50;
+            double y = -10 + random.nextDouble() * 35;
+            if (!CellId.containsPoint(polygon, x, y)) {
+                continue;
+            }
+            long leaf = CellId.fromPoint(venueKey, 0, x, y, CellId.MAX_LEVEL);
+            boolean covered = false;
+            for (long cell : covering) {
+                covered |= CellId.contains(cell, leaf);
+            }
+            coverOk &= covered;
+        }
+
+        int encodes = Math.max(100000, cellCount);
+        long sink = 0;
+        long start = System.nanoTime();
+        for (int i = 0; i < encodes; i++) {
+            sink += CellId.fromPoint(venueKey, 1, (i % 1000) * 0.1, (i / 1000) * 0.1, CellId.MAX_LEVEL);
+        }
+        long elapsed = System.nanoTime() - start;
+        sSink = sink;
+
+        JSONObject report = new JSONObject();
+        report.put("benchmark", "cellId");
+        report.put("cells", cellCount);
+        report.put("roundTripOk", roundTripOk);
+        report.put("tokenOk", tokenOk);
+        report.put("hierarchyOk", hierarchyOk);
+        report.put("neighboursOk", neighboursOk);
+        report.put("coverOk", coverOk);
+        report.put("coverCells", covering.length);
+        report.put("fixedToken", CellId.toToken(CellId.fromPoint(venueKey, 2, 10.5, -3.25, CellId.MAX_LEVEL)));
+        report.put("nsPerEncode", (double) elapsed / encodes);
+        return report;
+    }
+
+    /**
+     * Fills and encodes routes through the RouteBuffer pool the way a binary
+     * getRoute does. The first route may grow a pooled buffer; after that the
+     * buffers must allocate nothing, so steadyAllocatedBytes is 0 and the only
+     * allocation per route is the encoded array handed to the bridge.
+     * @param legCount
+     * @param routes
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject routeBuffer(int legCount, int routes) throws JSONException {
+        VenueFrame frame = new VenueFrame(60.17, 24.94);
+        Random random = new Random(42);
+        double[] latitudes = new double[legCount + 1];
+        double[] longitudes = new double[legCount + 1];
+        for (int i = 0; i <= legCount; i++) {
+            latitudes[i] = 60.17 + random.nextDouble() * 0.001;
+            longitudes[i] = 24.94 + random.nextDouble() * 0.002;
+        }
+
+        long before = RouteBuffer.allocatedBytes();
+        long warmupBytes = 0;
+        long encodedBytes = 0;
+        long start = System.nanoTime();
+        for (int r = 0; r < routes; r++) {
+            RouteBuffer route = RouteBuffer.acquire();
+            try {
+                route.resize(legCount);
+                for (int i = 0; i < legCount; i++) {
+                    route.setLeg(i, latitudes[i], longitudes[i], 1, latitudes[i + 1], longitudes[i + 1], 1, i, 1.0, 0.0, frame);
+                }
+                encodedBytes += route.encode(frame).length;
+            } finally {
+                RouteBuffer.release(route);
+            }
+            if (r == 0) {
+                warmupBytes = RouteBuffer.allocatedBytes() - before;
+            }
+        }
+        long elapsed = System.nanoTime() - start;
+
+        JSONObject report = new JSONObject();
+        report.put("benchmark", "routeBuffer");
+        report.put("legs", legCount);
+        report.put("routes", routes);
+        report.put("warmupAllocatedBytes", warmupBytes);
+        report.put("steadyAllocatedBytes", RouteBuffer.allocatedBytes() - before - warmupBytes);
+        report.put("encodedBytesPerRoute", encodedBytes / routes);
+        report.put("nsPerRoute", (double) elapsed / routes);
+        return report;
+    }
+
+    /**
+     * Runs chains of a stalled fetch and two steps, shaped like
+     * computeRouteOnFloorPlan, and probes the scheduler lanes while the
+     * fetches are in flight. The fetches complete from the timing wheel after
+     * stallMs, so if no thread waits on them the probes run right away and
+     * every chain ends about stallMs after the start. The same chains with a
+     * first step that sleeps through the stall, as a blocking fetch would,
+     * are the baseline.
+     * @param chainCount
+     * @param stallMs
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject deferred(int chainCount, int stallMs) throws JSONException {
+        JSONObject deferred = deferredChains(chainCount, stallMs, false);
+        JSONObject blocking = deferredChains(chainCount, stallMs, true);
+        JSONObject report = new JSONObject();
+        report.put("benchmark", "deferred");
+        report.put("chains", chainCount);
+        report.put("stallMs", stallMs);
+        report.put("deferred", deferred);
+        report.put("blocking", blocking);
+        // Probes may queue behind a few short steps, never behind a stall
+        report.put("nonBlocking", deferred.getBoolean("completed") && deferred.getInt("failures") == 0
+                && deferred.getDouble("maxProbeLatencyMs") < stallMs / 2.0
+                && deferred.getDouble("elapsedMs") < 2.0 * stallMs);
+        return report;
+    }
+
+    private static JSONObject deferredChains(int chainCount, final int stallMs, boolean blocking) throws JSONException {
+        final CountDownLatch done = new CountDownLatch(chainCount);
+        final AtomicInteger failures = new AtomicInteger();
+        long start = System.nanoTime();
+        for (int i = 0; i < chainCount; i++) {
+            Deferred<Integer> fetch;
+            if (blocking) {
+                fetch = Deferred.resolved(i).then(TaskScheduler.LANE_INTERACTIVE, new Deferred.Step<Integer, Integer>() {
+                    @Override
+                    public Integer apply(Integer value) throws Exception {
+                        Thread.sleep(stallMs);
+                        return value;
+                    }
+                });
+            } else {
+                final Deferred<Integer> pending = new Deferred<Integer>(null);
+                final int value = i;
+                TimingWheel.getShared().schedule(stallMs, new Runnable() {
+                    @Override
+                    public void run() {
+                        pending.resolve(value);
+                    }
+                });
+                fetch = pending;
+            }
+            fetch.then(TaskScheduler.LANE_INTERACTIVE, new Deferred.Step<Integer, Integer>() {
+                @Override
+                public Integer apply(Integer value) {
+                    spinFor(TimeUnit.MILLISECONDS.toNanos(1));
+                    return value * 2;
+                }
+            }).then(TaskScheduler.LANE_BACKGROUND, new Deferred.Step<Integer, Integer>() {
+                @Override
+                public Integer apply(Integer value) {
+                    return value + 1;
+                }
+            }).whenComplete(new Deferred.Callback<Integer>() {
+                @Override
+                public void onSuccess(Integer value) {
+                    done.countDown();
+                }
+
+                @Override
+                public void onFailure(Exception error) {
+                    failures.incrementAndGet();
+                    done.countDown();
+                }
+            });
+        }
+
+        // Probe both lanes every 5 ms while the fetches are in flight
+        int probeCount = Math.max(1, stallMs / 5);
+        final CountDownLatch probed = new CountDownLatch(2 * probeCount);
+        final long[] probeLatencies = new long[2 * probeCount];
+        TaskScheduler scheduler = TaskScheduler.getShared();
+        for (int i = 0; i < probeCount; i++) {
+            for (int lane = 0; lane < 2; lane++) {
+                final int index = 2 * i + lane;
+                final long submitted = System.nanoTime();
+                scheduler.submit(lane == 0 ? TaskScheduler.LANE_INTERACTIVE : TaskScheduler.LANE_BACKGROUND, new Runnable() {
+                    @Override
+                    public void run() {
+                        probeLatencies[index] = System.nanoTime() - submitted;
+                        probed.countDown();
+                    }
+                });
+            }
+            try {
+                Thread.sleep(5);
+            } catch (InterruptedException ex) {
+                Thread.currentThread().interrupt();
+                break;
+            }
+        }
+        boolean completed;
+        try {
+            completed = done.await(TIMEOUT_SECONDS, TimeUnit.SECONDS);
+            completed = probed.await(TIMEOUT_SECONDS, TimeUnit.SECONDS) && completed;
+        } catch (InterruptedException ex) {
+            completed = false;
+        }
+        long elapsed = System.nanoTime() - start;
+
+        JSONObject result = new JSONObject();
+        result.put("name", blocking ? "blocking" : "deferred");
+        result.put("completed", completed);
+        result.put("failures", failures.get());
+        result.put("elapsedMs", elapsed / 1e6);
+        result.put("probes", probeLatencies.length);
+        if (completed) {
+            Arrays.sort(probeLatencies);
+            result.put("p50ProbeLatencyMs", percentile(probeLatencies, 0.50) / 1e6);
+            result.put("maxProbeLatencyMs", probeLatencies[probeLatencies.length - 1] / 1e6);
+        }
+        return result;
+    }
+
+    /**
+     * Appends events to an EventQueue over several segments, closes it and
+     * cuts tornBytes off the newest segment, as a process killed in the
+     * middle of a write would leave it. The reopened queue must drop only the
+     * torn record, replay every earlier event in order and give the next
+     * append the offset of the lost one.
+     * @param eventCount
+     * @param tornBytes
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject eventQueueRecovery(int eventCount, int tornBytes) throws JSONException {
+        File dir = new File(System.getProperty("java.io.tmpdir"), "ia-event-queue-benchmark-" + System.nanoTime());
+        JSONObject report = new JSONObject();
+        report.put("benchmark", "eventQueueRecovery");
+        report.put("events", eventCount);
+        report.put("tornBytes", tornBytes);
+        try {
+            EventQueue queue = new EventQueue(dir, EventQueue.DEFAULT_MAX_BYTES, 4096);
+            for (int i = 0; i < eventCount; i++) {
+                JSONObject event = new JSONObject();
+                event.put("type", "synthetic");
+                event.put("i", i);
+                queue.append(event);
+            }
+            report.put("segments", queue.getStats().getInt("segments"));
+            queue.close();
+
+            File newest = null;
+            File[] files = dir.listFiles();
+            for (int i = 0; files != null && i < files.length; i++) {
+                if (files[i].getName().endsWith(".log") && (newest == null || files[i].getName().compareTo(newest.getName()) > 0)) {
+                    newest = files[i];
+                }
+            }
+            if (newest == null) {
+                throw new IOException("No segment written");
+            }
+            RandomAccessFile file = new RandomAccessFile(newest, "rw");
+            try {
+                file.setLength(Math.max(0, file.length() - tornBytes));
+            } finally {
+                file.close();
+            }
+
+            long start = System.nanoTime();
+            EventQueue recovered = new EventQueue(dir, EventQueue.DEFAULT_MAX_BYTES, 4096);
+            long recoverNanos = System.nanoTime() - start;
+            int replayed = 0;
+            boolean orderOk = true;
+            while (true) {
+                JSONObject batch = recovered.read("recovery", EventQueue.DEFAULT_BATCH);
+                JSONArray events = batch.getJSONArray("events");
+                if (events.length() == 0) {
+                    break;
+                }
+                for (int i = 0; i < events.length(); i++) {
+                    JSONObject event = events.getJSONObject(i);
+                    orderOk = orderOk && event.getLong("offset") == replayed && event.getInt("i") == replayed;
+                    replayed++;
+                }
+                recovered.ack("recovery", batch.getLong("lastOffset"));
+            }
+            JSONObject stats = recovered.getStats();
+            JSONObject next = new JSONObject();
+            next.put("type", "synthetic");
+            next.put("i", replayed);
+            long nextOffset = recovered.append(next);
+            JSONArray tail = recovered.read("recovery", EventQueue.DEFAULT_BATCH).getJSONArray("events");
+            boolean appendOk = nextOffset == replayed && tail.length() == 1 && tail.getJSONObject(0).getInt("i") == replayed;
+            recovered.close();
+
+            report.put("replayed", replayed);
+            report.put("lost", eventCount - replayed);
+            report.put("truncatedBytes", stats.getLong("truncatedBytes"));
+            report.put("orderOk", orderOk);
+            report.put("appendAfterRecoveryOk", appendOk);
+            report.put("recoverMs", recoverNanos / 1e6);
+            report.put("recoveredOk", replayed == eventCount - 1 && orderOk && appendOk && stats.getLong("truncatedBytes") > 0);
+        } catch (IOException ex) {
+            report.put("error", ex.getMessage());
+            report.put("recoveredOk", false);
+        } finally {
+            File[] files = dir.listFiles();
+            for (int i = 0; files != null && i < files.length; i++) {
+                files[i].delete();
+            }
+            dir.delete();
+        }
+        return report;
+    }
+
+    /**
+     * One decoded section of a stream channel frame
+     */
+    private static final class StreamSection {
+        int frame;
+        int id;
+        int count;
+        int first;
+        int dropped;
+        double[] values;
+    }
+
+    /**
+     * Drives a private StreamChannel the way IndoorAtlas.js does and decodes
+     * its frames by the layout the JavaScript side reads. Checks that a full
+     * window holds frames back, that meanwhile a position stream keeps its
+     * newest QUEUE_CAPACITY samples and a sensor stream its latest, with the
+     * coalesced counts, that only an in-range ack releases frames, and that
+     * every delivered sample decodes to the values and sequence number it was
+     * offered with.
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject streamChannel() throws JSONException {
+        final ArrayList<byte[]> frames = new ArrayList<byte[]>();
+        StreamChannel channel = new StreamChannel();
+        channel.open(new StreamChannel.Sender() {
+            @Override
+            public void send(byte[] frame) {
+                frames.add(frame);
+            }
+        });
+        final int positionStream = 1;
+        final int headingStream = 2;
+        channel.addStream(positionStream, 3, false);
+        channel.addStream(headingStream, StreamChannel.HEADING_FIELDS, true);
+        int region = channel.intern("region-a");
+
+        // A frame per position until the window is full, then more than a queue holds
+        int extra = 10;
+        int headings = 10;
+        int offered = 0;
+        for (; offered < StreamChannel.WINDOW_FRAMES + StreamChannel.QUEUE_CAPACITY + extra; offered++) {
+            channel.offer(positionStream, new double[] {offered, region, offered * 0.5});
+        }
+        for (int i = 0; i < headings; i++) {
+            channel.offer(headingStream, new double[] {i * 10.0, i});
+        }
+        boolean windowOk = frames.size() == StreamChannel.WINDOW_FRAMES;
+        channel.acknowledge(StreamChannel.WINDOW_FRAMES + 1);
+        boolean futureAckIgnored = frames.size() == StreamChannel.WINDOW_FRAMES;
+        channel.acknowledge(StreamChannel.ACK_EVERY_FRAMES);
+        int released = frames.size() - StreamChannel.WINDOW_FRAMES;
+
+        // Fill the window again and hold one position back
+        int inFlight = frames.size() - StreamChannel.ACK_EVERY_FRAMES;
+        for (int i = 0; i < StreamChannel.WINDOW_FRAMES - inFlight + 1; i++, offered++) {
+            channel.offer(positionStream, new double[] {offered, region, offered * 0.5});
+        }
+        int full = frames.size();
+        channel.acknowledge(StreamChannel.ACK_EVERY_FRAMES - 1);
+        boolean staleAckIgnored = frames.size() == full;
+        channel.acknowledge(2 * StreamChannel.ACK_EVERY_FRAMES);
+        boolean heldBackSent = frames.size() == full + 1;
+        // With the window empty every sample goes out right away
+        channel.acknowledge(frames.size());
+        channel.offer(positionStream, new double[] {offered, region, offered * 0.5});
+        offered++;
+        boolean lowRateOk = frames.size() == full + 2;
+
+        // Decode as IndoorAtlas.js does
+        ArrayList<StreamSection> sections = new ArrayList<StreamSection>();
+        ArrayList<String> strings = new ArrayList<String>();
+        int stringsFrame = 0;
+        boolean decodeOk = true;
+        for (int f = 0; f < frames.size(); f++) {
+            ByteBuffer in = ByteBuffer.wrap(frames.get(f)).order(ByteOrder.LITTLE_ENDIAN);
+            int version = in.getShort() & 0xffff;
+            int sectionCount = in.getShort() & 0xffff;
+            int sequence = in.getInt();
+            decodeOk = decodeOk && version == StreamChannel.VERSION && sequence == f + 1;
+            for (int s = 0; s < sectionCount; s++) {
+                StreamSection section = new StreamSection();
+                section.frame = sequence;
+                section.id = in.getShort() & 0xffff;
+                int fields = in.getShort() & 0xffff;
+                section.count = in.getInt();
+                section.first = in.getInt();
+                section.dropped = in.getInt();
+                if (section.id == StreamChannel.STRINGS_STREAM) {
+                    stringsFrame = stringsFrame == 0 ? sequence : -1;
+                    for (int i = 0; i < section.count; i++) {
+                        int index = in.getInt();
+                        byte[] utf8 = new byte[in.getInt()];
+                        in.get(utf8);
+                        in.position((in.position() + 7) & ~7);
+                        decodeOk = decodeOk && index == strings.size();
+                        try {
+                            strings.add(new String(utf8, "UTF-8"));
+                        } catch (UnsupportedEncodingException ex) {
+                            decodeOk = false;
+                        }
+                    }
+                    continue;
+                }
+                section.values = new double[section.count * fields];
+                for (int i = 0; i < section.values.length; i++) {
+                    section.values[i] = in.getDouble();
+                }
+                sections.add(section);
+            }
+            decodeOk = decodeOk && !in.hasRemaining();
+        }
+
+        int delivered = 0;
+        int dropped = 0;
+        int nextSequence = 0;
+        boolean headingsCoalesced = false;
+        boolean positionsCoalesced = false;
+        for (StreamSection section : sections) {
+            if (section.id == headingStream) {
+                // The burst arrives with the first ack, as its latest sample
+                headingsCoalesced = section.frame == StreamChannel.WINDOW_FRAMES + 1 && section.count == 1
+                        && section.dropped == headings - 1 && section.values[1] == headings - 1;
+                continue;
+            }
+            decodeOk = decodeOk && section.id == positionStream && section.first == nextSequence + section.dropped;
+            for (int i = 0; i < section.count; i++) {
+                double expected = section.first + i;
+                int stringIndex = (int) section.values[3 * i + 1];
+                decodeOk = decodeOk && section.values[3 * i] == expected && section.values[3 * i + 2] == expected * 0.5
+                        && stringIndex < strings.size() && "region-a".equals(strings.get(stringIndex));
+            }
+            if (section.frame == StreamChannel.WINDOW_FRAMES + 1) {
+                positionsCoalesced = section.count == StreamChannel.QUEUE_CAPACITY && section.dropped == extra;
+            }
+            nextSequence = section.first + section.count;
+            delivered += section.count;
+            dropped += section.dropped;
+        }
+        // The string goes out once, with the first sample that refers to it
+        decodeOk = decodeOk && delivered + dropped == offered && stringsFrame == 1;
+        boolean coalescedOk = headingsCoalesced && positionsCoalesced;
+
+        JSONObject report = new JSONObject();
+        report.put("benchmark", "streamChannel");
+        report.put("frames", frames.size());
+        report.put("offered", offered);
+        report.put("delivered", delivered);
+        report.put("coalesced", dropped);
+        report.put("windowOk", windowOk);
+        report.put("futureAckIgnored", futureAckIgnored);
+        report.put("staleAckIgnored", staleAckIgnored);
+        report.put("releasedFrames", released);
+        report.put("heldBackSent", heldBackSent);
+        report.put("lowRateOk", lowRateOk);
+        report.put("coalescedOk", coalescedOk);
+        report.put("decodeOk", decodeOk);
+        report.put("ok", windowOk && futureAckIgnored && staleAckIgnored && released == 1 && heldBackSent
+                && lowRateOk && coalescedOk && decodeOk);
+        return report;
+    }
+
+    private static JSONObject measure(String name, int taskCount, final int work, Dispatcher dispatcher) throws JSONException {
+        final long[] latencies = new long[taskCount];
+        final CountDownLatch done = new CountDownLatch(taskCount);
+        long start = System.nanoTime();
+        for (int i = 0; i < taskCount; i++) {
+            final int index = i;
+            final long submitted = System.nanoTime();
+            dispatcher.dispatch(new Runnable() {
+                @Override
+                public void run() {
+                    latencies[index] = System.nanoTime() - submitted;
+                    spin(work);
+                    done.countDown();
+                }
+            });
+        }
+        boolean completed;
+        try {
+            completed = done.await(TIMEOUT_SECONDS, TimeUnit.SECONDS);
+        } catch (InterruptedException ex) {
+            completed = false;
+        }
+        long elapsed = System.nanoTime() - start;
+
+        JSONObject result = new JSONObject();
+        result.put("name", name);
+        result.put("completed", completed);
+        result.put("elapsedMs", elapsed / 1e6);
+        result.put("tasksPerSecond", taskCount / (elapsed / 1e9));
+        if (completed) {
+            Arrays.sort(latencies);
+            result.put("p50LatencyMs", percentile(latencies, 0.50) / 1e6);
+            result.put("p99LatencyMs", percentile(latencies, 0.99) / 1e6);
+            result.put("maxLatencyMs", latencies[latencies.length - 1] / 1e6);
+        }
+        return result;
+    }
+
+    private static long percentile(long[] sorted, double p) {
+        int index = (int) Math.ceil(p * sorted.length) - 1;
+        return sorted[Math.max(0, Math.min(sorted.length - 1, index))];
+    }
+
+    private static void spin(int iterations) {
+        long x = iterations;
+        for (int i = 0; i < iterations; i++) {
+            x = x * 6364136223846793005L + 1442695040888963407L;
+        }
+        sSink = x;
+    }
+
+    private static void spinFor(long nanos) {
+        long end = System.nanoTime() + nanos;
+        long x = 0;
+        while (System.nanoTime() < end) {
+            x = x * 6364136223846793005L + 1442695040888963407L;
+        }
+        sSink = x;
+    }
+}
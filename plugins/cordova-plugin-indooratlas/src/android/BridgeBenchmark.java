@@ -0,0 +1,318 @@
+package com.ialocation.plugin;
+
+import org.apache.cordova.CallbackContext;
+import org.apache.cordova.PluginResult;
+import org.json.JSONArray;
+import org.json.JSONException;
+import org.json.JSONObject;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.Random;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.locks.LockSupport;
+
+/**
+ * Native half of the bridge micro-benchmarks driven by
+ * IndoorAtlas.runBridgeBenchmark.
+ *
+ * Payloads are shaped like the plugin's real ones: a position, a 500 leg
+ * route and a crowd frame of 1000 peers, each as a JSON object, as the same
+ * JSON in a string and as a binary ArrayBuffer. Every payload carries the
+ * native time it was sent, in milliseconds since the epoch, so JavaScript can
+ * split round trips into legs and measure one-way latency: the "sentAt" key
+ * of the JSON forms and the first little-endian float64 of the binary one.
+ *
+ * Payload templates are built once per shape; sending one only stamps the
+ * time, as a real event would be serialized once per update.
+ */
+public final class BridgeBenchmark {
+    public static final String SHAPE_POSITION = "position";
+    public static final String SHAPE_ROUTE = "route";
+    public static final String SHAPE_CROWD = "crowd";
+    public static final String ENCODING_DICT = "dict";
+    public static final String ENCODING_STRING = "string";
+    public static final String ENCODING_BUFFER = "buffer";
+
+    public static final int ROUTE_LEGS = 500;
+    public static final int CROWD_PEERS = 1000;
+    public static final int MAX_RATE_HZ = 1000;
+    public static final int MAX_EVENTS = 100000;
+
+    private static final class Template {
+        JSONObject dict;
+        String json;
+        byte[] buffer;
+    }
+
+    private final Template[] mTemplates = new Template[3];
+    private volatile boolean mStopped;
+
+    /**
+     * Answers one round trip. Downstream the payload is the response; upstream
+     * JavaScript sent it as the argument and the response is a small object.
+     * @param shape
+     * @param encoding
+     * @param upload true if the payload came with the request
+     * @param callbackContext
+     */
+    public void echo(String shape, String encoding, boolean upload, CallbackContext callbackContext)
+            throws JSONException {
+        if (upload) {
+            JSONObject reply = new JSONObject();
+            reply.put("sentAt", (double) System.currentTimeMillis());
+            callbackContext.success(reply);
+            return;
+        }
+        callbackContext.sendPluginResult(result(template(shape), encoding, false));
+    }
+
+    /**
+     * Sends count payloads at rateHz from a pool thread, then a final
+     * { done, sent, late } object. Events due while the previous one was still
+     * being sent go out at once and are counted as late.
+     * @param shape
+     * @param encoding
+     * @param rateHz
+     * @param count
+     * @param pool
+     * @param callbackContext
+     */
+    public void stream(String shape, final String encoding, int rateHz, final int count, ExecutorService pool,
+                       final CallbackContext callbackContext) throws JSONException {
+        if (rateHz <= 0 || rateHz > MAX_RATE_HZ) {
+            throw new IllegalArgumentException("Rate must be 1.." + MAX_RATE_HZ + " Hz");
+        }
+        if (count <= 0 || count > MAX_EVENTS) {
+            throw new IllegalArgumentException("Count must be 1.." + MAX_EVENTS);
+        }
+        final Template template = template(shape);
+        encodingOf(encoding);
+        final long periodNanos = TimeUnit.SECONDS.toNanos(1) / rateHz;
+        mStopped = false;
+        pool.execute(new Runnable() {
+            @Override
+            public void run() {
+                long start = System.nanoTime();
+                int sent = 0;
+                int late = 0;
+                while (sent < count && !mStopped) {
+                    long due = start + sent * periodNanos;
+                    long wait = due - System.nanoTime();
+                    if (wait > 0) {
+                        LockSupport.parkNanos(wait);
+                    } else if (sent > 0 && -wait > periodNanos) {
+                        late++;
+                    }
+                    callbackContext.sendPluginResult(result(template, encoding, true));
+                    sent++;
+                }
+                try {
+                    JSONObject done = new JSONObject();
+                    done.put("done", true);
+                    done.put("sent", sent);
+                    done.put("late", late);
+                    done.put("durationMs", (System.nanoTime() - start) / 1e6);
+                    callbackContext.success(done);
+                } catch (JSONException e) {
+                    callbackContext.error(e.toString());
+                }
+            }
+        });
+    }
+
+    /**
+     * Ends a running stream after its current event
+     */
+    public void stop() {
+        mStopped = true;
+    }
+
+    private static int encodingOf(String encoding) {
+        if (ENCODING_DICT.equals(encoding)) {
+            return 0;
+        } else if (ENCODING_STRING.equals(encoding)) {
+            return 1;
+        } else if (ENCODING_BUFFER.equals(encoding)) {
+            return 2;
+        }
+        throw new IllegalArgumentException("Unknown encoding " + encoding);
+    }
+
+    private static PluginResult result(Template template, String encoding, boolean keepCallback) {
+        double now = System.currentTimeMillis();
+        PluginResult result;
+        switch (encodingOf(encoding)) {
+            case 0:
+                // PluginResult serializes the object right away, so it can be stamped in place
+                synchronized (template) {
+                    try {
+                        template.dict.put("sentAt", now);
+                    } catch (JSONException e) {
+                        throw new IllegalStateException(e);
+                    }
+                    result = new PluginResult(PluginResult.Status.OK, template.dict);
+                }
+                break;
+            case 1:
+                result = new PluginResult(PluginResult.Status.OK, "{\"sentAt\":" + now + "," + template.json.substring(1));
+                break;
+            default:
+                byte[] buffer = template.buffer.clone();
+                ByteBuffer.wrap(buffer).order(ByteOrder.LITTLE_ENDIAN).putDouble(0, now);
+                result = new PluginResult(PluginResult.Status.OK, buffer);
+                break;
+        }
+        result.setKeepCallback(keepCallback);
+        return result;
+    }
+
+    private synchronized Template template(String shape) throws JSONException {
+        int index;
+        if (SHAPE_POSITION.equals(shape)) {
+            index = 0;
+        } else if (SHAPE_ROUTE.equals(shape)) {
+            index = 1;
+        } else if (SHAPE_CROWD.equals(shape)) {
+            index = 2;
+        } else {
+            throw new IllegalArgumentException("Unknown shape " + shape);
+        }
+        if (mTemplates[index] == null) {
+            Template template = new Template();
+            Random random = new Random(index);
+            switch (index) {
+                case 0:
+                    buildPosition(template, random);
+                    break;
+                case 1:
+                    buildRoute(template, random);
+                    break;
+                default:
+                    buildCrowd(template, random);
+                    break;
+            }
+            template.json = template.dict.toString();
+            mTemplates[index] = template;
+        }
+        return mTemplates[index];
+    }
+
+    /**
+     * As the location listener sends it; binary: sentAt, latitude, longitude,
+     * altitude, accuracy, heading, velocity, timestamp as float64, floor as int32
+     */
+    private static void buildPosition(Template template, Random random) throws JSONException {
+        double latitude = 60.16 + random.nextDouble() * 1e-3;
+        double longitude = 24.93 + random.nextDouble() * 1e-3;
+        long timestamp = System.currentTimeMillis();
+        JSONObject region = new JSONObject();
+        region.put("regionId", "2a6ab3e0-8c4d-4b2b-9a4e-2f0b7a9d5c1e");
+        region.put("timestamp", timestamp);
+        region.put("regionType", 1);
+        region.put("transitionType", 0);
+        JSONObject dict = new JSONObject();
+        dict.put("accuracy", 3.2);
+        dict.put("altitude", 0.0);
+        dict.put("heading", 271.5);
+        dict.put("flr", 3);
+        dict.put("latitude", latitude);
+        dict.put("longitude", longitude);
+        dict.put("region", region);
+        dict.put("velocity", 1.1);
+        dict.put("timestamp", timestamp);
+        template.dict = dict;
+        ByteBuffer out = ByteBuffer.allocate(8 * 8 + 8).order(ByteOrder.LITTLE_ENDIAN);
+        out.putDouble(0).putDouble(latitude).putDouble(longitude).putDouble(0.0).putDouble(3.2)
+                .putDouble(271.5).putDouble(1.1).putDouble(timestamp).putInt(3);
+        template.buffer = out.array();
+    }
+
+    /**
+     * As computeRoute returns it; binary: sentAt followed by the
+     * RouteBuffer.encode layout
+     */
+    private static void buildRoute(Template template, Random random) throws JSONException {
+        JSONArray legs = new JSONArray();
+        int intBytes = ROUTE_LEGS * RouteBuffer.INT_STRIDE * 4;
+        int lengthsOffset = RouteBuffer.ENCODED_HEADER_BYTES + ((intBytes + 7) & ~7);
+        ByteBuffer out = ByteBuffer.allocate(8 + lengthsOffset + ROUTE_LEGS * 8).order(ByteOrder.LITTLE_ENDIAN);
+        VenueFrame frame = VenueFrame.forAnchor(60.16, 24.93);
+        out.putDouble(0);
+        out.putDouble(frame.getOriginLatitude());
+        out.putDouble(frame.getOriginLongitude());
+        out.putDouble(frame.getMillimetresPerDegreeLatitude());
+        out.putDouble(frame.getMillimetresPerDegreeLongitude());
+        out.putInt(ROUTE_LEGS);
+        out.putInt(RouteBuffer.ENCODED_VERSION);
+        double latitude = 60.165;
+        double longitude = 24.935;
+        double[] lengths = new double[ROUTE_LEGS];
+        for (int i = 0; i < ROUTE_LEGS; i++) {
+            double nextLatitude = latitude + (random.nextDouble() - 0.5) * 2e-5;
+            double nextLongitude = longitude + (random.nextDouble() - 0.5) * 4e-5;
+            int floor = 1 + i * 3 / ROUTE_LEGS;
+            JSONObject leg = new JSONObject();
+            leg.put("begin", routingPoint(latitude, longitude, floor));
+            leg.put("end", routingPoint(nextLatitude, nextLongitude, floor));
+            lengths[i] = 1 + random.nextDouble();
+            leg.put("length", lengths[i]);
+            leg.put("direction", random.nextDouble() * 360);
+            leg.put("edgeIndex", i);
+            legs.put(leg);
+            out.putInt(frame.east(latitude, longitude)).putInt(frame.north(latitude, longitude)).putInt(floor);
+            out.putInt(frame.east(nextLatitude, nextLongitude)).putInt(frame.north(nextLatitude, nextLongitude)).putInt(floor);
+            out.putInt(i);
+            latitude = nextLatitude;
+            longitude = nextLongitude;
+        }
+        out.position(8 + lengthsOffset);
+        for (double length : lengths) {
+            out.putDouble(length);
+        }
+        JSONObject dict = new JSONObject();
+        dict.put("route", legs);
+        template.dict = dict;
+        template.buffer = out.array();
+    }
+
+    private static JSONObject routingPoint(double latitude, double longitude, int floor) throws JSONException {
+        JSONObject point = new JSONObject();
+        point.put("latitude", latitude);
+        point.put("longitude", longitude);
+        point.put("floor", floor);
+        return point;
+    }
+
+    /**
+     * Positions of other devices in the venue; binary: sentAt, int32 peer
+     * count and padding, then per peer int32 id, int32 floor, float64
+     * latitude and longitude, float32 accuracy and padding
+     */
+    private static void buildCrowd(Template template, Random random) throws JSONException {
+        JSONArray peers = new JSONArray();
+        ByteBuffer out = ByteBuffer.allocate(16 + CROWD_PEERS * 32).order(ByteOrder.LITTLE_ENDIAN);
+        out.putDouble(0).putInt(CROWD_PEERS).putInt(0);
+        long timestamp = System.currentTimeMillis();
+        for (int i = 0; i < CROWD_PEERS; i++) {
+            double latitude = 60.16 + random.nextDouble() * 1e-3;
+            double longitude = 24.93 + random.nextDouble() * 2e-3;
+            int floor = random.nextInt(4);
+            float accuracy = 1 + random.nextFloat() * 9;
+            JSONObject peer = new JSONObject();
+            peer.put("id", "peer-" + i);
+            peer.put("latitude", latitude);
+            peer.put("longitude", longitude);
+            peer.put("floor", floor);
+            peer.put("accuracy", accuracy);
+            peer.put("timestamp", timestamp);
+            peers.put(peer);
+            out.putInt(i).putInt(floor).putDouble(latitude).putDouble(longitude).putFloat(accuracy).putInt(0);
+        }
+        JSONObject dict = new JSONObject();
+        dict.put("peers", peers);
+        template.dict = dict;
+        template.buffer = out.array();
+    }
+}
@@ -0,0 +1,181 @@
+package com.ialocation.plugin;
+
+import android.content.ComponentCallbacks2;
+import android.content.res.Configuration;
+import android.util.Log;
+
+import org.json.JSONArray;
+import org.json.JSONException;
+import org.json.JSONObject;
+
+import java.util.ArrayList;
+
+/**
+ * Central memory budget for the plugin's caches.
+ *
+ * Every cache registers with a priority tier and reports its resident size.
+ * When the total goes over the budget, or the system signals memory pressure
+ * through ComponentCallbacks2, caches are trimmed starting from the cheapest
+ * tier to rebuild. TIER_CRITICAL holds state needed by an ongoing session,
+ * e.g. wayfinding graphs referenced from JavaScript, and is never evicted.
+ */
+public final class CacheBudget implements ComponentCallbacks2 {
+    private static final String TAG = "CacheBudget";
+
+    public static final int TIER_CRITICAL = 0;
+    public static final int TIER_WARM = 1;
+    public static final int TIER_COLD = 2;
+
+    /**
+     * A cache whose memory is managed by the budget
+     */
+    public interface Cache {
+        String getName();
+
+        int getTier();
+
+        /**
+         * Estimated bytes held by the cache
+         */
+        long residentBytes();
+
+        /**
+         * Frees at least the given number of bytes if possible
+         * @param bytes
+         * @return bytes actually freed
+         */
+        long trim(long bytes);
+    }
+
+    private final ArrayList<Cache> mCaches = new ArrayList<Cache>();
+    private long mBudgetBytes;
+    private long mEvictedBytes;
+    private int mPressureEvents;
+
+    /**
+     * The constructor
+     * @param budgetBytes
+     */
+    public CacheBudget(long budgetBytes) {
+        mBudgetBytes = budgetBytes;
+    }
+
+    /**
+     * Budget for a device with the given per-app memory class in megabytes
+     * @param memoryClassMegabytes
+     * @return
+     */
+    public static long defaultBudget(int memoryClassMegabytes) {
+        return memoryClassMegabytes * 1024L * 1024L / 16;
+    }
+
+    public synchronized void register(Cache cache) {
+        mCaches.add(cache);
+    }
+
+    public synchronized void unregister(Cache cache) {
+        mCaches.remove(cache);
+    }
+
+    public synchronized void setBudget(long budgetBytes) {
+        mBudgetBytes = budgetBytes;
+        enforce();
+    }
+
+    public synchronized long residentBytes() {
+        long total = 0;
+        for (Cache cache : mCaches) {
+            total += cache.residentBytes();
+        }
+        return total;
+    }
+
+    /**
+     * Trims caches until the total fits in the budget. Caches call this after inserting.
+     */
+    public synchronized void enforce() {
+        long excess = residentBytes() - mBudgetBytes;
+        if (excess > 0) {
+            evict(excess, TIER_WARM);
+        }
+    }
+
+    /**
+     * Reacts to a memory pressure level, as in ComponentCallbacks2.onTrimMemory
+     * @param level
+     */
+    public synchronized void onPressure(int level) {
+        mPressureEvents++;
+        // The levels are not ordered by severity: UI_HIDDEN and the background
+        // levels between RUNNING_CRITICAL and COMPLETE are milder than either
+        if (level == TRIM_MEMORY_RUNNING_CRITICAL || level >= TRIM_MEMORY_COMPLETE) {
+            // Keep only session state
+            evict(Long.MAX_VALUE, TIER_WARM);
+        } else if (level == TRIM_MEMORY_UI_HIDDEN) {
+            evict(Long.MAX_VALUE, TIER_COLD);
+        } else if (level >= TRIM_MEMORY_RUNNING_LOW) {
+            evict(Long.MAX_VALUE, TIER_COLD);
+            evict(residentBytes() / 2, TIER_WARM);
+        } else if (level >= TRIM_MEMORY_RUNNING_MODERATE) {
+            evict(Long.MAX_VALUE, TIER_COLD);
+        }
+    }
+
+    /**
+     * Resident bytes per cache and totals, for getCacheReport
+     * @return
+     * @throws JSONException
+     */
+    public synchronized JSONObject getReport() throws JSONException {
+        JSONArray caches = new JSONArray();
+        for (Cache cache : mCaches) {
+            JSONObject entry = new JSONObject();
+            entry.put("name", cache.getName());
+            entry.put("tier", cache.getTier());
+            entry.put("residentBytes", cache.residentBytes());
+            caches.put(entry);
+        }
+        JSONObject report = new JSONObject();
+        report.put("budgetBytes", mBudgetBytes);
+        report.put("residentBytes", residentBytes());
+        report.put("evictedBytes", mEvictedBytes);
+        report.put("pressureEvents", mPressureEvents);
+        report.put("caches", caches);
+        return report;
+    }
+
+    /**
+     * Frees up to the given number of bytes from caches at minTier or colder,
+     * coldest tier first
+     */
+    private void evict(long bytes, int minTier) {
+        long remaining = bytes;
+        for (int tier = TIER_COLD; tier >= minTier && remaining > 0; tier--) {
+            for (Cache cache : mCaches) {
+                if (cache.getTier() != tier || remaining <= 0) {
+                    continue;
+                }
+                long freed = cache.trim(remaining);
+                mEvictedBytes += freed;
+                remaining -= freed;
+            }
+        }
+        if (remaining < bytes) {
+            Log.d(TAG, "Evicted " + (bytes == Long.MAX_VALUE ? "all" : String.valueOf(bytes - remaining)) + " bytes down to tier " + minTier);
+        }
+    }
+
+    @Override
+    public void onTrimMemory(int level) {
+        onPressure(level);
+    }
+
+    @Override
+    public void onLowMemory() {
+        onPressure(TRIM_MEMORY_COMPLETE);
+    }
+
+    @Override
+    public void onConfigurationChanged(Configuration configuration) {
+    }
+}
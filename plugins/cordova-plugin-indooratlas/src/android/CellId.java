@@ -0,0 +1,464 @@
+package com.ialocation.plugin;
+
+import android.graphics.PointF;
+
+import com.indooratlas.android.sdk.resources.IAFloorPlan;
+import com.indooratlas.android.sdk.resources.IALatLng;
+
+import java.util.ArrayList;
+
+/**
+ * 64-bit hierarchical cell id shared by every layer that buckets positions
+ * (presence, heatmaps, geofence grids, proximity joins).
+ *
+ * Layout, most significant bit first:
+ *   16 bits  venue key (see venueKey)
+ *    8 bits  floor level, biased by 128
+ *   40 bits  quadtree position: Morton code of the cell, a terminating 1 bit
+ *            and zero padding, so all descendants of a cell form one
+ *            contiguous id range (see rangeMin / rangeMax)
+ *
+ * The quadtree spans a square floor-local metric frame of ROOT_EXTENT_METERS
+ * centred on the frame origin; level MAX_LEVEL cells are 7.8 mm wide. The frame
+ * can be floor-local metres or a VenueFrame in millimetres (see fromLocal).
+ * The same layout is implemented by IndoorCellId on iOS, so ids and tokens can be
+ * exchanged between platforms and with the backend.
+ */
+public final class CellId {
+    public static final int MAX_LEVEL = 19;
+    public static final double ROOT_EXTENT_METERS = 4096.0;
+    public static final long NONE = 0L;
+
+    private static final int POS_BITS = 40;
+    private static final int FLOOR_SHIFT = POS_BITS;
+    private static final int VENUE_SHIFT = POS_BITS + 8;
+    private static final long POS_MASK = (1L << POS_BITS) - 1;
+    private static final int FLOOR_BIAS = 128;
+    private static final int MAX_COORD = (1 << MAX_LEVEL) - 1;
+    private static final double HALF_EXTENT = ROOT_EXTENT_METERS / 2.0;
+    private static final long HALF_EXTENT_MM = 2048000L;
+
+    private static final int OUTSIDE = 0;
+    private static final int PARTIAL = 1;
+    private static final int INSIDE = 2;
+
+    private CellId() {
+    }
+
+    /**
+     * Returns a stable 16-bit key for a venue id (FNV-1a over UTF-8, folded)
+     * @param venueId
+     * @return
+     */
+    public static int venueKey(String venueId) {
+        if (venueId == null) {
+            return 0;
+        }
+        int hash = 0x811c9dc5;
+        byte[] bytes;
+        try {
+            bytes = venueId.getBytes("UTF-8");
+        } catch (java.io.UnsupportedEncodingException ex) {
+            throw new IllegalStateException(ex.getMessage());
+        }
+        for (byte b : bytes) {
+            hash ^= (b & 0xff);
+            hash *= 0x01000193;
+        }
+        return ((hash >>> 16) ^ hash) & 0xffff;
+    }
+
+    /**
+     * Returns the id of the cell at the given level that contains (x, y)
+     * @param venueKey
+     * @param floor
+     * @param x metres east of the frame origin
+     * @param y metres north of the frame origin
+     * @param level
+     * @return
+     */
+    public static long fromPoint(int venueKey, int floor, double x, double y, int level) {
+        int ix = toLeafCoordinate(x);
+        int iy = toLeafCoordinate(y);
+        return fromLeafCoordinates(venueKey, floor, ix, iy, level);
+    }
+
+    /**
+     * Integer variant of fromPoint for points already in a VenueFrame
+     * @param venueKey
+     * @param floor
+     * @param east millimetres east of the frame origin
+     * @param north millimetres north of the frame origin
+     * @param level
+     * @return
+     */
+    public static long fromLocal(int venueKey, int floor, int east, int north, int level) {
+        return fromLeafCoordinates(venueKey, floor, toLeafCoordinate(east), toLeafCoordinate(north), level);
+    }
+
+    /**
+     * Returns the id of the cell containing the given coordinate, using the floor
+     * plan's top-left corner as the origin of the floor-local frame.
+     * @param venueKey
+     * @param floorPlan
+     * @param coords
+     * @param level
+     * @return
+     */
+    public static long fromFloorPlan(int venueKey, IAFloorPlan floorPlan, IALatLng coords, int level) {
+        PointF point = floorPlan.coordinateToPoint(coords);
+        double metersPerPixel = floorPlan.getPixelsToMeters();
+        // Image y grows downwards, the frame's y grows northwards
+        return fromPoint(venueKey, floorPlan.getFloorLevel(),
+                point.x * metersPerPixel, -point.y * metersPerPixel, level);
+    }
+
+    private static long fromLeafCoordinates(int venueKey, int floor, int ix, int iy, int level) {
+        checkLevel(level);
+        int shift = MAX_LEVEL - level;
+        long morton = interleave(ix >>> shift, iy >>> shift);
+        long pos = ((morton << 1) | 1L) << (2 * shift);
+        return header(venueKey, floor) | pos;
+    }
+
+    private static long header(int venueKey, int floor) {
+        int biased = Math.max(0, Math.min(255, floor + FLOOR_BIAS));
+        return ((long) (venueKey & 0xffff) << VENUE_SHIFT) | ((long) biased << FLOOR_SHIFT);
+    }
+
+    public static int venue(long id) {
+        return (int) (id >>> VENUE_SHIFT) & 0xffff;
+    }
+
+    public static int floor(long id) {
+        return ((int) (id >>> FLOOR_SHIFT) & 0xff) - FLOOR_BIAS;
+    }
+
+    public static int level(long id) {
+        long pos = id & POS_MASK;
+        return MAX_LEVEL - (Long.numberOfTrailingZeros(pos) >> 1);
+    }
+
+    public static boolean isValid(long id) {
+        long pos = id & POS_MASK;
+        return pos != 0 && (Long.numberOfTrailingZeros(pos) & 1) == 0
+                && (pos >>> (2 * MAX_LEVEL + 1)) == 0;
+    }
+
+    /**
+     * Size of the cell edge in metres at the given level
+     * @param level
+     * @return
+     */
+    public static double sizeMeters(int level) {
+        return ROOT_EXTENT_METERS / (1 << level);
+    }
+
+    /**
+     * Returns {minX, minY, maxX, maxY} of the cell in frame metres
+     * @param id
+     * @return
+     */
+    public static double[] bounds(long id) {
+        int level = level(id);
+        int[] ij = cellCoordinates(id);
+        double size = sizeMeters(level);
+        double minX = ij[0] * size - HALF_EXTENT;
+        double minY = ij[1] * size - HALF_EXTENT;
+        return new double[] { minX, minY, minX + size, minY + size };
+    }
+
+    /**
+     * Returns {x, y} of the cell centre in frame metres
+     * @param id
+     * @return
+     */
+    public static double[] center(long id) {
+        double[] b = bounds(id);
+        return new double[] { (b[0] + b[2]) / 2.0, (b[1] + b[3]) / 2.0 };
+    }
+
+    public static long parent(long id) {
+        return parent(id, level(id) - 1);
+    }
+
+    public static long parent(long id, int level) {
+        checkLevel(level);
+        if (level > level(id)) {
+            throw new IllegalArgumentException("Parent level below cell level");
+        }
+        long lsb = 1L << (2 * (MAX_LEVEL - level));
+        long pos = ((id & POS_MASK) & -lsb) | lsb;
+        return (id & ~POS_MASK) | pos;
+    }
+
+    /**
+     * Returns the k:th child (0..3, Morton order) of the cell
+     * @param id
+     * @param k
+     * @return
+     */
+    public static long child(long id, int k) {
+        int level = level(id);
+        if (level >= MAX_LEVEL) {
+            throw new IllegalArgumentException("Leaf cell has no children");
+        }
+        long lsb = (id & POS_MASK) & -(id & POS_MASK);
+        long childLsb = lsb >>> 2;
+        long pos = (id & POS_MASK) - lsb + (2L * k + 1) * childLsb;
+        return (id & ~POS_MASK) | pos;
+    }
+
+    /**
+     * Smallest leaf id contained by the cell; descendants lie in [rangeMin, rangeMax]
+     * @param id
+     * @return
+     */
+    public static long rangeMin(long id) {
+        long lsb = (id & POS_MASK) & -(id & POS_MASK);
+        return id - (lsb - 1);
+    }
+
+    public static long rangeMax(long id) {
+        long lsb = (id & POS_MASK) & -(id & POS_MASK);
+        return id + (lsb - 1);
+    }
+
+    public static boolean contains(long id, long other) {
+        return other >= rangeMin(id) && other <= rangeMax(id);
+    }
+
+    /**
+     * Returns the up to eight same-level neighbours (edges and corners) that lie
+     * inside the frame.
+     * @param id
+     * @return
+     */
+    public static long[] neighbours(long id) {
+        int level = level(id);
+        int[] ij = cellCoordinates(id);
+        int limit = (1 << level) - 1;
+        long[] result = new long[8];
+        int n = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                if (dx == 0 && dy == 0) {
+                    continue;
+                }
+                int i = ij[0] + dx;
+                int j = ij[1] + dy;
+                if (i < 0 || j < 0 || i > limit || j > limit) {
+                    continue;
+                }
+                int shift = MAX_LEVEL - level;
+                result[n++] = fromLeafCoordinates(venue(id), floor(id), i << shift, j << shift, level);
+            }
+        }
+        if (n == result.length) {
+            return result;
+        }
+        long[] trimmed = new long[n];
+        System.arraycopy(result, 0, trimmed, 0, n);
+        return trimmed;
+    }
+
+    /**
+     * Covers a polygon with cells no finer than maxLevel. Cells fully inside the
+     * polygon are emitted as large as possible, boundary cells at maxLevel, so the
+     * covering always contains the polygon.
+     * @param venueKey
+     * @param floor
+     * @param polygon x0, y0, x1, y1, ... in frame metres
+     * @param maxLevel
+     * @return
+     */
+    public static long[] cover(int venueKey, int floor, double[] polygon, int maxLevel) {
+        checkLevel(maxLevel);
+        if (polygon == null || polygon.length < 6 || (polygon.length & 1) != 0) {
+            throw new IllegalArgumentException("Polygon needs at least three vertices");
+        }
+        ArrayList<Long> cells = new ArrayList<Long>();
+        long root = fromLeafCoordinates(venueKey, floor, 0, 0, 0);
+        coverCell(root, polygon, maxLevel, cells);
+        long[] result = new long[cells.size()];
+        for (int i = 0; i < result.length; i++) {
+            result[i] = cells.get(i);
+        }
+        return result;
+    }
+
+    private static void coverCell(long id, double[] polygon, int maxLevel, ArrayList<Long> out) {
+        int relation = relate(bounds(id), polygon);
+        if (relation == OUTSIDE) {
+            return;
+        }
+        if (relation == INSIDE || level(id) == maxLevel) {
+            out.add(id);
+            return;
+        }
+        for (int k = 0; k < 4; k++) {
+            coverCell(child(id, k), polygon, maxLevel, out);
+        }
+    }
+
+    /**
+     * Hex token used for JSON and other wire formats where 64-bit integers do not survive
+     * @param id
+     * @return
+     */
+    public static String toToken(long id) {
+        String hex = Long.toHexString(id);
+        StringBuilder token = new StringBuilder(16);
+        for (int i = hex.length(); i < 16; i++) {
+            token.append('0');
+        }
+        token.append(hex);
+        int len = token.length();
+        while (len > 1 && token.charAt(len - 1) == '0') {
+            len--;
+        }
+        token.setLength(len);
+        return token.toString();
+    }
+
+    public static long fromToken(String token) {
+        if (token == null || token.isEmpty() || token.length() > 16) {
+            return NONE;
+        }
+        StringBuilder padded = new StringBuilder(token);
+        while (padded.length() < 16) {
+            padded.append('0');
+        }
+        try {
+            long high = Long.parseLong(padded.substring(0, 8), 16);
+            long low = Long.parseLong(padded.substring(8), 16);
+            return (high << 32) | low;
+        } catch (NumberFormatException ex) {
+            return NONE;
+        }
+    }
+
+    private static int[] cellCoordinates(long id) {
+        int level = level(id);
+        long pos = id & POS_MASK;
+        long morton = pos >>> (2 * (MAX_LEVEL - level) + 1);
+        return new int[] { deinterleave(morton), deinterleave(morton >>> 1) };
+    }
+
+    private static int toLeafCoordinate(double meters) {
+        double scaled = (meters + HALF_EXTENT) * ((1 << MAX_LEVEL) / ROOT_EXTENT_METERS);
+        if (scaled <= 0) {
+            return 0;
+        }
+        if (scaled >= MAX_COORD) {
+            return MAX_COORD;
+        }
+        return (int) scaled;
+    }
+
+    private static int toLeafCoordinate(int millimetres) {
+        // 2^MAX_LEVEL leaf cells over ROOT_EXTENT_METERS: 16 / 125 leaves per mm
+        long scaled = ((long) millimetres + HALF_EXTENT_MM) * 16L / 125L;
+        if (scaled <= 0) {
+            return 0;
+        }
+        if (scaled >= MAX_COORD) {
+            return MAX_COORD;
+        }
+        return (int) scaled;
+    }
+
+    private static void checkLevel(int level) {
+        if (level < 0 || level > MAX_LEVEL) {
+            throw new IllegalArgumentException("Cell level out of range: " + level);
+        }
+    }
+
+    private static long spread(int v) {
+        long x = v & 0xffffffffL;
+        x = (x | (x << 16)) & 0x0000ffff0000ffffL;
+        x = (x | (x << 8)) & 0x00ff00ff00ff00ffL;
+        x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fL;
+        x = (x | (x << 2)) & 0x3333333333333333L;
+        x = (x | (x << 1)) & 0x5555555555555555L;
+        return x;
+    }
+
+    private static long interleave(int x, int y) {
+        return spread(x) | (spread(y) << 1);
+    }
+
+    private static int deinterleave(long v) {
+        long x = v & 0x5555555555555555L;
+        x = (x | (x >>> 1)) & 0x3333333333333333L;
+        x = (x | (x >>> 2)) & 0x0f0f0f0f0f0f0f0fL;
+        x = (x | (x >>> 4)) & 0x00ff00ff00ff00ffL;
+        x = (x | (x >>> 8)) & 0x0000ffff0000ffffL;
+        x = (x | (x >>> 16)) & 0x00000000ffffffffL;
+        return (int) x;
+    }
+
+    /**
+     * Classifies a cell rectangle against a polygon
+     */
+    private static int relate(double[] rect, double[] polygon) {
+        int n = polygon.length / 2;
+        for (int i = 0, j = n - 1; i < n; j = i++) {
+            if (segmentIntersectsRect(polygon[2 * j], polygon[2 * j + 1],
+                    polygon[2 * i], polygon[2 * i + 1], rect)) {
+                return PARTIAL;
+            }
+        }
+        double cx = (rect[0] + rect[2]) / 2.0;
+        double cy = (rect[1] + rect[3]) / 2.0;
+        return containsPoint(polygon, cx, cy) ? INSIDE : OUTSIDE;
+    }
+
+    /**
+     * Even-odd point in polygon test
+     * @param polygon x0, y0, x1, y1, ...
+     * @param x
+     * @param y
+     * @return
+     */
+    public static boolean containsPoint(double[] polygon, double x, double y) {
+        boolean inside = false;
+        int n = polygon.length / 2;
+        for (int i = 0, j = n - 1; i < n; j = i++) {
+            double xi = polygon[2 * i], yi = polygon[2 * i + 1];
+            double xj = polygon[2 * j], yj = polygon[2 * j + 1];
+            if (((yi > y) != (yj > y)) && (x < (xj - xi) * (y - yi) / (yj - yi) + xi)) {
+                inside = !inside;
+            }
+        }
+        return inside;
+    }
+
+    /**
+     * Liang-Barsky clip of a segment against an axis aligned rectangle
+     */
+    private static boolean segmentIntersectsRect(double x0, double y0, double x1, double y1, double[] rect) {
+        double dx = x1 - x0;
+        double dy = y1 - y0;
+        double[] p = { -dx, dx, -dy, dy };
+        double[] q = { x0 - rect[0], rect[2] - x0, y0 - rect[1], rect[3] - y0 };
+        double t0 = 0.0, t1 = 1.0;
+        for (int k = 0; k < 4; k++) {
+            if (p[k] == 0) {
+                if (q[k] < 0) {
+                    return false;
+                }
+            } else {
+                double t = q[k] / p[k];
+                if (p[k] < 0) {
+                    if (t > t1) return false;
+                    if (t > t0) t0 = t;
+                } else {
+                    if (t < t0) return false;
+                    if (t < t1) t1 = t;
+                }
+            }
+        }
+        return true;
+    }
+}
@@ -0,0 +1,128 @@
+package com.ialocation.plugin;
+
+import android.os.Build;
+import android.os.Handler;
+import android.os.HandlerThread;
+import android.os.Looper;
+import android.os.Process;
+
+import java.util.HashMap;
+
+/**
+ * Serial queues on which plugin commands run, one per subsystem, so that
+ * neither the WebView thread nor the UI thread waits on plugin work.
+ *
+ * Each queue is a HandlerThread. Its Looper also receives the SDK callbacks
+ * of that subsystem, so a subsystem's state is confined to one thread and
+ * needs no locking. Commands of a subsystem run in the order they were sent.
+ * Actions not listed here are cheap and run on the calling thread.
+ */
+public final class CommandQueues {
+    public static final int NONE = -1;
+    public static final int POSITIONING = 0;
+    public static final int RESOURCES = 1;
+    public static final int ROUTING = 2;
+    public static final int GEOFENCE = 3;
+
+    private static final String[] NAMES = {"IAPositioning", "IAResources", "IARouting", "IAGeofence"};
+    private static final HashMap<String, Integer> ACTIONS = new HashMap<String, Integer>();
+
+    static {
+        String[] positioning = {"initializeIndoorAtlas", "addWatch", "clearWatch", "getLocation", "setPosition",
+                "setDistanceFilter", "getTraceId", "getFloorCertainty", "addAttitudeCallback",
+                "removeAttitudeCallback", "addHeadingCallback", "removeHeadingCallback", "setSensitivities",
+                "addStatusChangedCallback", "removeStatusCallback", "addFloorCallback", "removeFloorCallback"};
+        for (String action : positioning) {
+            ACTIONS.put(action, POSITIONING);
+        }
+        ACTIONS.put("fetchFloorplan", RESOURCES);
+        ACTIONS.put("fetchFloorPlans", RESOURCES);
+        ACTIONS.put("coordinateToPoint", RESOURCES);
+        ACTIONS.put("pointToCoordinate", RESOURCES);
+        ACTIONS.put("fetchEvents", RESOURCES);
+        ACTIONS.put("ackEvents", RESOURCES);
+        ACTIONS.put("getHistory", RESOURCES);
+        ACTIONS.put("clearHistory", RESOURCES);
+        ACTIONS.put("configureUplink", RESOURCES);
+        ACTIONS.put("clearUplink", RESOURCES);
+        ACTIONS.put("buildWayfinder", ROUTING);
+        ACTIONS.put("computeRoute", ROUTING);
+        ACTIONS.put("computeRouteOnFloorPlan", ROUTING);
+        ACTIONS.put("buildExitField", ROUTING);
+        ACTIONS.put("closeExit", ROUTING);
+        ACTIONS.put("openExit", ROUTING);
+        ACTIONS.put("applyExitDelta", ROUTING);
+        ACTIONS.put("configureBackground", POSITIONING);
+        ACTIONS.put("clearBackground", POSITIONING);
+        ACTIONS.put("addRegionWatch", GEOFENCE);
+        ACTIONS.put("clearRegionWatch", GEOFENCE);
+    }
+
+    private final HandlerThread[] mThreads = new HandlerThread[NAMES.length];
+    private final Handler[] mHandlers = new Handler[NAMES.length];
+
+    /**
+     * Starts one thread per queue
+     */
+    public CommandQueues() {
+        for (int i = 0; i < NAMES.length; i++) {
+            mThreads[i] = new HandlerThread(NAMES[i], Process.THREAD_PRIORITY_DEFAULT);
+            mThreads[i].start();
+            mHandlers[i] = new Handler(mThreads[i].getLooper());
+        }
+    }
+
+    /**
+     * Queue that runs the given plugin action
+     * @param action
+     * @return one of the queue constants, NONE for actions run inline
+     */
+    public static int queueFor(String action) {
+        Integer queue = ACTIONS.get(action);
+        return queue != null ? queue : NONE;
+    }
+
+    public Looper getLooper(int queue) {
+        return mThreads[queue].getLooper();
+    }
+
+    /**
+     * Returns true on the thread of the given queue
+     * @param queue
+     * @return
+     */
+    public boolean isCurrent(int queue) {
+        return Looper.myLooper() == mThreads[queue].getLooper();
+    }
+
+    public void post(int queue, Runnable runnable) {
+        mHandlers[queue].post(runnable);
+    }
+
+    /**
+     * Runs the task right away when called on the queue's thread, like
+     * Activity.runOnUiThread, and posts it otherwise
+     * @param queue
+     * @param runnable
+     */
+    public void run(int queue, Runnable runnable) {
+        if (isCurrent(queue)) {
+            runnable.run();
+        } else {
+            mHandlers[queue].post(runnable);
+        }
+    }
+
+    /**
+     * Stops the threads once the commands already queued have run
+     */
+    public void quit() {
+        for (HandlerThread thread : mThreads) {
+            if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.JELLY_BEAN_MR2) {
+                thread.quitSafely();
+            } else {
+                thread.quit();
+            }
+        }
+    }
+}
@@ -0,0 +1,211 @@
+package com.ialocation.plugin;
+
+import android.os.Debug;
+import android.os.Process;
+
+import org.json.JSONException;
+import org.json.JSONObject;
+
+import java.util.Map;
+import java.util.concurrent.ConcurrentHashMap;
+import java.util.concurrent.atomic.AtomicLong;
+
+/**
+ * Attributes thread CPU time, wall time and wakeups to the subsystem and
+ * feature that used them, so that battery drain can be traced to positioning,
+ * bridging, sensor streaming, routing, and so on.
+ *
+ * Code to account is bracketed by enter() and exit(subsystem, feature) on the
+ * same thread. Attribution is exclusive: time spent in a nested bracket is
+ * charged to the inner pair only. An outermost bracket counts as a wakeup of
+ * its subsystem, since the thread was woken up to run it. Subsystem and
+ * feature names should be constants, as they are looked up on every exit.
+ */
+public final class CostAccounting {
+    public static final String POSITIONING = "positioning";
+    public static final String BRIDGE = "bridge";
+    public static final String SENSORS = "sensors";
+    public static final String ROUTING = "routing";
+    public static final String TIMERS = "timers";
+    public static final String SCHEDULER = "scheduler";
+    public static final String STORAGE = "storage";
+    public static final String NETWORK = "network";
+
+    private static final int MAX_DEPTH = 16;
+
+    private static final ConcurrentHashMap<String, ConcurrentHashMap<String, Account>> sSubsystems =
+            new ConcurrentHashMap<String, ConcurrentHashMap<String, Account>>();
+    private static volatile long sResetWallMs = System.currentTimeMillis();
+    private static volatile long sResetProcessCpuMs = Process.getElapsedCpuTime();
+
+    private static final ThreadLocal<Frames> sFrames = new ThreadLocal<Frames>() {
+        @Override
+        protected Frames initialValue() {
+            return new Frames();
+        }
+    };
+
+    /**
+     * Open brackets of one thread
+     */
+    private static final class Frames {
+        final long[] cpuStart = new long[MAX_DEPTH];
+        final long[] wallStart = new long[MAX_DEPTH];
+        final long[] childCpu = new long[MAX_DEPTH];
+        final long[] childWall = new long[MAX_DEPTH];
+        int depth;
+    }
+
+    private static final class Account {
+        final AtomicLong cpuNanos = new AtomicLong();
+        final AtomicLong wallNanos = new AtomicLong();
+        final AtomicLong calls = new AtomicLong();
+        final AtomicLong wakeups = new AtomicLong();
+    }
+
+    private CostAccounting() {
+    }
+
+    /**
+     * CPU time of the calling thread, 0 where the platform does not report it
+     * @return
+     */
+    public static long threadCpuNanos() {
+        long nanos = Debug.threadCpuTimeNanos();
+        return nanos < 0 ? 0 : nanos;
+    }
+
+    /**
+     * Opens a bracket on the calling thread
+     */
+    public static void enter() {
+        Frames frames = sFrames.get();
+        int depth = frames.depth++;
+        if (depth < MAX_DEPTH) {
+            frames.cpuStart[depth] = threadCpuNanos();
+            frames.wallStart[depth] = System.nanoTime();
+            frames.childCpu[depth] = 0;
+            frames.childWall[depth] = 0;
+        }
+    }
+
+    /**
+     * Closes the innermost bracket and charges its exclusive cost
+     * @param subsystem
+     * @param feature
+     */
+    public static void exit(String subsystem, String feature) {
+        Frames frames = sFrames.get();
+        if (frames.depth == 0) {
+            return;
+        }
+        int depth = --frames.depth;
+        if (depth >= MAX_DEPTH) {
+            return;
+        }
+        long cpu = threadCpuNanos() - frames.cpuStart[depth];
+        long wall = System.nanoTime() - frames.wallStart[depth];
+        if (depth > 0) {
+            frames.childCpu[depth - 1] += cpu;
+            frames.childWall[depth - 1] += wall;
+        }
+        Account account = account(subsystem, feature);
+        account.cpuNanos.addAndGet(Math.max(0, cpu - frames.childCpu[depth]));
+        account.wallNanos.addAndGet(Math.max(0, wall - frames.childWall[depth]));
+        account.calls.incrementAndGet();
+        if (depth == 0) {
+            account.wakeups.incrementAndGet();
+        }
+    }
+
+    /**
+     * Totals of a subsystem over all its features
+     * @param subsystem
+     * @return cpu nanos, wall nanos, calls, wakeups
+     */
+    public static long[] totals(String subsystem) {
+        long[] totals = new long[4];
+        Map<String, Account> features = sSubsystems.get(subsystem);
+        if (features != null) {
+            for (Account account : features.values()) {
+                totals[0] += account.cpuNanos.get();
+                totals[1] += account.wallNanos.get();
+                totals[2] += account.calls.get();
+                totals[3] += account.wakeups.get();
+            }
+        }
+        return totals;
+    }
+
+    /**
+     * Cost per subsystem and feature since the last reset, next to the CPU time
+     * of the whole process over the same period
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject getReport() throws JSONException {
+        JSONObject subsystems = new JSONObject();
+        long attributedCpu = 0;
+        for (Map.Entry<String, ConcurrentHashMap<String, Account>> subsystem : sSubsystems.entrySet()) {
+            JSONObject features = new JSONObject();
+            long[] totals = new long[4];
+            for (Map.Entry<String, Account> feature : subsystem.getValue().entrySet()) {
+                Account account = feature.getValue();
+                long[] values = {account.cpuNanos.get(), account.wallNanos.get(), account.calls.get(), account.wakeups.get()};
+                for (int i = 0; i < values.length; i++) {
+                    totals[i] += values[i];
+                }
+                features.put(feature.getKey(), toJSON(values));
+            }
+            attributedCpu += totals[0];
+            JSONObject entry = toJSON(totals);
+            entry.put("features", features);
+            subsystems.put(subsystem.getKey(), entry);
+        }
+
+        JSONObject report = new JSONObject();
+        report.put("periodMs", System.currentTimeMillis() - sResetWallMs);
+        report.put("processCpuMs", Process.getElapsedCpuTime() - sResetProcessCpuMs);
+        report.put("attributedCpuMs", attributedCpu / 1e6);
+        report.put("subsystems", subsystems);
+        return report;
+    }
+
+    /**
+     * Starts a new accounting period
+     */
+    public static void reset() {
+        sSubsystems.clear();
+        sResetWallMs = System.currentTimeMillis();
+        sResetProcessCpuMs = Process.getElapsedCpuTime();
+    }
+
+    private static Account account(String subsystem, String feature) {
+        ConcurrentHashMap<String, Account> features = sSubsystems.get(subsystem);
+        if (features == null) {
+            ConcurrentHashMap<String, Account> created = new ConcurrentHashMap<String, Account>();
+            features = sSubsystems.putIfAbsent(subsystem, created);
+            if (features == null) {
+                features = created;
+            }
+        }
+        Account account = features.get(feature);
+        if (account == null) {
+            Account created = new Account();
+            account = features.putIfAbsent(feature, created);
+            if (account == null) {
+                account = created;
+            }
+        }
+        return account;
+    }
+
+    private static JSONObject toJSON(long[] values) throws JSONException {
+        JSONObject entry = new JSONObject();
+        entry.put("cpuMs", values[0] / 1e6);
+        entry.put("wallMs", values[1] / 1e6);
+        entry.put("calls", values[2]);
+        entry.put("wakeups", values[3]);
+        return entry;
+    }
+}
@@ -0,0 +1,193 @@
+package com.ialocation.plugin;
+
+import java.util.ArrayList;
+import java.util.concurrent.CancellationException;
+
+/**
+ * Result of an asynchronous native operation, e.g. a resource fetch, routing
+ * or a coordinate conversion, that further steps can be chained onto.
+ *
+ * Steps run on TaskScheduler lanes once the previous result is available, so
+ * a chain such as fetch floor plan, route, project route onto plan runs in
+ * one bridge call and no thread waits while a fetch is in flight. A failure
+ * or cancellation skips the remaining steps and reaches the final callback.
+ * @param <T>
+ */
+public final class Deferred<T> {
+
+    /**
+     * Synchronous step, runs on a scheduler lane
+     * @param <A>
+     * @param <B>
+     */
+    public interface Step<A, B> {
+        B apply(A value) throws Exception;
+    }
+
+    /**
+     * Step that itself completes later, e.g. a network fetch
+     * @param <A>
+     * @param <B>
+     */
+    public interface AsyncStep<A, B> {
+        Deferred<B> apply(A value) throws Exception;
+    }
+
+    /**
+     * Receives the final outcome of a chain
+     * @param <T>
+     */
+    public interface Callback<T> {
+        void onSuccess(T value);
+        void onFailure(Exception error);
+    }
+
+    private final TaskScheduler.CancellationToken mToken;
+    private ArrayList<Callback<T>> mCallbacks = new ArrayList<Callback<T>>(1);
+    private boolean mDone;
+    private T mValue;
+    private Exception mError;
+
+    /**
+     * The constructor
+     * @param token shared by every step of the chain, may be null
+     */
+    public Deferred(TaskScheduler.CancellationToken token) {
+        mToken = token != null ? token : new TaskScheduler.CancellationToken();
+    }
+
+    public static <T> Deferred<T> resolved(T value) {
+        Deferred<T> deferred = new Deferred<T>(null);
+        deferred.resolve(value);
+        return deferred;
+    }
+
+    public static <T> Deferred<T> rejected(Exception error) {
+        Deferred<T> deferred = new Deferred<T>(null);
+        deferred.reject(error);
+        return deferred;
+    }
+
+    public TaskScheduler.CancellationToken getToken() {
+        return mToken;
+    }
+
+    /**
+     * Cancels the chain; pending steps are skipped and the callbacks fail
+     */
+    public void cancel() {
+        mToken.cancel();
+        reject(new CancellationException());
+    }
+
+    public void resolve(T value) {
+        complete(value, null);
+    }
+
+    public void reject(Exception error) {
+        complete(null, error);
+    }
+
+    /**
+     * Registers a callback, called right away if the result is already there.
+     * Callbacks run on the thread that completes the deferred.
+     * @param callback
+     */
+    public void whenComplete(Callback<T> callback) {
+        synchronized (this) {
+            if (!mDone) {
+                mCallbacks.add(callback);
+                return;
+            }
+        }
+        dispatch(callback);
+    }
+
+    /**
+     * Chains a synchronous step on the given lane
+     * @param lane
+     * @param step
+     * @return
+     */
+    public <R> Deferred<R> then(final int lane, final Step<T, R> step) {
+        return thenAsync(lane, new AsyncStep<T, R>() {
+            @Override
+            public Deferred<R> apply(T value) throws Exception {
+                return resolved(step.apply(value));
+            }
+        });
+    }
+
+    /**
+     * Chains a step that completes asynchronously on the given lane
+     * @param lane
+     * @param step
+     * @return
+     */
+    public <R> Deferred<R> thenAsync(final int lane, final AsyncStep<T, R> step) {
+        final Deferred<R> next = new Deferred<R>(mToken);
+        whenComplete(new Callback<T>() {
+            @Override
+            public void onSuccess(final T value) {
+                // Not submitted under the token: a cancelled step must still settle the chain
+                TaskScheduler.getShared().submit(lane, null, CostAccounting.SCHEDULER, new Runnable() {
+                    @Override
+                    public void run() {
+                        if (mToken.isCancelled()) {
+                            next.reject(new CancellationException());
+                            return;
+                        }
+                        try {
+                            step.apply(value).whenComplete(new Callback<R>() {
+                                @Override
+                                public void onSuccess(R result) {
+                                    next.resolve(result);
+                                }
+
+                                @Override
+                                public void onFailure(Exception error) {
+                                    next.reject(error);
+                                }
+                            });
+                        } catch (Exception ex) {
+                            next.reject(ex);
+                        }
+                    }
+                });
+            }
+
+            @Override
+            public void onFailure(Exception error) {
+                next.reject(error);
+            }
+        });
+        return next;
+    }
+
+    private void complete(T value, Exception error) {
+        ArrayList<Callback<T>> callbacks;
+        synchronized (this) {
+            if (mDone) {
+                return;
+            }
+            mDone = true;
+            mValue = value;
+            mError = error;
+            callbacks = mCallbacks;
+            mCallbacks = null;
+        }
+        for (Callback<T> callback : callbacks) {
+            dispatch(callback);
+        }
+    }
+
+    private void dispatch(Callback<T> callback) {
+        if (mError == null && mToken.isCancelled()) {
+            callback.onFailure(new CancellationException());
+        } else if (mError != null) {
+            callback.onFailure(mError);
+        } else {
+            callback.onSuccess(mValue);
+        }
+    }
+}
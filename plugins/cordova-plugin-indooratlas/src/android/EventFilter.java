@@ -0,0 +1,529 @@
+package com.ialocation.plugin;
+
+import java.util.ArrayList;
+
+/**
+ * A small declarative filter expression compiled into a predicate, so that
+ * updates a subscription does not want are dropped natively and never cross
+ * the bridge.
+ *
+ * Expressions compare the fields of one kind of update with numbers, strings
+ * or each other and combine the comparisons with &&, || and !, e.g.
+ *
+ *   accuracy < 5 && floor == 3
+ *   transition == 'enter' && regionId == 'abc'
+ *   change(heading) > 10
+ *
+ * change(field) is the absolute difference to the value in the last update
+ * the filter accepted, taking the shorter way round for headings, and is
+ * infinite until the filter has accepted an update. Each subscription has
+ * its own filter, as change() keeps state.
+ *
+ * Expressions are type checked when they are compiled; errors throw an
+ * IllegalArgumentException naming the position. Matching allocates nothing.
+ * A filter is only used on the queue its subscription delivers on.
+ */
+public final class EventFilter {
+    public static final int KIND_POSITION = 0;
+    public static final int KIND_REGION = 1;
+    public static final int KIND_HEADING = 2;
+    public static final int KIND_ATTITUDE = 3;
+
+    // Numeric slots of a position
+    public static final int LATITUDE = 0;
+    public static final int LONGITUDE = 1;
+    public static final int ALTITUDE = 2;
+    public static final int ACCURACY = 3;
+    public static final int BEARING = 4;
+    public static final int VELOCITY = 5;
+    public static final int FLOOR = 6;
+    public static final int POSITION_TIME = 7;
+    // Numeric and string slots of a region event
+    public static final int REGION_TYPE = 0;
+    public static final int TRANSITION_TYPE = 1;
+    public static final int REGION_TIME = 2;
+    public static final int REGION_ID = 0;
+    public static final int TRANSITION = 1;
+    // Numeric slots of a heading
+    public static final int HEADING = 0;
+    public static final int HEADING_TIME = 1;
+    // Numeric slots of an attitude
+    public static final int X = 0;
+    public static final int Y = 1;
+    public static final int Z = 2;
+    public static final int W = 3;
+    public static final int ATTITUDE_TIME = 4;
+
+    public static final int MAX_EXPRESSION_LENGTH = 1024;
+
+    // Field names per kind, indexed by slot; aliases map to the same slot
+    private static final String[][] NUMBER_FIELDS = {
+            { "latitude", "longitude", "altitude", "accuracy", "heading", "velocity", "floor", "timestamp" },
+            { "regionType", "transitionType", "timestamp" },
+            { "heading", "timestamp" },
+            { "x", "y", "z", "w", "timestamp" }
+    };
+    private static final String[][] STRING_FIELDS = {
+            {},
+            { "regionId", "transition" },
+            {},
+            {}
+    };
+    private static final String[][] ALIASES = {
+            { "flr", "floor", "bearing", "heading" },
+            {},
+            { "trueHeading", "heading" },
+            {}
+    };
+    // Slots that are angles in degrees, for change()
+    private static final int[] CIRCULAR = { BEARING, -1, HEADING, -1 };
+
+    /**
+     * Holds the fields of one update. The listener fills one instance per
+     * kind in place and hands it to every filter of that kind.
+     */
+    public static final class Values {
+        public final double[] numbers = new double[8];
+        public final String[] strings = new String[2];
+    }
+
+    private abstract static class Node {
+        abstract boolean test(Values values);
+    }
+
+    private abstract static class Term {
+        abstract double eval(Values values);
+    }
+
+    private static final class Constant extends Term {
+        private final double value;
+
+        Constant(double value) {
+            this.value = value;
+        }
+
+        @Override
+        double eval(Values values) {
+            return value;
+        }
+    }
+
+    private static final class Field extends Term {
+        private final int slot;
+
+        Field(int slot) {
+            this.slot = slot;
+        }
+
+        @Override
+        double eval(Values values) {
+            return values.numbers[slot];
+        }
+    }
+
+    private static final class Change extends Term {
+        private final int slot;
+        private final boolean circular;
+        private double last = Double.NaN;
+
+        Change(int slot, boolean circular) {
+            this.slot = slot;
+            this.circular = circular;
+        }
+
+        @Override
+        double eval(Values values) {
+            if (Double.isNaN(last)) {
+                return Double.POSITIVE_INFINITY;
+            }
+            double delta = Math.abs(values.numbers[slot] - last);
+            if (circular) {
+                delta %= 360;
+                if (delta > 180) {
+                    delta = 360 - delta;
+                }
+            }
+            return delta;
+        }
+
+        void commit(Values values) {
+            last = values.numbers[slot];
+        }
+    }
+
+    private static final class Compare extends Node {
+        private final int op;
+        private final Term left;
+        private final Term right;
+
+        Compare(int op, Term left, Term right) {
+            this.op = op;
+            this.left = left;
+            this.right = right;
+        }
+
+        @Override
+        boolean test(Values values) {
+            double a = left.eval(values);
+            double b = right.eval(values);
+            switch (op) {
+                case OP_EQ: return a == b;
+                case OP_NE: return a != b;
+                case OP_LT: return a < b;
+                case OP_LE: return a <= b;
+                case OP_GT: return a > b;
+                default: return a >= b;
+            }
+        }
+    }
+
+    private static final class CompareString extends Node {
+        private final boolean equal;
+        private final int slot;
+        // Null when comparing two fields
+        private final String literal;
+        private final int otherSlot;
+
+        CompareString(boolean equal, int slot, String literal, int otherSlot) {
+            this.equal = equal;
+            this.slot = slot;
+            this.literal = literal;
+            this.otherSlot = otherSlot;
+        }
+
+        @Override
+        boolean test(Values values) {
+            String value = values.strings[slot];
+            String other = literal != null ? literal : values.strings[otherSlot];
+            boolean same = value == null ? other == null : value.equals(other);
+            return same == equal;
+        }
+    }
+
+    private static final class And extends Node {
+        private final Node left;
+        private final Node right;
+
+        And(Node left, Node right) {
+            this.left = left;
+            this.right = right;
+        }
+
+        @Override
+        boolean test(Values values) {
+            return left.test(values) && right.test(values);
+        }
+    }
+
+    private static final class Or extends Node {
+        private final Node left;
+        private final Node right;
+
+        Or(Node left, Node right) {
+            this.left = left;
+            this.right = right;
+        }
+
+        @Override
+        boolean test(Values values) {
+            return left.test(values) || right.test(values);
+        }
+    }
+
+    private static final class Not extends Node {
+        private final Node operand;
+
+        Not(Node operand) {
+            this.operand = operand;
+        }
+
+        @Override
+        boolean test(Values values) {
+            return !operand.test(values);
+        }
+    }
+
+    private static final int OP_EQ = 0;
+    private static final int OP_NE = 1;
+    private static final int OP_LT = 2;
+    private static final int OP_LE = 3;
+    private static final int OP_GT = 4;
+    private static final int OP_GE = 5;
+    private static final String[] OPERATORS = { "==", "!=", "<=", ">=", "<", ">" };
+    private static final int[] OPERATOR_CODES = { OP_EQ, OP_NE, OP_LE, OP_GE, OP_LT, OP_GT };
+
+    private final String expression;
+    private final int kind;
+    private final Node root;
+    private final Change[] changes;
+    private long evaluated;
+    private long accepted;
+
+    private EventFilter(String expression, int kind, Node root, Change[] changes) {
+        this.expression = expression;
+        this.kind = kind;
+        this.root = root;
+        this.changes = changes;
+    }
+
+    /**
+     * Compiles an expression for updates of the given kind
+     * @param expression
+     * @param kind one of the KIND_ constants
+     * @return
+     * @throws IllegalArgumentException if the expression is invalid
+     */
+    public static EventFilter compile(String expression, int kind) {
+        if (kind < KIND_POSITION || kind > KIND_ATTITUDE) {
+            throw new IllegalArgumentException("Unknown filter kind " + kind);
+        }
+        if (expression == null || expression.trim().isEmpty()) {
+            throw new IllegalArgumentException("Empty filter expression");
+        }
+        if (expression.length() > MAX_EXPRESSION_LENGTH) {
+            throw new IllegalArgumentException("Filter expression longer than " + MAX_EXPRESSION_LENGTH + " characters");
+        }
+        Parser parser = new Parser(expression, kind);
+        Node root = parser.parseOr();
+        parser.skipSpace();
+        if (parser.pos < expression.length()) {
+            throw parser.error("Unexpected '" + expression.charAt(parser.pos) + "'");
+        }
+        return new EventFilter(expression, kind, root, parser.changes.toArray(new Change[parser.changes.size()]));
+    }
+
+    /**
+     * Tests an update, and if it passes remembers its values for change()
+     * @param values
+     * @return true if the update should be delivered
+     */
+    public boolean matches(Values values) {
+        evaluated++;
+        if (!root.test(values)) {
+            return false;
+        }
+        for (Change change : changes) {
+            change.commit(values);
+        }
+        accepted++;
+        return true;
+    }
+
+    public String getExpression() {
+        return expression;
+    }
+
+    public int getKind() {
+        return kind;
+    }
+
+    public long getEvaluated() {
+        return evaluated;
+    }
+
+    public long getAccepted() {
+        return accepted;
+    }
+
+    private static final class Parser {
+        private final String text;
+        private final int kind;
+        private final ArrayList<Change> changes = new ArrayList<Change>();
+        private int pos;
+
+        // Result of parseOperand: a number, a string literal or a string field
+        private Term number;
+        private String literal;
+        private int stringSlot;
+
+        Parser(String text, int kind) {
+            this.text = text;
+            this.kind = kind;
+        }
+
+        IllegalArgumentException error(String message) {
+            return new IllegalArgumentException(message + " at position " + pos + " in filter '" + text + "'");
+        }
+
+        void skipSpace() {
+            while (pos < text.length() && Character.isWhitespace(text.charAt(pos))) {
+                pos++;
+            }
+        }
+
+        boolean accept(String token) {
+            skipSpace();
+            if (text.startsWith(token, pos)) {
+                pos += token.length();
+                return true;
+            }
+            return false;
+        }
+
+        Node parseOr() {
+            Node node = parseAnd();
+            while (accept("||")) {
+                node = new Or(node, parseAnd());
+            }
+            return node;
+        }
+
+        Node parseAnd() {
+            Node node = parseUnary();
+            while (accept("&&")) {
+                node = new And(node, parseUnary());
+            }
+            return node;
+        }
+
+        Node parseUnary() {
+            skipSpace();
+            if (text.startsWith("!", pos) && !text.startsWith("!=", pos)) {
+                pos++;
+                return new Not(parseUnary());
+            }
+            if (accept("(")) {
+                Node node = parseOr();
+                if (!accept(")")) {
+                    throw error("Expected ')'");
+                }
+                return node;
+            }
+            return parseComparison();
+        }
+
+        Node parseComparison() {
+            int start = pos;
+            parseOperand();
+            Term leftNumber = number;
+            String leftLiteral = literal;
+            int leftSlot = stringSlot;
+            skipSpace();
+            int op = -1;
+            for (int i = 0; i < OPERATORS.length; i++) {
+                if (text.startsWith(OPERATORS[i], pos)) {
+                    pos += OPERATORS[i].length();
+                    op = OPERATOR_CODES[i];
+                    break;
+                }
+            }
+            if (op < 0) {
+                throw error("Expected a comparison");
+            }
+            parseOperand();
+            if (leftNumber != null && number != null) {
+                return new Compare(op, leftNumber, number);
+            }
+            if (leftNumber != null || number != null) {
+                pos = start;
+                throw error("Cannot compare a number with a string");
+            }
+            if (op != OP_EQ && op != OP_NE) {
+                pos = start;
+                throw error("Strings can only be compared with == and !=");
+            }
+            if (leftLiteral != null && literal != null) {
+                pos = start;
+                throw error("Comparison of two constants");
+            }
+            if (leftLiteral != null) {
+                return new CompareString(op == OP_EQ, stringSlot, leftLiteral, -1);
+            }
+            return new CompareString(op == OP_EQ, leftSlot, literal, stringSlot);
+        }
+
+        void parseOperand() {
+            number = null;
+            literal = null;
+            stringSlot = -1;
+            skipSpace();
+            if (pos >= text.length()) {
+                throw error("Unexpected end of filter");
+            }
+            char c = text.charAt(pos);
+            if (c == '\'' || c == '"') {
+                int end = text.indexOf(c, pos + 1);
+                if (end < 0) {
+                    throw error("Unterminated string");
+                }
+                literal = text.substring(pos + 1, end);
+                pos = end + 1;
+                return;
+            }
+            if (c == '-' || c == '.' || Character.isDigit(c)) {
+                int start = pos;
+                pos++;
+                while (pos < text.length()) {
+                    char d = text.charAt(pos);
+                    boolean exponentSign = (d == '-' || d == '+')
+                            && (text.charAt(pos - 1) == 'e' || text.charAt(pos - 1) == 'E');
+                    if (!Character.isDigit(d) && d != '.' && d != 'e' && d != 'E' && !exponentSign) {
+                        break;
+                    }
+                    pos++;
+                }
+                try {
+                    number = new Constant(Double.parseDouble(text.substring(start, pos)));
+                } catch (NumberFormatException e) {
+                    pos = start;
+                    throw error("Invalid number");
+                }
+                return;
+            }
+            String name = parseIdentifier();
+            if ("change".equals(name) && accept("(")) {
+                skipSpace();
+                int slot = numberSlot(parseIdentifier());
+                if (!accept(")")) {
+                    throw error("Expected ')'");
+                }
+                Change change = new Change(slot, slot == CIRCULAR[kind]);
+                changes.add(change);
+                number = change;
+                return;
+            }
+            int slot = indexOf(STRING_FIELDS[kind], name);
+            if (slot >= 0) {
+                stringSlot = slot;
+                return;
+            }
+            number = new Field(numberSlot(name));
+        }
+
+        String parseIdentifier() {
+            int start = pos;
+            while (pos < text.length() && (Character.isLetterOrDigit(text.charAt(pos)) || text.charAt(pos) == '_')) {
+                pos++;
+            }
+            if (start == pos) {
+                throw error("Expected a field, number or string");
+            }
+            return text.substring(start, pos);
+        }
+
+        int numberSlot(String name) {
+            int length = name.length();
+            String[] aliases = ALIASES[kind];
+            for (int i = 0; i < aliases.length; i += 2) {
+                if (aliases[i].equals(name)) {
+                    name = aliases[i + 1];
+                }
+            }
+            int slot = indexOf(NUMBER_FIELDS[kind], name);
+            if (slot < 0) {
+                pos -= length;
+                throw error("Unknown numeric field '" + name + "'");
+            }
+            return slot;
+        }
+
+        static int indexOf(String[] names, String name) {
+            for (int i = 0; i < names.length; i++) {
+                if (names[i].equals(name)) {
+                    return i;
+                }
+            }
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,505 @@
+package com.ialocation.plugin;
+
+import android.util.Log;
+
+import org.json.JSONArray;
+import org.json.JSONException;
+import org.json.JSONObject;
+
+import java.io.BufferedInputStream;
+import java.io.DataInputStream;
+import java.io.EOFException;
+import java.io.File;
+import java.io.FileInputStream;
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.io.RandomAccessFile;
+import java.nio.ByteBuffer;
+import java.nio.charset.Charset;
+import java.util.ArrayList;
+import java.util.Collections;
+import java.util.HashMap;
+import java.util.Iterator;
+import java.util.Locale;
+import java.util.Map;
+import java.util.TreeMap;
+import java.util.zip.CRC32;
+
+/**
+ * Append-only on-disk queue for events produced while JavaScript cannot take
+ * them: region transitions nobody is watching, and the triggers and occupancy
+ * batches of the background processor.
+ *
+ * Events are records in segment files named after the offset of their first
+ * record. A record is a 16 byte header (payload length, CRC32 of offset and
+ * payload, offset) followed by the event as UTF-8 JSON, written with a single
+ * write call so that a killed process never leaves half a record behind.
+ * Appends are made durable in groups: the first append after a sync schedules
+ * the next one GROUP_COMMIT_MS later on the TimingWheel, or it happens at once
+ * when GROUP_COMMIT_RECORDS are pending. On open the newest segment is
+ * truncated after its last valid record, dropping a write torn by power loss.
+ * When the queue outgrows its byte bound the oldest segments are deleted,
+ * read or not.
+ *
+ * Each consumer reads the events after its own acknowledged offset in batches.
+ * A consumer is registered by its first read, having acknowledged nothing.
+ * Offsets are persisted by write and rename. Segments every registered
+ * consumer has acknowledged are deleted. Thread safe.
+ */
+public final class EventQueue {
+    private static final String TAG = "EventQueue";
+    public static final long DEFAULT_MAX_BYTES = 4L * 1024 * 1024;
+    public static final int DEFAULT_SEGMENT_BYTES = 256 * 1024;
+    public static final int DEFAULT_BATCH = 100;
+    public static final long GROUP_COMMIT_MS = 50;
+    public static final int GROUP_COMMIT_RECORDS = 64;
+    private static final int HEADER_BYTES = 16;
+    private static final int MAX_RECORD_BYTES = 256 * 1024;
+    private static final String SEGMENT_SUFFIX = ".log";
+    private static final String OFFSETS_FILE = "offsets.json";
+    private static final Charset UTF8 = Charset.forName("UTF-8");
+
+    private static final class Segment {
+        final long firstOffset;
+        final File file;
+        long nextOffset;
+        long bytes;
+
+        Segment(long firstOffset, File file) {
+            this.firstOffset = firstOffset;
+            this.file = file;
+            this.nextOffset = firstOffset;
+        }
+    }
+
+    private final File mDir;
+    private final long mMaxBytes;
+    private final int mSegmentBytes;
+    private final TreeMap<Long, Segment> mSegments = new TreeMap<Long, Segment>();
+    private final HashMap<String, Long> mAcked = new HashMap<String, Long>();
+    private Segment mActive;
+    private FileOutputStream mOut;
+    private long mNextOffset;
+    private long mTotalBytes;
+    private int mUnsynced;
+    private TimingWheel.Timeout mCommit;
+
+    private long mAppended;
+    private long mSyncs;
+    private long mDropped;
+    private long mTruncatedBytes;
+
+    /**
+     * Opens the queue in a directory, recovering the events already there.
+     * @param dir created if missing
+     * @param maxBytes bound of the total size of the segments
+     * @param segmentBytes size at which a new segment is started
+     * @throws IOException
+     */
+    public EventQueue(File dir, long maxBytes, int segmentBytes) throws IOException {
+        mDir = dir;
+        mMaxBytes = maxBytes;
+        mSegmentBytes = segmentBytes;
+        if (!dir.isDirectory() && !dir.mkdirs()) {
+            throw new IOException("Cannot create " + dir);
+        }
+        loadOffsets();
+        recover();
+    }
+
+    /**
+     * Appends an event and returns its offset. The event is durable once the
+     * group it belongs to has been synced.
+     * @param event
+     * @throws IOException
+     */
+    public synchronized long append(JSONObject event) throws IOException {
+        byte[] payload = event.toString().getBytes(UTF8);
+        if (payload.length > MAX_RECORD_BYTES) {
+            throw new IOException("Event of " + payload.length + " bytes is too large");
+        }
+        int size = HEADER_BYTES + payload.length;
+        if (mActive == null || (mActive.bytes > 0 && mActive.bytes + size > mSegmentBytes)) {
+            roll();
+        }
+        long offset = mNextOffset;
+        ByteBuffer record = ByteBuffer.allocate(size);
+        record.putInt(payload.length).putInt(checksum(offset, payload)).putLong(offset).put(payload);
+        try {
+            mOut.write(record.array());
+        } catch (IOException e) {
+            // Cut off whatever part of the record made it, so later appends stay readable
+            mOut.getChannel().truncate(mActive.bytes);
+            throw e;
+        }
+        mActive.bytes += size;
+        mActive.nextOffset = ++mNextOffset;
+        mTotalBytes += size;
+        mAppended++;
+        if (++mUnsynced >= GROUP_COMMIT_RECORDS) {
+            sync();
+        } else if (mCommit == null) {
+            mCommit = TimingWheel.getShared().schedule(GROUP_COMMIT_MS, new Runnable() {
+                @Override
+                public void run() {
+                    TaskScheduler.getShared().submit(TaskScheduler.LANE_BACKGROUND, CostAccounting.STORAGE, new Runnable() {
+                        @Override
+                        public void run() {
+                            sync();
+                        }
+                    });
+                }
+            });
+        }
+        enforceBound();
+        return offset;
+    }
+
+    /**
+     * Makes every appended event durable.
+     * @return false if the sync failed, the events are then retried with the next group
+     */
+    public synchronized boolean sync() {
+        if (mCommit != null) {
+            mCommit.cancel();
+            mCommit = null;
+        }
+        if (mUnsynced == 0 || mOut == null) {
+            return true;
+        }
+        try {
+            mOut.getFD().sync();
+            mUnsynced = 0;
+            mSyncs++;
+            return true;
+        } catch (IOException e) {
+            Log.e(TAG, "sync failed: " + e);
+            return false;
+        }
+    }
+
+    /**
+     * Reads the next batch of a consumer: the events after its acknowledged
+     * offset, oldest first, each with its "offset".
+     * @param consumer
+     * @param maxEvents
+     * @return { events, lastOffset, pending, skipped }
+     * @throws IOException
+     * @throws JSONException
+     */
+    public synchronized JSONObject read(String consumer, int maxEvents) throws IOException, JSONException {
+        if (!mAcked.containsKey(consumer)) {
+            // Holds back compaction until the consumer acknowledges what it reads
+            mAcked.put(consumer, -1L);
+            saveOffsets();
+        }
+        long acked = ackedOffset(consumer);
+        long first = firstOffset();
+        long from = Math.max(acked + 1, first);
+        JSONArray events = new JSONArray();
+        Long start = mSegments.floorKey(from);
+        if (start == null && !mSegments.isEmpty()) {
+            start = mSegments.firstKey();
+        }
+        if (start != null) {
+            for (Segment segment : mSegments.tailMap(start, true).values()) {
+                if (events.length() >= maxEvents) {
+                    break;
+                }
+                // A corrupted record ends its segment, reading goes on with the next one
+                walk(segment, from, events, maxEvents);
+            }
+        }
+        long last = events.length() > 0 ? events.getJSONObject(events.length() - 1).getLong("offset") : from - 1;
+        JSONObject batch = new JSONObject();
+        batch.put("consumer", consumer);
+        batch.put("events", events);
+        batch.put("lastOffset", last);
+        batch.put("pending", Math.max(0, mNextOffset - 1 - last));
+        // Events dropped by the size bound before the consumer got to them
+        batch.put("skipped", Math.max(0, first - acked - 1));
+        return batch;
+    }
+
+    /**
+     * Acknowledges every event up to and including an offset for a consumer.
+     * Acknowledging backwards is ignored.
+     * @param consumer
+     * @param offset
+     * @throws IOException
+     */
+    public synchronized void ack(String consumer, long offset) throws IOException {
+        offset = Math.min(offset, mNextOffset - 1);
+        if (offset <= ackedOffset(consumer)) {
+            return;
+        }
+        mAcked.put(consumer, offset);
+        saveOffsets();
+        compact();
+    }
+
+    public synchronized JSONObject getStats() throws JSONException {
+        JSONObject stats = new JSONObject();
+        stats.put("firstOffset", firstOffset());
+        stats.put("nextOffset", mNextOffset);
+        stats.put("segments", mSegments.size());
+        stats.put("bytes", mTotalBytes);
+        stats.put("unsynced", mUnsynced);
+        stats.put("appended", mAppended);
+        stats.put("syncs", mSyncs);
+        stats.put("dropped", mDropped);
+        stats.put("truncatedBytes", mTruncatedBytes);
+        JSONObject consumers = new JSONObject();
+        for (Map.Entry<String, Long> entry : mAcked.entrySet()) {
+            consumers.put(entry.getKey(), entry.getValue().longValue());
+        }
+        stats.put("consumers", consumers);
+        return stats;
+    }
+
+    /**
+     * Syncs and closes the active segment. Appending afterwards opens a new one.
+     */
+    public synchronized void close() {
+        sync();
+        if (mOut != null) {
+            try {
+                mOut.close();
+            } catch (IOException e) {
+                Log.w(TAG, "close failed: " + e);
+            }
+            mOut = null;
+            mActive = null;
+        }
+    }
+
+    private long firstOffset() {
+        return mSegments.isEmpty() ? mNextOffset : mSegments.firstKey();
+    }
+
+    private long ackedOffset(String consumer) {
+        Long offset = mAcked.get(consumer);
+        return offset != null ? offset : -1;
+    }
+
+    private void roll() throws IOException {
+        if (mOut != null) {
+            sync();
+            mOut.close();
+            mOut = null;
+        }
+        Segment segment = new Segment(mNextOffset, new File(mDir, segmentName(mNextOffset)));
+        mOut = new FileOutputStream(segment.file, true);
+        mSegments.put(segment.firstOffset, segment);
+        mActive = segment;
+    }
+
+    private void enforceBound() {
+        while (mTotalBytes > mMaxBytes && mSegments.size() > 1) {
+            Segment oldest = mSegments.pollFirstEntry().getValue();
+            mDropped += oldest.nextOffset - oldest.firstOffset;
+            deleteSegment(oldest);
+        }
+    }
+
+    /**
+     * Deletes the sealed segments every registered consumer has acknowledged.
+     */
+    private void compact() {
+        if (mAcked.isEmpty()) {
+            return;
+        }
+        long acked = Long.MAX_VALUE;
+        for (Long offset : mAcked.values()) {
+            acked = Math.min(acked, offset);
+        }
+        Iterator<Segment> it = mSegments.values().iterator();
+        while (it.hasNext()) {
+            Segment segment = it.next();
+            if (segment == mActive || segment.nextOffset - 1 > acked) {
+                break;
+            }
+            it.remove();
+            deleteSegment(segment);
+        }
+    }
+
+    private void deleteSegment(Segment segment) {
+        mTotalBytes -= segment.bytes;
+        if (!segment.file.delete()) {
+            Log.w(TAG, "cannot delete " + segment.file);
+        }
+    }
+
+    private void recover() throws IOException {
+        File[] files = mDir.listFiles();
+        ArrayList<Long> offsets = new ArrayList<Long>();
+        for (int i = 0; files != null && i < files.length; i++) {
+            String name = files[i].getName();
+            if (name.endsWith(SEGMENT_SUFFIX)) {
+                try {
+                    offsets.add(Long.parseLong(name.substring(0, name.length() - SEGMENT_SUFFIX.length())));
+                } catch (NumberFormatException e) {
+                    Log.w(TAG, "ignoring " + name);
+                }
+            }
+        }
+        Collections.sort(offsets);
+        Segment previous = null;
+        for (Long offset : offsets) {
+            Segment segment = new Segment(offset, new File(mDir, segmentName(offset)));
+            segment.bytes = segment.file.length();
+            if (previous != null) {
+                previous.nextOffset = offset;
+            }
+            mSegments.put(offset, segment);
+            mTotalBytes += segment.bytes;
+            previous = segment;
+        }
+        long next = 0;
+        for (Long offset : mAcked.values()) {
+            next = Math.max(next, offset + 1);
+        }
+        if (previous != null) {
+            // Only the newest segment can end in a torn write, the others were synced before rolling
+            long valid = walk(previous, Long.MAX_VALUE, null, 0);
+            if (valid < previous.bytes) {
+                RandomAccessFile file = new RandomAccessFile(previous.file, "rw");
+                try {
+                    file.setLength(valid);
+                } finally {
+                    file.close();
+                }
+                mTruncatedBytes += previous.bytes - valid;
+                mTotalBytes -= previous.bytes - valid;
+                previous.bytes = valid;
+            }
+            next = Math.max(next, previous.nextOffset);
+            mActive = previous;
+            mOut = new FileOutputStream(previous.file, true);
+        }
+        mNextOffset = next;
+    }
+
+    /**
+     * Walks the valid records of a segment, adding the events at or after an
+     * offset to a batch until it is full. Without a batch, records the offset
+     * after the last valid record in the segment.
+     * @return length of the valid part of the segment
+     */
+    private long walk(Segment segment, long fromOffset, JSONArray events, int maxEvents) throws IOException {
+        long position = 0;
+        long offset = segment.firstOffset;
+        DataInputStream in = new DataInputStream(new BufferedInputStream(new FileInputStream(segment.file), 16 * 1024));
+        try {
+            byte[] payload = new byte[0];
+            while (events == null || events.length() < maxEvents) {
+                int size;
+                int crc;
+                long recordOffset;
+                try {
+                    size = in.readInt();
+                    crc = in.readInt();
+                    recordOffset = in.readLong();
+                    if (size < 0 || size > MAX_RECORD_BYTES || recordOffset != offset) {
+                        break;
+                    }
+                    if (payload.length < size) {
+                        payload = new byte[size];
+                    }
+                    in.readFully(payload, 0, size);
+                } catch (EOFException e) {
+                    break;
+                }
+                if (checksum(recordOffset, payload, size) != crc) {
+                    break;
+                }
+                if (events != null && recordOffset >= fromOffset) {
+                    try {
+                        JSONObject event = new JSONObject(new String(payload, 0, size, UTF8));
+                        event.put("offset", recordOffset);
+                        events.put(event);
+                    } catch (JSONException e) {
+                        Log.w(TAG, "skipping event " + recordOffset + ": " + e);
+                    }
+                }
+                position += HEADER_BYTES + size;
+                offset++;
+            }
+        } finally {
+            in.close();
+        }
+        if (events == null) {
+            segment.nextOffset = offset;
+        }
+        return position;
+    }
+
+    private void loadOffsets() {
+        File file = new File(mDir, OFFSETS_FILE);
+        if (!file.exists()) {
+            return;
+        }
+        try {
+            byte[] data = new byte[(int) file.length()];
+            DataInputStream in = new DataInputStream(new FileInputStream(file));
+            try {
+                in.readFully(data);
+            } finally {
+                in.close();
+            }
+            JSONObject offsets = new JSONObject(new String(data, UTF8));
+            Iterator<String> keys = offsets.keys();
+            while (keys.hasNext()) {
+                String consumer = keys.next();
+                mAcked.put(consumer, offsets.getLong(consumer));
+            }
+        } catch (IOException e) {
+            Log.w(TAG, "cannot read offsets: " + e);
+        } catch (JSONException e) {
+            Log.w(TAG, "cannot parse offsets: " + e);
+        }
+    }
+
+    private void saveOffsets() throws IOException {
+        JSONObject offsets = new JSONObject();
+        try {
+            for (Map.Entry<String, Long> entry : mAcked.entrySet()) {
+                offsets.put(entry.getKey(), entry.getValue().longValue());
+            }
+        } catch (JSONException e) {
+            throw new IOException(e.toString());
+        }
+        File temp = new File(mDir, OFFSETS_FILE + ".tmp");
+        FileOutputStream out = new FileOutputStream(temp);
+        try {
+            out.write(offsets.toString().getBytes(UTF8));
+            out.getFD().sync();
+        } finally {
+            out.close();
+        }
+        if (!temp.renameTo(new File(mDir, OFFSETS_FILE))) {
+            throw new IOException("Cannot replace " + OFFSETS_FILE);
+        }
+    }
+
+    private static String segmentName(long offset) {
+        return String.format(Locale.US, "%020d", offset) + SEGMENT_SUFFIX;
+    }
+
+    private static int checksum(long offset, byte[] payload) {
+        return checksum(offset, payload, payload.length);
+    }
+
+    /**
+     * CRC32 over the big-endian offset and the payload, as IndoorEventQueue computes it
+     */
+    private static int checksum(long offset, byte[] payload, int size) {
+        CRC32 crc = new CRC32();
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            crc.update((int) (offset >>> shift) & 0xff);
+        }
+        crc.update(payload, 0, size);
+        return (int) crc.getValue();
+    }
+}
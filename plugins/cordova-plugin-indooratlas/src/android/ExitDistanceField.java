@@ -0,0 +1,706 @@
+package com.ialocation.plugin;
+
+import org.json.JSONArray;
+import org.json.JSONException;
+import org.json.JSONObject;
+
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Collection;
+import java.util.HashMap;
+
+/**
+ * Distance field towards the nearest open exit, for evacuation guidance.
+ *
+ * A multi-source Dijkstra from all open exits over the wayfinding graph
+ * gives every node its distance, the exit it leads to and its next hop.
+ * Positions off the graph are covered by one raster per floor whose cells
+ * hold the node to head for, chosen by a chamfer distance transform seeded
+ * from the nodes, so guidance for a fix is a cell lookup and two array reads.
+ * Walls are not in the graph, so the raster may point through one in open
+ * plan areas; the node it points to is never further than its cell's
+ * distance.
+ *
+ * Closing an exit only repairs the nodes that led to it: they are reset,
+ * seeded from their unaffected neighbours and settled again. Opening one
+ * relaxes from its node only. Both return the changed nodes as a delta and
+ * rebuild the rasters of the floors they are on. Another device holding a
+ * field built from the same graph and exits applies the delta with
+ * applyDelta() instead of repairing the field itself. A delta names the
+ * version it was made from and a fingerprint of the graph and exits, and is
+ * rejected by a field at another version or built from other input.
+ */
+public final class ExitDistanceField {
+    public static final double DEFAULT_CELL_METERS = 1;
+    public static final double FLOOR_HEIGHT_METERS = 5;
+    public static final int MAX_RASTER_CELLS = 1 << 22;
+
+    private static final double RASTER_MARGIN_METERS = 10;
+    private static final double METERS_PER_DEGREE = 6371000.0 * Math.PI / 180.0;
+    // 64-bit FNV-1a, computed the same way on iOS so deltas can cross platforms
+    private static final long FNV_OFFSET = 0xcbf29ce484222325L;
+    private static final long FNV_PRIME = 0x100000001b3L;
+
+    private static final class Raster {
+        double x0;
+        double y0;
+        double cellMeters;
+        int width;
+        int height;
+        float[] distance;
+        int[] node;
+    }
+
+    /**
+     * Binary min-heap of nodes by distance, stale entries are skipped on pop
+     */
+    private static final class Heap {
+        private double[] mKeys = new double[64];
+        private int[] mNodes = new int[64];
+        private int mSize;
+
+        boolean isEmpty() {
+            return mSize == 0;
+        }
+
+        void push(double key, int node) {
+            if (mSize == mKeys.length) {
+                mKeys = Arrays.copyOf(mKeys, mSize * 2);
+                mNodes = Arrays.copyOf(mNodes, mSize * 2);
+            }
+            int i = mSize++;
+            while (i > 0) {
+                int parent = (i - 1) >> 1;
+                if (mKeys[parent] <= key) {
+                    break;
+                }
+                mKeys[i] = mKeys[parent];
+                mNodes[i] = mNodes[parent];
+                i = parent;
+            }
+            mKeys[i] = key;
+            mNodes[i] = node;
+        }
+
+        double peekKey() {
+            return mKeys[0];
+        }
+
+        int pop() {
+            int top = mNodes[0];
+            double key = mKeys[--mSize];
+            int node = mNodes[mSize];
+            int i = 0;
+            while (true) {
+                int child = 2 * i + 1;
+                if (child >= mSize) {
+                    break;
+                }
+                if (child + 1 < mSize && mKeys[child + 1] < mKeys[child]) {
+                    child++;
+                }
+                if (key <= mKeys[child]) {
+                    break;
+                }
+                mKeys[i] = mKeys[child];
+                mNodes[i] = mNodes[child];
+                i = child;
+            }
+            mKeys[i] = key;
+            mNodes[i] = node;
+            return top;
+        }
+    }
+
+    private final double mLatitude0;
+    private final double mLongitude0;
+    private final double mMetersPerDegreeLon;
+    private final double mCellMeters;
+
+    private final double[] mLatitudes;
+    private final double[] mLongitudes;
+    private final int[] mFloors;
+    private final double[] mX;
+    private final double[] mY;
+    private final int[] mAdjacencyOffsets;
+    private final int[] mAdjacentNodes;
+    private final double[] mAdjacentWeights;
+
+    private final String[] mExitIds;
+    private final int[] mExitNodes;
+    private final boolean[] mClosed;
+
+    private final double[] mDistance;
+    private final int[] mNext;
+    private final int[] mExit;
+    private final HashMap<Integer, Raster> mRasters = new HashMap<Integer, Raster>();
+    private final String mFingerprint;
+    private int mVersion;
+
+    /**
+     * Builds the field
+     * @param graphJson wayfinding graph as given to buildWayfinder
+     * @param exits [{ id, latitude, longitude, floor }], each snapped to the nearest node on its floor, or [{ id, node }]
+     * @param cellMeters raster cell size, grown if a floor would exceed MAX_RASTER_CELLS
+     * @param closedExitIds exits closed from the start, ids not among the exits are ignored
+     * @throws JSONException if the graph is malformed, a malformed exit or a negative edge weight throws
+     *                       IllegalArgumentException naming its index
+     */
+    public ExitDistanceField(String graphJson, JSONArray exits, double cellMeters, Collection<String> closedExitIds)
+            throws JSONException {
+        JSONObject graph = new JSONObject(graphJson);
+        JSONArray nodes = graph.getJSONArray("nodes");
+        JSONArray edges = graph.getJSONArray("edges");
+        int count = nodes.length();
+        if (count == 0) {
+            throw new IllegalArgumentException("Graph has no nodes");
+        }
+        mCellMeters = cellMeters > 0 ? cellMeters : DEFAULT_CELL_METERS;
+        mLatitudes = new double[count];
+        mLongitudes = new double[count];
+        mFloors = new int[count];
+        mX = new double[count];
+        mY = new double[count];
+        for (int i = 0; i < count; i++) {
+            JSONObject node = nodes.getJSONObject(i);
+            mLatitudes[i] = node.getDouble("latitude");
+            mLongitudes[i] = node.getDouble("longitude");
+            mFloors[i] = node.getInt("floor");
+        }
+        mLatitude0 = mLatitudes[0];
+        mLongitude0 = mLongitudes[0];
+        mMetersPerDegreeLon = METERS_PER_DEGREE * Math.cos(Math.toRadians(mLatitude0));
+        long fingerprint = mix(FNV_OFFSET, count);
+        for (int i = 0; i < count; i++) {
+            mX[i] = (mLongitudes[i] - mLongitude0) * mMetersPerDegreeLon;
+            mY[i] = (mLatitudes[i] - mLatitude0) * METERS_PER_DEGREE;
+            fingerprint = mix(mix(mix(fingerprint, fixed(mLatitudes[i], 1e7)), fixed(mLongitudes[i], 1e7)), mFloors[i]);
+        }
+
+        // Undirected edges in compressed rows
+        int[] begins = new int[edges.length()];
+        int[] ends = new int[edges.length()];
+        double[] weights = new double[edges.length()];
+        mAdjacencyOffsets = new int[count + 1];
+        fingerprint = mix(fingerprint, begins.length);
+        for (int i = 0; i < begins.length; i++) {
+            JSONObject edge = edges.getJSONObject(i);
+            int begin = edge.getInt("begin");
+            int end = edge.getInt("end");
+            if (begin < 0 || begin >= count || end < 0 || end >= count) {
+                throw new IllegalArgumentException("Edge " + i + " refers to a missing node");
+            }
+            boolean weighted = edge.has("weight");
+            double weight = weighted ? edge.getDouble("weight") : length(begin, end);
+            // Dijkstra settles a node for good, a negative edge would break that silently
+            if (!(weight >= 0) || Double.isInfinite(weight)) {
+                throw new IllegalArgumentException("Edge " + i + " has a negative or invalid weight");
+            }
+            begins[i] = begin;
+            ends[i] = end;
+            weights[i] = weight;
+            fingerprint = mix(mix(mix(fingerprint, begin), end), weighted ? fixed(weight, 1e3) : -1);
+            mAdjacencyOffsets[begin + 1]++;
+            mAdjacencyOffsets[end + 1]++;
+        }
+        for (int i = 0; i < count; i++) {
+            mAdjacencyOffsets[i + 1] += mAdjacencyOffsets[i];
+        }
+        mAdjacentNodes = new int[2 * begins.length];
+        mAdjacentWeights = new double[2 * begins.length];
+        int[] fill = Arrays.copyOf(mAdjacencyOffsets, count);
+        for (int i = 0; i < begins.length; i++) {
+            mAdjacentNodes[fill[begins[i]]] = ends[i];
+            mAdjacentWeights[fill[begins[i]]++] = weights[i];
+            mAdjacentNodes[fill[ends[i]]] = begins[i];
+            mAdjacentWeights[fill[ends[i]]++] = weights[i];
+        }
+
+        mExitIds = new String[exits.length()];
+        mExitNodes = new int[exits.length()];
+        mClosed = new boolean[exits.length()];
+        for (int e = 0; e < mExitIds.length; e++) {
+            try {
+                JSONObject exit = exits.getJSONObject(e);
+                mExitIds[e] = exit.getString("id");
+                mExitNodes[e] = exit.has("node") ? exit.getInt("node")
+                        : nearestNode(exit.getDouble("latitude"), exit.getDouble("longitude"), exit.getInt("floor"));
+            } catch (JSONException ex) {
+                throw new IllegalArgumentException("Exit " + e + ": " + ex.getMessage());
+            }
+            if (mExitNodes[e] < 0 || mExitNodes[e] >= count) {
+                throw new IllegalArgumentException("No node for exit " + mExitIds[e]);
+            }
+            mClosed[e] = closedExitIds.contains(mExitIds[e]);
+        }
+        fingerprint = mix(fingerprint, mExitIds.length);
+        for (int e = 0; e < mExitIds.length; e++) {
+            fingerprint = mix(mix(fingerprint, mExitNodes[e]), mExitIds[e].length());
+            for (int c = 0; c < mExitIds[e].length(); c++) {
+                fingerprint = mix(fingerprint, mExitIds[e].charAt(c));
+            }
+        }
+        mFingerprint = String.format("%016x", fingerprint);
+
+        mDistance = new double[count];
+        mNext = new int[count];
+        mExit = new int[count];
+        Arrays.fill(mDistance, Double.POSITIVE_INFINITY);
+        Arrays.fill(mNext, -1);
+        Arrays.fill(mExit, -1);
+        Heap heap = new Heap();
+        for (int e = 0; e < mExitIds.length; e++) {
+            seedExit(e, heap, null);
+        }
+        propagate(heap, null);
+        for (int i = 0; i < count; i++) {
+            if (!mRasters.containsKey(mFloors[i])) {
+                mRasters.put(mFloors[i], buildRaster(mFloors[i]));
+            }
+        }
+    }
+
+    /**
+     * Guidance for a position: { version, exitId, distance, node, next },
+     * node being where to head first and next the hop after it, each
+     * { latitude, longitude, floor }. exitId, distance and next are null if
+     * no open exit can be reached.
+     * @param latitude
+     * @param longitude
+     * @param floor
+     * @return
+     * @throws JSONException
+     */
+    public synchronized JSONObject guidance(double latitude, double longitude, int floor) throws JSONException {
+        double x = (longitude - mLongitude0) * mMetersPerDegreeLon;
+        double y = (latitude - mLatitude0) * METERS_PER_DEGREE;
+        int node = -1;
+        Raster raster = mRasters.get(floor);
+        if (raster != null) {
+            int col = (int) Math.floor((x - raster.x0) / raster.cellMeters);
+            int row = (int) Math.floor((y - raster.y0) / raster.cellMeters);
+            if (col >= 0 && col < raster.width && row >= 0 && row < raster.height) {
+                node = raster.node[row * raster.width + col];
+            }
+        }
+        if (node < 0) {
+            // Outside the rasters or cut off from every exit
+            node = nearestNode(latitude, longitude, floor);
+        }
+        JSONObject result = new JSONObject();
+        result.put("version", mVersion);
+        if (node < 0) {
+            result.put("exitId", JSONObject.NULL);
+            result.put("distance", JSONObject.NULL);
+            result.put("node", JSONObject.NULL);
+            result.put("next", JSONObject.NULL);
+            return result;
+        }
+        boolean reachable = mExit[node] >= 0;
+        double dx = mX[node] - x;
+        double dy = mY[node] - y;
+        result.put("exitId", reachable ? mExitIds[mExit[node]] : JSONObject.NULL);
+        result.put("distance", reachable ? Math.sqrt(dx * dx + dy * dy) + mDistance[node] : JSONObject.NULL);
+        result.put("node", nodeJSON(node));
+        result.put("next", mNext[node] >= 0 ? nodeJSON(mNext[node]) : JSONObject.NULL);
+        return result;
+    }
+
+    /**
+     * Closes an exit and repairs the nodes that led to it
+     * @param exitId
+     * @return the delta, see delta()
+     * @throws JSONException
+     */
+    public synchronized JSONObject closeExit(String exitId) throws JSONException {
+        int exit = exitIndex(exitId);
+        boolean[] changed = new boolean[mDistance.length];
+        if (!mClosed[exit]) {
+            mClosed[exit] = true;
+            ArrayList<Integer> affected = new ArrayList<Integer>();
+            for (int i = 0; i < mExit.length; i++) {
+                if (mExit[i] == exit) {
+                    mDistance[i] = Double.POSITIVE_INFINITY;
+                    mNext[i] = -1;
+                    mExit[i] = -1;
+                    changed[i] = true;
+                    affected.add(i);
+                }
+            }
+            Heap heap = new Heap();
+            // Distances only grow, so the rest of the field still holds
+            for (int i : affected) {
+                for (int k = mAdjacencyOffsets[i]; k < mAdjacencyOffsets[i + 1]; k++) {
+                    int neighbour = mAdjacentNodes[k];
+                    double distance = mDistance[neighbour] + mAdjacentWeights[k];
+                    if (mExit[neighbour] >= 0 && distance < mDistance[i]) {
+                        mDistance[i] = distance;
+                        mNext[i] = neighbour;
+                        mExit[i] = mExit[neighbour];
+                    }
+                }
+                if (mExit[i] >= 0) {
+                    heap.push(mDistance[i], i);
+                }
+            }
+            for (int e = 0; e < mExitIds.length; e++) {
+                seedExit(e, heap, changed);
+            }
+            propagate(heap, changed);
+        }
+        return delta(exit, changed);
+    }
+
+    /**
+     * Opens a closed exit again
+     * @param exitId
+     * @return the delta, see delta()
+     * @throws JSONException
+     */
+    public synchronized JSONObject openExit(String exitId) throws JSONException {
+        int exit = exitIndex(exitId);
+        boolean[] changed = new boolean[mDistance.length];
+        if (mClosed[exit]) {
+            mClosed[exit] = false;
+            Heap heap = new Heap();
+            seedExit(exit, heap, changed);
+            propagate(heap, changed);
+        }
+        return delta(exit, changed);
+    }
+
+    /**
+     * Closes and opens exits to match the given closed ids, e.g. those of the
+     * field this one replaces. Ids not among the exits are ignored.
+     * @param closedExitIds
+     * @throws JSONException
+     */
+    public synchronized void setClosedExits(Collection<String> closedExitIds) throws JSONException {
+        for (int e = 0; e < mExitIds.length; e++) {
+            boolean closed = closedExitIds.contains(mExitIds[e]);
+            if (closed && !mClosed[e]) {
+                closeExit(mExitIds[e]);
+            } else if (!closed && mClosed[e]) {
+                openExit(mExitIds[e]);
+            }
+        }
+    }
+
+    public synchronized ArrayList<String> getClosedExits() {
+        ArrayList<String> closed = new ArrayList<String>();
+        for (int e = 0; e < mExitIds.length; e++) {
+            if (mClosed[e]) {
+                closed.add(mExitIds[e]);
+            }
+        }
+        return closed;
+    }
+
+    /**
+     * Applies a delta of closeExit() or openExit() from a field built from the
+     * same graph and exits. Deltas of one field must be applied in the order
+     * it returned them: one made from another version than this field's, or
+     * with another fingerprint, is rejected. The delta is checked before
+     * anything changes, so a bad one leaves the field as it was.
+     * @param delta see delta()
+     * @return the delta as applied here, with this field's version
+     * @throws JSONException
+     */
+    public synchronized JSONObject applyDelta(JSONObject delta) throws JSONException {
+        if (!mFingerprint.equals(delta.getString("fingerprint"))) {
+            throw new IllegalArgumentException("Delta is for another graph or exits");
+        }
+        int baseVersion = delta.getInt("baseVersion");
+        if (baseVersion != mVersion) {
+            throw new IllegalArgumentException("Delta is for version " + baseVersion + ", the field is at version " + mVersion);
+        }
+        int exit = exitIndex(delta.getString("exitId"));
+        boolean closed = delta.getBoolean("closed");
+        JSONArray nodes = delta.getJSONArray("nodes");
+        JSONArray distances = delta.getJSONArray("distances");
+        JSONArray next = delta.getJSONArray("next");
+        JSONArray exits = delta.getJSONArray("exits");
+        int count = nodes.length();
+        if (distances.length() != count || next.length() != count || exits.length() != count) {
+            throw new IllegalArgumentException("Delta arrays differ in length");
+        }
+        int[] deltaNodes = new int[count];
+        double[] deltaDistances = new double[count];
+        int[] deltaNext = new int[count];
+        int[] deltaExits = new int[count];
+        for (int i = 0; i < count; i++) {
+            deltaNodes[i] = nodes.getInt(i);
+            deltaNext[i] = next.getInt(i);
+            deltaExits[i] = exits.isNull(i) ? -1 : exitIndex(exits.getString(i));
+            deltaDistances[i] = deltaExits[i] >= 0 ? distances.getDouble(i) : Double.POSITIVE_INFINITY;
+            if (deltaNodes[i] < 0 || deltaNodes[i] >= mDistance.length
+                    || deltaNext[i] < -1 || deltaNext[i] >= mDistance.length) {
+                throw new IllegalArgumentException("Delta node " + i + " is not in the graph");
+            }
+        }
+        mClosed[exit] = closed;
+        boolean[] changed = new boolean[mDistance.length];
+        for (int i = 0; i < count; i++) {
+            int node = deltaNodes[i];
+            mDistance[node] = deltaDistances[i];
+            mNext[node] = deltaNext[i];
+            mExit[node] = deltaExits[i];
+            changed[node] = true;
+        }
+        return delta(exit, changed);
+    }
+
+    public synchronized int getVersion() {
+        return mVersion;
+    }
+
+    /**
+     * Hash of the graph and exits the field was built from, the same on iOS
+     */
+    public String getFingerprint() {
+        return mFingerprint;
+    }
+
+    public int getNodeCount() {
+        return mDistance.length;
+    }
+
+    public int getExitCount() {
+        return mExitIds.length;
+    }
+
+    private int exitIndex(String exitId) {
+        for (int e = 0; e < mExitIds.length; e++) {
+            if (mExitIds[e].equals(exitId)) {
+                return e;
+            }
+        }
+        throw new IllegalArgumentException("Unknown exit " + exitId);
+    }
+
+    private void seedExit(int exit, Heap heap, boolean[] changed) {
+        int node = mExitNodes[exit];
+        if (mClosed[exit] || mDistance[node] <= 0) {
+            return;
+        }
+        mDistance[node] = 0;
+        mNext[node] = -1;
+        mExit[node] = exit;
+        if (changed != null) {
+            changed[node] = true;
+        }
+        heap.push(0, node);
+    }
+
+    private void propagate(Heap heap, boolean[] changed) {
+        while (!heap.isEmpty()) {
+            double distance = heap.peekKey();
+            int node = heap.pop();
+            if (distance > mDistance[node]) {
+                continue;
+            }
+            for (int k = mAdjacencyOffsets[node]; k < mAdjacencyOffsets[node + 1]; k++) {
+                int neighbour = mAdjacentNodes[k];
+                double candidate = distance + mAdjacentWeights[k];
+                if (candidate < mDistance[neighbour]) {
+                    mDistance[neighbour] = candidate;
+                    mNext[neighbour] = node;
+                    mExit[neighbour] = mExit[node];
+                    if (changed != null) {
+                        changed[neighbour] = true;
+                    }
+                    heap.push(candidate, neighbour);
+                }
+            }
+        }
+    }
+
+    /**
+     * { version, baseVersion, fingerprint, exitId, closed, nodes, distances,
+     * next, exits, floors }: the changed nodes with their new distance (null
+     * if unreachable), next hop node (-1 at an exit or if unreachable) and
+     * exit id, and the floors whose rasters were rebuilt. baseVersion is the
+     * version before the change. Rebuilds those rasters and bumps the version
+     * if anything changed.
+     */
+    private JSONObject delta(int exit, boolean[] changed) throws JSONException {
+        int baseVersion = mVersion;
+        JSONArray nodes = new JSONArray();
+        JSONArray distances = new JSONArray();
+        JSONArray next = new JSONArray();
+        JSONArray exits = new JSONArray();
+        ArrayList<Integer> floors = new ArrayList<Integer>();
+        for (int i = 0; i < changed.length; i++) {
+            if (!changed[i]) {
+                continue;
+            }
+            nodes.put(i);
+            distances.put(mExit[i] >= 0 ? mDistance[i] : JSONObject.NULL);
+            next.put(mNext[i]);
+            exits.put(mExit[i] >= 0 ? mExitIds[mExit[i]] : JSONObject.NULL);
+            if (!floors.contains(mFloors[i])) {
+                floors.add(mFloors[i]);
+            }
+        }
+        for (int floor : floors) {
+            mRasters.put(floor, buildRaster(floor));
+        }
+        if (nodes.length() > 0) {
+            mVersion++;
+        }
+        JSONObject delta = new JSONObject();
+        delta.put("version", mVersion);
+        delta.put("baseVersion", baseVersion);
+        delta.put("fingerprint", mFingerprint);
+        delta.put("exitId", mExitIds[exit]);
+        delta.put("closed", mClosed[exit]);
+        delta.put("nodes", nodes);
+        delta.put("distances", distances);
+        delta.put("next", next);
+        delta.put("exits", exits);
+        delta.put("floors", new JSONArray(floors));
+        return delta;
+    }
+
+    /**
+     * Raster of the node to head for from each cell of a floor: seeded with
+     * the reachable nodes, then two chamfer passes carry the best node to
+     * every cell by straight line distance plus the node's distance
+     */
+    private Raster buildRaster(int floor) {
+        double minX = Double.POSITIVE_INFINITY, minY = Double.POSITIVE_INFINITY;
+        double maxX = Double.NEGATIVE_INFINITY, maxY = Double.NEGATIVE_INFINITY;
+        for (int i = 0; i < mFloors.length; i++) {
+            if (mFloors[i] == floor) {
+                minX = Math.min(minX, mX[i]);
+                minY = Math.min(minY, mY[i]);
+                maxX = Math.max(maxX, mX[i]);
+                maxY = Math.max(maxY, mY[i]);
+            }
+        }
+        Raster raster = new Raster();
+        raster.x0 = minX - RASTER_MARGIN_METERS;
+        raster.y0 = minY - RASTER_MARGIN_METERS;
+        double spanX = maxX - minX + 2 * RASTER_MARGIN_METERS;
+        double spanY = maxY - minY + 2 * RASTER_MARGIN_METERS;
+        double cellMeters = Math.max(mCellMeters, Math.sqrt(spanX * spanY / MAX_RASTER_CELLS));
+        raster.cellMeters = cellMeters;
+        raster.width = (int) Math.ceil(spanX / cellMeters);
+        raster.height = (int) Math.ceil(spanY / cellMeters);
+        int cells = raster.width * raster.height;
+        float[] distance = raster.distance = new float[cells];
+        int[] best = raster.node = new int[cells];
+        Arrays.fill(distance, Float.POSITIVE_INFINITY);
+        Arrays.fill(best, -1);
+        for (int i = 0; i < mFloors.length; i++) {
+            if (mFloors[i] != floor || mExit[i] < 0) {
+                continue;
+            }
+            int col = (int) ((mX[i] - raster.x0) / cellMeters);
+            int row = (int) ((mY[i] - raster.y0) / cellMeters);
+            double dx = raster.x0 + (col + 0.5) * cellMeters - mX[i];
+            double dy = raster.y0 + (row + 0.5) * cellMeters - mY[i];
+            float value = (float) (mDistance[i] + Math.sqrt(dx * dx + dy * dy));
+            int cell = row * raster.width + col;
+            if (value < distance[cell]) {
+                distance[cell] = value;
+                best[cell] = i;
+            }
+        }
+        float straight = (float) cellMeters;
+        float diagonal = (float) (cellMeters * Math.sqrt(2));
+        int width = raster.width;
+        for (int row = 0; row < raster.height; row++) {
+            for (int col = 0; col < width; col++) {
+                int cell = row * width + col;
+                if (col > 0) {
+                    relaxCell(distance, best, cell, cell - 1, straight);
+                }
+                if (row > 0) {
+                    relaxCell(distance, best, cell, cell - width, straight);
+                    if (col > 0) {
+                        relaxCell(distance, best, cell, cell - width - 1, diagonal);
+                    }
+                    if (col + 1 < width) {
+                        relaxCell(distance, best, cell, cell - width + 1, diagonal);
+                    }
+                }
+            }
+        }
+        for (int row = raster.height - 1; row >= 0; row--) {
+            for (int col = width - 1; col >= 0; col--) {
+                int cell = row * width + col;
+                if (col + 1 < width) {
+                    relaxCell(distance, best, cell, cell + 1, straight);
+                }
+                if (row + 1 < raster.height) {
+                    relaxCell(distance, best, cell, cell + width, straight);
+                    if (col + 1 < width) {
+                        relaxCell(distance, best, cell, cell + width + 1, diagonal);
+                    }
+                    if (col > 0) {
+                        relaxCell(distance, best, cell, cell + width - 1, diagonal);
+                    }
+                }
+            }
+        }
+        return raster;
+    }
+
+    private static void relaxCell(float[] distance, int[] best, int cell, int from, float step) {
+        float candidate = distance[from] + step;
+        if (candidate < distance[cell]) {
+            distance[cell] = candidate;
+            best[cell] = best[from];
+        }
+    }
+
+    private int nearestNode(double latitude, double longitude, int floor) {
+        double x = (longitude - mLongitude0) * mMetersPerDegreeLon;
+        double y = (latitude - mLatitude0) * METERS_PER_DEGREE;
+        int nearest = -1;
+        double nearestDistance = Double.POSITIVE_INFINITY;
+        for (int i = 0; i < mFloors.length; i++) {
+            if (mFloors[i] != floor) {
+                continue;
+            }
+            double dx = mX[i] - x;
+            double dy = mY[i] - y;
+            if (dx * dx + dy * dy < nearestDistance) {
+                nearestDistance = dx * dx + dy * dy;
+                nearest = i;
+            }
+        }
+        return nearest;
+    }
+
+    private static long mix(long hash, long value) {
+        for (int i = 0; i < 64; i += 8) {
+            hash ^= (value >>> i) & 0xff;
+            hash *= FNV_PRIME;
+        }
+        return hash;
+    }
+
+    /**
+     * Rounds to a fixed point integer for the fingerprint, half up as on iOS
+     */
+    private static long fixed(double value, double scale) {
+        return (long) Math.floor(value * scale + 0.5);
+    }
+
+    private double length(int a, int b) {
+        double dx = (mLongitudes[b] - mLongitudes[a]) * METERS_PER_DEGREE * Math.cos(Math.toRadians(mLatitudes[a]));
+        double dy = (mLatitudes[b] - mLatitudes[a]) * METERS_PER_DEGREE;
+        double dz = (mFloors[b] - mFloors[a]) * FLOOR_HEIGHT_METERS;
+        return Math.sqrt(dx * dx + dy * dy + dz * dz);
+    }
+
+    private JSONObject nodeJSON(int node) throws JSONException {
+        JSONObject result = new JSONObject();
+        result.put("latitude", mLatitudes[node]);
+        result.put("longitude", mLongitudes[node]);
+        result.put("floor", mFloors[node]);
+        return result;
+    }
+}
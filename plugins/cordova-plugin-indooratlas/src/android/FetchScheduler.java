@@ -0,0 +1,469 @@
+package com.ialocation.plugin;
+
+import org.json.JSONException;
+import org.json.JSONObject;
+
+import java.util.ArrayDeque;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.Iterator;
+import java.util.Random;
+
+/**
+ * Single entry point for the network fetches of the plugin: floor plan
+ * metadata, images, tiles, graphs and speculative prefetch.
+ *
+ * Requests wait in one queue per priority and start in priority order under a
+ * global and a per-host concurrency cap. Requests for the same key share one
+ * fetch, which is only aborted once every request waiting for it has been
+ * cancelled. Failed fetches are retried with jittered exponential backoff on
+ * the TimingWheel. A host's cap is halved on a retryable (transport) failure
+ * and grows back by one per success; a terminal failure such as an unknown
+ * resource says nothing about the link and leaves it alone. Prefetch for a host is held back while its measured bandwidth
+ * or latency shows a slow link, unless nothing else is running there.
+ */
+public final class FetchScheduler {
+    public static final int PRIORITY_VISIBLE = 0;
+    public static final int PRIORITY_NAVIGATION = 1;
+    public static final int PRIORITY_PREFETCH = 2;
+    private static final int PRIORITY_COUNT = 3;
+
+    public static final int DEFAULT_MAX_CONCURRENT = 6;
+    public static final int DEFAULT_MAX_PER_HOST = 2;
+    private static final int MAX_ATTEMPTS = 4;
+    private static final long BACKOFF_BASE_MS = 500;
+    private static final long BACKOFF_MAX_MS = 30000;
+    private static final double SLOW_BYTES_PER_MS = 25;
+    private static final double SLOW_LATENCY_MS = 2000;
+    private static final double EWMA_WEIGHT = 0.25;
+
+    private static FetchScheduler sShared;
+
+    /**
+     * Aborts a started fetch
+     */
+    public interface Cancellable {
+        void cancel();
+    }
+
+    /**
+     * Completion of one fetch attempt, reported exactly once
+     * @param <T>
+     */
+    public interface Result<T> {
+        /**
+         * @param value
+         * @param bytes transferred, 0 if unknown
+         */
+        void success(T value, long bytes);
+
+        /**
+         * @param error
+         * @param retryable whether another attempt could succeed, i.e. transport errors; not
+         *                  for a resource that does not exist
+         */
+        void failure(Exception error, boolean retryable);
+    }
+
+    /**
+     * Starts one attempt of a fetch, on the thread that calls the scheduler
+     * @param <T>
+     */
+    public interface Fetcher<T> {
+        Cancellable start(Result<T> result);
+    }
+
+    private static final class Host {
+        final String name;
+        int cap;
+        int active;
+        double bytesPerMs = -1;
+        double latencyMs = -1;
+
+        Host(String name, int cap) {
+            this.name = name;
+            this.cap = cap;
+        }
+
+        boolean isSlow() {
+            return (bytesPerMs >= 0 && bytesPerMs < SLOW_BYTES_PER_MS) || latencyMs > SLOW_LATENCY_MS;
+        }
+    }
+
+    private static final class Job {
+        final String key;
+        final Host host;
+        final Fetcher<Object> fetcher;
+        final ArrayList<Deferred<Object>> waiters = new ArrayList<Deferred<Object>>(1);
+        final long traceId;
+        int priority;
+        int attempts;
+        boolean queued;
+        boolean inFlight;
+        boolean done;
+        Cancellable running;
+        long startNanos;
+        TimingWheel.Timeout retry;
+
+        Job(String key, Host host, int priority, Fetcher<Object> fetcher, long traceId) {
+            this.key = key;
+            this.traceId = traceId;
+            this.host = host;
+            this.priority = priority;
+            this.fetcher = fetcher;
+        }
+    }
+
+    /**
+     * One attempt of a job; reports of superseded attempts are ignored
+     */
+    private final class Attempt implements Result<Object> {
+        final Job job;
+        final int number;
+
+        Attempt(Job job, int number) {
+            this.job = job;
+            this.number = number;
+        }
+
+        @Override
+        public void success(Object value, long bytes) {
+            onSuccess(this, value, bytes);
+        }
+
+        @Override
+        public void failure(Exception error, boolean retryable) {
+            onFailure(this, error, retryable);
+        }
+    }
+
+    private final Object mLock = new Object();
+    private final ArrayDeque<Job>[] mQueues;
+    private final HashMap<String, Job> mJobs = new HashMap<String, Job>();
+    private final HashMap<String, Host> mHosts = new HashMap<String, Host>();
+    private final int mMaxConcurrent;
+    private final int mMaxPerHost;
+    private final TimingWheel mWheel;
+    private final Random mJitter = new Random();
+    private int mActive;
+    private long mNextJobId;
+    private int mStarted;
+    private int mDeduplicated;
+    private int mRetried;
+    private int mCompleted;
+    private int mFailed;
+    private int mCancelled;
+
+    /**
+     * Returns the process wide scheduler
+     * @return
+     */
+    public static synchronized FetchScheduler getShared() {
+        if (sShared == null) {
+            sShared = new FetchScheduler(DEFAULT_MAX_CONCURRENT, DEFAULT_MAX_PER_HOST, TimingWheel.getShared());
+        }
+        return sShared;
+    }
+
+    /**
+     * The constructor
+     * @param maxConcurrent fetches running at once over all hosts
+     * @param maxPerHost fetches running at once per host
+     * @param wheel timers for retry backoff
+     */
+    @SuppressWarnings("unchecked")
+    public FetchScheduler(int maxConcurrent, int maxPerHost, TimingWheel wheel) {
+        mMaxConcurrent = Math.max(1, maxConcurrent);
+        mMaxPerHost = Math.max(1, maxPerHost);
+        mWheel = wheel;
+        mQueues = new ArrayDeque[PRIORITY_COUNT];
+        for (int i = 0; i < PRIORITY_COUNT; i++) {
+            mQueues[i] = new ArrayDeque<Job>();
+        }
+    }
+
+    /**
+     * Queues a fetch, or joins the one already queued or running for the key.
+     * Cancelling the returned Deferred withdraws only this request.
+     * @param key identifies the resource, e.g. "floorplan:<id>" or a URL
+     * @param host requests to the same host share its concurrency cap
+     * @param priority one of the PRIORITY_ constants
+     * @param fetcher
+     * @return
+     */
+    @SuppressWarnings("unchecked")
+    public <T> Deferred<T> fetch(String key, String host, int priority, Fetcher<T> fetcher) {
+        priority = Math.max(PRIORITY_VISIBLE, Math.min(PRIORITY_PREFETCH, priority));
+        final Deferred<Object> waiter = new Deferred<Object>(null);
+        final Job job;
+        synchronized (mLock) {
+            Job existing = mJobs.get(key);
+            if (existing != null) {
+                mDeduplicated++;
+                job = existing;
+                if (priority < job.priority) {
+                    if (job.queued) {
+                        mQueues[job.priority].remove(job);
+                        mQueues[priority].add(job);
+                    }
+                    job.priority = priority;
+                }
+            } else {
+                job = new Job(key, hostFor(host), priority, (Fetcher<Object>) fetcher, ++mNextJobId);
+                mJobs.put(key, job);
+                enqueue(job);
+            }
+            job.waiters.add(waiter);
+        }
+        waiter.whenComplete(new Deferred.Callback<Object>() {
+            @Override
+            public void onSuccess(Object value) {
+            }
+
+            @Override
+            public void onFailure(Exception error) {
+                if (waiter.getToken().isCancelled()) {
+                    withdraw(job, waiter);
+                }
+            }
+        });
+        pump();
+        return (Deferred<T>) waiter;
+    }
+
+    /**
+     * Counters and per host state
+     * @return
+     * @throws JSONException
+     */
+    public JSONObject getReport() throws JSONException {
+        JSONObject report = new JSONObject();
+        synchronized (mLock) {
+            report.put("active", mActive);
+            report.put("queuedVisible", mQueues[PRIORITY_VISIBLE].size());
+            report.put("queuedNavigation", mQueues[PRIORITY_NAVIGATION].size());
+            report.put("queuedPrefetch", mQueues[PRIORITY_PREFETCH].size());
+            report.put("started", mStarted);
+            report.put("deduplicated", mDeduplicated);
+            report.put("retried", mRetried);
+            report.put("completed", mCompleted);
+            report.put("failed", mFailed);
+            report.put("cancelled", mCancelled);
+            JSONObject hosts = new JSONObject();
+            for (Host host : mHosts.values()) {
+                JSONObject item = new JSONObject();
+                item.put("cap", host.cap);
+                item.put("active", host.active);
+                item.put("bytesPerMs", host.bytesPerMs);
+                item.put("latencyMs", host.latencyMs);
+                item.put("slow", host.isSlow());
+                hosts.put(host.name, item);
+            }
+            report.put("hosts", hosts);
+        }
+        return report;
+    }
+
+    private Host hostFor(String name) {
+        Host host = mHosts.get(name);
+        if (host == null) {
+            host = new Host(name, mMaxPerHost);
+            mHosts.put(name, host);
+        }
+        return host;
+    }
+
+    private void enqueue(Job job) {
+        job.queued = true;
+        mQueues[job.priority].add(job);
+    }
+
+    /**
+     * Starts as many queued jobs as the caps allow, outside the lock
+     */
+    private void pump() {
+        ArrayList<Attempt> starting = null;
+        synchronized (mLock) {
+            for (int priority = 0; priority < PRIORITY_COUNT && mActive < mMaxConcurrent; priority++) {
+                Iterator<Job> it = mQueues[priority].iterator();
+                while (it.hasNext() && mActive < mMaxConcurrent) {
+                    Job job = it.next();
+                    Host host = job.host;
+                    if (host.active >= host.cap) {
+                        continue;
+                    }
+                    if (priority == PRIORITY_PREFETCH && host.isSlow() && host.active > 0) {
+                        continue;
+                    }
+                    it.remove();
+                    job.queued = false;
+                    job.attempts++;
+                    job.inFlight = true;
+                    job.startNanos = System.nanoTime();
+                    host.active++;
+                    mActive++;
+                    mStarted++;
+                    TraceRecorder.asyncBegin("fetch", job.key, job.traceId);
+                    TraceRecorder.counter("fetch", "active", mActive);
+                    if (starting == null) {
+                        starting = new ArrayList<Attempt>();
+                    }
+                    starting.add(new Attempt(job, job.attempts));
+                }
+            }
+        }
+        if (starting == null) {
+            return;
+        }
+        for (Attempt attempt : starting) {
+            Job job = attempt.job;
+            Cancellable running;
+            try {
+                running = job.fetcher.start(attempt);
+            } catch (RuntimeException ex) {
+                onFailure(attempt, ex, false);
+                continue;
+            }
+            boolean abort = false;
+            synchronized (mLock) {
+                if (isCurrent(attempt)) {
+                    job.running = running;
+                } else {
+                    // Withdrawn while starting
+                    abort = job.done && job.waiters.isEmpty();
+                }
+            }
+            if (abort && running != null) {
+                running.cancel();
+            }
+        }
+    }
+
+    private void onSuccess(Attempt attempt, Object value, long bytes) {
+        Job job = attempt.job;
+        ArrayList<Deferred<Object>> waiters;
+        synchronized (mLock) {
+            if (!isCurrent(attempt)) {
+                return;
+            }
+            release(job);
+            double elapsedMs = Math.max(1, (System.nanoTime() - job.startNanos) / 1e6);
+            Host host = job.host;
+            host.latencyMs = ewma(host.latencyMs, elapsedMs);
+            if (bytes > 0) {
+                host.bytesPerMs = ewma(host.bytesPerMs, bytes / elapsedMs);
+            }
+            host.cap = Math.min(mMaxPerHost, host.cap + 1);
+            finish(job);
+            mCompleted++;
+            waiters = new ArrayList<Deferred<Object>>(job.waiters);
+        }
+        for (Deferred<Object> waiter : waiters) {
+            waiter.resolve(value);
+        }
+        pump();
+    }
+
+    private void onFailure(Attempt attempt, Exception error, boolean retryable) {
+        final Job job = attempt.job;
+        ArrayList<Deferred<Object>> waiters = null;
+        synchronized (mLock) {
+            if (!isCurrent(attempt)) {
+                return;
+            }
+            release(job);
+            if (retryable) {
+                job.host.cap = Math.max(1, job.host.cap / 2);
+            }
+            if (retryable && job.attempts < MAX_ATTEMPTS) {
+                mRetried++;
+                long backoff = Math.min(BACKOFF_MAX_MS, BACKOFF_BASE_MS << (job.attempts - 1));
+                backoff = backoff / 2 + (long) (mJitter.nextDouble() * backoff / 2);
+                job.retry = mWheel.schedule(backoff, new Runnable() {
+                    @Override
+                    public void run() {
+                        synchronized (mLock) {
+                            if (job.done) {
+                                return;
+                            }
+                            job.retry = null;
+                            enqueue(job);
+                        }
+                        pump();
+                    }
+                });
+            } else {
+                finish(job);
+                mFailed++;
+                waiters = new ArrayList<Deferred<Object>>(job.waiters);
+            }
+        }
+        if (waiters != null) {
+            for (Deferred<Object> waiter : waiters) {
+                waiter.reject(error);
+            }
+        }
+        pump();
+    }
+
+    /**
+     * Drops a cancelled request; the fetch stops once nobody waits for it
+     */
+    private void withdraw(Job job, Deferred<Object> waiter) {
+        Cancellable running = null;
+        synchronized (mLock) {
+            if (!job.waiters.remove(waiter) || job.done || !job.waiters.isEmpty()) {
+                return;
+            }
+            mCancelled++;
+            if (job.queued) {
+                mQueues[job.priority].remove(job);
+                job.queued = false;
+            } else if (job.inFlight) {
+                running = job.running;
+                release(job);
+            } else if (job.retry != null) {
+                job.retry.cancel();
+                job.retry = null;
+            }
+            finish(job);
+        }
+        if (running != null) {
+            running.cancel();
+        }
+        pump();
+    }
+
+    /**
+     * Caller holds mLock
+     */
+    private boolean isCurrent(Attempt attempt) {
+        return !attempt.job.done && attempt.job.inFlight && attempt.job.attempts == attempt.number;
+    }
+
+    /**
+     * Frees the slots of a running job. Caller holds mLock.
+     */
+    private void release(Job job) {
+        job.host.active--;
+        mActive--;
+        TraceRecorder.asyncEnd("fetch", job.key, job.traceId);
+        TraceRecorder.counter("fetch", "active", mActive);
+        job.inFlight = false;
+        job.running = null;
+    }
+
+    /**
+     * Caller holds mLock
+     */
+    private void finish(Job job) {
+        job.done = true;
+        if (mJobs.get(job.key) == job) {
+            mJobs.remove(job.key);
+        }
+    }
+
+    private static double ewma(double current, double sample) {
+        return current < 0 ? sample : current + EWMA_WEIGHT * (sample - current);
+    }
+}
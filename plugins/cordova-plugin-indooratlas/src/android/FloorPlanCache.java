@@ -0,0 +1,79 @@
+package com.ialocation.plugin;
+
+import com.indooratlas.android.sdk.resources.IAFloorPlan;
+
+import java.util.Iterator;
+import java.util.LinkedHashMap;
+import java.util.Map;
+
+/**
+ * Least recently used cache of fetched floor plans, so that conversions and
+ * repeated fetches of the same plan do not go to the network again.
+ */
+public final class FloorPlanCache implements CacheBudget.Cache {
+    // Metadata only; the SDK does not hand out decoded images
+    private static final long ENTRY_OVERHEAD_BYTES = 512;
+
+    private final LinkedHashMap<String, IAFloorPlan> mFloorPlans = new LinkedHashMap<String, IAFloorPlan>(8, 0.75f, true);
+    private final CacheBudget mBudget;
+    private long mResidentBytes;
+
+    /**
+     * The constructor
+     * @param budget
+     */
+    public FloorPlanCache(CacheBudget budget) {
+        mBudget = budget;
+    }
+
+    public synchronized IAFloorPlan get(String floorplanId) {
+        return mFloorPlans.get(floorplanId);
+    }
+
+    public void put(IAFloorPlan floorPlan) {
+        synchronized (this) {
+            IAFloorPlan previous = mFloorPlans.put(floorPlan.getId(), floorPlan);
+            if (previous != null) {
+                mResidentBytes -= sizeOf(previous);
+            }
+            mResidentBytes += sizeOf(floorPlan);
+        }
+        mBudget.enforce();
+    }
+
+    @Override
+    public String getName() {
+        return "floorPlans";
+    }
+
+    @Override
+    public int getTier() {
+        return CacheBudget.TIER_WARM;
+    }
+
+    @Override
+    public synchronized long residentBytes() {
+        return mResidentBytes;
+    }
+
+    @Override
+    public synchronized long trim(long bytes) {
+        long freed = 0;
+        Iterator<Map.Entry<String, IAFloorPlan>> it = mFloorPlans.entrySet().iterator();
+        while (freed < bytes && it.hasNext()) {
+            freed += sizeOf(it.next().getValue());
+            it.remove();
+        }
+        mResidentBytes -= freed;
+        return freed;
+    }
+
+    private static long sizeOf(IAFloorPlan floorPlan) {
+        long chars = length(floorPlan.getId()) + length(floorPlan.getName()) + length(floorPlan.getUrl());
+        return ENTRY_OVERHEAD_BYTES + 2 * chars;
+    }
+
+    private static int length(String value) {
+        return value != null ? value.length() : 0;
+    }
+}
@@ -0,0 +1,244 @@
+package com.ialocation.plugin;
+
+import org.json.JSONArray;
+import org.json.JSONException;
+import org.json.JSONObject;
+
+/**
+ * Floor hysteresis. The SDK reports a floor with every fix, and near atria
+ * it may flip to a neighbouring floor for a few fixes with low certainty,
+ * which would reload the floor plan overlay and recompute routes each time.
+ *
+ * A fix on another floor than the confirmed one makes that floor tentative.
+ * It is confirmed right away if the floor certainty is at least
+ * CONFIRM_CERTAINTY next to a vertical connector of the wayfinding graph (an
+ * edge between two floors: stairs, escalator or elevator), otherwise once
+ * the fixes have stayed on it for a dwell time on the shared TimingWheel:
+ * DWELL_NEAR_CONNECTOR_MS next to a connector, DWELL_MS elsewhere. A fix
+ * back on the confirmed floor drops the tentative floor. Without a graph
+ * no position counts as next to a connector, so every change waits for the
+ * long dwell.
+ *
+ * The listener is called under the lock, so events arrive in order. A new
+ * listener first gets the confirmed floor, and the tentative one if any.
+ */
+public final class FloorStateMachine {
+    public static final float CONFIRM_CERTAINTY = 0.9f;
+    public static final float MIN_CERTAINTY = 0.5f;
+    public static final long DWELL_NEAR_CONNECTOR_MS = 2000;
+    public static final long DWELL_MS = 8000;
+    public static final double CONNECTOR_RADIUS_METERS = 15;
+
+    private static final double METERS_PER_DEGREE = 6371000.0 * Math.PI / 180.0;
+
+    public interface Listener {
+        /**
+         * Called when a floor becomes tentative or confirmed. A tentative
+         * event with floor equal to the confirmed floor means the tentative
+         * floor was dropped.
+         * @param confirmed
+         * @param floor
+         * @param confirmedFloor floor confirmed before this event, or floor if none was
+         * @param certainty NaN if unknown
+         * @param nearConnector
+         * @param time of the fix
+         */
+        void onFloorChange(boolean confirmed, int floor, int confirmedFloor, float certainty,
+                           boolean nearConnector, long time);
+    }
+
+    private final TimingWheel mTimingWheel;
+    private Listener mListener;
+
+    private double[] mConnectorLatitudes = new double[0];
+    private double[] mConnectorLongitudes = new double[0];
+    private int[] mConnectorFloors = new int[0];
+
+    private boolean mHasFloor;
+    private int mConfirmedFloor;
+    private float mConfirmedCertainty;
+    private boolean mConfirmedNearConnector;
+    private long mConfirmedTime;
+    private boolean mHasTentative;
+    private int mTentativeFloor;
+    private TimingWheel.Timeout mDwell;
+    private float mLastCertainty;
+    private boolean mLastNearConnector;
+    private long mLastTime;
+
+    public FloorStateMachine(TimingWheel timingWheel) {
+        mTimingWheel = timingWheel;
+    }
+
+    /**
+     * Sets the listener and replays the current state to it: the confirmed
+     * floor with previous floor equal to it, then the tentative floor if any
+     * @param listener
+     */
+    public synchronized void setListener(Listener listener) {
+        mListener = listener;
+        if (!mHasFloor) {
+            return;
+        }
+        fireFloorChange(true, mConfirmedFloor, mConfirmedFloor, mConfirmedCertainty, mConfirmedNearConnector, mConfirmedTime);
+        if (mHasTentative) {
+            fireFloorChange(false, mTentativeFloor, mConfirmedFloor, mLastCertainty, mLastNearConnector, mLastTime);
+        }
+    }
+
+    /**
+     * Takes the vertical connectors from a wayfinding graph: the nodes of
+     * edges between two floors
+     * @param graphJson
+     * @throws JSONException
+     */
+    public void setGraph(String graphJson) throws JSONException {
+        JSONObject graph = new JSONObject(graphJson);
+        JSONArray nodes = graph.getJSONArray("nodes");
+        JSONArray edges = graph.getJSONArray("edges");
+        boolean[] connector = new boolean[nodes.length()];
+        int count = 0;
+        for (int i = 0; i < edges.length(); i++) {
+            JSONObject edge = edges.getJSONObject(i);
+            int begin = edge.getInt("begin");
+            int end = edge.getInt("end");
+            if (nodes.getJSONObject(begin).getInt("floor") == nodes.getJSONObject(end).getInt("floor")) {
+                continue;
+            }
+            for (int node : new int[] { begin, end }) {
+                if (!connector[node]) {
+                    connector[node] = true;
+                    count++;
+                }
+            }
+        }
+        double[] latitudes = new double[count];
+        double[] longitudes = new double[count];
+        int[] floors = new int[count];
+        for (int i = 0, j = 0; i < connector.length; i++) {
+            if (connector[i]) {
+                JSONObject node = nodes.getJSONObject(i);
+                latitudes[j] = node.getDouble("latitude");
+                longitudes[j] = node.getDouble("longitude");
+                floors[j] = node.getInt("floor");
+                j++;
+            }
+        }
+        synchronized (this) {
+            mConnectorLatitudes = latitudes;
+            mConnectorLongitudes = longitudes;
+            mConnectorFloors = floors;
+        }
+    }
+
+    /**
+     * Feeds a fix
+     * @param certainty floor certainty, NaN if unknown
+     */
+    public synchronized void onFix(double latitude, double longitude, int floor, float certainty, long time) {
+        if (!mHasFloor) {
+            mHasFloor = true;
+            mConfirmedFloor = floor;
+            mConfirmedCertainty = certainty;
+            mConfirmedNearConnector = isNearConnector(latitude, longitude, floor);
+            mConfirmedTime = time;
+            fireFloorChange(true, floor, floor, certainty, mConfirmedNearConnector, time);
+            return;
+        }
+        if (floor == mConfirmedFloor) {
+            if (mHasTentative) {
+                dropTentative();
+                fireFloorChange(false, floor, floor, certainty, isNearConnector(latitude, longitude, floor), time);
+            }
+            return;
+        }
+        boolean near = isNearConnector(latitude, longitude, floor);
+        mLastCertainty = certainty;
+        mLastNearConnector = near;
+        mLastTime = time;
+        if (near && certainty >= CONFIRM_CERTAINTY) {
+            confirm(floor);
+            return;
+        }
+        if (mHasTentative && floor == mTentativeFloor) {
+            return;
+        }
+        dropTentative();
+        mHasTentative = true;
+        mTentativeFloor = floor;
+        final int tentativeFloor = floor;
+        mDwell = mTimingWheel.schedule(near ? DWELL_NEAR_CONNECTOR_MS : DWELL_MS, new Runnable() {
+            @Override
+            public void run() {
+                onDwell(tentativeFloor);
+            }
+        });
+        fireFloorChange(false, floor, mConfirmedFloor, certainty, near, time);
+    }
+
+    /**
+     * Forgets the floors, e.g. when positioning stops
+     */
+    public synchronized void reset() {
+        dropTentative();
+        mHasFloor = false;
+    }
+
+    private synchronized void onDwell(int tentativeFloor) {
+        if (!mHasTentative || mTentativeFloor != tentativeFloor) {
+            return;
+        }
+        mDwell = null;
+        // The last fix must still be reasonably sure of the tentative floor
+        if (Float.isNaN(mLastCertainty) || mLastCertainty >= MIN_CERTAINTY) {
+            confirm(tentativeFloor);
+        } else {
+            dropTentative();
+            fireFloorChange(false, mConfirmedFloor, mConfirmedFloor, mLastCertainty, mLastNearConnector, mLastTime);
+        }
+    }
+
+    private void confirm(int floor) {
+        int previous = mConfirmedFloor;
+        dropTentative();
+        mConfirmedFloor = floor;
+        mConfirmedCertainty = mLastCertainty;
+        mConfirmedNearConnector = mLastNearConnector;
+        mConfirmedTime = mLastTime;
+        fireFloorChange(true, floor, previous, mLastCertainty, mLastNearConnector, mLastTime);
+    }
+
+    private void dropTentative() {
+        if (mDwell != null) {
+            mDwell.cancel();
+            mDwell = null;
+        }
+        mHasTentative = false;
+    }
+
+    private boolean isNearConnector(double latitude, double longitude, int floor) {
+        if (mConnectorFloors.length == 0) {
+            return false;
+        }
+        double metersPerLongitudeDegree = METERS_PER_DEGREE * Math.cos(Math.toRadians(latitude));
+        double radius2 = CONNECTOR_RADIUS_METERS * CONNECTOR_RADIUS_METERS;
+        for (int i = 0; i < mConnectorFloors.length; i++) {
+            // Either end of the transition counts, the fix may be on either floor
+            if (mConnectorFloors[i] != floor && (!mHasFloor || mConnectorFloors[i] != mConfirmedFloor)) {
+                continue;
+            }
+            double dy = (mConnectorLatitudes[i] - latitude) * METERS_PER_DEGREE;
+            double dx = (mConnectorLongitudes[i] - longitude) * metersPerLongitudeDegree;
+            if (dx * dx + dy * dy <= radius2) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    private void fireFloorChange(boolean confirmed, int floor, int confirmedFloor, float certainty, boolean nearConnector, long time) {
+        if (mListener != null) {
+            mListener.onFloorChange(confirmed, floor, confirmedFloor, certainty, nearConnector, time);
+        }
+    }
+}
@@ -1,13 +1,18 @@
 package com.ialocation.plugin;
 
 import android.Manifest;
+import android.app.ActivityManager;
+import android.app.NotificationChannel;
+import android.app.NotificationManager;
+import android.app.PendingIntent;
+import android.content.Intent;
 import android.content.pm.PackageManager;
 import android.graphics.Matrix;
 import android.graphics.Point;
 import android.graphics.PointF;
 import android.os.Build;
 import android.os.Bundle;
-import android.os.Looper;
+import android.support.v4.app.NotificationCompat;
 import android.util.Log;
 import android.widget.Toast;
 import android.content.Context;
@@ -37,10 +42,13 @@ import org.json.JSONArray;
 import org.json.JSONException;
 import org.json.JSONObject;
 
-import java.util.Set;
-import java.util.Timer;
-import java.util.TimerTask;
+import java.io.File;
+import java.io.IOException;
 import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.Iterator;
+import java.util.Map;
+import java.util.concurrent.CancellationException;
 
 /**
  * Cordova Plugin which implements IndoorAtlas positioning service.
@@ -49,10 +57,16 @@ import java.util.ArrayList;
 public class IALocationPlugin extends CordovaPlugin{
     private static final String TAG = "IALocationPlugin";
     private static final int PERMISSION_REQUEST = 101;
+    // Resource manager requests share one fetch scheduler host
+    private static final String RESOURCE_HOST = "indooratlas-resources";
+    private static final String NOTIFICATION_CHANNEL = "indooratlas-triggers";
 
-    private IALocationManager mLocationManager;
-    private IAResourceManager mResourceManager;
-    private IATask<IAFloorPlan> mFetchFloorplanTask;
+    // Created on the positioning queue, read on the resources and routing queues
+    private volatile IALocationManager mLocationManager;
+    private volatile IAResourceManager mResourceManager;
+    private final FetchScheduler mFetchScheduler = FetchScheduler.getShared();
+    private Deferred<IAFloorPlan> mFetchFloorplan;
+    private CallbackContext mFetchFloorplanContext;
     private String[] permissions = new String[]{
             Manifest.permission.CHANGE_WIFI_STATE,
             Manifest.permission.ACCESS_WIFI_STATE,
@@ -62,14 +76,124 @@ public class IALocationPlugin extends CordovaPlugin{
     };
     private CallbackContext mCbContext;
     private IndoorLocationListener mListener;
-    private boolean mLocationServiceRunning = false;
-    private Timer mTimer;
+    private volatile boolean mLocationServiceRunning = false;
+    private CommandQueues mQueues;
+    private final TimingWheel mTimingWheel = TimingWheel.getShared();
+    private final HashMap<CallbackContext, TimingWheel.Timeout> mRequestTimeouts = new HashMap<CallbackContext, TimingWheel.Timeout>();
+    private final HashMap<String, TimingWheel.Timeout> mWatchTimeouts = new HashMap<String, TimingWheel.Timeout>();
+    private final HashMap<String, Long> mWatchTimeoutMs = new HashMap<String, Long>();
     private String mApiKey, mApiSecret;
     private IALocationRequest mLocationRequest = IALocationRequest.create();
     private IAOrientationRequest mOrientationRequest = new IAOrientationRequest(1.0, 1.0);
 
     private IAWayfinder wayfinder;
     private ArrayList<IAWayfinder> wayfinderInstances = new ArrayList<IAWayfinder>();
+    private long mWayfinderGraphBytes;
+
+    private CacheBudget mCacheBudget;
+    private FloorPlanCache mFloorPlanCache;
+    private BackgroundProcessor mBackgroundProcessor;
+    private volatile CallbackContext mBackgroundCallback;
+    private volatile EventQueue mEventQueue;
+    private static final String EVENT_QUEUE_DIR = "indooratlas-events";
+    private volatile Uplink mUplink;
+    private final BridgeBenchmark mBridgeBenchmark = new BridgeBenchmark();
+    private final StreamChannel mStreamChannel = new StreamChannel();
+    private final PositioningState mPositioningState = new PositioningState();
+    private final FloorStateMachine mFloorStateMachine = new FloorStateMachine(TimingWheel.getShared());
+    private volatile CallbackContext mFloorCallbackContext;
+    private volatile ExitDistanceField mExitField;
+    private static final String UPLINK_DIR = "indooratlas-uplink";
+    private volatile PositionHistory mPositionHistory;
+    private static final String HISTORY_DIR = "indooratlas-history";
+
+    /**
+     * Called after plugin construction and fields have been initialized.
+     * Sets up the cache budget and hooks it to the system memory callbacks.
+     */
+    @Override
+    protected void pluginInitialize() {
+        Context context = cordova.getActivity().getApplicationContext();
+        ActivityManager activityManager = (ActivityManager) context.getSystemService(Context.ACTIVITY_SERVICE);
+        mQueues = new CommandQueues();
+        mBackgroundProcessor = new BackgroundProcessor(new BackgroundProcessor.Sink() {
+            @Override
+            public void deliver(JSONObject event) {
+                Uplink uplink = mUplink;
+                if (uplink != null) {
+                    uplink.onEvent(event);
+                }
+                long offset = persistEvent(event);
+                if (offset >= 0) {
+                    try {
+                        event.put("offset", offset);
+                    } catch (JSONException e) {
+                        Log.w(TAG, e.toString());
+                    }
+                }
+                CallbackContext callbackContext = mBackgroundCallback;
+                if (callbackContext != null) {
+                    PluginResult pluginResult = new PluginResult(PluginResult.Status.OK, event);
+                    pluginResult.setKeepCallback(true);
+                    callbackContext.sendPluginResult(pluginResult);
+                }
+            }
+
+            @Override
+            public void notify(String triggerId, String title, String text) {
+                postTriggerNotification(triggerId, title, text);
+            }
+        }, mTimingWheel);
+        mCacheBudget = new CacheBudget(CacheBudget.defaultBudget(activityManager.getMemoryClass()));
+        mFloorPlanCache = new FloorPlanCache(mCacheBudget);
+        mCacheBudget.register(mFloorPlanCache);
+        mCacheBudget.register(new CacheBudget.Cache() {
+            @Override
+            public String getName() {
+                return "routes";
+            }
+
+            @Override
+            public int getTier() {
+                return CacheBudget.TIER_COLD;
+            }
+
+            @Override
+            public long residentBytes() {
+                return RouteBuffer.pooledBytes();
+            }
+
+            @Override
+            public long trim(long bytes) {
+                return RouteBuffer.clearPool();
+            }
+        });
+        // Graphs are referenced by id from JavaScript, so they are accounted but never evicted
+        mCacheBudget.register(new CacheBudget.Cache() {
+            @Override
+            public String getName() {
+                return "wayfinders";
+            }
+
+            @Override
+            public int getTier() {
+                return CacheBudget.TIER_CRITICAL;
+            }
+
+            @Override
+            public long residentBytes() {
+                synchronized (wayfinderInstances) {
+                    return mWayfinderGraphBytes;
+                }
+            }
+
+            @Override
+            public long trim(long bytes) {
+                return 0;
+            }
+        });
+        context.registerComponentCallbacks(mCacheBudget);
+    }
 
     /**
      * Called by the WebView implementation to check for geolocation permissions, can be used
@@ -125,10 +249,9 @@ public class IALocationPlugin extends CordovaPlugin{
 
     /**
      * Executes the request.
-     * This method is called from the WebView thread. To do a non-trivial amount of work, use:
-     *     cordova.getThreadPool().execute(runnable);
-     *     To run on the UI thread, use:
-     *     cordova.getActivity().runOnUiThread(runnable);
+     * This method is called from the WebView thread. Actions of a subsystem are
+     * handed to that subsystem's serial queue, see CommandQueues; the rest are
+     * cheap and run here. Nothing runs on the UI thread.
      * @param action          The action to execute.
      * @param args            The exec() arguments.
      * @param callbackContext The callback context used when calling back into JavaScript.
@@ -136,7 +259,156 @@ public class IALocationPlugin extends CordovaPlugin{
      * @throws JSONException
      */
     @Override
-    public boolean execute(String action, JSONArray args, CallbackContext callbackContext) throws JSONException {
+    public boolean execute(final String action, final JSONArray args, final CallbackContext callbackContext) throws JSONException {
+        int queue = CommandQueues.queueFor(action);
+        if (queue == CommandQueues.NONE) {
+            return executeAccounted(action, args, callbackContext);
+        }
+        mQueues.post(queue, new Runnable() {
+            @Override
+            public void run() {
+                try {
+                    executeAccounted(action, args, callbackContext);
+                } catch (JSONException ex) {
+                    Log.e(TAG, ex.toString());
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, ex.toString()));
+                }
+            }
+        });
+        return true;
+    }
+
+    /**
+     * Returns the queues that run plugin commands and receive SDK callbacks
+     * @return
+     */
+    public CommandQueues getQueues() {
+        return mQueues;
+    }
+
+    /**
+     * Returns the processor that handles events natively while the app is in the background
+     * @return
+     */
+    public BackgroundProcessor getBackgroundProcessor() {
+        return mBackgroundProcessor;
+    }
+
+    /**
+     * Opens the event queue on first use
+     * @return null if the queue cannot be opened
+     */
+    public synchronized EventQueue getEventQueue() {
+        if (mEventQueue == null) {
+            File dir = new File(cordova.getActivity().getApplicationContext().getFilesDir(), EVENT_QUEUE_DIR);
+            try {
+                mEventQueue = new EventQueue(dir, EventQueue.DEFAULT_MAX_BYTES, EventQueue.DEFAULT_SEGMENT_BYTES);
+            } catch (IOException e) {
+                Log.e(TAG, "Cannot open event queue: " + e);
+            }
+        }
+        return mEventQueue;
+    }
+
+    /**
+     * Opens the position history on first use
+     * @return null if the history cannot be opened
+     */
+    public synchronized PositionHistory getPositionHistory() {
+        if (mPositionHistory == null) {
+            File dir = new File(cordova.getActivity().getApplicationContext().getFilesDir(), HISTORY_DIR);
+            try {
+                mPositionHistory = new PositionHistory(dir, PositionHistory.DEFAULT_MAX_DISK_BYTES);
+            } catch (IOException e) {
+                Log.e(TAG, "Cannot open position history: " + e);
+            }
+        }
+        return mPositionHistory;
+    }
+
+    /**
+     * Records a fix on the resources queue, where the history is opened,
+     * spilled and compacted, so that the location callback never touches disk
+     */
+    public void addToHistory(final long time, final VenueFrame frame, final int east, final int north, final int floor,
+                             final float accuracy) {
+        mQueues.post(CommandQueues.RESOURCES, new Runnable() {
+            @Override
+            public void run() {
+                PositionHistory history = getPositionHistory();
+                if (history != null) {
+                    history.add(time, frame, east, north, floor, accuracy);
+                }
+            }
+        });
+    }
+
+    /**
+     * @return the uplink, or null if it was never configured
+     */
+    public Uplink getUplink() {
+        return mUplink;
+    }
+
+    /**
+     * @return the binary channel of the high rate streams
+     */
+    public StreamChannel getStreamChannel() {
+        return mStreamChannel;
+    }
+
+    /**
+     * @return the versioned record read by getState
+     */
+    public PositioningState getPositioningState() {
+        return mPositioningState;
+    }
+
+    /**
+     * @return the floor hysteresis fed with every fix
+     */
+    public FloorStateMachine getFloorStateMachine() {
+        return mFloorStateMachine;
+    }
+
+    /**
+     * @return trace id of the positioning session, null before initialization
+     */
+    public String getSessionTraceId() {
+        return mLocationManager != null ? mLocationManager.getExtraInfo().traceId : null;
+    }
+
+    /**
+     * Stores an event for JavaScript to fetch later, so that it survives the
+     * WebView being suspended and the app being killed.
+     * @param event
+     * @return offset of the event, or -1 if it could not be stored
+     */
+    public long persistEvent(JSONObject event) {
+        EventQueue queue = getEventQueue();
+        if (queue == null) {
+            return -1;
+        }
+        try {
+            return queue.append(event);
+        } catch (IOException e) {
+            Log.e(TAG, "Cannot store event: " + e);
+            return -1;
+        }
+    }
+
+    private boolean executeAccounted(String action, JSONArray args, CallbackContext callbackContext) throws JSONException {
+        TraceRecorder.begin("bridge", action);
+        CostAccounting.enter();
+        try {
+            return executeAction(action, args, callbackContext);
+        } finally {
+            CostAccounting.exit(CostAccounting.BRIDGE, action);
+            TraceRecorder.end("bridge", action);
+        }
+    }
+
+    private boolean executeAction(String action, JSONArray args, CallbackContext callbackContext) throws JSONException {
         try{
             if ("initializeIndoorAtlas".equals(action)) {
                 if (validateIAKeys(args)) {
@@ -150,23 +422,23 @@ public class IALocationPlugin extends CordovaPlugin{
                 }
             } else if ("addWatch".equals(action)) {
                 String watchId = args.getString(0);
-                addWatch(watchId,callbackContext);
+                EventFilter filter = compileFilter(args, 3, EventFilter.KIND_POSITION, callbackContext);
+                if (filter == null && !args.isNull(3)) {
+                    return true;
+                }
+                addWatch(watchId, callbackContext, filter, args.optInt(4, 0));
+                scheduleWatchTimeout(watchId, callbackContext, args.optLong(2, -1));
                 if (!mLocationServiceRunning) {
                     startPositioning(callbackContext);
                 }
             } else if ("clearWatch".equals(action)) {
                 String watchId = args.getString(0);
+                cancelWatchTimeout(watchId);
                 clearWatch(watchId);
                 callbackContext.success();
 
             } else if ("getLocation".equals(action)) {
-                if (mLocationServiceRunning) { //get last known location if service has started.
-                    getLastKnownLocation(callbackContext);
-                }
-                else { //Start service
-                    getListener(this).addCallback(callbackContext);
-                    startPositioning(callbackContext);
-                }
+                getLocation(args.optLong(1, -1), args.optLong(2, 0), (float) args.optDouble(3, -1), callbackContext);
             } else if ("getPermissions".equals(action)) {
                 if (hasPermisssion()) {
                     callbackContext.success();
@@ -180,10 +452,14 @@ public class IALocationPlugin extends CordovaPlugin{
                 setPosition(args, callbackContext);
             } else if ("addRegionWatch".equals(action)) {
                 String watchId = args.getString(0);
+                EventFilter filter = compileFilter(args, 1, EventFilter.KIND_REGION, callbackContext);
+                if (filter == null && !args.isNull(1)) {
+                    return true;
+                }
                 if (!mLocationServiceRunning){
                     startPositioning(callbackContext);
                 }
-                addRegionWatch(watchId, callbackContext);
+                addRegionWatch(watchId, callbackContext, filter);
             } else if ("clearRegionWatch".equals(action)) {
                 String watchId = args.getString(0);
                 clearRegionWatch(watchId);
@@ -195,6 +471,8 @@ public class IALocationPlugin extends CordovaPlugin{
                 } else {
                     callbackContext.error(PositionError.getErrorObject(PositionError.FLOOR_PLAN_UNDEFINED));
                 }
+            } else if ("fetchFloorPlans".equals(action)) {
+                fetchFloorPlans(args.getJSONArray(0), callbackContext);
             } else if ("coordinateToPoint".equals(action)) {
                 IALatLng coords = new IALatLng(args.getDouble(0), args.getDouble(1));
                 String floorplanId = args.getString(2);
@@ -211,11 +489,17 @@ public class IALocationPlugin extends CordovaPlugin{
             } else if ("getFloorCertainty".equals(action)) {
               getFloorCertainty(callbackContext);
             } else if ("addAttitudeCallback".equals(action)) {
-              addAttitudeCallback(callbackContext);
+              EventFilter filter = compileFilter(args, 0, EventFilter.KIND_ATTITUDE, callbackContext);
+              if (filter != null || args.isNull(0)) {
+                  addAttitudeCallback(callbackContext, filter, args.optInt(1, 0));
+              }
             } else if ("removeAttitudeCallback".equals(action)) {
               removeAttitudeCallback();
             } else if ("addHeadingCallback".equals(action)) {
-              addHeadingCallback(callbackContext);
+              EventFilter filter = compileFilter(args, 0, EventFilter.KIND_HEADING, callbackContext);
+              if (filter != null || args.isNull(0)) {
+                  addHeadingCallback(callbackContext, filter, args.optInt(1, 0));
+              }
             } else if ("removeHeadingCallback".equals(action)) {
               removeHeadingCallback();
             } else if ("setSensitivities".equals(action)) {
@@ -224,11 +508,44 @@ public class IALocationPlugin extends CordovaPlugin{
               setSensitivities(orientationSensitivity, headingSensitivity, callbackContext);
             } else if ("addStatusChangedCallback".equals(action)) {
               addStatusChangedCallback(callbackContext);
-            } else if ("removeStatusCallback".equals(action)) {
+            } else if ("removeStatusCallback".equals(action)) {
               removeStatusCallback();
+            } else if ("addFloorCallback".equals(action)) {
+              addFloorCallback(callbackContext);
+            } else if ("removeFloorCallback".equals(action)) {
+              mFloorCallbackContext = null;
             } else if ("buildWayfinder".equals(action)) {
                 String graphJson = args.getString(0);
                 buildWayfinder(graphJson, callbackContext);
+            } else if ("buildExitField".equals(action)) {
+                buildExitField(args.getString(0), args.getJSONArray(1), args.optJSONObject(2), callbackContext);
+            } else if ("getExitGuidance".equals(action)) {
+                getExitGuidance(args, callbackContext);
+            } else if ("closeExit".equals(action) || "openExit".equals(action)) {
+                ExitDistanceField field = mExitField;
+                if (field == null) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, "Exit field not built"));
+                } else {
+                    try {
+                        String exitId = args.getString(0);
+                        callbackContext.success("closeExit".equals(action) ? field.closeExit(exitId) : field.openExit(exitId));
+                    } catch (IllegalArgumentException ex) {
+                        callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, ex.getMessage()));
+                    }
+                }
+            } else if ("applyExitDelta".equals(action)) {
+                ExitDistanceField field = mExitField;
+                if (field == null) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, "Exit field not built"));
+                } else {
+                    try {
+                        callbackContext.success(field.applyDelta(args.getJSONObject(0)));
+                    } catch (JSONException ex) {
+                        callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, "Malformed exit delta"));
+                    } catch (IllegalArgumentException ex) {
+                        callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, ex.getMessage()));
+                    }
+                }
             } else if ("computeRoute".equals(action)) {
                 int wayfinderId = args.getInt(0);
                 Double lat0 = args.getDouble(1);
@@ -237,7 +554,118 @@ public class IALocationPlugin extends CordovaPlugin{
                 Double lat1 = args.getDouble(4);
                 Double lon1 = args.getDouble(5);
                 int floor1 = args.getInt(6);
-                computeRoute(wayfinderId, lat0, lon0, floor0, lat1, lon1, floor1, callbackContext);
+                boolean binary = args.optBoolean(7, false);
+                computeRoute(wayfinderId, lat0, lon0, floor0, lat1, lon1, floor1, binary, callbackContext);
+            } else if ("computeRouteOnFloorPlan".equals(action)) {
+                int wayfinderId = args.getInt(0);
+                double lat0 = args.getDouble(1);
+                double lon0 = args.getDouble(2);
+                int floor0 = args.getInt(3);
+                double lat1 = args.getDouble(4);
+                double lon1 = args.getDouble(5);
+                int floor1 = args.getInt(6);
+                String floorplanId = args.getString(7);
+                computeRouteOnFloorPlan(wayfinderId, lat0, lon0, floor0, lat1, lon1, floor1, floorplanId, callbackContext);
+            } else if ("getCacheReport".equals(action)) {
+                callbackContext.success(mCacheBudget.getReport());
+            } else if ("simulateMemoryPressure".equals(action)) {
+                mCacheBudget.onPressure(args.getInt(0));
+                callbackContext.success(mCacheBudget.getReport());
+            } else if ("configureBackground".equals(action)) {
+                configureBackground(args.getJSONObject(0), callbackContext);
+            } else if ("clearBackground".equals(action)) {
+                mBackgroundProcessor.disable();
+                CallbackContext backgroundCallback = mBackgroundCallback;
+                mBackgroundCallback = null;
+                if (backgroundCallback != null) {
+                    backgroundCallback.sendPluginResult(new PluginResult(PluginResult.Status.NO_RESULT));
+                }
+                callbackContext.success(mBackgroundProcessor.getStats());
+                stopPositioningIfIdle();
+            } else if ("fetchEvents".equals(action)) {
+                EventQueue queue = getEventQueue();
+                if (queue == null) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, "Event queue unavailable"));
+                } else {
+                    callbackContext.success(queue.read(args.getString(0), args.optInt(1, EventQueue.DEFAULT_BATCH)));
+                }
+            } else if ("ackEvents".equals(action)) {
+                EventQueue queue = getEventQueue();
+                if (queue == null) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, "Event queue unavailable"));
+                } else {
+                    queue.ack(args.getString(0), args.getLong(1));
+                    callbackContext.success(queue.getStats());
+                }
+            } else if ("getHistory".equals(action)) {
+                PositionHistory history = getPositionHistory();
+                if (history == null) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, "Position history unavailable"));
+                } else {
+                    callbackContext.success(history.query(args.optLong(0, 0), args.optLong(1, Long.MAX_VALUE),
+                            args.optInt(2, PositionHistory.DEFAULT_MAX_POINTS)));
+                }
+            } else if ("clearHistory".equals(action)) {
+                PositionHistory history = getPositionHistory();
+                if (history != null) {
+                    history.clear();
+                }
+                callbackContext.success();
+            } else if ("configureUplink".equals(action)) {
+                configureUplink(args.getJSONObject(0), callbackContext);
+            } else if ("clearUplink".equals(action)) {
+                Uplink uplink = mUplink;
+                if (uplink != null) {
+                    uplink.disable();
+                    callbackContext.success(uplink.getStats());
+                } else {
+                    callbackContext.success();
+                }
+            } else if ("getCostReport".equals(action)) {
+                callbackContext.success(CostAccounting.getReport());
+            } else if ("resetCostReport".equals(action)) {
+                CostAccounting.reset();
+                callbackContext.success();
+            } else if ("startTracing".equals(action)) {
+                TraceRecorder.start(args.optInt(0, TraceRecorder.DEFAULT_CAPACITY));
+                callbackContext.success();
+            } else if ("stopTracing".equals(action)) {
+                TraceRecorder.stop();
+                callbackContext.success();
+            } else if ("dumpTrace".equals(action)) {
+                dumpTrace(callbackContext);
+            } else if ("openStreamChannel".equals(action)) {
+                mStreamChannel.open(callbackContext);
+                PluginResult result = new PluginResult(PluginResult.Status.NO_RESULT);
+                result.setKeepCallback(true);
+                callbackContext.sendPluginResult(result);
+            } else if ("ackStreamChannel".equals(action)) {
+                mStreamChannel.acknowledge(args.getInt(0));
+            } else if ("getState".equals(action)) {
+                // A synchronized read, answered on the bridge thread without queueing
+                callbackContext.success(mPositioningState.snapshot(args.optLong(0, 0), args.optLong(1, 0)));
+            } else if ("bridgeEcho".equals(action)) {
+                // Answered on the bridge thread, so only the bridge itself is measured
+                try {
+                    mBridgeBenchmark.echo(args.getString(0), args.getString(1), args.optBoolean(2, false),
+                            callbackContext);
+                } catch (IllegalArgumentException e) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, e.getMessage()));
+                }
+            } else if ("bridgeStream".equals(action)) {
+                try {
+                    mBridgeBenchmark.stream(args.getString(0), args.getString(1), args.getInt(2), args.getInt(3),
+                            cordova.getThreadPool(), callbackContext);
+                } catch (IllegalArgumentException e) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, e.getMessage()));
+                }
+            } else if ("bridgeStop".equals(action)) {
+                mBridgeBenchmark.stop();
+                callbackContext.success();
+            } else if ("runBenchmark".equals(action)) {
+                String name = args.getString(0);
+                JSONObject options = args.optJSONObject(1);
+                runBenchmark(name, options != null ? options : new JSONObject(), callbackContext);
             }
         }
         catch(Exception ex) {
@@ -248,56 +676,116 @@ public class IALocationPlugin extends CordovaPlugin{
         return true;
     }
 
+    /**
+     * Called when the activity goes to the background. Events are handled
+     * natively from now on if background processing is configured.
+     * @param multitasking
+     */
+    @Override
+    public void onPause(boolean multitasking) {
+        TraceRecorder.instant("background", "pause");
+        mBackgroundProcessor.setBackground(true);
+        // The process may be killed from now on, do not wait for the group commit
+        final EventQueue queue = mEventQueue;
+        final Uplink uplink = mUplink;
+        final PositionHistory history = mPositionHistory;
+        if (queue != null || uplink != null || history != null) {
+            mQueues.post(CommandQueues.RESOURCES, new Runnable() {
+                @Override
+                public void run() {
+                    if (queue != null) {
+                        queue.sync();
+                    }
+                    if (uplink != null) {
+                        uplink.sync();
+                    }
+                    if (history != null) {
+                        history.sync();
+                    }
+                }
+            });
+        }
+    }
+
+    /**
+     * Called when the activity returns. Delivers the occupancy batch and the
+     * latest position, which the watches missed while in the background.
+     * @param multitasking
+     */
+    @Override
+    public void onResume(boolean multitasking) {
+        TraceRecorder.instant("background", "resume");
+        final boolean wasActive = mBackgroundProcessor.isActive();
+        mBackgroundProcessor.setBackground(false);
+        if (wasActive) {
+            mQueues.post(CommandQueues.POSITIONING, new Runnable() {
+                @Override
+                public void run() {
+                    getListener(IALocationPlugin.this).resendLastLocation();
+                }
+            });
+        }
+    }
+
     /**
      * The final call you receive before your activity is destroyed.
      */
     @Override
     public void onDestroy() {
-        if (mLocationManager != null){
-            mLocationManager.destroy();
+        mQueues.post(CommandQueues.POSITIONING, new Runnable() {
+            @Override
+            public void run() {
+                if (mLocationManager != null){
+                    mLocationManager.destroy();
+                }
+            }
+        });
+        mQueues.quit();
+        if (mEventQueue != null) {
+            mEventQueue.close();
         }
+        cordova.getActivity().getApplicationContext().unregisterComponentCallbacks(mCacheBudget);
         super.onDestroy();
     }
 
     /**
-     * Gets last known saved position from IndoorLocationListener
+     * Answers a getCurrentPosition request from the last known position if it
+     * is recent and accurate enough. Otherwise the request waits for the next
+     * such position of the running session, which is started only if needed.
+     * @param timeout milliseconds, negative for no timeout
+     * @param maximumAge milliseconds, negative for any age
+     * @param minimumAccuracy metres, negative for any accuracy
      * @param callbackContext
      */
-    private void getLastKnownLocation(CallbackContext callbackContext)throws JSONException {
-        JSONObject locationData;
-        if (mListener != null) {
-            locationData = mListener.getLastKnownLocation();
-            if (locationData != null) {
-                callbackContext.success(locationData);
-            }
-            else {
-                callbackContext.error(PositionError.getErrorObject(PositionError.POSITION_UNAVAILABLE));
-            }
+    private void getLocation(long timeout, long maximumAge, float minimumAccuracy, CallbackContext callbackContext) {
+        IndoorLocationListener listener = getListener(this);
+        JSONObject cached = listener.getCachedLocation(maximumAge, minimumAccuracy);
+        if (cached != null) {
+            callbackContext.success(cached);
+            return;
         }
-        else {
-            callbackContext.error(PositionError.getErrorObject(PositionError.POSITION_UNAVAILABLE));
+        listener.addCallback(callbackContext, minimumAccuracy);
+        scheduleTimeout(callbackContext, timeout);
+        if (!mLocationServiceRunning) {
+            startPositioning(callbackContext);
         }
     }
 
     /**
-     * Initialized location manger with given key and secret
+     * Initialized location manger with given key and secret, on the positioning
+     * queue, whose Looper then receives the location callbacks
      * @param apiKey
      * @param apiSecret
      */
     private void initializeIndoorAtlas(final String apiKey, final String apiSecret) {
         if (mLocationManager == null){
-            cordova.getActivity().runOnUiThread(new Runnable() {
-                @Override
-                public void run() {
-                    Bundle bundle = new Bundle(2);
-                    bundle.putString(IALocationManager.EXTRA_API_KEY, apiKey);
-                    bundle.putString(IALocationManager.EXTRA_API_SECRET, apiSecret);
-                    mLocationManager = IALocationManager.create(cordova.getActivity().getApplicationContext(), bundle);
-                    mResourceManager = IAResourceManager.create(cordova.getActivity().getApplicationContext(), bundle);
-                    mApiKey = apiKey;
-                    mApiSecret = apiSecret;
-                }
-            });
+            Bundle bundle = new Bundle(2);
+            bundle.putString(IALocationManager.EXTRA_API_KEY, apiKey);
+            bundle.putString(IALocationManager.EXTRA_API_SECRET, apiSecret);
+            mLocationManager = IALocationManager.create(cordova.getActivity().getApplicationContext(), bundle);
+            mResourceManager = IAResourceManager.create(cordova.getActivity().getApplicationContext(), bundle);
+            mApiKey = apiKey;
+            mApiSecret = apiSecret;
         }
     }
 
@@ -306,83 +794,186 @@ public class IALocationPlugin extends CordovaPlugin{
      * @param floorplanId
      * @param callbackContext
      */
-    private void fetchFloorplan(String floorplanId, CallbackContext callbackContext) {
+    private void fetchFloorplan(String floorplanId, CallbackContext callbackContext) throws JSONException {
+        IAFloorPlan cached = mFloorPlanCache.get(floorplanId);
+        if (cached != null) {
+            PluginResult pluginResult;
+            pluginResult = new PluginResult(PluginResult.Status.OK, getFloorPlanJSON(cached));
+            pluginResult.setKeepCallback(true);
+            callbackContext.sendPluginResult(pluginResult);
+            return;
+        }
         if (mResourceManager != null) {
             cancelPendingNetworkCalls();
-            mCbContext = callbackContext;
-            mFetchFloorplanTask = mResourceManager.fetchFloorPlanWithId(floorplanId);
-            mFetchFloorplanTask.setCallback(new IAResultCallback<IAFloorPlan>() {
+            final CallbackContext fetchContext = callbackContext;
+            mFetchFloorplanContext = callbackContext;
+            mFetchFloorplan = fetchFloorPlanDeferred(floorplanId, FetchScheduler.PRIORITY_VISIBLE);
+            mFetchFloorplan.whenComplete(new Deferred.Callback<IAFloorPlan>() {
                 @Override
-                public void onResult(IAResult<IAFloorPlan> iaResult) {
-                    IAFloorPlan floorPlan;
-                    JSONObject floorplanInfo;
-                    JSONArray latlngArray;
-                    floorPlan = iaResult.getResult();
-                    IALatLng iaLatLng;
+                public void onSuccess(IAFloorPlan floorPlan) {
                     try {
-                        if (floorPlan != null) {
-                            floorplanInfo = new JSONObject();
-                            floorplanInfo.put("id", floorPlan.getId());
-                            floorplanInfo.put("name", floorPlan.getName());
-                            floorplanInfo.put("url", floorPlan.getUrl());
-                            floorplanInfo.put("floorLevel", floorPlan.getFloorLevel());
-                            floorplanInfo.put("bearing", floorPlan.getBearing());
-                            floorplanInfo.put("bitmapHeight", floorPlan.getBitmapHeight());
-                            floorplanInfo.put("bitmapWidth", floorPlan.getBitmapWidth());
-                            floorplanInfo.put("heightMeters", floorPlan.getHeightMeters());
-                            floorplanInfo.put("widthMeters", floorPlan.getWidthMeters());
-                            floorplanInfo.put("metersToPixels", floorPlan.getMetersToPixels());
-                            floorplanInfo.put("pixelsToMeters", floorPlan.getPixelsToMeters());
-
-                            latlngArray = new JSONArray();
-                            iaLatLng = floorPlan.getBottomLeft();
-                            latlngArray.put(iaLatLng.longitude);
-                            latlngArray.put(iaLatLng.latitude);
-                            floorplanInfo.put("bottomLeft", latlngArray);
-
-                            latlngArray = new JSONArray();
-                            iaLatLng = floorPlan.getCenter();
-                            latlngArray.put(iaLatLng.longitude);
-                            latlngArray.put(iaLatLng.latitude);
-                            floorplanInfo.put("center", latlngArray);
-
-                            latlngArray = new JSONArray();
-                            iaLatLng = floorPlan.getTopLeft();
-                            latlngArray.put(iaLatLng.longitude);
-                            latlngArray.put(iaLatLng.latitude);
-                            floorplanInfo.put("topLeft", latlngArray);
-
-                            latlngArray = new JSONArray();
-                            iaLatLng = floorPlan.getTopRight();
-                            latlngArray.put(iaLatLng.longitude);
-                            latlngArray.put(iaLatLng.latitude);
-                            floorplanInfo.put("topRight", latlngArray);
-
-                            PluginResult pluginResult;
-                            pluginResult = new PluginResult(PluginResult.Status.OK, floorplanInfo);
-                            pluginResult.setKeepCallback(true);
-                            mCbContext.sendPluginResult(pluginResult);
-
-                        }
-                        else {
-                          PluginResult pluginResult;
-                          pluginResult = new PluginResult(PluginResult.Status.ERROR, PositionError.getErrorObject(PositionError.FLOOR_PLAN_UNAVAILABLE));
-                          pluginResult.setKeepCallback(true);
-                          mCbContext.sendPluginResult(pluginResult);
-                        }
+                        PluginResult pluginResult;
+                        pluginResult = new PluginResult(PluginResult.Status.OK, getFloorPlanJSON(floorPlan));
+                        pluginResult.setKeepCallback(true);
+                        fetchContext.sendPluginResult(pluginResult);
                     }
                     catch(JSONException ex) {
                         Log.e(TAG, ex.toString());
                         throw new IllegalStateException(ex.getMessage());
                     }
                 }
-            }, Looper.getMainLooper());
+
+                @Override
+                public void onFailure(Exception error) {
+                    if (error instanceof CancellationException) {
+                        return;
+                    }
+                    PluginResult pluginResult;
+                    pluginResult = new PluginResult(PluginResult.Status.ERROR, PositionError.getErrorObject(PositionError.FLOOR_PLAN_UNAVAILABLE));
+                    pluginResult.setKeepCallback(true);
+                    fetchContext.sendPluginResult(pluginResult);
+                }
+            });
         }
         else {
             callbackContext.error(PositionError.getErrorObject(PositionError.INITIALIZATION_ERROR));
         }
     }
 
+    /**
+     * Fetches several floor plans in parallel through the FetchScheduler,
+     * which serves cached ones right away and shares fetches already in
+     * flight, and answers once all have completed with { floorPlans, errors }:
+     * the floor plans in the order of the ids, null where a fetch failed, and
+     * { id, index, code, message } per failure
+     * @param floorplanIds
+     * @param callbackContext
+     */
+    private void fetchFloorPlans(JSONArray floorplanIds, final CallbackContext callbackContext) throws JSONException {
+        if (mResourceManager == null) {
+            callbackContext.error(PositionError.getErrorObject(PositionError.INITIALIZATION_ERROR));
+            return;
+        }
+        final int count = floorplanIds.length();
+        final JSONArray floorPlans = new JSONArray();
+        final JSONArray errors = new JSONArray();
+        for (int i = 0; i < count; i++) {
+            floorPlans.put(JSONObject.NULL);
+        }
+        final int[] remaining = { count };
+        if (count == 0) {
+            sendFloorPlans(floorPlans, errors, callbackContext);
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            final int index = i;
+            // optString would turn null and numbers into ids, those are undefined
+            final Object id = floorplanIds.opt(i);
+            final String floorplanId = id instanceof String ? (String) id : "";
+            Deferred<IAFloorPlan> fetch = floorplanId.isEmpty()
+                    ? Deferred.<IAFloorPlan>rejected(new IllegalArgumentException("Floor plan id is undefined"))
+                    : fetchFloorPlanDeferred(floorplanId, FetchScheduler.PRIORITY_VISIBLE);
+            fetch.whenComplete(new Deferred.Callback<IAFloorPlan>() {
+                @Override
+                public void onSuccess(IAFloorPlan floorPlan) {
+                    try {
+                        complete(getFloorPlanJSON(floorPlan), null);
+                    } catch (JSONException e) {
+                        complete(null, e);
+                    }
+                }
+
+                @Override
+                public void onFailure(Exception error) {
+                    complete(null, error);
+                }
+
+                private void complete(JSONObject floorPlan, Exception error) {
+                    synchronized (remaining) {
+                        try {
+                            if (floorPlan != null) {
+                                floorPlans.put(index, floorPlan);
+                            } else {
+                                int code = error instanceof IllegalArgumentException ? PositionError.FLOOR_PLAN_UNDEFINED
+                                        : error instanceof FloorPlanUnavailableException ? PositionError.FLOOR_PLAN_UNAVAILABLE
+                                        : PositionError.UNSPECIFIED_ERROR;
+                                JSONObject failure = PositionError.getErrorObject(code);
+                                failure.put("id", id instanceof String ? id : JSONObject.NULL);
+                                failure.put("index", index);
+                                errors.put(failure);
+                            }
+                        } catch (JSONException e) {
+                            Log.e(TAG, e.toString());
+                        }
+                        if (--remaining[0] > 0) {
+                            return;
+                        }
+                    }
+                    sendFloorPlans(floorPlans, errors, callbackContext);
+                }
+            });
+        }
+    }
+
+    private static void sendFloorPlans(JSONArray floorPlans, JSONArray errors, CallbackContext callbackContext) {
+        JSONObject result = new JSONObject();
+        try {
+            result.put("floorPlans", floorPlans);
+            result.put("errors", errors);
+        } catch (JSONException e) {
+            Log.e(TAG, e.toString());
+        }
+        callbackContext.success(result);
+    }
+
+    /**
+     * Returns a JSON object which contains IAFloorPlan info.
+     * @param floorPlan
+     * @return
+     * @throws JSONException
+     */
+    private JSONObject getFloorPlanJSON(IAFloorPlan floorPlan) throws JSONException {
+        JSONObject floorplanInfo = new JSONObject();
+        JSONArray latlngArray;
+        IALatLng iaLatLng;
+        floorplanInfo.put("id", floorPlan.getId());
+        floorplanInfo.put("name", floorPlan.getName());
+        floorplanInfo.put("url", floorPlan.getUrl());
+        floorplanInfo.put("floorLevel", floorPlan.getFloorLevel());
+        floorplanInfo.put("bearing", floorPlan.getBearing());
+        floorplanInfo.put("bitmapHeight", floorPlan.getBitmapHeight());
+        floorplanInfo.put("bitmapWidth", floorPlan.getBitmapWidth());
+        floorplanInfo.put("heightMeters", floorPlan.getHeightMeters());
+        floorplanInfo.put("widthMeters", floorPlan.getWidthMeters());
+        floorplanInfo.put("metersToPixels", floorPlan.getMetersToPixels());
+        floorplanInfo.put("pixelsToMeters", floorPlan.getPixelsToMeters());
+
+        latlngArray = new JSONArray();
+        iaLatLng = floorPlan.getBottomLeft();
+        latlngArray.put(iaLatLng.longitude);
+        latlngArray.put(iaLatLng.latitude);
+        floorplanInfo.put("bottomLeft", latlngArray);
+
+        latlngArray = new JSONArray();
+        iaLatLng = floorPlan.getCenter();
+        latlngArray.put(iaLatLng.longitude);
+        latlngArray.put(iaLatLng.latitude);
+        floorplanInfo.put("center", latlngArray);
+
+        latlngArray = new JSONArray();
+        iaLatLng = floorPlan.getTopLeft();
+        latlngArray.put(iaLatLng.longitude);
+        latlngArray.put(iaLatLng.latitude);
+        floorplanInfo.put("topLeft", latlngArray);
+
+        latlngArray = new JSONArray();
+        iaLatLng = floorPlan.getTopRight();
+        latlngArray.put(iaLatLng.longitude);
+        latlngArray.put(iaLatLng.latitude);
+        floorplanInfo.put("topRight", latlngArray);
+        return floorplanInfo;
+    }
+
     /**
      * Calculates point based on given coordinates
      * @param coords
@@ -391,28 +982,26 @@ public class IALocationPlugin extends CordovaPlugin{
      */
     private void coordinateToPoint(final IALatLng coords, String floorplanId, final CallbackContext callbackContext) {
         if (mResourceManager != null) {
-            IATask<IAFloorPlan> fetchFloorplanTask = mResourceManager.fetchFloorPlanWithId(floorplanId);
-            fetchFloorplanTask.setCallback(new IAResultCallback<IAFloorPlan>() {
+            fetchFloorPlanDeferred(floorplanId, FetchScheduler.PRIORITY_VISIBLE).whenComplete(new Deferred.Callback<IAFloorPlan>() {
                 @Override
-                public void onResult(IAResult<IAFloorPlan> iaResult) {
+                public void onSuccess(IAFloorPlan floorPlan) {
                     JSONObject pointInfo = new JSONObject();
-                    IAFloorPlan floorPlan = iaResult.getResult();
                     try {
-                        if (floorPlan != null) {
-                            PointF point = floorPlan.coordinateToPoint(coords);
-                            pointInfo.put("x", point.x);
-                            pointInfo.put("y", point.y);
-                            callbackContext.success(pointInfo);
-                        } else {
-                            callbackContext.error(PositionError.getErrorObject(PositionError.FLOOR_PLAN_UNAVAILABLE));
-                        }
-
+                        PointF point = floorPlan.coordinateToPoint(coords);
+                        pointInfo.put("x", point.x);
+                        pointInfo.put("y", point.y);
+                        callbackContext.success(pointInfo);
                     } catch (JSONException ex) {
                         Log.e(TAG, ex.toString());
                         throw new IllegalStateException(ex.getMessage());
                     }
                 }
-            }, Looper.getMainLooper());
+
+                @Override
+                public void onFailure(Exception error) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.FLOOR_PLAN_UNAVAILABLE));
+                }
+            });
         } else {
             callbackContext.error(PositionError.getErrorObject(PositionError.INITIALIZATION_ERROR));
         }
@@ -426,72 +1015,96 @@ public class IALocationPlugin extends CordovaPlugin{
      */
     private void pointToCoordinate(final PointF point, String floorplanId, final CallbackContext callbackContext) {
         if (mResourceManager != null) {
-            IATask<IAFloorPlan> fetchFloorplanTask = mResourceManager.fetchFloorPlanWithId(floorplanId);
-            fetchFloorplanTask.setCallback(new IAResultCallback<IAFloorPlan>() {
+            fetchFloorPlanDeferred(floorplanId, FetchScheduler.PRIORITY_VISIBLE).whenComplete(new Deferred.Callback<IAFloorPlan>() {
                 @Override
-                public void onResult(IAResult<IAFloorPlan> iaResult) {
+                public void onSuccess(IAFloorPlan floorPlan) {
                     JSONObject coordsInfo = new JSONObject();
-                    IAFloorPlan floorPlan = iaResult.getResult();
                     try {
-                        if (floorPlan != null) {
-                            IALatLng coords = floorPlan.pointToCoordinate(point);
-                            coordsInfo.put("latitude", coords.latitude);
-                            coordsInfo.put("longitude", coords.longitude);
-                            callbackContext.success(coordsInfo);
-                        } else {
-                            callbackContext.error(PositionError.getErrorObject(PositionError.FLOOR_PLAN_UNAVAILABLE));
-                        }
+                        IALatLng coords = floorPlan.pointToCoordinate(point);
+                        coordsInfo.put("latitude", coords.latitude);
+                        coordsInfo.put("longitude", coords.longitude);
+                        callbackContext.success(coordsInfo);
                     } catch (JSONException ex) {
                         Log.e(TAG, ex.toString());
                         throw new IllegalStateException(ex.getMessage());
                     }
                 }
-            }, Looper.getMainLooper());
+
+                @Override
+                public void onFailure(Exception error) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.FLOOR_PLAN_UNAVAILABLE));
+                }
+            });
         } else {
             callbackContext.error(PositionError.getErrorObject(PositionError.INITIALIZATION_ERROR));
         }
     }
 
     /**
-     * Helper method to cancel current task if any.
+     * Helper method to cancel current task if any. The fetch itself continues
+     * while other requests still wait for the same floor plan.
      */
     private void cancelPendingNetworkCalls() {
-        if (mFetchFloorplanTask != null) {
-            if (!mFetchFloorplanTask.isCancelled()) {
-                mFetchFloorplanTask.cancel();
-                mCbContext.sendPluginResult(new PluginResult(PluginResult.Status.NO_RESULT));
+        if (mFetchFloorplan != null) {
+            if (!mFetchFloorplan.getToken().isCancelled()) {
+                mFetchFloorplan.cancel();
+                mFetchFloorplanContext.sendPluginResult(new PluginResult(PluginResult.Status.NO_RESULT));
             }
         }
     }
 
+    /**
+     * Compiles the filter expression at the given argument index. If the
+     * expression is invalid the error is sent to the callback.
+     * @param args
+     * @param index
+     * @param kind
+     * @param callbackContext
+     * @return the filter, or null if there is none or it is invalid
+     */
+    private EventFilter compileFilter(JSONArray args, int index, int kind, CallbackContext callbackContext)
+            throws JSONException {
+        if (args.isNull(index)) {
+            return null;
+        }
+        try {
+            return EventFilter.compile(args.getString(index), kind);
+        } catch (IllegalArgumentException e) {
+            callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, e.getMessage()));
+            return null;
+        }
+    }
+
     /**
      * Adds a new callback to the IndoorAtlas location listener
      * @param watchId
      * @param callbackContext
+     * @param filter
+     * @param streamId
      */
-    private void addWatch(String watchId, CallbackContext callbackContext) {
-        getListener(this).addWatch(watchId, callbackContext);
+    private void addWatch(String watchId, CallbackContext callbackContext, EventFilter filter, int streamId) {
+        getListener(this).addWatch(watchId, callbackContext, filter, streamId);
     }
 
     /**
      * Adds a new callback to the IndoorAtlas IARegion.Listener
      */
-    private void addRegionWatch(String watchId, CallbackContext callbackContext) {
-        getListener(this).addRegionWatch(watchId, callbackContext);
+    private void addRegionWatch(String watchId, CallbackContext callbackContext, EventFilter filter) {
+        getListener(this).addRegionWatch(watchId, callbackContext, filter);
     }
 
     /**
      * Adds a new callback to the IndoorAtlas IAAttitude.Listener
      */
-    private void addAttitudeCallback(CallbackContext callbackContext) {
-      getListener(this).addAttitudeCallback(callbackContext);
+    private void addAttitudeCallback(CallbackContext callbackContext, EventFilter filter, int streamId) {
+      getListener(this).addAttitudeCallback(callbackContext, filter, streamId);
     }
 
     /**
      * Adds a new callback to the IndoorAtlas IAAttitude.Listener
      */
-    private void addHeadingCallback(CallbackContext callbackContext) {
-      getListener(this).addHeadingCallback(callbackContext);
+    private void addHeadingCallback(CallbackContext callbackContext, EventFilter filter, int streamId) {
+      getListener(this).addHeadingCallback(callbackContext, filter, streamId);
     }
 
     /**
@@ -501,6 +1114,38 @@ public class IALocationPlugin extends CordovaPlugin{
       getListener(this).addStatusChangedCallback(callbackContext);
     }
 
+    /**
+     * Sends the tentative and confirmed floor changes of the floor hysteresis
+     * to the callback
+     */
+    private void addFloorCallback(CallbackContext callbackContext) {
+      mFloorCallbackContext = callbackContext;
+      mFloorStateMachine.setListener(new FloorStateMachine.Listener() {
+          @Override
+          public void onFloorChange(boolean confirmed, int floor, int confirmedFloor, float certainty,
+                                    boolean nearConnector, long time) {
+              CallbackContext callback = mFloorCallbackContext;
+              if (callback == null) {
+                  return;
+              }
+              JSONObject floorData = new JSONObject();
+              try {
+                  floorData.put("confirmed", confirmed);
+                  floorData.put("floor", floor);
+                  floorData.put("confirmedFloor", confirmedFloor);
+                  floorData.put("certainty", Float.isNaN(certainty) ? JSONObject.NULL : certainty);
+                  floorData.put("nearConnector", nearConnector);
+                  floorData.put("timestamp", time);
+              } catch (JSONException e) {
+                  Log.e(TAG, e.toString());
+              }
+              PluginResult pluginResult = new PluginResult(PluginResult.Status.OK, floorData);
+              pluginResult.setKeepCallback(true);
+              callback.sendPluginResult(pluginResult);
+          }
+      });
+    }
+
     /**
      * Removes callback from IndoorAtlas location listener
      * @param watchId
@@ -541,62 +1186,339 @@ public class IALocationPlugin extends CordovaPlugin{
     /**
      * Initialize the graph with the given graph JSON
      */
-    private void buildWayfinder(final String graphJson, CallbackContext callbackContext) {
-        int wayfinderId = wayfinderInstances.size();
-
-        cordova.getActivity().runOnUiThread(new Runnable() {
+    private void buildWayfinder(final String graphJson, final CallbackContext callbackContext) {
+        // Parsing the graph can take a while for large venues, keep it off the UI thread
+        TaskScheduler.getShared().submit(TaskScheduler.LANE_BACKGROUND, CostAccounting.ROUTING, new Runnable() {
             @Override
             public void run() {
                 Context context = cordova.getActivity().getApplicationContext();
-                wayfinder = IAWayfinder.create(context, graphJson);
-                wayfinderInstances.add(wayfinder);
+                IAWayfinder instance = IAWayfinder.create(context, graphJson);
+                int wayfinderId;
+                synchronized (wayfinderInstances) {
+                    wayfinderId = wayfinderInstances.size();
+                    wayfinderInstances.add(instance);
+                    wayfinder = instance;
+                    // Rough in-memory size of the parsed graph
+                    mWayfinderGraphBytes += 2L * graphJson.length();
+                }
+                try {
+                    mFloorStateMachine.setGraph(graphJson);
+                } catch (JSONException e) {
+                    Log.e(TAG, "No vertical connectors in graph: " + e.toString());
+                }
+                mCacheBudget.enforce();
+
+                JSONObject result = new JSONObject();
+                try {
+                    result.put("wayfinderId", wayfinderId);
+                    callbackContext.success(result);
+
+                } catch (JSONException e) {
+                    Log.e("IAWAYFINDER", "wayfinderId was not set");
+                };
             }
         });
-        
-        JSONObject result = new JSONObject();
-        try {
-            result.put("wayfinderId", wayfinderId);
-            callbackContext.success(result);
-            
-        } catch (JSONException e) {
-            Log.e("IAWAYFINDER", "wayfinderId was not set");
-        };
     }
     
     /**
-     * Compute route for the given values;
+     * Builds the exit distance field of a wayfinding graph off the UI thread,
+     * replacing the previous one. Exits closed in the previous field stay
+     * closed in the new one.
+     */
+    private void buildExitField(final String graphJson, final JSONArray exits, final JSONObject options,
+                                final CallbackContext callbackContext) {
+        ExitDistanceField previous = mExitField;
+        final ArrayList<String> closedExitIds = previous != null ? previous.getClosedExits() : new ArrayList<String>();
+        TaskScheduler.getShared().submit(TaskScheduler.LANE_BACKGROUND, CostAccounting.ROUTING, new Runnable() {
+            @Override
+            public void run() {
+                double cellMeters = options != null ? options.optDouble("cellMeters", ExitDistanceField.DEFAULT_CELL_METERS)
+                        : ExitDistanceField.DEFAULT_CELL_METERS;
+                final ExitDistanceField field;
+                try {
+                    field = new ExitDistanceField(graphJson, exits, cellMeters, closedExitIds);
+                } catch (JSONException ex) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, "Error: graph"));
+                    return;
+                } catch (IllegalArgumentException ex) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, ex.getMessage()));
+                    return;
+                }
+                // Installed on the routing queue, after any closeExit or openExit
+                // that came in while the field was built
+                mQueues.run(CommandQueues.ROUTING, new Runnable() {
+                    @Override
+                    public void run() {
+                        JSONObject result = new JSONObject();
+                        try {
+                            ExitDistanceField current = mExitField;
+                            if (current != null) {
+                                field.setClosedExits(current.getClosedExits());
+                            }
+                            mExitField = field;
+                            result.put("version", field.getVersion());
+                            result.put("nodes", field.getNodeCount());
+                            result.put("exits", field.getExitCount());
+                            result.put("closed", new JSONArray(field.getClosedExits()));
+                        } catch (JSONException e) {
+                            Log.e(TAG, e.toString());
+                        }
+                        callbackContext.success(result);
+                    }
+                });
+            }
+        });
+    }
+
+    /**
+     * Answers with the guidance of the exit field for the given position,
+     * [latitude, longitude, floor], or the last fix if none is given
+     */
+    private void getExitGuidance(JSONArray args, CallbackContext callbackContext) throws JSONException {
+        ExitDistanceField field = mExitField;
+        if (field == null) {
+            callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, "Exit field not built"));
+            return;
+        }
+        if (args.length() >= 3) {
+            callbackContext.success(field.guidance(args.getDouble(0), args.getDouble(1), args.getInt(2)));
+            return;
+        }
+        IALocation location = mListener != null ? mListener.lastKnownLocation : null;
+        if (location == null) {
+            callbackContext.error(PositionError.getErrorObject(PositionError.POSITION_UNAVAILABLE));
+            return;
+        }
+        callbackContext.success(field.guidance(location.getLatitude(), location.getLongitude(), location.getFloorLevel()));
+    }
+
+    /**
+     * Compute route for the given values on the shared scheduler;
      * 1) Set location of the wayfinder instance
      * 2) Set destination of the wayfinder instance
      * 3) Get route between the given location and destination
      */
-    private void computeRoute(int wayfinderId, Double lat0, Double lon0, int floor0, Double lat1, Double lon1, int floor1, CallbackContext callbackContext) {
-        wayfinder = wayfinderInstances.get(wayfinderId);
-        wayfinder.setLocation(lat0, lon0, floor0);
-        wayfinder.setDestination(lat1, lon1, floor1);
-        
-        IARoutingLeg[] legs = wayfinder.getRoute();
-        JSONArray jsonArray = new JSONArray();
-        for (int i = 0; i < legs.length; i++) {
-            jsonArray.put(jsonObjectFromRoutingLeg(legs[i]));
+    private void computeRoute(final int wayfinderId, final Double lat0, final Double lon0, final int floor0, final Double lat1, final Double lon1, final int floor1, final boolean binary, final CallbackContext callbackContext) {
+        TaskScheduler.getShared().submit(TaskScheduler.LANE_INTERACTIVE, CostAccounting.ROUTING, new Runnable() {
+            @Override
+            public void run() {
+                IARoutingLeg[] legs;
+                try {
+                    legs = routeLegs(wayfinderId, lat0, lon0, floor0, lat1, lon1, floor1);
+                } catch (IllegalArgumentException ex) {
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, ex.getMessage()));
+                    return;
+                } catch (Exception ex) {
+                    // The scheduler only logs what escapes a task, the callback would never fire
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, ex.toString()));
+                    return;
+                }
+
+                try {
+                    if (binary) {
+                        // Sent as an ArrayBuffer the app hands to its processing worker, see RouteBuffer.encode
+                        VenueFrame frame = getListener(IALocationPlugin.this).obtainVenueFrame(lat0, lon0);
+                        byte[] encoded;
+                        RouteBuffer route = RouteBuffer.acquire();
+                        try {
+                            route.fill(legs, frame);
+                            encoded = route.encode(frame);
+                        } finally {
+                            RouteBuffer.release(route);
+                        }
+                        callbackContext.success(encoded);
+                        return;
+                    }
+
+                    JSONArray jsonArray = new JSONArray();
+                    for (int i = 0; i < legs.length; i++) {
+                        jsonArray.put(jsonObjectFromRoutingLeg(legs[i]));
+                    }
+                    JSONObject result = new JSONObject();
+                    result.put("route", jsonArray);
+                    callbackContext.success(result);
+                } catch (Exception ex) {
+                    Log.e("IAWAYFINDER", "error with route: " + ex);
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, ex.toString()));
+                }
+            }
+        });
+    }
+
+    /**
+     * Routes with the given wayfinder instance
+     */
+    private IARoutingLeg[] routeLegs(int wayfinderId, double lat0, double lon0, int floor0, double lat1, double lon1, int floor1) {
+        IAWayfinder instance;
+        synchronized (wayfinderInstances) {
+            if (wayfinderId < 0 || wayfinderId >= wayfinderInstances.size()) {
+                throw new IllegalArgumentException("Unknown wayfinder " + wayfinderId);
+            }
+            instance = wayfinderInstances.get(wayfinderId);
+            wayfinder = instance;
+        }
+        IARoutingLeg[] legs;
+        // A wayfinder holds the location and destination as state
+        synchronized (instance) {
+            TraceRecorder.begin("routing", "getRoute");
+            instance.setLocation(lat0, lon0, floor0);
+            instance.setDestination(lat1, lon1, floor1);
+            legs = instance.getRoute();
+            TraceRecorder.end("routing", "getRoute");
         }
-        JSONObject result = new JSONObject();
-        
+        return legs;
+    }
+
+    /**
+     * Fetches a floor plan without blocking; the result is delivered through the returned Deferred.
+     * Concurrent requests for the same floor plan share one fetch.
+     * @param floorplanId
+     * @param priority one of the FetchScheduler.PRIORITY_ constants
+     * @return
+     */
+    private Deferred<IAFloorPlan> fetchFloorPlanDeferred(final String floorplanId, int priority) {
+        IAFloorPlan cached = mFloorPlanCache.get(floorplanId);
+        if (cached != null) {
+            return Deferred.resolved(cached);
+        }
+        final IAResourceManager resourceManager = mResourceManager;
+        if (resourceManager == null) {
+            return Deferred.rejected(new IllegalStateException("IndoorAtlas is not initialized"));
+        }
+        return mFetchScheduler.fetch("floorplan:" + floorplanId, RESOURCE_HOST, priority, new FetchScheduler.Fetcher<IAFloorPlan>() {
+            @Override
+            public FetchScheduler.Cancellable start(final FetchScheduler.Result<IAFloorPlan> result) {
+                final IATask<IAFloorPlan> task = resourceManager.fetchFloorPlanWithId(floorplanId);
+                task.setCallback(new IAResultCallback<IAFloorPlan>() {
+                    @Override
+                    public void onResult(IAResult<IAFloorPlan> iaResult) {
+                        if (iaResult.isSuccess() && iaResult.getResult() != null) {
+                            mFloorPlanCache.put(iaResult.getResult());
+                            result.success(iaResult.getResult(), floorPlanBytes(iaResult.getResult()));
+                        } else {
+                            // Only a transport error may pass on retry; an unknown or wrong id,
+                            // or a successful request without a floor plan, will not
+                            result.failure(new FloorPlanUnavailableException(floorplanId),
+                                    !iaResult.isSuccess() && isTransportError(iaResult.getError()));
+                        }
+                    }
+                }, mQueues.getLooper(CommandQueues.RESOURCES));
+                return new FetchScheduler.Cancellable() {
+                    @Override
+                    public void cancel() {
+                        task.cancel();
+                    }
+                };
+            }
+        });
+    }
+
+    /**
+     * Size of a fetched floor plan's metadata, which the SDK does not report,
+     * estimated from its JSON form for the fetch scheduler's bandwidth estimate
+     */
+    private long floorPlanBytes(IAFloorPlan floorPlan) {
         try {
-            result.put("route", jsonArray);
-            callbackContext.success(result);
-        } catch(JSONException e) {
-            Log.e("IAWAYFINDER", "json error with route");
+            return getFloorPlanJSON(floorPlan).toString().length();
+        } catch (JSONException ex) {
+            return 0;
         }
     }
-    
+
+    /**
+     * Whether an SDK error, or one of its causes, is a network error
+     */
+    private static boolean isTransportError(Object error) {
+        for (Object cause = error; cause instanceof Throwable; cause = ((Throwable) cause).getCause()) {
+            if (cause instanceof IOException) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Raised when a floor plan could not be fetched
+     */
+    private static final class FloorPlanUnavailableException extends Exception {
+        FloorPlanUnavailableException(String floorplanId) {
+            super("Floor plan " + floorplanId + " is not available");
+        }
+    }
+
+    /**
+     * Fetches the floor plan, computes the route and projects the route points
+     * on that floor onto the floor plan bitmap, all in one call from JavaScript
+     */
+    private void computeRouteOnFloorPlan(final int wayfinderId, final double lat0, final double lon0, final int floor0, final double lat1, final double lon1, final int floor1, String floorplanId, final CallbackContext callbackContext) {
+        fetchFloorPlanDeferred(floorplanId, FetchScheduler.PRIORITY_NAVIGATION)
+            .then(TaskScheduler.LANE_INTERACTIVE, new Deferred.Step<IAFloorPlan, JSONObject>() {
+                @Override
+                public JSONObject apply(IAFloorPlan floorPlan) throws Exception {
+                    IARoutingLeg[] legs = routeLegs(wayfinderId, lat0, lon0, floor0, lat1, lon1, floor1);
+                    JSONArray jsonArray = new JSONArray();
+                    for (int i = 0; i < legs.length; i++) {
+                        jsonArray.put(jsonObjectFromRoutingLeg(legs[i], floorPlan));
+                    }
+                    JSONObject result = new JSONObject();
+                    result.put("floorPlanId", floorPlan.getId());
+                    result.put("route", jsonArray);
+                    return result;
+                }
+            })
+            .whenComplete(new Deferred.Callback<JSONObject>() {
+                @Override
+                public void onSuccess(JSONObject result) {
+                    callbackContext.success(result);
+                }
+
+                @Override
+                public void onFailure(Exception error) {
+                    if (error instanceof FloorPlanUnavailableException) {
+                        callbackContext.error(PositionError.getErrorObject(PositionError.FLOOR_PLAN_UNAVAILABLE));
+                    } else {
+                        callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, error.toString()));
+                    }
+                }
+            });
+    }
+
+    /**
+     * Runs a native benchmark on Cordova's thread pool, as it blocks until done
+     * @param name
+     * @param options
+     * @param callbackContext
+     */
+    private void runBenchmark(final String name, final JSONObject options, final CallbackContext callbackContext) {
+        cordova.getThreadPool().execute(new Runnable() {
+            @Override
+            public void run() {
+                try {
+                    callbackContext.success(Benchmarks.run(name, options, cordova.getThreadPool()));
+                } catch (Exception ex) {
+                    Log.e(TAG, ex.toString());
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, ex.toString()));
+                }
+            }
+        });
+    }
+
     /**
      * Create JSON object from the given RoutingLeg object
      */
     private JSONObject jsonObjectFromRoutingLeg(IARoutingLeg routingLeg) {
+        return jsonObjectFromRoutingLeg(routingLeg, null);
+    }
+
+    /**
+     * Create JSON object from the given RoutingLeg object, with floor plan pixel
+     * coordinates for the points on the floor plan's floor if one is given
+     */
+    private JSONObject jsonObjectFromRoutingLeg(IARoutingLeg routingLeg, IAFloorPlan floorPlan) {
         JSONObject obj = new JSONObject();
         try {
-            obj.put("begin", jsonObjectFromRoutingPoint(routingLeg.getBegin()));
-            obj.put("end", jsonObjectFromRoutingPoint(routingLeg.getEnd()));
+            obj.put("begin", jsonObjectFromRoutingPoint(routingLeg.getBegin(), floorPlan));
+            obj.put("end", jsonObjectFromRoutingPoint(routingLeg.getEnd(), floorPlan));
             obj.put("length", routingLeg.getLength());
             obj.put("direction", routingLeg.getDirection());
             obj.put("edgeIndex", routingLeg.getEdgeIndex());
@@ -609,12 +1531,17 @@ public class IALocationPlugin extends CordovaPlugin{
     /**
      * Create JSON object from RoutingPoint object
      */
-    private JSONObject jsonObjectFromRoutingPoint(IARoutingPoint routingPoint) {
+    private JSONObject jsonObjectFromRoutingPoint(IARoutingPoint routingPoint, IAFloorPlan floorPlan) {
         JSONObject obj = new JSONObject();
         try {
             obj.put("latitude", routingPoint.getLatitude());
             obj.put("longitude", routingPoint.getLongitude());
             obj.put("floor", routingPoint.getFloor());
+            if (floorPlan != null && floorPlan.getFloorLevel() == routingPoint.getFloor()) {
+                PointF point = floorPlan.coordinateToPoint(new IALatLng(routingPoint.getLatitude(), routingPoint.getLongitude()));
+                obj.put("x", point.x);
+                obj.put("y", point.y);
+            }
         } catch(JSONException e) {
             
         }
@@ -626,13 +1553,8 @@ public class IALocationPlugin extends CordovaPlugin{
      */
      private void setSensitivities(double orientationSensitivity, double headingSensitivity, CallbackContext callbackContext) {
        mOrientationRequest = new IAOrientationRequest(headingSensitivity, orientationSensitivity);
-       cordova.getActivity().runOnUiThread(new Runnable() {
-           @Override
-           public void run() {
-             mLocationManager.unregisterOrientationListener(getListener(IALocationPlugin.this));
-             mLocationManager.registerOrientationListener(mOrientationRequest, getListener(IALocationPlugin.this));
-           }
-       });
+       mLocationManager.unregisterOrientationListener(getListener(IALocationPlugin.this));
+       mLocationManager.registerOrientationListener(mOrientationRequest, getListener(IALocationPlugin.this));
 
        JSONObject successObject = new JSONObject();
        try {
@@ -704,22 +1626,12 @@ public class IALocationPlugin extends CordovaPlugin{
                     builder.withLatitude(args.getJSONArray(1).getDouble(0));
                     builder.withLongitude(args.getJSONArray(1).getDouble(1));
                 }
-                cordova.getActivity().runOnUiThread(new Runnable() {
-                    @Override
-                    public void run() {
-                        IALocation iaLocation;
-                        iaLocation = builder.build();
-                        mLocationManager.setLocation(iaLocation);
-                        JSONObject successObject = new JSONObject();
-                        try {
-                            successObject.put("message","Position set");
-                        } catch (JSONException ex) {
-                            Log.e(TAG, ex.toString());
-                            throw new IllegalStateException(ex.getMessage());
-                        }
-                        callbackContext.success(successObject);
-                    }
-                });
+                IALocation iaLocation;
+                iaLocation = builder.build();
+                mLocationManager.setLocation(iaLocation);
+                JSONObject successObject = new JSONObject();
+                successObject.put("message","Position set");
+                callbackContext.success(successObject);
             }
         }
         else {
@@ -758,6 +1670,109 @@ public class IALocationPlugin extends CordovaPlugin{
         }
     }
 
+    /**
+     * Sets the triggers and batching rules used in the background. The callback
+     * stays registered and receives every event the processor delivers.
+     * @param options
+     * @param callbackContext
+     * @throws JSONException
+     */
+    private void configureBackground(JSONObject options, CallbackContext callbackContext) throws JSONException {
+        IndoorLocationListener listener = getListener(this);
+        VenueFrame frame = listener.getVenueFrame();
+        JSONArray triggers = options.optJSONArray("triggers");
+        for (int i = 0; frame == null && triggers != null && i < triggers.length(); i++) {
+            JSONObject trigger = triggers.getJSONObject(i);
+            if (trigger.has("latitude") && trigger.has("longitude")) {
+                frame = listener.obtainVenueFrame(trigger.getDouble("latitude"), trigger.getDouble("longitude"));
+            }
+        }
+        mBackgroundProcessor.configure(options, frame);
+        CallbackContext previous = mBackgroundCallback;
+        mBackgroundCallback = callbackContext;
+        if (previous != null && previous != callbackContext) {
+            previous.sendPluginResult(new PluginResult(PluginResult.Status.NO_RESULT));
+        }
+        PluginResult pluginResult = new PluginResult(PluginResult.Status.NO_RESULT);
+        pluginResult.setKeepCallback(true);
+        callbackContext.sendPluginResult(pluginResult);
+        if (!mLocationServiceRunning) {
+            startPositioning(callbackContext);
+        }
+    }
+
+    /**
+     * Opens the uplink on first use and applies the options. Calls back with its counters.
+     * @param options
+     * @param callbackContext
+     * @throws JSONException
+     */
+    private void configureUplink(JSONObject options, CallbackContext callbackContext) throws JSONException {
+        if (mUplink == null) {
+            File dir = new File(cordova.getActivity().getApplicationContext().getFilesDir(), UPLINK_DIR);
+            try {
+                mUplink = new Uplink(dir, Uplink.HTTP, TimingWheel.getShared());
+            } catch (IOException e) {
+                callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, "Cannot open uplink: " + e));
+                return;
+            }
+        }
+        mUplink.configure(options);
+        callbackContext.success(mUplink.getStats());
+    }
+
+    /**
+     * Posts the local notification of a trigger. Tapping it opens the app.
+     * @param triggerId
+     * @param title
+     * @param text
+     */
+    private void postTriggerNotification(String triggerId, String title, String text) {
+        Context context = cordova.getActivity().getApplicationContext();
+        NotificationManager manager = (NotificationManager) context.getSystemService(Context.NOTIFICATION_SERVICE);
+        if (manager == null) {
+            return;
+        }
+        if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.O) {
+            manager.createNotificationChannel(new NotificationChannel(NOTIFICATION_CHANNEL, "Indoor triggers",
+                    NotificationManager.IMPORTANCE_DEFAULT));
+        }
+        Intent launch = context.getPackageManager().getLaunchIntentForPackage(context.getPackageName());
+        int flags = PendingIntent.FLAG_UPDATE_CURRENT;
+        if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.M) {
+            flags |= PendingIntent.FLAG_IMMUTABLE;
+        }
+        NotificationCompat.Builder builder = new NotificationCompat.Builder(context, NOTIFICATION_CHANNEL)
+                .setSmallIcon(context.getApplicationInfo().icon)
+                .setContentTitle(title)
+                .setContentText(text)
+                .setAutoCancel(true);
+        if (launch != null) {
+            builder.setContentIntent(PendingIntent.getActivity(context, 0, launch, flags));
+        }
+        manager.notify(triggerId, 0, builder.build());
+    }
+
+    /**
+     * Exports the native trace recording as Chrome trace JSON, tagged with the
+     * IndoorAtlas trace id of the session
+     * @param callbackContext
+     */
+    private void dumpTrace(final CallbackContext callbackContext) {
+        final String traceId = mLocationManager != null ? mLocationManager.getExtraInfo().traceId : null;
+        cordova.getThreadPool().execute(new Runnable() {
+            @Override
+            public void run() {
+                try {
+                    callbackContext.success(TraceRecorder.dump(traceId));
+                } catch (JSONException ex) {
+                    Log.e(TAG, ex.toString());
+                    callbackContext.error(PositionError.getErrorObject(PositionError.UNSPECIFIED_ERROR, ex.toString()));
+                }
+            }
+        });
+    }
+
     private void getTraceId(CallbackContext callbackContext) {
       JSONObject data;
       data = new JSONObject();
@@ -795,32 +1810,57 @@ public class IALocationPlugin extends CordovaPlugin{
     }
 
     /**
-     * Starts IndoorAtlas positioning session
+     * Starts IndoorAtlas positioning session on the positioning queue. Watches
+     * on other queues (region watches on the geofence queue) may ask at the
+     * same time, so the running check is repeated there, where
+     * mLocationServiceRunning is written, and the listener registers once.
      */
     protected void startPositioning() {
-        cordova.getActivity().runOnUiThread(new Runnable() {
+        mQueues.run(CommandQueues.POSITIONING, new Runnable() {
             @Override
             public void run() {
-                mLocationManager.requestLocationUpdates(mLocationRequest, getListener(IALocationPlugin.this));
+                if (mLocationServiceRunning) {
+                    return;
+                }
+                mLocationManager.requestLocationUpdates(mLocationRequest, getListener(IALocationPlugin.this),
+                        mQueues.getLooper(CommandQueues.POSITIONING));
                 mLocationManager.registerRegionListener(getListener(IALocationPlugin.this));
                 mLocationManager.registerOrientationListener(mOrientationRequest, getListener(IALocationPlugin.this));
                 mLocationServiceRunning = true;
+                mPositioningState.setRunning(true);
+            }
+        });
+    }
+
+    /**
+     * Stops positioning unless a watch or request is still waiting, e.g. after
+     * the last region watch was cleared on the geofence queue
+     */
+    protected void stopPositioningIfIdle() {
+        mQueues.run(CommandQueues.POSITIONING, new Runnable() {
+            @Override
+            public void run() {
+                if (getListener(IALocationPlugin.this).size() == 0) {
+                    stopPositioning();
+                }
             }
         });
     }
 
     /**
-     * Stops IndoorAtlas positioning session
+     * Stops IndoorAtlas positioning session on the positioning queue
      */
     protected void stopPositioning() {
         if (mLocationManager != null) {
-            cordova.getActivity().runOnUiThread(new Runnable() {
+            mQueues.run(CommandQueues.POSITIONING, new Runnable() {
                 @Override
                 public void run() {
                     mLocationManager.unregisterRegionListener(getListener(IALocationPlugin.this));
                     mLocationManager.removeLocationUpdates(getListener(IALocationPlugin.this));
                     mLocationManager.unregisterOrientationListener(getListener(IALocationPlugin.this));
                     mLocationServiceRunning = false;
+                    mPositioningState.setRunning(false);
+                    mFloorStateMachine.reset();
                 }
             });
         }
@@ -848,7 +1888,7 @@ public class IALocationPlugin extends CordovaPlugin{
      * @param plugin
      * @return
      */
-    private IndoorLocationListener getListener(IALocationPlugin plugin) {
+    private synchronized IndoorLocationListener getListener(IALocationPlugin plugin) {
         if (mListener == null){
             mListener = new IndoorLocationListener(plugin);
         }
@@ -856,57 +1896,136 @@ public class IALocationPlugin extends CordovaPlugin{
     }
 
     /**
-     * Cancels the timeout timer used in getCurrentPosition and addWatch methods.
+     * Fails a getCurrentPosition request with TIMEOUT unless a position is
+     * delivered within the given time
+     * @param callbackContext
+     * @param timeout milliseconds, negative for no timeout
      */
-    public void cancelTimer() {
-        if (mTimer != null) {
-            mTimer.cancel();
-            mTimer.purge();
-            mTimer = null;
+    private synchronized void scheduleTimeout(CallbackContext callbackContext, long timeout) {
+        if (timeout < 0) {
+            return;
         }
+        TimeoutTask task = new TimeoutTask(callbackContext, null);
+        task.mTimeout = mTimingWheel.schedule(timeout, task);
+        mRequestTimeouts.put(callbackContext, task.mTimeout);
     }
 
     /**
-     * Creates timeout timer used in getCurrentPosition and addWatch methods.
+     * Reports TIMEOUT to a watch whenever no position is delivered within the
+     * given time. The watch itself stays active.
+     * @param watchId
      * @param callbackContext
-     * @param timeout
+     * @param timeout milliseconds, negative for no timeout
      */
-    private void scheduleTimer(CallbackContext callbackContext, int timeout) {
-        if (mTimer == null) {
-            mTimer = new Timer();
+    private synchronized void scheduleWatchTimeout(String watchId, CallbackContext callbackContext, long timeout) {
+        if (timeout < 0) {
+            return;
+        }
+        mWatchTimeoutMs.put(watchId, timeout);
+        armWatchTimeout(watchId, callbackContext, timeout);
+    }
+
+    private void armWatchTimeout(String watchId, CallbackContext callbackContext, long timeout) {
+        TimeoutTask task = new TimeoutTask(callbackContext, watchId);
+        task.mTimeout = mTimingWheel.schedule(timeout, task);
+        TimingWheel.Timeout previous = mWatchTimeouts.put(watchId, task.mTimeout);
+        if (previous != null) {
+            previous.cancel();
         }
-        mTimer.schedule(new TimeoutTask(callbackContext, getListener(this)), timeout);
     }
+
+    private synchronized void cancelWatchTimeout(String watchId) {
+        mWatchTimeoutMs.remove(watchId);
+        TimingWheel.Timeout timeout = mWatchTimeouts.remove(watchId);
+        if (timeout != null) {
+            timeout.cancel();
+        }
+    }
+
+    /**
+     * Called by the listener after a position has been delivered. Cancels the
+     * timeouts of the answered getCurrentPosition requests and restarts the
+     * timeouts of the watches.
+     */
+    public synchronized void restartTimers() {
+        if (!mRequestTimeouts.isEmpty()) {
+            ArrayList<CallbackContext> pending = getListener(this).getCallbacks();
+            Iterator<Map.Entry<CallbackContext, TimingWheel.Timeout>> it = mRequestTimeouts.entrySet().iterator();
+            while (it.hasNext()) {
+                Map.Entry<CallbackContext, TimingWheel.Timeout> entry = it.next();
+                // Requests waiting for a more accurate position keep their timeout
+                if (!pending.contains(entry.getKey())) {
+                    entry.getValue().cancel();
+                    it.remove();
+                }
+            }
+        }
+        if (mWatchTimeoutMs.isEmpty()) {
+            return;
+        }
+        HashMap<String, CallbackContext> watches = getListener(this).getWatches();
+        for (Map.Entry<String, Long> entry : mWatchTimeoutMs.entrySet()) {
+            CallbackContext callbackContext = watches.get(entry.getKey());
+            if (callbackContext != null) {
+                armWatchTimeout(entry.getKey(), callbackContext, entry.getValue());
+            }
+        }
+    }
+
     /**
-     * TimerTask which implements timeout logic when fetching position.
+     * Timing wheel task which implements timeout logic when fetching position.
+     * Expires on the wheel thread and reports on the positioning queue, where
+     * the listener delivers positions.
      */
-    private class TimeoutTask extends TimerTask {
-        private CallbackContext mCallbackContext = null;
-        private IndoorLocationListener mListener = null;
+    private class TimeoutTask implements Runnable {
+        private final CallbackContext mCallbackContext;
+        private final String mWatchId;
+        private TimingWheel.Timeout mTimeout;
 
-        public TimeoutTask(CallbackContext callbackContext, IndoorLocationListener listener) {
+        public TimeoutTask(CallbackContext callbackContext, String watchId) {
             mCallbackContext = callbackContext;
-            mListener = listener;
+            mWatchId = watchId;
         }
+
         @Override
         public void run() {
-            PluginResult pluginResult;
-            JSONObject errorObject;
-            for (CallbackContext callbackContext : mListener.getCallbacks()) {
-                if (mCallbackContext == callbackContext) {
-                    callbackContext.error(PositionError.getErrorObject(PositionError.TIMEOUT));
-                    mListener.getCallbacks().remove(callbackContext);
-                    break;
+            mQueues.post(CommandQueues.POSITIONING, new Runnable() {
+                @Override
+                public void run() {
+                    onTimeout();
+                }
+            });
+        }
+
+        private void onTimeout() {
+            synchronized (IALocationPlugin.this) {
+                // A position delivered after expiry restarted or cancelled this timer
+                if (mWatchId != null ? mWatchTimeouts.get(mWatchId) != mTimeout
+                        : mRequestTimeouts.get(mCallbackContext) != mTimeout) {
+                    return;
+                }
+                if (mWatchId != null) {
+                    mWatchTimeouts.remove(mWatchId);
+                } else {
+                    mRequestTimeouts.remove(mCallbackContext);
                 }
             }
-            Set<String> keys = mListener.getWatches().keySet();
-            for(String key: keys) {
-                if (mCallbackContext == mListener.getWatches().get(key)) {
-                    mListener.getWatches().get(key).error(PositionError.getErrorObject(PositionError.TIMEOUT));
-                    mListener.getWatches().remove(key);
+            if (mWatchId != null) {
+                if (mBackgroundProcessor.isActive()) {
+                    // Watches are not served in the background, their timeout must not wake JavaScript
+                    return;
                 }
+                PluginResult pluginResult = new PluginResult(PluginResult.Status.ERROR,
+                        PositionError.getErrorObject(PositionError.TIMEOUT));
+                pluginResult.setKeepCallback(true);
+                mCallbackContext.sendPluginResult(pluginResult);
+                return;
+            }
+            IndoorLocationListener listener = getListener(IALocationPlugin.this);
+            if (listener.removeCallback(mCallbackContext)) {
+                mCallbackContext.error(PositionError.getErrorObject(PositionError.TIMEOUT));
             }
-            if (mListener.size() == 0) {
+            if (listener.size() == 0) {
                 stopPositioning();
             }
         }
@@ -17,9 +17,19 @@ import org.json.JSONObject;
 import java.lang.reflect.Array;
 import java.util.ArrayList;
 import java.util.HashMap;
+import java.util.Map;
+import java.util.concurrent.ConcurrentHashMap;
 
 /**
  * Handles events from IALocationListener and IARegion.Listener and relays them to Javascript callbacks.
+ * Location and orientation events are handled on the positioning queue and region events on the
+ * geofence queue; events the SDK delivers on another thread are moved there first.
+ * While the BackgroundProcessor is active, positions and region events go to it instead and
+ * orientation and heading are dropped, so that the WebView is not woken for them.
+ * Subscriptions may carry an EventFilter; updates it rejects are not sent, and a
+ * position no subscriber wants is not even converted to JSON.
+ * Subscriptions with a stream id receive their updates as samples on the
+ * StreamChannel instead of a PluginResult each.
  */
 public class IndoorLocationListener implements IALocationListener, IARegion.Listener, IAOrientationListener {
     private static final String TAG = "IndoorLocationListener";
@@ -29,14 +39,50 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
     private static final int TRANSITION_TYPE_EXIT = 2;
 
     private HashMap<String, CallbackContext> watches = new HashMap<String, CallbackContext>();
-    private HashMap<String, CallbackContext> regionWatches = new HashMap<String, CallbackContext>();
-    private CallbackContext attitudeUpdateCallbackContext;
-    private CallbackContext headingUpdateCallbackContext;
-    private CallbackContext statusUpdateCallbackContext;
+    // Changed on the geofence queue, read on the positioning queue
+    private final ConcurrentHashMap<String, CallbackContext> regionWatches = new ConcurrentHashMap<String, CallbackContext>();
+    private volatile CallbackContext attitudeUpdateCallbackContext;
+    private volatile CallbackContext headingUpdateCallbackContext;
+    private volatile CallbackContext statusUpdateCallbackContext;
+    // Filters of the subscriptions that have one, kept like the callbacks they belong to
+    private final HashMap<String, EventFilter> watchFilters = new HashMap<String, EventFilter>();
+    private final ConcurrentHashMap<String, EventFilter> regionFilters = new ConcurrentHashMap<String, EventFilter>();
+    private volatile EventFilter attitudeFilter;
+    private volatile EventFilter headingFilter;
+    private final EventFilter.Values positionValues = new EventFilter.Values();
+    private final EventFilter.Values regionValues = new EventFilter.Values();
+    private final EventFilter.Values orientationValues = new EventFilter.Values();
+    private final EventFilter.Values headingValues = new EventFilter.Values();
+    // Stream channel ids of the subscriptions that have one
+    private final HashMap<String, Integer> watchStreams = new HashMap<String, Integer>();
+    private volatile int attitudeStream;
+    private volatile int headingStream;
+    private final double[] positionSample = new double[StreamChannel.POSITION_FIELDS];
+    private final double[] attitudeSample = new double[StreamChannel.ATTITUDE_FIELDS];
+    private final double[] headingSample = new double[StreamChannel.HEADING_FIELDS];
+    // Watches whose filter accepts the position being sent, by callback or by stream
+    private final ArrayList<CallbackContext> matchedWatches = new ArrayList<CallbackContext>();
+    private final ArrayList<Integer> matchedStreams = new ArrayList<Integer>();
     private ArrayList<CallbackContext> mCallbacks = new ArrayList<CallbackContext>();
+    // Worst accuracy in metres the getCurrentPosition requests that have one accept
+    private final HashMap<CallbackContext, Float> mCallbackAccuracies = new HashMap<CallbackContext, Float>();
+    // Requests the position being sent answers
+    private final ArrayList<CallbackContext> matchedCallbacks = new ArrayList<CallbackContext>();
     private CallbackContext mCallbackContext;
     public IALocation lastKnownLocation = null;
+    private VenueFrame venueFrame;
+    // Venue the frame belongs to, null if it was anchored outside a venue
+    private String venueId;
+    private final int[] lastLocalPosition = new int[2];
+    // Reused for every update: PluginResult encodes its message on construction,
+    // so the objects are free again as soon as the results have been created.
+    private final JSONObject locationMessage = new JSONObject();
+    private final JSONObject locationRegionMessage = new JSONObject();
+    private final JSONObject orientationMessage = new JSONObject();
+    private final JSONObject headingMessage = new JSONObject();
     private IALocationPlugin owner;
+    // A position was handled natively and the watches have not seen it
+    private boolean missedLocation;
 
     /**
      * The constructor
@@ -68,18 +114,119 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      */
     public JSONObject getLastKnownLocation() {
         if (lastKnownLocation != null) {
-            JSONObject locationData = getLocationJSONFromIALocation(lastKnownLocation);
+            // Called from the plugin thread, so it must not share the update objects
+            JSONObject locationData = getLocationJSONFromIALocation(lastKnownLocation, new JSONObject(), new JSONObject());
             return locationData;
         }
         return null;
     }
 
+    /**
+     * Returns the last known position if it is recent and accurate enough,
+     * so that a getCurrentPosition request can be answered without waiting
+     * @param maximumAge milliseconds, negative for any age
+     * @param minimumAccuracy metres, negative for any accuracy
+     * @return null if there is no such position
+     */
+    public JSONObject getCachedLocation(long maximumAge, float minimumAccuracy) {
+        IALocation location = lastKnownLocation;
+        if (location == null || !isAccurate(location, minimumAccuracy)) {
+            return null;
+        }
+        if (maximumAge >= 0 && System.currentTimeMillis() - location.getTime() > maximumAge) {
+            return null;
+        }
+        return getLastKnownLocation();
+    }
+
+    private static boolean isAccurate(IALocation location, float minimumAccuracy) {
+        return minimumAccuracy < 0 || location.getAccuracy() <= minimumAccuracy;
+    }
+
+    /**
+     * Returns the frame of the current venue, anchored by its first fix, or
+     * null before any fix in it
+     * @return
+     */
+    public synchronized VenueFrame getVenueFrame() {
+        return venueFrame;
+    }
+
+    /**
+     * Last known position in venue frame millimetres, {east, north}
+     * @return
+     */
+    public int[] getLastLocalPosition() {
+        if (lastKnownLocation == null) {
+            return null;
+        }
+        return new int[] { lastLocalPosition[0], lastLocalPosition[1] };
+    }
+
+    /**
+     * Returns the venue frame, anchoring it at the given coordinate if no fix has done so yet
+     * @param latitude
+     * @param longitude
+     * @return
+     */
+    public synchronized VenueFrame obtainVenueFrame(double latitude, double longitude) {
+        if (venueFrame == null) {
+            venueFrame = VenueFrame.forAnchor(latitude, longitude);
+        }
+        return venueFrame;
+    }
+
+    /**
+     * Drops the frame when another venue is entered or the current one is
+     * exited, so that the next fix anchors a frame for the new venue
+     * @param regionId id of the venue region
+     * @param entered
+     */
+    private synchronized void onVenueTransition(String regionId, boolean entered) {
+        if (entered ? !regionId.equals(venueId) : (venueId == null || regionId.equals(venueId))) {
+            venueFrame = null;
+            venueId = entered ? regionId : null;
+        }
+    }
+
+    /**
+     * Converts a fix into the venue frame. This is the only place positions
+     * from the SDK are converted; native consumers use the local copy.
+     * Proximity triggers are projected again when a fix anchors a new frame.
+     * @param iaLocation
+     */
+    private void updateLocalPosition(IALocation iaLocation) {
+        VenueFrame frame;
+        boolean anchored;
+        synchronized (this) {
+            anchored = venueFrame == null;
+            frame = obtainVenueFrame(iaLocation.getLatitude(), iaLocation.getLongitude());
+        }
+        if (anchored) {
+            owner.getBackgroundProcessor().setFrame(frame);
+        }
+        frame.toLocal(iaLocation.getLatitude(), iaLocation.getLongitude(), lastLocalPosition, 0);
+    }
+
     /**
      * Adds watchPosition JS callback to the collection
      * @param watchId
      * @param callbackContext
+     * @param filter null to receive every position
+     * @param streamId stream channel id, 0 for a PluginResult per position
      */
-    public void addWatch(String watchId, CallbackContext callbackContext) {
+    public void addWatch(String watchId, CallbackContext callbackContext, EventFilter filter, int streamId) {
+        if (filter != null) {
+            watchFilters.put(watchId, filter);
+        } else {
+            watchFilters.remove(watchId);
+        }
+        if (streamId > 0) {
+            owner.getStreamChannel().addStream(streamId, StreamChannel.POSITION_FIELDS, false);
+            watchStreams.put(watchId, streamId);
+        } else {
+            watchStreams.remove(watchId);
+        }
         watches.put(watchId, callbackContext);
     }
 
@@ -87,33 +234,68 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      * Adds watchRegion JS callback to the collection
      * @param watchId
      * @param callbackContext
+     * @param filter null to receive every transition
      */
-    public void addRegionWatch(String watchId, CallbackContext callbackContext) {
+    public void addRegionWatch(String watchId, CallbackContext callbackContext, EventFilter filter) {
+        if (filter != null) {
+            regionFilters.put(watchId, filter);
+        } else {
+            regionFilters.remove(watchId);
+        }
         regionWatches.put(watchId, callbackContext);
     }
 
     /**
      * Adds attitudeWatch JS callback to the collection
      * @param callbackContext
+     * @param filter null to receive every update
+     * @param streamId stream channel id, 0 for a PluginResult per update
      */
-    public void addAttitudeCallback(CallbackContext callbackContext) {
+    public void addAttitudeCallback(CallbackContext callbackContext, EventFilter filter, int streamId) {
+      attitudeFilter = filter;
+      if (streamId > 0) {
+          owner.getStreamChannel().addStream(streamId, StreamChannel.ATTITUDE_FIELDS, true);
+      }
+      attitudeStream = streamId;
       attitudeUpdateCallbackContext = callbackContext;
     }
 
     /**
      * Adds headingWatch JS callback to the collection
      * @param callbackContext
+     * @param filter null to receive every update
+     * @param streamId stream channel id, 0 for a PluginResult per update
      */
-    public void addHeadingCallback(CallbackContext callbackContext) {
+    public void addHeadingCallback(CallbackContext callbackContext, EventFilter filter, int streamId) {
+      headingFilter = filter;
+      if (streamId > 0) {
+          owner.getStreamChannel().addStream(streamId, StreamChannel.HEADING_FIELDS, true);
+      }
+      headingStream = streamId;
       headingUpdateCallbackContext = callbackContext;
     }
 
     /**
-     * Adds getCurrentPosition JS callback to the collection
+     * Adds getCurrentPosition JS callback to the collection. It is answered by
+     * the first position at least as accurate as minimumAccuracy.
      * @param callbackContext
+     * @param minimumAccuracy metres, negative for any accuracy
      */
-    public void addCallback(CallbackContext callbackContext) {
+    public void addCallback(CallbackContext callbackContext, float minimumAccuracy) {
         mCallbacks.add(callbackContext);
+        if (minimumAccuracy >= 0) {
+            mCallbackAccuracies.put(callbackContext, minimumAccuracy);
+        }
+    }
+
+    /**
+     * Removes a getCurrentPosition JS callback, e.g. on timeout
+     * @param callbackContext
+     * @return true if it was still waiting
+     */
+    public boolean removeCallback(CallbackContext callbackContext) {
+        mCallbackAccuracies.remove(callbackContext);
+        return mCallbacks.remove(callbackContext);
     }
 
     /**
@@ -129,7 +311,8 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      * @return
      */
     public int size() {
-        return watches.size() + mCallbacks.size() + regionWatches.size();
+        int background = owner.getBackgroundProcessor().isEnabled() ? 1 : 0;
+        return watches.size() + mCallbacks.size() + regionWatches.size() + background;
     }
 
     /**
@@ -140,6 +323,11 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
         if (watches.containsKey(watchId)) {
             watches.remove(watchId);
         }
+        watchFilters.remove(watchId);
+        Integer streamId = watchStreams.remove(watchId);
+        if (streamId != null) {
+            owner.getStreamChannel().removeStream(streamId);
+        }
         if (size() == 0) {
             owner.stopPositioning();
         }
@@ -150,11 +338,10 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      * @param watchId
      */
     public void clearRegionWatch(String watchId) {
-        if (regionWatches.containsKey(watchId)) {
-            regionWatches.remove(watchId);
-        }
-        if (size() == 0){
-            owner.stopPositioning();
+        regionWatches.remove(watchId);
+        regionFilters.remove(watchId);
+        if (regionWatches.isEmpty()) {
+            owner.stopPositioningIfIdle();
         }
     }
 
@@ -163,6 +350,11 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      */
     public void removeAttitudeCallback() {
       attitudeUpdateCallbackContext = null;
+      attitudeFilter = null;
+      if (attitudeStream > 0) {
+          owner.getStreamChannel().removeStream(attitudeStream);
+          attitudeStream = 0;
+      }
     }
 
     /**
@@ -170,6 +362,11 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      */
      public void removeHeadingCallback() {
        headingUpdateCallbackContext = null;
+       headingFilter = null;
+       if (headingStream > 0) {
+           owner.getStreamChannel().removeStream(headingStream);
+           headingStream = 0;
+       }
      }
 
      /**
@@ -186,8 +383,18 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      * @return
      */
     private JSONObject getRegionJSONFromIARegion(IARegion iaRegion, int transitionType) {
+        return getRegionJSONFromIARegion(iaRegion, transitionType, new JSONObject());
+    }
+
+    /**
+     * Writes IARegion info into the given JSON object and returns it.
+     * @param iaRegion
+     * @param transitionType
+     * @param regionData
+     * @return
+     */
+    private JSONObject getRegionJSONFromIARegion(IARegion iaRegion, int transitionType, JSONObject regionData) {
         try {
-            JSONObject regionData = new JSONObject();
             regionData.put("regionId", iaRegion.getId());
             regionData.put("timestamp", iaRegion.getTimestamp());
             regionData.put("regionType", iaRegion.getType());
@@ -201,14 +408,14 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
     }
 
     /**
-     * Returns a JSON object which contains IALocation info.
+     * Writes IALocation info into the given JSON objects and returns locationData.
      * @param iaLocation
+     * @param locationData
+     * @param regionData used for the nested region, if any
      * @return
      */
-    private JSONObject getLocationJSONFromIALocation(IALocation iaLocation) {
+    private JSONObject getLocationJSONFromIALocation(IALocation iaLocation, JSONObject locationData, JSONObject regionData) {
         try {
-            JSONObject locationData,regionData;
-            locationData = new JSONObject();
             locationData.put("accuracy", iaLocation.getAccuracy());
             locationData.put("altitude", iaLocation.getAltitude());
             locationData.put("heading", iaLocation.getBearing());
@@ -216,8 +423,9 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
             locationData.put("latitude", iaLocation.getLatitude());
             locationData.put("longitude", iaLocation.getLongitude());
             if (iaLocation.getRegion() != null) {
-                regionData = getRegionJSONFromIARegion(iaLocation.getRegion(), TRANSITION_TYPE_UNKNOWN);
-                locationData.put("region", regionData);
+                locationData.put("region", getRegionJSONFromIARegion(iaLocation.getRegion(), TRANSITION_TYPE_UNKNOWN, regionData));
+            } else {
+                locationData.remove("region");
             }
             locationData.put("velocity",iaLocation.toLocation().getSpeed());
             locationData.put("timestamp",iaLocation.getTime());
@@ -237,10 +445,50 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
     public void onLocationChanged(IALocation iaLocation) {
         JSONObject locationData;
         Log.w(TAG, "Got location");
-        locationData = getLocationJSONFromIALocation(iaLocation);
-        lastKnownLocation = iaLocation;
-        sendResult(locationData);
-        owner.cancelTimer();
+        TraceRecorder.begin("sdk", "onLocationChanged");
+        CostAccounting.enter();
+        try {
+            updateLocalPosition(iaLocation);
+            lastKnownLocation = iaLocation;
+            owner.addToHistory(iaLocation.getTime(), getVenueFrame(), lastLocalPosition[0], lastLocalPosition[1],
+                    iaLocation.getFloorLevel(), iaLocation.getAccuracy());
+            PositioningState state = owner.getPositioningState();
+            state.setLocation(iaLocation.getLatitude(), iaLocation.getLongitude(), iaLocation.getAltitude(),
+                    iaLocation.getAccuracy(), iaLocation.getBearing(), iaLocation.getFloorLevel(),
+                    iaLocation.hasFloorCertainty() ? iaLocation.getFloorCertainty() : Float.NaN, iaLocation.getTime(),
+                    state.hasTraceId() ? null : owner.getSessionTraceId());
+            if (iaLocation.hasFloorLevel()) {
+                owner.getFloorStateMachine().onFix(iaLocation.getLatitude(), iaLocation.getLongitude(),
+                        iaLocation.getFloorLevel(),
+                        iaLocation.hasFloorCertainty() ? iaLocation.getFloorCertainty() : Float.NaN, iaLocation.getTime());
+            }
+            boolean handled = owner.getBackgroundProcessor().onPosition(iaLocation.getTime(),
+                    iaLocation.getFloorLevel(), lastLocalPosition[0], lastLocalPosition[1]);
+            Uplink uplink = owner.getUplink();
+            if (uplink != null) {
+                uplink.onFix(iaLocation.getTime(), iaLocation.getLatitude(), iaLocation.getLongitude(),
+                        iaLocation.getFloorLevel(), iaLocation.getAccuracy());
+            }
+            // Pending getCurrentPosition requests are answered even in the background
+            if (handled && mCallbacks.isEmpty()) {
+                missedLocation = !watches.isEmpty();
+            } else {
+                missedLocation = false;
+                if (matchWatches(iaLocation)) {
+                    sendStreamSamples(iaLocation);
+                }
+                // Matched before the test, a watch must not keep the requests waiting
+                boolean callbacksMatched = matchCallbacks(iaLocation);
+                if (!matchedWatches.isEmpty() || callbacksMatched) {
+                    locationData = getLocationJSONFromIALocation(iaLocation, locationMessage, locationRegionMessage);
+                    sendResult(locationData);
+                }
+            }
+            owner.restartTimers();
+        } finally {
+            CostAccounting.exit(CostAccounting.POSITIONING, "location");
+            TraceRecorder.end("sdk", "onLocationChanged");
+        }
     }
 
     /**
@@ -248,9 +496,31 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      * @param iaRegion
      */
     @Override
-    public void onEnterRegion(IARegion iaRegion) {
-        JSONObject regionData = getRegionJSONFromIARegion(iaRegion, TRANSITION_TYPE_ENTER);
-        sendRegionResult(regionData);
+    public void onEnterRegion(final IARegion iaRegion) {
+        CommandQueues queues = owner.getQueues();
+        if (!queues.isCurrent(CommandQueues.GEOFENCE)) {
+            queues.post(CommandQueues.GEOFENCE, new Runnable() {
+                @Override
+                public void run() {
+                    onEnterRegion(iaRegion);
+                }
+            });
+            return;
+        }
+        TraceRecorder.instant("sdk", "onEnterRegion");
+        if (iaRegion.getType() == IARegion.TYPE_VENUE) {
+            onVenueTransition(iaRegion.getId(), true);
+        }
+        CostAccounting.enter();
+        try {
+            boolean handled = owner.getBackgroundProcessor().onRegion(iaRegion.getId(), iaRegion.getType(),
+                    BackgroundProcessor.TRANSITION_ENTER, iaRegion.getTimestamp());
+            owner.getPositioningState().enterRegion(iaRegion.getId(), iaRegion.getType(), iaRegion.getTimestamp());
+            setRegionValues(iaRegion, TRANSITION_TYPE_ENTER);
+            deliverRegionEvent(getRegionJSONFromIARegion(iaRegion, TRANSITION_TYPE_ENTER), handled);
+        } finally {
+            CostAccounting.exit(CostAccounting.POSITIONING, "region");
+        }
     }
 
     /**
@@ -258,9 +528,31 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      * @param iaRegion
      */
     @Override
-    public void onExitRegion(IARegion iaRegion) {
-        JSONObject regionData = getRegionJSONFromIARegion(iaRegion, TRANSITION_TYPE_EXIT);
-        sendRegionResult(regionData);
+    public void onExitRegion(final IARegion iaRegion) {
+        CommandQueues queues = owner.getQueues();
+        if (!queues.isCurrent(CommandQueues.GEOFENCE)) {
+            queues.post(CommandQueues.GEOFENCE, new Runnable() {
+                @Override
+                public void run() {
+                    onExitRegion(iaRegion);
+                }
+            });
+            return;
+        }
+        TraceRecorder.instant("sdk", "onExitRegion");
+        if (iaRegion.getType() == IARegion.TYPE_VENUE) {
+            onVenueTransition(iaRegion.getId(), false);
+        }
+        CostAccounting.enter();
+        try {
+            boolean handled = owner.getBackgroundProcessor().onRegion(iaRegion.getId(), iaRegion.getType(),
+                    BackgroundProcessor.TRANSITION_EXIT, iaRegion.getTimestamp());
+            owner.getPositioningState().exitRegion(iaRegion.getId());
+            setRegionValues(iaRegion, TRANSITION_TYPE_EXIT);
+            deliverRegionEvent(getRegionJSONFromIARegion(iaRegion, TRANSITION_TYPE_EXIT), handled);
+        } finally {
+            CostAccounting.exit(CostAccounting.POSITIONING, "region");
+        }
     }
 
     /**
@@ -269,10 +561,49 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      * @param quaternion
      */
     @Override
-    public void onOrientationChange(long timestamp, double[] quaternion) {
+    public void onOrientationChange(final long timestamp, double[] quaternion) {
+      if (owner.getBackgroundProcessor().isActive()) {
+          return;
+      }
+      CommandQueues queues = owner.getQueues();
+      if (!queues.isCurrent(CommandQueues.POSITIONING)) {
+          // The SDK may reuse the array once this returns
+          final double[] copy = quaternion.clone();
+          queues.post(CommandQueues.POSITIONING, new Runnable() {
+              @Override
+              public void run() {
+                  onOrientationChange(timestamp, copy);
+              }
+          });
+          return;
+      }
+      TraceRecorder.instant("sdk", "onOrientationChange");
+      CostAccounting.enter();
       try {
+          EventFilter filter = attitudeFilter;
+          if (filter != null) {
+              double[] numbers = orientationValues.numbers;
+              numbers[EventFilter.X] = quaternion[1];
+              numbers[EventFilter.Y] = quaternion[2];
+              numbers[EventFilter.Z] = quaternion[3];
+              numbers[EventFilter.W] = quaternion[0];
+              numbers[EventFilter.ATTITUDE_TIME] = timestamp;
+              if (!filter.matches(orientationValues)) {
+                  return;
+              }
+          }
+          int streamId = attitudeStream;
+          if (streamId > 0 && owner.getStreamChannel().hasStream(streamId)) {
+              attitudeSample[0] = quaternion[1];
+              attitudeSample[1] = quaternion[2];
+              attitudeSample[2] = quaternion[3];
+              attitudeSample[3] = quaternion[0];
+              attitudeSample[4] = timestamp;
+              owner.getStreamChannel().offer(streamId, attitudeSample);
+              return;
+          }
           JSONObject orientationData;
-          orientationData = new JSONObject();
+          orientationData = orientationMessage;
           orientationData.put("timestamp", timestamp);
           orientationData.put("x", quaternion[1]);
           orientationData.put("y", quaternion[2]);
@@ -285,6 +616,9 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
           Log.e(TAG, ex.toString());
           throw new IllegalStateException(ex.getMessage());
       }
+      finally {
+          CostAccounting.exit(CostAccounting.SENSORS, "orientation");
+      }
     }
 
     /**
@@ -293,10 +627,40 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      * @param quaternion
      */
     @Override
-    public void onHeadingChanged(long timestamp, double heading) {
+    public void onHeadingChanged(final long timestamp, final double heading) {
+      if (owner.getBackgroundProcessor().isActive()) {
+          return;
+      }
+      CommandQueues queues = owner.getQueues();
+      if (!queues.isCurrent(CommandQueues.POSITIONING)) {
+          queues.post(CommandQueues.POSITIONING, new Runnable() {
+              @Override
+              public void run() {
+                  onHeadingChanged(timestamp, heading);
+              }
+          });
+          return;
+      }
+      TraceRecorder.instant("sdk", "onHeadingChanged");
+      CostAccounting.enter();
       try {
+          EventFilter filter = headingFilter;
+          if (filter != null) {
+              headingValues.numbers[EventFilter.HEADING] = heading;
+              headingValues.numbers[EventFilter.HEADING_TIME] = timestamp;
+              if (!filter.matches(headingValues)) {
+                  return;
+              }
+          }
+          int streamId = headingStream;
+          if (streamId > 0 && owner.getStreamChannel().hasStream(streamId)) {
+              headingSample[0] = heading;
+              headingSample[1] = timestamp;
+              owner.getStreamChannel().offer(streamId, headingSample);
+              return;
+          }
           JSONObject headingData;
-          headingData = new JSONObject();
+          headingData = headingMessage;
           headingData.put("timestamp", timestamp);
           headingData.put("trueHeading", heading);
           sendHeadingResult(headingData);
@@ -305,6 +669,9 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
           Log.e(TAG, ex.toString());
           throw new IllegalStateException(ex.getMessage());
       }
+      finally {
+          CostAccounting.exit(CostAccounting.SENSORS, "heading");
+      }
     }
 
     /**
@@ -313,10 +680,14 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      */
      private void sendOrientationResult(JSONObject orientationData) {
        if (attitudeUpdateCallbackContext != null) {
+         TraceRecorder.begin("bridge", "sendOrientation");
+         CostAccounting.enter();
          PluginResult pluginResult;
          pluginResult = new PluginResult(PluginResult.Status.OK, orientationData);
          pluginResult.setKeepCallback(true);
          attitudeUpdateCallbackContext.sendPluginResult(pluginResult);
+         CostAccounting.exit(CostAccounting.BRIDGE, "orientation");
+         TraceRecorder.end("bridge", "sendOrientation");
        }
      }
 
@@ -326,10 +697,14 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      */
     private void sendHeadingResult(JSONObject headingData) {
       if (headingUpdateCallbackContext != null) {
+        TraceRecorder.begin("bridge", "sendHeading");
+        CostAccounting.enter();
         PluginResult pluginResult;
         pluginResult = new PluginResult(PluginResult.Status.OK, headingData);
         pluginResult.setKeepCallback(true);
         headingUpdateCallbackContext.sendPluginResult(pluginResult);
+        CostAccounting.exit(CostAccounting.BRIDGE, "heading");
+        TraceRecorder.end("bridge", "sendHeading");
       }
     }
 
@@ -340,36 +715,195 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
      */
     private void sendRegionResult(JSONObject regionData) {
         PluginResult pluginResult;
-        for (CallbackContext callbackContext : regionWatches.values()) {
+        for (Map.Entry<String, CallbackContext> watch : regionWatches.entrySet()) {
+            EventFilter filter = regionFilters.get(watch.getKey());
+            if (filter != null && !filter.matches(regionValues)) {
+                continue;
+            }
+            CallbackContext callbackContext = watch.getValue();
             pluginResult = new PluginResult(PluginResult.Status.OK, regionData);
             pluginResult.setKeepCallback(true);
             callbackContext.sendPluginResult(pluginResult);
         }
     }
 
+    /**
+     * Fills regionValues for the region watch filters
+     * @param iaRegion
+     * @param transitionType
+     */
+    private void setRegionValues(IARegion iaRegion, int transitionType) {
+        regionValues.numbers[EventFilter.REGION_TYPE] = iaRegion.getType();
+        regionValues.numbers[EventFilter.TRANSITION_TYPE] = transitionType;
+        regionValues.numbers[EventFilter.REGION_TIME] = iaRegion.getTimestamp();
+        regionValues.strings[EventFilter.REGION_ID] = iaRegion.getId();
+        regionValues.strings[EventFilter.TRANSITION] = transitionType == TRANSITION_TYPE_ENTER ? "enter" : "exit";
+    }
+
+    /**
+     * Sends a region transition to the region watches, or stores it in the
+     * event queue if none of them receives it, and hands it to the uplink.
+     * @param regionData
+     * @param handled true if the background processor took the transition
+     */
+    private void deliverRegionEvent(JSONObject regionData, boolean handled) {
+        boolean store = handled || regionWatches.isEmpty();
+        if (!store) {
+            sendRegionResult(regionData);
+        }
+        Uplink uplink = owner.getUplink();
+        if (!store && uplink == null) {
+            return;
+        }
+        try {
+            regionData.put("type", "region");
+        } catch (JSONException e) {
+            Log.w(TAG, e.toString());
+        }
+        if (store) {
+            owner.persistEvent(regionData);
+        }
+        if (uplink != null) {
+            uplink.onEvent(regionData);
+        }
+    }
+
     /**
      * Invokes JS callback from watchPosition callback collection.
      * @param locationData
      */
     private void sendResult(JSONObject locationData) {
         PluginResult pluginResult;
-        for (CallbackContext callbackContext : mCallbacks) {
-            pluginResult = new PluginResult(PluginResult.Status.OK, locationData);
-            pluginResult.setKeepCallback(false);
-            callbackContext.sendPluginResult(pluginResult);
-        }
+        TraceRecorder.begin("bridge", "sendLocation");
+        CostAccounting.enter();
+        try {
+            for (CallbackContext callbackContext : matchedCallbacks) {
+                pluginResult = new PluginResult(PluginResult.Status.OK, locationData);
+                pluginResult.setKeepCallback(false);
+                callbackContext.sendPluginResult(pluginResult);
+                removeCallback(callbackContext);
+            }
+            matchedCallbacks.clear();
 
-        for (CallbackContext callbackContext : watches.values()) {
-            pluginResult = new PluginResult(PluginResult.Status.OK, locationData);
-            pluginResult.setKeepCallback(true);
-            callbackContext.sendPluginResult(pluginResult);
+            for (CallbackContext callbackContext : matchedWatches) {
+                pluginResult = new PluginResult(PluginResult.Status.OK, locationData);
+                pluginResult.setKeepCallback(true);
+                callbackContext.sendPluginResult(pluginResult);
+            }
+            matchedWatches.clear();
+        } finally {
+            CostAccounting.exit(CostAccounting.BRIDGE, "location");
+            TraceRecorder.end("bridge", "sendLocation");
         }
-        mCallbacks.clear();
         if (size() == 0) {
             owner.stopPositioning();
         }
     }
 
+    /**
+     * Sends the last known position to the watches if they missed it while
+     * the app was in the background
+     */
+    public void resendLastLocation() {
+        if (!missedLocation || lastKnownLocation == null) {
+            return;
+        }
+        missedLocation = false;
+        if (matchWatches(lastKnownLocation)) {
+            sendStreamSamples(lastKnownLocation);
+            if (!matchedWatches.isEmpty()) {
+                sendResult(getLocationJSONFromIALocation(lastKnownLocation, locationMessage, locationRegionMessage));
+            }
+        }
+    }
+
+    /**
+     * Sends the position to the streams in matchedStreams
+     * @param iaLocation
+     */
+    private void sendStreamSamples(IALocation iaLocation) {
+        if (matchedStreams.isEmpty()) {
+            return;
+        }
+        StreamChannel channel = owner.getStreamChannel();
+        IARegion region = iaLocation.getRegion();
+        positionSample[0] = iaLocation.getLatitude();
+        positionSample[1] = iaLocation.getLongitude();
+        positionSample[2] = iaLocation.getAltitude();
+        positionSample[3] = iaLocation.getAccuracy();
+        positionSample[4] = iaLocation.getBearing();
+        positionSample[5] = iaLocation.toLocation().getSpeed();
+        positionSample[6] = iaLocation.getFloorLevel();
+        positionSample[7] = iaLocation.getTime();
+        positionSample[8] = region != null ? channel.intern(region.getId()) : -1;
+        positionSample[9] = region != null ? region.getType() : 0;
+        positionSample[10] = region != null ? region.getTimestamp() : 0;
+        // Not in the JSON position on Android either
+        positionSample[11] = Double.NaN;
+        CostAccounting.enter();
+        for (Integer streamId : matchedStreams) {
+            channel.offer(streamId, positionSample);
+        }
+        matchedStreams.clear();
+        CostAccounting.exit(CostAccounting.BRIDGE, "location");
+    }
+
+    /**
+     * Collects the getCurrentPosition requests the position is accurate
+     * enough for into matchedCallbacks
+     * @param iaLocation
+     * @return true if there is at least one
+     */
+    private boolean matchCallbacks(IALocation iaLocation) {
+        matchedCallbacks.clear();
+        for (CallbackContext callbackContext : mCallbacks) {
+            Float minimumAccuracy = mCallbackAccuracies.isEmpty() ? null : mCallbackAccuracies.get(callbackContext);
+            if (minimumAccuracy == null || isAccurate(iaLocation, minimumAccuracy)) {
+                matchedCallbacks.add(callbackContext);
+            }
+        }
+        return !matchedCallbacks.isEmpty();
+    }
+
+    /**
+     * Collects the watches that want the position into matchedWatches, or
+     * matchedStreams for those on the stream channel
+     * @param iaLocation
+     * @return true if there is at least one
+     */
+    private boolean matchWatches(IALocation iaLocation) {
+        matchedWatches.clear();
+        matchedStreams.clear();
+        boolean valuesSet = false;
+        for (Map.Entry<String, CallbackContext> watch : watches.entrySet()) {
+            EventFilter filter = watchFilters.isEmpty() ? null : watchFilters.get(watch.getKey());
+            if (filter != null) {
+                if (!valuesSet) {
+                    double[] numbers = positionValues.numbers;
+                    numbers[EventFilter.LATITUDE] = iaLocation.getLatitude();
+                    numbers[EventFilter.LONGITUDE] = iaLocation.getLongitude();
+                    numbers[EventFilter.ALTITUDE] = iaLocation.getAltitude();
+                    numbers[EventFilter.ACCURACY] = iaLocation.getAccuracy();
+                    numbers[EventFilter.BEARING] = iaLocation.getBearing();
+                    numbers[EventFilter.VELOCITY] = iaLocation.toLocation().getSpeed();
+                    numbers[EventFilter.FLOOR] = iaLocation.getFloorLevel();
+                    numbers[EventFilter.POSITION_TIME] = iaLocation.getTime();
+                    valuesSet = true;
+                }
+                if (!filter.matches(positionValues)) {
+                    continue;
+                }
+            }
+            Integer streamId = watchStreams.isEmpty() ? null : watchStreams.get(watch.getKey());
+            if (streamId != null && owner.getStreamChannel().hasStream(streamId)) {
+                matchedStreams.add(streamId);
+            } else {
+                matchedWatches.add(watch.getValue());
+            }
+        }
+        return !matchedWatches.isEmpty() || !matchedStreams.isEmpty();
+    }
+
     /**
      * Invokes JS callback from statusChanged callback.
      * @param statusData
@@ -409,24 +943,30 @@ public class IndoorLocationListener implements IALocationListener, IARegion.List
     @Override
     public void onStatusChanged(String provider, int status, Bundle bundle) {
         JSONObject statusData;
-        statusData = new JSONObject();
-        switch (status) {
-          case IALocationManager.STATUS_AVAILABLE:
-              statusData = CurrentStatus.getStatusObject(CurrentStatus.STATUS_AVAILABLE);
-              sendStatusResult(statusData);
-              break;
-          case IALocationManager.STATUS_LIMITED:
-              statusData = CurrentStatus.getStatusObject(CurrentStatus.STATUS_LIMITED);
-              sendStatusResult(statusData);
-              break;
-          case IALocationManager.STATUS_OUT_OF_SERVICE:
-              statusData = CurrentStatus.getStatusObject(CurrentStatus.STATUS_OUT_OF_SERVICE);
-              sendStatusResult(statusData);
-              break;
-          case IALocationManager.STATUS_TEMPORARILY_UNAVAILABLE:
-              statusData = CurrentStatus.getStatusObject(CurrentStatus.STATUS_TEMPORARILY_UNAVAILABLE);
-              sendStatusResult(statusData);
-              break;
+        TraceRecorder.instant("sdk", "onStatusChanged");
+        CostAccounting.enter();
+        try {
+            owner.getPositioningState().setStatus(status, System.currentTimeMillis());
+            switch (status) {
+              case IALocationManager.STATUS_AVAILABLE:
+                  statusData = CurrentStatus.getStatusObject(CurrentStatus.STATUS_AVAILABLE);
+                  sendStatusResult(statusData);
+                  break;
+              case IALocationManager.STATUS_LIMITED:
+                  statusData = CurrentStatus.getStatusObject(CurrentStatus.STATUS_LIMITED);
+                  sendStatusResult(statusData);
+                  break;
+              case IALocationManager.STATUS_OUT_OF_SERVICE:
+                  statusData = CurrentStatus.getStatusObject(CurrentStatus.STATUS_OUT_OF_SERVICE);
+                  sendStatusResult(statusData);
+                  break;
+              case IALocationManager.STATUS_TEMPORARILY_UNAVAILABLE:
+                  statusData = CurrentStatus.getStatusObject(CurrentStatus.STATUS_TEMPORARILY_UNAVAILABLE);
+                  sendStatusResult(statusData);
+                  break;
+            }
+        } finally {
+            CostAccounting.exit(CostAccounting.POSITIONING, "status");
         }
     }
   }
@@ -0,0 +1,552 @@
+package com.ialocation.plugin;
+
+import android.util.Log;
+
+import java.io.Closeable;
+import java.io.File;
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.io.RandomAccessFile;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayDeque;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.zip.CRC32;
+
+/**
+ * Bounded native history of fixes, so that breadcrumb trails and distance
+ * walked do not need JavaScript to keep every position it ever received.
+ *
+ * Fixes are kept in venue frame millimetres in blocks of BLOCK_FIXES,
+ * delta-encoded as zigzag varints (time, east, north, floor and accuracy
+ * differences to the previous fix), typically 6 to 8 bytes per fix. The
+ * newest MEMORY_BLOCKS blocks are kept in memory as a ring; older ones are
+ * spilled to a file of records, each a 48 byte header (frame origin, first
+ * and last time, fix count, data length, CRC32 of the data) followed by the
+ * data. On open the file is scanned and truncated after its last valid
+ * record. When it outgrows its byte bound the oldest half is dropped.
+ *
+ * query returns the fixes of a time range, simplified to at most maxPoints
+ * by Douglas-Peucker rank (a fix is kept if it is one of the maxPoints most
+ * significant; floor changes and the ends of the range are always kept),
+ * in one little-endian payload:
+ * float64 origin latitude, longitude, millimetres per degree of latitude and
+ * longitude, float64 distance walked in metres over all fixes of the range,
+ * int32 number of fixes in the range and number of points, float64 time per
+ * point, then int32 east, north, floor and accuracy in millimetres per point.
+ * Thread safe.
+ */
+public final class PositionHistory {
+    private static final String TAG = "PositionHistory";
+    public static final int BLOCK_FIXES = 256;
+    public static final int MEMORY_BLOCKS = 16;
+    public static final long DEFAULT_MAX_DISK_BYTES = 4L * 1024 * 1024;
+    public static final int DEFAULT_MAX_POINTS = 1000;
+    public static final int ENCODED_HEADER_BYTES = 48;
+    private static final int RECORD_HEADER_BYTES = 48;
+    private static final int MAX_BLOCK_BYTES = BLOCK_FIXES * 5 * 10;
+    private static final String SPILL_FILE = "history.bin";
+
+    private static final class Block {
+        double originLatitude;
+        double originLongitude;
+        long firstTime;
+        long lastTime;
+        int count;
+        byte[] data;
+        int length;
+        // Spilled blocks: position of the data in the file; the data is then null
+        long fileOffset = -1;
+        // Encoder state
+        long previousTime;
+        int previousEast;
+        int previousNorth;
+        int previousFloor;
+        int previousAccuracy;
+    }
+
+    /**
+     * Fixes decoded for a query, in one venue frame
+     */
+    private static final class Series {
+        VenueFrame frame;
+        long[] times = new long[256];
+        int[] ints = new int[256 * 4];
+        int count;
+
+        void add(long time, int east, int north, int floor, int accuracy) {
+            if (count == times.length) {
+                times = Arrays.copyOf(times, count * 2);
+                ints = Arrays.copyOf(ints, count * 8);
+            }
+            times[count] = time;
+            ints[count * 4] = east;
+            ints[count * 4 + 1] = north;
+            ints[count * 4 + 2] = floor;
+            ints[count * 4 + 3] = accuracy;
+            count++;
+        }
+    }
+
+    private final File mFile;
+    private final long mMaxDiskBytes;
+    private final ArrayList<Block> mSpilled = new ArrayList<Block>();
+    private final ArrayDeque<Block> mMemory = new ArrayDeque<Block>();
+    private Block mOpen;
+    private long mFileBytes;
+
+    /**
+     * Opens the history in dir, loading the index of the spilled blocks
+     * @param dir
+     * @param maxDiskBytes
+     * @throws IOException
+     */
+    public PositionHistory(File dir, long maxDiskBytes) throws IOException {
+        if (!dir.isDirectory() && !dir.mkdirs()) {
+            throw new IOException("Cannot create " + dir);
+        }
+        mFile = new File(dir, SPILL_FILE);
+        mMaxDiskBytes = maxDiskBytes;
+        load();
+    }
+
+    /**
+     * Records a fix. Sealing a block may spill and compact the file, so call
+     * it off the location callback thread.
+     * @param time milliseconds since the epoch
+     * @param frame venue frame of east and north
+     * @param east millimetres
+     * @param north millimetres
+     * @param floor
+     * @param accuracy metres
+     */
+    public synchronized void add(long time, VenueFrame frame, int east, int north, int floor, float accuracy) {
+        if (mOpen != null && (mOpen.count == BLOCK_FIXES || time < mOpen.lastTime
+                || mOpen.originLatitude != frame.getOriginLatitude()
+                || mOpen.originLongitude != frame.getOriginLongitude())) {
+            seal();
+        }
+        if (mOpen == null) {
+            mOpen = new Block();
+            mOpen.originLatitude = frame.getOriginLatitude();
+            mOpen.originLongitude = frame.getOriginLongitude();
+            mOpen.firstTime = time;
+            mOpen.previousTime = time;
+            mOpen.data = new byte[MAX_BLOCK_BYTES];
+        }
+        Block block = mOpen;
+        int accuracyMm = Math.round(accuracy * 1000);
+        int p = block.length;
+        p = putVarint(block.data, p, zigzag(time - block.previousTime));
+        p = putVarint(block.data, p, zigzag(east - block.previousEast));
+        p = putVarint(block.data, p, zigzag(north - block.previousNorth));
+        p = putVarint(block.data, p, zigzag(floor - block.previousFloor));
+        p = putVarint(block.data, p, zigzag(accuracyMm - block.previousAccuracy));
+        block.length = p;
+        block.previousTime = time;
+        block.previousEast = east;
+        block.previousNorth = north;
+        block.previousFloor = floor;
+        block.previousAccuracy = accuracyMm;
+        block.lastTime = time;
+        block.count++;
+    }
+
+    /**
+     * Fixes between from and to inclusive, simplified to at most maxPoints,
+     * in the layout described above
+     * @param from milliseconds since the epoch
+     * @param to
+     * @param maxPoints at least 2
+     * @return
+     * @throws IOException
+     */
+    public synchronized byte[] query(long from, long to, int maxPoints) throws IOException {
+        Series series = new Series();
+        RandomAccessFile file = null;
+        try {
+            for (Block block : mSpilled) {
+                if (block.lastTime >= from && block.firstTime <= to) {
+                    if (file == null) {
+                        file = new RandomAccessFile(mFile, "r");
+                    }
+                    byte[] data = new byte[block.length];
+                    file.seek(block.fileOffset);
+                    file.readFully(data);
+                    decode(block, data, from, to, series);
+                }
+            }
+        } finally {
+            if (file != null) {
+                file.close();
+            }
+        }
+        for (Block block : mMemory) {
+            if (block.lastTime >= from && block.firstTime <= to) {
+                decode(block, block.data, from, to, series);
+            }
+        }
+        if (mOpen != null && mOpen.lastTime >= from && mOpen.firstTime <= to) {
+            decode(mOpen, mOpen.data, from, to, series);
+        }
+        return encode(series, Math.max(2, maxPoints));
+    }
+
+    /**
+     * Spills the fixes kept in memory, so that they survive the process
+     */
+    public synchronized void sync() {
+        if (mOpen != null) {
+            seal();
+        }
+        while (!mMemory.isEmpty()) {
+            spill(mMemory.removeFirst());
+        }
+    }
+
+    /**
+     * Forgets every fix, also on disk
+     */
+    public synchronized void clear() {
+        mSpilled.clear();
+        mMemory.clear();
+        mOpen = null;
+        mFileBytes = 0;
+        if (mFile.exists() && !mFile.delete()) {
+            Log.w(TAG, "Cannot delete " + mFile);
+        }
+    }
+
+    private void seal() {
+        Block block = mOpen;
+        mOpen = null;
+        block.data = Arrays.copyOf(block.data, block.length);
+        mMemory.addLast(block);
+        while (mMemory.size() > MEMORY_BLOCKS) {
+            spill(mMemory.removeFirst());
+        }
+    }
+
+    private void spill(Block block) {
+        CRC32 crc = new CRC32();
+        crc.update(block.data, 0, block.length);
+        ByteBuffer header = ByteBuffer.allocate(RECORD_HEADER_BYTES).order(ByteOrder.LITTLE_ENDIAN);
+        header.putDouble(block.originLatitude).putDouble(block.originLongitude)
+                .putLong(block.firstTime).putLong(block.lastTime)
+                .putInt(block.count).putInt(block.length).putInt((int) crc.getValue()).putInt(0);
+        byte[] record = Arrays.copyOf(header.array(), RECORD_HEADER_BYTES + block.length);
+        System.arraycopy(block.data, 0, record, RECORD_HEADER_BYTES, block.length);
+        FileOutputStream out = null;
+        try {
+            out = new FileOutputStream(mFile, true);
+            // One write, so that a killed process leaves no half record behind
+            out.write(record);
+            block.fileOffset = mFileBytes + RECORD_HEADER_BYTES;
+            block.data = null;
+            mFileBytes += record.length;
+            mSpilled.add(block);
+        } catch (IOException e) {
+            Log.w(TAG, "Cannot spill history: " + e);
+        } finally {
+            close(out);
+        }
+        if (mFileBytes > mMaxDiskBytes) {
+            compact();
+        }
+    }
+
+    /**
+     * Drops the oldest spilled blocks until the file is at most half its bound
+     */
+    private void compact() {
+        int first = 0;
+        long bytes = mFileBytes;
+        while (first < mSpilled.size() && bytes > mMaxDiskBytes / 2) {
+            bytes -= RECORD_HEADER_BYTES + mSpilled.get(first).length;
+            first++;
+        }
+        if (first == mSpilled.size()) {
+            clearSpilled();
+            return;
+        }
+        long start = mSpilled.get(first).fileOffset - RECORD_HEADER_BYTES;
+        File temporary = new File(mFile.getPath() + ".tmp");
+        RandomAccessFile in = null;
+        FileOutputStream out = null;
+        try {
+            in = new RandomAccessFile(mFile, "r");
+            byte[] kept = new byte[(int) (mFileBytes - start)];
+            in.seek(start);
+            in.readFully(kept);
+            out = new FileOutputStream(temporary);
+            out.write(kept);
+            out.getFD().sync();
+            close(out);
+            out = null;
+            if (!temporary.renameTo(mFile)) {
+                throw new IOException("Cannot rename " + temporary);
+            }
+            mSpilled.subList(0, first).clear();
+            for (Block block : mSpilled) {
+                block.fileOffset -= start;
+            }
+            mFileBytes -= start;
+        } catch (IOException e) {
+            Log.w(TAG, "Cannot compact history: " + e);
+            clearSpilled();
+        } finally {
+            close(in);
+            close(out);
+        }
+    }
+
+    private void clearSpilled() {
+        mSpilled.clear();
+        mFileBytes = 0;
+        if (mFile.exists() && !mFile.delete()) {
+            Log.w(TAG, "Cannot delete " + mFile);
+        }
+    }
+
+    private void load() throws IOException {
+        if (!mFile.exists()) {
+            return;
+        }
+        RandomAccessFile file = new RandomAccessFile(mFile, "rw");
+        try {
+            long length = file.length();
+            long position = 0;
+            byte[] header = new byte[RECORD_HEADER_BYTES];
+            while (position + RECORD_HEADER_BYTES <= length) {
+                file.seek(position);
+                file.readFully(header);
+                ByteBuffer in = ByteBuffer.wrap(header).order(ByteOrder.LITTLE_ENDIAN);
+                Block block = new Block();
+                block.originLatitude = in.getDouble();
+                block.originLongitude = in.getDouble();
+                block.firstTime = in.getLong();
+                block.lastTime = in.getLong();
+                block.count = in.getInt();
+                block.length = in.getInt();
+                int checksum = in.getInt();
+                if (block.length <= 0 || block.length > MAX_BLOCK_BYTES
+                        || position + RECORD_HEADER_BYTES + block.length > length) {
+                    break;
+                }
+                byte[] data = new byte[block.length];
+                file.readFully(data);
+                CRC32 crc = new CRC32();
+                crc.update(data, 0, data.length);
+                if ((int) crc.getValue() != checksum) {
+                    break;
+                }
+                block.fileOffset = position + RECORD_HEADER_BYTES;
+                mSpilled.add(block);
+                position += RECORD_HEADER_BYTES + block.length;
+            }
+            if (position < length) {
+                Log.w(TAG, "Dropping " + (length - position) + " bytes after the last valid block");
+                file.setLength(position);
+            }
+            mFileBytes = position;
+        } finally {
+            file.close();
+        }
+    }
+
+    private static void decode(Block block, byte[] data, long from, long to, Series series) {
+        VenueFrame frame = new VenueFrame(block.originLatitude, block.originLongitude);
+        if (series.frame == null) {
+            series.frame = frame;
+        }
+        boolean sameFrame = series.frame.getOriginLatitude() == block.originLatitude
+                && series.frame.getOriginLongitude() == block.originLongitude;
+        long time = block.firstTime;
+        int east = 0, north = 0, floor = 0, accuracy = 0;
+        int[] position = new int[] { 0 };
+        for (int i = 0; i < block.count; i++) {
+            time += unzigzag(getVarint(data, position));
+            east += (int) unzigzag(getVarint(data, position));
+            north += (int) unzigzag(getVarint(data, position));
+            floor += (int) unzigzag(getVarint(data, position));
+            accuracy += (int) unzigzag(getVarint(data, position));
+            if (time < from || time > to) {
+                continue;
+            }
+            if (sameFrame) {
+                series.add(time, east, north, floor, accuracy);
+            } else {
+                double latitude = frame.latitude(east, north);
+                double longitude = frame.longitude(east, north);
+                series.add(time, series.frame.east(latitude, longitude), series.frame.north(latitude, longitude),
+                        floor, accuracy);
+            }
+        }
+    }
+
+    private static byte[] encode(Series series, int maxPoints) {
+        int count = series.count;
+        int[] ints = series.ints;
+        double distanceMm = 0;
+        for (int i = 1; i < count; i++) {
+            distanceMm += Math.hypot(ints[i * 4] - ints[(i - 1) * 4], ints[i * 4 + 1] - ints[(i - 1) * 4 + 1]);
+        }
+        boolean[] keep = simplify(series, maxPoints);
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            if (keep[i]) {
+                kept++;
+            }
+        }
+        ByteBuffer out = ByteBuffer.allocate(ENCODED_HEADER_BYTES + kept * 24).order(ByteOrder.LITTLE_ENDIAN);
+        VenueFrame frame = series.frame;
+        out.putDouble(frame != null ? frame.getOriginLatitude() : 0);
+        out.putDouble(frame != null ? frame.getOriginLongitude() : 0);
+        out.putDouble(frame != null ? frame.getMillimetresPerDegreeLatitude() : 0);
+        out.putDouble(frame != null ? frame.getMillimetresPerDegreeLongitude() : 0);
+        out.putDouble(distanceMm / 1000);
+        out.putInt(count);
+        out.putInt(kept);
+        for (int i = 0; i < count; i++) {
+            if (keep[i]) {
+                out.putDouble(series.times[i]);
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (keep[i]) {
+                out.putInt(ints[i * 4]).putInt(ints[i * 4 + 1]).putInt(ints[i * 4 + 2]).putInt(ints[i * 4 + 3]);
+            }
+        }
+        return out.array();
+    }
+
+    /**
+     * Ranks the fixes by Douglas-Peucker significance, the distance at which
+     * the simplification would drop them, capped by that of the span they
+     * split so that ranks are consistent with the recursion, and keeps the
+     * maxPoints highest
+     */
+    private static boolean[] simplify(Series series, int maxPoints) {
+        int count = series.count;
+        boolean[] keep = new boolean[count];
+        if (count <= maxPoints) {
+            Arrays.fill(keep, true);
+            return keep;
+        }
+        int[] ints = series.ints;
+        double[] significance = new double[count];
+        int[] stack = new int[64];
+        double[] caps = new double[32];
+        int start = 0;
+        for (int j = 1; j <= count; j++) {
+            if (j < count && ints[j * 4 + 2] == ints[start * 4 + 2]) {
+                continue;
+            }
+            int end = j - 1;
+            significance[start] = Double.POSITIVE_INFINITY;
+            significance[end] = Double.POSITIVE_INFINITY;
+            int top = 0;
+            stack[top++] = start;
+            stack[top++] = end;
+            caps[0] = Double.POSITIVE_INFINITY;
+            while (top > 0) {
+                int b = stack[--top];
+                int a = stack[--top];
+                double cap = caps[top / 2];
+                int worst = -1;
+                double worstDistance = -1;
+                for (int i = a + 1; i < b; i++) {
+                    double d = segmentDistance(ints, i, a, b);
+                    if (d > worstDistance) {
+                        worst = i;
+                        worstDistance = d;
+                    }
+                }
+                if (worst < 0) {
+                    continue;
+                }
+                double rank = Math.min(worstDistance, cap);
+                significance[worst] = rank;
+                if (top + 4 > stack.length) {
+                    stack = Arrays.copyOf(stack, stack.length * 2);
+                    caps = Arrays.copyOf(caps, caps.length * 2);
+                }
+                caps[top / 2] = rank;
+                stack[top++] = a;
+                stack[top++] = worst;
+                caps[top / 2] = rank;
+                stack[top++] = worst;
+                stack[top++] = b;
+            }
+            start = j;
+        }
+        double[] sorted = significance.clone();
+        Arrays.sort(sorted);
+        double threshold = sorted[count - maxPoints];
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            if (significance[i] > threshold) {
+                keep[i] = true;
+                kept++;
+            }
+        }
+        // Ties at the threshold fill the remaining places in time order
+        for (int i = 0; i < count && kept < maxPoints; i++) {
+            if (!keep[i] && significance[i] == threshold) {
+                keep[i] = true;
+                kept++;
+            }
+        }
+        return keep;
+    }
+
+    private static double segmentDistance(int[] ints, int i, int a, int b) {
+        double ax = ints[a * 4], ay = ints[a * 4 + 1];
+        double dx = ints[b * 4] - ax, dy = ints[b * 4 + 1] - ay;
+        double px = ints[i * 4] - ax, py = ints[i * 4 + 1] - ay;
+        double lengthSquared = dx * dx + dy * dy;
+        double t = lengthSquared > 0 ? (px * dx + py * dy) / lengthSquared : 0;
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+        return Math.hypot(px - t * dx, py - t * dy);
+    }
+
+    private static long zigzag(long value) {
+        return (value << 1) ^ (value >> 63);
+    }
+
+    private static long unzigzag(long value) {
+        return (value >>> 1) ^ -(value & 1);
+    }
+
+    private static int putVarint(byte[] out, int position, long value) {
+        while ((value & ~0x7fL) != 0) {
+            out[position++] = (byte) ((value & 0x7f) | 0x80);
+            value >>>= 7;
+        }
+        out[position++] = (byte) value;
+        return position;
+    }
+
+    private static long getVarint(byte[] in, int[] position) {
+        long value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            byte b = in[position[0]++];
+            value |= (long) (b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                break;
+            }
+        }
+        return value;
+    }
+
+    private static void close(Closeable closeable) {
+        if (closeable != null) {
+            try {
+                closeable.close();
+            } catch (IOException e) {
+                Log.w(TAG, e.toString());
+            }
+        }
+    }
+}
@@ -0,0 +1,182 @@
+package com.ialocation.plugin;
+
+import org.json.JSONException;
+import org.json.JSONObject;
+
+/**
+ * One versioned record of what a status panel shows: the last position with
+ * its floor certainty, the service status, the current region, the trace id
+ * of the positioning session and whether positioning runs.
+ *
+ * Each SDK event updates its part of the record under one lock and bumps the
+ * version once, so a snapshot never mixes a position with the trace id of
+ * another session. Every part remembers the version it last changed at, and
+ * snapshot(since, epoch) returns only the parts that changed after since,
+ * or all of them for another epoch, e.g. 0 or that of an earlier process.
+ */
+public final class PositioningState {
+    private final long mEpoch = System.currentTimeMillis();
+    private long mVersion;
+
+    private long mLocationVersion;
+    private boolean mHasLocation;
+    private double mLatitude;
+    private double mLongitude;
+    private double mAltitude;
+    private double mAccuracy;
+    private double mHeading;
+    private int mFloor;
+    private float mFloorCertainty;
+    private long mLocationTime;
+
+    private long mStatusVersion;
+    private int mStatusCode = -1;
+    private long mStatusTime;
+
+    private long mRegionVersion;
+    private String mRegionId;
+    private int mRegionType;
+    private long mRegionTime;
+
+    private long mTraceIdVersion;
+    private String mTraceId;
+
+    private long mRunningVersion;
+    private boolean mRunning;
+
+    /**
+     * Records a position
+     * @param floorCertainty NaN if unknown
+     * @param traceId trace id of the session, null to keep the current one
+     */
+    public synchronized void setLocation(double latitude, double longitude, double altitude, double accuracy,
+                                         double heading, int floor, float floorCertainty, long time, String traceId) {
+        mVersion++;
+        mHasLocation = true;
+        mLatitude = latitude;
+        mLongitude = longitude;
+        mAltitude = altitude;
+        mAccuracy = accuracy;
+        mHeading = heading;
+        mFloor = floor;
+        mFloorCertainty = floorCertainty;
+        mLocationTime = time;
+        mLocationVersion = mVersion;
+        if (traceId != null && !traceId.equals(mTraceId)) {
+            mTraceId = traceId;
+            mTraceIdVersion = mVersion;
+        }
+    }
+
+    /**
+     * @return true if the trace id of the running session is known
+     */
+    public synchronized boolean hasTraceId() {
+        return mTraceId != null;
+    }
+
+    /**
+     * Records a service status, one of the CurrentStatus codes
+     */
+    public synchronized void setStatus(int code, long time) {
+        mVersion++;
+        mStatusCode = code;
+        mStatusTime = time;
+        mStatusVersion = mVersion;
+    }
+
+    public synchronized void enterRegion(String regionId, int regionType, long time) {
+        mVersion++;
+        mRegionId = regionId;
+        mRegionType = regionType;
+        mRegionTime = time;
+        mRegionVersion = mVersion;
+    }
+
+    /**
+     * Forgets the current region if it is the one exited
+     */
+    public synchronized void exitRegion(String regionId) {
+        if (mRegionId != null && mRegionId.equals(regionId)) {
+            mVersion++;
+            mRegionId = null;
+            mRegionVersion = mVersion;
+        }
+    }
+
+    /**
+     * Records positioning being started or stopped. A new session gets a new
+     * trace id, which the next position fills in.
+     */
+    public synchronized void setRunning(boolean running) {
+        if (running == mRunning) {
+            return;
+        }
+        mVersion++;
+        mRunning = running;
+        mRunningVersion = mVersion;
+        if (running && mTraceId != null) {
+            mTraceId = null;
+            mTraceIdVersion = mVersion;
+        }
+    }
+
+    /**
+     * Returns { epoch, version, full } and the parts changed after since:
+     * location, status, region, traceId and running, each null if unknown
+     * @param since version the caller has
+     * @param epoch epoch of that version, 0 for all parts
+     * @return
+     * @throws JSONException
+     */
+    public synchronized JSONObject snapshot(long since, long epoch) throws JSONException {
+        boolean full = epoch != mEpoch || since > mVersion;
+        if (full) {
+            since = 0;
+        }
+        JSONObject state = new JSONObject();
+        state.put("epoch", mEpoch);
+        state.put("version", mVersion);
+        state.put("full", full);
+        if (full || mLocationVersion > since) {
+            JSONObject location = null;
+            if (mHasLocation) {
+                location = new JSONObject();
+                location.put("latitude", mLatitude);
+                location.put("longitude", mLongitude);
+                location.put("altitude", mAltitude);
+                location.put("accuracy", mAccuracy);
+                location.put("heading", mHeading);
+                location.put("flr", mFloor);
+                location.put("floorCertainty", Float.isNaN(mFloorCertainty) ? JSONObject.NULL : mFloorCertainty);
+                location.put("timestamp", mLocationTime);
+            }
+            state.put("location", location != null ? location : JSONObject.NULL);
+        }
+        if (full || mStatusVersion > since) {
+            JSONObject status = null;
+            if (mStatusCode >= 0) {
+                status = CurrentStatus.getStatusObject(mStatusCode);
+                status.put("timestamp", mStatusTime);
+            }
+            state.put("status", status != null ? status : JSONObject.NULL);
+        }
+        if (full || mRegionVersion > since) {
+            JSONObject region = null;
+            if (mRegionId != null) {
+                region = new JSONObject();
+                region.put("regionId", mRegionId);
+                region.put("regionType", mRegionType);
+                region.put("timestamp", mRegionTime);
+            }
+            state.put("region", region != null ? region : JSONObject.NULL);
+        }
+        if (full || mTraceIdVersion > since) {
+            state.put("traceId", mTraceId != null ? mTraceId : JSONObject.NULL);
+        }
+        if (full || mRunningVersion > since) {
+            state.put("running", mRunning);
+        }
+        return state;
+    }
+}
@@ -0,0 +1,241 @@
+package com.ialocation.plugin;
+
+import com.indooratlas.android.wayfinding.IARoutingLeg;
+import com.indooratlas.android.wayfinding.IARoutingPoint;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayDeque;
+import java.util.concurrent.atomic.AtomicLong;
+
+/**
+ * Flat, reusable storage for a route in venue frame coordinates.
+ *
+ * Legs are kept in parallel primitive arrays that only grow, so once a buffer
+ * has seen the longest route of a session, filling it again allocates nothing.
+ * Buffers are recycled through a small pool: acquire one per request and
+ * release it in a finally block once the route has been encoded.
+ */
+public final class RouteBuffer {
+    private static final int POOL_SIZE = 4;
+    private static final int INITIAL_CAPACITY = 16;
+    private static final ArrayDeque<RouteBuffer> sPool = new ArrayDeque<RouteBuffer>(POOL_SIZE);
+    private static final AtomicLong sAllocatedBytes = new AtomicLong();
+
+    /** Per leg: begin east, begin north, begin floor, end east, end north, end floor, edge index */
+    public static final int INT_STRIDE = 7;
+    /** Bytes before the legs in the encoded form, see encode */
+    public static final int ENCODED_HEADER_BYTES = 40;
+    public static final int ENCODED_VERSION = 1;
+
+    private int[] mInts = new int[INITIAL_CAPACITY * INT_STRIDE];
+    private double[] mLengths = new double[INITIAL_CAPACITY];
+    private double[] mDirections = new double[INITIAL_CAPACITY];
+    private int mLegCount;
+
+    private RouteBuffer() {
+        sAllocatedBytes.addAndGet(residentBytes());
+    }
+
+    /**
+     * Returns a pooled buffer, or a new one when the pool is empty
+     * @return
+     */
+    public static RouteBuffer acquire() {
+        synchronized (sPool) {
+            RouteBuffer buffer = sPool.pollFirst();
+            if (buffer != null) {
+                return buffer;
+            }
+        }
+        return new RouteBuffer();
+    }
+
+    /**
+     * Returns the buffer to the pool. The caller must not use it afterwards.
+     * @param buffer
+     */
+    public static void release(RouteBuffer buffer) {
+        if (buffer == null) {
+            return;
+        }
+        buffer.mLegCount = 0;
+        synchronized (sPool) {
+            if (sPool.size() < POOL_SIZE) {
+                sPool.addFirst(buffer);
+            }
+        }
+    }
+
+    /**
+     * Replaces the contents with the given legs converted into the frame
+     * @param legs
+     * @param frame
+     */
+    public void fill(IARoutingLeg[] legs, VenueFrame frame) {
+        resize(legs.length);
+        for (int i = 0; i < legs.length; i++) {
+            IARoutingLeg leg = legs[i];
+            IARoutingPoint begin = leg.getBegin();
+            IARoutingPoint end = leg.getEnd();
+            Integer edgeIndex = leg.getEdgeIndex();
+            setLeg(i, begin.getLatitude(), begin.getLongitude(), begin.getFloor(),
+                    end.getLatitude(), end.getLongitude(), end.getFloor(),
+                    edgeIndex != null ? edgeIndex : -1, leg.getLength(), leg.getDirection(), frame);
+        }
+    }
+
+    /**
+     * Sets the number of legs, growing the arrays if needed. Each leg must then be set with setLeg.
+     * @param legs
+     */
+    public void resize(int legs) {
+        ensureCapacity(legs);
+        mLegCount = legs;
+    }
+
+    /**
+     * Sets one leg, converting its end points into the frame
+     */
+    public void setLeg(int leg, double beginLatitude, double beginLongitude, int beginFloor,
+                       double endLatitude, double endLongitude, int endFloor,
+                       int edgeIndex, double length, double direction, VenueFrame frame) {
+        int base = leg * INT_STRIDE;
+        frame.toLocal(beginLatitude, beginLongitude, mInts, base);
+        mInts[base + 2] = beginFloor;
+        frame.toLocal(endLatitude, endLongitude, mInts, base + 3);
+        mInts[base + 5] = endFloor;
+        mInts[base + 6] = edgeIndex;
+        mLengths[leg] = length;
+        mDirections[leg] = direction;
+    }
+
+    /**
+     * Bytes allocated by all buffers since the process started, to check that
+     * steady-state routing reuses them
+     * @return
+     */
+    public static long allocatedBytes() {
+        return sAllocatedBytes.get();
+    }
+
+    /**
+     * Bytes held by buffers waiting in the pool
+     * @return
+     */
+    public static long pooledBytes() {
+        long total = 0;
+        synchronized (sPool) {
+            for (RouteBuffer buffer : sPool) {
+                total += buffer.residentBytes();
+            }
+        }
+        return total;
+    }
+
+    /**
+     * Drops the pooled buffers, e.g. under memory pressure
+     * @return bytes freed
+     */
+    public static long clearPool() {
+        synchronized (sPool) {
+            long freed = pooledBytes();
+            sPool.clear();
+            return freed;
+        }
+    }
+
+    /**
+     * Bytes held by this buffer's arrays
+     * @return
+     */
+    public long residentBytes() {
+        return mInts.length * 4L + mLengths.length * 8L + mDirections.length * 8L;
+    }
+
+    public int getLegCount() {
+        return mLegCount;
+    }
+
+    public int getBeginEast(int leg) {
+        return mInts[leg * INT_STRIDE];
+    }
+
+    public int getBeginNorth(int leg) {
+        return mInts[leg * INT_STRIDE + 1];
+    }
+
+    public int getBeginFloor(int leg) {
+        return mInts[leg * INT_STRIDE + 2];
+    }
+
+    public int getEndEast(int leg) {
+        return mInts[leg * INT_STRIDE + 3];
+    }
+
+    public int getEndNorth(int leg) {
+        return mInts[leg * INT_STRIDE + 4];
+    }
+
+    public int getEndFloor(int leg) {
+        return mInts[leg * INT_STRIDE + 5];
+    }
+
+    /**
+     * Edge index in the original graph, -1 for the synthetic first and last legs
+     */
+    public int getEdgeIndex(int leg) {
+        return mInts[leg * INT_STRIDE + 6];
+    }
+
+    public double getLength(int leg) {
+        return mLengths[leg];
+    }
+
+    public double getDirection(int leg) {
+        return mDirections[leg];
+    }
+
+    /**
+     * Encodes the route for JavaScript, where it arrives as an ArrayBuffer.
+     * Little-endian: float64 origin latitude and longitude and millimetres per
+     * degree of latitude and longitude of the frame, int32 leg count and
+     * ENCODED_VERSION, INT_STRIDE int32 per leg, zero padding to a multiple
+     * of 8 bytes, and a float64 length in metres per leg.
+     * @param frame the frame the buffer was filled with
+     * @return
+     */
+    public byte[] encode(VenueFrame frame) {
+        int intBytes = mLegCount * INT_STRIDE * 4;
+        int lengthsOffset = ENCODED_HEADER_BYTES + ((intBytes + 7) & ~7);
+        ByteBuffer out = ByteBuffer.allocate(lengthsOffset + mLegCount * 8).order(ByteOrder.LITTLE_ENDIAN);
+        out.putDouble(frame.getOriginLatitude());
+        out.putDouble(frame.getOriginLongitude());
+        out.putDouble(frame.getMillimetresPerDegreeLatitude());
+        out.putDouble(frame.getMillimetresPerDegreeLongitude());
+        out.putInt(mLegCount);
+        out.putInt(ENCODED_VERSION);
+        for (int i = 0; i < mLegCount * INT_STRIDE; i++) {
+            out.putInt(mInts[i]);
+        }
+        out.position(lengthsOffset);
+        for (int i = 0; i < mLegCount; i++) {
+            out.putDouble(mLengths[i]);
+        }
+        return out.array();
+    }
+
+    private void ensureCapacity(int legs) {
+        if (legs <= mLengths.length) {
+            return;
+        }
+        int capacity = mLengths.length;
+        while (capacity < legs) {
+            capacity *= 2;
+        }
+        mInts = new int[capacity * INT_STRIDE];
+        mLengths = new double[capacity];
+        mDirections = new double[capacity];
+        sAllocatedBytes.addAndGet(residentBytes());
+    }
+}
@@ -0,0 +1,268 @@
+package com.ialocation.plugin;
+
+import org.apache.cordova.CallbackContext;
+import org.apache.cordova.PluginResult;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.Charset;
+import java.util.ArrayList;
+import java.util.HashMap;
+
+/**
+ * Multiplexed binary channel for the high rate streams: positions of the
+ * watches, heading and attitude. Instead of a PluginResult per update, all
+ * streams share one long-lived callback that receives framed ArrayBuffers,
+ * and IndoorAtlas.js hands the samples to the listeners they belong to.
+ *
+ * A frame is little-endian: uint16 version, uint16 section count and uint32
+ * frame sequence number, then the sections. A section is uint16 stream id,
+ * uint16 fields per sample, uint32 sample count, uint32 stream sequence
+ * number of its first sample and uint32 samples coalesced away before it,
+ * followed by the samples as float64. Stream 0 carries strings the samples
+ * refer to by index, each as uint32 index, uint32 UTF-8 length and the bytes,
+ * padded to 8 bytes; it is sent before the first sample that needs them.
+ *
+ * Flow control: at most WINDOW_FRAMES frames are unacknowledged, and
+ * JavaScript acknowledges every ACK_EVERY_FRAMES frames. While the window
+ * is full samples are coalesced, keeping the latest of a sensor stream and
+ * the newest QUEUE_CAPACITY positions, and go out together on the next ack.
+ * At low rates every update is a frame of its own, sent right away.
+ */
+public final class StreamChannel {
+    public static final int VERSION = 1;
+    public static final int WINDOW_FRAMES = 8;
+    public static final int ACK_EVERY_FRAMES = 4;
+    public static final int QUEUE_CAPACITY = 64;
+
+    public static final int STRINGS_STREAM = 0;
+
+    /**
+     * latitude, longitude, altitude, accuracy, heading, velocity, floor,
+     * timestamp, region id string index or -1, region type, region timestamp,
+     * altitude accuracy or NaN
+     */
+    public static final int POSITION_FIELDS = 12;
+    /**
+     * trueHeading, timestamp
+     */
+    public static final int HEADING_FIELDS = 2;
+    /**
+     * x, y, z, w, timestamp
+     */
+    public static final int ATTITUDE_FIELDS = 5;
+
+    private static final int FRAME_HEADER_BYTES = 8;
+    private static final int SECTION_HEADER_BYTES = 16;
+    private static final Charset UTF8 = Charset.forName("UTF-8");
+
+    private static final class Stream {
+        final int id;
+        final int fields;
+        final int capacity;
+        final double[] samples;
+        int head;
+        int count;
+        int nextSample;
+        int dropped;
+
+        Stream(int id, int fields, int capacity) {
+            this.id = id;
+            this.fields = fields;
+            this.capacity = capacity;
+            this.samples = new double[fields * capacity];
+        }
+    }
+
+    /**
+     * Delivers one frame, called with the channel locked
+     */
+    public interface Sender {
+        void send(byte[] frame);
+    }
+
+    private Sender mSender;
+    private int mSequence;
+    private int mAcknowledged;
+    private final ArrayList<Stream> mStreams = new ArrayList<Stream>();
+    private final ArrayList<String> mStrings = new ArrayList<String>();
+    private final HashMap<String, Integer> mStringIndex = new HashMap<String, Integer>();
+    private int mStringsSent;
+
+    /**
+     * Makes the callback the channel's, replacing the previous one, e.g.
+     * after a page reload. Strings are sent again.
+     * @param callbackContext
+     */
+    public void open(final CallbackContext callbackContext) {
+        open(new Sender() {
+            @Override
+            public void send(byte[] frame) {
+                TraceRecorder.begin("bridge", "sendStreamFrame");
+                PluginResult result = new PluginResult(PluginResult.Status.OK, frame);
+                result.setKeepCallback(true);
+                callbackContext.sendPluginResult(result);
+                TraceRecorder.end("bridge", "sendStreamFrame");
+            }
+        });
+    }
+
+    /**
+     * Makes the sender the channel's, replacing the previous one and its streams
+     * @param sender
+     */
+    public synchronized void open(Sender sender) {
+        mSender = sender;
+        mSequence = 0;
+        mAcknowledged = 0;
+        mStringsSent = 0;
+        mStreams.clear();
+    }
+
+    public synchronized boolean isOpen() {
+        return mSender != null;
+    }
+
+    /**
+     * Adds a stream; JavaScript chooses its id
+     * @param id
+     * @param fields values per sample
+     * @param latestOnly true to keep only the latest sample while the window is full
+     */
+    public synchronized void addStream(int id, int fields, boolean latestOnly) {
+        removeStream(id);
+        mStreams.add(new Stream(id, fields, latestOnly ? 1 : QUEUE_CAPACITY));
+    }
+
+    /**
+     * Drops a stream and its pending samples
+     * @param id
+     */
+    public synchronized void removeStream(int id) {
+        for (int i = 0; i < mStreams.size(); i++) {
+            if (mStreams.get(i).id == id) {
+                mStreams.remove(i);
+                return;
+            }
+        }
+    }
+
+    public synchronized boolean hasStream(int id) {
+        return find(id) != null;
+    }
+
+    /**
+     * Index of a string for samples to refer to
+     * @param string
+     * @return
+     */
+    public synchronized int intern(String string) {
+        Integer index = mStringIndex.get(string);
+        if (index == null) {
+            index = mStrings.size();
+            mStrings.add(string);
+            mStringIndex.put(string, index);
+        }
+        return index;
+    }
+
+    /**
+     * Queues a sample and sends it if the window allows
+     * @param id
+     * @param sample fields values, copied
+     */
+    public synchronized void offer(int id, double[] sample) {
+        Stream stream = find(id);
+        if (stream == null || mSender == null) {
+            return;
+        }
+        int slot;
+        if (stream.count == stream.capacity) {
+            slot = stream.head;
+            stream.head = (stream.head + 1) % stream.capacity;
+            stream.dropped++;
+        } else {
+            slot = (stream.head + stream.count) % stream.capacity;
+            stream.count++;
+        }
+        System.arraycopy(sample, 0, stream.samples, slot * stream.fields, stream.fields);
+        stream.nextSample++;
+        flush();
+    }
+
+    /**
+     * Called when JavaScript has handled the frames up to sequence
+     * @param sequence
+     */
+    public synchronized void acknowledge(int sequence) {
+        if (sequence - mAcknowledged > 0 && mSequence - sequence >= 0) {
+            mAcknowledged = sequence;
+            flush();
+        }
+    }
+
+    private Stream find(int id) {
+        for (Stream stream : mStreams) {
+            if (stream.id == id) {
+                return stream;
+            }
+        }
+        return null;
+    }
+
+    private void flush() {
+        if (mSender == null || mSequence - mAcknowledged >= WINDOW_FRAMES) {
+            return;
+        }
+        int sections = 0;
+        int bytes = FRAME_HEADER_BYTES;
+        for (Stream stream : mStreams) {
+            if (stream.count > 0) {
+                sections++;
+                bytes += SECTION_HEADER_BYTES + stream.count * stream.fields * 8;
+            }
+        }
+        if (sections == 0) {
+            return;
+        }
+        byte[][] strings = null;
+        if (mStringsSent < mStrings.size()) {
+            strings = new byte[mStrings.size() - mStringsSent][];
+            bytes += SECTION_HEADER_BYTES;
+            for (int i = 0; i < strings.length; i++) {
+                strings[i] = mStrings.get(mStringsSent + i).getBytes(UTF8);
+                bytes += (8 + strings[i].length + 7) & ~7;
+            }
+            sections++;
+        }
+
+        ByteBuffer out = ByteBuffer.allocate(bytes).order(ByteOrder.LITTLE_ENDIAN);
+        mSequence++;
+        out.putShort((short) VERSION).putShort((short) sections).putInt(mSequence);
+        if (strings != null) {
+            out.putShort((short) STRINGS_STREAM).putShort((short) 0).putInt(strings.length).putInt(mStringsSent).putInt(0);
+            for (int i = 0; i < strings.length; i++) {
+                out.putInt(mStringsSent + i).putInt(strings[i].length).put(strings[i]);
+                out.position((out.position() + 7) & ~7);
+            }
+            mStringsSent = mStrings.size();
+        }
+        for (Stream stream : mStreams) {
+            if (stream.count == 0) {
+                continue;
+            }
+            out.putShort((short) stream.id).putShort((short) stream.fields).putInt(stream.count)
+                    .putInt(stream.nextSample - stream.count).putInt(stream.dropped);
+            for (int i = 0; i < stream.count; i++) {
+                int base = ((stream.head + i) % stream.capacity) * stream.fields;
+                for (int f = 0; f < stream.fields; f++) {
+                    out.putDouble(stream.samples[base + f]);
+                }
+            }
+            stream.head = 0;
+            stream.count = 0;
+            stream.dropped = 0;
+        }
+        mSender.send(out.array());
+    }
+}
@@ -0,0 +1,342 @@
+package com.ialocation.plugin;
+
+import android.os.Process;
+import android.util.Log;
+
+import java.util.ArrayDeque;
+import java.util.concurrent.atomic.AtomicInteger;
+
+/**
+ * Work-stealing scheduler shared by all native work of the plugin (routing,
+ * resource processing, prefetching, ...), so that subsystems do not start
+ * their own threads or block the Cordova and UI threads.
+ *
+ * Tasks submitted from outside the scheduler go to one of three shared lanes
+ * which are drained in priority order. A task submitted from a worker for the
+ * lane that worker is currently running goes to the worker's own deque and is
+ * taken LIFO; idle workers steal from the other end of those deques. A worker
+ * only takes from its deque while no shared lane of higher priority has work,
+ * so long background chains do not hold up interactive tasks. Workers run
+ * each task at the thread priority of its lane. The number of workers is
+ * bounded by the number of cores, leaving one for the UI thread.
+ */
+public final class TaskScheduler {
+    private static final String TAG = "TaskScheduler";
+
+    public static final int LANE_INTERACTIVE = 0;
+    public static final int LANE_BACKGROUND = 1;
+    public static final int LANE_IDLE = 2;
+    private static final int LANE_COUNT = 3;
+    private static final String[] LANE_NAMES = {"interactive", "background", "idle"};
+    private static final int[] LANE_THREAD_PRIORITY = {
+            Process.THREAD_PRIORITY_DEFAULT,
+            Process.THREAD_PRIORITY_BACKGROUND,
+            Process.THREAD_PRIORITY_LOWEST
+    };
+
+    private static TaskScheduler sShared;
+
+    /**
+     * Cancels a submitted task. Tasks that have not started are dropped; running
+     * tasks should poll isCancelled() at convenient points.
+     */
+    public static final class CancellationToken {
+        private volatile boolean mCancelled;
+
+        public void cancel() {
+            mCancelled = true;
+        }
+
+        public boolean isCancelled() {
+            return mCancelled;
+        }
+    }
+
+    private static final class Task {
+        final Runnable runnable;
+        final int lane;
+        final CancellationToken token;
+        final String subsystem;
+
+        Task(Runnable runnable, int lane, CancellationToken token, String subsystem) {
+            this.runnable = runnable;
+            this.lane = lane;
+            this.token = token;
+            this.subsystem = subsystem;
+        }
+    }
+
+    private final class Worker extends Thread {
+        final int index;
+        final ArrayDeque<Task> deque = new ArrayDeque<Task>();
+        int currentLane = -1;
+        int threadPriority = Process.THREAD_PRIORITY_DEFAULT;
+
+        Worker(int index) {
+            super("IATaskScheduler-" + index);
+            this.index = index;
+            setDaemon(true);
+        }
+
+        @Override
+        public void run() {
+            Task task;
+            while ((task = nextTask(this)) != null) {
+                execute(this, task);
+            }
+        }
+    }
+
+    private final Object mLock = new Object();
+    private final ArrayDeque<Task>[] mLanes;
+    private final Worker[] mWorkers;
+    private final AtomicInteger mLocalPending = new AtomicInteger();
+    private int mIdleWorkers;
+    private boolean mShutdown;
+
+    /**
+     * Returns the process wide scheduler
+     * @return
+     */
+    public static synchronized TaskScheduler getShared() {
+        if (sShared == null) {
+            sShared = new TaskScheduler(defaultThreadCount());
+        }
+        return sShared;
+    }
+
+    /**
+     * One worker per core, minus one for the UI thread
+     * @return
+     */
+    public static int defaultThreadCount() {
+        return Math.max(1, Runtime.getRuntime().availableProcessors() - 1);
+    }
+
+    /**
+     * The constructor
+     * @param threadCount
+     */
+    @SuppressWarnings("unchecked")
+    public TaskScheduler(int threadCount) {
+        mLanes = new ArrayDeque[LANE_COUNT];
+        for (int i = 0; i < LANE_COUNT; i++) {
+            mLanes[i] = new ArrayDeque<Task>();
+        }
+        mWorkers = new Worker[Math.max(1, threadCount)];
+        for (int i = 0; i < mWorkers.length; i++) {
+            mWorkers[i] = new Worker(i);
+        }
+        for (Worker worker : mWorkers) {
+            worker.start();
+        }
+    }
+
+    public int getThreadCount() {
+        return mWorkers.length;
+    }
+
+    /**
+     * Schedules a task and returns a token that can cancel it
+     * @param lane
+     * @param runnable
+     * @return
+     */
+    public CancellationToken submit(int lane, Runnable runnable) {
+        return submit(lane, CostAccounting.SCHEDULER, runnable);
+    }
+
+    /**
+     * Schedules a task whose cost is accounted to the given subsystem
+     * @param lane
+     * @param subsystem CostAccounting subsystem, the lane is the feature
+     * @param runnable
+     * @return
+     */
+    public CancellationToken submit(int lane, String subsystem, Runnable runnable) {
+        CancellationToken token = new CancellationToken();
+        submit(lane, token, subsystem, runnable);
+        return token;
+    }
+
+    /**
+     * Schedules a task under an existing token, e.g. the steps of one request
+     * @param lane
+     * @param token
+     * @param runnable
+     */
+    public void submit(int lane, CancellationToken token, Runnable runnable) {
+        submit(lane, token, CostAccounting.SCHEDULER, runnable);
+    }
+
+    /**
+     * Schedules a task under an existing token, accounted to the given subsystem
+     * @param lane
+     * @param token
+     * @param subsystem
+     * @param runnable
+     */
+    public void submit(int lane, CancellationToken token, String subsystem, Runnable runnable) {
+        if (lane < 0 || lane >= LANE_COUNT) {
+            throw new IllegalArgumentException("Unknown lane " + lane);
+        }
+        Task task = new Task(runnable, lane, token, subsystem);
+        Thread current = Thread.currentThread();
+        if (current instanceof Worker && ((Worker) current).currentLane == lane
+                && isOwnWorker((Worker) current)) {
+            Worker worker = (Worker) current;
+            synchronized (worker.deque) {
+                worker.deque.addFirst(task);
+            }
+            mLocalPending.incrementAndGet();
+            synchronized (mLock) {
+                if (mIdleWorkers > 0) {
+                    mLock.notify();
+                }
+            }
+            return;
+        }
+        synchronized (mLock) {
+            mLanes[lane].addLast(task);
+            mLock.notify();
+        }
+    }
+
+    /**
+     * Stops the workers once the queued tasks have been dropped
+     */
+    public void shutdown() {
+        synchronized (mLock) {
+            mShutdown = true;
+            for (ArrayDeque<Task> lane : mLanes) {
+                lane.clear();
+            }
+            mLock.notifyAll();
+        }
+    }
+
+    private boolean isOwnWorker(Worker worker) {
+        return worker.index < mWorkers.length && mWorkers[worker.index] == worker;
+    }
+
+    private Task nextTask(Worker worker) {
+        while (true) {
+            Task task = pollShared(localLane(worker));
+            if (task == null) {
+                task = pollLocal(worker);
+            }
+            if (task == null) {
+                task = pollShared(LANE_COUNT);
+            }
+            if (task == null) {
+                task = steal(worker);
+            }
+            if (task != null) {
+                return task;
+            }
+            synchronized (mLock) {
+                if (mShutdown) {
+                    return null;
+                }
+                if (mLocalPending.get() == 0 && sharedEmpty()) {
+                    mIdleWorkers++;
+                    try {
+                        mLock.wait();
+                    } catch (InterruptedException ex) {
+                        return null;
+                    } finally {
+                        mIdleWorkers--;
+                    }
+                }
+            }
+        }
+    }
+
+    private Task pollLocal(Worker worker) {
+        Task task;
+        synchronized (worker.deque) {
+            task = worker.deque.pollFirst();
+        }
+        if (task != null) {
+            mLocalPending.decrementAndGet();
+        }
+        return task;
+    }
+
+    /**
+     * Lane of the task the worker would take from its deque, LANE_COUNT if there is none
+     */
+    private int localLane(Worker worker) {
+        synchronized (worker.deque) {
+            Task task = worker.deque.peekFirst();
+            return task != null ? task.lane : LANE_COUNT;
+        }
+    }
+
+    /**
+     * Takes the first task of the shared lanes before the given one
+     * @param lanes number of lanes to look at, in priority order
+     */
+    private Task pollShared(int lanes) {
+        if (lanes == 0) {
+            return null;
+        }
+        synchronized (mLock) {
+            for (int i = 0; i < lanes; i++) {
+                Task task = mLanes[i].pollFirst();
+                if (task != null) {
+                    return task;
+                }
+            }
+        }
+        return null;
+    }
+
+    private boolean sharedEmpty() {
+        for (ArrayDeque<Task> lane : mLanes) {
+            if (!lane.isEmpty()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    private Task steal(Worker thief) {
+        if (mLocalPending.get() == 0) {
+            return null;
+        }
+        for (int i = 1; i < mWorkers.length; i++) {
+            Worker victim = mWorkers[(thief.index + i) % mWorkers.length];
+            Task task;
+            synchronized (victim.deque) {
+                task = victim.deque.pollLast();
+            }
+            if (task != null) {
+                mLocalPending.decrementAndGet();
+                return task;
+            }
+        }
+        return null;
+    }
+
+    private void execute(Worker worker, Task task) {
+        if (task.token != null && task.token.isCancelled()) {
+            return;
+        }
+        int priority = LANE_THREAD_PRIORITY[task.lane];
+        if (worker.threadPriority != priority) {
+            Process.setThreadPriority(priority);
+            worker.threadPriority = priority;
+        }
+        worker.currentLane = task.lane;
+        CostAccounting.enter();
+        try {
+            task.runnable.run();
+        } catch (Throwable ex) {
+            Log.e(TAG, ex.toString());
+        } finally {
+            CostAccounting.exit(task.subsystem, LANE_NAMES[task.lane]);
+            worker.currentLane = -1;
+        }
+    }
+}
@@ -0,0 +1,329 @@
+package com.ialocation.plugin;
+
+import android.util.Log;
+
+import java.util.ArrayList;
+
+/**
+ * Hierarchical timing wheel shared by every timer of the plugin: request
+ * timeouts, cached position expiry, dwell timers and presence TTLs.
+ *
+ * Four levels of 64 slots cover 2^24 ticks (about 46 hours at the default
+ * 10 ms tick); later deadlines wait in an overflow list. Each slot is an
+ * intrusive doubly-linked list, so scheduling and cancelling are O(1). When a
+ * level wraps, the matching slot of the next level is cascaded down. Expired
+ * tasks run on the wheel thread outside the lock and must be short; tasks
+ * touching plugin state should post to the thread that owns it.
+ *
+ * The wheel thread sleeps while no timers are pending and otherwise wakes
+ * only at the next occupied slot of the lowest level or its next wrap.
+ */
+public final class TimingWheel {
+    private static final String TAG = "TimingWheel";
+
+    public static final long DEFAULT_TICK_MS = 10;
+    private static final int SLOT_BITS = 6;
+    private static final int SLOTS = 1 << SLOT_BITS;
+    private static final int SLOT_MASK = SLOTS - 1;
+    private static final int LEVELS = 4;
+    private static final long RANGE = 1L << (SLOT_BITS * LEVELS);
+    private static final int LEVEL_OVERFLOW = LEVELS;
+
+    private static TimingWheel sShared;
+
+    /**
+     * Handle of a scheduled task
+     */
+    public static final class Timeout {
+        private final TimingWheel mWheel;
+        private final Runnable mTask;
+        private final long mDeadline;
+        private int mLevel = -1;
+        private int mSlot;
+        private Timeout mPrev;
+        private Timeout mNext;
+
+        private Timeout(TimingWheel wheel, Runnable task, long deadline) {
+            mWheel = wheel;
+            mTask = task;
+            mDeadline = deadline;
+        }
+
+        /**
+         * Cancels the task if it has not run yet
+         * @return true if the task was pending
+         */
+        public boolean cancel() {
+            return mWheel.cancel(this);
+        }
+
+        public boolean isPending() {
+            synchronized (mWheel.mLock) {
+                return mLevel >= 0;
+            }
+        }
+    }
+
+    private final Object mLock = new Object();
+    private final long mTickMs;
+    private final long mOriginNanos = System.nanoTime();
+    private final Timeout[][] mSlots = new Timeout[LEVELS + 1][SLOTS];
+    private long mCurrentTick;
+    private int mPending;
+    private long mWakeTick = Long.MAX_VALUE;
+    private Thread mThread;
+
+    /**
+     * Returns the process wide wheel, started on first use
+     * @return
+     */
+    public static synchronized TimingWheel getShared() {
+        if (sShared == null) {
+            sShared = new TimingWheel(DEFAULT_TICK_MS);
+            sShared.start();
+        }
+        return sShared;
+    }
+
+    /**
+     * The constructor. The wheel does not advance until start() is called or
+     * the owner calls advanceTo() itself.
+     * @param tickMs
+     */
+    public TimingWheel(long tickMs) {
+        if (tickMs <= 0) {
+            throw new IllegalArgumentException("tickMs must be positive");
+        }
+        mTickMs = tickMs;
+    }
+
+    /**
+     * Starts the wheel thread
+     */
+    public void start() {
+        synchronized (mLock) {
+            if (mThread != null) {
+                return;
+            }
+            mThread = new Thread(new Runnable() {
+                @Override
+                public void run() {
+                    loop();
+                }
+            }, "IATimingWheel");
+            mThread.setDaemon(true);
+            mThread.start();
+        }
+    }
+
+    /**
+     * Milliseconds since the wheel was created, the time base of advanceTo()
+     * @return
+     */
+    public long nowMs() {
+        return (System.nanoTime() - mOriginNanos) / 1000000L;
+    }
+
+    /**
+     * Schedules a task to run once after the given delay
+     * @param delayMs
+     * @param task
+     * @return handle for cancelling the task
+     */
+    public Timeout schedule(long delayMs, Runnable task) {
+        long nowTick = nowMs() / mTickMs;
+        long ticks = (Math.max(0, delayMs) + mTickMs - 1) / mTickMs;
+        synchronized (mLock) {
+            if (mPending == 0 && nowTick > mCurrentTick) {
+                // Nothing to cascade, skip the idle ticks
+                mCurrentTick = nowTick;
+            }
+            Timeout timeout = new Timeout(this, task, Math.max(mCurrentTick, nowTick + ticks));
+            insert(timeout);
+            mPending++;
+            if (timeout.mDeadline < mWakeTick) {
+                mLock.notifyAll();
+            }
+            return timeout;
+        }
+    }
+
+    /**
+     * Cancels a scheduled task
+     * @param timeout
+     * @return true if the task was pending
+     */
+    public boolean cancel(Timeout timeout) {
+        synchronized (mLock) {
+            if (timeout == null || timeout.mLevel < 0) {
+                return false;
+            }
+            unlink(timeout);
+            mPending--;
+            return true;
+        }
+    }
+
+    /**
+     * Number of tasks that have neither run nor been cancelled
+     * @return
+     */
+    public int size() {
+        synchronized (mLock) {
+            return mPending;
+        }
+    }
+
+    /**
+     * Runs, on the calling thread, every task due at the given time
+     * @param nowMs time in the base of nowMs()
+     * @return number of tasks run
+     */
+    public int advanceTo(long nowMs) {
+        ArrayList<Timeout> expired = new ArrayList<Timeout>();
+        synchronized (mLock) {
+            collectExpired(nowMs / mTickMs, expired);
+        }
+        for (int i = 0, n = expired.size(); i < n; i++) {
+            try {
+                expired.get(i).mTask.run();
+            } catch (RuntimeException ex) {
+                Log.e(TAG, ex.toString());
+            }
+        }
+        return expired.size();
+    }
+
+    private void loop() {
+        ArrayList<Timeout> expired = new ArrayList<Timeout>();
+        while (true) {
+            synchronized (mLock) {
+                long nowTick = nowMs() / mTickMs;
+                collectExpired(nowTick, expired);
+                if (expired.isEmpty()) {
+                    mWakeTick = mPending == 0 ? Long.MAX_VALUE : nextWakeTick();
+                    long waitMs = mWakeTick == Long.MAX_VALUE ? 0 : Math.max(1, (mWakeTick - nowTick) * mTickMs);
+                    try {
+                        mLock.wait(waitMs);
+                    } catch (InterruptedException ex) {
+                        return;
+                    }
+                    mWakeTick = Long.MAX_VALUE;
+                    continue;
+                }
+            }
+            CostAccounting.enter();
+            for (int i = 0, n = expired.size(); i < n; i++) {
+                try {
+                    expired.get(i).mTask.run();
+                } catch (RuntimeException ex) {
+                    Log.e(TAG, ex.toString());
+                }
+            }
+            CostAccounting.exit(CostAccounting.TIMERS, "expire");
+            expired.clear();
+        }
+    }
+
+    /**
+     * Processes ticks up to and including nowTick. Caller holds mLock.
+     */
+    private void collectExpired(long nowTick, ArrayList<Timeout> out) {
+        while (mCurrentTick <= nowTick && mPending > 0) {
+            long tick = mCurrentTick;
+            if ((tick & SLOT_MASK) == 0) {
+                cascade(tick);
+            }
+            int slot = (int) (tick & SLOT_MASK);
+            Timeout timeout = mSlots[0][slot];
+            mSlots[0][slot] = null;
+            while (timeout != null) {
+                Timeout next = timeout.mNext;
+                timeout.mLevel = -1;
+                timeout.mPrev = null;
+                timeout.mNext = null;
+                out.add(timeout);
+                mPending--;
+                timeout = next;
+            }
+            mCurrentTick = tick + 1;
+        }
+        if (mPending == 0 && mCurrentTick <= nowTick) {
+            mCurrentTick = nowTick + 1;
+        }
+    }
+
+    /**
+     * Moves the timers of the higher level slots that start at this tick down
+     */
+    private void cascade(long tick) {
+        for (int level = 1; level <= LEVELS; level++) {
+            // The overflow list is revisited whenever the top level wraps
+            int slot = level == LEVELS ? 0 : (int) ((tick >>> (SLOT_BITS * level)) & SLOT_MASK);
+            Timeout timeout = mSlots[level][slot];
+            mSlots[level][slot] = null;
+            while (timeout != null) {
+                Timeout next = timeout.mNext;
+                timeout.mPrev = null;
+                timeout.mNext = null;
+                insert(timeout);
+                timeout = next;
+            }
+            if (slot != 0) {
+                return;
+            }
+        }
+    }
+
+    private void insert(Timeout timeout) {
+        long delta = timeout.mDeadline - mCurrentTick;
+        int level;
+        int slot;
+        if (delta < SLOTS) {
+            level = 0;
+            slot = (int) (timeout.mDeadline & SLOT_MASK);
+        } else if (delta < RANGE) {
+            level = 1;
+            while (delta >= (1L << (SLOT_BITS * (level + 1)))) {
+                level++;
+            }
+            slot = (int) ((timeout.mDeadline >>> (SLOT_BITS * level)) & SLOT_MASK);
+        } else {
+            level = LEVEL_OVERFLOW;
+            slot = 0;
+        }
+        timeout.mLevel = level;
+        timeout.mSlot = slot;
+        Timeout head = mSlots[level][slot];
+        timeout.mNext = head;
+        if (head != null) {
+            head.mPrev = timeout;
+        }
+        mSlots[level][slot] = timeout;
+    }
+
+    private void unlink(Timeout timeout) {
+        if (timeout.mPrev != null) {
+            timeout.mPrev.mNext = timeout.mNext;
+        } else {
+            mSlots[timeout.mLevel][timeout.mSlot] = timeout.mNext;
+        }
+        if (timeout.mNext != null) {
+            timeout.mNext.mPrev = timeout.mPrev;
+        }
+        timeout.mPrev = null;
+        timeout.mNext = null;
+        timeout.mLevel = -1;
+    }
+
+    /**
+     * Next occupied slot of the lowest level, or its next wrap if it is empty
+     */
+    private long nextWakeTick() {
+        for (long tick = mCurrentTick; ; tick++) {
+            if ((tick & SLOT_MASK) == 0 || mSlots[0][(int) (tick & SLOT_MASK)] != null) {
+                return tick;
+            }
+        }
+    }
+}
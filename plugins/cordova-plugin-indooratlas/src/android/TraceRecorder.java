@@ -0,0 +1,291 @@
+package com.ialocation.plugin;
+
+import android.os.Process;
+
+import org.json.JSONArray;
+import org.json.JSONException;
+import org.json.JSONObject;
+
+import java.lang.ref.WeakReference;
+import java.util.concurrent.CopyOnWriteArrayList;
+
+/**
+ * Low overhead timeline recorder for field sessions, exported in the Chrome
+ * trace event format and tagged with the IndoorAtlas trace id.
+ *
+ * Every thread records into its own ring buffer, so recording takes no lock
+ * and never blocks: the owning thread fills a slot and then publishes it by
+ * a volatile write of the count. A thread's buffer is registered once, on its
+ * first event, and dropped when a new recording starts or a dump finds it
+ * stale after the thread has ended. When recording is off, each hook costs
+ * one volatile read.
+ *
+ * A hook that read sEnabled just before a dump paused recording could still
+ * be filling a slot while the dump reads it. Each buffer therefore raises a
+ * volatile writing flag and checks sEnabled again before it writes, and the
+ * dump waits for the flag to drop after pausing: either the writer sees the
+ * pause and skips the event, or the dump sees the flag and waits.
+ * Starting a new recording bumps a generation which each thread notices on
+ * its next event and resets its own buffer. Names must not be built per call
+ * unless isEnabled() was checked first.
+ *
+ * sEnabled is what the hooks read. Whether a recording runs is kept apart in
+ * sRecording, so that a dump pausing the hooks never turns a recording that
+ * was stopped meanwhile back on.
+ */
+public final class TraceRecorder {
+    public static final int DEFAULT_CAPACITY = 4096;
+
+    private static final char PHASE_BEGIN = 'B';
+    private static final char PHASE_END = 'E';
+    private static final char PHASE_COUNTER = 'C';
+    private static final char PHASE_INSTANT = 'i';
+    private static final char PHASE_ASYNC_BEGIN = 'b';
+    private static final char PHASE_ASYNC_END = 'e';
+
+    private static volatile boolean sEnabled;
+    private static final Object sControlLock = new Object();
+    // Guarded by sControlLock
+    private static boolean sRecording;
+    private static int sPauses;
+    private static volatile int sGeneration;
+    private static volatile int sCapacity = DEFAULT_CAPACITY;
+    private static volatile long sStartNanos;
+    private static volatile long sStartWallMs;
+    private static final CopyOnWriteArrayList<Buffer> sBuffers = new CopyOnWriteArrayList<Buffer>();
+
+    private static final ThreadLocal<Buffer> sLocal = new ThreadLocal<Buffer>() {
+        @Override
+        protected Buffer initialValue() {
+            Buffer buffer = new Buffer(Process.myTid(), Thread.currentThread());
+            sBuffers.add(buffer);
+            return buffer;
+        }
+    };
+
+    /**
+     * Events of one thread. Only the owning thread writes.
+     */
+    private static final class Buffer {
+        final int tid;
+        final String threadName;
+        // Weak, so that the registry does not keep ended threads alive
+        final WeakReference<Thread> owner;
+        int generation = -1;
+        long[] timestamps;
+        char[] phases;
+        String[] categories;
+        String[] names;
+        double[] values;
+        long[] ids;
+        volatile long count;
+        volatile boolean writing;
+
+        Buffer(int tid, Thread owner) {
+            this.tid = tid;
+            this.threadName = owner.getName();
+            this.owner = new WeakReference<Thread>(owner);
+        }
+
+        boolean hasEnded() {
+            Thread thread = owner.get();
+            return thread == null || !thread.isAlive();
+        }
+
+        void reset(int generation, int capacity) {
+            if (timestamps == null || timestamps.length != capacity) {
+                timestamps = new long[capacity];
+                phases = new char[capacity];
+                categories = new String[capacity];
+                names = new String[capacity];
+                values = new double[capacity];
+                ids = new long[capacity];
+            }
+            count = 0;
+            this.generation = generation;
+        }
+    }
+
+    private TraceRecorder() {
+    }
+
+    /**
+     * Starts a new recording, dropping the previous one
+     * @param capacityPerThread events kept per thread; older ones are overwritten
+     */
+    public static void start(int capacityPerThread) {
+        synchronized (sControlLock) {
+            sEnabled = false;
+            sCapacity = Math.max(64, capacityPerThread);
+            sStartNanos = System.nanoTime();
+            sStartWallMs = System.currentTimeMillis();
+            sGeneration++;
+            sRecording = true;
+            // A running dump turns the hooks on when it is done
+            sEnabled = sPauses == 0;
+        }
+        for (Buffer buffer : sBuffers) {
+            if (buffer.hasEnded()) {
+                sBuffers.remove(buffer);
+            }
+        }
+    }
+
+    public static void stop() {
+        synchronized (sControlLock) {
+            sRecording = false;
+            sEnabled = false;
+        }
+    }
+
+    public static boolean isEnabled() {
+        return sEnabled;
+    }
+
+    public static void begin(String category, String name) {
+        if (sEnabled) {
+            record(PHASE_BEGIN, category, name, 0, 0);
+        }
+    }
+
+    public static void end(String category, String name) {
+        if (sEnabled) {
+            record(PHASE_END, category, name, 0, 0);
+        }
+    }
+
+    public static void instant(String category, String name) {
+        if (sEnabled) {
+            record(PHASE_INSTANT, category, name, 0, 0);
+        }
+    }
+
+    public static void counter(String category, String name, double value) {
+        if (sEnabled) {
+            record(PHASE_COUNTER, category, name, value, 0);
+        }
+    }
+
+    /**
+     * Start of an operation that may end on another thread, e.g. a fetch
+     * @param category
+     * @param name
+     * @param id pairs the begin with its end
+     */
+    public static void asyncBegin(String category, String name, long id) {
+        if (sEnabled) {
+            record(PHASE_ASYNC_BEGIN, category, name, 0, id);
+        }
+    }
+
+    public static void asyncEnd(String category, String name, long id) {
+        if (sEnabled) {
+            record(PHASE_ASYNC_END, category, name, 0, id);
+        }
+    }
+
+    private static void record(char phase, String category, String name, double value, long id) {
+        Buffer buffer = sLocal.get();
+        buffer.writing = true;
+        if (!sEnabled) {
+            buffer.writing = false;
+            return;
+        }
+        int generation = sGeneration;
+        if (buffer.generation != generation) {
+            buffer.reset(generation, sCapacity);
+        }
+        long count = buffer.count;
+        int slot = (int) (count % buffer.timestamps.length);
+        buffer.timestamps[slot] = System.nanoTime();
+        buffer.phases[slot] = phase;
+        buffer.categories[slot] = category;
+        buffer.names[slot] = name;
+        buffer.values[slot] = value;
+        buffer.ids[slot] = id;
+        buffer.count = count + 1;
+        buffer.writing = false;
+    }
+
+    /**
+     * Exports the current recording as a Chrome trace JSON object. Recording is
+     * paused while exporting so that no buffer wraps under the reader.
+     * @param traceId IndoorAtlas trace id of the positioning session, may be null
+     * @return
+     * @throws JSONException
+     */
+    public static JSONObject dump(String traceId) throws JSONException {
+        synchronized (sControlLock) {
+            sPauses++;
+            sEnabled = false;
+        }
+        try {
+            int generation = sGeneration;
+            long startNanos = sStartNanos;
+            int pid = Process.myPid();
+            JSONArray events = new JSONArray();
+            long dropped = 0;
+            for (Buffer buffer : sBuffers) {
+                while (buffer.writing) {
+                    Thread.yield();
+                }
+                if (buffer.generation != generation) {
+                    if (buffer.hasEnded()) {
+                        sBuffers.remove(buffer);
+                    }
+                    continue;
+                }
+                long count = buffer.count;
+                int capacity = buffer.timestamps.length;
+                long first = Math.max(0, count - capacity);
+                dropped += first;
+
+                JSONObject threadName = new JSONObject();
+                threadName.put("name", "thread_name");
+                threadName.put("ph", "M");
+                threadName.put("pid", pid);
+                threadName.put("tid", buffer.tid);
+                threadName.put("args", new JSONObject().put("name", buffer.threadName));
+                events.put(threadName);
+
+                for (long i = first; i < count; i++) {
+                    int slot = (int) (i % capacity);
+                    char phase = buffer.phases[slot];
+                    JSONObject event = new JSONObject();
+                    event.put("name", buffer.names[slot]);
+                    event.put("cat", buffer.categories[slot]);
+                    event.put("ph", String.valueOf(phase));
+                    event.put("ts", (buffer.timestamps[slot] - startNanos) / 1000.0);
+                    event.put("pid", pid);
+                    event.put("tid", buffer.tid);
+                    if (phase == PHASE_COUNTER) {
+                        event.put("args", new JSONObject().put("value", buffer.values[slot]));
+                    } else if (phase == PHASE_ASYNC_BEGIN || phase == PHASE_ASYNC_END) {
+                        event.put("id", Long.toHexString(buffer.ids[slot]));
+                    } else if (phase == PHASE_INSTANT) {
+                        event.put("s", "t");
+                    }
+                    events.put(event);
+                }
+            }
+
+            JSONObject metadata = new JSONObject();
+            metadata.put("traceId", traceId != null ? traceId : JSONObject.NULL);
+            metadata.put("platform", "android");
+            metadata.put("startWallClockMs", sStartWallMs);
+            metadata.put("droppedEvents", dropped);
+
+            JSONObject trace = new JSONObject();
+            trace.put("traceEvents", events);
+            trace.put("displayTimeUnit", "ms");
+            trace.put("otherData", metadata);
+            return trace;
+        } finally {
+            synchronized (sControlLock) {
+                if (--sPauses == 0) {
+                    sEnabled = sRecording;
+                }
+            }
+        }
+    }
+}
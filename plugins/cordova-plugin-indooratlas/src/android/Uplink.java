@@ -0,0 +1,501 @@
+package com.ialocation.plugin;
+
+import android.util.Log;
+
+import org.json.JSONArray;
+import org.json.JSONException;
+import org.json.JSONObject;
+
+import java.io.ByteArrayOutputStream;
+import java.io.File;
+import java.io.FileInputStream;
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+import java.net.HttpURLConnection;
+import java.net.URL;
+import java.nio.charset.Charset;
+import java.util.HashMap;
+import java.util.Iterator;
+import java.util.Map;
+import java.util.Random;
+import java.util.UUID;
+import java.util.zip.Deflater;
+
+/**
+ * Uploads fixes and events to a backend in batches instead of one request
+ * each, so that the radio wakes up once per batch.
+ *
+ * Items are first appended to an EventQueue of their own, which makes the
+ * upload resumable: a batch is the next run of items after the uplink's
+ * acknowledged offset and is only acknowledged once the backend accepted it.
+ * A batch is sent when batchEvents items are pending or intervalMs after the
+ * first of them, and the uplink then drains everything pending. Each request
+ * carries the stream id and offset range of its items, so the backend can
+ * drop the duplicates of a batch whose response was lost.
+ *
+ * The body is the columnar encoding of encode(), deflated. Network errors,
+ * 5xx, 408 and 429 are retried with jittered exponential backoff; any other
+ * status rejects the batch, which is then skipped.
+ */
+public final class Uplink {
+    private static final String TAG = "Uplink";
+    public static final int DEFAULT_BATCH_EVENTS = 500;
+    public static final long DEFAULT_INTERVAL_MS = 60 * 1000;
+    public static final long DEFAULT_BACKOFF_BASE_MS = 5000;
+    public static final long DEFAULT_BACKOFF_MAX_MS = 10 * 60 * 1000;
+    public static final String CONTENT_TYPE = "application/vnd.indooratlas.batch";
+    private static final byte[] MAGIC = {'I', 'A', 'U', 2};
+    private static final String CONSUMER = "uplink";
+    private static final String STREAM_FILE = "stream-id";
+    private static final Charset UTF8 = Charset.forName("UTF-8");
+
+    /**
+     * Sends one request. Called on the background lane and may block.
+     */
+    public interface Transport {
+        /**
+         * @return the HTTP status
+         * @throws IOException if no response was received
+         */
+        int post(String url, byte[] body, Map<String, String> headers) throws IOException;
+    }
+
+    /**
+     * Transport over HttpURLConnection
+     */
+    public static final Transport HTTP = new Transport() {
+        @Override
+        public int post(String url, byte[] body, Map<String, String> headers) throws IOException {
+            HttpURLConnection connection = (HttpURLConnection) new URL(url).openConnection();
+            try {
+                connection.setConnectTimeout(15000);
+                connection.setReadTimeout(30000);
+                connection.setDoOutput(true);
+                connection.setRequestMethod("POST");
+                connection.setFixedLengthStreamingMode(body.length);
+                for (Map.Entry<String, String> header : headers.entrySet()) {
+                    connection.setRequestProperty(header.getKey(), header.getValue());
+                }
+                OutputStream out = connection.getOutputStream();
+                out.write(body);
+                out.close();
+                int status = connection.getResponseCode();
+                InputStream in = status < 400 ? connection.getInputStream() : connection.getErrorStream();
+                if (in != null) {
+                    byte[] buffer = new byte[1024];
+                    while (in.read(buffer) > 0) {
+                    }
+                    in.close();
+                }
+                return status;
+            } finally {
+                connection.disconnect();
+            }
+        }
+    };
+
+    private final EventQueue mQueue;
+    private final Transport mTransport;
+    private final TimingWheel mWheel;
+    private final String mStreamId;
+    private final Random mRandom = new Random();
+
+    private boolean mEnabled;
+    private String mUrl;
+    private final HashMap<String, String> mHeaders = new HashMap<String, String>();
+    private int mBatchEvents = DEFAULT_BATCH_EVENTS;
+    private long mIntervalMs = DEFAULT_INTERVAL_MS;
+    private long mBackoffBaseMs = DEFAULT_BACKOFF_BASE_MS;
+    private long mBackoffMaxMs = DEFAULT_BACKOFF_MAX_MS;
+    private boolean mFixes = true;
+    private boolean mEvents = true;
+
+    private TimingWheel.Timeout mTimer;
+    private boolean mUploading;
+    private int mPending;
+    private int mAttempt;
+
+    private long mRequests;
+    private long mBatches;
+    private long mItems;
+    private long mRawBytes;
+    private long mWireBytes;
+    private long mRetries;
+    private long mRejected;
+    private int mLastStatus;
+
+    /**
+     * Opens the uplink's queue in a directory
+     * @param dir
+     * @param transport
+     * @param wheel
+     * @throws IOException
+     */
+    public Uplink(File dir, Transport transport, TimingWheel wheel) throws IOException {
+        mQueue = new EventQueue(dir, EventQueue.DEFAULT_MAX_BYTES, EventQueue.DEFAULT_SEGMENT_BYTES);
+        mTransport = transport;
+        mWheel = wheel;
+        mStreamId = loadStreamId(new File(dir, STREAM_FILE));
+    }
+
+    /**
+     * Sets the backend and batching rules and enables the uplink. Items left
+     * from an earlier run are sent right away.
+     * @param options { url, headers, batchEvents, intervalMs, backoffBaseMs, backoffMaxMs, fixes, events }
+     * @throws JSONException
+     */
+    public synchronized void configure(JSONObject options) throws JSONException {
+        mUrl = options.getString("url");
+        mHeaders.clear();
+        JSONObject headers = options.optJSONObject("headers");
+        if (headers != null) {
+            Iterator<String> keys = headers.keys();
+            while (keys.hasNext()) {
+                String key = keys.next();
+                mHeaders.put(key, headers.getString(key));
+            }
+        }
+        mBatchEvents = Math.max(1, options.optInt("batchEvents", DEFAULT_BATCH_EVENTS));
+        mIntervalMs = Math.max(0, options.optLong("intervalMs", DEFAULT_INTERVAL_MS));
+        mBackoffBaseMs = Math.max(1, options.optLong("backoffBaseMs", DEFAULT_BACKOFF_BASE_MS));
+        mBackoffMaxMs = Math.max(mBackoffBaseMs, options.optLong("backoffMaxMs", DEFAULT_BACKOFF_MAX_MS));
+        mFixes = options.optBoolean("fixes", true);
+        mEvents = options.optBoolean("events", true);
+        mEnabled = true;
+        mAttempt = 0;
+        cancelTimer();
+        schedule(0);
+    }
+
+    /**
+     * Stops uploading. Queued items stay on disk for the next configure.
+     */
+    public synchronized void disable() {
+        mEnabled = false;
+        cancelTimer();
+    }
+
+    public synchronized boolean isEnabled() {
+        return mEnabled;
+    }
+
+    /**
+     * Queues a position
+     * @param timeMs
+     * @param latitude
+     * @param longitude
+     * @param floor
+     * @param accuracy metres
+     */
+    public void onFix(long timeMs, double latitude, double longitude, int floor, float accuracy) {
+        if (!isFixesEnabled()) {
+            return;
+        }
+        try {
+            JSONObject fix = new JSONObject();
+            fix.put("type", "fix");
+            fix.put("t", timeMs);
+            fix.put("lat", latitude);
+            fix.put("lon", longitude);
+            fix.put("floor", floor);
+            fix.put("acc", accuracy);
+            append(fix);
+        } catch (JSONException e) {
+            Log.w(TAG, e.toString());
+        }
+    }
+
+    /**
+     * Queues an event, e.g. a region transition or a background trigger
+     * @param event
+     */
+    public void onEvent(JSONObject event) {
+        synchronized (this) {
+            if (!mEnabled || !mEvents) {
+                return;
+            }
+        }
+        append(event);
+    }
+
+    private synchronized boolean isFixesEnabled() {
+        return mEnabled && mFixes;
+    }
+
+    private void append(JSONObject item) {
+        try {
+            mQueue.append(item);
+        } catch (IOException e) {
+            Log.e(TAG, "Cannot queue item: " + e);
+            return;
+        }
+        synchronized (this) {
+            schedule(++mPending >= mBatchEvents ? 0 : mIntervalMs);
+        }
+    }
+
+    /**
+     * Schedules an upload unless one is running or scheduled. An upload due
+     * now replaces one scheduled later, except a retry waiting for its backoff.
+     */
+    private void schedule(long delayMs) {
+        if (!mEnabled || mUploading) {
+            return;
+        }
+        if (mTimer != null) {
+            if (delayMs > 0 || mAttempt > 0) {
+                return;
+            }
+            mTimer.cancel();
+        }
+        mTimer = mWheel.schedule(delayMs, new Runnable() {
+            @Override
+            public void run() {
+                TaskScheduler.getShared().submit(TaskScheduler.LANE_BACKGROUND, CostAccounting.NETWORK, new Runnable() {
+                    @Override
+                    public void run() {
+                        upload();
+                    }
+                });
+            }
+        });
+    }
+
+    private void cancelTimer() {
+        if (mTimer != null) {
+            mTimer.cancel();
+            mTimer = null;
+        }
+    }
+
+    /**
+     * Sends batches until nothing is pending or a request fails
+     */
+    void upload() {
+        String url;
+        HashMap<String, String> headers;
+        int batchEvents;
+        synchronized (this) {
+            mTimer = null;
+            if (!mEnabled || mUploading) {
+                return;
+            }
+            mUploading = true;
+            mPending = 0;
+            url = mUrl;
+            headers = new HashMap<String, String>(mHeaders);
+            batchEvents = mBatchEvents;
+        }
+        headers.put("Content-Type", CONTENT_TYPE);
+        headers.put("Content-Encoding", "deflate");
+        headers.put("X-IA-Stream", mStreamId);
+        boolean failed = false;
+        try {
+            while (true) {
+                JSONObject batch = mQueue.read(CONSUMER, batchEvents);
+                JSONArray items = batch.getJSONArray("events");
+                if (items.length() == 0) {
+                    break;
+                }
+                long first = items.getJSONObject(0).getLong("offset");
+                long last = batch.getLong("lastOffset");
+                byte[] raw = encode(items);
+                byte[] body = deflate(raw);
+                headers.put("X-IA-Offsets", first + "-" + last);
+                int status;
+                try {
+                    status = mTransport.post(url, body, headers);
+                } catch (IOException e) {
+                    status = -1;
+                }
+                synchronized (this) {
+                    mRequests++;
+                    mWireBytes += body.length;
+                    mLastStatus = status;
+                }
+                if (status == -1 || status >= 500 || status == 408 || status == 429) {
+                    failed = true;
+                    break;
+                }
+                mQueue.ack(CONSUMER, last);
+                synchronized (this) {
+                    if (status >= 200 && status < 300) {
+                        mBatches++;
+                        mItems += items.length();
+                        mRawBytes += raw.length;
+                    } else {
+                        // The backend refuses the batch itself, retrying cannot help
+                        mRejected++;
+                    }
+                    mAttempt = 0;
+                }
+            }
+        } catch (IOException e) {
+            Log.e(TAG, "upload failed: " + e);
+            failed = true;
+        } catch (JSONException e) {
+            Log.e(TAG, "upload failed: " + e);
+            failed = true;
+        }
+        synchronized (this) {
+            mUploading = false;
+            if (failed) {
+                mRetries++;
+                long delay = Math.min(mBackoffMaxMs, mBackoffBaseMs << Math.min(mAttempt, 20));
+                mAttempt++;
+                schedule(delay / 2 + (long) (mRandom.nextDouble() * (delay / 2)));
+            } else if (mPending > 0) {
+                schedule(mPending >= mBatchEvents ? 0 : mIntervalMs);
+            }
+        }
+    }
+
+    public JSONObject getStats() throws JSONException {
+        JSONObject queue = mQueue.getStats();
+        long acked = queue.getJSONObject("consumers").optLong(CONSUMER, queue.getLong("firstOffset") - 1);
+        JSONObject stats = new JSONObject();
+        synchronized (this) {
+            stats.put("enabled", mEnabled);
+            stats.put("streamId", mStreamId);
+            stats.put("pending", queue.getLong("nextOffset") - 1 - acked);
+            stats.put("requests", mRequests);
+            stats.put("batches", mBatches);
+            stats.put("items", mItems);
+            stats.put("rawBytes", mRawBytes);
+            stats.put("wireBytes", mWireBytes);
+            stats.put("retries", mRetries);
+            stats.put("rejected", mRejected);
+            stats.put("backoffAttempt", mAttempt);
+            stats.put("lastStatus", mLastStatus);
+        }
+        stats.put("queue", queue);
+        return stats;
+    }
+
+    /**
+     * Syncs the queue, e.g. before the process may be killed
+     */
+    public void sync() {
+        mQueue.sync();
+    }
+
+    /**
+     * Encodes a batch. Layout: magic "IAU\2"; fix count; the fix columns t,
+     * lat, lon, floor (zigzag varint deltas, coordinates in 1e-7 degrees) and
+     * acc (varint decimetres); event count; each event as the varint number
+     * of fixes queued between it and the previous event, varint length and
+     * UTF-8 JSON, without its queue offset. The fix gaps keep the queue order:
+     * an event whose gaps sum to k came after the first k fixes of the batch.
+     * Matches IndoorUplink on iOS.
+     * @param items fixes and events as queued
+     * @return
+     * @throws JSONException
+     */
+    public static byte[] encode(JSONArray items) throws JSONException {
+        int fixCount = 0;
+        for (int i = 0; i < items.length(); i++) {
+            if ("fix".equals(items.getJSONObject(i).optString("type"))) {
+                fixCount++;
+            }
+        }
+        long[][] columns = new long[5][fixCount];
+        ByteArrayOutputStream events = new ByteArrayOutputStream();
+        int eventCount = 0;
+        int n = 0;
+        int fixesBefore = 0;
+        for (int i = 0; i < items.length(); i++) {
+            JSONObject item = items.getJSONObject(i);
+            if ("fix".equals(item.optString("type"))) {
+                columns[0][n] = item.getLong("t");
+                columns[1][n] = Math.round(item.getDouble("lat") * 1e7);
+                columns[2][n] = Math.round(item.getDouble("lon") * 1e7);
+                columns[3][n] = item.getInt("floor");
+                columns[4][n] = Math.round(item.getDouble("acc") * 10);
+                n++;
+            } else {
+                JSONObject event = new JSONObject(item.toString());
+                event.remove("offset");
+                byte[] json = event.toString().getBytes(UTF8);
+                writeVarint(events, n - fixesBefore);
+                fixesBefore = n;
+                writeVarint(events, json.length);
+                events.write(json, 0, json.length);
+                eventCount++;
+            }
+        }
+        ByteArrayOutputStream out = new ByteArrayOutputStream(16 + fixCount * 12 + events.size());
+        out.write(MAGIC, 0, MAGIC.length);
+        writeVarint(out, fixCount);
+        for (int c = 0; c < 4; c++) {
+            long previous = 0;
+            for (int i = 0; i < fixCount; i++) {
+                long delta = columns[c][i] - previous;
+                writeVarint(out, (delta << 1) ^ (delta >> 63));
+                previous = columns[c][i];
+            }
+        }
+        for (int i = 0; i < fixCount; i++) {
+            writeVarint(out, Math.max(0, columns[4][i]));
+        }
+        writeVarint(out, eventCount);
+        byte[] eventBytes = events.toByteArray();
+        out.write(eventBytes, 0, eventBytes.length);
+        return out.toByteArray();
+    }
+
+    static void writeVarint(ByteArrayOutputStream out, long value) {
+        while ((value & ~0x7fL) != 0) {
+            out.write((int) ((value & 0x7f) | 0x80));
+            value >>>= 7;
+        }
+        out.write((int) value);
+    }
+
+    private static byte[] deflate(byte[] raw) {
+        Deflater deflater = new Deflater(Deflater.DEFAULT_COMPRESSION);
+        deflater.setInput(raw);
+        deflater.finish();
+        ByteArrayOutputStream out = new ByteArrayOutputStream(raw.length / 2 + 64);
+        byte[] buffer = new byte[8192];
+        while (!deflater.finished()) {
+            int length = deflater.deflate(buffer);
+            out.write(buffer, 0, length);
+        }
+        deflater.end();
+        return out.toByteArray();
+    }
+
+    private static String loadStreamId(File file) throws IOException {
+        if (file.exists()) {
+            byte[] data = new byte[(int) file.length()];
+            FileInputStream in = new FileInputStream(file);
+            try {
+                int read = 0;
+                while (read < data.length) {
+                    int n = in.read(data, read, data.length - read);
+                    if (n < 0) {
+                        break;
+                    }
+                    read += n;
+                }
+                String id = new String(data, 0, read, UTF8).trim();
+                if (id.length() > 0) {
+                    return id;
+                }
+            } finally {
+                in.close();
+            }
+        }
+        String id = UUID.randomUUID().toString();
+        FileOutputStream out = new FileOutputStream(file);
+        try {
+            out.write(id.getBytes(UTF8));
+            out.getFD().sync();
+        } finally {
+            out.close();
+        }
+        return id;
+    }
+}
@@ -0,0 +1,151 @@
+package com.ialocation.plugin;
+
+/**
+ * Venue-local east/north/up frame in fixed-point millimetres.
+ *
+ * Positions are converted from WGS84 once, when they arrive from the SDK, and
+ * are kept as int32 millimetres from the frame origin internally (routing,
+ * geofencing, history, rendering helpers). A point costs 8 bytes instead of
+ * the 16 of a double lat/lon pair and can be processed with integer math.
+ * The scales are fixed at the origin, so the error grows with the square of
+ * the distance d from it, roughly d^2 * tan(latitude) / 6400 km: about 10 cm
+ * at 1 km at mid latitudes, a few millimetres within 100 m. Millimetres are
+ * the storage unit, not the accuracy; keep frames to the extent of a venue.
+ */
+public final class VenueFrame {
+    private static final double WGS84_A = 6378137.0;
+    private static final double WGS84_E2 = 6.69437999014e-3;
+
+    /**
+     * Origins are snapped to this grid (degrees) so that frames anchored by
+     * nearby fixes in the same venue coincide.
+     */
+    public static final double ORIGIN_GRID_DEGREES = 0.01;
+
+    private final double mOriginLatitude;
+    private final double mOriginLongitude;
+    private final double mMillimetresPerDegreeLat;
+    private final double mMillimetresPerDegreeLon;
+
+    /**
+     * The constructor
+     * @param originLatitude
+     * @param originLongitude
+     */
+    public VenueFrame(double originLatitude, double originLongitude) {
+        mOriginLatitude = originLatitude;
+        mOriginLongitude = originLongitude;
+        double phi = Math.toRadians(originLatitude);
+        double s = Math.sin(phi);
+        double w = Math.sqrt(1.0 - WGS84_E2 * s * s);
+        double meridional = WGS84_A * (1.0 - WGS84_E2) / (w * w * w);
+        double normal = WGS84_A / w;
+        mMillimetresPerDegreeLat = Math.toRadians(meridional) * 1000.0;
+        mMillimetresPerDegreeLon = Math.toRadians(normal * Math.cos(phi)) * 1000.0;
+    }
+
+    /**
+     * Returns a frame whose origin is the given coordinate snapped to ORIGIN_GRID_DEGREES
+     * @param latitude
+     * @param longitude
+     * @return
+     */
+    public static VenueFrame forAnchor(double latitude, double longitude) {
+        double lat = Math.floor(latitude / ORIGIN_GRID_DEGREES) * ORIGIN_GRID_DEGREES;
+        double lon = Math.floor(longitude / ORIGIN_GRID_DEGREES) * ORIGIN_GRID_DEGREES;
+        return new VenueFrame(lat, lon);
+    }
+
+    public double getOriginLatitude() {
+        return mOriginLatitude;
+    }
+
+    public double getOriginLongitude() {
+        return mOriginLongitude;
+    }
+
+    public double getMillimetresPerDegreeLatitude() {
+        return mMillimetresPerDegreeLat;
+    }
+
+    public double getMillimetresPerDegreeLongitude() {
+        return mMillimetresPerDegreeLon;
+    }
+
+    /**
+     * Millimetres east of the origin
+     * @param latitude
+     * @param longitude
+     * @return
+     */
+    public int east(double latitude, double longitude) {
+        return clamp(Math.round((longitude - mOriginLongitude) * mMillimetresPerDegreeLon));
+    }
+
+    /**
+     * Millimetres north of the origin
+     * @param latitude
+     * @param longitude
+     * @return
+     */
+    public int north(double latitude, double longitude) {
+        return clamp(Math.round((latitude - mOriginLatitude) * mMillimetresPerDegreeLat));
+    }
+
+    /**
+     * Writes the local point into out[offset] (east) and out[offset + 1] (north)
+     * @param latitude
+     * @param longitude
+     * @param out
+     * @param offset
+     */
+    public void toLocal(double latitude, double longitude, int[] out, int offset) {
+        out[offset] = east(latitude, longitude);
+        out[offset + 1] = north(latitude, longitude);
+    }
+
+    public double latitude(int east, int north) {
+        return mOriginLatitude + north / mMillimetresPerDegreeLat;
+    }
+
+    public double longitude(int east, int north) {
+        return mOriginLongitude + east / mMillimetresPerDegreeLon;
+    }
+
+    /**
+     * Packs a local point into one long, east in the high word
+     * @param east
+     * @param north
+     * @return
+     */
+    public static long pack(int east, int north) {
+        return ((long) east << 32) | (north & 0xffffffffL);
+    }
+
+    public static int packedEast(long packed) {
+        return (int) (packed >> 32);
+    }
+
+    public static int packedNorth(long packed) {
+        return (int) packed;
+    }
+
+    /**
+     * Squared distance in mm^2 between two local points, without overflow
+     */
+    public static long distanceSquared(int x0, int y0, int x1, int y1) {
+        long dx = (long) x1 - x0;
+        long dy = (long) y1 - y0;
+        return dx * dx + dy * dy;
+    }
+
+    private static int clamp(long millimetres) {
+        if (millimetres > Integer.MAX_VALUE) {
+            return Integer.MAX_VALUE;
+        }
+        if (millimetres < Integer.MIN_VALUE) {
+            return Integer.MIN_VALUE;
+        }
+        return (int) millimetres;
+    }
+}
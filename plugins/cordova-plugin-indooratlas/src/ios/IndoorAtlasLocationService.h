@@ -2,6 +2,9 @@
 #import <Foundation/Foundation.h>
 #import <CoreLocation/CoreLocation.h>
 #import <IndoorAtlas/IALocationManager.h>
+#import "IndoorDeferred.h"
+#import "IndoorFetchScheduler.h"
+#import "IndoorCacheBudget.h"
 
 enum IndoorLocationTransitionType {
     TRANSITION_TYPE_UNKNOWN = 0,
@@ -98,6 +101,7 @@ typedef NSUInteger IndoorLocationTransitionType;
 }
 
 @property (nonatomic, weak) id <IALocationDelegate> delegate;
+@property (nonatomic, strong) IndoorFloorPlanCache *floorPlanCache;
 
 - (id)init:(NSString *)apikey hash:(NSString *)apisecret;
 /**
@@ -132,6 +136,23 @@ typedef NSUInteger IndoorLocationTransitionType;
  */
 - (void)fetchFloorplanWithId:(NSString *)floorplanId;
 
+/**
+ *  Fetch floor plan without delegate callbacks, for chaining native steps
+ *
+ *  @param floorplanId
+ *  @return Deferred resolved with the IAFloorPlan
+ */
+- (IndoorDeferred *)floorPlanWithId:(NSString *)floorplanId;
+
+/**
+ *  As floorPlanWithId:, queued at the given fetch priority. Concurrent
+ *  requests for the same floor plan share one fetch.
+ *
+ *  @param floorplanId
+ *  @param priority
+ */
+- (IndoorDeferred *)floorPlanWithId:(NSString *)floorplanId priority:(IndoorFetchPriority)priority;
+
 /**
  * Calculates point with the given coordinates
  *
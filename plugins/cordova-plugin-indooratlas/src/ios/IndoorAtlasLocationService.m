@@ -2,18 +2,61 @@
 #import <UIKit/UIKit.h>
 #import "IndoorAtlasLocationService.h"
 #import <IndoorAtlas/IAResourceManager.h>
+#import "IndoorCommandQueues.h"
+
+// Resource manager requests share one fetch scheduler host
+static NSString *const kResourceHost = @"indooratlas-resources";
+// Keys and numbers of a floor plan's JSON form, besides its strings
+static const int64_t kFloorPlanFixedBytes = 320;
 
 @interface IndoorAtlasLocationService()<IALocationManagerDelegate> {
 }
 
-@property (nonatomic, strong) IALocationManager *manager;
-@property (nonatomic, strong) IAResourceManager *resourceManager;
+// Created on the main thread after init returns
+@property (atomic, strong) IALocationManager *manager;
+@property (atomic, strong) IAResourceManager *resourceManager;
 @property (nonatomic, retain) NSString *apikey;
 @property (nonatomic, retain) NSString *apiSecret;
 @property (nonatomic, retain) NSString *graphicID;
-@property (nonatomic, strong) IAFloorPlan *previousFloorplan;
 @end
 
+/**
+ *  Wraps a completion so that it runs on the resources queue, where the
+ *  plugin keeps its floor plan callback state
+ */
+static IndoorDeferredCompletion OnResourcesQueue(IndoorDeferredCompletion completion)
+{
+    return ^(id value, NSError *error) {
+        [[IndoorCommandQueues sharedQueues] run:IndoorCommandQueueResources block:^{
+            completion(value, error);
+        }];
+    };
+}
+
+/**
+ *  Whether an SDK error, or one it wraps, is a network error
+ */
+static BOOL IsTransportError(NSError *error)
+{
+    for (NSError *cause = error; cause != nil; cause = cause.userInfo[NSUnderlyingErrorKey]) {
+        if ([cause.domain isEqualToString:NSURLErrorDomain]) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+/**
+ *  Size of a fetched floor plan's metadata, which the SDK does not report,
+ *  estimated from its JSON form for the fetch scheduler's bandwidth estimate
+ */
+static int64_t FloorPlanBytes(IAFloorPlan *floorPlan)
+{
+    return kFloorPlanFixedBytes + [floorPlan.floorPlanId lengthOfBytesUsingEncoding:NSUTF8StringEncoding]
+        + [floorPlan.name lengthOfBytesUsingEncoding:NSUTF8StringEncoding]
+        + [floorPlan.imageUrl.absoluteString lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+}
+
 @implementation IndoorAtlasLocationService {
     BOOL serviceStoped;
 }
@@ -38,17 +81,20 @@
     if (self) {
         self.apikey = apikey;
         self.apiSecret = apisecret;
-        // Create IALocationManager and point delegate to receiver
-        self.manager = [IALocationManager new];
+        serviceStoped = YES;
+        [IndoorCommandQueues onMain:^{
+            // Create IALocationManager and point delegate to receiver
+            IALocationManager *manager = [IALocationManager new];
 
-        // Set IndoorAtlas API key and secret
-        [self.manager setApiKey:self.apikey andSecret:self.apiSecret];
+            // Set IndoorAtlas API key and secret
+            [manager setApiKey:self.apikey andSecret:self.apiSecret];
 
-        self.manager.delegate = self;
-        serviceStoped = YES;
+            manager.delegate = self;
+            self.manager = manager;
 
-        // Create floor plan manager
-        self.resourceManager = [IAResourceManager resourceManagerWithLocationManager:self.manager];
+            // Create floor plan manager
+            self.resourceManager = [IAResourceManager resourceManagerWithLocationManager:manager];
+        }];
     }
     return self;
 }
@@ -65,18 +111,22 @@
     serviceStoped = NO;
     self.graphicID = floorid;
     [self setCriticalLog:[NSString stringWithFormat:@"Started service for floorid %@", self.graphicID]];
-    [self.manager stopUpdatingLocation];
-    if (self.graphicID != nil) {
-        IALocation *location = [IALocation locationWithFloorPlanId:self.graphicID];
-        self.manager.location = location;
-    }
-    [self.manager startUpdatingLocation];
+    [IndoorCommandQueues onMain:^{
+        [self.manager stopUpdatingLocation];
+        if (floorid != nil) {
+            IALocation *location = [IALocation locationWithFloorPlanId:floorid];
+            self.manager.location = location;
+        }
+        [self.manager startUpdatingLocation];
+    }];
 }
 
 - (void)stopPositioning
 {
     serviceStoped = YES;
-    [self.manager stopUpdatingLocation];
+    [IndoorCommandQueues onMain:^{
+        [self.manager stopUpdatingLocation];
+    }];
     [self setCriticalLog:@"IndoorAtlas service stopped"];
 }
 
@@ -89,7 +139,9 @@
 - (void)indoorLocationManager:(nonnull IALocationManager *)manager didEnterRegion:(nonnull IARegion *)region
 {
     if([self.delegate respondsToSelector:@selector(location:didRegionChange:type:)]) {
-        [self.delegate location:self didRegionChange:region type:TRANSITION_TYPE_ENTER];
+        [[IndoorCommandQueues sharedQueues] run:IndoorCommandQueueGeofence block:^{
+            [self.delegate location:self didRegionChange:region type:TRANSITION_TYPE_ENTER];
+        }];
     }
 }
 
@@ -101,7 +153,9 @@
 - (void)indoorLocationManager:(nonnull IALocationManager *)manager didExitRegion:(nonnull IARegion *)region
 {
     if([self.delegate respondsToSelector:@selector(location:didRegionChange:type:)]) {
-        [self.delegate location:self didRegionChange:region type:TRANSITION_TYPE_EXIT];
+        [[IndoorCommandQueues sharedQueues] run:IndoorCommandQueueGeofence block:^{
+            [self.delegate location:self didRegionChange:region type:TRANSITION_TYPE_EXIT];
+        }];
     }
 }
 
@@ -121,7 +175,9 @@
     }
 
     if(self.delegate != nil) {
-        [self.delegate location:self didUpdateLocation:loc];
+        [[IndoorCommandQueues sharedQueues] run:IndoorCommandQueuePositioning block:^{
+            [self.delegate location:self didUpdateLocation:loc];
+        }];
     }
 }
 
@@ -134,97 +190,74 @@
 - (void)indoorLocationManager:(nonnull IALocationManager *)manager statusChanged:(nonnull IAStatus *)status
 {
     if([self.delegate respondsToSelector:@selector(location:statusChanged:)]) {
-        [self.delegate location:self statusChanged:status];
+        [[IndoorCommandQueues sharedQueues] run:IndoorCommandQueuePositioning block:^{
+            [self.delegate location:self statusChanged:status];
+        }];
     }
 }
 
 - (void)indoorLocationManager:(nonnull IALocationManager *)manager didUpdateAttitude:(nonnull IAAttitude *)newAttitude
 {
     if([self.delegate respondsToSelector:@selector(location:didUpdateAttitude:)]) {
-        [self.delegate location:self didUpdateAttitude:newAttitude];
+        [[IndoorCommandQueues sharedQueues] run:IndoorCommandQueuePositioning block:^{
+            [self.delegate location:self didUpdateAttitude:newAttitude];
+        }];
     }
 }
 
 - (void)indoorLocationManager:(nonnull IALocationManager *)manager didUpdateHeading:(nonnull IAHeading *)newHeading
 {
     if([self.delegate respondsToSelector:@selector(location:didUpdateHeading:)]) {
-        [self.delegate location:self didUpdateHeading:newHeading];
+        [[IndoorCommandQueues sharedQueues] run:IndoorCommandQueuePositioning block:^{
+            [self.delegate location:self didUpdateHeading:newHeading];
+        }];
     }
 }
 
 // Gets coordinate to a given point
 - (void)getCoordinateToPoint:(NSString *)floorplanId andCoordinates: (CLLocationCoordinate2D) coords
 {
-    NSLog(@"getCoordinateToPoint: previousFloorplanName %@", _previousFloorplan.name);
     NSLog(@"getCoordinateToPoint: longitude %f", coords.longitude);
     NSLog(@"getCoordinateToPoint: latitude %f", coords.latitude);
 
     __weak IndoorAtlasLocationService *weakSelf = self;
 
-    // New floorplan information is not fetched if current and previous ids are the same
+    // Cached floor plans are used right away, others are fetched through the fetch scheduler
     // Finally, sendCoordinateToPoint function is called which prepares the data for Cordova and Javascript
-    if ([floorplanId isEqualToString:self.previousFloorplan.floorPlanId]) {
+    [[self floorPlanWithId:floorplanId priority:IndoorFetchPriorityVisible] whenComplete:OnResourcesQueue(^(IAFloorPlan *floorplan, NSError *error) {
+        if (error) {
+            if ([weakSelf.delegate respondsToSelector:@selector(errorInCoordinateToPoint:)]) {
+                [weakSelf.delegate errorInCoordinateToPoint:[NSError errorWithDomain:@"Service Unavailable" code:kIAStatusServiceUnavailable userInfo:nil]];};
+            return;
+        }
 
-        CGPoint points = [self.previousFloorplan coordinateToPoint:coords];
+        CGPoint points = [floorplan coordinateToPoint:coords];
+        NSLog(@"getCoordinateToPoint: point %@", NSStringFromCGPoint(points));
         [weakSelf.delegate sendCoordinateToPoint:points];
-
-    } else {
-
-        // Fetches new floorplan information and calls sendCoordinateToPoint to send the data to Cordova and Javcascript.
-        [self.resourceManager fetchFloorPlanWithId:floorplanId andCompletion:^(IAFloorPlan *floorplan, NSError *error) {
-            if (error) {
-                NSLog(@"Error during floorplan fetch: %@", error);
-                if ([weakSelf.delegate respondsToSelector:@selector(errorInCoordinateToPoint:)]) {
-                    [weakSelf.delegate errorInCoordinateToPoint:[NSError errorWithDomain:@"Service Unavailable" code:kIAStatusServiceUnavailable userInfo:nil]];};
-
-                /*if ([weakSelf.delegate respondsToSelector:@selector(location:didFloorPlanFailedWithError:)]) {
-                    [weakSelf.delegate  location:weakSelf didFloorPlanFailedWithError:[NSError errorWithDomain:@"Service Unavailable" code:kIAStatusServiceUnavailable userInfo:nil]];
-                }*/
-                return;
-            }
-
-            NSLog(@"getCoordinateToPoint: fetched floorplan with id: %@", floorplan.floorPlanId);
-            CGPoint points = [floorplan coordinateToPoint:coords];
-            NSLog(@"getCoordinateToPoint: point %@", NSStringFromCGPoint(points));
-            self.previousFloorplan = floorplan;
-            [weakSelf.delegate sendCoordinateToPoint:points];
-        }];
-    };
+    })];
 }
 
 // Gets point to a given coordinate
 - (void)getPointToCoordinate:(NSString *)floorplanId andPoint: (CGPoint) point
 {
-    NSLog(@"getPointToCoordinate: previousFloorplanName %@", _previousFloorplan.name);
     NSLog(@"getPointToCoordinate: point %@", NSStringFromCGPoint(point));
 
     __weak IndoorAtlasLocationService *weakSelf = self;
 
-    // New floorplan information is not fetched if current and previous ids are the same
-    // Finally, sendCoordinateToPoint function is called which prepares the data for Cordova and Javascript
-    if (floorplanId == self.previousFloorplan.floorPlanId) {
+    // Cached floor plans are used right away, others are fetched through the fetch scheduler
+    // Finally, sendPointToCoordinate function is called which prepares the data for Cordova and Javascript
+    [[self floorPlanWithId:floorplanId priority:IndoorFetchPriorityVisible] whenComplete:OnResourcesQueue(^(IAFloorPlan *floorplan, NSError *error) {
+        if (error) {
+            if ([weakSelf.delegate respondsToSelector:@selector(errorInPointToCoordinate:)]) {
+                [weakSelf.delegate errorInPointToCoordinate:[NSError errorWithDomain:@"Service Unavailable" code:kIAStatusServiceUnavailable userInfo:nil]];};
+            return;
+        }
 
-        CLLocationCoordinate2D coords = [self.previousFloorplan pointToCoordinate:point];
+        CLLocationCoordinate2D coords = [floorplan pointToCoordinate:point];
+        NSLog(@"getPointToCoordinate: latitude %f", coords.latitude);
+        NSLog(@"getPointToCoordinate: longitude %f", coords.longitude);
         [weakSelf.delegate sendPointToCoordinate:coords];
-    } else {
-
-        // Fetches new floorplan information and calls sendPointToCoordinate to send the data to Cordova and Javcascript.
-        [self.resourceManager fetchFloorPlanWithId:floorplanId andCompletion:^(IAFloorPlan *floorplan, NSError *error) {
-            if (error) {
-                NSLog(@"Error during floorplan fetch: %@", error);
-                if ([weakSelf.delegate respondsToSelector:@selector(errorInPointToCoordinate:)]) {
-                    [weakSelf.delegate errorInPointToCoordinate:[NSError errorWithDomain:@"Service Unavailable" code:kIAStatusServiceUnavailable userInfo:nil]];};
-                return;
-            }
-
-            NSLog(@"getPointToCoordinate: fetched floorplan with id: %@", floorplan.floorPlanId);
-            CLLocationCoordinate2D coords = [floorplan pointToCoordinate:point];
-            self.previousFloorplan = floorplan;
-            NSLog(@"getPointToCoordinate: latitude %f", coords.latitude);
-            NSLog(@"getPointToCoordinate: longitude %f", coords.longitude);
-            [weakSelf.delegate sendPointToCoordinate:coords];
-        }];
-    };
+    })];
 }
 
 #pragma mark Resource Manager
@@ -236,9 +269,8 @@
 - (void)fetchFloorplanWithId:(NSString *)floorplanId
 {
     __weak IndoorAtlasLocationService *weakSelf = self;
-    [self.resourceManager fetchFloorPlanWithId:floorplanId andCompletion:^(IAFloorPlan *floorplan, NSError *error) {
+    [[self floorPlanWithId:floorplanId priority:IndoorFetchPriorityVisible] whenComplete:OnResourcesQueue(^(IAFloorPlan *floorplan, NSError *error) {
         if (error) {
-            NSLog(@"Error during floorplan fetch: %@", error);
             if ([weakSelf.delegate respondsToSelector:@selector(location:didFloorPlanFailedWithError:)]) {
                 [weakSelf.delegate  location:weakSelf didFloorPlanFailedWithError:[NSError errorWithDomain:@"Service Unavailable" code:kIAStatusServiceUnavailable userInfo:nil]];
             }
@@ -249,28 +281,73 @@
         if ([weakSelf.delegate respondsToSelector:@selector(location:withFloorPlan:)]) {
             [weakSelf.delegate  location:weakSelf withFloorPlan:floorplan];
         }
+    })];
+}
+
+- (IndoorDeferred *)floorPlanWithId:(NSString *)floorplanId
+{
+    return [self floorPlanWithId:floorplanId priority:IndoorFetchPriorityVisible];
+}
+
+- (IndoorDeferred *)floorPlanWithId:(NSString *)floorplanId priority:(IndoorFetchPriority)priority
+{
+    IAFloorPlan *cached = [self.floorPlanCache floorPlanWithId:floorplanId];
+    if (cached != nil) {
+        return [IndoorDeferred resolved:cached];
+    }
+    __weak IndoorAtlasLocationService *weakSelf = self;
+    NSString *key = [@"floorplan:" stringByAppendingString:floorplanId];
+    return [[IndoorFetchScheduler sharedScheduler] fetch:key host:kResourceHost priority:priority fetcher:^dispatch_block_t(IndoorFetchSuccess success, IndoorFetchFailure failure) {
+        IAResourceManager *resourceManager = weakSelf.resourceManager;
+        if (resourceManager == nil) {
+            // Still being created on the main thread, see init:hash:
+            failure([NSError errorWithDomain:@"Service Unavailable" code:kIAStatusServiceUnavailable userInfo:nil], YES);
+            return nil;
+        }
+        IATask *task = [resourceManager fetchFloorPlanWithId:floorplanId andCompletion:^(IAFloorPlan *floorplan, NSError *error) {
+            if (error || floorplan == nil) {
+                NSLog(@"Error during floorplan fetch: %@", error);
+                // Only a transport error may pass on retry; an unknown or wrong id,
+                // or a request that succeeded without a floor plan, will not
+                failure([NSError errorWithDomain:@"Service Unavailable" code:kIAStatusServiceUnavailable userInfo:nil],
+                        IsTransportError(error));
+                return;
+            }
+            [weakSelf.floorPlanCache addFloorPlan:floorplan];
+            success(floorplan, FloorPlanBytes(floorplan));
+        }];
+        return ^{
+            [task cancel];
+        };
     }];
 }
 
 - (void)valueForDistanceFilter:(float *)distance
 {
-    self.manager.distanceFilter = (CLLocationDistance) *(distance);
+    CLLocationDistance value = (CLLocationDistance) *(distance);
+    [IndoorCommandQueues onMain:^{
+        self.manager.distanceFilter = value;
+    }];
 }
 
 - (float)fetchFloorCertainty
 {
-  return [IALocationManager sharedInstance].location.floor.certainty;
+  return self.manager.location.floor.certainty;
 }
 
 - (NSString *)fetchTraceId
 {
-  return [[IALocationManager sharedInstance].extraInfo objectForKey:kIATraceId];
+  return [self.manager.extraInfo objectForKey:kIATraceId];
 }
 
 - (void)setSensitivities:(double *)orientationSensitivity headingSensitivity:(double *)headingSensitivity
 {
-    self.manager.attitudeFilter = (CLLocationDegrees) *(orientationSensitivity);
-    self.manager.headingFilter = (CLLocationDegrees) *(headingSensitivity);
+    CLLocationDegrees attitudeFilter = (CLLocationDegrees) *(orientationSensitivity);
+    CLLocationDegrees headingFilter = (CLLocationDegrees) *(headingSensitivity);
+    [IndoorCommandQueues onMain:^{
+        self.manager.attitudeFilter = attitudeFilter;
+        self.manager.headingFilter = headingFilter;
+    }];
 }
 
 
@@ -297,17 +374,19 @@
 - (void)setFloorPlan:(NSString *)floorPlan orLocation:(CLLocation *)newLocation
 {
     BOOL isServiceResume = [self isServiceActive];
-    [self.manager stopUpdatingLocation];
-    if (floorPlan != nil) {
-        IALocation *location = [IALocation locationWithFloorPlanId:floorPlan];
-        self.manager.location = location;
-    }
-    if (newLocation != nil) {
-        IALocation *location = [IALocation locationWithCLLocation:newLocation];
-        self.manager.location = location;
-    }
-    if (isServiceResume) {
-        [self.manager startUpdatingLocation];
-    }
+    [IndoorCommandQueues onMain:^{
+        [self.manager stopUpdatingLocation];
+        if (floorPlan != nil) {
+            IALocation *location = [IALocation locationWithFloorPlanId:floorPlan];
+            self.manager.location = location;
+        }
+        if (newLocation != nil) {
+            IALocation *location = [IALocation locationWithCLLocation:newLocation];
+            self.manager.location = location;
+        }
+        if (isServiceResume) {
+            [self.manager startUpdatingLocation];
+        }
+    }];
 }
 @end
@@ -0,0 +1,96 @@
+
+#import <Foundation/Foundation.h>
+#import "IndoorAtlasLocationService.h"
+#import "IndoorVenueFrame.h"
+
+@class IndoorTimingWheel;
+
+extern const NSInteger IndoorBackgroundAnyFloor;
+
+/**
+ *  Receives what the processor decides to surface
+ */
+@protocol IndoorBackgroundSink <NSObject>
+
+/**
+ *  Delivers an event to JavaScript, waking the WebView
+ */
+- (void)deliverBackgroundEvent:(NSDictionary *)event;
+
+/**
+ *  Posts a local notification
+ */
+- (void)notifyTrigger:(NSString *)triggerId title:(NSString *)title text:(NSString *)text;
+
+@end
+
+/**
+ *  Evaluates geofence and proximity triggers and aggregates occupancy in the
+ *  native layer while the app is in the background, so that the WebView is
+ *  only woken for actionable events.
+ *
+ *  In the foreground every event still goes to JavaScript and the processor
+ *  only keeps its trigger state up to date. In background mode positions and
+ *  region events are handled here instead of by the watch callbacks. A
+ *  trigger that fires is delivered if it asks to wake JavaScript and posted
+ *  as a local notification if it has one. Positions are counted per cell in
+ *  an occupancy batch delivered once per batch interval, when it is full, or
+ *  when the app returns. The interval is also timed on the timing wheel, so a
+ *  batch is delivered even when no further position arrives. Thread safe.
+ *  Matches BackgroundProcessor.java.
+ */
+@interface IndoorBackgroundProcessor : NSObject
+
+/**
+ *  @param timingWheel times the batch interval, nil if the caller only wants
+ *  batches flushed by the position timestamps
+ */
+- (instancetype)initWithSink:(id<IndoorBackgroundSink>)sink timingWheel:(IndoorTimingWheel *)timingWheel;
+
+/**
+ *  Replaces the triggers and batching rules and enables the processor
+ *
+ *  @param options { triggers: [...], batchIntervalMs, batchMaxSamples, cellLevel }
+ *  @param frame venue frame for triggers given by coordinates, may be nil if there are none
+ */
+- (BOOL)configure:(NSDictionary *)options frame:(IndoorVenueFrame *)frame error:(NSError **)error;
+
+/**
+ *  Projects the proximity triggers into a new venue frame, the one the
+ *  points passed to onPositionAt: are in from now on
+ */
+- (void)setFrame:(IndoorVenueFrame *)frame;
+
+/**
+ *  Disables the processor, delivering what is left of the occupancy batch
+ */
+- (void)disable;
+
+/**
+ *  Called when the app goes to the background or returns. Returning delivers the occupancy batch.
+ */
+- (void)setBackground:(BOOL)background;
+
+- (BOOL)isEnabled;
+
+/**
+ *  YES when events are handled natively instead of being sent to the watch callbacks
+ */
+- (BOOL)isActive;
+
+/**
+ *  Evaluates a position, returns YES if it was handled and must not be sent to the watches
+ */
+- (BOOL)onPositionAt:(int64_t)timeMs floor:(NSInteger)floor point:(IndoorLocalPoint)point;
+
+/**
+ *  Evaluates a region transition, returns YES if it was handled and must not be sent to the region watches
+ */
+- (BOOL)onRegion:(NSString *)regionId type:(ia_region_type)type transition:(IndoorLocationTransitionType)transition at:(int64_t)timeMs;
+
+/**
+ *  Counters since the processor was created
+ */
+- (NSDictionary *)stats;
+
+@end
@@ -0,0 +1,410 @@
+
+#import "IndoorBackgroundProcessor.h"
+#import "IndoorCellId.h"
+#import "IndoorTraceRecorder.h"
+#import "IndoorCostAccounting.h"
+#import "IndoorTimingWheel.h"
+#import "IndoorTaskScheduler.h"
+
+const NSInteger IndoorBackgroundAnyFloor = NSIntegerMin;
+
+static const int64_t kDefaultBatchIntervalMs = 15 * 60 * 1000;
+static const NSInteger kDefaultBatchMaxSamples = 3600;
+static const int kDefaultCellLevel = 10;
+static const int64_t kDefaultCooldownMs = 60 * 1000;
+// Longer gaps between fixes are not counted as dwell time
+static const int64_t kMaxDwellGapMs = 30 * 1000;
+// A proximity trigger exits at this multiple of its radius, so fixes jittering on the edge do not re-fire it
+static const double kExitHysteresis = 1.2;
+
+@interface IndoorBackgroundTrigger : NSObject {
+@public
+    NSString *_id;
+    // Region triggers match a region id, the others a circle in the venue frame
+    NSString *_regionId;
+    NSInteger _floor;
+    CLLocationCoordinate2D _coordinate;
+    IndoorLocalPoint _center;
+    int64_t _enterRadiusSquared;
+    int64_t _exitRadiusSquared;
+    NSUInteger _transitions;
+    BOOL _wake;
+    NSString *_title;
+    NSString *_text;
+    int64_t _cooldownMs;
+    BOOL _inside;
+    // Separate cooldowns, an exit shortly after the enter must still fire
+    BOOL _firedEnter;
+    BOOL _firedExit;
+    int64_t _lastEnterMs;
+    int64_t _lastExitMs;
+}
+@end
+
+@implementation IndoorBackgroundTrigger
+@end
+
+@implementation IndoorBackgroundProcessor {
+    __weak id<IndoorBackgroundSink> _sink;
+    IndoorTimingWheel *_timingWheel;
+    NSArray<IndoorBackgroundTrigger *> *_triggers;
+    BOOL _enabled;
+    BOOL _background;
+    int64_t _batchIntervalMs;
+    NSInteger _batchMaxSamples;
+    int _cellLevel;
+    uint16_t _venueKey;
+
+    // Occupancy batch: cell id -> {samples, dwell ms}
+    NSMutableDictionary<NSNumber *, NSMutableArray<NSNumber *> *> *_occupancy;
+    NSMutableArray<NSNumber *> *_cellOrder;
+    NSInteger _batchSamples;
+    int64_t _batchStartMs;
+    int64_t _lastSampleMs;
+    IndoorCellIdType _lastCell;
+    IndoorTimeout *_batchTimer;
+
+    uint64_t _positions;
+    uint64_t _regionEvents;
+    uint64_t _handled;
+    uint64_t _delivered;
+    uint64_t _notified;
+    uint64_t _fired;
+    uint64_t _batches;
+}
+
+- (instancetype)initWithSink:(id<IndoorBackgroundSink>)sink timingWheel:(IndoorTimingWheel *)timingWheel
+{
+    self = [super init];
+    if (self) {
+        _sink = sink;
+        _timingWheel = timingWheel;
+        _triggers = @[];
+        _batchIntervalMs = kDefaultBatchIntervalMs;
+        _batchMaxSamples = kDefaultBatchMaxSamples;
+        _cellLevel = kDefaultCellLevel;
+        _occupancy = [NSMutableDictionary dictionary];
+        _cellOrder = [NSMutableArray array];
+    }
+    return self;
+}
+
+- (BOOL)configure:(NSDictionary *)options frame:(IndoorVenueFrame *)frame error:(NSError **)error
+{
+    NSMutableArray<IndoorBackgroundTrigger *> *triggers = [NSMutableArray array];
+    for (NSDictionary *json in options[@"triggers"]) {
+        IndoorBackgroundTrigger *trigger = [self parseTrigger:json frame:frame error:error];
+        if (trigger == nil) {
+            return NO;
+        }
+        [triggers addObject:trigger];
+    }
+    int cellLevel = options[@"cellLevel"] != nil ? [options[@"cellLevel"] intValue] : kDefaultCellLevel;
+    if (cellLevel < 0 || cellLevel > IndoorCellIdMaxLevel) {
+        if (error != NULL) {
+            *error = [self errorWithMessage:[NSString stringWithFormat:@"cellLevel must be within 0..%d", IndoorCellIdMaxLevel]];
+        }
+        return NO;
+    }
+    @synchronized (self) {
+        [self flush];
+        _triggers = triggers;
+        _batchIntervalMs = MAX(1000, options[@"batchIntervalMs"] != nil ? [options[@"batchIntervalMs"] longLongValue] : kDefaultBatchIntervalMs);
+        _batchMaxSamples = MAX(1, options[@"batchMaxSamples"] != nil ? [options[@"batchMaxSamples"] integerValue] : kDefaultBatchMaxSamples);
+        _cellLevel = cellLevel;
+        _enabled = YES;
+    }
+    return YES;
+}
+
+- (IndoorBackgroundTrigger *)parseTrigger:(NSDictionary *)json frame:(IndoorVenueFrame *)frame error:(NSError **)error
+{
+    IndoorBackgroundTrigger *trigger = [[IndoorBackgroundTrigger alloc] init];
+    trigger->_id = [json[@"id"] description];
+    if (trigger->_id == nil) {
+        if (error != NULL) {
+            *error = [self errorWithMessage:@"Trigger without id"];
+        }
+        return nil;
+    }
+    if (json[@"regionId"] != nil) {
+        trigger->_regionId = json[@"regionId"];
+    } else {
+        if (frame == nil || json[@"latitude"] == nil || json[@"longitude"] == nil || json[@"radius"] == nil) {
+            if (error != NULL) {
+                *error = [self errorWithMessage:[NSString stringWithFormat:@"Invalid trigger %@", trigger->_id]];
+            }
+            return nil;
+        }
+        trigger->_coordinate = CLLocationCoordinate2DMake([json[@"latitude"] doubleValue], [json[@"longitude"] doubleValue]);
+        trigger->_center = [frame toLocal:trigger->_coordinate];
+        int64_t radius = llround([json[@"radius"] doubleValue] * 1000);
+        int64_t exitRadius = llround(radius * kExitHysteresis);
+        trigger->_enterRadiusSquared = radius * radius;
+        trigger->_exitRadiusSquared = exitRadius * exitRadius;
+        trigger->_floor = json[@"floor"] != nil ? [json[@"floor"] integerValue] : IndoorBackgroundAnyFloor;
+    }
+    NSString *on = json[@"on"];
+    trigger->_transitions = [on isEqualToString:@"both"] ? (1 << TRANSITION_TYPE_ENTER) | (1 << TRANSITION_TYPE_EXIT)
+        : [on isEqualToString:@"exit"] ? (1 << TRANSITION_TYPE_EXIT) : (1 << TRANSITION_TYPE_ENTER);
+    trigger->_wake = json[@"wake"] != nil ? [json[@"wake"] boolValue] : YES;
+    NSDictionary *notification = json[@"notification"];
+    if ([notification isKindOfClass:[NSDictionary class]]) {
+        trigger->_title = notification[@"title"] ?: @"";
+        trigger->_text = notification[@"text"] ?: @"";
+    }
+    trigger->_cooldownMs = json[@"cooldownMs"] != nil ? [json[@"cooldownMs"] longLongValue] : kDefaultCooldownMs;
+    return trigger;
+}
+
+- (NSError *)errorWithMessage:(NSString *)message
+{
+    return [NSError errorWithDomain:@"IndoorBackgroundProcessor" code:0 userInfo:@{NSLocalizedDescriptionKey: message}];
+}
+
+- (void)setFrame:(IndoorVenueFrame *)frame
+{
+    @synchronized (self) {
+        for (IndoorBackgroundTrigger *trigger in _triggers) {
+            if (trigger->_regionId == nil) {
+                trigger->_center = [frame toLocal:trigger->_coordinate];
+            }
+        }
+    }
+}
+
+- (void)disable
+{
+    @synchronized (self) {
+        [self flush];
+        _triggers = @[];
+        _enabled = NO;
+    }
+}
+
+- (void)setBackground:(BOOL)background
+{
+    @synchronized (self) {
+        _background = background;
+        if (!background) {
+            [self flush];
+        }
+    }
+}
+
+- (BOOL)isEnabled
+{
+    @synchronized (self) {
+        return _enabled;
+    }
+}
+
+- (BOOL)isActive
+{
+    @synchronized (self) {
+        return _enabled && _background;
+    }
+}
+
+- (BOOL)onPositionAt:(int64_t)timeMs floor:(NSInteger)floor point:(IndoorLocalPoint)point
+{
+    @synchronized (self) {
+        if (!_enabled) {
+            return NO;
+        }
+        _positions++;
+        for (IndoorBackgroundTrigger *trigger in _triggers) {
+            if (trigger->_regionId != nil) {
+                continue;
+            }
+            BOOL sameFloor = trigger->_floor == IndoorBackgroundAnyFloor || trigger->_floor == floor;
+            int64_t dx = (int64_t)point.east - trigger->_center.east;
+            int64_t dy = (int64_t)point.north - trigger->_center.north;
+            int64_t distanceSquared = dx * dx + dy * dy;
+            if (!trigger->_inside && sameFloor && distanceSquared <= trigger->_enterRadiusSquared) {
+                trigger->_inside = YES;
+                [self fire:trigger transition:TRANSITION_TYPE_ENTER at:timeMs];
+            } else if (trigger->_inside && (!sameFloor || distanceSquared > trigger->_exitRadiusSquared)) {
+                trigger->_inside = NO;
+                [self fire:trigger transition:TRANSITION_TYPE_EXIT at:timeMs];
+            }
+        }
+        if (!_background) {
+            return NO;
+        }
+        [self addSampleAt:timeMs cell:[IndoorCellId cellIdWithVenue:_venueKey floor:floor localPoint:point level:_cellLevel]];
+        _handled++;
+        return YES;
+    }
+}
+
+- (BOOL)onRegion:(NSString *)regionId type:(ia_region_type)type transition:(IndoorLocationTransitionType)transition at:(int64_t)timeMs
+{
+    @synchronized (self) {
+        if (!_enabled) {
+            return NO;
+        }
+        _regionEvents++;
+        if (type == kIARegionTypeVenue && transition == TRANSITION_TYPE_ENTER && _venueKey != [IndoorCellId venueKey:regionId]) {
+            // Cells of different venues must not be merged into one batch
+            [self flush];
+            _venueKey = [IndoorCellId venueKey:regionId];
+        }
+        for (IndoorBackgroundTrigger *trigger in _triggers) {
+            if ([regionId isEqualToString:trigger->_regionId]) {
+                trigger->_inside = transition == TRANSITION_TYPE_ENTER;
+                [self fire:trigger transition:transition at:timeMs];
+            }
+        }
+        if (!_background) {
+            return NO;
+        }
+        _handled++;
+        return YES;
+    }
+}
+
+- (void)fire:(IndoorBackgroundTrigger *)trigger transition:(IndoorLocationTransitionType)transition at:(int64_t)timeMs
+{
+    if ((trigger->_transitions & (1 << transition)) == 0) {
+        return;
+    }
+    if (transition == TRANSITION_TYPE_ENTER) {
+        if (trigger->_firedEnter && timeMs - trigger->_lastEnterMs < trigger->_cooldownMs) {
+            return;
+        }
+        trigger->_firedEnter = YES;
+        trigger->_lastEnterMs = timeMs;
+    } else {
+        if (trigger->_firedExit && timeMs - trigger->_lastExitMs < trigger->_cooldownMs) {
+            return;
+        }
+        trigger->_firedExit = YES;
+        trigger->_lastExitMs = timeMs;
+    }
+    _fired++;
+    IndoorTraceInstant("background", "trigger");
+    // In the foreground JavaScript is awake anyway, a notification would only duplicate the event
+    if (_background && trigger->_title != nil) {
+        _notified++;
+        [_sink notifyTrigger:trigger->_id title:trigger->_title text:trigger->_text];
+    }
+    if (trigger->_wake || !_background) {
+        [self deliver:@{@"type": @"trigger",
+                        @"triggerId": trigger->_id,
+                        @"transitionType": @(transition),
+                        @"timestamp": @(timeMs),
+                        @"background": @(_background)}];
+    }
+}
+
+- (void)addSampleAt:(int64_t)timeMs cell:(IndoorCellIdType)cell
+{
+    if (_batchSamples == 0) {
+        _batchStartMs = timeMs;
+        [self scheduleFlush];
+    } else if (_lastCell != 0) {
+        int64_t gap = timeMs - _lastSampleMs;
+        if (gap > 0 && gap <= kMaxDwellGapMs) {
+            NSMutableArray<NSNumber *> *last = _occupancy[@(_lastCell)];
+            last[1] = @([last[1] longLongValue] + gap);
+        }
+    }
+    NSNumber *key = @(cell);
+    NSMutableArray<NSNumber *> *counts = _occupancy[key];
+    if (counts == nil) {
+        counts = [NSMutableArray arrayWithObjects:@0, @0, nil];
+        _occupancy[key] = counts;
+        [_cellOrder addObject:key];
+    }
+    counts[0] = @([counts[0] longLongValue] + 1);
+    _batchSamples++;
+    _lastCell = cell;
+    _lastSampleMs = timeMs;
+    if (_batchSamples >= _batchMaxSamples || timeMs - _batchStartMs >= _batchIntervalMs) {
+        [self flush];
+    }
+}
+
+/**
+ *  Flushes the batch just started after the batch interval, unless it has
+ *  been delivered by then. Called with the lock held.
+ */
+- (void)scheduleFlush
+{
+    if (_timingWheel == nil) {
+        return;
+    }
+    uint64_t batch = _batches;
+    __weak IndoorBackgroundProcessor *weakSelf = self;
+    _batchTimer = [_timingWheel schedule:_batchIntervalMs block:^{
+        // Delivering persists the event, keep that off the wheel thread
+        [[IndoorTaskScheduler sharedScheduler] submit:IndoorTaskLaneBackground subsystem:IndoorCostTimers block:^{
+            IndoorBackgroundProcessor *strongSelf = weakSelf;
+            if (strongSelf == nil) {
+                return;
+            }
+            @synchronized (strongSelf) {
+                if (strongSelf->_batches == batch) {
+                    strongSelf->_batchTimer = nil;
+                    [strongSelf flush];
+                }
+            }
+        }];
+    }];
+}
+
+/**
+ *  Delivers the occupancy batch, if any, and cancels its timer. Called with the lock held.
+ */
+- (void)flush
+{
+    [_batchTimer cancel];
+    _batchTimer = nil;
+    if (_batchSamples == 0) {
+        return;
+    }
+    NSMutableArray *cells = [NSMutableArray arrayWithCapacity:[_cellOrder count]];
+    for (NSNumber *key in _cellOrder) {
+        NSArray<NSNumber *> *counts = _occupancy[key];
+        [cells addObject:@{@"cellId": [IndoorCellId toToken:[key unsignedLongLongValue]],
+                           @"samples": counts[0],
+                           @"dwellMs": counts[1]}];
+    }
+    NSDictionary *event = @{@"type": @"occupancy",
+                            @"from": @(_batchStartMs),
+                            @"to": @(_lastSampleMs),
+                            @"samples": @(_batchSamples),
+                            @"cells": cells};
+    [_occupancy removeAllObjects];
+    [_cellOrder removeAllObjects];
+    _batchSamples = 0;
+    _lastCell = 0;
+    _batches++;
+    [self deliver:event];
+}
+
+- (void)deliver:(NSDictionary *)event
+{
+    _delivered++;
+    IndoorTraceBegin("bridge", "sendBackgroundEvent");
+    IndoorCostEnter();
+    [_sink deliverBackgroundEvent:event];
+    IndoorCostExit(IndoorCostBridge, "background");
+    IndoorTraceEnd("bridge", "sendBackgroundEvent");
+}
+
+- (NSDictionary *)stats
+{
+    @synchronized (self) {
+        return @{@"positions": @(_positions),
+                 @"regionEvents": @(_regionEvents),
+                 @"handled": @(_handled),
+                 @"delivered": @(_delivered),
+                 @"notified": @(_notified),
+                 @"triggersFired": @(_fired),
+                 @"batches": @(_batches)};
+    }
+}
+
+@end
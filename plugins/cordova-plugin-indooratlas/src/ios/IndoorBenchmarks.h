@@ -0,0 +1,95 @@
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  Micro benchmarks for the native layer, run on demand through the
+ *  runBenchmark command. Each benchmark returns a report dictionary.
+ */
+@interface IndoorBenchmarks : NSObject
+
+/**
+ *  Runs the named benchmark synchronously, returns nil for unknown names
+ *
+ *  @param name
+ *  @param options
+ */
++ (NSDictionary *)run:(NSString *)name options:(NSDictionary *)options;
+
+/**
+ *  Compares throughput and queueing latency of a thread per task and the
+ *  shared IndoorTaskScheduler for short CPU bound tasks
+ */
++ (NSDictionary *)schedulerWithTasks:(NSInteger)taskCount work:(NSInteger)work;
+
+/**
+ *  Schedules timers with delays between one second and one minute, cancels
+ *  half and expires the rest on an IndoorTimingWheel, against one dispatch
+ *  timer per request
+ */
++ (NSDictionary *)timingWheelWithTimers:(NSInteger)timerCount;
+
+/**
+ *  Runs a burst of mixed priority requests, some for the same resource and
+ *  some cancelled right away, through an IndoorFetchScheduler against two
+ *  stand-in hosts with injected latency and failures. Then fetches resources
+ *  a third host does not have, which must reach it once each and leave its
+ *  cap whole.
+ */
++ (NSDictionary *)fetchSchedulerWithRequests:(NSInteger)requestCount keys:(NSInteger)keyCount latencyMs:(NSInteger)latencyMs failureRate:(double)failureRate cancelRate:(double)cancelRate missing:(NSInteger)missingCount;
+
+/**
+ *  Checks IndoorCostAccounting against busy, sleeping and nested synthetic
+ *  tasks on the shared scheduler, and reports the cost of a bracket
+ */
++ (NSDictionary *)costAccountingWithTasks:(NSInteger)taskCount workMs:(NSInteger)workMs;
+
+/**
+ *  Replays a synthetic walk, or a recorded one given as [timeMs, floor,
+ *  eastMeters, northMeters] fixes, through IndoorBackgroundProcessor in the
+ *  foreground and in the background, and compares the JavaScript wakeups
+ */
++ (NSDictionary *)backgroundReplayWithFixes:(NSInteger)fixCount intervalMs:(NSInteger)intervalMs triggers:(NSInteger)triggerCount recorded:(NSArray *)recorded;
+
+/**
+ *  Feeds a synthetic walk with an event every eventEvery fixes through an
+ *  IndoorUplink against a stand-in backend that fails and loses responses,
+ *  and checks that every item arrives and each event follows the fix it was
+ *  queued after. Reports duplicates, requests and bytes
+ *  against one JSON request per item.
+ */
++ (NSDictionary *)uplinkWithFixes:(NSInteger)fixCount eventEvery:(NSInteger)eventEvery batchEvents:(NSInteger)batchEvents latencyMs:(NSInteger)latencyMs failureRate:(double)failureRate dropRate:(double)dropRate;
+
+/**
+ *  Checks IndoorCellId on random cells: round trips through the centre and
+ *  token, parent ranges, mutual neighbours and a polygon covering. Reports
+ *  the cost of an encode and the token of a fixed point, which must match
+ *  CellId.java.
+ */
++ (NSDictionary *)cellIdWithCells:(NSInteger)cellCount;
+
+/**
+ *  Runs chains of a fetch that stalls for stallMs and two steps, shaped like
+ *  computeRouteOnFloorPlan, on IndoorDeferred while probing the scheduler
+ *  lanes. nonBlocking holds when the probes never waited behind a stall and
+ *  the chains ran concurrently. A chain whose first step sleeps through the
+ *  stall is reported as the blocking baseline.
+ */
++ (NSDictionary *)deferredWithChains:(NSInteger)chainCount stallMs:(NSInteger)stallMs;
+
+/**
+ *  Writes events to an IndoorEventQueue, cuts tornBytes off its newest
+ *  segment like a write interrupted by a kill, and reopens it. recoveredOk
+ *  holds when only the torn record is lost, the rest replay in order and the
+ *  next append takes the lost offset.
+ */
++ (NSDictionary *)eventQueueRecoveryWithEvents:(NSInteger)eventCount tornBytes:(NSInteger)tornBytes;
+
+/**
+ *  Drives a private IndoorStreamChannel the way IndoorAtlas.js does and
+ *  decodes its frames: a full window holds frames back and coalesces, only
+ *  an in-range ack releases them, and every delivered sample decodes to what
+ *  was offered. Matches Benchmarks.streamChannel on Android.
+ */
++ (NSDictionary *)streamChannel;
+
+@end
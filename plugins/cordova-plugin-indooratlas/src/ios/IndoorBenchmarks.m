@@ -0,0 +1,1241 @@
+
+#import "IndoorBenchmarks.h"
+#import "IndoorTaskScheduler.h"
+#import "IndoorTimingWheel.h"
+#import "IndoorFetchScheduler.h"
+#import "IndoorCostAccounting.h"
+#import "IndoorBackgroundProcessor.h"
+#import "IndoorUplink.h"
+#import "IndoorCellId.h"
+#import "IndoorDeferred.h"
+#import "IndoorEventQueue.h"
+#import "IndoorStreamChannel.h"
+#import <time.h>
+#import <zlib.h>
+
+static const int64_t kBenchmarkTimeoutSeconds = 60;
+static volatile uint64_t benchmarkSink;
+
+static void spin(NSInteger iterations)
+{
+    uint64_t x = (uint64_t)iterations;
+    for (NSInteger i = 0; i < iterations; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    benchmarkSink = x;
+}
+
+static void spinFor(uint64_t nanos)
+{
+    uint64_t end = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) + nanos;
+    uint64_t x = 0;
+    while (clock_gettime_nsec_np(CLOCK_UPTIME_RAW) < end) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    benchmarkSink = x;
+}
+
+static int compareLatency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static uint64_t percentile(const uint64_t *sorted, NSInteger count, double p)
+{
+    NSInteger index = (NSInteger)ceil(p * count) - 1;
+    return sorted[MAX(0, MIN(count - 1, index))];
+}
+
+static uint16_t getUInt16(const uint8_t *p)
+{
+    uint16_t value;
+    memcpy(&value, p, 2);
+    return CFSwapInt16LittleToHost(value);
+}
+
+static uint32_t getUInt32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return CFSwapInt32LittleToHost(value);
+}
+
+static double getDouble(const uint8_t *p)
+{
+    uint64_t bits;
+    memcpy(&bits, p, 8);
+    bits = CFSwapInt64LittleToHost(bits);
+    double value;
+    memcpy(&value, &bits, 8);
+    return value;
+}
+
+static BOOL IndoorReadVarint(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t b = *(*p)++;
+        *value |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+/**
+ *  Number of fixes and events in a deflated uplink batch, -1 if it does not
+ *  decode. Adds the events that do not carry the time of the fix before them
+ *  to misordered.
+ */
+static NSInteger IndoorDecodedUplinkItems(NSData *body, NSInteger *misordered)
+{
+    NSMutableData *raw = [NSMutableData dataWithLength:MAX(body.length * 8, (NSUInteger)1024)];
+    uLongf length;
+    int result;
+    while (YES) {
+        length = raw.length;
+        result = uncompress(raw.mutableBytes, &length, body.bytes, body.length);
+        if (result != Z_BUF_ERROR) {
+            break;
+        }
+        raw.length *= 2;
+    }
+    const uint8_t *p = raw.bytes;
+    const uint8_t *end = p + length;
+    if (result != Z_OK || length < 4 || p[0] != 'I' || p[1] != 'A' || p[2] != 'U' || p[3] != 2) {
+        return -1;
+    }
+    p += 4;
+    uint64_t fixes, events, value;
+    if (!IndoorReadVarint(&p, end, &fixes) || fixes > (uint64_t)(end - p)) {
+        return -1;
+    }
+    NSMutableData *times = [NSMutableData dataWithLength:(NSUInteger)MAX(fixes, 1) * sizeof(int64_t)];
+    int64_t *time = times.mutableBytes;
+    int64_t t = 0;
+    for (uint64_t i = 0; i < fixes; i++) {
+        if (!IndoorReadVarint(&p, end, &value)) {
+            return -1;
+        }
+        t += (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+        time[i] = t;
+    }
+    for (uint64_t i = 0; i < 4 * fixes; i++) {
+        if (!IndoorReadVarint(&p, end, &value)) {
+            return -1;
+        }
+    }
+    if (!IndoorReadVarint(&p, end, &events)) {
+        return -1;
+    }
+    uint64_t fixesBefore = 0;
+    for (uint64_t i = 0; i < events; i++) {
+        uint64_t gap;
+        if (!IndoorReadVarint(&p, end, &gap) || !IndoorReadVarint(&p, end, &value) || value > (uint64_t)(end - p)) {
+            return -1;
+        }
+        NSData *json = [NSData dataWithBytesNoCopy:(void *)p length:(NSUInteger)value freeWhenDone:NO];
+        NSDictionary *event = [NSJSONSerialization JSONObjectWithData:json options:0 error:nil];
+        if (event == nil) {
+            return -1;
+        }
+        fixesBefore += gap;
+        if (fixesBefore > fixes || (fixesBefore > 0 && time[fixesBefore - 1] != [event[@"timestamp"] longLongValue])) {
+            (*misordered)++;
+        }
+        p += value;
+    }
+    return (NSInteger)(fixes + events);
+}
+
+/**
+ *  A recorded or synthetic session: positions and region transitions in time order
+ */
+typedef struct {
+    int64_t time;
+    // 0 for a position, otherwise the region transition
+    IndoorLocationTransitionType kind;
+    NSInteger floor;
+    IndoorLocalPoint point;
+    __unsafe_unretained NSString *regionId;
+    ia_region_type regionType;
+} IndoorReplayEvent;
+
+/**
+ *  Counts what a replayed IndoorBackgroundProcessor surfaces
+ */
+@interface IndoorReplaySink : NSObject <IndoorBackgroundSink>
+@property (nonatomic, assign) uint64_t delivered;
+@property (nonatomic, assign) uint64_t notified;
+@end
+
+@implementation IndoorReplaySink
+
+- (void)deliverBackgroundEvent:(NSDictionary *)event
+{
+    self.delivered++;
+}
+
+- (void)notifyTrigger:(NSString *)triggerId title:(NSString *)title text:(NSString *)text
+{
+    self.notified++;
+}
+
+@end
+
+@implementation IndoorBenchmarks
+
++ (NSDictionary *)run:(NSString *)name options:(NSDictionary *)options
+{
+    if ([name isEqualToString:@"scheduler"]) {
+        NSInteger tasks = options[@"tasks"] != nil ? [options[@"tasks"] integerValue] : 2000;
+        NSInteger work = options[@"work"] != nil ? [options[@"work"] integerValue] : 20000;
+        return [self schedulerWithTasks:MAX(1, tasks) work:work];
+    }
+    if ([name isEqualToString:@"timingWheel"]) {
+        NSInteger timers = options[@"timers"] != nil ? [options[@"timers"] integerValue] : 100000;
+        return [self timingWheelWithTimers:MAX(1, timers)];
+    }
+    if ([name isEqualToString:@"fetchScheduler"]) {
+        NSInteger requests = options[@"requests"] != nil ? [options[@"requests"] integerValue] : 120;
+        NSInteger keys = options[@"keys"] != nil ? [options[@"keys"] integerValue] : 40;
+        NSInteger latencyMs = options[@"latencyMs"] != nil ? [options[@"latencyMs"] integerValue] : 100;
+        double failureRate = options[@"failureRate"] != nil ? [options[@"failureRate"] doubleValue] : 0.1;
+        double cancelRate = options[@"cancelRate"] != nil ? [options[@"cancelRate"] doubleValue] : 0.1;
+        NSInteger missing = options[@"missing"] != nil ? [options[@"missing"] integerValue] : 4;
+        return [self fetchSchedulerWithRequests:MAX(1, requests) keys:MAX(1, keys) latencyMs:latencyMs failureRate:failureRate
+                                     cancelRate:cancelRate missing:MAX(0, missing)];
+    }
+    if ([name isEqualToString:@"costAccounting"]) {
+        NSInteger tasks = options[@"tasks"] != nil ? [options[@"tasks"] integerValue] : 20;
+        NSInteger workMs = options[@"workMs"] != nil ? [options[@"workMs"] integerValue] : 20;
+        return [self costAccountingWithTasks:MAX(1, tasks) workMs:MAX(2, workMs)];
+    }
+    if ([name isEqualToString:@"backgroundReplay"]) {
+        NSInteger fixes = options[@"fixes"] != nil ? [options[@"fixes"] integerValue] : 3600;
+        NSInteger intervalMs = options[@"intervalMs"] != nil ? [options[@"intervalMs"] integerValue] : 1000;
+        NSInteger triggers = options[@"triggers"] != nil ? [options[@"triggers"] integerValue] : 8;
+        NSArray *trace = [options[@"trace"] isKindOfClass:[NSArray class]] ? options[@"trace"] : nil;
+        return [self backgroundReplayWithFixes:MAX(1, fixes) intervalMs:MAX(1, intervalMs) triggers:MAX(0, triggers) recorded:trace];
+    }
+    if ([name isEqualToString:@"uplink"]) {
+        NSInteger fixes = options[@"fixes"] != nil ? [options[@"fixes"] integerValue] : 3600;
+        NSInteger eventEvery = options[@"eventEvery"] != nil ? [options[@"eventEvery"] integerValue] : 60;
+        NSInteger batchEvents = options[@"batchEvents"] != nil ? [options[@"batchEvents"] integerValue] : (NSInteger)IndoorUplinkDefaultBatchEvents;
+        NSInteger latencyMs = options[@"latencyMs"] != nil ? [options[@"latencyMs"] integerValue] : 20;
+        double failureRate = options[@"failureRate"] != nil ? [options[@"failureRate"] doubleValue] : 0.2;
+        double dropRate = options[@"dropRate"] != nil ? [options[@"dropRate"] doubleValue] : 0.1;
+        return [self uplinkWithFixes:MAX(1, fixes) eventEvery:MAX(0, eventEvery) batchEvents:MAX(1, batchEvents) latencyMs:MAX(0, latencyMs) failureRate:failureRate dropRate:dropRate];
+    }
+    if ([name isEqualToString:@"cellId"]) {
+        NSInteger cells = options[@"cells"] != nil ? [options[@"cells"] integerValue] : 1000;
+        return [self cellIdWithCells:MAX(1, cells)];
+    }
+    if ([name isEqualToString:@"deferred"]) {
+        NSInteger chains = options[@"chains"] != nil ? [options[@"chains"] integerValue] : 64;
+        NSInteger stallMs = options[@"stallMs"] != nil ? [options[@"stallMs"] integerValue] : 500;
+        return [self deferredWithChains:MAX(1, chains) stallMs:MAX(20, stallMs)];
+    }
+    if ([name isEqualToString:@"eventQueueRecovery"]) {
+        NSInteger events = options[@"events"] != nil ? [options[@"events"] integerValue] : 300;
+        NSInteger tornBytes = options[@"tornBytes"] != nil ? [options[@"tornBytes"] integerValue] : 7;
+        return [self eventQueueRecoveryWithEvents:MAX(2, events) tornBytes:MAX(1, tornBytes)];
+    }
+    if ([name isEqualToString:@"streamChannel"]) {
+        return [self streamChannel];
+    }
+    return nil;
+}
+
++ (NSDictionary *)schedulerWithTasks:(NSInteger)taskCount work:(NSInteger)work
+{
+    NSMutableArray *results = [NSMutableArray arrayWithCapacity:2];
+    [results addObject:[self measure:@"threadPerTask" tasks:taskCount work:work dispatcher:^(dispatch_block_t block) {
+        [NSThread detachNewThreadWithBlock:block];
+    }]];
+    [results addObject:[self measure:@"taskScheduler" tasks:taskCount work:work dispatcher:^(dispatch_block_t block) {
+        [[IndoorTaskScheduler sharedScheduler] submit:IndoorTaskLaneInteractive block:block];
+    }]];
+
+    NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:5];
+    [report setObject:@"scheduler" forKey:@"benchmark"];
+    [report setObject:[NSNumber numberWithInteger:taskCount] forKey:@"tasks"];
+    [report setObject:[NSNumber numberWithInteger:work] forKey:@"work"];
+    [report setObject:[NSNumber numberWithUnsignedInteger:[NSProcessInfo processInfo].activeProcessorCount] forKey:@"cores"];
+    [report setObject:results forKey:@"results"];
+    return report;
+}
+
++ (NSDictionary *)timingWheelWithTimers:(NSInteger)timerCount
+{
+    int64_t *delays = malloc(timerCount * sizeof(int64_t));
+    srand48(42);
+    for (NSInteger i = 0; i < timerCount; i++) {
+        delays[i] = 1000 + (int64_t)(drand48() * 59000);
+    }
+    __block NSInteger fired = 0;
+    dispatch_block_t task = ^{
+        fired++;
+    };
+    NSInteger cancelled = (timerCount + 1) / 2;
+
+    IndoorTimingWheel *wheel = [[IndoorTimingWheel alloc] initWithTickMs:10];
+    NSMutableArray<IndoorTimeout *> *timeouts = [NSMutableArray arrayWithCapacity:timerCount];
+    uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    for (NSInteger i = 0; i < timerCount; i++) {
+        [timeouts addObject:[wheel schedule:delays[i] block:task]];
+    }
+    uint64_t insert = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+    NSUInteger pending = [wheel count];
+    start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    for (NSInteger i = 0; i < timerCount; i += 2) {
+        [timeouts[i] cancel];
+    }
+    uint64_t cancel = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+    start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    [wheel advanceTo:[wheel nowMs] + 60000];
+    uint64_t expire = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+
+    NSMutableDictionary *wheelResult = [NSMutableDictionary dictionaryWithCapacity:7];
+    [wheelResult setObject:@"timingWheel" forKey:@"name"];
+    [wheelResult setObject:[NSNumber numberWithUnsignedInteger:pending] forKey:@"pending"];
+    [wheelResult setObject:[NSNumber numberWithDouble:(double)insert / timerCount] forKey:@"insertNsPerTimer"];
+    [wheelResult setObject:[NSNumber numberWithDouble:(double)cancel / cancelled] forKey:@"cancelNsPerTimer"];
+    [wheelResult setObject:[NSNumber numberWithDouble:fired > 0 ? (double)expire / fired : 0] forKey:@"expireNsPerTimer"];
+    [wheelResult setObject:[NSNumber numberWithInteger:fired] forKey:@"expired"];
+    [wheelResult setObject:[NSNumber numberWithUnsignedInteger:[wheel count]] forKey:@"remaining"];
+
+    // The previous approach: one dispatch timer per request. It cannot be fast
+    // forwarded, so only insert and cancel costs are reported.
+    dispatch_queue_t queue = dispatch_queue_create("com.indooratlas.benchmark.timers", DISPATCH_QUEUE_SERIAL);
+    NSMutableArray *sources = [NSMutableArray arrayWithCapacity:timerCount];
+    start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    for (NSInteger i = 0; i < timerCount; i++) {
+        dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+        dispatch_source_set_event_handler(source, ^{
+        });
+        dispatch_source_set_timer(source, dispatch_time(DISPATCH_TIME_NOW, delays[i] * NSEC_PER_MSEC), DISPATCH_TIME_FOREVER, 0);
+        dispatch_resume(source);
+        [sources addObject:source];
+    }
+    insert = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+    start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    for (NSInteger i = 0; i < timerCount; i += 2) {
+        dispatch_source_cancel(sources[i]);
+    }
+    cancel = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+    for (NSInteger i = 1; i < timerCount; i += 2) {
+        dispatch_source_cancel(sources[i]);
+    }
+    free(delays);
+
+    NSMutableDictionary *sourceResult = [NSMutableDictionary dictionaryWithCapacity:4];
+    [sourceResult setObject:@"dispatchSourcePerTimer" forKey:@"name"];
+    [sourceResult setObject:[NSNumber numberWithInteger:timerCount] forKey:@"pending"];
+    [sourceResult setObject:[NSNumber numberWithDouble:(double)insert / timerCount] forKey:@"insertNsPerTimer"];
+    [sourceResult setObject:[NSNumber numberWithDouble:(double)cancel / cancelled] forKey:@"cancelNsPerTimer"];
+
+    NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:3];
+    [report setObject:@"timingWheel" forKey:@"benchmark"];
+    [report setObject:[NSNumber numberWithInteger:timerCount] forKey:@"timers"];
+    [report setObject:@[wheelResult, sourceResult] forKey:@"results"];
+    return report;
+}
+
++ (NSDictionary *)fetchSchedulerWithRequests:(NSInteger)requestCount keys:(NSInteger)keyCount latencyMs:(NSInteger)latencyMs failureRate:(double)failureRate cancelRate:(double)cancelRate missing:(NSInteger)missingCount
+{
+    static const NSInteger hostCount = 2;
+    static const int64_t bodyBytes = 20000;
+    IndoorFetchScheduler *scheduler = [[IndoorFetchScheduler alloc] initWithMaxConcurrent:6 maxPerHost:2 wheel:[IndoorTimingWheel sharedWheel]];
+    dispatch_queue_t serverQueue = dispatch_queue_create("com.indooratlas.benchmark.standin", DISPATCH_QUEUE_CONCURRENT);
+    // Stand-in hosts: each answers after the injected latency and records its concurrency
+    __block NSInteger serverRequests = 0;
+    NSInteger *active = calloc(hostCount, sizeof(NSInteger));
+    __block NSInteger maxActive = 0;
+    NSObject *lock = [[NSObject alloc] init];
+
+    dispatch_group_t group = dispatch_group_create();
+    uint64_t *latencies = calloc(3 * requestCount, sizeof(uint64_t));
+    NSInteger *latencyCounts = calloc(3, sizeof(NSInteger));
+    __block NSInteger failed = 0;
+    __block NSInteger cancelled = 0;
+    srand48(42);
+    uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    for (NSInteger i = 0; i < requestCount; i++) {
+        NSInteger key = (NSInteger)(drand48() * keyCount);
+        NSInteger host = key % hostCount;
+        IndoorFetchPriority priority = (IndoorFetchPriority)(drand48() * 3);
+        uint64_t submitted = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        dispatch_group_enter(group);
+        IndoorDeferred *request = [scheduler fetch:[NSString stringWithFormat:@"standin-%ld/resource/%ld", (long)host, (long)key]
+                                              host:[NSString stringWithFormat:@"standin-%ld", (long)host]
+                                          priority:priority
+                                           fetcher:^dispatch_block_t(IndoorFetchSuccess success, IndoorFetchFailure failure) {
+            @synchronized (lock) {
+                serverRequests++;
+                active[host]++;
+                maxActive = MAX(maxActive, active[host]);
+            }
+            __block BOOL aborted = NO;
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, latencyMs * NSEC_PER_MSEC), serverQueue, ^{
+                BOOL fail;
+                @synchronized (lock) {
+                    active[host]--;
+                    fail = drand48() < failureRate;
+                    if (aborted) {
+                        return;
+                    }
+                }
+                if (fail) {
+                    failure([NSError errorWithDomain:@"StandIn" code:503 userInfo:nil], YES);
+                } else {
+                    success(@(bodyBytes), bodyBytes);
+                }
+            });
+            return ^{
+                @synchronized (lock) {
+                    aborted = YES;
+                }
+            };
+        }];
+        [request whenComplete:^(id value, NSError *error) {
+            @synchronized (lock) {
+                if (error == nil) {
+                    latencies[priority * requestCount + latencyCounts[priority]++] = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - submitted;
+                } else if (error.code == NSUserCancelledError) {
+                    // A cancel that comes after the fetch completed neither fails nor counts
+                    cancelled++;
+                } else {
+                    failed++;
+                }
+            }
+            dispatch_group_leave(group);
+        }];
+        if (drand48() < cancelRate) {
+            [request cancel];
+        }
+    }
+    BOOL completed = dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, kBenchmarkTimeoutSeconds * NSEC_PER_SEC)) == 0;
+    uint64_t elapsed = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+
+    // A host without the resources: each fetch must fail once, for good
+    __block NSInteger missingServerRequests = 0;
+    __block NSInteger missingFailed = 0;
+    dispatch_group_t missingGroup = dispatch_group_create();
+    for (NSInteger i = 0; i < missingCount; i++) {
+        dispatch_group_enter(missingGroup);
+        IndoorDeferred *request = [scheduler fetch:[NSString stringWithFormat:@"standin-missing/missing/%ld", (long)i]
+                                              host:@"standin-missing"
+                                          priority:IndoorFetchPriorityVisible
+                                           fetcher:^dispatch_block_t(IndoorFetchSuccess success, IndoorFetchFailure failure) {
+            @synchronized (lock) {
+                missingServerRequests++;
+            }
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, latencyMs * NSEC_PER_MSEC), serverQueue, ^{
+                failure([NSError errorWithDomain:@"StandIn" code:404 userInfo:nil], NO);
+            });
+            return nil;
+        }];
+        [request whenComplete:^(id value, NSError *error) {
+            @synchronized (lock) {
+                if (error != nil) {
+                    missingFailed++;
+                }
+            }
+            dispatch_group_leave(missingGroup);
+        }];
+    }
+    completed = completed && dispatch_group_wait(missingGroup, dispatch_time(DISPATCH_TIME_NOW, kBenchmarkTimeoutSeconds * NSEC_PER_SEC)) == 0;
+
+    NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:16];
+    [report setObject:@"fetchScheduler" forKey:@"benchmark"];
+    [report setObject:@(requestCount) forKey:@"requests"];
+    [report setObject:@(keyCount) forKey:@"keys"];
+    [report setObject:@(latencyMs) forKey:@"latencyMs"];
+    [report setObject:@(failureRate) forKey:@"failureRate"];
+    [report setObject:@(completed) forKey:@"completed"];
+    [report setObject:@(elapsed / 1e6) forKey:@"elapsedMs"];
+    @synchronized (lock) {
+        [report setObject:@(cancelled) forKey:@"cancelled"];
+        [report setObject:@(failed) forKey:@"failed"];
+        [report setObject:@(missingCount) forKey:@"missingRequests"];
+        [report setObject:@(missingFailed) forKey:@"missingFailed"];
+        [report setObject:@(missingServerRequests) forKey:@"missingServerRequests"];
+        NSArray *names = @[@"visible", @"navigation", @"prefetch"];
+        for (NSInteger p = 0; p < 3; p++) {
+            if (latencyCounts[p] > 0) {
+                qsort(latencies + p * requestCount, latencyCounts[p], sizeof(uint64_t), compareLatency);
+                [report setObject:@(percentile(latencies + p * requestCount, latencyCounts[p], 0.50) / 1e6)
+                           forKey:[names[p] stringByAppendingString:@"P50LatencyMs"]];
+            }
+        }
+        [report setObject:@(serverRequests) forKey:@"serverRequests"];
+        [report setObject:@(maxActive) forKey:@"maxConcurrentPerHost"];
+    }
+    // On timeout the stragglers still write into the buffers, so they are leaked on purpose.
+    // The stand-in may still answer cancelled fetches, so its counters always are.
+    if (completed) {
+        free(latencies);
+        free(latencyCounts);
+    }
+    [report setObject:@(scheduler.maxPerHost) forKey:@"perHostCap"];
+    NSDictionary *schedulerReport = [scheduler report];
+    [report setObject:schedulerReport[@"hosts"][@"standin-missing"][@"cap"] ?: @0 forKey:@"missingHostCap"];
+    [report setObject:schedulerReport forKey:@"scheduler"];
+    return report;
+}
+
++ (NSDictionary *)costAccountingWithTasks:(NSInteger)taskCount workMs:(NSInteger)workMs
+{
+    static const char *const subsystems[] = {"synthetic.busy", "synthetic.sleep", "synthetic.outer", "synthetic.inner"};
+    const int subsystemCount = 4;
+    uint64_t before[4][4];
+    for (int i = 0; i < subsystemCount; i++) {
+        [IndoorCostAccounting totals:subsystems[i] into:before[i]];
+    }
+
+    IndoorTaskScheduler *scheduler = [IndoorTaskScheduler sharedScheduler];
+    dispatch_group_t group = dispatch_group_create();
+    uint64_t workNanos = (uint64_t)workMs * NSEC_PER_MSEC;
+    for (NSInteger i = 0; i < taskCount; i++) {
+        dispatch_group_enter(group);
+        [scheduler submit:IndoorTaskLaneBackground subsystem:subsystems[0] block:^{
+            spinFor(workNanos);
+            dispatch_group_leave(group);
+        }];
+        dispatch_group_enter(group);
+        [scheduler submit:IndoorTaskLaneBackground subsystem:subsystems[1] block:^{
+            usleep((useconds_t)(workMs * 1000));
+            dispatch_group_leave(group);
+        }];
+        dispatch_group_enter(group);
+        [scheduler submit:IndoorTaskLaneBackground subsystem:subsystems[2] block:^{
+            spinFor(workNanos / 2);
+            IndoorCostEnter();
+            spinFor(workNanos / 2);
+            IndoorCostExit(subsystems[3], "nested");
+            dispatch_group_leave(group);
+        }];
+    }
+    BOOL completed = dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, kBenchmarkTimeoutSeconds * NSEC_PER_SEC)) == 0;
+    // Tasks are charged right after they return, wait for the last ones
+    uint64_t deadline = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) + 5 * NSEC_PER_SEC;
+    uint64_t outer[4];
+    while (completed) {
+        [IndoorCostAccounting totals:subsystems[2] into:outer];
+        if (outer[2] - before[2][2] >= (uint64_t)taskCount || clock_gettime_nsec_np(CLOCK_UPTIME_RAW) > deadline) {
+            break;
+        }
+        usleep(1000);
+    }
+
+    uint64_t delta[4][4];
+    NSMutableDictionary *workloads = [NSMutableDictionary dictionaryWithCapacity:subsystemCount];
+    for (int i = 0; i < subsystemCount; i++) {
+        uint64_t after[4];
+        [IndoorCostAccounting totals:subsystems[i] into:after];
+        for (int k = 0; k < 4; k++) {
+            delta[i][k] = after[k] - before[i][k];
+        }
+        [workloads setObject:@{@"cpuMs": @(delta[i][0] / 1e6), @"wallMs": @(delta[i][1] / 1e6),
+                               @"calls": @(delta[i][2]), @"wakeups": @(delta[i][3])}
+                      forKey:[NSString stringWithUTF8String:subsystems[i]]];
+    }
+
+    double busyRatio = delta[0][1] > 0 ? (double)delta[0][0] / delta[0][1] : 0;
+    double sleepRatio = delta[1][1] > 0 ? (double)delta[1][0] / delta[1][1] : 0;
+    double nestedSplit = delta[3][0] > 0 ? (double)delta[2][0] / delta[3][0] : 0;
+    uint64_t n = (uint64_t)taskCount;
+    BOOL wakeupsOk = delta[0][3] == n && delta[1][3] == n && delta[2][3] == n && delta[3][2] == n && delta[3][3] == 0;
+
+    const int pairs = 100000;
+    uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    for (int i = 0; i < pairs; i++) {
+        IndoorCostEnter();
+        IndoorCostExit("synthetic.overhead", "empty");
+    }
+    uint64_t overhead = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+
+    NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:11];
+    [report setObject:@"costAccounting" forKey:@"benchmark"];
+    [report setObject:@(taskCount) forKey:@"tasks"];
+    [report setObject:@(workMs) forKey:@"workMs"];
+    [report setObject:@(completed) forKey:@"completed"];
+    [report setObject:workloads forKey:@"workloads"];
+    [report setObject:@(busyRatio) forKey:@"busyCpuToWall"];
+    [report setObject:@(sleepRatio) forKey:@"sleepCpuToWall"];
+    [report setObject:@(nestedSplit) forKey:@"outerToInnerCpu"];
+    [report setObject:@(wakeupsOk) forKey:@"wakeupsOk"];
+    // CPU may fall short of wall time when the device is loaded, hence the slack
+    [report setObject:@(completed && wakeupsOk && busyRatio > 0.7 && sleepRatio < 0.1 && nestedSplit > 0.65 && nestedSplit < 1.35) forKey:@"attributionOk"];
+    [report setObject:@((double)overhead / pairs) forKey:@"nsPerEnterExit"];
+    return report;
+}
+
++ (NSDictionary *)backgroundReplayWithFixes:(NSInteger)fixCount intervalMs:(NSInteger)intervalMs triggers:(NSInteger)triggerCount recorded:(NSArray *)recorded
+{
+    // Region ids outlive the trace, which does not retain them
+    NSArray<NSString *> *regionIds = @[@"venue-1", @"floorplan-0", @"floorplan-1"];
+    NSInteger floorChangeEvery = MAX(1, 600000 / intervalMs);
+    NSInteger capacity = recorded != nil ? (NSInteger)[recorded count] : fixCount + 2 * (fixCount / floorChangeEvery) + 2;
+    IndoorReplayEvent *trace = calloc(MAX(1, capacity), sizeof(IndoorReplayEvent));
+    NSInteger size = 0;
+    if (recorded != nil) {
+        for (NSArray *fix in recorded) {
+            trace[size].time = [fix[0] longLongValue];
+            trace[size].floor = [fix[1] integerValue];
+            trace[size].point.east = (int32_t)llround([fix[2] doubleValue] * 1000);
+            trace[size].point.north = (int32_t)llround([fix[3] doubleValue] * 1000);
+            size++;
+        }
+    } else {
+        srand48(42);
+        double x = 50000, y = 30000, heading = 0;
+        double step = 1.2 * intervalMs;
+        NSInteger floor = 0;
+        int64_t t = 0;
+        trace[size++] = (IndoorReplayEvent){t, TRANSITION_TYPE_ENTER, 0, {0, 0}, regionIds[0], kIARegionTypeVenue};
+        trace[size++] = (IndoorReplayEvent){t, TRANSITION_TYPE_ENTER, 0, {0, 0}, regionIds[1], kIARegionTypeFloorPlan};
+        for (NSInteger i = 0; i < fixCount; i++) {
+            t += intervalMs;
+            if (i > 0 && i % floorChangeEvery == 0) {
+                trace[size++] = (IndoorReplayEvent){t, TRANSITION_TYPE_EXIT, 0, {0, 0}, regionIds[1 + floor], kIARegionTypeFloorPlan};
+                floor = 1 - floor;
+                trace[size++] = (IndoorReplayEvent){t, TRANSITION_TYPE_ENTER, 0, {0, 0}, regionIds[1 + floor], kIARegionTypeFloorPlan};
+            }
+            heading += drand48() - 0.5;
+            x += step * cos(heading);
+            y += step * sin(heading);
+            // Stay inside a 100 m x 60 m building
+            if (x < 0 || x > 100000) {
+                heading = M_PI - heading;
+                x = MAX(0, MIN(100000, x));
+            }
+            if (y < 0 || y > 60000) {
+                heading = -heading;
+                y = MAX(0, MIN(60000, y));
+            }
+            trace[size++] = (IndoorReplayEvent){t, 0, floor, {(int32_t)x, (int32_t)y}, nil, kIARegionTypeUnknown};
+        }
+    }
+
+    // Proximity triggers on points of the walk, half of them only notify
+    srand48(7);
+    IndoorVenueFrame *frame = [[IndoorVenueFrame alloc] initWithOrigin:CLLocationCoordinate2DMake(60.17, 24.94)];
+    NSMutableArray *triggers = [NSMutableArray arrayWithCapacity:triggerCount + 1];
+    for (NSInteger i = 0; i < triggerCount && size > 0; i++) {
+        NSInteger at;
+        do {
+            at = (NSInteger)(drand48() * size);
+        } while (trace[at].kind != 0);
+        CLLocationCoordinate2D center = [frame toCoordinate:trace[at].point];
+        NSMutableDictionary *trigger = [NSMutableDictionary dictionaryWithDictionary:@{
+            @"id": [NSString stringWithFormat:@"proximity-%ld", (long)i],
+            @"latitude": @(center.latitude),
+            @"longitude": @(center.longitude),
+            @"floor": @(trace[at].floor),
+            @"radius": @5,
+            @"on": @"both",
+            @"cooldownMs": @(5 * 60 * 1000)}];
+        if (i % 2 == 1) {
+            [trigger setObject:@NO forKey:@"wake"];
+            [trigger setObject:@{@"title": @"Nearby", @"text": [NSString stringWithFormat:@"Trigger %ld", (long)i]} forKey:@"notification"];
+        }
+        [triggers addObject:trigger];
+    }
+    [triggers addObject:@{@"id": @"floor-1", @"regionId": regionIds[2]}];
+    NSDictionary *config = @{@"triggers": triggers, @"batchIntervalMs": @(15 * 60 * 1000)};
+
+    NSDictionary *foreground = [self replay:trace size:size config:config frame:frame background:NO];
+    NSDictionary *background = [self replay:trace size:size config:config frame:frame background:YES];
+    free(trace);
+
+    uint64_t foregroundWakeups = [foreground[@"jsWakeups"] unsignedLongLongValue];
+    uint64_t backgroundWakeups = [background[@"jsWakeups"] unsignedLongLongValue];
+    NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:6];
+    [report setObject:@"backgroundReplay" forKey:@"benchmark"];
+    [report setObject:@(size) forKey:@"events"];
+    [report setObject:@(recorded != nil) forKey:@"recorded"];
+    [report setObject:foreground forKey:@"foreground"];
+    [report setObject:background forKey:@"background"];
+    [report setObject:@(backgroundWakeups > 0 ? (double)foregroundWakeups / backgroundWakeups : (double)foregroundWakeups) forKey:@"wakeupReduction"];
+    return report;
+}
+
++ (NSDictionary *)replay:(const IndoorReplayEvent *)trace size:(NSInteger)size config:(NSDictionary *)config frame:(IndoorVenueFrame *)frame background:(BOOL)background
+{
+    IndoorReplaySink *sink = [[IndoorReplaySink alloc] init];
+    IndoorBackgroundProcessor *processor = [[IndoorBackgroundProcessor alloc] initWithSink:sink timingWheel:nil];
+    [processor configure:config frame:frame error:NULL];
+    [processor setBackground:background];
+
+    const char *subsystem = background ? "synthetic.background" : "synthetic.foreground";
+    uint64_t before[4], after[4];
+    [IndoorCostAccounting totals:subsystem into:before];
+    uint64_t direct = 0;
+    for (NSInteger i = 0; i < size; i++) {
+        const IndoorReplayEvent *event = &trace[i];
+        IndoorCostEnter();
+        BOOL handled = event->kind == 0
+            ? [processor onPositionAt:event->time floor:event->floor point:event->point]
+            : [processor onRegion:event->regionId type:event->regionType transition:event->kind at:event->time];
+        IndoorCostExit(subsystem, "replay");
+        if (!handled) {
+            // Sent to the watch callbacks, as without a processor
+            direct++;
+        }
+    }
+    // Returning to the foreground delivers the last batch
+    [processor setBackground:NO];
+    [IndoorCostAccounting totals:subsystem into:after];
+
+    NSMutableDictionary *result = [NSMutableDictionary dictionaryWithDictionary:[processor stats]];
+    [result setObject:@(direct) forKey:@"direct"];
+    [result setObject:@(direct + sink.delivered) forKey:@"jsWakeups"];
+    [result setObject:@(sink.notified) forKey:@"notifications"];
+    [result setObject:@(size > 0 ? (double)(after[0] - before[0]) / size : 0) forKey:@"cpuNsPerEvent"];
+    return result;
+}
+
++ (NSDictionary *)uplinkWithFixes:(NSInteger)fixCount eventEvery:(NSInteger)eventEvery batchEvents:(NSInteger)batchEvents latencyMs:(NSInteger)latencyMs failureRate:(double)failureRate dropRate:(double)dropRate
+{
+    // Stand-in backend: records the offsets it took and checks the event order, fails at failureRate and loses the response at dropRate
+    dispatch_queue_t serverQueue = dispatch_queue_create("com.indooratlas.benchmark.uplink", DISPATCH_QUEUE_SERIAL);
+    NSMutableIndexSet *received = [NSMutableIndexSet indexSet];
+    __block NSInteger serverRequests = 0;
+    __block NSInteger failures = 0;
+    __block NSInteger drops = 0;
+    __block NSInteger duplicates = 0;
+    __block NSInteger decodeErrors = 0;
+    __block NSInteger orderErrors = 0;
+    NSObject *lock = [[NSObject alloc] init];
+    IndoorUplinkTransport transport = ^(NSURLRequest *request, IndoorUplinkResponse response) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, latencyMs * NSEC_PER_MSEC), serverQueue, ^{
+            NSInteger status = 200;
+            @synchronized (lock) {
+                serverRequests++;
+                double roll = drand48();
+                if (roll < failureRate) {
+                    failures++;
+                    status = 503;
+                } else {
+                    NSArray<NSString *> *range = [[request valueForHTTPHeaderField:@"X-IA-Offsets"] componentsSeparatedByString:@"-"];
+                    NSInteger first = range.count == 2 ? [range[0] integerValue] : -1;
+                    NSInteger last = range.count == 2 ? [range[1] integerValue] : -2;
+                    if (first < 0 || IndoorDecodedUplinkItems(request.HTTPBody, &orderErrors) != last - first + 1) {
+                        decodeErrors++;
+                    }
+                    for (NSInteger offset = first; offset >= 0 && offset <= last; offset++) {
+                        if ([received containsIndex:offset]) {
+                            duplicates++;
+                        }
+                        [received addIndex:offset];
+                    }
+                    if (roll < failureRate + dropRate) {
+                        drops++;
+                        status = -1;
+                    }
+                }
+            }
+            response(status);
+        });
+    };
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"ia-uplink-benchmark-%llu", clock_gettime_nsec_np(CLOCK_UPTIME_RAW)]];
+    NSError *error = nil;
+    IndoorUplink *uplink = [[IndoorUplink alloc] initWithDirectory:path transport:transport error:&error];
+    if (uplink == nil) {
+        return @{@"benchmark": @"uplink", @"error": [error localizedDescription] ?: @"Cannot open uplink"};
+    }
+    [uplink configure:@{@"url": @"http://standin/batch", @"batchEvents": @(batchEvents), @"intervalMs": @100,
+                        @"backoffBaseMs": @20, @"backoffMaxMs": @500} error:nil];
+
+    srand48(42);
+    double latitude = 60.1699;
+    double longitude = 24.9384;
+    int64_t timeMs = 1600000000000LL;
+    NSInteger items = 0;
+    uint64_t jsonBytes = 0;
+    uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    for (NSInteger i = 0; i < fixCount; i++) {
+        timeMs += 1000;
+        latitude += (drand48() - 0.5) * 2e-5;
+        longitude += (drand48() - 0.5) * 4e-5;
+        NSInteger floor = (i / 600) % 3;
+        double accuracy = 2 + drand48() * 4;
+        [uplink onFixAt:timeMs latitude:latitude longitude:longitude floor:floor accuracy:accuracy];
+        NSDictionary *fix = @{@"type": @"fix", @"t": @(timeMs), @"lat": @(latitude), @"lon": @(longitude), @"floor": @(floor), @"acc": @(accuracy)};
+        jsonBytes += [NSJSONSerialization dataWithJSONObject:fix options:0 error:nil].length;
+        items++;
+        if (eventEvery > 0 && i % eventEvery == 0) {
+            NSDictionary *event = @{@"type": @"region", @"regionId": [NSString stringWithFormat:@"region-%ld", (long)(drand48() * 20)],
+                                    @"timestamp": @(timeMs), @"regionType": @(kIARegionTypeFloorPlan), @"transitionType": @(drand48() < 0.5 ? 1 : 2)};
+            [uplink onEvent:event];
+            jsonBytes += [NSJSONSerialization dataWithJSONObject:event options:0 error:nil].length;
+            items++;
+        }
+    }
+    BOOL completed = NO;
+    uint64_t deadline = start + kBenchmarkTimeoutSeconds * NSEC_PER_SEC;
+    while (clock_gettime_nsec_np(CLOCK_UPTIME_RAW) < deadline) {
+        if ([[uplink stats][@"pending"] longLongValue] == 0) {
+            completed = YES;
+            break;
+        }
+        usleep(20000);
+    }
+    uint64_t elapsed = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+    [uplink disable];
+    NSDictionary *stats = [uplink stats];
+    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+
+    NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:20];
+    [report setObject:@"uplink" forKey:@"benchmark"];
+    [report setObject:@(items) forKey:@"items"];
+    [report setObject:@(batchEvents) forKey:@"batchEvents"];
+    [report setObject:@(failureRate) forKey:@"failureRate"];
+    [report setObject:@(dropRate) forKey:@"dropRate"];
+    [report setObject:@(completed) forKey:@"completed"];
+    [report setObject:@(elapsed / 1e6) forKey:@"elapsedMs"];
+    @synchronized (lock) {
+        [report setObject:@(received.count) forKey:@"received"];
+        [report setObject:@(items - (NSInteger)received.count) forKey:@"missing"];
+        [report setObject:@(duplicates) forKey:@"duplicates"];
+        [report setObject:@(decodeErrors) forKey:@"decodeErrors"];
+        [report setObject:@(orderErrors) forKey:@"orderErrors"];
+        [report setObject:@(serverRequests) forKey:@"serverRequests"];
+        [report setObject:@(failures) forKey:@"injectedFailures"];
+        [report setObject:@(drops) forKey:@"injectedDrops"];
+        [report setObject:@(serverRequests > 0 ? (double)items / serverRequests : 0) forKey:@"requestReduction"];
+    }
+    uint64_t wireBytes = [stats[@"wireBytes"] unsignedLongLongValue];
+    [report setObject:@(jsonBytes) forKey:@"jsonBytes"];
+    [report setObject:@(wireBytes) forKey:@"wireBytes"];
+    [report setObject:@((double)wireBytes / items) forKey:@"wireBytesPerItem"];
+    [report setObject:@(wireBytes > 0 ? (double)jsonBytes / wireBytes : 0) forKey:@"compressionRatio"];
+    [report setObject:stats forKey:@"uplink"];
+    return report;
+}
+
++ (NSDictionary *)cellIdWithCells:(NSInteger)cellCount
+{
+    uint16_t venueKey = [IndoorCellId venueKey:@"venue-1"];
+    srand48(42);
+    BOOL roundTripOk = YES, tokenOk = YES, hierarchyOk = YES, neighboursOk = YES;
+    for (NSInteger i = 0; i < cellCount; i++) {
+        double x = (drand48() - 0.5) * 200;
+        double y = (drand48() - 0.5) * 200;
+        NSInteger floorLevel = (NSInteger)(drand48() * 10) - 3;
+        int level = (int)(drand48() * (IndoorCellIdMaxLevel + 1));
+        IndoorCellIdType cellId = [IndoorCellId cellIdWithVenue:venueKey floor:floorLevel x:x y:y level:level];
+        double rect[4];
+        [IndoorCellId bounds:cellId into:rect];
+        roundTripOk = roundTripOk && [IndoorCellId isValid:cellId] && [IndoorCellId level:cellId] == level
+            && [IndoorCellId floor:cellId] == floorLevel && [IndoorCellId venue:cellId] == venueKey
+            && [IndoorCellId cellIdWithVenue:venueKey floor:floorLevel x:(rect[0] + rect[2]) / 2 y:(rect[1] + rect[3]) / 2 level:level] == cellId;
+        tokenOk = tokenOk && [IndoorCellId fromToken:[IndoorCellId toToken:cellId]] == cellId;
+        hierarchyOk = hierarchyOk && [IndoorCellId cell:cellId contains:[IndoorCellId cellIdWithVenue:venueKey floor:floorLevel x:x y:y level:IndoorCellIdMaxLevel]];
+        if (level > 0) {
+            IndoorCellIdType parent = [IndoorCellId parent:cellId level:level - 1];
+            BOOL isChild = NO;
+            for (int k = 0; k < 4; k++) {
+                isChild = isChild || [IndoorCellId child:parent index:k] == cellId;
+            }
+            hierarchyOk = hierarchyOk && isChild && [IndoorCellId cell:parent contains:cellId]
+                && [IndoorCellId rangeMin:parent] <= [IndoorCellId rangeMin:cellId] && [IndoorCellId rangeMax:cellId] <= [IndoorCellId rangeMax:parent];
+        }
+        for (NSNumber *neighbour in [IndoorCellId neighbours:cellId]) {
+            IndoorCellIdType other = [neighbour unsignedLongLongValue];
+            BOOL mutual = NO;
+            for (NSNumber *back in [IndoorCellId neighbours:other]) {
+                mutual = mutual || [back unsignedLongLongValue] == cellId;
+            }
+            neighboursOk = neighboursOk && mutual && other != cellId && [IndoorCellId level:other] == level;
+        }
+    }
+
+    // A triangle covered down to 25 cm cells
+    const double polygon[] = {-20, -10, 30, -10, -20, 25};
+    NSArray<NSNumber *> *covering = [IndoorCellId coverPolygon:polygon count:3 venue:venueKey floor:0 maxLevel:14];
+    BOOL coverOk = YES;
+    for (NSInteger i = 0; i < cellCount; i++) {
+        double x = -20 + drand48() * 50;
+        double y = -10 + drand48() * 35;
+        if (![IndoorCellId polygon:polygon count:3 containsX:x y:y]) {
+            continue;
+        }
+        IndoorCellIdType leaf = [IndoorCellId cellIdWithVenue:venueKey floor:0 x:x y:y level:IndoorCellIdMaxLevel];
+        BOOL covered = NO;
+        for (NSNumber *cell in covering) {
+            covered = covered || [IndoorCellId cell:[cell unsignedLongLongValue] contains:leaf];
+        }
+        coverOk = coverOk && covered;
+    }
+
+    NSInteger encodes = MAX(100000, cellCount);
+    uint64_t sink = 0;
+    uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    for (NSInteger i = 0; i < encodes; i++) {
+        sink += [IndoorCellId cellIdWithVenue:venueKey floor:1 x:(i % 1000) * 0.1 y:(i / 1000) * 0.1 level:IndoorCellIdMaxLevel];
+    }
+    uint64_t elapsed = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+    benchmarkSink = sink;
+
+    NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:10];
+    [report setObject:@"cellId" forKey:@"benchmark"];
+    [report setObject:@(cellCount) forKey:@"cells"];
+    [report setObject:@(roundTripOk) forKey:@"roundTripOk"];
+    [report setObject:@(tokenOk) forKey:@"tokenOk"];
+    [report setObject:@(hierarchyOk) forKey:@"hierarchyOk"];
+    [report setObject:@(neighboursOk) forKey:@"neighboursOk"];
+    [report setObject:@(coverOk) forKey:@"coverOk"];
+    [report setObject:@(covering.count) forKey:@"coverCells"];
+    [report setObject:[IndoorCellId toToken:[IndoorCellId cellIdWithVenue:venueKey floor:2 x:10.5 y:-3.25 level:IndoorCellIdMaxLevel]] forKey:@"fixedToken"];
+    [report setObject:@((double)elapsed / encodes) forKey:@"nsPerEncode"];
+    return report;
+}
+
++ (NSDictionary *)deferredWithChains:(NSInteger)chainCount stallMs:(NSInteger)stallMs
+{
+    NSDictionary *deferred = [self deferredChains:chainCount stallMs:stallMs blocking:NO];
+    NSDictionary *blocking = [self deferredChains:chainCount stallMs:stallMs blocking:YES];
+    NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:6];
+    [report setObject:@"deferred" forKey:@"benchmark"];
+    [report setObject:@(chainCount) forKey:@"chains"];
+    [report setObject:@(stallMs) forKey:@"stallMs"];
+    [report setObject:deferred forKey:@"deferred"];
+    [report setObject:blocking forKey:@"blocking"];
+    // Probes may queue behind a few short steps, never behind a stall
+    BOOL nonBlocking = [deferred[@"completed"] boolValue] && [deferred[@"failures"] integerValue] == 0
+        && [deferred[@"maxProbeLatencyMs"] doubleValue] < stallMs / 2.0
+        && [deferred[@"elapsedMs"] doubleValue] < 2.0 * stallMs;
+    [report setObject:@(nonBlocking) forKey:@"nonBlocking"];
+    return report;
+}
+
++ (NSDictionary *)deferredChains:(NSInteger)chainCount stallMs:(NSInteger)stallMs blocking:(BOOL)blocking
+{
+    dispatch_group_t done = dispatch_group_create();
+    __block NSInteger failures = 0;
+    NSObject *lock = [[NSObject alloc] init];
+    uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    for (NSInteger i = 0; i < chainCount; i++) {
+        IndoorDeferred *fetch;
+        if (blocking) {
+            fetch = [[IndoorDeferred resolved:@(i)] then:IndoorTaskLaneInteractive step:^IndoorDeferred *(id value) {
+                usleep((useconds_t)(stallMs * 1000));
+                return [IndoorDeferred resolved:value];
+            }];
+        } else {
+            IndoorDeferred *pending = [[IndoorDeferred alloc] initWithToken:nil];
+            [[IndoorTimingWheel sharedWheel] schedule:stallMs block:^{
+                [pending resolve:@(i)];
+            }];
+            fetch = pending;
+        }
+        dispatch_group_enter(done);
+        [[[fetch then:IndoorTaskLaneInteractive step:^IndoorDeferred *(NSNumber *value) {
+            spinFor(NSEC_PER_MSEC);
+            return [IndoorDeferred resolved:@(value.integerValue * 2)];
+        }] then:IndoorTaskLaneBackground step:^IndoorDeferred *(NSNumber *value) {
+            return [IndoorDeferred resolved:@(value.integerValue + 1)];
+        }] whenComplete:^(id value, NSError *error) {
+            if (error != nil) {
+                @synchronized (lock) {
+                    failures++;
+                }
+            }
+            dispatch_group_leave(done);
+        }];
+    }
+
+    // Probe both lanes every 5 ms while the fetches are in flight
+    NSInteger probeCount = MAX(1, stallMs / 5);
+    uint64_t *probeLatencies = calloc(2 * probeCount, sizeof(uint64_t));
+    dispatch_group_t probed = dispatch_group_create();
+    IndoorTaskScheduler *scheduler = [IndoorTaskScheduler sharedScheduler];
+    for (NSInteger i = 0; i < probeCount; i++) {
+        for (NSInteger lane = 0; lane < 2; lane++) {
+            NSInteger index = 2 * i + lane;
+            uint64_t submitted = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+            dispatch_group_enter(probed);
+            [scheduler submit:lane == 0 ? IndoorTaskLaneInteractive : IndoorTaskLaneBackground block:^{
+                probeLatencies[index] = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - submitted;
+                dispatch_group_leave(probed);
+            }];
+        }
+        usleep(5000);
+    }
+    dispatch_time_t timeout = dispatch_time(DISPATCH_TIME_NOW, kBenchmarkTimeoutSeconds * NSEC_PER_SEC);
+    BOOL completed = dispatch_group_wait(done, timeout) == 0;
+    completed = dispatch_group_wait(probed, timeout) == 0 && completed;
+    uint64_t elapsed = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+
+    NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:7];
+    [result setObject:blocking ? @"blocking" : @"deferred" forKey:@"name"];
+    [result setObject:@(completed) forKey:@"completed"];
+    @synchronized (lock) {
+        [result setObject:@(failures) forKey:@"failures"];
+    }
+    [result setObject:@(elapsed / 1e6) forKey:@"elapsedMs"];
+    [result setObject:@(2 * probeCount) forKey:@"probes"];
+    if (completed) {
+        qsort(probeLatencies, 2 * probeCount, sizeof(uint64_t), compareLatency);
+        [result setObject:@(percentile(probeLatencies, 2 * probeCount, 0.50) / 1e6) forKey:@"p50ProbeLatencyMs"];
+        [result setObject:@(probeLatencies[2 * probeCount - 1] / 1e6) forKey:@"maxProbeLatencyMs"];
+        free(probeLatencies);
+    }
+    // On timeout the stragglers still write into the buffer, so it is leaked on purpose
+    return result;
+}
+
++ (NSDictionary *)eventQueueRecoveryWithEvents:(NSInteger)eventCount tornBytes:(NSInteger)tornBytes
+{
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"ia-event-queue-benchmark-%llu", clock_gettime_nsec_np(CLOCK_UPTIME_RAW)]];
+    NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:11];
+    [report setObject:@"eventQueueRecovery" forKey:@"benchmark"];
+    [report setObject:@(eventCount) forKey:@"events"];
+    [report setObject:@(tornBytes) forKey:@"tornBytes"];
+    [report setObject:@NO forKey:@"recoveredOk"];
+
+    NSError *error = nil;
+    IndoorEventQueue *queue = [[IndoorEventQueue alloc] initWithDirectory:path maxBytes:IndoorEventQueueDefaultMaxBytes segmentBytes:4096 error:&error];
+    for (NSInteger i = 0; queue != nil && i < eventCount; i++) {
+        if ([queue append:@{@"type": @"synthetic", @"i": @(i)} error:&error] < 0) {
+            queue = nil;
+        }
+    }
+    if (queue == nil) {
+        [report setObject:[error localizedDescription] ?: @"Cannot write the queue" forKey:@"error"];
+        [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+        return report;
+    }
+    [report setObject:[queue stats][@"segments"] forKey:@"segments"];
+    [queue close];
+
+    NSString *newest = nil;
+    for (NSString *name in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:path error:nil]) {
+        if ([name hasSuffix:@".log"] && (newest == nil || [name compare:newest] == NSOrderedDescending)) {
+            newest = name;
+        }
+    }
+    NSFileHandle *file = newest != nil ? [NSFileHandle fileHandleForWritingAtPath:[path stringByAppendingPathComponent:newest]] : nil;
+    if (file == nil) {
+        [report setObject:@"No segment written" forKey:@"error"];
+        [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+        return report;
+    }
+    unsigned long long length = [file seekToEndOfFile];
+    [file truncateFileAtOffset:length > (unsigned long long)tornBytes ? length - tornBytes : 0];
+    [file closeFile];
+
+    uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    IndoorEventQueue *recovered = [[IndoorEventQueue alloc] initWithDirectory:path maxBytes:IndoorEventQueueDefaultMaxBytes segmentBytes:4096 error:&error];
+    uint64_t recoverNanos = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+    if (recovered == nil) {
+        [report setObject:[error localizedDescription] ?: @"Cannot reopen the queue" forKey:@"error"];
+        [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+        return report;
+    }
+    NSInteger replayed = 0;
+    BOOL orderOk = YES;
+    while (YES) {
+        NSDictionary *batch = [recovered read:@"recovery" maxEvents:IndoorEventQueueDefaultBatch];
+        NSArray *events = batch[@"events"];
+        if (events.count == 0) {
+            break;
+        }
+        for (NSDictionary *event in events) {
+            orderOk = orderOk && [event[@"offset"] longLongValue] == replayed && [event[@"i"] integerValue] == replayed;
+            replayed++;
+        }
+        [recovered ack:@"recovery" offset:[batch[@"lastOffset"] longLongValue] error:nil];
+    }
+    uint64_t truncatedBytes = [[recovered stats][@"truncatedBytes"] unsignedLongLongValue];
+    int64_t nextOffset = [recovered append:@{@"type": @"synthetic", @"i": @(replayed)} error:nil];
+    NSArray *tail = [recovered read:@"recovery" maxEvents:IndoorEventQueueDefaultBatch][@"events"];
+    BOOL appendOk = nextOffset == replayed && tail.count == 1 && [tail[0][@"i"] integerValue] == replayed;
+    [recovered close];
+    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+
+    [report setObject:@(replayed) forKey:@"replayed"];
+    [report setObject:@(eventCount - replayed) forKey:@"lost"];
+    [report setObject:@(truncatedBytes) forKey:@"truncatedBytes"];
+    [report setObject:@(orderOk) forKey:@"orderOk"];
+    [report setObject:@(appendOk) forKey:@"appendAfterRecoveryOk"];
+    [report setObject:@(recoverNanos / 1e6) forKey:@"recoverMs"];
+    [report setObject:@(replayed == eventCount - 1 && orderOk && appendOk && truncatedBytes > 0) forKey:@"recoveredOk"];
+    return report;
+}
+
++ (NSDictionary *)streamChannel
+{
+    NSMutableArray<NSData *> *frames = [NSMutableArray array];
+    IndoorStreamChannel *channel = [[IndoorStreamChannel alloc] init];
+    [channel openWithSend:^(NSData *frame) {
+        [frames addObject:frame];
+    }];
+    const NSInteger positionStream = 1;
+    const NSInteger headingStream = 2;
+    [channel addStream:positionStream fields:3 latestOnly:NO];
+    [channel addStream:headingStream fields:IndoorStreamHeadingFields latestOnly:YES];
+    double region = [channel intern:@"region-a"];
+
+    // A frame per position until the window is full, then more than a queue holds
+    const NSInteger extra = 10;
+    const NSInteger headings = 10;
+    const NSInteger window = IndoorStreamChannelWindowFrames;
+    const NSInteger ackEvery = IndoorStreamChannelAckEveryFrames;
+    NSInteger offered = 0;
+    for (; offered < window + IndoorStreamChannelQueueCapacity + extra; offered++) {
+        double sample[3] = {offered, region, offered * 0.5};
+        [channel offer:positionStream sample:sample];
+    }
+    for (NSInteger i = 0; i < headings; i++) {
+        double sample[2] = {i * 10.0, i};
+        [channel offer:headingStream sample:sample];
+    }
+    BOOL windowOk = (NSInteger)frames.count == window;
+    [channel acknowledge:(uint32_t)(window + 1)];
+    BOOL futureAckIgnored = (NSInteger)frames.count == window;
+    [channel acknowledge:(uint32_t)ackEvery];
+    NSInteger released = (NSInteger)frames.count - window;
+
+    // Fill the window again and hold one position back
+    NSInteger inFlight = (NSInteger)frames.count - ackEvery;
+    for (NSInteger i = 0; i < window - inFlight + 1; i++, offered++) {
+        double sample[3] = {offered, region, offered * 0.5};
+        [channel offer:positionStream sample:sample];
+    }
+    NSInteger full = (NSInteger)frames.count;
+    [channel acknowledge:(uint32_t)(ackEvery - 1)];
+    BOOL staleAckIgnored = (NSInteger)frames.count == full;
+    [channel acknowledge:(uint32_t)(2 * ackEvery)];
+    BOOL heldBackSent = (NSInteger)frames.count == full + 1;
+    // With the window empty every sample goes out right away
+    [channel acknowledge:(uint32_t)frames.count];
+    double last[3] = {offered, region, offered * 0.5};
+    [channel offer:positionStream sample:last];
+    offered++;
+    BOOL lowRateOk = (NSInteger)frames.count == full + 2;
+
+    // Decode as IndoorAtlas.js does
+    NSMutableArray<NSString *> *strings = [NSMutableArray array];
+    NSInteger stringsFrame = 0;
+    BOOL decodeOk = YES;
+    BOOL headingsCoalesced = NO;
+    BOOL positionsCoalesced = NO;
+    NSInteger delivered = 0;
+    NSInteger dropped = 0;
+    uint32_t nextSequence = 0;
+    for (NSUInteger f = 0; f < frames.count; f++) {
+        const uint8_t *p = frames[f].bytes;
+        const uint8_t *end = p + frames[f].length;
+        uint16_t sectionCount = getUInt16(p + 2);
+        uint32_t sequence = getUInt32(p + 4);
+        decodeOk = decodeOk && getUInt16(p) == IndoorStreamChannelVersion && sequence == f + 1;
+        p += 8;
+        for (uint16_t s = 0; s < sectionCount && decodeOk; s++) {
+            uint16_t streamId = getUInt16(p);
+            uint16_t fields = getUInt16(p + 2);
+            uint32_t count = getUInt32(p + 4);
+            uint32_t first = getUInt32(p + 8);
+            uint32_t coalesced = getUInt32(p + 12);
+            p += 16;
+            if (streamId == 0) {
+                stringsFrame = stringsFrame == 0 ? sequence : -1;
+                for (uint32_t i = 0; i < count; i++) {
+                    uint32_t index = getUInt32(p);
+                    uint32_t length = getUInt32(p + 4);
+                    NSString *string = [[NSString alloc] initWithBytes:p + 8 length:length encoding:NSUTF8StringEncoding];
+                    decodeOk = decodeOk && index == strings.count && string != nil;
+                    if (string != nil) {
+                        [strings addObject:string];
+                    }
+                    p += (8 + length + 7) & ~(NSUInteger)7;
+                }
+                continue;
+            }
+            if (streamId == headingStream) {
+                // The burst arrives with the first ack, as its latest sample
+                headingsCoalesced = sequence == window + 1 && count == 1 && coalesced == headings - 1
+                    && getDouble(p + 8) == headings - 1;
+            } else {
+                decodeOk = decodeOk && streamId == positionStream && first == nextSequence + coalesced;
+                for (uint32_t i = 0; i < count; i++) {
+                    const uint8_t *sample = p + i * fields * 8;
+                    double expected = first + i;
+                    NSInteger stringIndex = (NSInteger)getDouble(sample + 8);
+                    decodeOk = decodeOk && getDouble(sample) == expected && getDouble(sample + 16) == expected * 0.5
+                        && stringIndex < (NSInteger)strings.count && [strings[stringIndex] isEqualToString:@"region-a"];
+                }
+                if (sequence == window + 1) {
+                    positionsCoalesced = count == IndoorStreamChannelQueueCapacity && coalesced == extra;
+                }
+                nextSequence = first + count;
+                delivered += count;
+                dropped += coalesced;
+            }
+            p += count * fields * 8;
+        }
+        decodeOk = decodeOk && p == end;
+    }
+    // The string goes out once, with the first sample that refers to it
+    decodeOk = decodeOk && delivered + dropped == offered && stringsFrame == 1;
+    BOOL coalescedOk = headingsCoalesced && positionsCoalesced;
+
+    NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:14];
+    [report setObject:@"streamChannel" forKey:@"benchmark"];
+    [report setObject:@(frames.count) forKey:@"frames"];
+    [report setObject:@(offered) forKey:@"offered"];
+    [report setObject:@(delivered) forKey:@"delivered"];
+    [report setObject:@(dropped) forKey:@"coalesced"];
+    [report setObject:@(windowOk) forKey:@"windowOk"];
+    [report setObject:@(futureAckIgnored) forKey:@"futureAckIgnored"];
+    [report setObject:@(staleAckIgnored) forKey:@"staleAckIgnored"];
+    [report setObject:@(released) forKey:@"releasedFrames"];
+    [report setObject:@(heldBackSent) forKey:@"heldBackSent"];
+    [report setObject:@(lowRateOk) forKey:@"lowRateOk"];
+    [report setObject:@(coalescedOk) forKey:@"coalescedOk"];
+    [report setObject:@(decodeOk) forKey:@"decodeOk"];
+    [report setObject:@(windowOk && futureAckIgnored && staleAckIgnored && released == 1 && heldBackSent
+                        && lowRateOk && coalescedOk && decodeOk) forKey:@"ok"];
+    return report;
+}
+
++ (NSDictionary *)measure:(NSString *)name tasks:(NSInteger)taskCount work:(NSInteger)work dispatcher:(void (^)(dispatch_block_t))dispatcher
+{
+    uint64_t *latencies = calloc(taskCount, sizeof(uint64_t));
+    dispatch_group_t group = dispatch_group_create();
+    uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    for (NSInteger i = 0; i < taskCount; i++) {
+        uint64_t submitted = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        dispatch_group_enter(group);
+        dispatcher(^{
+            latencies[i] = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - submitted;
+            spin(work);
+            dispatch_group_leave(group);
+        });
+    }
+    BOOL completed = dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, kBenchmarkTimeoutSeconds * NSEC_PER_SEC)) == 0;
+    uint64_t elapsed = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+
+    NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:7];
+    [result setObject:name forKey:@"name"];
+    [result setObject:[NSNumber numberWithBool:completed] forKey:@"completed"];
+    [result setObject:[NSNumber numberWithDouble:elapsed / 1e6] forKey:@"elapsedMs"];
+    [result setObject:[NSNumber numberWithDouble:taskCount / (elapsed / 1e9)] forKey:@"tasksPerSecond"];
+    if (completed) {
+        qsort(latencies, taskCount, sizeof(uint64_t), compareLatency);
+        [result setObject:[NSNumber numberWithDouble:percentile(latencies, taskCount, 0.50) / 1e6] forKey:@"p50LatencyMs"];
+        [result setObject:[NSNumber numberWithDouble:percentile(latencies, taskCount, 0.99) / 1e6] forKey:@"p99LatencyMs"];
+        [result setObject:[NSNumber numberWithDouble:latencies[taskCount - 1] / 1e6] forKey:@"maxLatencyMs"];
+        free(latencies);
+    }
+    // On timeout the stragglers still write into the buffer, so it is leaked on purpose
+    return result;
+}
+
+@end
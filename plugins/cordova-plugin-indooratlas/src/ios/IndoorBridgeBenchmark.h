@@ -0,0 +1,52 @@
+
+#import <Foundation/Foundation.h>
+
+extern NSString * const IndoorBridgeShapePosition;
+extern NSString * const IndoorBridgeShapeRoute;
+extern NSString * const IndoorBridgeShapeCrowd;
+extern NSString * const IndoorBridgeEncodingDict;
+extern NSString * const IndoorBridgeEncodingString;
+extern NSString * const IndoorBridgeEncodingBuffer;
+
+extern const NSInteger IndoorBridgeRouteLegs;
+extern const NSInteger IndoorBridgeCrowdPeers;
+extern const NSInteger IndoorBridgeMaxRateHz;
+extern const NSInteger IndoorBridgeMaxEvents;
+
+/**
+ *  Delivers one payload, an NSDictionary, NSString or NSData, to JavaScript
+ */
+typedef void (^IndoorBridgeSend)(id payload, BOOL keepCallback);
+
+/**
+ *  Native half of the bridge micro-benchmarks driven by
+ *  IndoorAtlas.runBridgeBenchmark.
+ *
+ *  Payloads are shaped like the plugin's real ones: a position, a 500 leg
+ *  route and a crowd frame of 1000 peers, each as a dictionary, as the same
+ *  JSON in a string and as binary data. Every payload carries the native time
+ *  it was sent, in milliseconds since the epoch: the "sentAt" key of the JSON
+ *  forms and the first little-endian float64 of the binary one. Templates are
+ *  built once per shape. Matches BridgeBenchmark.java.
+ */
+@interface IndoorBridgeBenchmark : NSObject
+
+/**
+ *  Stamped payload of a shape in an encoding, nil with an error message if
+ *  either is unknown
+ */
+- (id)payloadForShape:(NSString *)shape encoding:(NSString *)encoding error:(NSString **)error;
+
+/**
+ *  Sends count payloads at rateHz from a background queue, then a final
+ *  { done, sent, late, durationMs } dictionary without keeping the callback.
+ *  Returns NO with an error message if the arguments are invalid.
+ */
+- (BOOL)streamShape:(NSString *)shape encoding:(NSString *)encoding rateHz:(NSInteger)rateHz count:(NSInteger)count send:(IndoorBridgeSend)send error:(NSString **)error;
+
+/**
+ *  Ends a running stream after its current event
+ */
+- (void)stop;
+
+@end
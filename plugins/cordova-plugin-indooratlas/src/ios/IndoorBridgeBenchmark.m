@@ -0,0 +1,297 @@
+
+#import "IndoorBridgeBenchmark.h"
+#import "IndoorVenueFrame.h"
+#import <time.h>
+#import <stdlib.h>
+
+NSString * const IndoorBridgeShapePosition = @"position";
+NSString * const IndoorBridgeShapeRoute = @"route";
+NSString * const IndoorBridgeShapeCrowd = @"crowd";
+NSString * const IndoorBridgeEncodingDict = @"dict";
+NSString * const IndoorBridgeEncodingString = @"string";
+NSString * const IndoorBridgeEncodingBuffer = @"buffer";
+
+const NSInteger IndoorBridgeRouteLegs = 500;
+const NSInteger IndoorBridgeCrowdPeers = 1000;
+const NSInteger IndoorBridgeMaxRateHz = 1000;
+const NSInteger IndoorBridgeMaxEvents = 100000;
+
+// Same layout constants as RouteBuffer.java
+static const uint32_t kRouteHeaderBytes = 40;
+static const int32_t kRouteVersion = 1;
+enum { kRouteStride = 7 };
+
+static void putDouble(uint8_t *p, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    bits = CFSwapInt64HostToLittle(bits);
+    memcpy(p, &bits, 8);
+}
+
+static void putInt32(uint8_t *p, int32_t value)
+{
+    uint32_t bits = CFSwapInt32HostToLittle((uint32_t)value);
+    memcpy(p, &bits, 4);
+}
+
+static void putFloat(uint8_t *p, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    bits = CFSwapInt32HostToLittle(bits);
+    memcpy(p, &bits, 4);
+}
+
+static double nowMillis(void)
+{
+    return floor([NSDate date].timeIntervalSince1970 * 1000);
+}
+
+@interface IndoorBridgeTemplate : NSObject
+@property (nonatomic, strong) NSDictionary *dict;
+@property (nonatomic, strong) NSString *json;
+@property (nonatomic, strong) NSData *buffer;
+@end
+
+@implementation IndoorBridgeTemplate
+@end
+
+@implementation IndoorBridgeBenchmark {
+    NSMutableDictionary<NSString *, IndoorBridgeTemplate *> *_templates;
+    volatile BOOL _stopped;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        _templates = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+- (id)payloadForShape:(NSString *)shape encoding:(NSString *)encoding error:(NSString **)error
+{
+    IndoorBridgeTemplate *template = [self templateForShape:shape error:error];
+    if (template == nil || ![self checkEncoding:encoding error:error]) {
+        return nil;
+    }
+    return [self stamp:template encoding:encoding];
+}
+
+- (BOOL)streamShape:(NSString *)shape encoding:(NSString *)encoding rateHz:(NSInteger)rateHz count:(NSInteger)count send:(IndoorBridgeSend)send error:(NSString **)error
+{
+    if (rateHz <= 0 || rateHz > IndoorBridgeMaxRateHz) {
+        *error = [NSString stringWithFormat:@"Rate must be 1..%ld Hz", (long)IndoorBridgeMaxRateHz];
+        return NO;
+    }
+    if (count <= 0 || count > IndoorBridgeMaxEvents) {
+        *error = [NSString stringWithFormat:@"Count must be 1..%ld", (long)IndoorBridgeMaxEvents];
+        return NO;
+    }
+    IndoorBridgeTemplate *template = [self templateForShape:shape error:error];
+    if (template == nil || ![self checkEncoding:encoding error:error]) {
+        return NO;
+    }
+    uint64_t period = NSEC_PER_SEC / (uint64_t)rateHz;
+    _stopped = NO;
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+        uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        NSInteger sent = 0;
+        NSInteger late = 0;
+        while (sent < count && !self->_stopped) {
+            uint64_t due = start + (uint64_t)sent * period;
+            uint64_t now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+            if (due > now) {
+                struct timespec wait = { (time_t)((due - now) / NSEC_PER_SEC), (long)((due - now) % NSEC_PER_SEC) };
+                nanosleep(&wait, NULL);
+            } else if (sent > 0 && now - due > period) {
+                late++;
+            }
+            send([self stamp:template encoding:encoding], YES);
+            sent++;
+        }
+        double duration = (clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start) / 1e6;
+        send(@{ @"done": @YES, @"sent": @(sent), @"late": @(late), @"durationMs": @(duration) }, NO);
+    });
+    return YES;
+}
+
+- (void)stop
+{
+    _stopped = YES;
+}
+
+- (BOOL)checkEncoding:(NSString *)encoding error:(NSString **)error
+{
+    if ([IndoorBridgeEncodingDict isEqualToString:encoding] || [IndoorBridgeEncodingString isEqualToString:encoding]
+        || [IndoorBridgeEncodingBuffer isEqualToString:encoding]) {
+        return YES;
+    }
+    *error = [NSString stringWithFormat:@"Unknown encoding %@", encoding];
+    return NO;
+}
+
+- (id)stamp:(IndoorBridgeTemplate *)template encoding:(NSString *)encoding
+{
+    double now = nowMillis();
+    if ([IndoorBridgeEncodingDict isEqualToString:encoding]) {
+        // Shallow copy, the payload itself is shared
+        NSMutableDictionary *dict = [template.dict mutableCopy];
+        dict[@"sentAt"] = @(now);
+        return dict;
+    } else if ([IndoorBridgeEncodingString isEqualToString:encoding]) {
+        return [NSString stringWithFormat:@"{\"sentAt\":%.0f,%@", now, [template.json substringFromIndex:1]];
+    }
+    NSMutableData *buffer = [template.buffer mutableCopy];
+    putDouble(buffer.mutableBytes, now);
+    return buffer;
+}
+
+- (IndoorBridgeTemplate *)templateForShape:(NSString *)shape error:(NSString **)error
+{
+    @synchronized (self) {
+        IndoorBridgeTemplate *template = _templates[shape];
+        if (template != nil) {
+            return template;
+        }
+        srand48([shape hash]);
+        if ([IndoorBridgeShapePosition isEqualToString:shape]) {
+            template = [self buildPosition];
+        } else if ([IndoorBridgeShapeRoute isEqualToString:shape]) {
+            template = [self buildRoute];
+        } else if ([IndoorBridgeShapeCrowd isEqualToString:shape]) {
+            template = [self buildCrowd];
+        } else {
+            *error = [NSString stringWithFormat:@"Unknown shape %@", shape];
+            return nil;
+        }
+        NSData *json = [NSJSONSerialization dataWithJSONObject:template.dict options:0 error:nil];
+        template.json = [[NSString alloc] initWithData:json encoding:NSUTF8StringEncoding];
+        _templates[shape] = template;
+        return template;
+    }
+}
+
+/**
+ *  As the location delegate sends it; binary: sentAt, latitude, longitude,
+ *  altitude, accuracy, heading, velocity, timestamp as float64, floor as int32
+ */
+- (IndoorBridgeTemplate *)buildPosition
+{
+    double latitude = 60.16 + drand48() * 1e-3;
+    double longitude = 24.93 + drand48() * 1e-3;
+    double timestamp = nowMillis();
+    IndoorBridgeTemplate *template = [[IndoorBridgeTemplate alloc] init];
+    template.dict = @{
+        @"accuracy": @3.2,
+        @"altitude": @0.0,
+        @"heading": @271.5,
+        @"flr": @3,
+        @"latitude": @(latitude),
+        @"longitude": @(longitude),
+        @"region": @{ @"regionId": @"2a6ab3e0-8c4d-4b2b-9a4e-2f0b7a9d5c1e", @"timestamp": @(timestamp),
+                      @"regionType": @1, @"transitionType": @0 },
+        @"velocity": @1.1,
+        @"timestamp": @(timestamp)
+    };
+    NSMutableData *buffer = [NSMutableData dataWithLength:8 * 8 + 8];
+    uint8_t *bytes = buffer.mutableBytes;
+    double values[] = { 0, latitude, longitude, 0.0, 3.2, 271.5, 1.1, timestamp };
+    for (int i = 0; i < 8; i++) {
+        putDouble(bytes + i * 8, values[i]);
+    }
+    putInt32(bytes + 64, 3);
+    template.buffer = buffer;
+    return template;
+}
+
+/**
+ *  As computeRoute returns it; binary: sentAt followed by the
+ *  RouteBuffer.java layout
+ */
+- (IndoorBridgeTemplate *)buildRoute
+{
+    NSInteger legCount = IndoorBridgeRouteLegs;
+    uint32_t intBytes = (uint32_t)legCount * kRouteStride * 4;
+    uint32_t lengthsOffset = kRouteHeaderBytes + ((intBytes + 7) & ~7u);
+    NSMutableData *buffer = [NSMutableData dataWithLength:8 + lengthsOffset + legCount * 8];
+    uint8_t *bytes = (uint8_t *)buffer.mutableBytes + 8;
+    IndoorVenueFrame *frame = [IndoorVenueFrame frameForAnchor:CLLocationCoordinate2DMake(60.16, 24.93)];
+    putDouble(bytes, frame.origin.latitude);
+    putDouble(bytes + 8, frame.origin.longitude);
+    putDouble(bytes + 16, [frame millimetresPerDegreeLatitude]);
+    putDouble(bytes + 24, [frame millimetresPerDegreeLongitude]);
+    putInt32(bytes + 32, (int32_t)legCount);
+    putInt32(bytes + 36, kRouteVersion);
+
+    NSMutableArray *legs = [NSMutableArray arrayWithCapacity:legCount];
+    CLLocationCoordinate2D begin = CLLocationCoordinate2DMake(60.165, 24.935);
+    for (NSInteger i = 0; i < legCount; i++) {
+        CLLocationCoordinate2D end = CLLocationCoordinate2DMake(begin.latitude + (drand48() - 0.5) * 2e-5,
+                                                                begin.longitude + (drand48() - 0.5) * 4e-5);
+        int32_t floor = (int32_t)(1 + i * 3 / legCount);
+        double length = 1 + drand48();
+        [legs addObject:@{
+            @"begin": @{ @"latitude": @(begin.latitude), @"longitude": @(begin.longitude), @"floor": @(floor) },
+            @"end": @{ @"latitude": @(end.latitude), @"longitude": @(end.longitude), @"floor": @(floor) },
+            @"length": @(length),
+            @"direction": @(drand48() * 360),
+            @"edgeIndex": @(i)
+        }];
+        IndoorLocalPoint from = [frame toLocal:begin];
+        IndoorLocalPoint to = [frame toLocal:end];
+        int32_t values[kRouteStride] = { from.east, from.north, floor, to.east, to.north, floor, (int32_t)i };
+        for (int j = 0; j < kRouteStride; j++) {
+            putInt32(bytes + kRouteHeaderBytes + (i * kRouteStride + j) * 4, values[j]);
+        }
+        putDouble(bytes + lengthsOffset + i * 8, length);
+        begin = end;
+    }
+    IndoorBridgeTemplate *template = [[IndoorBridgeTemplate alloc] init];
+    template.dict = @{ @"route": legs };
+    template.buffer = buffer;
+    return template;
+}
+
+/**
+ *  Positions of other devices in the venue; binary: sentAt, int32 peer count
+ *  and padding, then per peer int32 id, int32 floor, float64 latitude and
+ *  longitude, float32 accuracy and padding
+ */
+- (IndoorBridgeTemplate *)buildCrowd
+{
+    NSInteger peerCount = IndoorBridgeCrowdPeers;
+    NSMutableData *buffer = [NSMutableData dataWithLength:16 + peerCount * 32];
+    uint8_t *bytes = buffer.mutableBytes;
+    putInt32(bytes + 8, (int32_t)peerCount);
+    NSMutableArray *peers = [NSMutableArray arrayWithCapacity:peerCount];
+    double timestamp = nowMillis();
+    for (NSInteger i = 0; i < peerCount; i++) {
+        double latitude = 60.16 + drand48() * 1e-3;
+        double longitude = 24.93 + drand48() * 2e-3;
+        int32_t floor = (int32_t)(lrand48() % 4);
+        float accuracy = 1 + (float)drand48() * 9;
+        [peers addObject:@{
+            @"id": [NSString stringWithFormat:@"peer-%ld", (long)i],
+            @"latitude": @(latitude),
+            @"longitude": @(longitude),
+            @"floor": @(floor),
+            @"accuracy": @(accuracy),
+            @"timestamp": @(timestamp)
+        }];
+        uint8_t *peer = bytes + 16 + i * 32;
+        putInt32(peer, (int32_t)i);
+        putInt32(peer + 4, floor);
+        putDouble(peer + 8, latitude);
+        putDouble(peer + 16, longitude);
+        putFloat(peer + 24, accuracy);
+    }
+    IndoorBridgeTemplate *template = [[IndoorBridgeTemplate alloc] init];
+    template.dict = @{ @"peers": peers };
+    template.buffer = buffer;
+    return template;
+}
+
+@end
@@ -0,0 +1,95 @@
+
+#import <Foundation/Foundation.h>
+#import <IndoorAtlas/IAFloorPlan.h>
+
+/**
+ *  Priority tiers, evicted from the coldest. Critical holds state needed by an
+ *  ongoing session and is never evicted.
+ */
+typedef NS_ENUM(NSInteger, IndoorCacheTier) {
+    IndoorCacheTierCritical = 0,
+    IndoorCacheTierWarm,
+    IndoorCacheTierCold
+};
+
+/**
+ *  Pressure levels, same values as Android's ComponentCallbacks2 trim levels
+ */
+typedef NS_ENUM(NSInteger, IndoorMemoryPressure) {
+    IndoorMemoryPressureModerate = 5,
+    IndoorMemoryPressureLow = 10,
+    IndoorMemoryPressureCritical = 15,
+    IndoorMemoryPressureUIHidden = 20,
+    IndoorMemoryPressureBackground = 40,
+    IndoorMemoryPressureBackgroundModerate = 60,
+    IndoorMemoryPressureComplete = 80
+};
+
+@protocol IndoorBudgetedCache <NSObject>
+
+- (NSString *)cacheName;
+- (IndoorCacheTier)cacheTier;
+
+/**
+ *  Estimated bytes held by the cache
+ */
+- (unsigned long long)residentBytes;
+
+/**
+ *  Frees at least the given number of bytes if possible, returns bytes freed
+ */
+- (unsigned long long)trim:(unsigned long long)bytes;
+
+@end
+
+/**
+ *  Central memory budget for the plugin's caches. Trims caches coldest tier
+ *  first when over budget or on memory warnings. Matches CacheBudget.java.
+ */
+@interface IndoorCacheBudget : NSObject
+
+@property (nonatomic, assign) unsigned long long budgetBytes;
+
+- (id)initWithBudget:(unsigned long long)budgetBytes;
+
+/**
+ *  Budget derived from the device's physical memory
+ */
++ (unsigned long long)defaultBudget;
+
+- (void)registerCache:(id<IndoorBudgetedCache>)cache;
+- (unsigned long long)residentBytes;
+
+/**
+ *  Trims caches until the total fits in the budget. Caches call this after inserting.
+ */
+- (void)enforce;
+
+- (void)onPressure:(IndoorMemoryPressure)level;
+
+/**
+ *  Resident bytes per cache and totals, for getCacheReport
+ */
+- (NSDictionary *)report;
+
+@end
+
+/**
+ *  Adapter for state owned elsewhere, e.g. wayfinding graphs
+ */
+@interface IndoorBlockCache : NSObject <IndoorBudgetedCache>
+
+- (id)initWithName:(NSString *)name tier:(IndoorCacheTier)tier residentBytes:(unsigned long long (^)(void))residentBytes trim:(unsigned long long (^)(unsigned long long bytes))trim;
+
+@end
+
+/**
+ *  Least recently used cache of fetched floor plans
+ */
+@interface IndoorFloorPlanCache : NSObject <IndoorBudgetedCache>
+
+- (id)initWithBudget:(IndoorCacheBudget *)budget;
+- (IAFloorPlan *)floorPlanWithId:(NSString *)floorplanId;
+- (void)addFloorPlan:(IAFloorPlan *)floorPlan;
+
+@end
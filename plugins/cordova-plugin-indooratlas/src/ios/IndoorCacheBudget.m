@@ -0,0 +1,260 @@
+
+#import "IndoorCacheBudget.h"
+#import <UIKit/UIKit.h>
+
+// Metadata only; the SDK does not hand out decoded images
+static const unsigned long long kFloorPlanEntryOverheadBytes = 512;
+
+@interface IndoorCacheBudget ()
+@property (nonatomic, strong) NSMutableArray<id<IndoorBudgetedCache>> *caches;
+@property (nonatomic, assign) unsigned long long evictedBytes;
+@property (nonatomic, assign) NSUInteger pressureEvents;
+@end
+
+@implementation IndoorCacheBudget
+
+- (id)initWithBudget:(unsigned long long)budgetBytes
+{
+    self = [super init];
+    if (self) {
+        _budgetBytes = budgetBytes;
+        _caches = [NSMutableArray arrayWithCapacity:4];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(didReceiveMemoryWarning:) name:UIApplicationDidReceiveMemoryWarningNotification object:nil];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+}
+
++ (unsigned long long)defaultBudget
+{
+    return [NSProcessInfo processInfo].physicalMemory / 256;
+}
+
+- (void)didReceiveMemoryWarning:(NSNotification *)notification
+{
+    [self onPressure:IndoorMemoryPressureCritical];
+}
+
+- (void)registerCache:(id<IndoorBudgetedCache>)cache
+{
+    @synchronized (self) {
+        [self.caches addObject:cache];
+    }
+}
+
+- (unsigned long long)residentBytes
+{
+    @synchronized (self) {
+        unsigned long long total = 0;
+        for (id<IndoorBudgetedCache> cache in self.caches) {
+            total += [cache residentBytes];
+        }
+        return total;
+    }
+}
+
+- (void)enforce
+{
+    @synchronized (self) {
+        unsigned long long resident = [self residentBytes];
+        if (resident > self.budgetBytes) {
+            [self evict:resident - self.budgetBytes downToTier:IndoorCacheTierWarm];
+        }
+    }
+}
+
+- (void)onPressure:(IndoorMemoryPressure)level
+{
+    @synchronized (self) {
+        self.pressureEvents++;
+        // Not ordered by severity, the background levels are milder than critical
+        if (level == IndoorMemoryPressureCritical || level >= IndoorMemoryPressureComplete) {
+            [self evict:ULLONG_MAX downToTier:IndoorCacheTierWarm];
+        } else if (level == IndoorMemoryPressureUIHidden) {
+            [self evict:ULLONG_MAX downToTier:IndoorCacheTierCold];
+        } else if (level >= IndoorMemoryPressureLow) {
+            [self evict:ULLONG_MAX downToTier:IndoorCacheTierCold];
+            [self evict:[self residentBytes] / 2 downToTier:IndoorCacheTierWarm];
+        } else if (level >= IndoorMemoryPressureModerate) {
+            [self evict:ULLONG_MAX downToTier:IndoorCacheTierCold];
+        }
+    }
+}
+
+- (NSDictionary *)report
+{
+    @synchronized (self) {
+        NSMutableArray *caches = [NSMutableArray arrayWithCapacity:[self.caches count]];
+        for (id<IndoorBudgetedCache> cache in self.caches) {
+            [caches addObject:@{@"name": [cache cacheName],
+                                @"tier": [NSNumber numberWithInteger:[cache cacheTier]],
+                                @"residentBytes": [NSNumber numberWithUnsignedLongLong:[cache residentBytes]]}];
+        }
+        NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:5];
+        [report setObject:[NSNumber numberWithUnsignedLongLong:self.budgetBytes] forKey:@"budgetBytes"];
+        [report setObject:[NSNumber numberWithUnsignedLongLong:[self residentBytes]] forKey:@"residentBytes"];
+        [report setObject:[NSNumber numberWithUnsignedLongLong:self.evictedBytes] forKey:@"evictedBytes"];
+        [report setObject:[NSNumber numberWithUnsignedInteger:self.pressureEvents] forKey:@"pressureEvents"];
+        [report setObject:caches forKey:@"caches"];
+        return report;
+    }
+}
+
+// Frees up to the given number of bytes from caches at minTier or colder, coldest tier first
+- (void)evict:(unsigned long long)bytes downToTier:(IndoorCacheTier)minTier
+{
+    unsigned long long remaining = bytes;
+    for (NSInteger tier = IndoorCacheTierCold; tier >= minTier && remaining > 0; tier--) {
+        for (id<IndoorBudgetedCache> cache in self.caches) {
+            if ([cache cacheTier] != tier || remaining == 0) {
+                continue;
+            }
+            unsigned long long freed = MIN([cache trim:remaining], remaining);
+            self.evictedBytes += freed;
+            remaining -= freed;
+        }
+    }
+}
+
+@end
+
+@interface IndoorBlockCache ()
+@property (nonatomic, copy) NSString *name;
+@property (nonatomic, assign) IndoorCacheTier tier;
+@property (nonatomic, copy) unsigned long long (^residentBytesBlock)(void);
+@property (nonatomic, copy) unsigned long long (^trimBlock)(unsigned long long bytes);
+@end
+
+@implementation IndoorBlockCache
+
+- (id)initWithName:(NSString *)name tier:(IndoorCacheTier)tier residentBytes:(unsigned long long (^)(void))residentBytes trim:(unsigned long long (^)(unsigned long long bytes))trim
+{
+    self = [super init];
+    if (self) {
+        _name = [name copy];
+        _tier = tier;
+        _residentBytesBlock = [residentBytes copy];
+        _trimBlock = [trim copy];
+    }
+    return self;
+}
+
+- (NSString *)cacheName
+{
+    return self.name;
+}
+
+- (IndoorCacheTier)cacheTier
+{
+    return self.tier;
+}
+
+- (unsigned long long)residentBytes
+{
+    return self.residentBytesBlock();
+}
+
+- (unsigned long long)trim:(unsigned long long)bytes
+{
+    return self.trimBlock != nil ? self.trimBlock(bytes) : 0;
+}
+
+@end
+
+@interface IndoorFloorPlanCache ()
+@property (nonatomic, weak) IndoorCacheBudget *budget;
+@property (nonatomic, strong) NSMutableDictionary<NSString *, IAFloorPlan *> *floorPlans;
+// Least recently used first
+@property (nonatomic, strong) NSMutableArray<NSString *> *order;
+@property (nonatomic, assign) unsigned long long bytes;
+@end
+
+@implementation IndoorFloorPlanCache
+
+- (id)initWithBudget:(IndoorCacheBudget *)budget
+{
+    self = [super init];
+    if (self) {
+        _budget = budget;
+        _floorPlans = [NSMutableDictionary dictionaryWithCapacity:8];
+        _order = [NSMutableArray arrayWithCapacity:8];
+    }
+    return self;
+}
+
++ (unsigned long long)sizeOf:(IAFloorPlan *)floorPlan
+{
+    NSUInteger chars = floorPlan.floorPlanId.length + floorPlan.name.length + floorPlan.imageUrl.absoluteString.length;
+    return kFloorPlanEntryOverheadBytes + 2 * chars;
+}
+
+- (IAFloorPlan *)floorPlanWithId:(NSString *)floorplanId
+{
+    if (floorplanId == nil) {
+        return nil;
+    }
+    @synchronized (self) {
+        IAFloorPlan *floorPlan = self.floorPlans[floorplanId];
+        if (floorPlan != nil) {
+            [self.order removeObject:floorplanId];
+            [self.order addObject:floorplanId];
+        }
+        return floorPlan;
+    }
+}
+
+- (void)addFloorPlan:(IAFloorPlan *)floorPlan
+{
+    if (floorPlan.floorPlanId == nil) {
+        return;
+    }
+    @synchronized (self) {
+        IAFloorPlan *previous = self.floorPlans[floorPlan.floorPlanId];
+        if (previous != nil) {
+            self.bytes -= [IndoorFloorPlanCache sizeOf:previous];
+            [self.order removeObject:floorPlan.floorPlanId];
+        }
+        self.floorPlans[floorPlan.floorPlanId] = floorPlan;
+        [self.order addObject:floorPlan.floorPlanId];
+        self.bytes += [IndoorFloorPlanCache sizeOf:floorPlan];
+    }
+    [self.budget enforce];
+}
+
+- (NSString *)cacheName
+{
+    return @"floorPlans";
+}
+
+- (IndoorCacheTier)cacheTier
+{
+    return IndoorCacheTierWarm;
+}
+
+- (unsigned long long)residentBytes
+{
+    @synchronized (self) {
+        return self.bytes;
+    }
+}
+
+- (unsigned long long)trim:(unsigned long long)bytes
+{
+    @synchronized (self) {
+        unsigned long long freed = 0;
+        while (freed < bytes && [self.order count] > 0) {
+            NSString *floorplanId = self.order[0];
+            freed += [IndoorFloorPlanCache sizeOf:self.floorPlans[floorplanId]];
+            [self.floorPlans removeObjectForKey:floorplanId];
+            [self.order removeObjectAtIndex:0];
+        }
+        self.bytes -= freed;
+        return freed;
+    }
+}
+
+@end
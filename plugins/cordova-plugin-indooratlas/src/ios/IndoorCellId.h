@@ -0,0 +1,80 @@
+
+#import <Foundation/Foundation.h>
+#import <IndoorAtlas/IAFloorPlan.h>
+#import "IndoorVenueFrame.h"
+
+/**
+ *  64-bit hierarchical cell id shared by every layer that buckets positions.
+ *
+ *  Layout, most significant bit first: 16 bits venue key, 8 bits floor level
+ *  (biased by 128), 40 bits quadtree position (Morton code, terminating 1 bit,
+ *  zero padding). Matches CellId.java on Android bit for bit.
+ */
+typedef uint64_t IndoorCellIdType;
+
+extern const int IndoorCellIdMaxLevel;
+extern const double IndoorCellIdRootExtentMeters;
+
+@interface IndoorCellId : NSObject
+
+/**
+ *  Stable 16-bit key for a venue id (FNV-1a over UTF-8, folded)
+ *
+ *  @param venueId
+ */
++ (uint16_t)venueKey:(NSString *)venueId;
+
+/**
+ *  Id of the cell at the given level containing (x, y), in frame metres
+ */
++ (IndoorCellIdType)cellIdWithVenue:(uint16_t)venueKey floor:(NSInteger)floor x:(double)x y:(double)y level:(int)level;
+
+/**
+ *  Integer variant for points already in an IndoorVenueFrame
+ */
++ (IndoorCellIdType)cellIdWithVenue:(uint16_t)venueKey floor:(NSInteger)floor localPoint:(IndoorLocalPoint)point level:(int)level;
+
+/**
+ *  Id of the cell containing the coordinate, using the floor plan's top-left corner as origin
+ */
++ (IndoorCellIdType)cellIdWithVenue:(uint16_t)venueKey floorPlan:(IAFloorPlan *)floorPlan coordinate:(CLLocationCoordinate2D)coords level:(int)level;
+
++ (uint16_t)venue:(IndoorCellIdType)cellId;
++ (NSInteger)floor:(IndoorCellIdType)cellId;
++ (int)level:(IndoorCellIdType)cellId;
++ (BOOL)isValid:(IndoorCellIdType)cellId;
++ (double)sizeMeters:(int)level;
+
+/**
+ *  Bounds of the cell in frame metres: minX, minY, maxX, maxY
+ */
++ (void)bounds:(IndoorCellIdType)cellId into:(double *)rect;
+
++ (IndoorCellIdType)parent:(IndoorCellIdType)cellId level:(int)level;
++ (IndoorCellIdType)child:(IndoorCellIdType)cellId index:(int)k;
++ (IndoorCellIdType)rangeMin:(IndoorCellIdType)cellId;
++ (IndoorCellIdType)rangeMax:(IndoorCellIdType)cellId;
++ (BOOL)cell:(IndoorCellIdType)cellId contains:(IndoorCellIdType)other;
+
+/**
+ *  Up to eight same-level neighbours inside the frame, as NSNumber (unsigned long long)
+ */
++ (NSArray<NSNumber *> *)neighbours:(IndoorCellIdType)cellId;
+
+/**
+ *  Covers a polygon (x0, y0, x1, y1, ... in frame metres) with cells no finer than maxLevel
+ */
++ (NSArray<NSNumber *> *)coverPolygon:(const double *)polygon count:(NSUInteger)vertexCount venue:(uint16_t)venueKey floor:(NSInteger)floor maxLevel:(int)maxLevel;
+
+/**
+ *  Even-odd point in polygon test
+ */
++ (BOOL)polygon:(const double *)polygon count:(NSUInteger)vertexCount containsX:(double)x y:(double)y;
+
+/**
+ *  Hex token used in JSON and other wire formats
+ */
++ (NSString *)toToken:(IndoorCellIdType)cellId;
++ (IndoorCellIdType)fromToken:(NSString *)token;
+
+@end
@@ -0,0 +1,348 @@
+
+#import "IndoorCellId.h"
+
+const int IndoorCellIdMaxLevel = 19;
+const double IndoorCellIdRootExtentMeters = 4096.0;
+
+#define POS_BITS 40
+#define FLOOR_SHIFT POS_BITS
+#define VENUE_SHIFT (POS_BITS + 8)
+#define POS_MASK ((1ULL << POS_BITS) - 1)
+#define FLOOR_BIAS 128
+#define MAX_LEVEL 19
+#define MAX_COORD ((1 << MAX_LEVEL) - 1)
+
+enum {
+    CELL_OUTSIDE = 0,
+    CELL_PARTIAL,
+    CELL_INSIDE
+};
+
+static uint64_t spread(uint32_t v)
+{
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | (x << 2)) & 0x3333333333333333ULL;
+    x = (x | (x << 1)) & 0x5555555555555555ULL;
+    return x;
+}
+
+static uint32_t deinterleave(uint64_t v)
+{
+    uint64_t x = v & 0x5555555555555555ULL;
+    x = (x | (x >> 1)) & 0x3333333333333333ULL;
+    x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | (x >> 4)) & 0x00ff00ff00ff00ffULL;
+    x = (x | (x >> 8)) & 0x0000ffff0000ffffULL;
+    x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+    return (uint32_t)x;
+}
+
+static uint64_t header(uint16_t venueKey, NSInteger floor)
+{
+    NSInteger biased = MAX(0, MIN(255, floor + FLOOR_BIAS));
+    return ((uint64_t)venueKey << VENUE_SHIFT) | ((uint64_t)biased << FLOOR_SHIFT);
+}
+
+static uint64_t lowestSetBit(uint64_t v)
+{
+    return v & (~v + 1);
+}
+
+static uint32_t toLeafCoordinate(double meters)
+{
+    double scaled = (meters + IndoorCellIdRootExtentMeters / 2.0) * ((1 << MAX_LEVEL) / IndoorCellIdRootExtentMeters);
+    if (scaled <= 0) {
+        return 0;
+    }
+    if (scaled >= MAX_COORD) {
+        return MAX_COORD;
+    }
+    return (uint32_t)scaled;
+}
+
+static uint32_t millimetresToLeafCoordinate(int32_t millimetres)
+{
+    // 2^MAX_LEVEL leaf cells over the root extent: 16 / 125 leaves per mm
+    int64_t scaled = ((int64_t)millimetres + 2048000LL) * 16LL / 125LL;
+    if (scaled <= 0) {
+        return 0;
+    }
+    if (scaled >= MAX_COORD) {
+        return MAX_COORD;
+    }
+    return (uint32_t)scaled;
+}
+
+static void checkLevel(int level)
+{
+    if (level < 0 || level > MAX_LEVEL) {
+        [NSException raise:NSInvalidArgumentException format:@"Cell level out of range: %d", level];
+    }
+}
+
+static IndoorCellIdType fromLeafCoordinates(uint16_t venueKey, NSInteger floor, uint32_t ix, uint32_t iy, int level)
+{
+    checkLevel(level);
+    int shift = MAX_LEVEL - level;
+    uint64_t morton = spread(ix >> shift) | (spread(iy >> shift) << 1);
+    uint64_t pos = ((morton << 1) | 1ULL) << (2 * shift);
+    return header(venueKey, floor) | pos;
+}
+
+static void cellCoordinates(IndoorCellIdType cellId, uint32_t *i, uint32_t *j)
+{
+    int level = [IndoorCellId level:cellId];
+    uint64_t morton = (cellId & POS_MASK) >> (2 * (MAX_LEVEL - level) + 1);
+    *i = deinterleave(morton);
+    *j = deinterleave(morton >> 1);
+}
+
+// Liang-Barsky clip of a segment against an axis aligned rectangle
+static BOOL segmentIntersectsRect(double x0, double y0, double x1, double y1, const double *rect)
+{
+    double dx = x1 - x0;
+    double dy = y1 - y0;
+    double p[4] = { -dx, dx, -dy, dy };
+    double q[4] = { x0 - rect[0], rect[2] - x0, y0 - rect[1], rect[3] - y0 };
+    double t0 = 0.0, t1 = 1.0;
+    for (int k = 0; k < 4; k++) {
+        if (p[k] == 0) {
+            if (q[k] < 0) {
+                return NO;
+            }
+        } else {
+            double t = q[k] / p[k];
+            if (p[k] < 0) {
+                if (t > t1) return NO;
+                if (t > t0) t0 = t;
+            } else {
+                if (t < t0) return NO;
+                if (t < t1) t1 = t;
+            }
+        }
+    }
+    return YES;
+}
+
+@implementation IndoorCellId
+
++ (uint16_t)venueKey:(NSString *)venueId
+{
+    if (venueId == nil) {
+        return 0;
+    }
+    uint32_t hash = 0x811c9dc5;
+    const char *bytes = [venueId UTF8String];
+    for (size_t i = 0; bytes[i] != '\0'; i++) {
+        hash ^= (uint8_t)bytes[i];
+        hash *= 0x01000193;
+    }
+    return (uint16_t)(((hash >> 16) ^ hash) & 0xffff);
+}
+
++ (IndoorCellIdType)cellIdWithVenue:(uint16_t)venueKey floor:(NSInteger)floor x:(double)x y:(double)y level:(int)level
+{
+    return fromLeafCoordinates(venueKey, floor, toLeafCoordinate(x), toLeafCoordinate(y), level);
+}
+
++ (IndoorCellIdType)cellIdWithVenue:(uint16_t)venueKey floor:(NSInteger)floor localPoint:(IndoorLocalPoint)point level:(int)level
+{
+    return fromLeafCoordinates(venueKey, floor, millimetresToLeafCoordinate(point.east), millimetresToLeafCoordinate(point.north), level);
+}
+
++ (IndoorCellIdType)cellIdWithVenue:(uint16_t)venueKey floorPlan:(IAFloorPlan *)floorPlan coordinate:(CLLocationCoordinate2D)coords level:(int)level
+{
+    CGPoint point = [floorPlan coordinateToPoint:coords];
+    double metersPerPixel = floorPlan.pixelToMeterConversion;
+    // Image y grows downwards, the frame's y grows northwards
+    return [self cellIdWithVenue:venueKey floor:floorPlan.floor.level x:point.x * metersPerPixel y:-point.y * metersPerPixel level:level];
+}
+
++ (uint16_t)venue:(IndoorCellIdType)cellId
+{
+    return (uint16_t)((cellId >> VENUE_SHIFT) & 0xffff);
+}
+
++ (NSInteger)floor:(IndoorCellIdType)cellId
+{
+    return (NSInteger)((cellId >> FLOOR_SHIFT) & 0xff) - FLOOR_BIAS;
+}
+
++ (int)level:(IndoorCellIdType)cellId
+{
+    uint64_t pos = cellId & POS_MASK;
+    if (pos == 0) {
+        return -1;
+    }
+    return MAX_LEVEL - (__builtin_ctzll(pos) >> 1);
+}
+
++ (BOOL)isValid:(IndoorCellIdType)cellId
+{
+    uint64_t pos = cellId & POS_MASK;
+    return pos != 0 && (__builtin_ctzll(pos) & 1) == 0 && (pos >> (2 * MAX_LEVEL + 1)) == 0;
+}
+
++ (double)sizeMeters:(int)level
+{
+    return IndoorCellIdRootExtentMeters / (1 << level);
+}
+
++ (void)bounds:(IndoorCellIdType)cellId into:(double *)rect
+{
+    uint32_t i, j;
+    cellCoordinates(cellId, &i, &j);
+    double size = [self sizeMeters:[self level:cellId]];
+    rect[0] = i * size - IndoorCellIdRootExtentMeters / 2.0;
+    rect[1] = j * size - IndoorCellIdRootExtentMeters / 2.0;
+    rect[2] = rect[0] + size;
+    rect[3] = rect[1] + size;
+}
+
++ (IndoorCellIdType)parent:(IndoorCellIdType)cellId level:(int)level
+{
+    if (level < 0 || level > [self level:cellId]) {
+        [NSException raise:NSInvalidArgumentException format:@"Invalid parent level: %d", level];
+    }
+    uint64_t lsb = 1ULL << (2 * (MAX_LEVEL - level));
+    uint64_t pos = ((cellId & POS_MASK) & (~lsb + 1)) | lsb;
+    return (cellId & ~POS_MASK) | pos;
+}
+
++ (IndoorCellIdType)child:(IndoorCellIdType)cellId index:(int)k
+{
+    if ([self level:cellId] >= MAX_LEVEL) {
+        [NSException raise:NSInvalidArgumentException format:@"Leaf cell has no children"];
+    }
+    uint64_t pos = cellId & POS_MASK;
+    uint64_t lsb = lowestSetBit(pos);
+    uint64_t childPos = pos - lsb + (2ULL * k + 1) * (lsb >> 2);
+    return (cellId & ~POS_MASK) | childPos;
+}
+
++ (IndoorCellIdType)rangeMin:(IndoorCellIdType)cellId
+{
+    return cellId - (lowestSetBit(cellId & POS_MASK) - 1);
+}
+
++ (IndoorCellIdType)rangeMax:(IndoorCellIdType)cellId
+{
+    return cellId + (lowestSetBit(cellId & POS_MASK) - 1);
+}
+
++ (BOOL)cell:(IndoorCellIdType)cellId contains:(IndoorCellIdType)other
+{
+    return other >= [self rangeMin:cellId] && other <= [self rangeMax:cellId];
+}
+
++ (NSArray<NSNumber *> *)neighbours:(IndoorCellIdType)cellId
+{
+    int level = [self level:cellId];
+    int shift = MAX_LEVEL - level;
+    int64_t limit = (1 << level) - 1;
+    uint32_t i, j;
+    cellCoordinates(cellId, &i, &j);
+
+    NSMutableArray<NSNumber *> *result = [NSMutableArray arrayWithCapacity:8];
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            if (dx == 0 && dy == 0) {
+                continue;
+            }
+            int64_t ni = (int64_t)i + dx;
+            int64_t nj = (int64_t)j + dy;
+            if (ni < 0 || nj < 0 || ni > limit || nj > limit) {
+                continue;
+            }
+            IndoorCellIdType n = fromLeafCoordinates([self venue:cellId], [self floor:cellId], (uint32_t)ni << shift, (uint32_t)nj << shift, level);
+            [result addObject:[NSNumber numberWithUnsignedLongLong:n]];
+        }
+    }
+    return result;
+}
+
++ (NSArray<NSNumber *> *)coverPolygon:(const double *)polygon count:(NSUInteger)vertexCount venue:(uint16_t)venueKey floor:(NSInteger)floor maxLevel:(int)maxLevel
+{
+    checkLevel(maxLevel);
+    if (vertexCount < 3) {
+        [NSException raise:NSInvalidArgumentException format:@"Polygon needs at least three vertices"];
+    }
+    NSMutableArray<NSNumber *> *cells = [NSMutableArray array];
+    IndoorCellIdType root = fromLeafCoordinates(venueKey, floor, 0, 0, 0);
+    [self coverCell:root polygon:polygon count:vertexCount maxLevel:maxLevel into:cells];
+    return cells;
+}
+
++ (void)coverCell:(IndoorCellIdType)cellId polygon:(const double *)polygon count:(NSUInteger)vertexCount maxLevel:(int)maxLevel into:(NSMutableArray<NSNumber *> *)cells
+{
+    double rect[4];
+    [self bounds:cellId into:rect];
+    int relation = [self relateRect:rect polygon:polygon count:vertexCount];
+    if (relation == CELL_OUTSIDE) {
+        return;
+    }
+    if (relation == CELL_INSIDE || [self level:cellId] == maxLevel) {
+        [cells addObject:[NSNumber numberWithUnsignedLongLong:cellId]];
+        return;
+    }
+    for (int k = 0; k < 4; k++) {
+        [self coverCell:[self child:cellId index:k] polygon:polygon count:vertexCount maxLevel:maxLevel into:cells];
+    }
+}
+
++ (int)relateRect:(const double *)rect polygon:(const double *)polygon count:(NSUInteger)n
+{
+    for (NSUInteger i = 0, j = n - 1; i < n; j = i++) {
+        if (segmentIntersectsRect(polygon[2 * j], polygon[2 * j + 1], polygon[2 * i], polygon[2 * i + 1], rect)) {
+            return CELL_PARTIAL;
+        }
+    }
+    double cx = (rect[0] + rect[2]) / 2.0;
+    double cy = (rect[1] + rect[3]) / 2.0;
+    return [self polygon:polygon count:n containsX:cx y:cy] ? CELL_INSIDE : CELL_OUTSIDE;
+}
+
++ (BOOL)polygon:(const double *)polygon count:(NSUInteger)n containsX:(double)x y:(double)y
+{
+    BOOL inside = NO;
+    for (NSUInteger i = 0, j = n - 1; i < n; j = i++) {
+        double xi = polygon[2 * i], yi = polygon[2 * i + 1];
+        double xj = polygon[2 * j], yj = polygon[2 * j + 1];
+        if (((yi > y) != (yj > y)) && (x < (xj - xi) * (y - yi) / (yj - yi) + xi)) {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
++ (NSString *)toToken:(IndoorCellIdType)cellId
+{
+    NSMutableString *token = [NSMutableString stringWithFormat:@"%016llx", cellId];
+    NSUInteger len = [token length];
+    while (len > 1 && [token characterAtIndex:len - 1] == '0') {
+        len--;
+    }
+    return [token substringToIndex:len];
+}
+
++ (IndoorCellIdType)fromToken:(NSString *)token
+{
+    if (token == nil || [token length] == 0 || [token length] > 16) {
+        return 0;
+    }
+    NSMutableString *padded = [NSMutableString stringWithString:token];
+    while ([padded length] < 16) {
+        [padded appendString:@"0"];
+    }
+    unsigned long long value = 0;
+    NSScanner *scanner = [NSScanner scannerWithString:padded];
+    if (![scanner scanHexLongLong:&value] || ![scanner isAtEnd]) {
+        return 0;
+    }
+    return value;
+}
+
+@end
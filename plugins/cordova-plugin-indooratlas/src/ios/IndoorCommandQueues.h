@@ -0,0 +1,44 @@
+
+#import <Foundation/Foundation.h>
+
+typedef NS_ENUM(NSInteger, IndoorCommandQueue) {
+    IndoorCommandQueuePositioning = 0,
+    IndoorCommandQueueResources,
+    IndoorCommandQueueRouting,
+    IndoorCommandQueueGeofence
+};
+
+/**
+ *  Serial queues on which plugin commands run, one per subsystem, so that
+ *  neither the WebView nor the main thread waits on plugin work.
+ *
+ *  SDK delegate callbacks of a subsystem are forwarded to its queue, so a
+ *  subsystem's state is confined to one queue and needs no locking. Only
+ *  IALocationManager and CLLocationManager calls go to the main thread, see
+ *  onMain:. Matches CommandQueues.java.
+ */
+@interface IndoorCommandQueues : NSObject
+
++ (IndoorCommandQueues *)sharedQueues;
+
+- (dispatch_queue_t)queue:(IndoorCommandQueue)queue;
+
+/**
+ *  Returns YES when called on the given queue
+ */
+- (BOOL)isCurrent:(IndoorCommandQueue)queue;
+
+- (void)dispatch:(IndoorCommandQueue)queue block:(dispatch_block_t)block;
+
+/**
+ *  Runs the block right away when already on the queue, otherwise dispatches it
+ */
+- (void)run:(IndoorCommandQueue)queue block:(dispatch_block_t)block;
+
+/**
+ *  Runs the block right away on the main thread, otherwise dispatches it to the main queue.
+ *  Blocks dispatched from one queue keep their order.
+ */
++ (void)onMain:(dispatch_block_t)block;
+
+@end
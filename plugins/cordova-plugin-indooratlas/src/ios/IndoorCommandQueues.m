@@ -0,0 +1,75 @@
+
+#import "IndoorCommandQueues.h"
+
+static const int kQueueCount = 4;
+static const char *const kQueueNames[kQueueCount] = {
+    "com.indooratlas.plugin.positioning",
+    "com.indooratlas.plugin.resources",
+    "com.indooratlas.plugin.routing",
+    "com.indooratlas.plugin.geofence"
+};
+// dispatch_get_specific only compares keys, the tag values identify the queue
+static char kQueueKey;
+static char kQueueTags[kQueueCount];
+
+@implementation IndoorCommandQueues {
+    dispatch_queue_t _queues[kQueueCount];
+}
+
++ (IndoorCommandQueues *)sharedQueues
+{
+    static IndoorCommandQueues *shared = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        shared = [[IndoorCommandQueues alloc] init];
+    });
+    return shared;
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self) {
+        dispatch_queue_attr_t attr = dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_USER_INITIATED, 0);
+        for (int i = 0; i < kQueueCount; i++) {
+            _queues[i] = dispatch_queue_create(kQueueNames[i], attr);
+            dispatch_queue_set_specific(_queues[i], &kQueueKey, &kQueueTags[i], NULL);
+        }
+    }
+    return self;
+}
+
+- (dispatch_queue_t)queue:(IndoorCommandQueue)queue
+{
+    return _queues[queue];
+}
+
+- (BOOL)isCurrent:(IndoorCommandQueue)queue
+{
+    return dispatch_get_specific(&kQueueKey) == &kQueueTags[queue];
+}
+
+- (void)dispatch:(IndoorCommandQueue)queue block:(dispatch_block_t)block
+{
+    dispatch_async(_queues[queue], block);
+}
+
+- (void)run:(IndoorCommandQueue)queue block:(dispatch_block_t)block
+{
+    if ([self isCurrent:queue]) {
+        block();
+    } else {
+        dispatch_async(_queues[queue], block);
+    }
+}
+
++ (void)onMain:(dispatch_block_t)block
+{
+    if ([NSThread isMainThread]) {
+        block();
+    } else {
+        dispatch_async(dispatch_get_main_queue(), block);
+    }
+}
+
+@end
@@ -0,0 +1,52 @@
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  Attributes thread CPU time, wall time and wakeups to the subsystem and
+ *  feature that used them, so that battery drain can be traced to positioning,
+ *  bridging, sensor streaming, routing, and so on.
+ *
+ *  Code to account is bracketed by IndoorCostEnter() and IndoorCostExit() on
+ *  the same thread. Attribution is exclusive: time spent in a nested bracket
+ *  is charged to the inner pair only. An outermost bracket counts as a wakeup
+ *  of its subsystem. Names must be static C strings. Matches CostAccounting.java.
+ */
+extern const char *const IndoorCostPositioning;
+extern const char *const IndoorCostBridge;
+extern const char *const IndoorCostSensors;
+extern const char *const IndoorCostRouting;
+extern const char *const IndoorCostTimers;
+extern const char *const IndoorCostScheduler;
+extern const char *const IndoorCostStorage;
+extern const char *const IndoorCostNetwork;
+
+void IndoorCostEnter(void);
+void IndoorCostExit(const char *subsystem, const char *feature);
+
+/**
+ *  CPU time of the calling thread
+ */
+uint64_t IndoorCostThreadCpuNanos(void);
+
+@interface IndoorCostAccounting : NSObject
+
+/**
+ *  Totals of a subsystem over all its features: cpu nanos, wall nanos, calls, wakeups
+ *
+ *  @param subsystem
+ *  @param totals array of four values
+ */
++ (void)totals:(const char *)subsystem into:(uint64_t *)totals;
+
+/**
+ *  Cost per subsystem and feature since the last reset, next to the CPU time
+ *  of the whole process over the same period
+ */
++ (NSDictionary *)report;
+
+/**
+ *  Starts a new accounting period
+ */
++ (void)reset;
+
+@end
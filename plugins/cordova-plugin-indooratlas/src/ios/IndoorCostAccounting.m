@@ -0,0 +1,213 @@
+
+#import "IndoorCostAccounting.h"
+#import <os/lock.h>
+#import <stdatomic.h>
+#import <sys/resource.h>
+#import <time.h>
+
+const char *const IndoorCostPositioning = "positioning";
+const char *const IndoorCostBridge = "bridge";
+const char *const IndoorCostSensors = "sensors";
+const char *const IndoorCostRouting = "routing";
+const char *const IndoorCostTimers = "timers";
+const char *const IndoorCostScheduler = "scheduler";
+const char *const IndoorCostStorage = "storage";
+const char *const IndoorCostNetwork = "network";
+
+enum {
+    kMaxDepth = 16,
+    kMaxAccounts = 256
+};
+
+typedef struct {
+    const char *subsystem;
+    const char *feature;
+    _Atomic uint64_t cpuNanos;
+    _Atomic uint64_t wallNanos;
+    _Atomic uint64_t calls;
+    _Atomic uint64_t wakeups;
+} IndoorCostAccount;
+
+// Open brackets of one thread
+typedef struct {
+    int depth;
+    uint64_t cpuStart[kMaxDepth];
+    uint64_t wallStart[kMaxDepth];
+    uint64_t childCpu[kMaxDepth];
+    uint64_t childWall[kMaxDepth];
+} IndoorCostFrames;
+
+// Accounts are only appended, so lookups need no lock; a slot is published
+// by the release store of the count after it has been filled in.
+static IndoorCostAccount accounts[kMaxAccounts];
+static _Atomic int accountCount;
+static os_unfair_lock insertLock = OS_UNFAIR_LOCK_INIT;
+static __thread IndoorCostFrames frames;
+static double resetWallMs;
+static double resetProcessCpuMs;
+
+uint64_t IndoorCostThreadCpuNanos(void)
+{
+    return clock_gettime_nsec_np(CLOCK_THREAD_CPUTIME_ID);
+}
+
+static double processCpuMs(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+static IndoorCostAccount *findAccount(const char *subsystem, const char *feature, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (accounts[i].subsystem == subsystem && accounts[i].feature == feature) {
+            return &accounts[i];
+        }
+    }
+    // The same name may live at several addresses
+    for (int i = 0; i < count; i++) {
+        if (strcmp(accounts[i].subsystem, subsystem) == 0 && strcmp(accounts[i].feature, feature) == 0) {
+            return &accounts[i];
+        }
+    }
+    return NULL;
+}
+
+static IndoorCostAccount *account(const char *subsystem, const char *feature)
+{
+    IndoorCostAccount *found = findAccount(subsystem, feature, atomic_load_explicit(&accountCount, memory_order_acquire));
+    if (found != NULL) {
+        return found;
+    }
+    os_unfair_lock_lock(&insertLock);
+    int count = atomic_load_explicit(&accountCount, memory_order_relaxed);
+    found = findAccount(subsystem, feature, count);
+    if (found == NULL && count < kMaxAccounts) {
+        found = &accounts[count];
+        found->subsystem = subsystem;
+        found->feature = feature;
+        atomic_store_explicit(&accountCount, count + 1, memory_order_release);
+    }
+    os_unfair_lock_unlock(&insertLock);
+    return found;
+}
+
+void IndoorCostEnter(void)
+{
+    int depth = frames.depth++;
+    if (depth < kMaxDepth) {
+        frames.cpuStart[depth] = IndoorCostThreadCpuNanos();
+        frames.wallStart[depth] = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        frames.childCpu[depth] = 0;
+        frames.childWall[depth] = 0;
+    }
+}
+
+void IndoorCostExit(const char *subsystem, const char *feature)
+{
+    if (frames.depth == 0) {
+        return;
+    }
+    int depth = --frames.depth;
+    if (depth >= kMaxDepth) {
+        return;
+    }
+    uint64_t cpu = IndoorCostThreadCpuNanos() - frames.cpuStart[depth];
+    uint64_t wall = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - frames.wallStart[depth];
+    if (depth > 0) {
+        frames.childCpu[depth - 1] += cpu;
+        frames.childWall[depth - 1] += wall;
+    }
+    IndoorCostAccount *target = account(subsystem, feature);
+    if (target == NULL) {
+        return;
+    }
+    atomic_fetch_add_explicit(&target->cpuNanos, cpu > frames.childCpu[depth] ? cpu - frames.childCpu[depth] : 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&target->wallNanos, wall > frames.childWall[depth] ? wall - frames.childWall[depth] : 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&target->calls, 1, memory_order_relaxed);
+    if (depth == 0) {
+        atomic_fetch_add_explicit(&target->wakeups, 1, memory_order_relaxed);
+    }
+}
+
+static NSMutableDictionary *entry(const uint64_t *values)
+{
+    NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:5];
+    [result setObject:@(values[0] / 1e6) forKey:@"cpuMs"];
+    [result setObject:@(values[1] / 1e6) forKey:@"wallMs"];
+    [result setObject:@(values[2]) forKey:@"calls"];
+    [result setObject:@(values[3]) forKey:@"wakeups"];
+    return result;
+}
+
+@implementation IndoorCostAccounting
+
++ (void)load
+{
+    resetWallMs = [[NSDate date] timeIntervalSince1970] * 1000.0;
+    resetProcessCpuMs = processCpuMs();
+}
+
++ (void)totals:(const char *)subsystem into:(uint64_t *)totals
+{
+    memset(totals, 0, 4 * sizeof(uint64_t));
+    int count = atomic_load_explicit(&accountCount, memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        IndoorCostAccount *a = &accounts[i];
+        if (strcmp(a->subsystem, subsystem) == 0) {
+            totals[0] += atomic_load_explicit(&a->cpuNanos, memory_order_relaxed);
+            totals[1] += atomic_load_explicit(&a->wallNanos, memory_order_relaxed);
+            totals[2] += atomic_load_explicit(&a->calls, memory_order_relaxed);
+            totals[3] += atomic_load_explicit(&a->wakeups, memory_order_relaxed);
+        }
+    }
+}
+
++ (NSDictionary *)report
+{
+    NSMutableDictionary *subsystems = [NSMutableDictionary dictionary];
+    uint64_t attributedCpu = 0;
+    int count = atomic_load_explicit(&accountCount, memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        IndoorCostAccount *a = &accounts[i];
+        uint64_t values[4] = {atomic_load_explicit(&a->cpuNanos, memory_order_relaxed),
+                              atomic_load_explicit(&a->wallNanos, memory_order_relaxed),
+                              atomic_load_explicit(&a->calls, memory_order_relaxed),
+                              atomic_load_explicit(&a->wakeups, memory_order_relaxed)};
+        if (values[2] == 0) {
+            continue;
+        }
+        NSString *name = [NSString stringWithUTF8String:a->subsystem];
+        if (subsystems[name] == nil) {
+            uint64_t totals[4];
+            [self totals:a->subsystem into:totals];
+            NSMutableDictionary *subsystem = entry(totals);
+            [subsystem setObject:[NSMutableDictionary dictionary] forKey:@"features"];
+            [subsystems setObject:subsystem forKey:name];
+            attributedCpu += totals[0];
+        }
+        [subsystems[name][@"features"] setObject:entry(values) forKey:[NSString stringWithUTF8String:a->feature]];
+    }
+    return @{@"periodMs": @([[NSDate date] timeIntervalSince1970] * 1000.0 - resetWallMs),
+             @"processCpuMs": @(processCpuMs() - resetProcessCpuMs),
+             @"attributedCpuMs": @(attributedCpu / 1e6),
+             @"subsystems": subsystems};
+}
+
++ (void)reset
+{
+    // Accounts stay allocated so that lookups never race with removal
+    int count = atomic_load_explicit(&accountCount, memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        atomic_store(&accounts[i].cpuNanos, 0);
+        atomic_store(&accounts[i].wallNanos, 0);
+        atomic_store(&accounts[i].calls, 0);
+        atomic_store(&accounts[i].wakeups, 0);
+    }
+    resetWallMs = [[NSDate date] timeIntervalSince1970] * 1000.0;
+    resetProcessCpuMs = processCpuMs();
+}
+
+@end
@@ -0,0 +1,46 @@
+
+#import <Foundation/Foundation.h>
+#import "IndoorTaskScheduler.h"
+
+@class IndoorDeferred;
+
+typedef IndoorDeferred *(^IndoorDeferredStep)(id value);
+typedef void (^IndoorDeferredCompletion)(id value, NSError *error);
+
+/**
+ *  Result of an asynchronous native operation, e.g. a resource fetch, routing
+ *  or a coordinate conversion, that further steps can be chained onto.
+ *
+ *  Steps run on IndoorTaskScheduler lanes once the previous result is
+ *  available, so a fetch, route and projection chain runs in one bridge call
+ *  without any thread waiting on the fetch. Matches Deferred.java.
+ */
+@interface IndoorDeferred : NSObject
+
+@property (nonatomic, readonly) IndoorCancellationToken *token;
+
+- (id)initWithToken:(IndoorCancellationToken *)token;
+
++ (IndoorDeferred *)resolved:(id)value;
++ (IndoorDeferred *)rejected:(NSError *)error;
+
+- (void)resolve:(id)value;
+- (void)reject:(NSError *)error;
+
+/**
+ *  Cancels the chain; pending steps are skipped and the completion gets an error
+ */
+- (void)cancel;
+
+/**
+ *  Chains a step on the given lane. The step returns the deferred for its own
+ *  result, [IndoorDeferred resolved:] when it completes synchronously.
+ */
+- (IndoorDeferred *)then:(IndoorTaskLane)lane step:(IndoorDeferredStep)step;
+
+/**
+ *  Called on the completing thread, right away if the result is already there
+ */
+- (void)whenComplete:(IndoorDeferredCompletion)completion;
+
+@end
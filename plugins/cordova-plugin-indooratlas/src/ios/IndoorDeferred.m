@@ -0,0 +1,132 @@
+
+#import "IndoorDeferred.h"
+
+static NSString *const IndoorDeferredErrorDomain = @"IndoorDeferred";
+
+@interface IndoorDeferred ()
+@property (nonatomic, strong) NSMutableArray<IndoorDeferredCompletion> *completions;
+@property (nonatomic, assign) BOOL done;
+@property (nonatomic, strong) id value;
+@property (nonatomic, strong) NSError *error;
+@end
+
+@implementation IndoorDeferred
+
+- (id)initWithToken:(IndoorCancellationToken *)token
+{
+    self = [super init];
+    if (self) {
+        _token = token != nil ? token : [[IndoorCancellationToken alloc] init];
+        _completions = [NSMutableArray arrayWithCapacity:1];
+    }
+    return self;
+}
+
++ (IndoorDeferred *)resolved:(id)value
+{
+    IndoorDeferred *deferred = [[IndoorDeferred alloc] initWithToken:nil];
+    [deferred resolve:value];
+    return deferred;
+}
+
++ (IndoorDeferred *)rejected:(NSError *)error
+{
+    IndoorDeferred *deferred = [[IndoorDeferred alloc] initWithToken:nil];
+    [deferred reject:error];
+    return deferred;
+}
+
++ (NSError *)cancellationError
+{
+    return [NSError errorWithDomain:IndoorDeferredErrorDomain code:NSUserCancelledError userInfo:@{NSLocalizedDescriptionKey: @"Cancelled"}];
+}
+
+- (void)cancel
+{
+    [self.token cancel];
+    [self reject:[IndoorDeferred cancellationError]];
+}
+
+- (void)resolve:(id)value
+{
+    [self completeWithValue:value error:nil];
+}
+
+- (void)reject:(NSError *)error
+{
+    [self completeWithValue:nil error:error];
+}
+
+- (void)whenComplete:(IndoorDeferredCompletion)completion
+{
+    @synchronized (self) {
+        if (!self.done) {
+            [self.completions addObject:[completion copy]];
+            return;
+        }
+    }
+    [self dispatch:completion];
+}
+
+- (IndoorDeferred *)then:(IndoorTaskLane)lane step:(IndoorDeferredStep)step
+{
+    IndoorDeferred *next = [[IndoorDeferred alloc] initWithToken:self.token];
+    IndoorCancellationToken *token = self.token;
+    [self whenComplete:^(id value, NSError *error) {
+        if (error != nil) {
+            [next reject:error];
+            return;
+        }
+        // Not submitted under the token: a cancelled step must still settle the chain
+        [[IndoorTaskScheduler sharedScheduler] submit:lane token:nil block:^{
+            if (token.isCancelled) {
+                [next reject:[IndoorDeferred cancellationError]];
+                return;
+            }
+            IndoorDeferred *result;
+            @try {
+                result = step(value);
+            } @catch (NSException *exception) {
+                [next reject:[NSError errorWithDomain:IndoorDeferredErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey: exception.reason ?: exception.name}]];
+                return;
+            }
+            [result whenComplete:^(id stepValue, NSError *stepError) {
+                if (stepError != nil) {
+                    [next reject:stepError];
+                } else {
+                    [next resolve:stepValue];
+                }
+            }];
+        }];
+    }];
+    return next;
+}
+
+- (void)completeWithValue:(id)value error:(NSError *)error
+{
+    NSArray<IndoorDeferredCompletion> *completions;
+    @synchronized (self) {
+        if (self.done) {
+            return;
+        }
+        self.done = YES;
+        self.value = value;
+        self.error = error;
+        completions = self.completions;
+        self.completions = nil;
+    }
+    for (IndoorDeferredCompletion completion in completions) {
+        [self dispatch:completion];
+    }
+}
+
+- (void)dispatch:(IndoorDeferredCompletion)completion
+{
+    if (self.error == nil && self.token.isCancelled) {
+        completion(nil, [IndoorDeferred cancellationError]);
+    } else {
+        completion(self.value, self.error);
+    }
+}
+
+@end
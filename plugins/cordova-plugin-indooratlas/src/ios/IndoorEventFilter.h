@@ -0,0 +1,81 @@
+
+#import <Foundation/Foundation.h>
+
+typedef NS_ENUM(NSInteger, IndoorEventFilterKind) {
+    IndoorEventFilterKindPosition = 0,
+    IndoorEventFilterKindRegion,
+    IndoorEventFilterKindHeading,
+    IndoorEventFilterKindAttitude
+};
+
+/**
+ *  Value slots of each kind of update, as in EventFilter.java
+ */
+enum {
+    IndoorFilterLatitude = 0,
+    IndoorFilterLongitude,
+    IndoorFilterAltitude,
+    IndoorFilterAccuracy,
+    IndoorFilterBearing,
+    IndoorFilterVelocity,
+    IndoorFilterFloor,
+    IndoorFilterPositionTime
+};
+enum {
+    IndoorFilterRegionType = 0,
+    IndoorFilterTransitionType,
+    IndoorFilterRegionTime
+};
+enum {
+    IndoorFilterRegionId = 0,
+    IndoorFilterTransition
+};
+enum {
+    IndoorFilterHeading = 0,
+    IndoorFilterHeadingTime
+};
+enum {
+    IndoorFilterX = 0,
+    IndoorFilterY,
+    IndoorFilterZ,
+    IndoorFilterW,
+    IndoorFilterAttitudeTime
+};
+
+/**
+ *  Fields of one update, filled in place by the plugin for every filter of its kind
+ */
+typedef struct {
+    double numbers[8];
+    __unsafe_unretained NSString *strings[2];
+} IndoorEventFilterValues;
+
+/**
+ *  A small declarative filter expression compiled into a predicate, so that
+ *  updates a subscription does not want never cross the bridge.
+ *
+ *  Expressions compare fields with numbers, strings or each other using
+ *  == != < <= > >= and combine the comparisons with &&, || and !, e.g.
+ *  "accuracy < 5 && floor == 3" or "change(heading) > 10". change(field) is
+ *  the difference to the last update the filter accepted, the shorter way
+ *  round for headings, and infinite before the first. One filter per
+ *  subscription, used on the queue it delivers on. Matches EventFilter.java.
+ */
+@interface IndoorEventFilter : NSObject
+
+@property (nonatomic, readonly) NSString *expression;
+@property (nonatomic, readonly) IndoorEventFilterKind kind;
+@property (nonatomic, readonly) uint64_t evaluated;
+@property (nonatomic, readonly) uint64_t accepted;
+
+/**
+ *  Compiles and type checks an expression, returns nil with the position of the error if it is invalid
+ */
++ (IndoorEventFilter *)compile:(NSString *)expression kind:(IndoorEventFilterKind)kind error:(NSError **)error;
+
+/**
+ *  Tests an update, and if it passes remembers its values for change()
+ */
+- (BOOL)matches:(const IndoorEventFilterValues *)values;
+
+@end
@@ -0,0 +1,438 @@
+
+#import "IndoorEventFilter.h"
+
+typedef BOOL (^IndoorFilterTest)(const IndoorEventFilterValues *values);
+typedef double (^IndoorFilterTerm)(const IndoorEventFilterValues *values);
+
+static const NSUInteger kMaxExpressionLength = 1024;
+
+typedef NS_ENUM(NSInteger, IndoorFilterOp) {
+    IndoorFilterOpEq,
+    IndoorFilterOpNe,
+    IndoorFilterOpLt,
+    IndoorFilterOpLe,
+    IndoorFilterOpGt,
+    IndoorFilterOpGe
+};
+
+// Field names per kind, indexed by slot
+static NSArray<NSString *> *IndoorFilterNumberFields(IndoorEventFilterKind kind)
+{
+    switch (kind) {
+        case IndoorEventFilterKindPosition:
+            return @[@"latitude", @"longitude", @"altitude", @"accuracy", @"heading", @"velocity", @"floor", @"timestamp"];
+        case IndoorEventFilterKindRegion:
+            return @[@"regionType", @"transitionType", @"timestamp"];
+        case IndoorEventFilterKindHeading:
+            return @[@"heading", @"timestamp"];
+        default:
+            return @[@"x", @"y", @"z", @"w", @"timestamp"];
+    }
+}
+
+static NSArray<NSString *> *IndoorFilterStringFields(IndoorEventFilterKind kind)
+{
+    return kind == IndoorEventFilterKindRegion ? @[@"regionId", @"transition"] : @[];
+}
+
+static NSDictionary<NSString *, NSString *> *IndoorFilterAliases(IndoorEventFilterKind kind)
+{
+    switch (kind) {
+        case IndoorEventFilterKindPosition:
+            return @{@"flr": @"floor", @"bearing": @"heading"};
+        case IndoorEventFilterKindHeading:
+            return @{@"trueHeading": @"heading"};
+        default:
+            return @{};
+    }
+}
+
+// Slot that is an angle in degrees, for change()
+static NSInteger IndoorFilterCircularSlot(IndoorEventFilterKind kind)
+{
+    switch (kind) {
+        case IndoorEventFilterKindPosition:
+            return IndoorFilterBearing;
+        case IndoorEventFilterKindHeading:
+            return IndoorFilterHeading;
+        default:
+            return -1;
+    }
+}
+
+@interface IndoorFilterChange : NSObject {
+@public
+    NSUInteger _slot;
+    BOOL _circular;
+    double _last;
+}
+@end
+
+@implementation IndoorFilterChange
+@end
+
+@interface IndoorEventFilter ()
+@property (nonatomic, strong) NSString *expression;
+@property (nonatomic, assign) IndoorEventFilterKind kind;
+@property (nonatomic, assign) uint64_t evaluated;
+@property (nonatomic, assign) uint64_t accepted;
+@end
+
+@interface IndoorFilterParser : NSObject {
+@public
+    NSString *_text;
+    IndoorEventFilterKind _kind;
+    NSUInteger _pos;
+    NSMutableArray<IndoorFilterChange *> *_changes;
+    NSString *_error;
+    // Result of parseOperand: a number, a string literal or a string field
+    IndoorFilterTerm _term;
+    NSString *_literal;
+    NSInteger _stringSlot;
+}
+@end
+
+@implementation IndoorFilterParser
+
+- (void)fail:(NSString *)message
+{
+    if (_error == nil) {
+        _error = [NSString stringWithFormat:@"%@ at position %lu in filter '%@'", message, (unsigned long)_pos, _text];
+    }
+}
+
+- (void)skipSpace
+{
+    while (_pos < _text.length && [[NSCharacterSet whitespaceAndNewlineCharacterSet] characterIsMember:[_text characterAtIndex:_pos]]) {
+        _pos++;
+    }
+}
+
+- (BOOL)startsWith:(NSString *)token
+{
+    return _pos + token.length <= _text.length && [[_text substringWithRange:NSMakeRange(_pos, token.length)] isEqualToString:token];
+}
+
+- (BOOL)accept:(NSString *)token
+{
+    [self skipSpace];
+    if ([self startsWith:token]) {
+        _pos += token.length;
+        return YES;
+    }
+    return NO;
+}
+
+- (IndoorFilterTest)parseOr
+{
+    IndoorFilterTest node = [self parseAnd];
+    while (node != nil && [self accept:@"||"]) {
+        IndoorFilterTest left = node;
+        IndoorFilterTest right = [self parseAnd];
+        if (right == nil) {
+            return nil;
+        }
+        node = ^BOOL(const IndoorEventFilterValues *values) {
+            return left(values) || right(values);
+        };
+    }
+    return node;
+}
+
+- (IndoorFilterTest)parseAnd
+{
+    IndoorFilterTest node = [self parseUnary];
+    while (node != nil && [self accept:@"&&"]) {
+        IndoorFilterTest left = node;
+        IndoorFilterTest right = [self parseUnary];
+        if (right == nil) {
+            return nil;
+        }
+        node = ^BOOL(const IndoorEventFilterValues *values) {
+            return left(values) && right(values);
+        };
+    }
+    return node;
+}
+
+- (IndoorFilterTest)parseUnary
+{
+    [self skipSpace];
+    if ([self startsWith:@"!"] && ![self startsWith:@"!="]) {
+        _pos++;
+        IndoorFilterTest operand = [self parseUnary];
+        if (operand == nil) {
+            return nil;
+        }
+        return ^BOOL(const IndoorEventFilterValues *values) {
+            return !operand(values);
+        };
+    }
+    if ([self accept:@"("]) {
+        IndoorFilterTest node = [self parseOr];
+        if (node != nil && ![self accept:@")"]) {
+            [self fail:@"Expected ')'"];
+            return nil;
+        }
+        return node;
+    }
+    return [self parseComparison];
+}
+
+- (IndoorFilterTest)parseComparison
+{
+    NSUInteger start = _pos;
+    if (![self parseOperand]) {
+        return nil;
+    }
+    IndoorFilterTerm leftTerm = _term;
+    NSString *leftLiteral = _literal;
+    NSInteger leftSlot = _stringSlot;
+    [self skipSpace];
+    static NSString *const operators[] = { @"==", @"!=", @"<=", @">=", @"<", @">" };
+    static const IndoorFilterOp codes[] = { IndoorFilterOpEq, IndoorFilterOpNe, IndoorFilterOpLe, IndoorFilterOpGe, IndoorFilterOpLt, IndoorFilterOpGt };
+    NSInteger op = -1;
+    for (int i = 0; i < 6; i++) {
+        if ([self startsWith:operators[i]]) {
+            _pos += operators[i].length;
+            op = codes[i];
+            break;
+        }
+    }
+    if (op < 0) {
+        [self fail:@"Expected a comparison"];
+        return nil;
+    }
+    if (![self parseOperand]) {
+        return nil;
+    }
+    IndoorFilterTerm rightTerm = _term;
+    if (leftTerm != nil && rightTerm != nil) {
+        switch ((IndoorFilterOp)op) {
+            case IndoorFilterOpEq:
+                return ^BOOL(const IndoorEventFilterValues *values) { return leftTerm(values) == rightTerm(values); };
+            case IndoorFilterOpNe:
+                return ^BOOL(const IndoorEventFilterValues *values) { return leftTerm(values) != rightTerm(values); };
+            case IndoorFilterOpLt:
+                return ^BOOL(const IndoorEventFilterValues *values) { return leftTerm(values) < rightTerm(values); };
+            case IndoorFilterOpLe:
+                return ^BOOL(const IndoorEventFilterValues *values) { return leftTerm(values) <= rightTerm(values); };
+            case IndoorFilterOpGt:
+                return ^BOOL(const IndoorEventFilterValues *values) { return leftTerm(values) > rightTerm(values); };
+            case IndoorFilterOpGe:
+                return ^BOOL(const IndoorEventFilterValues *values) { return leftTerm(values) >= rightTerm(values); };
+        }
+    }
+    _pos = start;
+    if (leftTerm != nil || rightTerm != nil) {
+        [self fail:@"Cannot compare a number with a string"];
+        return nil;
+    }
+    if (op != IndoorFilterOpEq && op != IndoorFilterOpNe) {
+        [self fail:@"Strings can only be compared with == and !="];
+        return nil;
+    }
+    if (leftLiteral != nil && _literal != nil) {
+        [self fail:@"Comparison of two constants"];
+        return nil;
+    }
+    BOOL equal = op == IndoorFilterOpEq;
+    NSInteger slot = leftLiteral != nil ? _stringSlot : leftSlot;
+    NSString *literal = leftLiteral != nil ? leftLiteral : _literal;
+    NSInteger otherSlot = _stringSlot;
+    return ^BOOL(const IndoorEventFilterValues *values) {
+        NSString *value = values->strings[slot];
+        NSString *other = literal != nil ? literal : values->strings[otherSlot];
+        BOOL same = value == nil ? other == nil : [value isEqualToString:other];
+        return same == equal;
+    };
+}
+
+- (BOOL)parseOperand
+{
+    _term = nil;
+    _literal = nil;
+    _stringSlot = -1;
+    [self skipSpace];
+    if (_pos >= _text.length) {
+        [self fail:@"Unexpected end of filter"];
+        return NO;
+    }
+    unichar c = [_text characterAtIndex:_pos];
+    if (c == '\'' || c == '"') {
+        NSRange end = [_text rangeOfString:[NSString stringWithCharacters:&c length:1] options:0
+                                     range:NSMakeRange(_pos + 1, _text.length - _pos - 1)];
+        if (end.location == NSNotFound) {
+            [self fail:@"Unterminated string"];
+            return NO;
+        }
+        _literal = [_text substringWithRange:NSMakeRange(_pos + 1, end.location - _pos - 1)];
+        _pos = end.location + 1;
+        return YES;
+    }
+    if (c == '-' || c == '.' || (c >= '0' && c <= '9')) {
+        NSUInteger start = _pos;
+        _pos++;
+        while (_pos < _text.length) {
+            unichar d = [_text characterAtIndex:_pos];
+            unichar previous = [_text characterAtIndex:_pos - 1];
+            BOOL exponentSign = (d == '-' || d == '+') && (previous == 'e' || previous == 'E');
+            if (!(d >= '0' && d <= '9') && d != '.' && d != 'e' && d != 'E' && !exponentSign) {
+                break;
+            }
+            _pos++;
+        }
+        NSScanner *scanner = [NSScanner scannerWithString:[_text substringWithRange:NSMakeRange(start, _pos - start)]];
+        double value;
+        if (![scanner scanDouble:&value] || !scanner.isAtEnd) {
+            _pos = start;
+            [self fail:@"Invalid number"];
+            return NO;
+        }
+        _term = ^double(const IndoorEventFilterValues *values) {
+            return value;
+        };
+        return YES;
+    }
+    NSString *name = [self parseIdentifier];
+    if (name == nil) {
+        return NO;
+    }
+    if ([name isEqualToString:@"change"] && [self accept:@"("]) {
+        [self skipSpace];
+        NSString *field = [self parseIdentifier];
+        NSInteger slot = field != nil ? [self numberSlot:field] : -1;
+        if (slot < 0) {
+            return NO;
+        }
+        if (![self accept:@")"]) {
+            [self fail:@"Expected ')'"];
+            return NO;
+        }
+        IndoorFilterChange *change = [[IndoorFilterChange alloc] init];
+        change->_slot = slot;
+        change->_circular = slot == IndoorFilterCircularSlot(_kind);
+        change->_last = NAN;
+        [_changes addObject:change];
+        _term = ^double(const IndoorEventFilterValues *values) {
+            if (isnan(change->_last)) {
+                return INFINITY;
+            }
+            double delta = fabs(values->numbers[change->_slot] - change->_last);
+            if (change->_circular) {
+                delta = fmod(delta, 360);
+                if (delta > 180) {
+                    delta = 360 - delta;
+                }
+            }
+            return delta;
+        };
+        return YES;
+    }
+    NSUInteger stringSlot = [IndoorFilterStringFields(_kind) indexOfObject:name];
+    if (stringSlot != NSNotFound) {
+        _stringSlot = stringSlot;
+        return YES;
+    }
+    NSInteger slot = [self numberSlot:name];
+    if (slot < 0) {
+        return NO;
+    }
+    _term = ^double(const IndoorEventFilterValues *values) {
+        return values->numbers[slot];
+    };
+    return YES;
+}
+
+- (NSString *)parseIdentifier
+{
+    NSUInteger start = _pos;
+    while (_pos < _text.length) {
+        unichar c = [_text characterAtIndex:_pos];
+        if (![[NSCharacterSet alphanumericCharacterSet] characterIsMember:c] && c != '_') {
+            break;
+        }
+        _pos++;
+    }
+    if (start == _pos) {
+        [self fail:@"Expected a field, number or string"];
+        return nil;
+    }
+    return [_text substringWithRange:NSMakeRange(start, _pos - start)];
+}
+
+- (NSInteger)numberSlot:(NSString *)name
+{
+    NSUInteger length = name.length;
+    NSString *alias = IndoorFilterAliases(_kind)[name];
+    NSUInteger slot = [IndoorFilterNumberFields(_kind) indexOfObject:alias ?: name];
+    if (slot == NSNotFound) {
+        _pos -= length;
+        [self fail:[NSString stringWithFormat:@"Unknown numeric field '%@'", name]];
+        return -1;
+    }
+    return slot;
+}
+
+@end
+
+@implementation IndoorEventFilter {
+    IndoorFilterTest _root;
+    NSArray<IndoorFilterChange *> *_changes;
+}
+
++ (NSError *)errorWithMessage:(NSString *)message
+{
+    return [NSError errorWithDomain:@"IndoorEventFilter" code:0 userInfo:@{NSLocalizedDescriptionKey: message}];
+}
+
++ (IndoorEventFilter *)compile:(NSString *)expression kind:(IndoorEventFilterKind)kind error:(NSError **)error
+{
+    NSString *message = nil;
+    if (expression.length == 0 || [expression stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]].length == 0) {
+        message = @"Empty filter expression";
+    } else if (expression.length > kMaxExpressionLength) {
+        message = [NSString stringWithFormat:@"Filter expression longer than %lu characters", (unsigned long)kMaxExpressionLength];
+    }
+    IndoorFilterParser *parser = nil;
+    IndoorFilterTest root = nil;
+    if (message == nil) {
+        parser = [[IndoorFilterParser alloc] init];
+        parser->_text = expression;
+        parser->_kind = kind;
+        parser->_changes = [NSMutableArray array];
+        root = [parser parseOr];
+        [parser skipSpace];
+        if (root != nil && parser->_pos < expression.length) {
+            [parser fail:[NSString stringWithFormat:@"Unexpected '%C'", [expression characterAtIndex:parser->_pos]]];
+        }
+        message = parser->_error;
+    }
+    if (message != nil) {
+        if (error) {
+            *error = [self errorWithMessage:message];
+        }
+        return nil;
+    }
+    IndoorEventFilter *filter = [[IndoorEventFilter alloc] init];
+    filter.expression = expression;
+    filter.kind = kind;
+    filter->_root = root;
+    filter->_changes = [parser->_changes copy];
+    return filter;
+}
+
+- (BOOL)matches:(const IndoorEventFilterValues *)values
+{
+    _evaluated++;
+    if (!_root(values)) {
+        return NO;
+    }
+    for (IndoorFilterChange *change in _changes) {
+        change->_last = values->numbers[change->_slot];
+    }
+    _accepted++;
+    return YES;
+}
+
+@end
@@ -0,0 +1,62 @@
+
+#import <Foundation/Foundation.h>
+
+extern const uint64_t IndoorEventQueueDefaultMaxBytes;
+extern const uint32_t IndoorEventQueueDefaultSegmentBytes;
+extern const NSUInteger IndoorEventQueueDefaultBatch;
+
+/**
+ *  Append-only on-disk queue for events produced while JavaScript cannot take
+ *  them: region transitions nobody is watching, and the triggers and occupancy
+ *  batches of the background processor.
+ *
+ *  Events are records in segment files named after the offset of their first
+ *  record: a 16 byte big-endian header (payload length, CRC32 of offset and
+ *  payload, offset) and the event as UTF-8 JSON, written with one write call.
+ *  Appends are synced in groups, at most 50 ms or 64 records apart. On open
+ *  the newest segment is truncated after its last valid record. Past the byte
+ *  bound the oldest segments are deleted, read or not. Each consumer reads the
+ *  events after its own acknowledged offset in batches; its first read
+ *  registers it, and segments every registered consumer has acknowledged are
+ *  deleted. Thread safe. Matches EventQueue.java
+ *  record for record.
+ */
+@interface IndoorEventQueue : NSObject
+
+/**
+ *  Opens the queue in a directory, recovering the events already there
+ *
+ *  @param path directory, created if missing
+ *  @param maxBytes bound of the total size of the segments
+ *  @param segmentBytes size at which a new segment is started
+ */
+- (instancetype)initWithDirectory:(NSString *)path maxBytes:(uint64_t)maxBytes segmentBytes:(uint32_t)segmentBytes error:(NSError **)error;
+
+/**
+ *  Appends an event, returns its offset or -1 on failure
+ */
+- (int64_t)append:(NSDictionary *)event error:(NSError **)error;
+
+/**
+ *  Makes every appended event durable, returns NO if the sync failed
+ */
+- (BOOL)sync;
+
+/**
+ *  Next batch of a consumer: { events, lastOffset, pending, skipped }, each event with its "offset"
+ */
+- (NSDictionary *)read:(NSString *)consumer maxEvents:(NSUInteger)maxEvents;
+
+/**
+ *  Acknowledges every event up to and including an offset for a consumer
+ */
+- (BOOL)ack:(NSString *)consumer offset:(int64_t)offset error:(NSError **)error;
+
+- (NSDictionary *)stats;
+
+/**
+ *  Syncs and closes the active segment. Appending afterwards opens a new one.
+ */
+- (void)close;
+
+@end
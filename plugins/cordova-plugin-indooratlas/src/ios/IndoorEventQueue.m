@@ -0,0 +1,490 @@
+
+#import "IndoorEventQueue.h"
+#import "IndoorTimingWheel.h"
+#import "IndoorTaskScheduler.h"
+#import "IndoorCostAccounting.h"
+#import <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+const uint64_t IndoorEventQueueDefaultMaxBytes = 4 * 1024 * 1024;
+const uint32_t IndoorEventQueueDefaultSegmentBytes = 256 * 1024;
+const NSUInteger IndoorEventQueueDefaultBatch = 100;
+
+static const int64_t kGroupCommitMs = 50;
+static const NSUInteger kGroupCommitRecords = 64;
+static const uint32_t kHeaderBytes = 16;
+static const uint32_t kMaxRecordBytes = 256 * 1024;
+static NSString *const kSegmentSuffix = @".log";
+static NSString *const kOffsetsFile = @"offsets.json";
+
+@interface IndoorEventSegment : NSObject {
+@public
+    int64_t _firstOffset;
+    int64_t _nextOffset;
+    uint64_t _bytes;
+    NSString *_path;
+}
+@end
+
+@implementation IndoorEventSegment
+@end
+
+/**
+ *  CRC32 over the big-endian offset and the payload, as EventQueue.java computes it
+ */
+static uint32_t IndoorEventChecksum(int64_t offset, const uint8_t *payload, uint32_t size)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (uint8_t)((uint64_t)offset >> (56 - 8 * i));
+    }
+    uLong crc = crc32(0L, bytes, 8);
+    return (uint32_t)crc32(crc, payload, size);
+}
+
+static void IndoorPutUInt32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t IndoorGetUInt32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+@implementation IndoorEventQueue {
+    NSString *_dir;
+    uint64_t _maxBytes;
+    uint32_t _segmentBytes;
+    NSMutableArray<IndoorEventSegment *> *_segments;
+    NSMutableDictionary<NSString *, NSNumber *> *_acked;
+    IndoorEventSegment *_active;
+    int _fd;
+    int64_t _nextOffset;
+    uint64_t _totalBytes;
+    NSUInteger _unsynced;
+    IndoorTimeout *_commit;
+
+    uint64_t _appended;
+    uint64_t _syncs;
+    uint64_t _dropped;
+    uint64_t _truncatedBytes;
+}
+
+- (instancetype)initWithDirectory:(NSString *)path maxBytes:(uint64_t)maxBytes segmentBytes:(uint32_t)segmentBytes error:(NSError **)error
+{
+    self = [super init];
+    if (self) {
+        _dir = path;
+        _maxBytes = maxBytes;
+        _segmentBytes = segmentBytes;
+        _segments = [NSMutableArray array];
+        _acked = [NSMutableDictionary dictionary];
+        _fd = -1;
+        if (![[NSFileManager defaultManager] createDirectoryAtPath:path withIntermediateDirectories:YES attributes:nil error:error]) {
+            return nil;
+        }
+        [self loadOffsets];
+        if (![self recover:error]) {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (_fd >= 0) {
+        fsync(_fd);
+        close(_fd);
+    }
+}
+
+- (int64_t)append:(NSDictionary *)event error:(NSError **)error
+{
+    NSData *payload = [NSJSONSerialization dataWithJSONObject:event options:0 error:error];
+    if (payload == nil) {
+        return -1;
+    }
+    if (payload.length > kMaxRecordBytes) {
+        if (error) {
+            *error = [NSError errorWithDomain:@"IndoorEventQueue" code:0 userInfo:@{NSLocalizedDescriptionKey:
+                [NSString stringWithFormat:@"Event of %lu bytes is too large", (unsigned long)payload.length]}];
+        }
+        return -1;
+    }
+    uint32_t size = kHeaderBytes + (uint32_t)payload.length;
+    @synchronized (self) {
+        if (_active == nil || (_active->_bytes > 0 && _active->_bytes + size > _segmentBytes)) {
+            if (![self roll:error]) {
+                return -1;
+            }
+        }
+        int64_t offset = _nextOffset;
+        NSMutableData *record = [NSMutableData dataWithLength:kHeaderBytes];
+        uint8_t *header = record.mutableBytes;
+        IndoorPutUInt32(header, (uint32_t)payload.length);
+        IndoorPutUInt32(header + 4, IndoorEventChecksum(offset, payload.bytes, (uint32_t)payload.length));
+        IndoorPutUInt32(header + 8, (uint32_t)((uint64_t)offset >> 32));
+        IndoorPutUInt32(header + 12, (uint32_t)offset);
+        [record appendData:payload];
+        ssize_t written = write(_fd, record.bytes, record.length);
+        if (written != (ssize_t)record.length) {
+            // Cut off whatever part of the record made it, so later appends stay readable
+            int code = written < 0 ? errno : EIO;
+            ftruncate(_fd, (off_t)_active->_bytes);
+            if (error) {
+                *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:nil];
+            }
+            return -1;
+        }
+        _active->_bytes += size;
+        _active->_nextOffset = ++_nextOffset;
+        _totalBytes += size;
+        _appended++;
+        if (++_unsynced >= kGroupCommitRecords) {
+            [self sync];
+        } else if (_commit == nil) {
+            __weak IndoorEventQueue *weakSelf = self;
+            _commit = [[IndoorTimingWheel sharedWheel] schedule:kGroupCommitMs block:^{
+                [[IndoorTaskScheduler sharedScheduler] submit:IndoorTaskLaneBackground subsystem:IndoorCostStorage block:^{
+                    [weakSelf sync];
+                }];
+            }];
+        }
+        [self enforceBound];
+        return offset;
+    }
+}
+
+- (BOOL)sync
+{
+    @synchronized (self) {
+        [_commit cancel];
+        _commit = nil;
+        if (_unsynced == 0 || _fd < 0) {
+            return YES;
+        }
+        if (fsync(_fd) != 0) {
+            NSLog(@"IndoorEventQueue: sync failed: %s", strerror(errno));
+            return NO;
+        }
+        _unsynced = 0;
+        _syncs++;
+        return YES;
+    }
+}
+
+- (NSDictionary *)read:(NSString *)consumer maxEvents:(NSUInteger)maxEvents
+{
+    @synchronized (self) {
+        if (_acked[consumer] == nil) {
+            // Holds back compaction until the consumer acknowledges what it reads
+            _acked[consumer] = @(-1);
+            NSError *error = nil;
+            if (![self saveOffsets:&error]) {
+                NSLog(@"IndoorEventQueue: cannot save offsets: %@", error);
+            }
+        }
+        int64_t acked = [self ackedOffset:consumer];
+        int64_t first = [self firstOffset];
+        int64_t from = MAX(acked + 1, first);
+        NSMutableArray *events = [NSMutableArray array];
+        for (IndoorEventSegment *segment in _segments) {
+            if (events.count >= maxEvents) {
+                break;
+            }
+            if (segment->_nextOffset <= from && segment != _active) {
+                continue;
+            }
+            // A corrupted record ends its segment, reading goes on with the next one
+            [self walk:segment from:from into:events max:maxEvents];
+        }
+        int64_t last = events.count > 0 ? [events.lastObject[@"offset"] longLongValue] : from - 1;
+        return @{
+            @"consumer": consumer,
+            @"events": events,
+            @"lastOffset": @(last),
+            @"pending": @(MAX(0, _nextOffset - 1 - last)),
+            // Events dropped by the size bound before the consumer got to them
+            @"skipped": @(MAX(0, first - acked - 1))
+        };
+    }
+}
+
+- (BOOL)ack:(NSString *)consumer offset:(int64_t)offset error:(NSError **)error
+{
+    @synchronized (self) {
+        offset = MIN(offset, _nextOffset - 1);
+        if (offset <= [self ackedOffset:consumer]) {
+            return YES;
+        }
+        _acked[consumer] = @(offset);
+        if (![self saveOffsets:error]) {
+            return NO;
+        }
+        [self compact];
+        return YES;
+    }
+}
+
+- (NSDictionary *)stats
+{
+    @synchronized (self) {
+        return @{
+            @"firstOffset": @([self firstOffset]),
+            @"nextOffset": @(_nextOffset),
+            @"segments": @(_segments.count),
+            @"bytes": @(_totalBytes),
+            @"unsynced": @(_unsynced),
+            @"appended": @(_appended),
+            @"syncs": @(_syncs),
+            @"dropped": @(_dropped),
+            @"truncatedBytes": @(_truncatedBytes),
+            @"consumers": [_acked copy]
+        };
+    }
+}
+
+- (void)close
+{
+    @synchronized (self) {
+        [self sync];
+        if (_fd >= 0) {
+            close(_fd);
+            _fd = -1;
+            _active = nil;
+        }
+    }
+}
+
+#pragma mark - Segments
+
+- (int64_t)firstOffset
+{
+    return _segments.count == 0 ? _nextOffset : _segments.firstObject->_firstOffset;
+}
+
+- (int64_t)ackedOffset:(NSString *)consumer
+{
+    NSNumber *offset = _acked[consumer];
+    return offset != nil ? offset.longLongValue : -1;
+}
+
+- (NSString *)segmentPath:(int64_t)offset
+{
+    return [_dir stringByAppendingPathComponent:[NSString stringWithFormat:@"%020lld%@", (long long)offset, kSegmentSuffix]];
+}
+
+- (BOOL)roll:(NSError **)error
+{
+    if (_fd >= 0) {
+        [self sync];
+        close(_fd);
+        _fd = -1;
+    }
+    IndoorEventSegment *segment = [IndoorEventSegment new];
+    segment->_firstOffset = _nextOffset;
+    segment->_nextOffset = _nextOffset;
+    segment->_path = [self segmentPath:_nextOffset];
+    if (![self openSegment:segment error:error]) {
+        return NO;
+    }
+    [_segments addObject:segment];
+    _active = segment;
+    return YES;
+}
+
+- (BOOL)openSegment:(IndoorEventSegment *)segment error:(NSError **)error
+{
+    _fd = open(segment->_path.fileSystemRepresentation, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (_fd < 0) {
+        if (error) {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        }
+        return NO;
+    }
+    return YES;
+}
+
+- (void)enforceBound
+{
+    while (_totalBytes > _maxBytes && _segments.count > 1) {
+        IndoorEventSegment *oldest = _segments.firstObject;
+        [_segments removeObjectAtIndex:0];
+        _dropped += oldest->_nextOffset - oldest->_firstOffset;
+        [self deleteSegment:oldest];
+    }
+}
+
+/**
+ *  Deletes the sealed segments every registered consumer has acknowledged
+ */
+- (void)compact
+{
+    if (_acked.count == 0) {
+        return;
+    }
+    int64_t acked = INT64_MAX;
+    for (NSNumber *offset in _acked.allValues) {
+        acked = MIN(acked, offset.longLongValue);
+    }
+    while (_segments.count > 0) {
+        IndoorEventSegment *segment = _segments.firstObject;
+        if (segment == _active || segment->_nextOffset - 1 > acked) {
+            break;
+        }
+        [_segments removeObjectAtIndex:0];
+        [self deleteSegment:segment];
+    }
+}
+
+- (void)deleteSegment:(IndoorEventSegment *)segment
+{
+    _totalBytes -= segment->_bytes;
+    if (unlink(segment->_path.fileSystemRepresentation) != 0) {
+        NSLog(@"IndoorEventQueue: cannot delete %@", segment->_path);
+    }
+}
+
+- (BOOL)recover:(NSError **)error
+{
+    NSArray<NSString *> *names = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:_dir error:nil];
+    NSMutableArray<NSNumber *> *offsets = [NSMutableArray array];
+    for (NSString *name in names) {
+        if ([name hasSuffix:kSegmentSuffix]) {
+            NSScanner *scanner = [NSScanner scannerWithString:[name substringToIndex:name.length - kSegmentSuffix.length]];
+            long long offset;
+            if ([scanner scanLongLong:&offset] && scanner.isAtEnd) {
+                [offsets addObject:@(offset)];
+            }
+        }
+    }
+    [offsets sortUsingSelector:@selector(compare:)];
+    IndoorEventSegment *previous = nil;
+    for (NSNumber *offset in offsets) {
+        IndoorEventSegment *segment = [IndoorEventSegment new];
+        segment->_firstOffset = offset.longLongValue;
+        segment->_nextOffset = segment->_firstOffset;
+        segment->_path = [self segmentPath:segment->_firstOffset];
+        segment->_bytes = [[[NSFileManager defaultManager] attributesOfItemAtPath:segment->_path error:nil] fileSize];
+        if (previous != nil) {
+            previous->_nextOffset = segment->_firstOffset;
+        }
+        [_segments addObject:segment];
+        _totalBytes += segment->_bytes;
+        previous = segment;
+    }
+    int64_t next = 0;
+    for (NSNumber *offset in _acked.allValues) {
+        next = MAX(next, offset.longLongValue + 1);
+    }
+    if (previous != nil) {
+        // Only the newest segment can end in a torn write, the others were synced before rolling
+        uint64_t valid = [self walk:previous from:INT64_MAX into:nil max:0];
+        if (valid < previous->_bytes) {
+            truncate(previous->_path.fileSystemRepresentation, (off_t)valid);
+            _truncatedBytes += previous->_bytes - valid;
+            _totalBytes -= previous->_bytes - valid;
+            previous->_bytes = valid;
+        }
+        next = MAX(next, previous->_nextOffset);
+        if (![self openSegment:previous error:error]) {
+            return NO;
+        }
+        _active = previous;
+    }
+    _nextOffset = next;
+    return YES;
+}
+
+/**
+ *  Walks the valid records of a segment, adding the events at or after an
+ *  offset to a batch until it is full. Without a batch, records the offset
+ *  after the last valid record in the segment. Returns the length of the
+ *  valid part of the segment.
+ */
+- (uint64_t)walk:(IndoorEventSegment *)segment from:(int64_t)fromOffset into:(NSMutableArray *)events max:(NSUInteger)maxEvents
+{
+    NSData *data = [NSData dataWithContentsOfFile:segment->_path options:NSDataReadingMappedIfSafe error:nil];
+    const uint8_t *bytes = data.bytes;
+    uint64_t length = data.length;
+    uint64_t position = 0;
+    int64_t offset = segment->_firstOffset;
+    while ((events == nil || events.count < maxEvents) && position + kHeaderBytes <= length) {
+        const uint8_t *header = bytes + position;
+        uint32_t size = IndoorGetUInt32(header);
+        uint32_t crc = IndoorGetUInt32(header + 4);
+        int64_t recordOffset = (int64_t)(((uint64_t)IndoorGetUInt32(header + 8) << 32) | IndoorGetUInt32(header + 12));
+        if (size > kMaxRecordBytes || recordOffset != offset || position + kHeaderBytes + size > length) {
+            break;
+        }
+        const uint8_t *payload = header + kHeaderBytes;
+        if (IndoorEventChecksum(recordOffset, payload, size) != crc) {
+            break;
+        }
+        if (events != nil && recordOffset >= fromOffset) {
+            NSData *json = [NSData dataWithBytesNoCopy:(void *)payload length:size freeWhenDone:NO];
+            NSMutableDictionary *event = [NSJSONSerialization JSONObjectWithData:json options:NSJSONReadingMutableContainers error:nil];
+            if ([event isKindOfClass:[NSMutableDictionary class]]) {
+                event[@"offset"] = @(recordOffset);
+                [events addObject:event];
+            } else {
+                NSLog(@"IndoorEventQueue: skipping event %lld", (long long)recordOffset);
+            }
+        }
+        position += kHeaderBytes + size;
+        offset++;
+    }
+    if (events == nil) {
+        segment->_nextOffset = offset;
+    }
+    return position;
+}
+
+#pragma mark - Offsets
+
+- (void)loadOffsets
+{
+    NSData *data = [NSData dataWithContentsOfFile:[_dir stringByAppendingPathComponent:kOffsetsFile]];
+    if (data == nil) {
+        return;
+    }
+    NSDictionary *offsets = [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+    if (![offsets isKindOfClass:[NSDictionary class]]) {
+        NSLog(@"IndoorEventQueue: cannot parse offsets");
+        return;
+    }
+    for (NSString *consumer in offsets) {
+        if ([offsets[consumer] isKindOfClass:[NSNumber class]]) {
+            _acked[consumer] = offsets[consumer];
+        }
+    }
+}
+
+- (BOOL)saveOffsets:(NSError **)error
+{
+    NSData *data = [NSJSONSerialization dataWithJSONObject:_acked options:0 error:error];
+    if (data == nil) {
+        return NO;
+    }
+    NSString *path = [_dir stringByAppendingPathComponent:kOffsetsFile];
+    NSString *temp = [path stringByAppendingString:@".tmp"];
+    int fd = open(temp.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    BOOL ok = fd >= 0 && write(fd, data.bytes, data.length) == (ssize_t)data.length && fsync(fd) == 0;
+    int code = errno;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (ok && rename(temp.fileSystemRepresentation, path.fileSystemRepresentation) != 0) {
+        ok = NO;
+        code = errno;
+    }
+    if (!ok && error) {
+        *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:nil];
+    }
+    return ok;
+}
+
+@end
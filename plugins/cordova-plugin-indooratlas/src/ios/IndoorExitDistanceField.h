@@ -0,0 +1,79 @@
+
+#import <Foundation/Foundation.h>
+
+extern const double IndoorExitDefaultCellMeters;
+extern const double IndoorExitFloorHeightMeters;
+
+/**
+ *  Distance field towards the nearest open exit, for evacuation guidance.
+ *
+ *  A multi-source Dijkstra from all open exits over the wayfinding graph gives
+ *  every node its distance, exit and next hop. One raster per floor, filled
+ *  by a chamfer distance transform seeded from the nodes, holds the node to
+ *  head for from positions off the graph, so guidance for a fix is a cell
+ *  lookup. Closing or opening an exit repairs only the nodes it affects and
+ *  returns them as a delta, which a field built from the same graph and exits
+ *  on another device applies with applyDelta:error:. Matches
+ *  ExitDistanceField.java.
+ */
+@interface IndoorExitDistanceField : NSObject
+
+@property (atomic, readonly) NSInteger version;
+@property (nonatomic, readonly) NSUInteger nodeCount;
+@property (nonatomic, readonly) NSUInteger exitCount;
+/**
+ *  Hash of the graph and exits the field was built from, the same on Android
+ */
+@property (nonatomic, readonly) NSString *fingerprint;
+
+/**
+ *  Builds the field, nil with error on an unreadable graph or exit, the error
+ *  of an exit naming its index
+ *
+ *  @param graphJson wayfinding graph as given to buildWayfinder
+ *  @param exits [{ id, latitude, longitude, floor }], each snapped to the nearest node on its floor, or [{ id, node }]
+ *  @param cellMeters raster cell size, grown for very large floors
+ *  @param closedExitIds exits closed from the start, ids not among the exits are ignored
+ */
+- (instancetype)initWithGraph:(NSString *)graphJson exits:(NSArray *)exits cellMeters:(double)cellMeters
+                  closedExits:(NSArray<NSString *> *)closedExitIds error:(NSError **)error;
+
+/**
+ *  { version, exitId, distance, node, next }: node is where to head first
+ *  and next the hop after it, each { latitude, longitude, floor }. exitId,
+ *  distance and next are NSNull if no open exit can be reached.
+ */
+- (NSDictionary *)guidanceAtLatitude:(double)latitude longitude:(double)longitude floor:(NSInteger)floor;
+
+/**
+ *  Close or open an exit. Return { version, baseVersion, fingerprint, exitId,
+ *  closed, nodes, distances, next, exits, floors }: the version before the
+ *  change, the changed nodes with their distance, next hop node and exit id,
+ *  and the floors whose rasters were rebuilt. nil with error for an unknown
+ *  exit.
+ */
+- (NSDictionary *)closeExit:(NSString *)exitId error:(NSError **)error;
+- (NSDictionary *)openExit:(NSString *)exitId error:(NSError **)error;
+
+/**
+ *  Ids of the closed exits
+ */
+- (NSArray<NSString *> *)closedExits;
+
+/**
+ *  Closes and opens exits to match the given closed ids, e.g. those of the
+ *  field this one replaces. Ids not among the exits are ignored.
+ */
+- (void)setClosedExits:(NSArray<NSString *> *)closedExitIds;
+
+/**
+ *  Applies a delta of closeExit:error: or openExit:error: from a field built
+ *  from the same graph and exits. Deltas of one field must be applied in the
+ *  order it returned them: one made from another version than this field's,
+ *  or with another fingerprint, is rejected. Returns the delta as applied
+ *  here, with this field's version, or nil with error for a bad delta, which
+ *  leaves the field as it was.
+ */
+- (NSDictionary *)applyDelta:(NSDictionary *)delta error:(NSError **)error;
+
+@end
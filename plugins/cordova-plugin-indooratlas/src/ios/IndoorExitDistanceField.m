@@ -0,0 +1,759 @@
+
+#import "IndoorExitDistanceField.h"
+
+const double IndoorExitDefaultCellMeters = 1;
+const double IndoorExitFloorHeightMeters = 5;
+
+static const NSUInteger kMaxRasterCells = 1 << 22;
+static const double kRasterMarginMeters = 10;
+static const double kMetersPerDegree = 6371000.0 * M_PI / 180.0;
+// 64-bit FNV-1a, computed the same way on Android so deltas can cross platforms
+static const uint64_t kFnvOffset = 0xcbf29ce484222325ULL;
+static const uint64_t kFnvPrime = 0x100000001b3ULL;
+
+static uint64_t fingerprintMix(uint64_t hash, int64_t value)
+{
+    for (int i = 0; i < 64; i += 8) {
+        hash ^= ((uint64_t)value >> i) & 0xff;
+        hash *= kFnvPrime;
+    }
+    return hash;
+}
+
+// Rounds to a fixed point integer for the fingerprint, half up as on Android
+static int64_t fingerprintFixed(double value, double scale)
+{
+    return (int64_t)floor(value * scale + 0.5);
+}
+
+// Binary min-heap of nodes by distance, stale entries are skipped on pop
+typedef struct {
+    double *keys;
+    int32_t *nodes;
+    NSUInteger size;
+    NSUInteger capacity;
+} IndoorExitHeap;
+
+static void heapPush(IndoorExitHeap *heap, double key, int32_t node)
+{
+    if (heap->size == heap->capacity) {
+        heap->capacity = heap->capacity > 0 ? heap->capacity * 2 : 64;
+        heap->keys = realloc(heap->keys, heap->capacity * sizeof(double));
+        heap->nodes = realloc(heap->nodes, heap->capacity * sizeof(int32_t));
+    }
+    NSUInteger i = heap->size++;
+    while (i > 0) {
+        NSUInteger parent = (i - 1) >> 1;
+        if (heap->keys[parent] <= key) {
+            break;
+        }
+        heap->keys[i] = heap->keys[parent];
+        heap->nodes[i] = heap->nodes[parent];
+        i = parent;
+    }
+    heap->keys[i] = key;
+    heap->nodes[i] = node;
+}
+
+static int32_t heapPop(IndoorExitHeap *heap, double *key)
+{
+    int32_t top = heap->nodes[0];
+    *key = heap->keys[0];
+    double last = heap->keys[--heap->size];
+    int32_t node = heap->nodes[heap->size];
+    NSUInteger i = 0;
+    while (YES) {
+        NSUInteger child = 2 * i + 1;
+        if (child >= heap->size) {
+            break;
+        }
+        if (child + 1 < heap->size && heap->keys[child + 1] < heap->keys[child]) {
+            child++;
+        }
+        if (last <= heap->keys[child]) {
+            break;
+        }
+        heap->keys[i] = heap->keys[child];
+        heap->nodes[i] = heap->nodes[child];
+        i = child;
+    }
+    heap->keys[i] = last;
+    heap->nodes[i] = node;
+    return top;
+}
+
+static void heapFree(IndoorExitHeap *heap)
+{
+    free(heap->keys);
+    free(heap->nodes);
+}
+
+static void relaxCell(float *distance, int32_t *best, NSUInteger cell, NSUInteger from, float step)
+{
+    float candidate = distance[from] + step;
+    if (candidate < distance[cell]) {
+        distance[cell] = candidate;
+        best[cell] = best[from];
+    }
+}
+
+@interface IndoorExitRaster : NSObject
+@property (nonatomic, assign) double x0;
+@property (nonatomic, assign) double y0;
+@property (nonatomic, assign) double cellMeters;
+@property (nonatomic, assign) NSInteger width;
+@property (nonatomic, assign) NSInteger height;
+@property (nonatomic, strong) NSMutableData *distance;
+@property (nonatomic, strong) NSMutableData *node;
+@end
+
+@implementation IndoorExitRaster
+@end
+
+@implementation IndoorExitDistanceField {
+    double _latitude0;
+    double _longitude0;
+    double _metersPerDegreeLon;
+    double _cellMeters;
+    NSUInteger _count;
+    NSMutableData *_latitudes;
+    NSMutableData *_longitudes;
+    NSMutableData *_floors;
+    NSMutableData *_x;
+    NSMutableData *_y;
+    NSMutableData *_adjacencyOffsets;
+    NSMutableData *_adjacentNodes;
+    NSMutableData *_adjacentWeights;
+    NSArray<NSString *> *_exitIds;
+    NSMutableData *_exitNodes;
+    NSMutableData *_closed;
+    NSMutableData *_distance;
+    NSMutableData *_next;
+    NSMutableData *_exit;
+    NSMutableDictionary<NSNumber *, IndoorExitRaster *> *_rasters;
+    NSString *_fingerprint;
+    NSInteger _version;
+}
+
+static NSError *fieldError(NSString *message)
+{
+    return [NSError errorWithDomain:@"IndoorExitDistanceField" code:0 userInfo:@{NSLocalizedDescriptionKey: message}];
+}
+
+- (instancetype)initWithGraph:(NSString *)graphJson exits:(NSArray *)exits cellMeters:(double)cellMeters
+                  closedExits:(NSArray<NSString *> *)closedExitIds error:(NSError **)error
+{
+    self = [super init];
+    if (!self) {
+        return nil;
+    }
+    NSData *data = [graphJson dataUsingEncoding:NSUTF8StringEncoding];
+    NSDictionary *graph = data != nil ? [NSJSONSerialization JSONObjectWithData:data options:0 error:nil] : nil;
+    NSArray *nodes = [graph isKindOfClass:[NSDictionary class]] ? graph[@"nodes"] : nil;
+    NSArray *edges = [graph isKindOfClass:[NSDictionary class]] ? graph[@"edges"] : nil;
+    if (![nodes isKindOfClass:[NSArray class]] || ![edges isKindOfClass:[NSArray class]] || nodes.count == 0) {
+        if (error) *error = fieldError(@"Error: graph");
+        return nil;
+    }
+    _count = nodes.count;
+    _cellMeters = cellMeters > 0 ? cellMeters : IndoorExitDefaultCellMeters;
+    _latitudes = [NSMutableData dataWithLength:_count * sizeof(double)];
+    _longitudes = [NSMutableData dataWithLength:_count * sizeof(double)];
+    _floors = [NSMutableData dataWithLength:_count * sizeof(int32_t)];
+    _x = [NSMutableData dataWithLength:_count * sizeof(double)];
+    _y = [NSMutableData dataWithLength:_count * sizeof(double)];
+    double *latitudes = _latitudes.mutableBytes;
+    double *longitudes = _longitudes.mutableBytes;
+    int32_t *floors = _floors.mutableBytes;
+    double *x = _x.mutableBytes;
+    double *y = _y.mutableBytes;
+    for (NSUInteger i = 0; i < _count; i++) {
+        latitudes[i] = [nodes[i][@"latitude"] doubleValue];
+        longitudes[i] = [nodes[i][@"longitude"] doubleValue];
+        floors[i] = [nodes[i][@"floor"] intValue];
+    }
+    _latitude0 = latitudes[0];
+    _longitude0 = longitudes[0];
+    _metersPerDegreeLon = kMetersPerDegree * cos(_latitude0 * M_PI / 180.0);
+    uint64_t fingerprint = fingerprintMix(kFnvOffset, (int64_t)_count);
+    for (NSUInteger i = 0; i < _count; i++) {
+        x[i] = (longitudes[i] - _longitude0) * _metersPerDegreeLon;
+        y[i] = (latitudes[i] - _latitude0) * kMetersPerDegree;
+        fingerprint = fingerprintMix(fingerprintMix(fingerprintMix(fingerprint, fingerprintFixed(latitudes[i], 1e7)),
+                                                    fingerprintFixed(longitudes[i], 1e7)), floors[i]);
+    }
+
+    // Undirected edges in compressed rows
+    NSUInteger edgeCount = edges.count;
+    _adjacencyOffsets = [NSMutableData dataWithLength:(_count + 1) * sizeof(int32_t)];
+    _adjacentNodes = [NSMutableData dataWithLength:2 * edgeCount * sizeof(int32_t)];
+    _adjacentWeights = [NSMutableData dataWithLength:2 * edgeCount * sizeof(double)];
+    int32_t *offsets = _adjacencyOffsets.mutableBytes;
+    int32_t *adjacent = _adjacentNodes.mutableBytes;
+    double *weights = _adjacentWeights.mutableBytes;
+    fingerprint = fingerprintMix(fingerprint, (int64_t)edgeCount);
+    for (NSUInteger i = 0; i < edgeCount; i++) {
+        NSInteger begin = [edges[i][@"begin"] integerValue];
+        NSInteger end = [edges[i][@"end"] integerValue];
+        if (begin < 0 || begin >= (NSInteger)_count || end < 0 || end >= (NSInteger)_count) {
+            if (error) *error = fieldError([NSString stringWithFormat:@"Edge %lu refers to a missing node", (unsigned long)i]);
+            return nil;
+        }
+        NSNumber *weight = edges[i][@"weight"];
+        BOOL weighted = [weight isKindOfClass:[NSNumber class]];
+        // Dijkstra settles a node for good, a negative edge would break that silently
+        if (weighted && (!([weight doubleValue] >= 0) || isinf([weight doubleValue]))) {
+            if (error) *error = fieldError([NSString stringWithFormat:@"Edge %lu has a negative or invalid weight", (unsigned long)i]);
+            return nil;
+        }
+        fingerprint = fingerprintMix(fingerprintMix(fingerprintMix(fingerprint, begin), end),
+                                     weighted ? fingerprintFixed([weight doubleValue], 1e3) : -1);
+        offsets[begin + 1]++;
+        offsets[end + 1]++;
+    }
+    for (NSUInteger i = 0; i < _count; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+    NSMutableData *fillData = [NSMutableData dataWithBytes:offsets length:_count * sizeof(int32_t)];
+    int32_t *fill = fillData.mutableBytes;
+    for (NSUInteger i = 0; i < edgeCount; i++) {
+        int32_t begin = [edges[i][@"begin"] intValue];
+        int32_t end = [edges[i][@"end"] intValue];
+        NSNumber *weight = edges[i][@"weight"];
+        double w = [weight isKindOfClass:[NSNumber class]] ? [weight doubleValue] : [self lengthFrom:begin to:end];
+        adjacent[fill[begin]] = end;
+        weights[fill[begin]++] = w;
+        adjacent[fill[end]] = begin;
+        weights[fill[end]++] = w;
+    }
+
+    NSMutableArray<NSString *> *exitIds = [NSMutableArray arrayWithCapacity:exits.count];
+    _exitNodes = [NSMutableData dataWithLength:exits.count * sizeof(int32_t)];
+    _closed = [NSMutableData dataWithLength:exits.count * sizeof(BOOL)];
+    int32_t *exitNodes = _exitNodes.mutableBytes;
+    BOOL *closed = _closed.mutableBytes;
+    for (NSUInteger e = 0; e < exits.count; e++) {
+        NSDictionary *exit = exits[e];
+        NSString *exitId = [exit isKindOfClass:[NSDictionary class]] ? exit[@"id"] : nil;
+        if (![exitId isKindOfClass:[NSString class]]) {
+            if (error) *error = fieldError([NSString stringWithFormat:@"Exit %lu has no id", (unsigned long)e]);
+            return nil;
+        }
+        BOOL byNode = [exit[@"node"] isKindOfClass:[NSNumber class]];
+        if (!byNode && !([exit[@"latitude"] isKindOfClass:[NSNumber class]]
+                         && [exit[@"longitude"] isKindOfClass:[NSNumber class]]
+                         && [exit[@"floor"] isKindOfClass:[NSNumber class]])) {
+            if (error) *error = fieldError([NSString stringWithFormat:@"Exit %lu has no node or position", (unsigned long)e]);
+            return nil;
+        }
+        [exitIds addObject:exitId];
+        exitNodes[e] = byNode ? [exit[@"node"] intValue]
+            : [self nearestNodeAtLatitude:[exit[@"latitude"] doubleValue] longitude:[exit[@"longitude"] doubleValue]
+                                    floor:[exit[@"floor"] integerValue]];
+        if (exitNodes[e] < 0 || exitNodes[e] >= (int32_t)_count) {
+            if (error) *error = fieldError([@"No node for exit " stringByAppendingString:exitId]);
+            return nil;
+        }
+        closed[e] = [closedExitIds containsObject:exitId];
+    }
+    _exitIds = exitIds;
+    fingerprint = fingerprintMix(fingerprint, (int64_t)_exitIds.count);
+    for (NSUInteger e = 0; e < _exitIds.count; e++) {
+        NSString *exitId = _exitIds[e];
+        fingerprint = fingerprintMix(fingerprintMix(fingerprint, exitNodes[e]), (int64_t)exitId.length);
+        // UTF-16 code units, as Java's String.charAt
+        for (NSUInteger c = 0; c < exitId.length; c++) {
+            fingerprint = fingerprintMix(fingerprint, [exitId characterAtIndex:c]);
+        }
+    }
+    _fingerprint = [NSString stringWithFormat:@"%016llx", fingerprint];
+
+    _distance = [NSMutableData dataWithLength:_count * sizeof(double)];
+    _next = [NSMutableData dataWithLength:_count * sizeof(int32_t)];
+    _exit = [NSMutableData dataWithLength:_count * sizeof(int32_t)];
+    double *distance = _distance.mutableBytes;
+    int32_t *next = _next.mutableBytes;
+    int32_t *exitOf = _exit.mutableBytes;
+    for (NSUInteger i = 0; i < _count; i++) {
+        distance[i] = INFINITY;
+        next[i] = -1;
+        exitOf[i] = -1;
+    }
+    IndoorExitHeap heap = {0};
+    for (NSUInteger e = 0; e < _exitIds.count; e++) {
+        [self seedExit:(int32_t)e heap:&heap changed:NULL];
+    }
+    [self propagate:&heap changed:NULL];
+    heapFree(&heap);
+
+    _rasters = [NSMutableDictionary dictionary];
+    for (NSUInteger i = 0; i < _count; i++) {
+        if (_rasters[@(floors[i])] == nil) {
+            _rasters[@(floors[i])] = [self buildRaster:floors[i]];
+        }
+    }
+    return self;
+}
+
+- (NSInteger)version
+{
+    @synchronized (self) {
+        return _version;
+    }
+}
+
+- (NSUInteger)nodeCount
+{
+    return _count;
+}
+
+- (NSString *)fingerprint
+{
+    return _fingerprint;
+}
+
+- (NSUInteger)exitCount
+{
+    return _exitIds.count;
+}
+
+- (NSDictionary *)guidanceAtLatitude:(double)latitude longitude:(double)longitude floor:(NSInteger)floor
+{
+    @synchronized (self) {
+        double px = (longitude - _longitude0) * _metersPerDegreeLon;
+        double py = (latitude - _latitude0) * kMetersPerDegree;
+        int32_t node = -1;
+        IndoorExitRaster *raster = _rasters[@(floor)];
+        if (raster != nil) {
+            double fx = (px - raster.x0) / raster.cellMeters;
+            double fy = (py - raster.y0) / raster.cellMeters;
+            if (fx >= 0 && fx < raster.width && fy >= 0 && fy < raster.height) {
+                node = ((const int32_t *)raster.node.bytes)[(NSInteger)fy * raster.width + (NSInteger)fx];
+            }
+        }
+        if (node < 0) {
+            // Outside the rasters or cut off from every exit
+            node = [self nearestNodeAtLatitude:latitude longitude:longitude floor:floor];
+        }
+        if (node < 0) {
+            return @{@"version": @(_version), @"exitId": [NSNull null], @"distance": [NSNull null],
+                     @"node": [NSNull null], @"next": [NSNull null]};
+        }
+        const double *x = _x.bytes;
+        const double *y = _y.bytes;
+        const double *distance = _distance.bytes;
+        const int32_t *next = _next.bytes;
+        const int32_t *exitOf = _exit.bytes;
+        BOOL reachable = exitOf[node] >= 0;
+        double dx = x[node] - px;
+        double dy = y[node] - py;
+        return @{@"version": @(_version),
+                 @"exitId": reachable ? _exitIds[exitOf[node]] : [NSNull null],
+                 @"distance": reachable ? @(sqrt(dx * dx + dy * dy) + distance[node]) : [NSNull null],
+                 @"node": [self nodeInfo:node],
+                 @"next": next[node] >= 0 ? [self nodeInfo:next[node]] : [NSNull null]};
+    }
+}
+
+- (NSDictionary *)closeExit:(NSString *)exitId error:(NSError **)error
+{
+    @synchronized (self) {
+        NSInteger exit = [_exitIds indexOfObject:exitId];
+        if (exit == NSNotFound) {
+            if (error) *error = fieldError([@"Unknown exit " stringByAppendingString:exitId ?: @""]);
+            return nil;
+        }
+        BOOL *closed = _closed.mutableBytes;
+        NSMutableData *changedData = [NSMutableData dataWithLength:_count * sizeof(BOOL)];
+        BOOL *changed = changedData.mutableBytes;
+        if (!closed[exit]) {
+            closed[exit] = YES;
+            double *distance = _distance.mutableBytes;
+            int32_t *next = _next.mutableBytes;
+            int32_t *exitOf = _exit.mutableBytes;
+            const int32_t *offsets = _adjacencyOffsets.bytes;
+            const int32_t *adjacent = _adjacentNodes.bytes;
+            const double *weights = _adjacentWeights.bytes;
+            for (NSUInteger i = 0; i < _count; i++) {
+                if (exitOf[i] == exit) {
+                    distance[i] = INFINITY;
+                    next[i] = -1;
+                    exitOf[i] = -1;
+                    changed[i] = YES;
+                }
+            }
+            IndoorExitHeap heap = {0};
+            // Distances only grow, so the rest of the field still holds
+            for (NSUInteger i = 0; i < _count; i++) {
+                if (!changed[i]) {
+                    continue;
+                }
+                for (int32_t k = offsets[i]; k < offsets[i + 1]; k++) {
+                    int32_t neighbour = adjacent[k];
+                    double candidate = distance[neighbour] + weights[k];
+                    if (exitOf[neighbour] >= 0 && candidate < distance[i]) {
+                        distance[i] = candidate;
+                        next[i] = neighbour;
+                        exitOf[i] = exitOf[neighbour];
+                    }
+                }
+                if (exitOf[i] >= 0) {
+                    heapPush(&heap, distance[i], (int32_t)i);
+                }
+            }
+            for (NSUInteger e = 0; e < _exitIds.count; e++) {
+                [self seedExit:(int32_t)e heap:&heap changed:changed];
+            }
+            [self propagate:&heap changed:changed];
+            heapFree(&heap);
+        }
+        return [self deltaForExit:exit changed:changed];
+    }
+}
+
+- (NSDictionary *)openExit:(NSString *)exitId error:(NSError **)error
+{
+    @synchronized (self) {
+        NSInteger exit = [_exitIds indexOfObject:exitId];
+        if (exit == NSNotFound) {
+            if (error) *error = fieldError([@"Unknown exit " stringByAppendingString:exitId ?: @""]);
+            return nil;
+        }
+        BOOL *closed = _closed.mutableBytes;
+        NSMutableData *changedData = [NSMutableData dataWithLength:_count * sizeof(BOOL)];
+        BOOL *changed = changedData.mutableBytes;
+        if (closed[exit]) {
+            closed[exit] = NO;
+            IndoorExitHeap heap = {0};
+            [self seedExit:(int32_t)exit heap:&heap changed:changed];
+            [self propagate:&heap changed:changed];
+            heapFree(&heap);
+        }
+        return [self deltaForExit:exit changed:changed];
+    }
+}
+
+- (NSArray<NSString *> *)closedExits
+{
+    @synchronized (self) {
+        const BOOL *closed = _closed.bytes;
+        NSMutableArray<NSString *> *ids = [NSMutableArray array];
+        for (NSUInteger e = 0; e < _exitIds.count; e++) {
+            if (closed[e]) {
+                [ids addObject:_exitIds[e]];
+            }
+        }
+        return ids;
+    }
+}
+
+- (void)setClosedExits:(NSArray<NSString *> *)closedExitIds
+{
+    @synchronized (self) {
+        const BOOL *closed = _closed.bytes;
+        for (NSUInteger e = 0; e < _exitIds.count; e++) {
+            BOOL close = [closedExitIds containsObject:_exitIds[e]];
+            if (close && !closed[e]) {
+                [self closeExit:_exitIds[e] error:NULL];
+            } else if (!close && closed[e]) {
+                [self openExit:_exitIds[e] error:NULL];
+            }
+        }
+    }
+}
+
+- (NSDictionary *)applyDelta:(NSDictionary *)delta error:(NSError **)error
+{
+    @synchronized (self) {
+        NSString *exitId = [delta isKindOfClass:[NSDictionary class]] ? delta[@"exitId"] : nil;
+        NSArray *nodes = [delta isKindOfClass:[NSDictionary class]] ? delta[@"nodes"] : nil;
+        NSArray *distances = nodes != nil ? delta[@"distances"] : nil;
+        NSArray *nextNodes = nodes != nil ? delta[@"next"] : nil;
+        NSArray *exits = nodes != nil ? delta[@"exits"] : nil;
+        if (![exitId isKindOfClass:[NSString class]] || ![delta[@"closed"] isKindOfClass:[NSNumber class]]
+            || ![nodes isKindOfClass:[NSArray class]] || ![distances isKindOfClass:[NSArray class]]
+            || ![nextNodes isKindOfClass:[NSArray class]] || ![exits isKindOfClass:[NSArray class]]
+            || ![delta[@"fingerprint"] isKindOfClass:[NSString class]] || ![delta[@"baseVersion"] isKindOfClass:[NSNumber class]]) {
+            if (error) *error = fieldError(@"Malformed exit delta");
+            return nil;
+        }
+        if (![delta[@"fingerprint"] isEqualToString:_fingerprint]) {
+            if (error) *error = fieldError(@"Delta is for another graph or exits");
+            return nil;
+        }
+        NSInteger baseVersion = [delta[@"baseVersion"] integerValue];
+        if (baseVersion != _version) {
+            if (error) *error = fieldError([NSString stringWithFormat:@"Delta is for version %ld, the field is at version %ld",
+                                            (long)baseVersion, (long)_version]);
+            return nil;
+        }
+        NSInteger exit = [_exitIds indexOfObject:exitId];
+        if (exit == NSNotFound) {
+            if (error) *error = fieldError([@"Unknown exit " stringByAppendingString:exitId]);
+            return nil;
+        }
+        NSUInteger count = nodes.count;
+        if (distances.count != count || nextNodes.count != count || exits.count != count) {
+            if (error) *error = fieldError(@"Delta arrays differ in length");
+            return nil;
+        }
+        // Checked before anything changes
+        for (NSUInteger i = 0; i < count; i++) {
+            BOOL reachable = exits[i] != [NSNull null];
+            if (![nodes[i] isKindOfClass:[NSNumber class]] || ![nextNodes[i] isKindOfClass:[NSNumber class]]
+                || (reachable && (![exits[i] isKindOfClass:[NSString class]]
+                                  || ![distances[i] isKindOfClass:[NSNumber class]]))) {
+                if (error) *error = fieldError(@"Malformed exit delta");
+                return nil;
+            }
+            if (reachable && ![_exitIds containsObject:exits[i]]) {
+                if (error) *error = fieldError([@"Unknown exit " stringByAppendingString:exits[i]]);
+                return nil;
+            }
+            NSInteger node = [nodes[i] integerValue];
+            NSInteger hop = [nextNodes[i] integerValue];
+            if (node < 0 || node >= (NSInteger)_count || hop < -1 || hop >= (NSInteger)_count) {
+                if (error) *error = fieldError([NSString stringWithFormat:@"Delta node %lu is not in the graph",
+                                                (unsigned long)i]);
+                return nil;
+            }
+        }
+        ((BOOL *)_closed.mutableBytes)[exit] = [delta[@"closed"] boolValue];
+        double *distance = _distance.mutableBytes;
+        int32_t *next = _next.mutableBytes;
+        int32_t *exitOf = _exit.mutableBytes;
+        NSMutableData *changedData = [NSMutableData dataWithLength:_count * sizeof(BOOL)];
+        BOOL *changed = changedData.mutableBytes;
+        for (NSUInteger i = 0; i < count; i++) {
+            NSInteger node = [nodes[i] integerValue];
+            BOOL reachable = exits[i] != [NSNull null];
+            distance[node] = reachable ? [distances[i] doubleValue] : INFINITY;
+            next[node] = [nextNodes[i] intValue];
+            exitOf[node] = reachable ? (int32_t)[_exitIds indexOfObject:exits[i]] : -1;
+            changed[node] = YES;
+        }
+        return [self deltaForExit:exit changed:changed];
+    }
+}
+
+- (void)seedExit:(int32_t)exit heap:(IndoorExitHeap *)heap changed:(BOOL *)changed
+{
+    const BOOL *closed = _closed.bytes;
+    int32_t node = ((const int32_t *)_exitNodes.bytes)[exit];
+    double *distance = _distance.mutableBytes;
+    if (closed[exit] || distance[node] <= 0) {
+        return;
+    }
+    distance[node] = 0;
+    ((int32_t *)_next.mutableBytes)[node] = -1;
+    ((int32_t *)_exit.mutableBytes)[node] = exit;
+    if (changed != NULL) {
+        changed[node] = YES;
+    }
+    heapPush(heap, 0, node);
+}
+
+- (void)propagate:(IndoorExitHeap *)heap changed:(BOOL *)changed
+{
+    double *distance = _distance.mutableBytes;
+    int32_t *next = _next.mutableBytes;
+    int32_t *exitOf = _exit.mutableBytes;
+    const int32_t *offsets = _adjacencyOffsets.bytes;
+    const int32_t *adjacent = _adjacentNodes.bytes;
+    const double *weights = _adjacentWeights.bytes;
+    while (heap->size > 0) {
+        double d;
+        int32_t node = heapPop(heap, &d);
+        if (d > distance[node]) {
+            continue;
+        }
+        for (int32_t k = offsets[node]; k < offsets[node + 1]; k++) {
+            int32_t neighbour = adjacent[k];
+            double candidate = d + weights[k];
+            if (candidate < distance[neighbour]) {
+                distance[neighbour] = candidate;
+                next[neighbour] = node;
+                exitOf[neighbour] = exitOf[node];
+                if (changed != NULL) {
+                    changed[neighbour] = YES;
+                }
+                heapPush(heap, candidate, neighbour);
+            }
+        }
+    }
+}
+
+// Rebuilds the rasters of the changed floors and bumps the version if anything changed
+- (NSDictionary *)deltaForExit:(NSInteger)exit changed:(const BOOL *)changed
+{
+    const double *distance = _distance.bytes;
+    const int32_t *next = _next.bytes;
+    const int32_t *exitOf = _exit.bytes;
+    const int32_t *floors = _floors.bytes;
+    NSMutableArray *nodes = [NSMutableArray array];
+    NSMutableArray *distances = [NSMutableArray array];
+    NSMutableArray *nextNodes = [NSMutableArray array];
+    NSMutableArray *exits = [NSMutableArray array];
+    NSMutableOrderedSet<NSNumber *> *changedFloors = [NSMutableOrderedSet orderedSet];
+    NSInteger baseVersion = _version;
+    for (NSUInteger i = 0; i < _count; i++) {
+        if (!changed[i]) {
+            continue;
+        }
+        BOOL reachable = exitOf[i] >= 0;
+        [nodes addObject:@(i)];
+        [distances addObject:reachable ? @(distance[i]) : [NSNull null]];
+        [nextNodes addObject:@(next[i])];
+        [exits addObject:reachable ? _exitIds[exitOf[i]] : [NSNull null]];
+        [changedFloors addObject:@(floors[i])];
+    }
+    for (NSNumber *floor in changedFloors) {
+        _rasters[floor] = [self buildRaster:[floor intValue]];
+    }
+    if (nodes.count > 0) {
+        _version++;
+    }
+    return @{@"version": @(_version),
+             @"baseVersion": @(baseVersion),
+             @"fingerprint": _fingerprint,
+             @"exitId": _exitIds[exit],
+             @"closed": @(((const BOOL *)_closed.bytes)[exit]),
+             @"nodes": nodes,
+             @"distances": distances,
+             @"next": nextNodes,
+             @"exits": exits,
+             @"floors": [changedFloors array]};
+}
+
+// Seeded with the reachable nodes of the floor, two chamfer passes carry the
+// best node to every cell by straight line distance plus the node's distance
+- (IndoorExitRaster *)buildRaster:(int32_t)floor
+{
+    const int32_t *floors = _floors.bytes;
+    const double *x = _x.bytes;
+    const double *y = _y.bytes;
+    const double *nodeDistance = _distance.bytes;
+    const int32_t *exitOf = _exit.bytes;
+    double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+    for (NSUInteger i = 0; i < _count; i++) {
+        if (floors[i] == floor) {
+            minX = MIN(minX, x[i]);
+            minY = MIN(minY, y[i]);
+            maxX = MAX(maxX, x[i]);
+            maxY = MAX(maxY, y[i]);
+        }
+    }
+    IndoorExitRaster *raster = [[IndoorExitRaster alloc] init];
+    raster.x0 = minX - kRasterMarginMeters;
+    raster.y0 = minY - kRasterMarginMeters;
+    double spanX = maxX - minX + 2 * kRasterMarginMeters;
+    double spanY = maxY - minY + 2 * kRasterMarginMeters;
+    double cellMeters = MAX(_cellMeters, sqrt(spanX * spanY / kMaxRasterCells));
+    raster.cellMeters = cellMeters;
+    NSInteger width = raster.width = (NSInteger)ceil(spanX / cellMeters);
+    NSInteger height = raster.height = (NSInteger)ceil(spanY / cellMeters);
+    NSUInteger cells = width * height;
+    raster.distance = [NSMutableData dataWithLength:cells * sizeof(float)];
+    raster.node = [NSMutableData dataWithLength:cells * sizeof(int32_t)];
+    float *distance = raster.distance.mutableBytes;
+    int32_t *best = raster.node.mutableBytes;
+    for (NSUInteger c = 0; c < cells; c++) {
+        distance[c] = INFINITY;
+        best[c] = -1;
+    }
+    for (NSUInteger i = 0; i < _count; i++) {
+        if (floors[i] != floor || exitOf[i] < 0) {
+            continue;
+        }
+        NSInteger col = (NSInteger)((x[i] - raster.x0) / cellMeters);
+        NSInteger row = (NSInteger)((y[i] - raster.y0) / cellMeters);
+        double dx = raster.x0 + (col + 0.5) * cellMeters - x[i];
+        double dy = raster.y0 + (row + 0.5) * cellMeters - y[i];
+        float value = (float)(nodeDistance[i] + sqrt(dx * dx + dy * dy));
+        NSUInteger cell = row * width + col;
+        if (value < distance[cell]) {
+            distance[cell] = value;
+            best[cell] = (int32_t)i;
+        }
+    }
+    float straight = (float)cellMeters;
+    float diagonal = (float)(cellMeters * M_SQRT2);
+    for (NSInteger row = 0; row < height; row++) {
+        for (NSInteger col = 0; col < width; col++) {
+            NSUInteger cell = row * width + col;
+            if (col > 0) {
+                relaxCell(distance, best, cell, cell - 1, straight);
+            }
+            if (row > 0) {
+                relaxCell(distance, best, cell, cell - width, straight);
+                if (col > 0) {
+                    relaxCell(distance, best, cell, cell - width - 1, diagonal);
+                }
+                if (col + 1 < width) {
+                    relaxCell(distance, best, cell, cell - width + 1, diagonal);
+                }
+            }
+        }
+    }
+    for (NSInteger row = height - 1; row >= 0; row--) {
+        for (NSInteger col = width - 1; col >= 0; col--) {
+            NSUInteger cell = row * width + col;
+            if (col + 1 < width) {
+                relaxCell(distance, best, cell, cell + 1, straight);
+            }
+            if (row + 1 < height) {
+                relaxCell(distance, best, cell, cell + width, straight);
+                if (col + 1 < width) {
+                    relaxCell(distance, best, cell, cell + width + 1, diagonal);
+                }
+                if (col > 0) {
+                    relaxCell(distance, best, cell, cell + width - 1, diagonal);
+                }
+            }
+        }
+    }
+    return raster;
+}
+
+- (int32_t)nearestNodeAtLatitude:(double)latitude longitude:(double)longitude floor:(NSInteger)floor
+{
+    const int32_t *floors = _floors.bytes;
+    const double *x = _x.bytes;
+    const double *y = _y.bytes;
+    double px = (longitude - _longitude0) * _metersPerDegreeLon;
+    double py = (latitude - _latitude0) * kMetersPerDegree;
+    int32_t nearest = -1;
+    double nearestDistance = INFINITY;
+    for (NSUInteger i = 0; i < _count; i++) {
+        if (floors[i] != floor) {
+            continue;
+        }
+        double dx = x[i] - px;
+        double dy = y[i] - py;
+        if (dx * dx + dy * dy < nearestDistance) {
+            nearestDistance = dx * dx + dy * dy;
+            nearest = (int32_t)i;
+        }
+    }
+    return nearest;
+}
+
+- (double)lengthFrom:(int32_t)a to:(int32_t)b
+{
+    const double *latitudes = _latitudes.bytes;
+    const double *longitudes = _longitudes.bytes;
+    const int32_t *floors = _floors.bytes;
+    double dx = (longitudes[b] - longitudes[a]) * kMetersPerDegree * cos(latitudes[a] * M_PI / 180.0);
+    double dy = (latitudes[b] - latitudes[a]) * kMetersPerDegree;
+    double dz = (floors[b] - floors[a]) * IndoorExitFloorHeightMeters;
+    return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+- (NSDictionary *)nodeInfo:(int32_t)node
+{
+    return @{@"latitude": @(((const double *)_latitudes.bytes)[node]),
+             @"longitude": @(((const double *)_longitudes.bytes)[node]),
+             @"floor": @(((const int32_t *)_floors.bytes)[node])};
+}
+
+@end
@@ -0,0 +1,61 @@
+
+#import <Foundation/Foundation.h>
+#import "IndoorDeferred.h"
+#import "IndoorTimingWheel.h"
+
+typedef NS_ENUM(NSInteger, IndoorFetchPriority) {
+    IndoorFetchPriorityVisible = 0,
+    IndoorFetchPriorityNavigation,
+    IndoorFetchPriorityPrefetch
+};
+
+/**
+ *  Completion of one fetch attempt, called exactly once. Bytes may be 0 if unknown;
+ *  retryable tells whether another attempt could succeed, i.e. after a transport
+ *  error, not for a resource that does not exist.
+ */
+typedef void (^IndoorFetchSuccess)(id value, int64_t bytes);
+typedef void (^IndoorFetchFailure)(NSError *error, BOOL retryable);
+
+/**
+ *  Starts one attempt of a fetch and returns a block that aborts it, or nil
+ */
+typedef dispatch_block_t (^IndoorFetcher)(IndoorFetchSuccess success, IndoorFetchFailure failure);
+
+/**
+ *  Single entry point for the network fetches of the plugin: floor plan
+ *  metadata, images, tiles, graphs and speculative prefetch.
+ *
+ *  Requests wait in one queue per priority and start in priority order under a
+ *  global and a per-host concurrency cap. Requests for the same key share one
+ *  fetch, which is only aborted once every request waiting for it has been
+ *  cancelled. Failed fetches are retried with jittered exponential backoff on
+ *  the timing wheel. A host's cap is halved on a retryable (transport) failure
+ *  and grows back by one per success; a terminal failure such as an unknown
+ *  resource leaves it alone. Prefetch for a slow host waits until the host is
+ *  idle.
+ *  Matches FetchScheduler.java.
+ */
+@interface IndoorFetchScheduler : NSObject
+
++ (IndoorFetchScheduler *)sharedScheduler;
+
+- (instancetype)initWithMaxConcurrent:(NSInteger)maxConcurrent maxPerHost:(NSInteger)maxPerHost wheel:(IndoorTimingWheel *)wheel;
+
+@property (nonatomic, readonly) NSInteger maxPerHost;
+
+/**
+ *  Queues a fetch, or joins the one already queued or running for the key.
+ *  Cancelling the returned deferred withdraws only this request.
+ *
+ *  @param key identifies the resource, e.g. "floorplan:<id>" or a URL
+ *  @param host requests to the same host share its concurrency cap
+ */
+- (IndoorDeferred *)fetch:(NSString *)key host:(NSString *)host priority:(IndoorFetchPriority)priority fetcher:(IndoorFetcher)fetcher;
+
+/**
+ *  Counters and per host state
+ */
+- (NSDictionary *)report;
+
+@end
@@ -0,0 +1,363 @@
+
+#import "IndoorFetchScheduler.h"
+#import "IndoorTraceRecorder.h"
+#import <time.h>
+
+static const NSInteger kPriorityCount = 3;
+static const NSInteger kDefaultMaxConcurrent = 6;
+static const NSInteger kDefaultMaxPerHost = 2;
+static const NSInteger kMaxAttempts = 4;
+static const int64_t kBackoffBaseMs = 500;
+static const int64_t kBackoffMaxMs = 30000;
+static const double kSlowBytesPerMs = 25;
+static const double kSlowLatencyMs = 2000;
+static const double kEwmaWeight = 0.25;
+
+static double ewma(double current, double sample)
+{
+    return current < 0 ? sample : current + kEwmaWeight * (sample - current);
+}
+
+@interface IndoorFetchHost : NSObject
+@property (nonatomic, strong) NSString *name;
+@property (nonatomic, assign) NSInteger cap;
+@property (nonatomic, assign) NSInteger active;
+@property (nonatomic, assign) double bytesPerMs;
+@property (nonatomic, assign) double latencyMs;
+@end
+
+@implementation IndoorFetchHost
+
+- (BOOL)isSlow
+{
+    return (self.bytesPerMs >= 0 && self.bytesPerMs < kSlowBytesPerMs) || self.latencyMs > kSlowLatencyMs;
+}
+
+@end
+
+@interface IndoorFetchJob : NSObject
+@property (nonatomic, strong) NSString *key;
+@property (nonatomic, strong) IndoorFetchHost *host;
+@property (nonatomic, copy) IndoorFetcher fetcher;
+@property (nonatomic, strong) NSMutableArray<IndoorDeferred *> *waiters;
+@property (nonatomic, assign) IndoorFetchPriority priority;
+@property (nonatomic, assign) NSInteger attempts;
+@property (nonatomic, assign) BOOL queued;
+@property (nonatomic, assign) BOOL inFlight;
+@property (nonatomic, assign) BOOL done;
+@property (nonatomic, copy) dispatch_block_t cancelRunning;
+@property (nonatomic, assign) uint64_t startNanos;
+@property (nonatomic, strong) IndoorTimeout *retry;
+@end
+
+@implementation IndoorFetchJob
+@end
+
+@interface IndoorFetchScheduler ()
+@property (nonatomic, strong) NSArray<NSMutableArray<IndoorFetchJob *> *> *queues;
+@property (nonatomic, strong) NSMutableDictionary<NSString *, IndoorFetchJob *> *jobs;
+@property (nonatomic, strong) NSMutableDictionary<NSString *, IndoorFetchHost *> *hosts;
+@property (nonatomic, strong) IndoorTimingWheel *wheel;
+@property (nonatomic, assign) NSInteger maxConcurrent;
+@property (nonatomic, assign) NSInteger active;
+@property (nonatomic, assign) NSInteger started;
+@property (nonatomic, assign) NSInteger deduplicated;
+@property (nonatomic, assign) NSInteger retried;
+@property (nonatomic, assign) NSInteger completed;
+@property (nonatomic, assign) NSInteger failed;
+@property (nonatomic, assign) NSInteger cancelled;
+@end
+
+@implementation IndoorFetchScheduler
+
++ (IndoorFetchScheduler *)sharedScheduler
+{
+    static IndoorFetchScheduler *shared = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        shared = [[IndoorFetchScheduler alloc] initWithMaxConcurrent:kDefaultMaxConcurrent maxPerHost:kDefaultMaxPerHost wheel:[IndoorTimingWheel sharedWheel]];
+    });
+    return shared;
+}
+
+- (instancetype)initWithMaxConcurrent:(NSInteger)maxConcurrent maxPerHost:(NSInteger)maxPerHost wheel:(IndoorTimingWheel *)wheel
+{
+    self = [super init];
+    if (self) {
+        _maxConcurrent = MAX(1, maxConcurrent);
+        _maxPerHost = MAX(1, maxPerHost);
+        _wheel = wheel;
+        _queues = @[[NSMutableArray array], [NSMutableArray array], [NSMutableArray array]];
+        _jobs = [NSMutableDictionary dictionary];
+        _hosts = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+- (IndoorDeferred *)fetch:(NSString *)key host:(NSString *)hostName priority:(IndoorFetchPriority)priority fetcher:(IndoorFetcher)fetcher
+{
+    priority = MAX(IndoorFetchPriorityVisible, MIN(IndoorFetchPriorityPrefetch, priority));
+    IndoorDeferred *waiter = [[IndoorDeferred alloc] initWithToken:nil];
+    IndoorFetchJob *job;
+    @synchronized (self) {
+        job = self.jobs[key];
+        if (job != nil) {
+            self.deduplicated++;
+            if (priority < job.priority) {
+                if (job.queued) {
+                    [self.queues[job.priority] removeObjectIdenticalTo:job];
+                    [self.queues[priority] addObject:job];
+                }
+                job.priority = priority;
+            }
+        } else {
+            job = [[IndoorFetchJob alloc] init];
+            job.key = key;
+            job.host = [self hostNamed:hostName];
+            job.fetcher = fetcher;
+            job.priority = priority;
+            job.waiters = [NSMutableArray arrayWithCapacity:1];
+            self.jobs[key] = job;
+            [self enqueue:job];
+        }
+        [job.waiters addObject:waiter];
+    }
+    __weak IndoorDeferred *weakWaiter = waiter;
+    [waiter whenComplete:^(id value, NSError *error) {
+        IndoorDeferred *cancelledWaiter = weakWaiter;
+        if (error != nil && cancelledWaiter.token.isCancelled) {
+            [self withdraw:job waiter:cancelledWaiter];
+        }
+    }];
+    [self pump];
+    return waiter;
+}
+
+- (NSDictionary *)report
+{
+    @synchronized (self) {
+        NSMutableDictionary *hosts = [NSMutableDictionary dictionaryWithCapacity:self.hosts.count];
+        for (IndoorFetchHost *host in self.hosts.allValues) {
+            hosts[host.name] = @{@"cap": @(host.cap),
+                                 @"active": @(host.active),
+                                 @"bytesPerMs": @(host.bytesPerMs),
+                                 @"latencyMs": @(host.latencyMs),
+                                 @"slow": @([host isSlow])};
+        }
+        return @{@"active": @(self.active),
+                 @"queuedVisible": @(self.queues[IndoorFetchPriorityVisible].count),
+                 @"queuedNavigation": @(self.queues[IndoorFetchPriorityNavigation].count),
+                 @"queuedPrefetch": @(self.queues[IndoorFetchPriorityPrefetch].count),
+                 @"started": @(self.started),
+                 @"deduplicated": @(self.deduplicated),
+                 @"retried": @(self.retried),
+                 @"completed": @(self.completed),
+                 @"failed": @(self.failed),
+                 @"cancelled": @(self.cancelled),
+                 @"hosts": hosts};
+    }
+}
+
+#pragma mark - Internals
+
+- (IndoorFetchHost *)hostNamed:(NSString *)name
+{
+    IndoorFetchHost *host = self.hosts[name];
+    if (host == nil) {
+        host = [[IndoorFetchHost alloc] init];
+        host.name = name;
+        host.cap = self.maxPerHost;
+        host.bytesPerMs = -1;
+        host.latencyMs = -1;
+        self.hosts[name] = host;
+    }
+    return host;
+}
+
+- (void)enqueue:(IndoorFetchJob *)job
+{
+    job.queued = YES;
+    [self.queues[job.priority] addObject:job];
+}
+
+// Starts as many queued jobs as the caps allow, outside the lock
+- (void)pump
+{
+    NSMutableArray<IndoorFetchJob *> *starting = nil;
+    NSMutableArray<NSNumber *> *attempts = nil;
+    @synchronized (self) {
+        for (NSInteger priority = 0; priority < kPriorityCount && self.active < self.maxConcurrent; priority++) {
+            NSMutableArray<IndoorFetchJob *> *queue = self.queues[priority];
+            for (NSUInteger i = 0; i < queue.count && self.active < self.maxConcurrent; ) {
+                IndoorFetchJob *job = queue[i];
+                IndoorFetchHost *host = job.host;
+                if (host.active >= host.cap || (priority == IndoorFetchPriorityPrefetch && [host isSlow] && host.active > 0)) {
+                    i++;
+                    continue;
+                }
+                [queue removeObjectAtIndex:i];
+                job.queued = NO;
+                job.inFlight = YES;
+                job.attempts++;
+                job.startNanos = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+                host.active++;
+                self.active++;
+                self.started++;
+                IndoorTraceAsyncBegin("fetch", "attempt", (uint64_t)(uintptr_t)job);
+                IndoorTraceCounter("fetch", "active", self.active);
+                if (starting == nil) {
+                    starting = [NSMutableArray array];
+                    attempts = [NSMutableArray array];
+                }
+                [starting addObject:job];
+                [attempts addObject:@(job.attempts)];
+            }
+        }
+    }
+    for (NSUInteger i = 0; i < starting.count; i++) {
+        IndoorFetchJob *job = starting[i];
+        NSInteger attempt = [attempts[i] integerValue];
+        dispatch_block_t cancel = job.fetcher(^(id value, int64_t bytes) {
+            [self job:job attempt:attempt succeeded:value bytes:bytes];
+        }, ^(NSError *error, BOOL retryable) {
+            [self job:job attempt:attempt failed:error retryable:retryable];
+        });
+        BOOL abort = NO;
+        @synchronized (self) {
+            if ([self isCurrent:job attempt:attempt]) {
+                job.cancelRunning = cancel;
+            } else {
+                // Withdrawn while starting
+                abort = job.done && job.waiters.count == 0;
+            }
+        }
+        if (abort && cancel != nil) {
+            cancel();
+        }
+    }
+}
+
+- (void)job:(IndoorFetchJob *)job attempt:(NSInteger)attempt succeeded:(id)value bytes:(int64_t)bytes
+{
+    NSArray<IndoorDeferred *> *waiters;
+    @synchronized (self) {
+        if (![self isCurrent:job attempt:attempt]) {
+            return;
+        }
+        [self releaseJob:job];
+        double elapsedMs = MAX(1, (clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - job.startNanos) / 1e6);
+        IndoorFetchHost *host = job.host;
+        host.latencyMs = ewma(host.latencyMs, elapsedMs);
+        if (bytes > 0) {
+            host.bytesPerMs = ewma(host.bytesPerMs, bytes / elapsedMs);
+        }
+        host.cap = MIN(self.maxPerHost, host.cap + 1);
+        [self finish:job];
+        self.completed++;
+        waiters = [job.waiters copy];
+    }
+    for (IndoorDeferred *waiter in waiters) {
+        [waiter resolve:value];
+    }
+    [self pump];
+}
+
+- (void)job:(IndoorFetchJob *)job attempt:(NSInteger)attempt failed:(NSError *)error retryable:(BOOL)retryable
+{
+    NSArray<IndoorDeferred *> *waiters = nil;
+    @synchronized (self) {
+        if (![self isCurrent:job attempt:attempt]) {
+            return;
+        }
+        [self releaseJob:job];
+        if (retryable) {
+            job.host.cap = MAX(1, job.host.cap / 2);
+        }
+        if (retryable && job.attempts < kMaxAttempts) {
+            self.retried++;
+            int64_t backoff = MIN(kBackoffMaxMs, kBackoffBaseMs << (job.attempts - 1));
+            backoff = backoff / 2 + (int64_t)arc4random_uniform((uint32_t)(backoff / 2 + 1));
+            __weak IndoorFetchScheduler *weakSelf = self;
+            job.retry = [self.wheel schedule:backoff block:^{
+                IndoorFetchScheduler *strongSelf = weakSelf;
+                if (strongSelf == nil) {
+                    return;
+                }
+                @synchronized (strongSelf) {
+                    if (job.done) {
+                        return;
+                    }
+                    job.retry = nil;
+                    [strongSelf enqueue:job];
+                }
+                [strongSelf pump];
+            }];
+        } else {
+            [self finish:job];
+            self.failed++;
+            waiters = [job.waiters copy];
+        }
+    }
+    for (IndoorDeferred *waiter in waiters) {
+        [waiter reject:error];
+    }
+    [self pump];
+}
+
+// Drops a cancelled request; the fetch stops once nobody waits for it
+- (void)withdraw:(IndoorFetchJob *)job waiter:(IndoorDeferred *)waiter
+{
+    dispatch_block_t cancel = nil;
+    @synchronized (self) {
+        if (waiter == nil || ![job.waiters containsObject:waiter] || job.done) {
+            return;
+        }
+        [job.waiters removeObjectIdenticalTo:waiter];
+        if (job.waiters.count > 0) {
+            return;
+        }
+        self.cancelled++;
+        if (job.queued) {
+            [self.queues[job.priority] removeObjectIdenticalTo:job];
+            job.queued = NO;
+        } else if (job.inFlight) {
+            cancel = job.cancelRunning;
+            [self releaseJob:job];
+        } else if (job.retry != nil) {
+            [job.retry cancel];
+            job.retry = nil;
+        }
+        [self finish:job];
+    }
+    if (cancel != nil) {
+        cancel();
+    }
+    [self pump];
+}
+
+- (BOOL)isCurrent:(IndoorFetchJob *)job attempt:(NSInteger)attempt
+{
+    return !job.done && job.inFlight && job.attempts == attempt;
+}
+
+// Frees the slots of a running job. Caller holds the lock.
+- (void)releaseJob:(IndoorFetchJob *)job
+{
+    job.host.active--;
+    self.active--;
+    IndoorTraceAsyncEnd("fetch", "attempt", (uint64_t)(uintptr_t)job);
+    IndoorTraceCounter("fetch", "active", self.active);
+    job.inFlight = NO;
+    job.cancelRunning = nil;
+}
+
+// Caller holds the lock
+- (void)finish:(IndoorFetchJob *)job
+{
+    job.done = YES;
+    if (self.jobs[job.key] == job) {
+        [self.jobs removeObjectForKey:job.key];
+    }
+}
+
+@end
@@ -0,0 +1,64 @@
+
+#import <Foundation/Foundation.h>
+
+@class IndoorTimingWheel;
+
+extern const double IndoorFloorConfirmCertainty;
+extern const double IndoorFloorMinCertainty;
+extern const int64_t IndoorFloorDwellNearConnectorMs;
+extern const int64_t IndoorFloorDwellMs;
+extern const double IndoorFloorConnectorRadiusMeters;
+
+/**
+ *  Called when a floor becomes tentative or confirmed. A tentative change
+ *  with floor equal to confirmedFloor means the tentative floor was dropped.
+ *  confirmedFloor is the floor confirmed before the change, certainty NAN if
+ *  unknown.
+ */
+typedef void (^IndoorFloorChange)(BOOL confirmed, NSInteger floor, NSInteger confirmedFloor, double certainty,
+                                  BOOL nearConnector, int64_t timeMs);
+
+/**
+ *  Floor hysteresis. A fix on another floor than the confirmed one makes that
+ *  floor tentative. It is confirmed right away with a floor certainty of at
+ *  least IndoorFloorConfirmCertainty next to a vertical connector of the
+ *  wayfinding graph, otherwise once the fixes have stayed on it for a dwell
+ *  time on the shared timing wheel. A fix back on the confirmed floor drops
+ *  the tentative floor. Without a graph no position counts as next to a
+ *  connector. Matches FloorStateMachine.java.
+ */
+@interface IndoorFloorStateMachine : NSObject
+
+/**
+ *  Called under the lock, so changes arrive in order
+ */
+@property (atomic, copy, readonly) IndoorFloorChange onChange;
+
+/**
+ *  Sets onChange and replays the current state to it: the confirmed floor
+ *  with confirmedFloor equal to it, then the tentative floor if any
+ */
+- (void)observe:(IndoorFloorChange)onChange;
+
+- (instancetype)initWithTimingWheel:(IndoorTimingWheel *)timingWheel;
+
+/**
+ *  Takes the vertical connectors from a wayfinding graph: the nodes of edges
+ *  between two floors. Returns NO if the graph cannot be read.
+ */
+- (BOOL)setGraph:(NSString *)graphJson;
+
+/**
+ *  Feeds a fix
+ *
+ *  @param certainty floor certainty, NAN if unknown
+ */
+- (void)onFixAtLatitude:(double)latitude longitude:(double)longitude floor:(NSInteger)floor
+              certainty:(double)certainty time:(int64_t)timeMs;
+
+/**
+ *  Forgets the floors, e.g. when positioning stops
+ */
+- (void)reset;
+
+@end
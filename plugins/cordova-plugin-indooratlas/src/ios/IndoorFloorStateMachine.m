@@ -0,0 +1,224 @@
+
+#import "IndoorFloorStateMachine.h"
+#import "IndoorTimingWheel.h"
+
+const double IndoorFloorConfirmCertainty = 0.9;
+const double IndoorFloorMinCertainty = 0.5;
+const int64_t IndoorFloorDwellNearConnectorMs = 2000;
+const int64_t IndoorFloorDwellMs = 8000;
+const double IndoorFloorConnectorRadiusMeters = 15;
+
+static const double kMetersPerDegree = 6371000.0 * M_PI / 180.0;
+
+typedef struct {
+    double latitude;
+    double longitude;
+    NSInteger floor;
+} IndoorConnector;
+
+@implementation IndoorFloorStateMachine {
+    IndoorTimingWheel *_timingWheel;
+    NSData *_connectors;
+    BOOL _hasFloor;
+    NSInteger _confirmedFloor;
+    double _confirmedCertainty;
+    BOOL _confirmedNearConnector;
+    int64_t _confirmedTime;
+    BOOL _hasTentative;
+    NSInteger _tentativeFloor;
+    IndoorTimeout *_dwell;
+    double _lastCertainty;
+    BOOL _lastNearConnector;
+    int64_t _lastTime;
+}
+
+- (instancetype)initWithTimingWheel:(IndoorTimingWheel *)timingWheel
+{
+    self = [super init];
+    if (self) {
+        _timingWheel = timingWheel;
+        _connectors = [NSData data];
+    }
+    return self;
+}
+
+- (void)observe:(IndoorFloorChange)onChange
+{
+    @synchronized (self) {
+        _onChange = [onChange copy];
+        if (!_hasFloor) {
+            return;
+        }
+        [self fire:YES floor:_confirmedFloor confirmedFloor:_confirmedFloor certainty:_confirmedCertainty
+              near:_confirmedNearConnector time:_confirmedTime];
+        if (_hasTentative) {
+            [self fire:NO floor:_tentativeFloor confirmedFloor:_confirmedFloor certainty:_lastCertainty
+                  near:_lastNearConnector time:_lastTime];
+        }
+    }
+}
+
+- (BOOL)setGraph:(NSString *)graphJson
+{
+    NSData *data = [graphJson dataUsingEncoding:NSUTF8StringEncoding];
+    NSDictionary *graph = data != nil ? [NSJSONSerialization JSONObjectWithData:data options:0 error:nil] : nil;
+    if (![graph isKindOfClass:[NSDictionary class]]) {
+        return NO;
+    }
+    NSArray *nodes = graph[@"nodes"];
+    NSArray *edges = graph[@"edges"];
+    if (![nodes isKindOfClass:[NSArray class]] || ![edges isKindOfClass:[NSArray class]]) {
+        return NO;
+    }
+    NSMutableIndexSet *connectorNodes = [NSMutableIndexSet indexSet];
+    for (NSDictionary *edge in edges) {
+        NSUInteger begin = [edge[@"begin"] unsignedIntegerValue];
+        NSUInteger end = [edge[@"end"] unsignedIntegerValue];
+        if (begin >= nodes.count || end >= nodes.count) {
+            return NO;
+        }
+        if ([nodes[begin][@"floor"] integerValue] != [nodes[end][@"floor"] integerValue]) {
+            [connectorNodes addIndex:begin];
+            [connectorNodes addIndex:end];
+        }
+    }
+    NSMutableData *connectors = [NSMutableData dataWithLength:connectorNodes.count * sizeof(IndoorConnector)];
+    IndoorConnector *out = connectors.mutableBytes;
+    __block NSUInteger j = 0;
+    [connectorNodes enumerateIndexesUsingBlock:^(NSUInteger i, BOOL *stop) {
+        NSDictionary *node = nodes[i];
+        out[j].latitude = [node[@"latitude"] doubleValue];
+        out[j].longitude = [node[@"longitude"] doubleValue];
+        out[j].floor = [node[@"floor"] integerValue];
+        j++;
+    }];
+    @synchronized (self) {
+        _connectors = connectors;
+    }
+    return YES;
+}
+
+- (void)onFixAtLatitude:(double)latitude longitude:(double)longitude floor:(NSInteger)floor
+              certainty:(double)certainty time:(int64_t)timeMs
+{
+    @synchronized (self) {
+        if (!_hasFloor) {
+            _hasFloor = YES;
+            _confirmedFloor = floor;
+            _confirmedCertainty = certainty;
+            _confirmedNearConnector = [self isNearConnectorAtLatitude:latitude longitude:longitude floor:floor];
+            _confirmedTime = timeMs;
+            [self fire:YES floor:floor confirmedFloor:floor certainty:certainty near:_confirmedNearConnector time:timeMs];
+            return;
+        }
+        if (floor == _confirmedFloor) {
+            if (_hasTentative) {
+                [self dropTentative];
+                [self fire:NO floor:floor confirmedFloor:floor certainty:certainty
+                      near:[self isNearConnectorAtLatitude:latitude longitude:longitude floor:floor] time:timeMs];
+            }
+            return;
+        }
+        BOOL near = [self isNearConnectorAtLatitude:latitude longitude:longitude floor:floor];
+        _lastCertainty = certainty;
+        _lastNearConnector = near;
+        _lastTime = timeMs;
+        if (near && certainty >= IndoorFloorConfirmCertainty) {
+            [self confirm:floor];
+            return;
+        }
+        if (_hasTentative && floor == _tentativeFloor) {
+            return;
+        }
+        [self dropTentative];
+        _hasTentative = YES;
+        _tentativeFloor = floor;
+        __weak IndoorFloorStateMachine *weakSelf = self;
+        _dwell = [_timingWheel schedule:near ? IndoorFloorDwellNearConnectorMs : IndoorFloorDwellMs block:^{
+            [weakSelf onDwell:floor];
+        }];
+        [self fire:NO floor:floor confirmedFloor:_confirmedFloor certainty:certainty near:near time:timeMs];
+    }
+}
+
+- (void)reset
+{
+    @synchronized (self) {
+        [self dropTentative];
+        _hasFloor = NO;
+    }
+}
+
+- (void)onDwell:(NSInteger)tentativeFloor
+{
+    @synchronized (self) {
+        if (!_hasTentative || _tentativeFloor != tentativeFloor) {
+            return;
+        }
+        _dwell = nil;
+        // The last fix must still be reasonably sure of the tentative floor
+        if (isnan(_lastCertainty) || _lastCertainty >= IndoorFloorMinCertainty) {
+            [self confirm:tentativeFloor];
+        } else {
+            [self dropTentative];
+            [self fire:NO floor:_confirmedFloor confirmedFloor:_confirmedFloor certainty:_lastCertainty
+                  near:_lastNearConnector time:_lastTime];
+        }
+    }
+}
+
+// Called with the lock held
+- (void)confirm:(NSInteger)floor
+{
+    NSInteger previous = _confirmedFloor;
+    [self dropTentative];
+    _confirmedFloor = floor;
+    _confirmedCertainty = _lastCertainty;
+    _confirmedNearConnector = _lastNearConnector;
+    _confirmedTime = _lastTime;
+    [self fire:YES floor:floor confirmedFloor:previous certainty:_lastCertainty near:_lastNearConnector time:_lastTime];
+}
+
+// Called with the lock held
+- (void)dropTentative
+{
+    [_dwell cancel];
+    _dwell = nil;
+    _hasTentative = NO;
+}
+
+// Called with the lock held
+- (BOOL)isNearConnectorAtLatitude:(double)latitude longitude:(double)longitude floor:(NSInteger)floor
+{
+    NSUInteger count = _connectors.length / sizeof(IndoorConnector);
+    if (count == 0) {
+        return NO;
+    }
+    const IndoorConnector *connectors = _connectors.bytes;
+    double metersPerLongitudeDegree = kMetersPerDegree * cos(latitude * M_PI / 180.0);
+    double radius2 = IndoorFloorConnectorRadiusMeters * IndoorFloorConnectorRadiusMeters;
+    for (NSUInteger i = 0; i < count; i++) {
+        // Either end of the transition counts, the fix may be on either floor
+        if (connectors[i].floor != floor && (!_hasFloor || connectors[i].floor != _confirmedFloor)) {
+            continue;
+        }
+        double dy = (connectors[i].latitude - latitude) * kMetersPerDegree;
+        double dx = (connectors[i].longitude - longitude) * metersPerLongitudeDegree;
+        if (dx * dx + dy * dy <= radius2) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+// Called with the lock held
+- (void)fire:(BOOL)confirmed floor:(NSInteger)floor confirmedFloor:(NSInteger)confirmedFloor certainty:(double)certainty
+        near:(BOOL)near time:(int64_t)timeMs
+{
+    IndoorFloorChange onChange = _onChange;
+    if (onChange != nil) {
+        onChange(confirmed, floor, confirmedFloor, certainty, near, timeMs);
+    }
+}
+
+@end
@@ -3,6 +3,8 @@
 #import <CoreLocation/CoreLocation.h>
 #import <Cordova/CDVPlugin.h>
 #import "IndoorAtlasLocationService.h"
+#import "IndoorVenueFrame.h"
+#import "IndoorCacheBudget.h"
 #import <IndoorAtlasWayfinding/wayfinding.h>
 
 enum IndoorLocationStatus {
@@ -12,7 +14,8 @@ enum IndoorLocationStatus {
     INVALID_ACCESS_TOKEN,
     INITIALIZATION_ERROR,
     FLOORPLAN_UNAVAILABLE,
-    UNSPECIFIED_ERROR
+    UNSPECIFIED_ERROR,
+    FLOORPLAN_UNDEFINED
 };
 
 enum IACurrentStatus {
@@ -29,10 +32,14 @@ typedef NSUInteger IndoorLocationStatus;
 
 @property (nonatomic, assign) IndoorLocationStatus locationStatus;
 @property (nonatomic, strong) CLLocation *locationInfo;
+@property (nonatomic, assign) IndoorLocalPoint localPoint;
 @property (nonatomic, strong) IARegion *region;
 @property (nonatomic, strong) NSString *floorID;
 @property (nonatomic, strong) NSMutableArray *locationCallbacks;
 @property (nonatomic, strong) NSMutableDictionary *watchCallbacks;
+// Message sent to JavaScript, rebuilt in place once per fix and shared by all callbacks
+@property (nonatomic, strong) NSMutableDictionary *locationMessage;
+@property (nonatomic, assign) BOOL locationMessageValid;
 
 @end
 
@@ -52,6 +59,7 @@ typedef NSUInteger IndoorLocationStatus;
 @property (nonatomic, strong) CLLocationManager *locationManager;
 @property (nonatomic, strong) IndoorLocationInfo *locationData;
 @property (nonatomic, strong) IndoorRegionInfo *regionData;
+@property (nonatomic, strong) IndoorVenueFrame *venueFrame;
 @property (nonatomic, strong) IAWayfinding *wayfinder;
 @property (nonatomic, strong) NSMutableArray *wayfinderInstances;
 
@@ -67,8 +75,11 @@ typedef NSUInteger IndoorLocationStatus;
 - (void)removeHeadingCallback:(CDVInvokedUrlCommand *)command;
 - (void)addStatusChangedCallback:(CDVInvokedUrlCommand *)command;
 - (void)removeStatusCallback:(CDVInvokedUrlCommand *)command;
+- (void)addFloorCallback:(CDVInvokedUrlCommand *)command;
+- (void)removeFloorCallback:(CDVInvokedUrlCommand *)command;
 - (void)setPosition:(CDVInvokedUrlCommand *)command;
 - (void)fetchFloorplan:(CDVInvokedUrlCommand *)command;
+- (void)fetchFloorPlans:(CDVInvokedUrlCommand *)command;
 - (void)coordinateToPoint:(CDVInvokedUrlCommand *)command;
 - (void)pointToCoordinate:(CDVInvokedUrlCommand *)command;
 - (void)sendCoordinateToPoint:(CGPoint)point;
@@ -79,5 +90,33 @@ typedef NSUInteger IndoorLocationStatus;
 - (void)setSensitivities:(CDVInvokedUrlCommand *)command;
 - (void)buildWayfinder:(CDVInvokedUrlCommand *)command;
 - (void)computeRoute:(CDVInvokedUrlCommand *)command;
+- (void)computeRouteOnFloorPlan:(CDVInvokedUrlCommand *)command;
+- (void)buildExitField:(CDVInvokedUrlCommand *)command;
+- (void)getExitGuidance:(CDVInvokedUrlCommand *)command;
+- (void)closeExit:(CDVInvokedUrlCommand *)command;
+- (void)openExit:(CDVInvokedUrlCommand *)command;
+- (void)applyExitDelta:(CDVInvokedUrlCommand *)command;
+- (void)getCacheReport:(CDVInvokedUrlCommand *)command;
+- (void)simulateMemoryPressure:(CDVInvokedUrlCommand *)command;
+- (void)configureBackground:(CDVInvokedUrlCommand *)command;
+- (void)clearBackground:(CDVInvokedUrlCommand *)command;
+- (void)fetchEvents:(CDVInvokedUrlCommand *)command;
+- (void)ackEvents:(CDVInvokedUrlCommand *)command;
+- (void)getHistory:(CDVInvokedUrlCommand *)command;
+- (void)clearHistory:(CDVInvokedUrlCommand *)command;
+- (void)configureUplink:(CDVInvokedUrlCommand *)command;
+- (void)clearUplink:(CDVInvokedUrlCommand *)command;
+- (void)getCostReport:(CDVInvokedUrlCommand *)command;
+- (void)resetCostReport:(CDVInvokedUrlCommand *)command;
+- (void)startTracing:(CDVInvokedUrlCommand *)command;
+- (void)stopTracing:(CDVInvokedUrlCommand *)command;
+- (void)dumpTrace:(CDVInvokedUrlCommand *)command;
+- (void)runBenchmark:(CDVInvokedUrlCommand *)command;
+- (void)bridgeEcho:(CDVInvokedUrlCommand *)command;
+- (void)bridgeStream:(CDVInvokedUrlCommand *)command;
+- (void)bridgeStop:(CDVInvokedUrlCommand *)command;
+- (void)openStreamChannel:(CDVInvokedUrlCommand *)command;
+- (void)ackStreamChannel:(CDVInvokedUrlCommand *)command;
+- (void)getState:(CDVInvokedUrlCommand *)command;
 
 @end
@@ -1,4 +1,74 @@
 #import "IndoorLocation.h"
+#import "IndoorTaskScheduler.h"
+#import "IndoorTimingWheel.h"
+#import "IndoorBenchmarks.h"
+#import "IndoorBridgeBenchmark.h"
+#import "IndoorStreamChannel.h"
+#import "IndoorTraceRecorder.h"
+#import "IndoorCostAccounting.h"
+#import "IndoorCommandQueues.h"
+#import "IndoorBackgroundProcessor.h"
+#import "IndoorEventQueue.h"
+#import "IndoorPositionHistory.h"
+#import "IndoorPositioningState.h"
+#import "IndoorFloorStateMachine.h"
+#import "IndoorExitDistanceField.h"
+#import "IndoorUplink.h"
+#import "IndoorEventFilter.h"
+#import <UserNotifications/UserNotifications.h>
+static const uint32_t kEncodedRouteHeaderBytes = 40;
+static const int32_t kEncodedRouteVersion = 1;
+enum { kEncodedRouteStride = 7 };
+
+static void IndoorPutDoubleLE(uint8_t *p, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    bits = CFSwapInt64HostToLittle(bits);
+    memcpy(p, &bits, 8);
+}
+
+static void IndoorPutInt32LE(uint8_t *p, int32_t value)
+{
+    uint32_t bits = CFSwapInt32HostToLittle((uint32_t)value);
+    memcpy(p, &bits, 4);
+}
+
+/**
+ * Route in venue frame millimetres as RouteBuffer.java encodes it: little-endian
+ * float64 origin latitude and longitude and millimetres per degree of latitude
+ * and longitude, int32 leg count and version, 7 int32 per leg (begin east, north,
+ * floor, end east, north, floor, edge index), padding to 8 bytes and a float64
+ * length per leg
+ */
+static NSData *IndoorEncodeRoute(NSArray<IARoutingLeg *> *legs, IndoorVenueFrame *frame)
+{
+    uint32_t count = (uint32_t)legs.count;
+    uint32_t intBytes = count * kEncodedRouteStride * 4;
+    uint32_t lengthsOffset = kEncodedRouteHeaderBytes + ((intBytes + 7) & ~7u);
+    NSMutableData *data = [NSMutableData dataWithLength:lengthsOffset + count * 8];
+    uint8_t *bytes = data.mutableBytes;
+    IndoorPutDoubleLE(bytes, frame.origin.latitude);
+    IndoorPutDoubleLE(bytes + 8, frame.origin.longitude);
+    IndoorPutDoubleLE(bytes + 16, [frame millimetresPerDegreeLatitude]);
+    IndoorPutDoubleLE(bytes + 24, [frame millimetresPerDegreeLongitude]);
+    IndoorPutInt32LE(bytes + 32, (int32_t)count);
+    IndoorPutInt32LE(bytes + 36, kEncodedRouteVersion);
+    for (uint32_t i = 0; i < count; i++) {
+        IARoutingLeg *leg = legs[i];
+        IndoorLocalPoint begin = [frame toLocal:CLLocationCoordinate2DMake(leg.begin.latitude, leg.begin.longitude)];
+        IndoorLocalPoint end = [frame toLocal:CLLocationCoordinate2DMake(leg.end.latitude, leg.end.longitude)];
+        NSNumber *edgeIndex = leg.edgeIndexInOriginalGraph;
+        int32_t values[kEncodedRouteStride] = { begin.east, begin.north, (int32_t)leg.begin.floor,
+            end.east, end.north, (int32_t)leg.end.floor, edgeIndex != nil ? [edgeIndex intValue] : -1 };
+        for (int j = 0; j < kEncodedRouteStride; j++) {
+            IndoorPutInt32LE(bytes + kEncodedRouteHeaderBytes + (i * kEncodedRouteStride + j) * 4, values[j]);
+        }
+        IndoorPutDoubleLE(bytes + lengthsOffset + i * 8, leg.length);
+    }
+    return data;
+}
+
 #pragma mark IndoorLocationInfo
 
 @implementation IndoorLocationInfo
@@ -10,6 +80,8 @@
         self.locationInfo = nil;
         self.locationCallbacks = nil;
         self.watchCallbacks = nil;
+        self.locationMessage = [NSMutableDictionary dictionaryWithCapacity:10];
+        self.locationMessageValid = NO;
     }
     return self;
 }
@@ -38,10 +110,47 @@
 #pragma mark -
 
 #pragma mark IndoorLocation
-@interface IndoorLocation ()<IALocationDelegate> {
+@interface IndoorLocation ()<IALocationDelegate, IndoorBackgroundSink> {
+    // Filled in place for the subscription filters, on the queue of their updates
+    IndoorEventFilterValues _positionValues;
+    IndoorEventFilterValues _regionValues;
+    IndoorEventFilterValues _sensorValues;
 }
 
-@property (nonatomic, strong) IndoorAtlasLocationService *IAlocationInfo;
+// Set on the positioning queue, read by the other queues
+@property (atomic, strong) IndoorAtlasLocationService *IAlocationInfo;
+// Region watches live on the geofence queue; the positioning queue only needs their number
+@property (atomic, assign) NSUInteger regionWatchCount;
+@property (nonatomic, strong) IndoorBackgroundProcessor *backgroundProcessor;
+@property (atomic, strong) NSString *backgroundCallbackID;
+// Opened on first use, see openEventQueue
+@property (atomic, strong) IndoorEventQueue *eventQueue;
+// Opened on first use, see openPositionHistory
+@property (atomic, strong) IndoorPositionHistory *positionHistory;
+// Set by configureUplink
+@property (atomic, strong) IndoorUplink *uplink;
+@property (nonatomic, strong) IndoorBridgeBenchmark *bridgeBenchmark;
+// Subscriptions with a stream id get their updates on the stream channel;
+// changed and read on the positioning queue
+@property (nonatomic, strong) IndoorStreamChannel *streamChannel;
+@property (nonatomic, strong) NSMutableDictionary<NSString *, NSNumber *> *watchStreams;
+@property (nonatomic, assign) NSInteger attitudeStream;
+@property (nonatomic, assign) NSInteger headingStream;
+// Versioned record read by getState, updated by the SDK callbacks
+@property (nonatomic, strong) IndoorPositioningState *positioningState;
+@property (nonatomic, strong) IndoorFloorStateMachine *floorStateMachine;
+@property (atomic, strong) NSString *floorCallbackID;
+@property (atomic, strong) IndoorExitDistanceField *exitField;
+// Venue the venue frame belongs to, nil if it was anchored outside a venue
+@property (nonatomic, strong) NSString *venueId;
+// Filters of the subscriptions that have one; watches and sensors on the positioning
+// queue, region watches on the geofence queue
+@property (nonatomic, strong) NSMutableDictionary<NSString *, IndoorEventFilter *> *watchFilters;
+@property (nonatomic, strong) NSMutableDictionary<NSString *, IndoorEventFilter *> *regionFilters;
+@property (nonatomic, strong) IndoorEventFilter *attitudeFilter;
+@property (nonatomic, strong) IndoorEventFilter *headingFilter;
+// A position was handled natively and the watches have not seen it
+@property (nonatomic, assign) BOOL missedLocation;
 @property (nonatomic, strong) NSString *watchingFloorPlanID;
 @property (nonatomic, strong) NSString *floorPlanCallbackID;
 @property (nonatomic, strong) NSString *coordinateToPointCallbackID;
@@ -52,6 +161,15 @@
 @property (nonatomic, strong) NSString *addAttitudeUpdateCallbackID;
 @property (nonatomic, strong) NSString *addHeadingUpdateCallbackID;
 @property (nonatomic, strong) NSString *addStatusUpdateCallbackID;
+@property (nonatomic, strong) IndoorCacheBudget *cacheBudget;
+@property (nonatomic, strong) IndoorFloorPlanCache *floorPlanCache;
+@property (atomic, assign) unsigned long long wayfinderGraphBytes;
+// Timeouts of getLocation requests by callback id, and of watches by watch id
+@property (nonatomic, strong) NSMutableDictionary<NSString *, IndoorTimeout *> *requestTimeouts;
+@property (nonatomic, strong) NSMutableDictionary<NSString *, IndoorTimeout *> *watchTimeouts;
+@property (nonatomic, strong) NSMutableDictionary<NSString *, NSNumber *> *watchTimeoutMs;
+// Worst accuracy in metres the getLocation requests that have one accept, by callback id
+@property (nonatomic, strong) NSMutableDictionary<NSString *, NSNumber *> *requestAccuracies;
 
 @end
 
@@ -67,6 +185,29 @@
     __locationStarted = NO;
     self.locationData = nil;
     self.regionData = nil;
+    self.requestTimeouts = [NSMutableDictionary dictionary];
+    self.watchTimeouts = [NSMutableDictionary dictionary];
+    self.watchTimeoutMs = [NSMutableDictionary dictionary];
+    self.requestAccuracies = [NSMutableDictionary dictionary];
+    self.watchFilters = [NSMutableDictionary dictionary];
+    self.regionFilters = [NSMutableDictionary dictionary];
+    self.backgroundProcessor = [[IndoorBackgroundProcessor alloc] initWithSink:self timingWheel:[IndoorTimingWheel sharedWheel]];
+    self.bridgeBenchmark = [[IndoorBridgeBenchmark alloc] init];
+    self.streamChannel = [[IndoorStreamChannel alloc] init];
+    self.positioningState = [[IndoorPositioningState alloc] init];
+    self.floorStateMachine = [[IndoorFloorStateMachine alloc] initWithTimingWheel:[IndoorTimingWheel sharedWheel]];
+    self.watchStreams = [NSMutableDictionary dictionary];
+    [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(onEnterBackground:) name:UIApplicationDidEnterBackgroundNotification object:nil];
+    [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(onEnterForeground:) name:UIApplicationWillEnterForegroundNotification object:nil];
+
+    self.cacheBudget = [[IndoorCacheBudget alloc] initWithBudget:[IndoorCacheBudget defaultBudget]];
+    self.floorPlanCache = [[IndoorFloorPlanCache alloc] initWithBudget:self.cacheBudget];
+    [self.cacheBudget registerCache:self.floorPlanCache];
+    // Graphs are referenced by id from JavaScript, so they are accounted but never evicted
+    __weak IndoorLocation *weakSelf = self;
+    [self.cacheBudget registerCache:[[IndoorBlockCache alloc] initWithName:@"wayfinders" tier:IndoorCacheTierCritical residentBytes:^unsigned long long{
+        return weakSelf.wayfinderGraphBytes;
+    } trim:nil]];
 }
 
 - (BOOL)isAuthorized
@@ -135,9 +276,13 @@
     NSUInteger code = [CLLocationManager authorizationStatus];
     if (code == kCLAuthorizationStatusNotDetermined && ([self.locationManager respondsToSelector:@selector(requestAlwaysAuthorization)] || [self.locationManager respondsToSelector:@selector(requestWhenInUseAuthorization)])) { //iOS8+
         if([[NSBundle mainBundle] objectForInfoDictionaryKey:@"NSLocationWhenInUseUsageDescription"]) {
-            [self.locationManager requestWhenInUseAuthorization];
+            [IndoorCommandQueues onMain:^{
+                [self.locationManager requestWhenInUseAuthorization];
+            }];
         } else if([[NSBundle mainBundle] objectForInfoDictionaryKey:@"NSLocationAlwaysUsageDescription"]) {
-            [self.locationManager requestAlwaysAuthorization];
+            [IndoorCommandQueues onMain:^{
+                [self.locationManager requestAlwaysAuthorization];
+            }];
         } else {
             NSLog(@"[Warning] No NSLocationAlwaysUsageDescription or NSLocationWhenInUseUsageDescription key is defined in the Info.plist file.");
         }
@@ -151,7 +296,10 @@
     //[self.locationManager stopUpdatingLocation];
     //[self.locationManager startUpdatingLocation];
     __locationStarted = YES;
-    [self.locationManager stopUpdatingLocation];
+    [self.positioningState setRunning:YES];
+    [IndoorCommandQueues onMain:^{
+        [self.locationManager stopUpdatingLocation];
+    }];
     [self.IAlocationInfo startPositioning:self.watchingFloorPlanID];
 
 }
@@ -163,7 +311,7 @@
     if(self.locationData && (self.locationData.watchCallbacks.count > 0 ||self.locationData.locationCallbacks.count > 0)) {
         stopLocationservice = NO;
     }
-    else if(self.regionData && self.regionData.watchCallbacks.count > 0) {
+    else if(self.regionWatchCount > 0 || [self.backgroundProcessor isEnabled]) {
         stopLocationservice = NO;
     }
     if (stopLocationservice) {
@@ -172,8 +320,12 @@
                 return;
             }
 
-            [self.locationManager stopUpdatingLocation];
+            [IndoorCommandQueues onMain:^{
+                [self.locationManager stopUpdatingLocation];
+            }];
             __locationStarted = NO;
+            [self.positioningState setRunning:NO];
+            [self.floorStateMachine reset];
         }
         [self.IAlocationInfo stopPositioning];
     }
@@ -191,28 +343,39 @@
         [posError setObject:@"Position not available" forKey:@"message"];
         result = [CDVPluginResult resultWithStatus:CDVCommandStatus_ERROR messageAsDictionary:posError];
     } else if (lData && lData.locationInfo) {
-        CLLocation *lInfo = lData.locationInfo;
-        NSMutableDictionary *returnInfo = [NSMutableDictionary dictionaryWithCapacity:10];
-        NSNumber *timestamp = [NSNumber numberWithDouble:([lInfo.timestamp timeIntervalSince1970] * 1000)];
-        [returnInfo setObject:timestamp forKey:@"timestamp"];
-        [returnInfo setObject:[NSNumber numberWithDouble:lInfo.speed] forKey:@"velocity"];
-        [returnInfo setObject:[NSNumber numberWithDouble:lInfo.verticalAccuracy] forKey:@"altitudeAccuracy"];
-        [returnInfo setObject:[NSNumber numberWithDouble:lInfo.horizontalAccuracy] forKey:@"accuracy"];
-        [returnInfo setObject:[NSNumber numberWithDouble:lInfo.course] forKey:@"heading"];
-        [returnInfo setObject:[NSNumber numberWithDouble:lInfo.altitude] forKey:@"altitude"];
-        [returnInfo setObject:[NSNumber numberWithDouble:lInfo.coordinate.latitude] forKey:@"latitude"];
-        [returnInfo setObject:[NSNumber numberWithDouble:lInfo.coordinate.longitude] forKey:@"longitude"];
-
-        [returnInfo setObject:lData.floorID forKey:@"flr"];
-        if (lData.region != nil) {
-            [returnInfo setObject:[self formatRegionInfo:lData.region andTransitionType:TRANSITION_TYPE_UNKNOWN] forKey:@"region"];
+        NSMutableDictionary *returnInfo = lData.locationMessage;
+        // Filled once per fix; the result is serialized when it is sent, so the
+        // same dictionary can back every callback
+        if (!lData.locationMessageValid) {
+            CLLocation *lInfo = lData.locationInfo;
+            NSNumber *timestamp = [NSNumber numberWithDouble:([lInfo.timestamp timeIntervalSince1970] * 1000)];
+            [returnInfo setObject:timestamp forKey:@"timestamp"];
+            [returnInfo setObject:[NSNumber numberWithDouble:lInfo.speed] forKey:@"velocity"];
+            [returnInfo setObject:[NSNumber numberWithDouble:lInfo.verticalAccuracy] forKey:@"altitudeAccuracy"];
+            [returnInfo setObject:[NSNumber numberWithDouble:lInfo.horizontalAccuracy] forKey:@"accuracy"];
+            [returnInfo setObject:[NSNumber numberWithDouble:lInfo.course] forKey:@"heading"];
+            [returnInfo setObject:[NSNumber numberWithDouble:lInfo.altitude] forKey:@"altitude"];
+            [returnInfo setObject:[NSNumber numberWithDouble:lInfo.coordinate.latitude] forKey:@"latitude"];
+            [returnInfo setObject:[NSNumber numberWithDouble:lInfo.coordinate.longitude] forKey:@"longitude"];
+
+            [returnInfo setObject:lData.floorID forKey:@"flr"];
+            if (lData.region != nil) {
+                [returnInfo setObject:[self formatRegionInfo:lData.region andTransitionType:TRANSITION_TYPE_UNKNOWN] forKey:@"region"];
+            } else {
+                [returnInfo removeObjectForKey:@"region"];
+            }
+            lData.locationMessageValid = YES;
         }
 
         result = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:returnInfo];
         [result setKeepCallbackAsBool:keepCallback];
     }
     if (result) {
+        IndoorTraceBegin("bridge", "sendLocation");
+        IndoorCostEnter();
         [self.commandDelegate sendPluginResult:result callbackId:callbackId];
+        IndoorCostExit(IndoorCostBridge, "location");
+        IndoorTraceEnd("bridge", "sendLocation");
     }
 }
 
@@ -250,6 +413,7 @@
     }
 
     [self.locationData.locationCallbacks removeAllObjects];
+    [self.requestAccuracies removeAllObjects];
 
     for (NSString *callbackId in self.locationData.watchCallbacks) {
         [self.commandDelegate sendPluginResult:result callbackId:callbackId];
@@ -258,6 +422,11 @@
 
 - (void)returnAttitudeInformation:(double)x y:(double)y z:(double)z w:(double)w timestamp:(NSDate *)timestamp
 {
+    if (self.attitudeStream > 0 && [self.streamChannel hasStream:self.attitudeStream]) {
+        double sample[IndoorStreamAttitudeFields] = { x, y, z, w, [timestamp timeIntervalSinceReferenceDate] };
+        [self.streamChannel offer:self.attitudeStream sample:sample];
+        return;
+    }
     if (_addAttitudeUpdateCallbackID != nil) {
         CDVPluginResult *pluginResult;
         
@@ -270,12 +439,21 @@
         [result setObject:[NSNumber numberWithDouble:w] forKey:@"w"];
         pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:result];
         [pluginResult setKeepCallbackAsBool:YES];
+        IndoorTraceBegin("bridge", "sendOrientation");
+        IndoorCostEnter();
         [self.commandDelegate sendPluginResult:pluginResult callbackId:self.addAttitudeUpdateCallbackID];
+        IndoorCostExit(IndoorCostBridge, "orientation");
+        IndoorTraceEnd("bridge", "sendOrientation");
     }
 }
 
 - (void)returnHeadingInformation:(double)heading timestamp:(NSDate *)timestamp
 {
+    if (self.headingStream > 0 && [self.streamChannel hasStream:self.headingStream]) {
+        double sample[IndoorStreamHeadingFields] = { heading, [timestamp timeIntervalSinceReferenceDate] };
+        [self.streamChannel offer:self.headingStream sample:sample];
+        return;
+    }
     if (_addHeadingUpdateCallbackID != nil) {
         CDVPluginResult *pluginResult;
         
@@ -285,7 +463,11 @@
         [result setObject:[NSNumber numberWithDouble:heading] forKey:@"trueHeading"];
         pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:result];
         [pluginResult setKeepCallbackAsBool:YES];
+        IndoorTraceBegin("bridge", "sendHeading");
+        IndoorCostEnter();
         [self.commandDelegate sendPluginResult:pluginResult callbackId:self.addHeadingUpdateCallbackID];
+        IndoorCostExit(IndoorCostBridge, "heading");
+        IndoorTraceEnd("bridge", "sendHeading");
     }
 }
 
@@ -316,20 +498,86 @@
 }
 - (void)dealloc
 {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [self.eventQueue close];
     self.locationManager.delegate = nil;
 }
 
+/**
+ * From now on events are handled natively if background processing is configured
+ */
+- (void)onEnterBackground:(NSNotification *)notification
+{
+    IndoorTraceInstant("background", "pause");
+    [self.backgroundProcessor setBackground:YES];
+    // The app may be suspended or killed from now on, do not wait for the group commit
+    IndoorEventQueue *queue = self.eventQueue;
+    IndoorUplink *uplink = self.uplink;
+    IndoorPositionHistory *history = self.positionHistory;
+    if (queue != nil || uplink != nil || history != nil) {
+        [[IndoorCommandQueues sharedQueues] dispatch:IndoorCommandQueueResources block:^{
+            [queue sync];
+            [uplink sync];
+            [history sync];
+        }];
+    }
+}
+
+/**
+ * Delivers the occupancy batch and the latest position, which the watches
+ * missed while in the background
+ */
+- (void)onEnterForeground:(NSNotification *)notification
+{
+    IndoorTraceInstant("background", "resume");
+    BOOL wasActive = [self.backgroundProcessor isActive];
+    [self.backgroundProcessor setBackground:NO];
+    if (!wasActive) {
+        return;
+    }
+    [[IndoorCommandQueues sharedQueues] dispatch:IndoorCommandQueuePositioning block:^{
+        if (!self.missedLocation || self.locationData.locationInfo == nil) {
+            return;
+        }
+        self.missedLocation = NO;
+        [self returnLocationToWatches];
+    }];
+}
+
 - (void)onReset
 {
-    [self _stopLocation];
+    [[IndoorCommandQueues sharedQueues] dispatch:IndoorCommandQueuePositioning block:^{
+        [self _stopLocation];
+    }];
     [self.locationManager stopUpdatingHeading];
 }
 
+/**
+ * Re-sends a command on the serial queue of its subsystem, so that neither the
+ * WebView nor the main thread waits on it. Returns NO when already on that queue,
+ * in which case the caller runs the command itself.
+ */
+- (BOOL)dispatchCommand:(CDVInvokedUrlCommand *)command selector:(SEL)selector toQueue:(IndoorCommandQueue)queue
+{
+    IndoorCommandQueues *queues = [IndoorCommandQueues sharedQueues];
+    if ([queues isCurrent:queue]) {
+        return NO;
+    }
+    void (*send)(id, SEL, CDVInvokedUrlCommand *) = (void (*)(id, SEL, CDVInvokedUrlCommand *))[self methodForSelector:selector];
+    [queues dispatch:queue block:^{
+        send(self, selector, command);
+    }];
+    return YES;
+}
+
 
 #pragma mark Expose Methods implementation
 
 - (void)initializeIndoorAtlas:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     NSString *callbackId = command.callbackId;
     CDVPluginResult *pluginResult;
     NSDictionary *options = [command.arguments objectAtIndex:0];
@@ -346,18 +594,27 @@
     else {
         self.IAlocationInfo = [[IndoorAtlasLocationService alloc] init:iakey hash:iasecret];
         self.IAlocationInfo.delegate = self;
-
-        NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:2];
-        [result setObject:[NSNumber numberWithInt:0] forKey:@"code"];
-        [result setObject:@"service Initialize" forKey:@"message"];
-        pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:result];
-        [self.commandDelegate sendPluginResult:pluginResult callbackId:callbackId];
+        self.IAlocationInfo.floorPlanCache = self.floorPlanCache;
+
+        // The service creates its managers on the main thread; blocks sent
+        // there from this queue keep their order, so this one runs after
+        // them and no request sees the service without its managers
+        [IndoorCommandQueues onMain:^{
+            NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:2];
+            [result setObject:[NSNumber numberWithInt:0] forKey:@"code"];
+            [result setObject:@"service Initialize" forKey:@"message"];
+            CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:result];
+            [self.commandDelegate sendPluginResult:pluginResult callbackId:callbackId];
+        }];
     }
 
 }
 
 - (void)setPosition:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     NSString *callbackId = command.callbackId;
 
     if (self.IAlocationInfo == nil) {
@@ -392,6 +649,9 @@
 
 - (void)getLocation:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     NSString *callbackId = command.callbackId;
     if (self.IAlocationInfo == nil) {
         NSMutableDictionary *posError = [NSMutableDictionary dictionaryWithCapacity:2];
@@ -417,22 +677,41 @@
             lData.locationCallbacks = [NSMutableArray arrayWithCapacity:1];
         }
 
-        if (!__locationStarted || _locationData.region == nil) {
-            // add the callbackId into the array so we can call back when get data
-            if (callbackId != nil) {
-                [lData.locationCallbacks addObject:callbackId];
+        // maximumAge in milliseconds and minimumAccuracy in metres, negative for no limit
+        int64_t maximumAge = [[command argumentAtIndex:2 withDefault:@0 andClass:[NSNumber class]] longLongValue];
+        double minimumAccuracy = [[command argumentAtIndex:3 withDefault:@(-1) andClass:[NSNumber class]] doubleValue];
+        CLLocation *last = lData.locationInfo;
+        if (last != nil && [self isLocation:last accurateTo:minimumAccuracy]
+                && (maximumAge < 0 || -[last.timestamp timeIntervalSinceNow] * 1000 <= maximumAge)) {
+            // Recent and accurate enough, no need to wait for the SDK
+            [self returnLocationInfo:callbackId andKeepCallback:NO];
+            return;
+        }
+        // add the callbackId into the array so we can call back when get data
+        if (callbackId != nil) {
+            [lData.locationCallbacks addObject:callbackId];
+            if (minimumAccuracy >= 0) {
+                self.requestAccuracies[callbackId] = @(minimumAccuracy);
             }
-
-            // Tell the location manager to start notifying us of heading updates
+            [self scheduleTimeoutForCallback:callbackId after:[command argumentAtIndex:1]];
+        }
+        // A running session answers the request with its next position
+        if (!__locationStarted) {
             [self startLocation];
-        } else {
-            [self returnLocationInfo:callbackId andKeepCallback:NO];
         }
     }
 }
 
+- (BOOL)isLocation:(CLLocation *)location accurateTo:(double)minimumAccuracy
+{
+    return minimumAccuracy < 0 || location.horizontalAccuracy <= minimumAccuracy;
+}
+
 - (void)addWatch:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     NSString *callbackId = command.callbackId;
     if (self.IAlocationInfo == nil) {
         NSMutableDictionary *posError = [NSMutableDictionary dictionaryWithCapacity:2];
@@ -443,6 +722,10 @@
         return;
     }
     NSString *timerId = [command argumentAtIndex:0];
+    IndoorEventFilter *filter = nil;
+    if (![self compileFilter:command atIndex:3 kind:IndoorEventFilterKindPosition filter:&filter]) {
+        return;
+    }
 
     if (!self.locationData) {
         self.locationData = [[IndoorLocationInfo alloc] init];
@@ -455,6 +738,15 @@
 
     // add the callbackId into the dictionary so we can call back whenever get data
     [lData.watchCallbacks setObject:callbackId forKey:timerId];
+    [self.watchFilters setValue:filter forKey:timerId];
+    NSInteger streamId = [[command argumentAtIndex:4 withDefault:@0 andClass:[NSNumber class]] integerValue];
+    if (streamId > 0) {
+        [self.streamChannel addStream:streamId fields:IndoorStreamPositionFields latestOnly:NO];
+        [self.watchStreams setObject:@(streamId) forKey:timerId];
+    } else {
+        [self.watchStreams removeObjectForKey:timerId];
+    }
+    [self scheduleTimeoutForWatch:timerId after:[command argumentAtIndex:2]];
 
     if ([self isLocationServicesEnabled] == NO) {
         NSMutableDictionary *posError = [NSMutableDictionary dictionaryWithCapacity:2];
@@ -472,7 +764,17 @@
 
 - (void)clearWatch:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     NSString *timerId = [command argumentAtIndex:0];
+    [self cancelWatchTimeout:timerId];
+    [self.watchFilters removeObjectForKey:timerId];
+    NSNumber *streamId = [self.watchStreams objectForKey:timerId];
+    if (streamId != nil) {
+        [self.streamChannel removeStream:[streamId integerValue]];
+        [self.watchStreams removeObjectForKey:timerId];
+    }
 
     if (self.locationData && self.locationData.watchCallbacks && [self.locationData.watchCallbacks objectForKey:timerId]) {
         [self.locationData.watchCallbacks removeObjectForKey:timerId];
@@ -484,6 +786,9 @@
 
 - (void)addRegionWatch:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueGeofence]) {
+        return;
+    }
     NSString *callbackId = command.callbackId;
     if (self.IAlocationInfo == nil) {
         NSMutableDictionary *posError = [NSMutableDictionary dictionaryWithCapacity:2];
@@ -494,6 +799,10 @@
         return;
     }
     NSString *timerId = [command argumentAtIndex:0];
+    IndoorEventFilter *filter = nil;
+    if (![self compileFilter:command atIndex:1 kind:IndoorEventFilterKindRegion filter:&filter]) {
+        return;
+    }
 
     if (!self.regionData) {
         self.regionData = [[IndoorRegionInfo alloc] init];
@@ -506,6 +815,8 @@
 
     // add the callbackId into the dictionary so we can call back whenever get data
     [lData.watchCallbacks setObject:callbackId forKey:timerId];
+    [self.regionFilters setValue:filter forKey:timerId];
+    self.regionWatchCount = [lData.watchCallbacks count];
 
     if ([self isLocationServicesEnabled] == NO) {
         NSMutableDictionary *posError = [NSMutableDictionary dictionaryWithCapacity:2];
@@ -514,70 +825,233 @@
         CDVPluginResult *result = [CDVPluginResult resultWithStatus:CDVCommandStatus_ERROR messageAsDictionary:posError];
         [self.commandDelegate sendPluginResult:result callbackId:callbackId];
     } else {
-        if (!__locationStarted) {
-            // Tell the location manager to start notifying us of location updates
-            [self startLocation];
-        }
+        [[IndoorCommandQueues sharedQueues] dispatch:IndoorCommandQueuePositioning block:^{
+            if (!__locationStarted) {
+                // Tell the location manager to start notifying us of location updates
+                [self startLocation];
+            }
+        }];
     }
 }
 
 - (void)clearRegionWatch:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueGeofence]) {
+        return;
+    }
     NSString *timerId = [command argumentAtIndex:0];
+    [self.regionFilters removeObjectForKey:timerId];
 
     if (self.regionData && self.regionData.watchCallbacks && [self.regionData.watchCallbacks objectForKey:timerId]) {
         [self.regionData.watchCallbacks removeObjectForKey:timerId];
+        self.regionWatchCount = [self.regionData.watchCallbacks count];
         if([self.regionData.watchCallbacks count] == 0) {
-            [self _stopLocation];
+            [[IndoorCommandQueues sharedQueues] dispatch:IndoorCommandQueuePositioning block:^{
+                [self _stopLocation];
+            }];
         }
     }
 }
 
 - (void)addAttitudeCallback:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
+    IndoorEventFilter *filter = nil;
+    if (![self compileFilter:command atIndex:0 kind:IndoorEventFilterKindAttitude filter:&filter]) {
+        return;
+    }
+    self.attitudeFilter = filter;
+    self.attitudeStream = [[command argumentAtIndex:1 withDefault:@0 andClass:[NSNumber class]] integerValue];
+    if (self.attitudeStream > 0) {
+        [self.streamChannel addStream:self.attitudeStream fields:IndoorStreamAttitudeFields latestOnly:YES];
+    }
     _addAttitudeUpdateCallbackID = command.callbackId;
 }
 
 - (void)removeAttitudeCallback:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     _addAttitudeUpdateCallbackID = nil;
+    self.attitudeFilter = nil;
+    [self.streamChannel removeStream:self.attitudeStream];
+    self.attitudeStream = 0;
 }
 
 - (void)addHeadingCallback:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
+    IndoorEventFilter *filter = nil;
+    if (![self compileFilter:command atIndex:0 kind:IndoorEventFilterKindHeading filter:&filter]) {
+        return;
+    }
+    self.headingFilter = filter;
+    self.headingStream = [[command argumentAtIndex:1 withDefault:@0 andClass:[NSNumber class]] integerValue];
+    if (self.headingStream > 0) {
+        [self.streamChannel addStream:self.headingStream fields:IndoorStreamHeadingFields latestOnly:YES];
+    }
     _addHeadingUpdateCallbackID = command.callbackId;
 }
 
 - (void)removeHeadingCallback:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     _addHeadingUpdateCallbackID = nil;
+    self.headingFilter = nil;
+    [self.streamChannel removeStream:self.headingStream];
+    self.headingStream = 0;
 }
 
 - (void)addStatusChangedCallback:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     _addStatusUpdateCallbackID = command.callbackId;
 }
 
 - (void)removeStatusCallback:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     _addStatusUpdateCallbackID = nil;
 }
 
+/**
+ * Sends the tentative and confirmed floor changes of the floor hysteresis to the callback
+ */
+- (void)addFloorCallback:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
+    self.floorCallbackID = command.callbackId;
+    __weak IndoorLocation *weakSelf = self;
+    [self.floorStateMachine observe:^(BOOL confirmed, NSInteger floor, NSInteger confirmedFloor, double certainty,
+                                      BOOL nearConnector, int64_t timeMs) {
+        NSString *callbackId = weakSelf.floorCallbackID;
+        if (callbackId == nil) {
+            return;
+        }
+        NSDictionary *floorInfo = @{@"confirmed": @(confirmed),
+                                    @"floor": @(floor),
+                                    @"confirmedFloor": @(confirmedFloor),
+                                    @"certainty": isnan(certainty) ? [NSNull null] : @(certainty),
+                                    @"nearConnector": @(nearConnector),
+                                    @"timestamp": @(timeMs)};
+        CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:floorInfo];
+        [pluginResult setKeepCallbackAsBool:YES];
+        [weakSelf.commandDelegate sendPluginResult:pluginResult callbackId:callbackId];
+    }];
+}
+
+- (void)removeFloorCallback:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
+    self.floorCallbackID = nil;
+}
+
 - (void)stopLocation:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     [self _stopLocation];
 }
 
-- (void)fetchFloorplan:(CDVInvokedUrlCommand *)command{
+- (void)fetchFloorplan:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueResources]) {
+        return;
+    }
     self.floorPlanCallbackID = command.callbackId;
     NSString *floorplanid = [command argumentAtIndex:0];
     [self.IAlocationInfo fetchFloorplanWithId:floorplanid];
 }
 
+/**
+ * Fetches several floor plans in parallel through the fetch scheduler, which
+ * serves cached ones right away and shares fetches already in flight, and
+ * answers once all have completed with { floorPlans, errors }: the floor plans
+ * in the order of the ids, null where a fetch failed, and
+ * { id, index, code, message } per failure
+ */
+- (void)fetchFloorPlans:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueResources]) {
+        return;
+    }
+    NSArray *floorplanIds = [command argumentAtIndex:0 withDefault:@[] andClass:[NSArray class]];
+    if (self.IAlocationInfo == nil) {
+        [self sendErrorCommand:command withMessage:@"Error: not initialized"];
+        return;
+    }
+
+    NSUInteger count = [floorplanIds count];
+    NSMutableArray *floorPlans = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        [floorPlans addObject:[NSNull null]];
+    }
+    NSMutableArray *errors = [NSMutableArray array];
+    __block NSUInteger remaining = count;
+    void (^send)(void) = ^{
+        NSDictionary *result = @{@"floorPlans": floorPlans, @"errors": errors};
+        CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:result];
+        [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+    };
+    if (count == 0) {
+        send();
+        return;
+    }
+
+    for (NSUInteger i = 0; i < count; i++) {
+        id floorplanId = floorplanIds[i];
+        // null, numbers and the like are undefined ids, not ids to fetch
+        BOOL undefinedId = ![floorplanId isKindOfClass:[NSString class]] || [floorplanId length] == 0;
+        IndoorDeferred *fetch;
+        if (!undefinedId) {
+            fetch = [self.IAlocationInfo floorPlanWithId:floorplanId priority:IndoorFetchPriorityVisible];
+        } else {
+            fetch = [IndoorDeferred rejected:[NSError errorWithDomain:@"IndoorLocation" code:0 userInfo:@{NSLocalizedDescriptionKey: @"Floor plan id is undefined"}]];
+        }
+        [fetch whenComplete:^(IAFloorPlan *floorPlan, NSError *error) {
+            BOOL done;
+            @synchronized (floorPlans) {
+                if (error == nil) {
+                    floorPlans[i] = [self dictionaryFromFloorPlan:floorPlan];
+                } else {
+                    BOOL fetchFailed = [error.domain isEqualToString:@"Service Unavailable"];
+                    [errors addObject:@{@"id": [floorplanId isKindOfClass:[NSString class]] ? floorplanId : [NSNull null],
+                                        @"index": @(i),
+                                        @"code": @(undefinedId ? FLOORPLAN_UNDEFINED : fetchFailed ? FLOORPLAN_UNAVAILABLE : UNSPECIFIED_ERROR),
+                                        @"message": [error localizedDescription] ? [error localizedDescription] : @""}];
+                }
+                done = --remaining == 0;
+            }
+            if (done) {
+                send();
+            }
+        }];
+    }
+}
+
 // CoordinateToPoint Method
 // Gets the arguments from the function call that is done in the Javascript side, then calls IALocationService's getCoordinateToPoint function
 - (void)coordinateToPoint:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueResources]) {
+        return;
+    }
     // Callback id of the call from Javascript side
     self.coordinateToPointCallbackID = command.callbackId;
 
@@ -610,6 +1084,9 @@
 // Gets the arguments from the function call that is done in the Javascript side, then calls IALocationService's getPointToCoordinate function
 - (void)pointToCoordinate:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueResources]) {
+        return;
+    }
     // Callback id of the call from Javascript side
     self.pointToCoordinateCallbackID = command.callbackId;
 
@@ -642,6 +1119,9 @@
 
 - (void)setDistanceFilter:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     self.setDistanceFilterCallbackID = command.callbackId;
     NSString *distance = [command argumentAtIndex:0];
 
@@ -657,6 +1137,9 @@
 
 - (void)getFloorCertainty:(CDVInvokedUrlCommand *)command
 {
+  if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+      return;
+  }
   self.getFloorCertaintyCallbackID = command.callbackId;
   float certainty = [self.IAlocationInfo fetchFloorCertainty];
 
@@ -670,6 +1153,9 @@
 
 - (void)getTraceId:(CDVInvokedUrlCommand *)command
 {
+  if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+      return;
+  }
   self.getTraceIdCallbackID = command.callbackId;
   NSString *traceId = [self.IAlocationInfo fetchTraceId];
 
@@ -683,6 +1169,9 @@
 
 - (void)setSensitivities:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
     NSString *oSensitivity = [command argumentAtIndex:0];
     NSString *hSensitivity = [command argumentAtIndex:1];
     
@@ -703,186 +1192,1201 @@
  */
 - (void)buildWayfinder:(CDVInvokedUrlCommand *)command
 {
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueRouting]) {
+        return;
+    }
     NSString *graphJson = [command argumentAtIndex:0];
     
     if (self.wayfinderInstances == nil) {
         self.wayfinderInstances = [[NSMutableArray alloc] init];
     }
+    NSMutableArray *instances = self.wayfinderInstances;
     
-    int wayfinderId = [self.wayfinderInstances count];
-    
-    @try {
-        IAWayfinding *wf = [[IAWayfinding alloc] initWithGraph:graphJson];
-        [self.wayfinderInstances addObject:wf];
-    } @catch(NSException *exception) {
-        NSLog(@"graph: %@", exception.reason);
-        [self sendErrorCommand:command withMessage:@"Error: graph"];
-    }
-    
-    CDVPluginResult *pluginResult;
-    NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:1];
-    [result setObject: [NSNumber numberWithInteger:wayfinderId] forKey:@"wayfinderId"];
-    pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:result];
-    [self.commandDelegate sendPluginResult:pluginResult callbackId: command.callbackId];
-    
+    // Parsing the graph can take a while for large venues, keep it off the main thread
+    [[IndoorTaskScheduler sharedScheduler] submit:IndoorTaskLaneBackground subsystem:IndoorCostRouting block:^{
+        IAWayfinding *wf;
+        @try {
+            wf = [[IAWayfinding alloc] initWithGraph:graphJson];
+        } @catch(NSException *exception) {
+            NSLog(@"graph: %@", exception.reason);
+            [self sendErrorCommand:command withMessage:@"Error: graph"];
+            return;
+        }
+        
+        NSUInteger wayfinderId;
+        @synchronized (instances) {
+            wayfinderId = [instances count];
+            [instances addObject:wf];
+            // Rough in-memory size of the parsed graph
+            self.wayfinderGraphBytes += 2 * [graphJson length];
+        }
+        if (![self.floorStateMachine setGraph:graphJson]) {
+            NSLog(@"graph: no vertical connectors");
+        }
+        [self.cacheBudget enforce];
+        
+        CDVPluginResult *pluginResult;
+        NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:1];
+        [result setObject: [NSNumber numberWithInteger:wayfinderId] forKey:@"wayfinderId"];
+        pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:result];
+        [self.commandDelegate sendPluginResult:pluginResult callbackId: command.callbackId];
+    }];
 }
 
 /**
- * Compute route for the given values;
- * 1) Set location of the wayfinder instance
- * 2) Set destination of the wayfinder instance
- * 3) Get route between the given location and destination
+ * Builds the exit distance field from a graph and exits on the shared scheduler.
+ * Exits closed in the previous field stay closed in the new one.
  */
-- (void)computeRoute:(CDVInvokedUrlCommand *)command
+- (void)buildExitField:(CDVInvokedUrlCommand *)command
 {
-    NSString *wayfinderId = [command argumentAtIndex:0];
-    NSString *lat0 = [command argumentAtIndex:1];
-    NSString *lon0 = [command argumentAtIndex:2];
-    NSString *floor0 = [command argumentAtIndex:3];
-    NSString *lat1 = [command argumentAtIndex:4];
-    NSString *lon1 = [command argumentAtIndex:5];
-    NSString *floor1 = [command argumentAtIndex:6];
-    
-    self.wayfinder = self.wayfinderInstances[[wayfinderId intValue]];
-    
-    @try {
-        [self.wayfinder setLocationWithLatitude:[lat0 doubleValue] Longitude:[lon0 doubleValue] Floor:[floor0 intValue]];
-    } @catch(NSException *exception) {
-        NSLog(@"loc: %@", exception.reason);
-        [self sendErrorCommand:command withMessage:@"Error: loc"];
-    }
-    
-    @try {
-        [self.wayfinder setDestinationWithLatitude:[lat1 doubleValue] Longitude:[lon1 doubleValue] Floor:[floor1 intValue]];
-    } @catch(NSException *exception) {
-        NSLog(@"dest: %@", exception.reason);
-        [self sendErrorCommand:command withMessage:@"Error: dest"];
-    }
-    
-    CDVPluginResult *pluginResult;
-    NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:1];
-    NSArray<IARoutingLeg *> *route = [NSArray array];
-    
-    @try {
-        route = [self.wayfinder getRoute];
-    } @catch(NSException *exception) {
-        NSLog(@"route: %@", exception.reason);
-    }
-    
-    NSMutableArray<NSMutableDictionary *>* routingLegs = [[NSMutableArray alloc] init];
-    for (int i=0; i < [route count]; i++) {
-        [routingLegs addObject:[self dictionaryFromRoutingLeg:route[i]]];
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueRouting]) {
+        return;
     }
-    
-    [result setObject:routingLegs forKey:@"route"];
-    pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:result];
-    [self.commandDelegate sendPluginResult:pluginResult callbackId: command.callbackId];
-}
-
-/**
- * Create NSMutableDictionary from the RoutingLeg object
- */
-- (NSMutableDictionary *)dictionaryFromRoutingLeg:(IARoutingLeg *)routingLeg {
-    return [NSMutableDictionary dictionaryWithObjectsAndKeys: [self dictionaryFromRoutingPoint:routingLeg.begin], @"begin", [self dictionaryFromRoutingPoint:routingLeg.end], @"end", [NSNumber numberWithDouble:routingLeg.length], @"length", [NSNumber numberWithDouble:routingLeg.direction], @"direction", routingLeg.edgeIndexInOriginalGraph, @"edgeIndex", nil];
-}
-
-/**
- * Create NSMutableDictionary from the RoutingPoint object
- */
-- (NSMutableDictionary *)dictionaryFromRoutingPoint:(IARoutingPoint *)routingPoint {
-    return [NSMutableDictionary dictionaryWithObjectsAndKeys:[NSNumber numberWithDouble:routingPoint.latitude], @"latitude", [NSNumber numberWithDouble:routingPoint.longitude], @"longitude", [NSNumber numberWithInt:routingPoint.floor], @"floor", nil];
+    NSString *graphJson = [command argumentAtIndex:0 withDefault:nil andClass:[NSString class]];
+    NSArray *exits = [command argumentAtIndex:1 withDefault:@[] andClass:[NSArray class]];
+    NSDictionary *options = [command argumentAtIndex:2 withDefault:@{} andClass:[NSDictionary class]];
+    double cellMeters = options[@"cellMeters"] != nil ? [options[@"cellMeters"] doubleValue] : IndoorExitDefaultCellMeters;
+    NSArray<NSString *> *closedExitIds = [self.exitField closedExits] ?: @[];
+
+    [[IndoorTaskScheduler sharedScheduler] submit:IndoorTaskLaneBackground subsystem:IndoorCostRouting block:^{
+        NSError *error = nil;
+        IndoorExitDistanceField *field = [[IndoorExitDistanceField alloc] initWithGraph:graphJson exits:exits
+                                                                             cellMeters:cellMeters
+                                                                            closedExits:closedExitIds error:&error];
+        if (field == nil) {
+            [self sendErrorCommand:command withMessage:error.localizedDescription];
+            return;
+        }
+        // Installed on the routing queue, after any closeExit or openExit
+        // that came in while the field was built
+        [[IndoorCommandQueues sharedQueues] run:IndoorCommandQueueRouting block:^{
+            IndoorExitDistanceField *current = self.exitField;
+            if (current != nil) {
+                [field setClosedExits:[current closedExits]];
+            }
+            self.exitField = field;
+            NSDictionary *result = @{@"version": @(field.version), @"nodes": @(field.nodeCount),
+                                     @"exits": @(field.exitCount), @"closed": [field closedExits]};
+            CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:result];
+            [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+        }];
+    }];
 }
 
 /**
- * Send error command back to JavaScript side
+ * Guidance towards the nearest open exit from the given position or the
+ * last fix. A field lookup, so answered right on the bridge thread.
  */
-- (void)sendErrorCommand:(CDVInvokedUrlCommand *)command withMessage:(NSString *)message
+- (void)getExitGuidance:(CDVInvokedUrlCommand *)command
 {
-    CDVPluginResult *pluginResult;
-    pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_ERROR messageAsString:message];
+    IndoorExitDistanceField *field = self.exitField;
+    if (field == nil) {
+        [self sendErrorCommand:command withMessage:@"Exit field not built"];
+        return;
+    }
+    NSDictionary *guidance;
+    if (command.arguments.count >= 3) {
+        guidance = [field guidanceAtLatitude:[[command argumentAtIndex:0] doubleValue]
+                                   longitude:[[command argumentAtIndex:1] doubleValue]
+                                       floor:[[command argumentAtIndex:2] integerValue]];
+    } else {
+        IndoorLocationInfo *lData = self.locationData;
+        CLLocation *location = lData.locationInfo;
+        if (location == nil) {
+            NSDictionary *posError = @{@"code": @(POSITION_UNAVAILABLE), @"message": @"Position not available"};
+            CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_ERROR messageAsDictionary:posError];
+            [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+            return;
+        }
+        guidance = [field guidanceAtLatitude:location.coordinate.latitude longitude:location.coordinate.longitude
+                                       floor:[lData.floorID integerValue]];
+    }
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:guidance];
     [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
 }
 
-#pragma mark IndoorAtlas Location
-- (void)location:(IndoorAtlasLocationService *)manager didUpdateLocation:(IALocation *)newLocation
+- (void)closeExit:(CDVInvokedUrlCommand *)command
 {
-    IndoorLocationInfo *cData = self.locationData;
-
-    cData.locationInfo = [[CLLocation alloc] initWithCoordinate:newLocation.location.coordinate altitude:0 horizontalAccuracy:newLocation.location.horizontalAccuracy verticalAccuracy:0 course:newLocation.location.course speed:0 timestamp:[NSDate date]];
-    cData.floorID = [NSString stringWithFormat:@"%ld", newLocation.floor.level];
-    cData.region = newLocation.region;
-    if (self.locationData.locationCallbacks.count > 0) {
-        for (NSString *callbackId in self.locationData.locationCallbacks) {
-            [self returnLocationInfo:callbackId andKeepCallback:NO];
-        }
-
-        [self.locationData.locationCallbacks removeAllObjects];
-    }
-    if (self.locationData.watchCallbacks.count > 0) {
-        for (NSString *timerId in self.locationData.watchCallbacks) {
-            [self returnLocationInfo:[self.locationData.watchCallbacks objectForKey:timerId] andKeepCallback:YES];
-        }
-    } else {
-        // No callbacks waiting on us anymore, turn off listening.
-        [self _stopLocation];
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueRouting]) {
+        return;
     }
+    [self updateExit:command closed:YES];
 }
 
-- (void)location:(IndoorAtlasLocationService *)manager didFailWithError:(NSError *)error
+- (void)openExit:(CDVInvokedUrlCommand *)command
 {
-    NSLog(@"locationManager::didFailWithError %@", [error localizedFailureReason]);
-    IndoorLocationInfo *lData = self.locationData;
-    if (lData && __locationStarted) {
-        // TODO: probably have to once over the various error codes and return one of:
-        // PositionError.PERMISSION_DENIED = 1;
-        // PositionError.POSITION_UNAVAILABLE = 2;
-        // PositionError.TIMEOUT = 3;
-        NSUInteger positionError = POSITION_UNAVAILABLE;
-        [self returnLocationError:positionError withMessage:[error localizedDescription]];
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueRouting]) {
+        return;
     }
+    [self updateExit:command closed:NO];
 }
 
-- (void)location:(IndoorAtlasLocationService *)manager didRegionChange:(IARegion *)region type:(IndoorLocationTransitionType)enterOrExit
+- (void)updateExit:(CDVInvokedUrlCommand *)command closed:(BOOL)closed
 {
-    if (region == nil) {
+    IndoorExitDistanceField *field = self.exitField;
+    if (field == nil) {
+        [self sendErrorCommand:command withMessage:@"Exit field not built"];
         return;
     }
-    IndoorRegionInfo *cData = self.regionData;
-    cData.region = region;
-    cData.regionStatus = enterOrExit;
-    if (self.regionData.watchCallbacks.count > 0) {
-        for (NSString *timerId in self.regionData.watchCallbacks) {
-            [self returnRegionInfo:[self.regionData.watchCallbacks objectForKey:timerId] andKeepCallback:YES];
-        }
+    NSString *exitId = [command argumentAtIndex:0 withDefault:nil andClass:[NSString class]];
+    NSError *error = nil;
+    NSDictionary *delta = closed ? [field closeExit:exitId error:&error] : [field openExit:exitId error:&error];
+    if (delta == nil) {
+        [self sendErrorCommand:command withMessage:error.localizedDescription];
+        return;
+    }
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:delta];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+/**
+ * Applies a closeExit or openExit delta from another device to the exit field
+ */
+- (void)applyExitDelta:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueRouting]) {
+        return;
+    }
+    IndoorExitDistanceField *field = self.exitField;
+    if (field == nil) {
+        [self sendErrorCommand:command withMessage:@"Exit field not built"];
+        return;
+    }
+    NSDictionary *delta = [command argumentAtIndex:0 withDefault:nil andClass:[NSDictionary class]];
+    NSError *error = nil;
+    NSDictionary *applied = [field applyDelta:delta error:&error];
+    if (applied == nil) {
+        [self sendErrorCommand:command withMessage:error.localizedDescription];
+        return;
+    }
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:applied];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+/**
+ * Compute route for the given values on the shared scheduler;
+ * 1) Set location of the wayfinder instance
+ * 2) Set destination of the wayfinder instance
+ * 3) Get route between the given location and destination
+ */
+- (void)computeRoute:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueRouting]) {
+        return;
+    }
+    NSString *wayfinderId = [command argumentAtIndex:0];
+    NSString *lat0 = [command argumentAtIndex:1];
+    NSString *lon0 = [command argumentAtIndex:2];
+    NSString *floor0 = [command argumentAtIndex:3];
+    NSString *lat1 = [command argumentAtIndex:4];
+    NSString *lon1 = [command argumentAtIndex:5];
+    NSString *floor1 = [command argumentAtIndex:6];
+    BOOL binary = [[command argumentAtIndex:7 withDefault:@NO andClass:[NSNumber class]] boolValue];
+    NSMutableArray *instances = self.wayfinderInstances;
+    IndoorVenueFrame *frame = self.venueFrame ?: [IndoorVenueFrame frameForAnchor:CLLocationCoordinate2DMake([lat0 doubleValue], [lon0 doubleValue])];
+    
+    [[IndoorTaskScheduler sharedScheduler] submit:IndoorTaskLaneInteractive subsystem:IndoorCostRouting block:^{
+        IAWayfinding *wf = nil;
+        @synchronized (instances) {
+            NSInteger index = [wayfinderId integerValue];
+            if (index >= 0 && index < (NSInteger)[instances count]) {
+                wf = instances[index];
+            }
+        }
+        if (wf == nil) {
+            [self sendErrorCommand:command withMessage:@"Error: wayfinder"];
+            return;
+        }
+        
+        NSArray<IARoutingLeg *> *route = [NSArray array];
+        // A wayfinder holds the location and destination as state
+        IndoorTraceBegin("routing", "getRoute");
+        @synchronized (wf) {
+            @try {
+                [wf setLocationWithLatitude:[lat0 doubleValue] Longitude:[lon0 doubleValue] Floor:[floor0 intValue]];
+            } @catch(NSException *exception) {
+                NSLog(@"loc: %@", exception.reason);
+                [self sendErrorCommand:command withMessage:@"Error: loc"];
+            }
+            
+            @try {
+                [wf setDestinationWithLatitude:[lat1 doubleValue] Longitude:[lon1 doubleValue] Floor:[floor1 intValue]];
+            } @catch(NSException *exception) {
+                NSLog(@"dest: %@", exception.reason);
+                [self sendErrorCommand:command withMessage:@"Error: dest"];
+            }
+            
+            @try {
+                route = [wf getRoute];
+            } @catch(NSException *exception) {
+                NSLog(@"route: %@", exception.reason);
+            }
+        }
+        IndoorTraceEnd("routing", "getRoute");
+        
+        CDVPluginResult *pluginResult;
+        if (binary) {
+            // Sent as an ArrayBuffer the app hands to its processing worker
+            pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsArrayBuffer:IndoorEncodeRoute(route, frame)];
+            [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+            return;
+        }
+        NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:1];
+        NSMutableArray<NSMutableDictionary *>* routingLegs = [[NSMutableArray alloc] init];
+        for (int i=0; i < [route count]; i++) {
+            [routingLegs addObject:[self dictionaryFromRoutingLeg:route[i]]];
+        }
+        
+        [result setObject:routingLegs forKey:@"route"];
+        pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:result];
+        [self.commandDelegate sendPluginResult:pluginResult callbackId: command.callbackId];
+    }];
+}
+
+/**
+ * Fetches the floor plan, computes the route and projects the route points
+ * on that floor onto the floor plan bitmap, all in one call from JavaScript
+ */
+- (void)computeRouteOnFloorPlan:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueRouting]) {
+        return;
+    }
+    NSInteger wayfinderId = [[command argumentAtIndex:0] integerValue];
+    double lat0 = [[command argumentAtIndex:1] doubleValue];
+    double lon0 = [[command argumentAtIndex:2] doubleValue];
+    int floor0 = [[command argumentAtIndex:3] intValue];
+    double lat1 = [[command argumentAtIndex:4] doubleValue];
+    double lon1 = [[command argumentAtIndex:5] doubleValue];
+    int floor1 = [[command argumentAtIndex:6] intValue];
+    NSString *floorplanId = [command argumentAtIndex:7];
+    NSMutableArray *instances = self.wayfinderInstances;
+    
+    if (self.IAlocationInfo == nil) {
+        [self sendErrorCommand:command withMessage:@"Error: not initialized"];
+        return;
+    }
+    
+    [[[self.IAlocationInfo floorPlanWithId:floorplanId priority:IndoorFetchPriorityNavigation] then:IndoorTaskLaneInteractive step:^IndoorDeferred *(IAFloorPlan *floorPlan) {
+        IAWayfinding *wf = nil;
+        @synchronized (instances) {
+            if (wayfinderId >= 0 && wayfinderId < (NSInteger)[instances count]) {
+                wf = instances[wayfinderId];
+            }
+        }
+        if (wf == nil) {
+            return [IndoorDeferred rejected:[NSError errorWithDomain:@"IndoorLocation" code:0 userInfo:@{NSLocalizedDescriptionKey: @"Error: wayfinder"}]];
+        }
+        
+        NSArray<IARoutingLeg *> *route;
+        // A wayfinder holds the location and destination as state
+        IndoorTraceBegin("routing", "getRoute");
+        @synchronized (wf) {
+            [wf setLocationWithLatitude:lat0 Longitude:lon0 Floor:floor0];
+            [wf setDestinationWithLatitude:lat1 Longitude:lon1 Floor:floor1];
+            route = [wf getRoute];
+        }
+        IndoorTraceEnd("routing", "getRoute");
+        
+        NSMutableArray<NSMutableDictionary *> *routingLegs = [NSMutableArray arrayWithCapacity:[route count]];
+        for (IARoutingLeg *leg in route) {
+            [routingLegs addObject:[self dictionaryFromRoutingLeg:leg floorPlan:floorPlan]];
+        }
+        NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:2];
+        [result setObject:floorPlan.floorPlanId forKey:@"floorPlanId"];
+        [result setObject:routingLegs forKey:@"route"];
+        return [IndoorDeferred resolved:result];
+    }] whenComplete:^(NSDictionary *result, NSError *error) {
+        CDVPluginResult *pluginResult;
+        if (error != nil) {
+            NSMutableDictionary *posError = [NSMutableDictionary dictionaryWithCapacity:2];
+            BOOL fetchFailed = [error.domain isEqualToString:@"Service Unavailable"];
+            [posError setObject:[NSNumber numberWithInt:fetchFailed ? FLOORPLAN_UNAVAILABLE : UNSPECIFIED_ERROR] forKey:@"code"];
+            [posError setObject:[error localizedDescription] forKey:@"message"];
+            pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_ERROR messageAsDictionary:posError];
+        } else {
+            pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:result];
+        }
+        [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+    }];
+}
+
+- (void)getCacheReport:(CDVInvokedUrlCommand *)command
+{
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:[self.cacheBudget report]];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+/**
+ * Applies a memory pressure level as if signalled by the system, for testing eviction
+ */
+- (void)simulateMemoryPressure:(CDVInvokedUrlCommand *)command
+{
+    NSInteger level = [[command argumentAtIndex:0] integerValue];
+    [self.cacheBudget onPressure:(IndoorMemoryPressure)level];
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:[self.cacheBudget report]];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+/**
+ * Sets the triggers and batching rules used in the background. The callback
+ * stays registered and receives every event the processor delivers.
+ */
+- (void)configureBackground:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
+    NSDictionary *options = [command argumentAtIndex:0 withDefault:@{} andClass:[NSDictionary class]];
+    IndoorVenueFrame *frame = self.venueFrame;
+    BOOL notifies = NO;
+    for (NSDictionary *trigger in options[@"triggers"]) {
+        if (frame == nil && trigger[@"latitude"] != nil && trigger[@"longitude"] != nil) {
+            frame = [IndoorVenueFrame frameForAnchor:CLLocationCoordinate2DMake([trigger[@"latitude"] doubleValue], [trigger[@"longitude"] doubleValue])];
+            self.venueFrame = frame;
+        }
+        notifies = notifies || trigger[@"notification"] != nil;
+    }
+    NSError *error = nil;
+    if (![self.backgroundProcessor configure:options frame:frame error:&error]) {
+        [self sendErrorCommand:command withMessage:[error localizedDescription]];
+        return;
+    }
+    if (notifies) {
+        [[UNUserNotificationCenter currentNotificationCenter] requestAuthorizationWithOptions:UNAuthorizationOptionAlert | UNAuthorizationOptionSound completionHandler:^(BOOL granted, NSError *authorizationError) {
+        }];
+    }
+    NSString *previous = self.backgroundCallbackID;
+    self.backgroundCallbackID = command.callbackId;
+    if (previous != nil && ![previous isEqualToString:command.callbackId]) {
+        [self.commandDelegate sendPluginResult:[CDVPluginResult resultWithStatus:CDVCommandStatus_NO_RESULT] callbackId:previous];
+    }
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_NO_RESULT];
+    [pluginResult setKeepCallbackAsBool:YES];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+    if (!__locationStarted && self.IAlocationInfo != nil) {
+        [self startLocation];
+    }
+}
+
+- (void)clearBackground:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueuePositioning]) {
+        return;
+    }
+    [self.backgroundProcessor disable];
+    NSString *previous = self.backgroundCallbackID;
+    self.backgroundCallbackID = nil;
+    if (previous != nil) {
+        [self.commandDelegate sendPluginResult:[CDVPluginResult resultWithStatus:CDVCommandStatus_NO_RESULT] callbackId:previous];
+    }
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:[self.backgroundProcessor stats]];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+    [self _stopLocation];
+}
+
+- (void)fetchEvents:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueResources]) {
+        return;
+    }
+    IndoorEventQueue *queue = [self openEventQueue];
+    if (queue == nil) {
+        [self sendErrorCommand:command withMessage:@"Event queue unavailable"];
+        return;
+    }
+    NSString *consumer = [command argumentAtIndex:0];
+    NSUInteger maxEvents = [[command argumentAtIndex:1 withDefault:@(IndoorEventQueueDefaultBatch)] unsignedIntegerValue];
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:[queue read:consumer maxEvents:maxEvents]];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+- (void)ackEvents:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueResources]) {
+        return;
+    }
+    IndoorEventQueue *queue = [self openEventQueue];
+    if (queue == nil) {
+        [self sendErrorCommand:command withMessage:@"Event queue unavailable"];
+        return;
+    }
+    NSError *error = nil;
+    if (![queue ack:[command argumentAtIndex:0] offset:[[command argumentAtIndex:1] longLongValue] error:&error]) {
+        [self sendErrorCommand:command withMessage:[error localizedDescription]];
+        return;
+    }
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:[queue stats]];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+- (void)getHistory:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueResources]) {
+        return;
+    }
+    IndoorPositionHistory *history = [self openPositionHistory];
+    if (history == nil) {
+        [self sendErrorCommand:command withMessage:@"Position history unavailable"];
+        return;
+    }
+    int64_t from = [[command argumentAtIndex:0 withDefault:@0 andClass:[NSNumber class]] longLongValue];
+    int64_t to = [[command argumentAtIndex:1 withDefault:@(INT64_MAX) andClass:[NSNumber class]] longLongValue];
+    NSUInteger maxPoints = [[command argumentAtIndex:2 withDefault:@(IndoorPositionHistoryDefaultMaxPoints) andClass:[NSNumber class]] unsignedIntegerValue];
+    NSData *payload = [history queryFrom:from to:to maxPoints:maxPoints];
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsArrayBuffer:payload];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+- (void)clearHistory:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueResources]) {
+        return;
+    }
+    [[self openPositionHistory] clear];
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+- (void)configureUplink:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueResources]) {
+        return;
+    }
+    NSError *error = nil;
+    if (self.uplink == nil) {
+        NSString *support = NSSearchPathForDirectoriesInDomains(NSApplicationSupportDirectory, NSUserDomainMask, YES).firstObject;
+        self.uplink = [[IndoorUplink alloc] initWithDirectory:[support stringByAppendingPathComponent:@"indooratlas-uplink"] transport:nil error:&error];
+        if (self.uplink == nil) {
+            [self sendErrorCommand:command withMessage:[NSString stringWithFormat:@"Cannot open uplink: %@", [error localizedDescription]]];
+            return;
+        }
+    }
+    NSDictionary *options = [command argumentAtIndex:0 withDefault:@{} andClass:[NSDictionary class]];
+    if (![self.uplink configure:options error:&error]) {
+        [self sendErrorCommand:command withMessage:[error localizedDescription]];
+        return;
+    }
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:[self.uplink stats]];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+- (void)clearUplink:(CDVInvokedUrlCommand *)command
+{
+    if ([self dispatchCommand:command selector:_cmd toQueue:IndoorCommandQueueResources]) {
+        return;
+    }
+    IndoorUplink *uplink = self.uplink;
+    [uplink disable];
+    CDVPluginResult *pluginResult = uplink != nil
+        ? [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:[uplink stats]]
+        : [CDVPluginResult resultWithStatus:CDVCommandStatus_OK];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+/**
+ * Opens the event queue on first use, returns nil if it cannot be opened
+ */
+- (IndoorEventQueue *)openEventQueue
+{
+    @synchronized (self) {
+        if (self.eventQueue == nil) {
+            NSString *support = NSSearchPathForDirectoriesInDomains(NSApplicationSupportDirectory, NSUserDomainMask, YES).firstObject;
+            NSError *error = nil;
+            self.eventQueue = [[IndoorEventQueue alloc] initWithDirectory:[support stringByAppendingPathComponent:@"indooratlas-events"]
+                                                                 maxBytes:IndoorEventQueueDefaultMaxBytes
+                                                             segmentBytes:IndoorEventQueueDefaultSegmentBytes
+                                                                    error:&error];
+            if (self.eventQueue == nil) {
+                NSLog(@"Cannot open event queue: %@", error);
+            }
+        }
+        return self.eventQueue;
+    }
+}
+
+/**
+ * Opens the position history on first use, returns nil if it cannot be opened
+ */
+/**
+ * Records a fix on the resources queue, where the history is opened,
+ * spilled and compacted, so that the location callback never touches disk
+ */
+- (void)addToHistoryAt:(int64_t)timeMs point:(IndoorLocalPoint)point floor:(NSInteger)floor accuracy:(double)accuracy
+{
+    IndoorVenueFrame *frame = self.venueFrame;
+    [[IndoorCommandQueues sharedQueues] dispatch:IndoorCommandQueueResources block:^{
+        [[self openPositionHistory] addAt:timeMs frame:frame point:point floor:floor accuracy:accuracy];
+    }];
+}
+
+- (IndoorPositionHistory *)openPositionHistory
+{
+    @synchronized (self) {
+        if (self.positionHistory == nil) {
+            NSString *support = NSSearchPathForDirectoriesInDomains(NSApplicationSupportDirectory, NSUserDomainMask, YES).firstObject;
+            NSError *error = nil;
+            self.positionHistory = [[IndoorPositionHistory alloc] initWithDirectory:[support stringByAppendingPathComponent:@"indooratlas-history"]
+                                                                       maxDiskBytes:IndoorPositionHistoryDefaultMaxDiskBytes
+                                                                              error:&error];
+            if (self.positionHistory == nil) {
+                NSLog(@"Cannot open position history: %@", error);
+            }
+        }
+        return self.positionHistory;
+    }
+}
+
+/**
+ * Stores an event for JavaScript to fetch later, so that it survives the
+ * WebView being suspended and the app being killed. Returns its offset, or -1.
+ */
+- (int64_t)persistEvent:(NSDictionary *)event
+{
+    NSError *error = nil;
+    int64_t offset = [[self openEventQueue] append:event error:&error];
+    if (offset < 0 && error != nil) {
+        NSLog(@"Cannot store event: %@", error);
+    }
+    return offset;
+}
+
+- (NSDictionary *)regionEvent:(IARegion *)region transition:(IndoorLocationTransitionType)transition
+{
+    NSMutableDictionary *event = [[self formatRegionInfo:region andTransitionType:transition] mutableCopy];
+    event[@"type"] = @"region";
+    return event;
+}
+
+/**
+ * Stores a region transition no region watch received
+ */
+- (void)persistRegion:(IARegion *)region transition:(IndoorLocationTransitionType)transition
+{
+    [self persistEvent:[self regionEvent:region transition:transition]];
+}
+
+#pragma mark IndoorBackgroundSink
+
+- (void)deliverBackgroundEvent:(NSDictionary *)event
+{
+    [self.uplink onEvent:event];
+    int64_t offset = [self persistEvent:event];
+    if (offset >= 0) {
+        NSMutableDictionary *stored = [event mutableCopy];
+        stored[@"offset"] = @(offset);
+        event = stored;
+    }
+    NSString *callbackId = self.backgroundCallbackID;
+    if (callbackId != nil) {
+        CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:event];
+        [pluginResult setKeepCallbackAsBool:YES];
+        [self.commandDelegate sendPluginResult:pluginResult callbackId:callbackId];
+    }
+}
+
+/**
+ * Posts the local notification of a trigger. Tapping it opens the app.
+ */
+- (void)notifyTrigger:(NSString *)triggerId title:(NSString *)title text:(NSString *)text
+{
+    UNMutableNotificationContent *content = [[UNMutableNotificationContent alloc] init];
+    content.title = title;
+    content.body = text;
+    content.sound = [UNNotificationSound defaultSound];
+    UNNotificationRequest *request = [UNNotificationRequest requestWithIdentifier:triggerId content:content trigger:nil];
+    [[UNUserNotificationCenter currentNotificationCenter] addNotificationRequest:request withCompletionHandler:nil];
+}
+
+- (void)getCostReport:(CDVInvokedUrlCommand *)command
+{
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:[IndoorCostAccounting report]];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+- (void)resetCostReport:(CDVInvokedUrlCommand *)command
+{
+    [IndoorCostAccounting reset];
+    [self.commandDelegate sendPluginResult:[CDVPluginResult resultWithStatus:CDVCommandStatus_OK] callbackId:command.callbackId];
+}
+
+- (void)startTracing:(CDVInvokedUrlCommand *)command
+{
+    NSNumber *capacity = [command argumentAtIndex:0 withDefault:@(IndoorTraceDefaultCapacity) andClass:[NSNumber class]];
+    [IndoorTraceRecorder startWithCapacity:[capacity unsignedIntegerValue]];
+    [self.commandDelegate sendPluginResult:[CDVPluginResult resultWithStatus:CDVCommandStatus_OK] callbackId:command.callbackId];
+}
+
+- (void)stopTracing:(CDVInvokedUrlCommand *)command
+{
+    [IndoorTraceRecorder stop];
+    [self.commandDelegate sendPluginResult:[CDVPluginResult resultWithStatus:CDVCommandStatus_OK] callbackId:command.callbackId];
+}
+
+/**
+ * Exports the native trace recording as Chrome trace JSON, tagged with the
+ * IndoorAtlas trace id of the session
+ */
+- (void)dumpTrace:(CDVInvokedUrlCommand *)command
+{
+    NSString *traceId = [self.IAlocationInfo fetchTraceId];
+    [self.commandDelegate runInBackground:^{
+        NSDictionary *trace = [IndoorTraceRecorder dumpWithTraceId:traceId];
+        CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:trace];
+        [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+    }];
+}
+
+/**
+ * Runs a native benchmark off the main thread, as it blocks until done
+ */
+- (void)runBenchmark:(CDVInvokedUrlCommand *)command
+{
+    NSString *name = [command argumentAtIndex:0];
+    NSDictionary *options = [command argumentAtIndex:1 withDefault:@{} andClass:[NSDictionary class]];
+    
+    [self.commandDelegate runInBackground:^{
+        NSDictionary *report = [IndoorBenchmarks run:name options:options];
+        if (report == nil) {
+            [self sendErrorCommand:command withMessage:[NSString stringWithFormat:@"Unknown benchmark %@", name]];
+            return;
+        }
+        CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:report];
+        [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+    }];
+}
+
+/**
+ * Plugin result carrying a bridge benchmark payload in its own encoding
+ */
+- (CDVPluginResult *)bridgeResult:(id)payload
+{
+    if ([payload isKindOfClass:[NSData class]]) {
+        return [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsArrayBuffer:payload];
+    } else if ([payload isKindOfClass:[NSString class]]) {
+        return [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsString:payload];
+    }
+    return [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:payload];
+}
+
+/**
+ * One bridge benchmark round trip, answered on the thread Cordova calls it on
+ * so that only the bridge itself is measured. Uploads get a small reply.
+ */
+- (void)bridgeEcho:(CDVInvokedUrlCommand *)command
+{
+    NSString *shape = [command argumentAtIndex:0];
+    NSString *encoding = [command argumentAtIndex:1];
+    BOOL upload = [[command argumentAtIndex:2 withDefault:@NO] boolValue];
+
+    if (upload) {
+        NSDictionary *reply = @{ @"sentAt": @(floor([NSDate date].timeIntervalSince1970 * 1000)) };
+        [self.commandDelegate sendPluginResult:[self bridgeResult:reply] callbackId:command.callbackId];
+        return;
+    }
+    NSString *error = nil;
+    id payload = [self.bridgeBenchmark payloadForShape:shape encoding:encoding error:&error];
+    if (payload == nil) {
+        [self sendErrorCommand:command withMessage:error];
+        return;
+    }
+    [self.commandDelegate sendPluginResult:[self bridgeResult:payload] callbackId:command.callbackId];
+}
+
+/**
+ * Streams bridge benchmark payloads at a fixed rate on the same callback
+ */
+- (void)bridgeStream:(CDVInvokedUrlCommand *)command
+{
+    NSString *shape = [command argumentAtIndex:0];
+    NSString *encoding = [command argumentAtIndex:1];
+    NSInteger rateHz = [[command argumentAtIndex:2 withDefault:@0] integerValue];
+    NSInteger count = [[command argumentAtIndex:3 withDefault:@0] integerValue];
+
+    __weak IndoorLocation *weakSelf = self;
+    NSString *callbackId = command.callbackId;
+    NSString *error = nil;
+    BOOL started = [self.bridgeBenchmark streamShape:shape encoding:encoding rateHz:rateHz count:count send:^(id payload, BOOL keepCallback) {
+        CDVPluginResult *pluginResult = [weakSelf bridgeResult:payload];
+        [pluginResult setKeepCallbackAsBool:keepCallback];
+        [weakSelf.commandDelegate sendPluginResult:pluginResult callbackId:callbackId];
+    } error:&error];
+    if (!started) {
+        [self sendErrorCommand:command withMessage:error];
+    }
+}
+
+- (void)bridgeStop:(CDVInvokedUrlCommand *)command
+{
+    [self.bridgeBenchmark stop];
+    [self.commandDelegate sendPluginResult:[CDVPluginResult resultWithStatus:CDVCommandStatus_OK] callbackId:command.callbackId];
+}
+
+/**
+ * Create NSMutableDictionary from the RoutingLeg object
+ */
+- (NSMutableDictionary *)dictionaryFromRoutingLeg:(IARoutingLeg *)routingLeg {
+    return [NSMutableDictionary dictionaryWithObjectsAndKeys: [self dictionaryFromRoutingPoint:routingLeg.begin], @"begin", [self dictionaryFromRoutingPoint:routingLeg.end], @"end", [NSNumber numberWithDouble:routingLeg.length], @"length", [NSNumber numberWithDouble:routingLeg.direction], @"direction", routingLeg.edgeIndexInOriginalGraph, @"edgeIndex", nil];
+}
+
+/**
+ * Create NSMutableDictionary from the RoutingPoint object
+ */
+- (NSMutableDictionary *)dictionaryFromRoutingPoint:(IARoutingPoint *)routingPoint {
+    return [NSMutableDictionary dictionaryWithObjectsAndKeys:[NSNumber numberWithDouble:routingPoint.latitude], @"latitude", [NSNumber numberWithDouble:routingPoint.longitude], @"longitude", [NSNumber numberWithInt:routingPoint.floor], @"floor", nil];
+}
+
+/**
+ * Create NSMutableDictionary from the RoutingLeg object, with floor plan pixel
+ * coordinates for the points on the floor plan's floor
+ */
+- (NSMutableDictionary *)dictionaryFromRoutingLeg:(IARoutingLeg *)routingLeg floorPlan:(IAFloorPlan *)floorPlan {
+    NSMutableDictionary *leg = [self dictionaryFromRoutingLeg:routingLeg];
+    [self addPointOf:routingLeg.begin onFloorPlan:floorPlan to:leg[@"begin"]];
+    [self addPointOf:routingLeg.end onFloorPlan:floorPlan to:leg[@"end"]];
+    return leg;
+}
+
+- (void)addPointOf:(IARoutingPoint *)routingPoint onFloorPlan:(IAFloorPlan *)floorPlan to:(NSMutableDictionary *)dictionary {
+    if (floorPlan.floor.level != routingPoint.floor) {
+        return;
+    }
+    CGPoint point = [floorPlan coordinateToPoint:CLLocationCoordinate2DMake(routingPoint.latitude, routingPoint.longitude)];
+    [dictionary setObject:[NSNumber numberWithDouble:point.x] forKey:@"x"];
+    [dictionary setObject:[NSNumber numberWithDouble:point.y] forKey:@"y"];
+}
+
+#pragma mark Timeouts
+
+/**
+ * Fails a getLocation request with TIMEOUT unless a position is delivered in time
+ *
+ * @param callbackId
+ * @param timeout milliseconds, nil or negative for no timeout
+ */
+- (void)scheduleTimeoutForCallback:(NSString *)callbackId after:(id)timeout
+{
+    if (![timeout isKindOfClass:[NSNumber class]] || [timeout longLongValue] < 0) {
+        return;
+    }
+    __weak IndoorLocation *weakSelf = self;
+    __block IndoorTimeout *handle = nil;
+    handle = [[IndoorTimingWheel sharedWheel] schedule:[timeout longLongValue] block:^{
+        [[IndoorCommandQueues sharedQueues] dispatch:IndoorCommandQueuePositioning block:^{
+            IndoorLocation *strongSelf = weakSelf;
+            // A position delivered after expiry already answered the request
+            if (strongSelf == nil || strongSelf.requestTimeouts[callbackId] != handle) {
+                return;
+            }
+            [strongSelf.requestTimeouts removeObjectForKey:callbackId];
+            [strongSelf.locationData.locationCallbacks removeObject:callbackId];
+            [strongSelf.requestAccuracies removeObjectForKey:callbackId];
+            [strongSelf sendTimeout:callbackId keepCallback:NO];
+            [strongSelf _stopLocation];
+        }];
+    }];
+    self.requestTimeouts[callbackId] = handle;
+}
+
+/**
+ * Reports TIMEOUT to a watch whenever no position is delivered in time. The watch stays active.
+ *
+ * @param timerId
+ * @param timeout milliseconds, nil or negative for no timeout
+ */
+- (void)scheduleTimeoutForWatch:(NSString *)timerId after:(id)timeout
+{
+    if (![timeout isKindOfClass:[NSNumber class]] || [timeout longLongValue] < 0) {
+        return;
+    }
+    self.watchTimeoutMs[timerId] = timeout;
+    [self armWatchTimeout:timerId];
+}
+
+- (void)armWatchTimeout:(NSString *)timerId
+{
+    __weak IndoorLocation *weakSelf = self;
+    __block IndoorTimeout *handle = nil;
+    handle = [[IndoorTimingWheel sharedWheel] schedule:[self.watchTimeoutMs[timerId] longLongValue] block:^{
+        [[IndoorCommandQueues sharedQueues] dispatch:IndoorCommandQueuePositioning block:^{
+            IndoorLocation *strongSelf = weakSelf;
+            if (strongSelf == nil || strongSelf.watchTimeouts[timerId] != handle) {
+                return;
+            }
+            [strongSelf.watchTimeouts removeObjectForKey:timerId];
+            NSString *callbackId = [strongSelf.locationData.watchCallbacks objectForKey:timerId];
+            // Watches are not served in the background, their timeout must not wake JavaScript
+            if (callbackId != nil && ![strongSelf.backgroundProcessor isActive]) {
+                [strongSelf sendTimeout:callbackId keepCallback:YES];
+            }
+        }];
+    }];
+    [self.watchTimeouts[timerId] cancel];
+    self.watchTimeouts[timerId] = handle;
+}
+
+- (void)cancelWatchTimeout:(NSString *)timerId
+{
+    [self.watchTimeoutMs removeObjectForKey:timerId];
+    [self.watchTimeouts[timerId] cancel];
+    [self.watchTimeouts removeObjectForKey:timerId];
+}
+
+/**
+ * Called for every position: cancels the timeouts of the requests it answered
+ * and restarts the timeouts of the watches
+ */
+- (void)restartTimers
+{
+    for (NSString *callbackId in self.requestTimeouts.allKeys) {
+        // Requests waiting for a more accurate position keep their timeout
+        if (![self.locationData.locationCallbacks containsObject:callbackId]) {
+            [self.requestTimeouts[callbackId] cancel];
+            [self.requestTimeouts removeObjectForKey:callbackId];
+        }
+    }
+    for (NSString *timerId in self.watchTimeoutMs) {
+        [self armWatchTimeout:timerId];
+    }
+}
+
+- (void)sendTimeout:(NSString *)callbackId keepCallback:(BOOL)keepCallback
+{
+    NSMutableDictionary *posError = [NSMutableDictionary dictionaryWithCapacity:2];
+    [posError setObject:[NSNumber numberWithInt:TIMEOUT] forKey:@"code"];
+    [posError setObject:@"Position retrieval timed out." forKey:@"message"];
+    CDVPluginResult *result = [CDVPluginResult resultWithStatus:CDVCommandStatus_ERROR messageAsDictionary:posError];
+    [result setKeepCallbackAsBool:keepCallback];
+    [self.commandDelegate sendPluginResult:result callbackId:callbackId];
+}
+
+/**
+ * Compiles the filter expression at an argument index, or sets nil if there is none.
+ * Returns NO and sends the error to the callback if the expression is invalid.
+ */
+- (BOOL)compileFilter:(CDVInvokedUrlCommand *)command atIndex:(NSUInteger)index kind:(IndoorEventFilterKind)kind filter:(IndoorEventFilter **)filter
+{
+    NSString *expression = [command argumentAtIndex:index withDefault:nil andClass:[NSString class]];
+    *filter = nil;
+    if (expression == nil) {
+        return YES;
+    }
+    NSError *error = nil;
+    *filter = [IndoorEventFilter compile:expression kind:kind error:&error];
+    if (*filter == nil) {
+        NSMutableDictionary *posError = [NSMutableDictionary dictionaryWithCapacity:2];
+        [posError setObject:[NSNumber numberWithInt:UNSPECIFIED_ERROR] forKey:@"code"];
+        [posError setObject:error.localizedDescription forKey:@"message"];
+        CDVPluginResult *result = [CDVPluginResult resultWithStatus:CDVCommandStatus_ERROR messageAsDictionary:posError];
+        [self.commandDelegate sendPluginResult:result callbackId:command.callbackId];
+        return NO;
+    }
+    return YES;
+}
+
+/**
+ * Sends the current position to the watches whose filter accepts it, as a
+ * sample to those on the stream channel
+ */
+- (void)returnLocationToWatches
+{
+    double sample[IndoorStreamPositionFields];
+    BOOL sampleSet = NO;
+    IndoorLocationInfo *lData = self.locationData;
+    if (self.watchFilters.count > 0) {
+        CLLocation *lInfo = lData.locationInfo;
+        _positionValues.numbers[IndoorFilterLatitude] = lInfo.coordinate.latitude;
+        _positionValues.numbers[IndoorFilterLongitude] = lInfo.coordinate.longitude;
+        _positionValues.numbers[IndoorFilterAltitude] = lInfo.altitude;
+        _positionValues.numbers[IndoorFilterAccuracy] = lInfo.horizontalAccuracy;
+        _positionValues.numbers[IndoorFilterBearing] = lInfo.course;
+        _positionValues.numbers[IndoorFilterVelocity] = lInfo.speed;
+        _positionValues.numbers[IndoorFilterFloor] = [lData.floorID doubleValue];
+        _positionValues.numbers[IndoorFilterPositionTime] = [lInfo.timestamp timeIntervalSince1970] * 1000;
+    }
+    for (NSString *timerId in lData.watchCallbacks) {
+        IndoorEventFilter *filter = [self.watchFilters objectForKey:timerId];
+        if (filter != nil && ![filter matches:&_positionValues]) {
+            continue;
+        }
+        NSNumber *streamId = self.watchStreams.count > 0 ? [self.watchStreams objectForKey:timerId] : nil;
+        if (streamId != nil && [self.streamChannel hasStream:[streamId integerValue]]) {
+            if (!sampleSet) {
+                [self fillPositionSample:sample];
+                sampleSet = YES;
+            }
+            IndoorCostEnter();
+            [self.streamChannel offer:[streamId integerValue] sample:sample];
+            IndoorCostExit(IndoorCostBridge, "location");
+            continue;
+        }
+        [self returnLocationInfo:[lData.watchCallbacks objectForKey:timerId] andKeepCallback:YES];
+    }
+}
+
+/**
+ * The current position in the stream channel layout, with the values the
+ * JSON position carries
+ */
+- (void)fillPositionSample:(double *)sample
+{
+    IndoorLocationInfo *lData = self.locationData;
+    CLLocation *lInfo = lData.locationInfo;
+    IARegion *region = lData.region;
+    sample[0] = lInfo.coordinate.latitude;
+    sample[1] = lInfo.coordinate.longitude;
+    sample[2] = lInfo.altitude;
+    sample[3] = lInfo.horizontalAccuracy;
+    sample[4] = lInfo.course;
+    sample[5] = lInfo.speed;
+    sample[6] = [lData.floorID doubleValue];
+    sample[7] = [lInfo.timestamp timeIntervalSince1970] * 1000;
+    sample[8] = region != nil ? [self.streamChannel intern:region.identifier] : -1;
+    sample[9] = region != nil ? region.type : 0;
+    sample[10] = region != nil ? [region.timestamp timeIntervalSince1970] * 1000 : 0;
+    sample[11] = lInfo.verticalAccuracy;
+}
+
+/**
+ * Opens the stream channel on this callback, which then receives every frame
+ */
+- (void)openStreamChannel:(CDVInvokedUrlCommand *)command
+{
+    __weak IndoorLocation *weakSelf = self;
+    NSString *callbackId = command.callbackId;
+    [self.streamChannel openWithSend:^(NSData *frame) {
+        CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsArrayBuffer:frame];
+        [pluginResult setKeepCallbackAsBool:YES];
+        [weakSelf.commandDelegate sendPluginResult:pluginResult callbackId:callbackId];
+    }];
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_NO_RESULT];
+    [pluginResult setKeepCallbackAsBool:YES];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:callbackId];
+}
+
+- (void)ackStreamChannel:(CDVInvokedUrlCommand *)command
+{
+    NSNumber *sequence = [command argumentAtIndex:0 withDefault:@0 andClass:[NSNumber class]];
+    [self.streamChannel acknowledge:(uint32_t)[sequence unsignedIntValue]];
+}
+
+/**
+ * A synchronized read of the state record, answered without queueing
+ */
+- (void)getState:(CDVInvokedUrlCommand *)command
+{
+    int64_t since = [[command argumentAtIndex:0 withDefault:@0 andClass:[NSNumber class]] longLongValue];
+    int64_t epoch = [[command argumentAtIndex:1 withDefault:@0 andClass:[NSNumber class]] longLongValue];
+    CDVPluginResult *pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK
+                                                  messageAsDictionary:[self.positioningState snapshotSince:since epoch:epoch]];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+/**
+ * Send error command back to JavaScript side
+ */
+- (void)sendErrorCommand:(CDVInvokedUrlCommand *)command withMessage:(NSString *)message
+{
+    CDVPluginResult *pluginResult;
+    pluginResult = [CDVPluginResult resultWithStatus:CDVCommandStatus_ERROR messageAsString:message];
+    [self.commandDelegate sendPluginResult:pluginResult callbackId:command.callbackId];
+}
+
+#pragma mark IndoorAtlas Location
+- (void)location:(IndoorAtlasLocationService *)manager didUpdateLocation:(IALocation *)newLocation
+{
+    IndoorLocationInfo *cData = self.locationData;
+    IndoorTraceBegin("sdk", "didUpdateLocation");
+    IndoorCostEnter();
+
+    cData.locationInfo = [[CLLocation alloc] initWithCoordinate:newLocation.location.coordinate altitude:0 horizontalAccuracy:newLocation.location.horizontalAccuracy verticalAccuracy:0 course:newLocation.location.course speed:0 timestamp:[NSDate date]];
+    // The only place SDK positions are converted; native consumers use the local copy
+    if (self.venueFrame == nil) {
+        self.venueFrame = [IndoorVenueFrame frameForAnchor:newLocation.location.coordinate];
+        // Proximity triggers follow the frame of the new venue
+        [self.backgroundProcessor setFrame:self.venueFrame];
+    }
+    cData.localPoint = [self.venueFrame toLocal:newLocation.location.coordinate];
+    cData.floorID = [NSString stringWithFormat:@"%ld", newLocation.floor.level];
+    cData.region = newLocation.region;
+    cData.locationMessageValid = NO;
+    int64_t timeMs = (int64_t)([newLocation.location.timestamp timeIntervalSince1970] * 1000);
+    IndoorPositioningState *state = self.positioningState;
+    [state setLatitude:newLocation.location.coordinate.latitude longitude:newLocation.location.coordinate.longitude
+              altitude:newLocation.location.altitude accuracy:newLocation.location.horizontalAccuracy
+               heading:newLocation.location.course floor:newLocation.floor.level
+        floorCertainty:newLocation.floor != nil ? newLocation.floor.certainty : NAN
+                  time:timeMs traceId:[state hasTraceId] ? nil : [self.IAlocationInfo fetchTraceId]];
+    if (newLocation.floor != nil) {
+        [self.floorStateMachine onFixAtLatitude:newLocation.location.coordinate.latitude
+                                      longitude:newLocation.location.coordinate.longitude
+                                          floor:newLocation.floor.level certainty:newLocation.floor.certainty time:timeMs];
+    }
+    [self addToHistoryAt:timeMs point:cData.localPoint floor:newLocation.floor.level
+                accuracy:newLocation.location.horizontalAccuracy];
+    BOOL handled = [self.backgroundProcessor onPositionAt:timeMs floor:newLocation.floor.level point:cData.localPoint];
+    [self.uplink onFixAt:timeMs latitude:newLocation.location.coordinate.latitude longitude:newLocation.location.coordinate.longitude
+                   floor:newLocation.floor.level accuracy:newLocation.location.horizontalAccuracy];
+    // Pending getLocation requests are answered even in the background
+    BOOL requests = self.locationData.locationCallbacks.count > 0;
+    if (requests) {
+        NSMutableArray<NSString *> *answered = [NSMutableArray arrayWithCapacity:self.locationData.locationCallbacks.count];
+        for (NSString *callbackId in self.locationData.locationCallbacks) {
+            NSNumber *minimumAccuracy = self.requestAccuracies[callbackId];
+            if (minimumAccuracy == nil || [self isLocation:cData.locationInfo accurateTo:[minimumAccuracy doubleValue]]) {
+                [self returnLocationInfo:callbackId andKeepCallback:NO];
+                [answered addObject:callbackId];
+            }
+        }
+        [self.locationData.locationCallbacks removeObjectsInArray:answered];
+        [self.requestAccuracies removeObjectsForKeys:answered];
+    }
+    [self restartTimers];
+    if (handled && !requests) {
+        self.missedLocation = self.locationData.watchCallbacks.count > 0;
+        IndoorCostExit(IndoorCostPositioning, "location");
+        IndoorTraceEnd("sdk", "didUpdateLocation");
+        return;
+    }
+    self.missedLocation = NO;
+    if (self.locationData.watchCallbacks.count > 0) {
+        [self returnLocationToWatches];
     } else {
         // No callbacks waiting on us anymore, turn off listening.
         [self _stopLocation];
     }
+    IndoorCostExit(IndoorCostPositioning, "location");
+    IndoorTraceEnd("sdk", "didUpdateLocation");
+}
+
+- (void)location:(IndoorAtlasLocationService *)manager didFailWithError:(NSError *)error
+{
+    NSLog(@"locationManager::didFailWithError %@", [error localizedFailureReason]);
+    IndoorLocationInfo *lData = self.locationData;
+    if (lData && __locationStarted) {
+        // TODO: probably have to once over the various error codes and return one of:
+        // PositionError.PERMISSION_DENIED = 1;
+        // PositionError.POSITION_UNAVAILABLE = 2;
+        // PositionError.TIMEOUT = 3;
+        NSUInteger positionError = POSITION_UNAVAILABLE;
+        [self returnLocationError:positionError withMessage:[error localizedDescription]];
+    }
+}
+
+- (void)location:(IndoorAtlasLocationService *)manager didRegionChange:(IARegion *)region type:(IndoorLocationTransitionType)enterOrExit
+{
+    if (region == nil) {
+        return;
+    }
+    IndoorTraceInstant("sdk", enterOrExit == TRANSITION_TYPE_ENTER ? "didEnterRegion" : "didExitRegion");
+    int64_t timeMs = (int64_t)([region.timestamp timeIntervalSince1970] * 1000);
+    if (region.type == kIARegionTypeVenue) {
+        // The next fix anchors a frame for the venue entered
+        BOOL entered = enterOrExit == TRANSITION_TYPE_ENTER;
+        if (entered ? ![region.identifier isEqualToString:self.venueId]
+                    : (self.venueId == nil || [region.identifier isEqualToString:self.venueId])) {
+            self.venueFrame = nil;
+            self.venueId = entered ? region.identifier : nil;
+        }
+    }
+    if (enterOrExit == TRANSITION_TYPE_ENTER) {
+        [self.positioningState enterRegion:region.identifier type:region.type time:timeMs];
+    } else {
+        [self.positioningState exitRegion:region.identifier];
+    }
+    IndoorUplink *uplink = self.uplink;
+    if (uplink != nil) {
+        [uplink onEvent:[self regionEvent:region transition:enterOrExit]];
+    }
+    if ([self.backgroundProcessor onRegion:region.identifier type:region.type transition:enterOrExit at:timeMs]) {
+        [self persistRegion:region transition:enterOrExit];
+        return;
+    }
+    IndoorCostEnter();
+    IndoorRegionInfo *cData = self.regionData;
+    cData.region = region;
+    cData.regionStatus = enterOrExit;
+    if (self.regionData.watchCallbacks.count > 0) {
+        _regionValues.numbers[IndoorFilterRegionType] = region.type;
+        _regionValues.numbers[IndoorFilterTransitionType] = enterOrExit;
+        _regionValues.numbers[IndoorFilterRegionTime] = timeMs;
+        _regionValues.strings[IndoorFilterRegionId] = region.identifier;
+        _regionValues.strings[IndoorFilterTransition] = enterOrExit == TRANSITION_TYPE_ENTER ? @"enter" : @"exit";
+        for (NSString *timerId in self.regionData.watchCallbacks) {
+            IndoorEventFilter *filter = [self.regionFilters objectForKey:timerId];
+            if (filter != nil && ![filter matches:&_regionValues]) {
+                continue;
+            }
+            [self returnRegionInfo:[self.regionData.watchCallbacks objectForKey:timerId] andKeepCallback:YES];
+        }
+    } else {
+        [self persistRegion:region transition:enterOrExit];
+        // No callbacks waiting on us anymore, turn off listening.
+        [[IndoorCommandQueues sharedQueues] dispatch:IndoorCommandQueuePositioning block:^{
+            [self _stopLocation];
+        }];
+    }
+    IndoorCostExit(IndoorCostPositioning, "region");
 }
 
 - (void)location:(IndoorAtlasLocationService *)manager didUpdateAttitude:(IAAttitude *)attitude
 {
+    if ([self.backgroundProcessor isActive]) {
+        return;
+    }
+    IndoorTraceInstant("sdk", "didUpdateAttitude");
+    IndoorCostEnter();
     double x = attitude.quaternion.x;
     double y = attitude.quaternion.y;
     double z = attitude.quaternion.z;
     double w = attitude.quaternion.w;
     NSDate *timestamp = attitude.timestamp;
-    
+    IndoorEventFilter *filter = self.attitudeFilter;
+    if (filter != nil) {
+        _sensorValues.numbers[IndoorFilterX] = x;
+        _sensorValues.numbers[IndoorFilterY] = y;
+        _sensorValues.numbers[IndoorFilterZ] = z;
+        _sensorValues.numbers[IndoorFilterW] = w;
+        _sensorValues.numbers[IndoorFilterAttitudeTime] = [timestamp timeIntervalSince1970] * 1000;
+        if (![filter matches:&_sensorValues]) {
+            IndoorCostExit(IndoorCostSensors, "orientation");
+            return;
+        }
+    }
+
     [self returnAttitudeInformation:x y:y z:z w:w timestamp:timestamp];
+    IndoorCostExit(IndoorCostSensors, "orientation");
 }
 
 - (void)location:(IndoorAtlasLocationService *)manager didUpdateHeading:(IAHeading *)heading
 {
+    if ([self.backgroundProcessor isActive]) {
+        return;
+    }
+    IndoorTraceInstant("sdk", "didUpdateHeading");
+    IndoorCostEnter();
     double direction = heading.trueHeading;
     NSDate *timestamp = heading.timestamp;
-    
+    IndoorEventFilter *filter = self.headingFilter;
+    if (filter != nil) {
+        _sensorValues.numbers[IndoorFilterHeading] = direction;
+        _sensorValues.numbers[IndoorFilterHeadingTime] = [timestamp timeIntervalSince1970] * 1000;
+        if (![filter matches:&_sensorValues]) {
+            IndoorCostExit(IndoorCostSensors, "heading");
+            return;
+        }
+    }
+
     [self returnHeadingInformation:direction timestamp:timestamp];
+    IndoorCostExit(IndoorCostSensors, "heading");
 }
 
 - (void)location:(IndoorAtlasLocationService *)manager statusChanged:(IAStatus *)status
 {
     NSString *statusDisplay;
-    NSUInteger statusCode;
+    NSUInteger statusCode = STATUS_OUT_OF_SERVICE;
+    IndoorTraceInstant("sdk", "statusChanged");
+    IndoorCostEnter();
     switch (status.type) {
         case kIAStatusServiceAvailable:
             statusDisplay = @"Available";
@@ -905,42 +2409,49 @@
             break;
     }
     
+    [self.positioningState setStatus:statusCode message:statusDisplay time:(int64_t)([[NSDate date] timeIntervalSince1970] * 1000)];
     [self returnStatusInformation:statusDisplay code:statusCode];
+    IndoorCostExit(IndoorCostPositioning, "status");
     NSLog(@"IALocationManager status %d %@", status.type, statusDisplay) ;
 }
 
 - (void)location:(IndoorAtlasLocationService *)manager withFloorPlan:(IAFloorPlan *)floorPlan
 {
     if (self.floorPlanCallbackID != nil) {
-        NSMutableDictionary *returnInfo = [NSMutableDictionary dictionaryWithCapacity:17];
-
-        NSNumber *timestamp = [NSNumber numberWithDouble:([[NSDate date] timeIntervalSince1970] * 1000)];
-        [returnInfo setObject:timestamp forKey:@"timestamp"];
-        [returnInfo setObject:floorPlan.floorPlanId forKey:@"id"];
-        [returnInfo setObject:floorPlan.name forKey:@"name"];
-        [returnInfo setObject:[floorPlan.imageUrl absoluteString] forKey:@"url"];
-        [returnInfo setObject:[NSNumber numberWithInteger:floorPlan.floor.level] forKey:@"floorLevel"];
-        [returnInfo setObject:[NSNumber numberWithDouble: floorPlan.bearing] forKey:@"bearing"];
-        [returnInfo setObject:[NSNumber numberWithInteger:floorPlan.height] forKey:@"bitmapHeight"];
-        [returnInfo setObject:[NSNumber numberWithInteger:floorPlan.width] forKey:@"bitmapWidth"];
-        [returnInfo setObject:[NSNumber numberWithFloat:floorPlan.heightMeters] forKey:@"heightMeters"];
-        [returnInfo setObject:[NSNumber numberWithFloat:floorPlan.widthMeters] forKey:@"widthMeters"];
-        [returnInfo setObject:[NSNumber numberWithFloat:floorPlan.meterToPixelConversion] forKey:@"metersToPixels"];
-        [returnInfo setObject:[NSNumber numberWithFloat:floorPlan.pixelToMeterConversion] forKey:@"pixelsToMeters"];
-        CLLocationCoordinate2D locationPoint = floorPlan.bottomLeft;
-        [returnInfo setObject:[NSArray arrayWithObjects:[NSNumber numberWithDouble:locationPoint.longitude], [NSNumber numberWithDouble:locationPoint.latitude], nil] forKey:@"bottomLeft"];
-        locationPoint = floorPlan.center;
-        [returnInfo setObject:[NSArray arrayWithObjects:[NSNumber numberWithDouble:locationPoint.longitude], [NSNumber numberWithDouble:locationPoint.latitude], nil] forKey:@"center"];
-        locationPoint = floorPlan.topLeft;
-        [returnInfo setObject:[NSArray arrayWithObjects:[NSNumber numberWithDouble:locationPoint.longitude], [NSNumber numberWithDouble:locationPoint.latitude], nil] forKey:@"topLeft"];
-        locationPoint = floorPlan.topRight;
-        [returnInfo setObject:[NSArray arrayWithObjects:[NSNumber numberWithDouble:locationPoint.longitude], [NSNumber numberWithDouble:locationPoint.latitude], nil] forKey:@"topRight"];
-
+        NSDictionary *returnInfo = [self dictionaryFromFloorPlan:floorPlan];
         CDVPluginResult *result = [CDVPluginResult resultWithStatus:CDVCommandStatus_OK messageAsDictionary:returnInfo];
         [self.commandDelegate sendPluginResult:result callbackId:self.floorPlanCallbackID];
     }
 }
 
+- (NSDictionary *)dictionaryFromFloorPlan:(IAFloorPlan *)floorPlan
+{
+    NSMutableDictionary *returnInfo = [NSMutableDictionary dictionaryWithCapacity:17];
+
+    NSNumber *timestamp = [NSNumber numberWithDouble:([[NSDate date] timeIntervalSince1970] * 1000)];
+    [returnInfo setObject:timestamp forKey:@"timestamp"];
+    [returnInfo setObject:floorPlan.floorPlanId forKey:@"id"];
+    [returnInfo setObject:floorPlan.name forKey:@"name"];
+    [returnInfo setObject:[floorPlan.imageUrl absoluteString] forKey:@"url"];
+    [returnInfo setObject:[NSNumber numberWithInteger:floorPlan.floor.level] forKey:@"floorLevel"];
+    [returnInfo setObject:[NSNumber numberWithDouble: floorPlan.bearing] forKey:@"bearing"];
+    [returnInfo setObject:[NSNumber numberWithInteger:floorPlan.height] forKey:@"bitmapHeight"];
+    [returnInfo setObject:[NSNumber numberWithInteger:floorPlan.width] forKey:@"bitmapWidth"];
+    [returnInfo setObject:[NSNumber numberWithFloat:floorPlan.heightMeters] forKey:@"heightMeters"];
+    [returnInfo setObject:[NSNumber numberWithFloat:floorPlan.widthMeters] forKey:@"widthMeters"];
+    [returnInfo setObject:[NSNumber numberWithFloat:floorPlan.meterToPixelConversion] forKey:@"metersToPixels"];
+    [returnInfo setObject:[NSNumber numberWithFloat:floorPlan.pixelToMeterConversion] forKey:@"pixelsToMeters"];
+    CLLocationCoordinate2D locationPoint = floorPlan.bottomLeft;
+    [returnInfo setObject:[NSArray arrayWithObjects:[NSNumber numberWithDouble:locationPoint.longitude], [NSNumber numberWithDouble:locationPoint.latitude], nil] forKey:@"bottomLeft"];
+    locationPoint = floorPlan.center;
+    [returnInfo setObject:[NSArray arrayWithObjects:[NSNumber numberWithDouble:locationPoint.longitude], [NSNumber numberWithDouble:locationPoint.latitude], nil] forKey:@"center"];
+    locationPoint = floorPlan.topLeft;
+    [returnInfo setObject:[NSArray arrayWithObjects:[NSNumber numberWithDouble:locationPoint.longitude], [NSNumber numberWithDouble:locationPoint.latitude], nil] forKey:@"topLeft"];
+    locationPoint = floorPlan.topRight;
+    [returnInfo setObject:[NSArray arrayWithObjects:[NSNumber numberWithDouble:locationPoint.longitude], [NSNumber numberWithDouble:locationPoint.latitude], nil] forKey:@"topRight"];
+    return returnInfo;
+}
+
 - (void)location:(IndoorAtlasLocationService *)manager didFloorPlanFailedWithError:(NSError *)error
 {
     NSLog(@"locationManager::didFloorPlanFailedWithError %@", [error localizedFailureReason]);
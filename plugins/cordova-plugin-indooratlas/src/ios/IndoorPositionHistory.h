@@ -0,0 +1,53 @@
+
+#import <Foundation/Foundation.h>
+#import "IndoorVenueFrame.h"
+
+extern const uint64_t IndoorPositionHistoryDefaultMaxDiskBytes;
+extern const NSUInteger IndoorPositionHistoryDefaultMaxPoints;
+
+/**
+ *  Bounded native history of fixes, so that breadcrumb trails and distance
+ *  walked do not need JavaScript to keep every position it ever received.
+ *
+ *  Fixes are kept in venue frame millimetres in blocks of 256, delta-encoded
+ *  as zigzag varints. The newest 16 blocks are a ring in memory, older ones
+ *  are spilled to a file of CRC-checked records that is truncated after its
+ *  last valid record on open and loses its oldest half past the byte bound.
+ *  Queries simplify the fixes of a time range by Douglas-Peucker rank and
+ *  return them in one little-endian payload. Thread safe. Matches
+ *  PositionHistory.java byte for byte, see there for the layouts.
+ */
+@interface IndoorPositionHistory : NSObject
+
+/**
+ *  Opens the history in a directory, loading the index of the spilled blocks
+ *
+ *  @param path directory, created if missing
+ */
+- (instancetype)initWithDirectory:(NSString *)path maxDiskBytes:(uint64_t)maxDiskBytes error:(NSError **)error;
+
+/**
+ *  Records a fix. Sealing a block may spill and compact the file, so call it
+ *  off the location callback thread.
+ *
+ *  @param timeMs milliseconds since the epoch
+ *  @param accuracy metres
+ */
+- (void)addAt:(int64_t)timeMs frame:(IndoorVenueFrame *)frame point:(IndoorLocalPoint)point floor:(NSInteger)floor accuracy:(double)accuracy;
+
+/**
+ *  Fixes between fromMs and toMs inclusive, simplified to at most maxPoints
+ */
+- (NSData *)queryFrom:(int64_t)fromMs to:(int64_t)toMs maxPoints:(NSUInteger)maxPoints;
+
+/**
+ *  Spills the fixes kept in memory, so that they survive the process
+ */
+- (void)sync;
+
+/**
+ *  Forgets every fix, also on disk
+ */
+- (void)clear;
+
+@end
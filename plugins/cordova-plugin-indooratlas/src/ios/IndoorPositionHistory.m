@@ -0,0 +1,605 @@
+
+#import "IndoorPositionHistory.h"
+#import <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+const uint64_t IndoorPositionHistoryDefaultMaxDiskBytes = 4 * 1024 * 1024;
+const NSUInteger IndoorPositionHistoryDefaultMaxPoints = 1000;
+
+static const NSInteger kBlockFixes = 256;
+static const NSUInteger kMemoryBlocks = 16;
+static const NSUInteger kEncodedHeaderBytes = 48;
+static const NSUInteger kRecordHeaderBytes = 48;
+static const NSUInteger kMaxBlockBytes = 256 * 5 * 10;
+static NSString *const kSpillFile = @"history.bin";
+
+static void putInt32(uint8_t *p, int32_t value)
+{
+    uint32_t bits = CFSwapInt32HostToLittle((uint32_t)value);
+    memcpy(p, &bits, 4);
+}
+
+static void putInt64(uint8_t *p, int64_t value)
+{
+    uint64_t bits = CFSwapInt64HostToLittle((uint64_t)value);
+    memcpy(p, &bits, 8);
+}
+
+static void putDouble(uint8_t *p, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    bits = CFSwapInt64HostToLittle(bits);
+    memcpy(p, &bits, 8);
+}
+
+static int32_t getInt32(const uint8_t *p)
+{
+    uint32_t bits;
+    memcpy(&bits, p, 4);
+    return (int32_t)CFSwapInt32LittleToHost(bits);
+}
+
+static int64_t getInt64(const uint8_t *p)
+{
+    uint64_t bits;
+    memcpy(&bits, p, 8);
+    return (int64_t)CFSwapInt64LittleToHost(bits);
+}
+
+static double getDouble(const uint8_t *p)
+{
+    uint64_t bits;
+    memcpy(&bits, p, 8);
+    bits = CFSwapInt64LittleToHost(bits);
+    double value;
+    memcpy(&value, &bits, 8);
+    return value;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)((value >> 1) ^ (~(value & 1) + 1));
+}
+
+static NSUInteger putVarint(uint8_t *out, NSUInteger position, uint64_t value)
+{
+    while ((value & ~(uint64_t)0x7f) != 0) {
+        out[position++] = (uint8_t)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out[position++] = (uint8_t)value;
+    return position;
+}
+
+static uint64_t getVarint(const uint8_t *in, NSUInteger *position)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b = in[(*position)++];
+        value |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            break;
+        }
+    }
+    return value;
+}
+
+@interface IndoorHistoryBlock : NSObject {
+@public
+    double _originLatitude;
+    double _originLongitude;
+    int64_t _firstTime;
+    int64_t _lastTime;
+    NSInteger _count;
+    NSMutableData *_data;
+    NSUInteger _length;
+    // Spilled blocks: position of the data in the file; the data is then nil
+    int64_t _fileOffset;
+    // Encoder state
+    int64_t _previousTime;
+    int32_t _previousEast;
+    int32_t _previousNorth;
+    int32_t _previousFloor;
+    int32_t _previousAccuracy;
+}
+@end
+
+@implementation IndoorHistoryBlock
+@end
+
+/**
+ *  Fixes decoded for a query, in one venue frame
+ */
+@interface IndoorHistorySeries : NSObject {
+@public
+    IndoorVenueFrame *_frame;
+    NSMutableData *_times;
+    NSMutableData *_ints;
+    NSUInteger _count;
+}
+@end
+
+@implementation IndoorHistorySeries
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        _times = [NSMutableData dataWithLength:256 * sizeof(int64_t)];
+        _ints = [NSMutableData dataWithLength:256 * 4 * sizeof(int32_t)];
+    }
+    return self;
+}
+
+- (void)addAt:(int64_t)time east:(int32_t)east north:(int32_t)north floor:(int32_t)floor accuracy:(int32_t)accuracy
+{
+    if (_count * sizeof(int64_t) == _times.length) {
+        _times.length = _count * 2 * sizeof(int64_t);
+        _ints.length = _count * 8 * sizeof(int32_t);
+    }
+    ((int64_t *)_times.mutableBytes)[_count] = time;
+    int32_t *ints = (int32_t *)_ints.mutableBytes + _count * 4;
+    ints[0] = east;
+    ints[1] = north;
+    ints[2] = floor;
+    ints[3] = accuracy;
+    _count++;
+}
+
+@end
+
+static double segmentDistance(const int32_t *ints, NSUInteger i, NSUInteger a, NSUInteger b)
+{
+    double ax = ints[a * 4], ay = ints[a * 4 + 1];
+    double dx = ints[b * 4] - ax, dy = ints[b * 4 + 1] - ay;
+    double px = ints[i * 4] - ax, py = ints[i * 4 + 1] - ay;
+    double lengthSquared = dx * dx + dy * dy;
+    double t = lengthSquared > 0 ? (px * dx + py * dy) / lengthSquared : 0;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+    return hypot(px - t * dx, py - t * dy);
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+@implementation IndoorPositionHistory {
+    NSString *_path;
+    uint64_t _maxDiskBytes;
+    NSMutableArray<IndoorHistoryBlock *> *_spilled;
+    NSMutableArray<IndoorHistoryBlock *> *_memory;
+    IndoorHistoryBlock *_open;
+    uint64_t _fileBytes;
+}
+
+- (instancetype)initWithDirectory:(NSString *)path maxDiskBytes:(uint64_t)maxDiskBytes error:(NSError **)error
+{
+    self = [super init];
+    if (self) {
+        if (![[NSFileManager defaultManager] createDirectoryAtPath:path withIntermediateDirectories:YES attributes:nil error:error]) {
+            return nil;
+        }
+        _path = [path stringByAppendingPathComponent:kSpillFile];
+        _maxDiskBytes = maxDiskBytes;
+        _spilled = [NSMutableArray array];
+        _memory = [NSMutableArray array];
+        if (![self load:error]) {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)addAt:(int64_t)timeMs frame:(IndoorVenueFrame *)frame point:(IndoorLocalPoint)point floor:(NSInteger)floor accuracy:(double)accuracy
+{
+    @synchronized (self) {
+        IndoorHistoryBlock *block = _open;
+        if (block != nil && (block->_count == kBlockFixes || timeMs < block->_lastTime
+                || block->_originLatitude != frame.origin.latitude
+                || block->_originLongitude != frame.origin.longitude)) {
+            [self seal];
+            block = nil;
+        }
+        if (block == nil) {
+            block = [[IndoorHistoryBlock alloc] init];
+            block->_originLatitude = frame.origin.latitude;
+            block->_originLongitude = frame.origin.longitude;
+            block->_firstTime = timeMs;
+            block->_previousTime = timeMs;
+            block->_fileOffset = -1;
+            block->_data = [NSMutableData dataWithLength:kMaxBlockBytes];
+            _open = block;
+        }
+        int32_t accuracyMm = (int32_t)lround(accuracy * 1000);
+        uint8_t *data = block->_data.mutableBytes;
+        NSUInteger p = block->_length;
+        p = putVarint(data, p, zigzag(timeMs - block->_previousTime));
+        p = putVarint(data, p, zigzag((int64_t)point.east - block->_previousEast));
+        p = putVarint(data, p, zigzag((int64_t)point.north - block->_previousNorth));
+        p = putVarint(data, p, zigzag((int64_t)floor - block->_previousFloor));
+        p = putVarint(data, p, zigzag((int64_t)accuracyMm - block->_previousAccuracy));
+        block->_length = p;
+        block->_previousTime = timeMs;
+        block->_previousEast = point.east;
+        block->_previousNorth = point.north;
+        block->_previousFloor = (int32_t)floor;
+        block->_previousAccuracy = accuracyMm;
+        block->_lastTime = timeMs;
+        block->_count++;
+    }
+}
+
+- (NSData *)queryFrom:(int64_t)fromMs to:(int64_t)toMs maxPoints:(NSUInteger)maxPoints
+{
+    @synchronized (self) {
+        IndoorHistorySeries *series = [[IndoorHistorySeries alloc] init];
+        int fd = -1;
+        for (IndoorHistoryBlock *block in _spilled) {
+            if (block->_lastTime < fromMs || block->_firstTime > toMs) {
+                continue;
+            }
+            if (fd < 0) {
+                fd = open(_path.fileSystemRepresentation, O_RDONLY);
+                if (fd < 0) {
+                    NSLog(@"Cannot read history: %s", strerror(errno));
+                    break;
+                }
+            }
+            NSMutableData *data = [NSMutableData dataWithLength:block->_length];
+            if (pread(fd, data.mutableBytes, block->_length, (off_t)block->_fileOffset) != (ssize_t)block->_length) {
+                NSLog(@"Cannot read history block at %lld", block->_fileOffset);
+                continue;
+            }
+            [self decode:block data:data.bytes from:fromMs to:toMs into:series];
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        for (IndoorHistoryBlock *block in _memory) {
+            if (block->_lastTime >= fromMs && block->_firstTime <= toMs) {
+                [self decode:block data:block->_data.bytes from:fromMs to:toMs into:series];
+            }
+        }
+        if (_open != nil && _open->_lastTime >= fromMs && _open->_firstTime <= toMs) {
+            [self decode:_open data:_open->_data.bytes from:fromMs to:toMs into:series];
+        }
+        return [self encode:series maxPoints:MAX(2, maxPoints)];
+    }
+}
+
+- (void)sync
+{
+    @synchronized (self) {
+        if (_open != nil) {
+            [self seal];
+        }
+        while (_memory.count > 0) {
+            IndoorHistoryBlock *block = _memory[0];
+            [_memory removeObjectAtIndex:0];
+            [self spill:block];
+        }
+    }
+}
+
+- (void)clear
+{
+    @synchronized (self) {
+        [_memory removeAllObjects];
+        _open = nil;
+        [self clearSpilled];
+    }
+}
+
+- (void)seal
+{
+    IndoorHistoryBlock *block = _open;
+    _open = nil;
+    block->_data.length = block->_length;
+    [_memory addObject:block];
+    while (_memory.count > kMemoryBlocks) {
+        IndoorHistoryBlock *oldest = _memory[0];
+        [_memory removeObjectAtIndex:0];
+        [self spill:oldest];
+    }
+}
+
+- (void)spill:(IndoorHistoryBlock *)block
+{
+    uint32_t crc = (uint32_t)crc32(0L, block->_data.bytes, (uInt)block->_length);
+    NSMutableData *record = [NSMutableData dataWithLength:kRecordHeaderBytes];
+    uint8_t *header = record.mutableBytes;
+    putDouble(header, block->_originLatitude);
+    putDouble(header + 8, block->_originLongitude);
+    putInt64(header + 16, block->_firstTime);
+    putInt64(header + 24, block->_lastTime);
+    putInt32(header + 32, (int32_t)block->_count);
+    putInt32(header + 36, (int32_t)block->_length);
+    putInt32(header + 40, (int32_t)crc);
+    putInt32(header + 44, 0);
+    [record appendData:block->_data];
+
+    int fd = open(_path.fileSystemRepresentation, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        NSLog(@"Cannot spill history: %s", strerror(errno));
+        return;
+    }
+    // One write, so that a killed process leaves no half record behind
+    ssize_t written = write(fd, record.bytes, record.length);
+    if (written != (ssize_t)record.length) {
+        NSLog(@"Cannot spill history: %s", written < 0 ? strerror(errno) : "short write");
+        if (written > 0) {
+            ftruncate(fd, (off_t)_fileBytes);
+        }
+    } else {
+        block->_fileOffset = (int64_t)(_fileBytes + kRecordHeaderBytes);
+        block->_data = nil;
+        _fileBytes += record.length;
+        [_spilled addObject:block];
+    }
+    close(fd);
+    if (_fileBytes > _maxDiskBytes) {
+        [self compact];
+    }
+}
+
+/**
+ *  Drops the oldest spilled blocks until the file is at most half its bound
+ */
+- (void)compact
+{
+    NSUInteger first = 0;
+    uint64_t bytes = _fileBytes;
+    while (first < _spilled.count && bytes > _maxDiskBytes / 2) {
+        bytes -= kRecordHeaderBytes + _spilled[first]->_length;
+        first++;
+    }
+    if (first == _spilled.count) {
+        [self clearSpilled];
+        return;
+    }
+    int64_t start = _spilled[first]->_fileOffset - (int64_t)kRecordHeaderBytes;
+    NSFileHandle *in = [NSFileHandle fileHandleForReadingAtPath:_path];
+    [in seekToFileOffset:(unsigned long long)start];
+    NSData *kept = [in readDataToEndOfFile];
+    [in closeFile];
+    NSError *error = nil;
+    // Atomic writes go through a temporary file and a rename
+    if (kept.length != _fileBytes - (uint64_t)start || ![kept writeToFile:_path options:NSDataWritingAtomic error:&error]) {
+        NSLog(@"Cannot compact history: %@", error);
+        [self clearSpilled];
+        return;
+    }
+    [_spilled removeObjectsInRange:NSMakeRange(0, first)];
+    for (IndoorHistoryBlock *block in _spilled) {
+        block->_fileOffset -= start;
+    }
+    _fileBytes -= (uint64_t)start;
+}
+
+- (void)clearSpilled
+{
+    [_spilled removeAllObjects];
+    _fileBytes = 0;
+    NSError *error = nil;
+    if ([[NSFileManager defaultManager] fileExistsAtPath:_path]
+            && ![[NSFileManager defaultManager] removeItemAtPath:_path error:&error]) {
+        NSLog(@"Cannot delete %@: %@", _path, error);
+    }
+}
+
+- (BOOL)load:(NSError **)error
+{
+    if (![[NSFileManager defaultManager] fileExistsAtPath:_path]) {
+        return YES;
+    }
+    int fd = open(_path.fileSystemRepresentation, O_RDWR);
+    if (fd < 0) {
+        if (error) {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        }
+        return NO;
+    }
+    off_t length = lseek(fd, 0, SEEK_END);
+    off_t position = 0;
+    uint8_t header[kRecordHeaderBytes];
+    NSMutableData *data = [NSMutableData dataWithLength:kMaxBlockBytes];
+    while (position + (off_t)kRecordHeaderBytes <= length) {
+        if (pread(fd, header, kRecordHeaderBytes, position) != (ssize_t)kRecordHeaderBytes) {
+            break;
+        }
+        IndoorHistoryBlock *block = [[IndoorHistoryBlock alloc] init];
+        block->_originLatitude = getDouble(header);
+        block->_originLongitude = getDouble(header + 8);
+        block->_firstTime = getInt64(header + 16);
+        block->_lastTime = getInt64(header + 24);
+        block->_count = getInt32(header + 32);
+        int32_t size = getInt32(header + 36);
+        uint32_t checksum = (uint32_t)getInt32(header + 40);
+        if (size <= 0 || size > (int32_t)kMaxBlockBytes
+                || position + (off_t)kRecordHeaderBytes + size > length) {
+            break;
+        }
+        if (pread(fd, data.mutableBytes, size, position + kRecordHeaderBytes) != size
+                || (uint32_t)crc32(0L, data.bytes, (uInt)size) != checksum) {
+            break;
+        }
+        block->_length = (NSUInteger)size;
+        block->_fileOffset = position + kRecordHeaderBytes;
+        [_spilled addObject:block];
+        position += kRecordHeaderBytes + size;
+    }
+    if (position < length) {
+        NSLog(@"Dropping %lld bytes after the last valid history block", (long long)(length - position));
+        ftruncate(fd, position);
+    }
+    _fileBytes = (uint64_t)position;
+    close(fd);
+    return YES;
+}
+
+- (void)decode:(IndoorHistoryBlock *)block data:(const uint8_t *)data from:(int64_t)fromMs to:(int64_t)toMs into:(IndoorHistorySeries *)series
+{
+    CLLocationCoordinate2D origin = CLLocationCoordinate2DMake(block->_originLatitude, block->_originLongitude);
+    IndoorVenueFrame *frame = [[IndoorVenueFrame alloc] initWithOrigin:origin];
+    if (series->_frame == nil) {
+        series->_frame = frame;
+    }
+    BOOL sameFrame = series->_frame.origin.latitude == block->_originLatitude
+            && series->_frame.origin.longitude == block->_originLongitude;
+    int64_t time = block->_firstTime;
+    int32_t east = 0, north = 0, floor = 0, accuracy = 0;
+    NSUInteger position = 0;
+    for (NSInteger i = 0; i < block->_count; i++) {
+        time += unzigzag(getVarint(data, &position));
+        east += (int32_t)unzigzag(getVarint(data, &position));
+        north += (int32_t)unzigzag(getVarint(data, &position));
+        floor += (int32_t)unzigzag(getVarint(data, &position));
+        accuracy += (int32_t)unzigzag(getVarint(data, &position));
+        if (time < fromMs || time > toMs) {
+            continue;
+        }
+        if (sameFrame) {
+            [series addAt:time east:east north:north floor:floor accuracy:accuracy];
+        } else {
+            IndoorLocalPoint point = { east, north };
+            IndoorLocalPoint local = [series->_frame toLocal:[frame toCoordinate:point]];
+            [series addAt:time east:local.east north:local.north floor:floor accuracy:accuracy];
+        }
+    }
+}
+
+- (NSData *)encode:(IndoorHistorySeries *)series maxPoints:(NSUInteger)maxPoints
+{
+    NSUInteger count = series->_count;
+    const int32_t *ints = series->_ints.bytes;
+    const int64_t *times = series->_times.bytes;
+    double distanceMm = 0;
+    for (NSUInteger i = 1; i < count; i++) {
+        distanceMm += hypot(ints[i * 4] - ints[(i - 1) * 4], ints[i * 4 + 1] - ints[(i - 1) * 4 + 1]);
+    }
+    NSMutableData *keepData = [NSMutableData dataWithLength:MAX(count, 1)];
+    BOOL *keep = keepData.mutableBytes;
+    NSUInteger kept = [self simplify:series maxPoints:maxPoints keep:keep];
+
+    NSMutableData *payload = [NSMutableData dataWithLength:kEncodedHeaderBytes + kept * 24];
+    uint8_t *out = payload.mutableBytes;
+    IndoorVenueFrame *frame = series->_frame;
+    putDouble(out, frame != nil ? frame.origin.latitude : 0);
+    putDouble(out + 8, frame != nil ? frame.origin.longitude : 0);
+    putDouble(out + 16, frame != nil ? [frame millimetresPerDegreeLatitude] : 0);
+    putDouble(out + 24, frame != nil ? [frame millimetresPerDegreeLongitude] : 0);
+    putDouble(out + 32, distanceMm / 1000);
+    putInt32(out + 40, (int32_t)count);
+    putInt32(out + 44, (int32_t)kept);
+    uint8_t *timeOut = out + kEncodedHeaderBytes;
+    uint8_t *intOut = timeOut + kept * 8;
+    for (NSUInteger i = 0; i < count; i++) {
+        if (!keep[i]) {
+            continue;
+        }
+        putDouble(timeOut, (double)times[i]);
+        timeOut += 8;
+        for (NSUInteger f = 0; f < 4; f++) {
+            putInt32(intOut, ints[i * 4 + f]);
+            intOut += 4;
+        }
+    }
+    return payload;
+}
+
+/**
+ *  Ranks the fixes by Douglas-Peucker significance, capped by that of the span
+ *  they split, and keeps the maxPoints highest. Returns the number kept.
+ */
+- (NSUInteger)simplify:(IndoorHistorySeries *)series maxPoints:(NSUInteger)maxPoints keep:(BOOL *)keep
+{
+    NSUInteger count = series->_count;
+    if (count <= maxPoints) {
+        for (NSUInteger i = 0; i < count; i++) {
+            keep[i] = YES;
+        }
+        return count;
+    }
+    const int32_t *ints = series->_ints.bytes;
+    NSMutableData *significanceData = [NSMutableData dataWithLength:count * sizeof(double)];
+    double *significance = significanceData.mutableBytes;
+    NSMutableData *stackData = [NSMutableData dataWithLength:64 * sizeof(NSUInteger)];
+    NSMutableData *capsData = [NSMutableData dataWithLength:32 * sizeof(double)];
+    NSUInteger start = 0;
+    for (NSUInteger j = 1; j <= count; j++) {
+        if (j < count && ints[j * 4 + 2] == ints[start * 4 + 2]) {
+            continue;
+        }
+        NSUInteger end = j - 1;
+        significance[start] = INFINITY;
+        significance[end] = INFINITY;
+        NSUInteger *stack = stackData.mutableBytes;
+        double *caps = capsData.mutableBytes;
+        NSUInteger top = 0;
+        stack[top++] = start;
+        stack[top++] = end;
+        caps[0] = INFINITY;
+        while (top > 0) {
+            NSUInteger b = stack[--top];
+            NSUInteger a = stack[--top];
+            double cap = caps[top / 2];
+            NSInteger worst = -1;
+            double worstDistance = -1;
+            for (NSUInteger i = a + 1; i < b; i++) {
+                double d = segmentDistance(ints, i, a, b);
+                if (d > worstDistance) {
+                    worst = (NSInteger)i;
+                    worstDistance = d;
+                }
+            }
+            if (worst < 0) {
+                continue;
+            }
+            double rank = MIN(worstDistance, cap);
+            significance[worst] = rank;
+            if ((top + 4) * sizeof(NSUInteger) > stackData.length) {
+                stackData.length *= 2;
+                capsData.length *= 2;
+                stack = stackData.mutableBytes;
+                caps = capsData.mutableBytes;
+            }
+            caps[top / 2] = rank;
+            stack[top++] = a;
+            stack[top++] = (NSUInteger)worst;
+            caps[top / 2] = rank;
+            stack[top++] = (NSUInteger)worst;
+            stack[top++] = b;
+        }
+        start = j;
+    }
+    NSMutableData *sortedData = [significanceData mutableCopy];
+    double *sorted = sortedData.mutableBytes;
+    qsort(sorted, count, sizeof(double), compareDoubles);
+    double threshold = sorted[count - maxPoints];
+    NSUInteger kept = 0;
+    for (NSUInteger i = 0; i < count; i++) {
+        keep[i] = significance[i] > threshold;
+        if (keep[i]) {
+            kept++;
+        }
+    }
+    // Ties at the threshold fill the remaining places in time order
+    for (NSUInteger i = 0; i < count && kept < maxPoints; i++) {
+        if (!keep[i] && significance[i] == threshold) {
+            keep[i] = YES;
+            kept++;
+        }
+    }
+    return kept;
+}
+
+@end
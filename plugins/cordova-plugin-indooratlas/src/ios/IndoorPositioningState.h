@@ -0,0 +1,56 @@
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  One versioned record of what a status panel shows: the last position with
+ *  its floor certainty, the service status, the current region, the trace id
+ *  of the positioning session and whether positioning runs.
+ *
+ *  Each SDK event updates its part under one lock and bumps the version once.
+ *  Every part remembers the version it last changed at, so snapshots can
+ *  carry only what changed since a version the caller has. Matches
+ *  PositioningState.java.
+ */
+@interface IndoorPositioningState : NSObject
+
+/**
+ *  Records a position
+ *
+ *  @param floorCertainty NAN if unknown
+ *  @param traceId trace id of the session, nil to keep the current one
+ */
+- (void)setLatitude:(double)latitude longitude:(double)longitude altitude:(double)altitude accuracy:(double)accuracy
+            heading:(double)heading floor:(NSInteger)floor floorCertainty:(double)floorCertainty
+               time:(int64_t)timeMs traceId:(NSString *)traceId;
+
+/**
+ *  YES if the trace id of the running session is known
+ */
+- (BOOL)hasTraceId;
+
+/**
+ *  Records a service status with its code and message as statusChanged reports them
+ */
+- (void)setStatus:(NSUInteger)code message:(NSString *)message time:(int64_t)timeMs;
+
+- (void)enterRegion:(NSString *)regionId type:(NSInteger)regionType time:(int64_t)timeMs;
+
+/**
+ *  Forgets the current region if it is the one exited
+ */
+- (void)exitRegion:(NSString *)regionId;
+
+/**
+ *  Records positioning being started or stopped. A new session gets a new
+ *  trace id, which the next position fills in.
+ */
+- (void)setRunning:(BOOL)running;
+
+/**
+ *  { epoch, version, full } and the parts changed after since: location,
+ *  status, region, traceId and running, each NSNull if unknown. All parts
+ *  for another epoch, e.g. 0 or that of an earlier process.
+ */
+- (NSDictionary *)snapshotSince:(int64_t)since epoch:(int64_t)epoch;
+
+@end
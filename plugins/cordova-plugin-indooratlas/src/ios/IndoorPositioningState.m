@@ -0,0 +1,171 @@
+
+#import "IndoorPositioningState.h"
+
+@implementation IndoorPositioningState {
+    int64_t _epoch;
+    int64_t _version;
+
+    int64_t _locationVersion;
+    BOOL _hasLocation;
+    double _latitude;
+    double _longitude;
+    double _altitude;
+    double _accuracy;
+    double _heading;
+    NSInteger _floor;
+    double _floorCertainty;
+    int64_t _locationTime;
+
+    int64_t _statusVersion;
+    NSNumber *_statusCode;
+    NSString *_statusMessage;
+    int64_t _statusTime;
+
+    int64_t _regionVersion;
+    NSString *_regionId;
+    NSInteger _regionType;
+    int64_t _regionTime;
+
+    int64_t _traceIdVersion;
+    NSString *_traceId;
+
+    int64_t _runningVersion;
+    BOOL _running;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        _epoch = (int64_t)([[NSDate date] timeIntervalSince1970] * 1000);
+    }
+    return self;
+}
+
+- (void)setLatitude:(double)latitude longitude:(double)longitude altitude:(double)altitude accuracy:(double)accuracy
+            heading:(double)heading floor:(NSInteger)floor floorCertainty:(double)floorCertainty
+               time:(int64_t)timeMs traceId:(NSString *)traceId
+{
+    @synchronized (self) {
+        _version++;
+        _hasLocation = YES;
+        _latitude = latitude;
+        _longitude = longitude;
+        _altitude = altitude;
+        _accuracy = accuracy;
+        _heading = heading;
+        _floor = floor;
+        _floorCertainty = floorCertainty;
+        _locationTime = timeMs;
+        _locationVersion = _version;
+        if (traceId != nil && ![traceId isEqualToString:_traceId]) {
+            _traceId = [traceId copy];
+            _traceIdVersion = _version;
+        }
+    }
+}
+
+- (BOOL)hasTraceId
+{
+    @synchronized (self) {
+        return _traceId != nil;
+    }
+}
+
+- (void)setStatus:(NSUInteger)code message:(NSString *)message time:(int64_t)timeMs
+{
+    @synchronized (self) {
+        _version++;
+        _statusCode = @(code);
+        _statusMessage = [message copy];
+        _statusTime = timeMs;
+        _statusVersion = _version;
+    }
+}
+
+- (void)enterRegion:(NSString *)regionId type:(NSInteger)regionType time:(int64_t)timeMs
+{
+    @synchronized (self) {
+        _version++;
+        _regionId = [regionId copy];
+        _regionType = regionType;
+        _regionTime = timeMs;
+        _regionVersion = _version;
+    }
+}
+
+- (void)exitRegion:(NSString *)regionId
+{
+    @synchronized (self) {
+        if (_regionId != nil && [_regionId isEqualToString:regionId]) {
+            _version++;
+            _regionId = nil;
+            _regionVersion = _version;
+        }
+    }
+}
+
+- (void)setRunning:(BOOL)running
+{
+    @synchronized (self) {
+        if (running == _running) {
+            return;
+        }
+        _version++;
+        _running = running;
+        _runningVersion = _version;
+        if (running && _traceId != nil) {
+            _traceId = nil;
+            _traceIdVersion = _version;
+        }
+    }
+}
+
+- (NSDictionary *)snapshotSince:(int64_t)since epoch:(int64_t)epoch
+{
+    @synchronized (self) {
+        BOOL full = epoch != _epoch || since > _version;
+        if (full) {
+            since = 0;
+        }
+        NSMutableDictionary *state = [NSMutableDictionary dictionaryWithCapacity:8];
+        state[@"epoch"] = @(_epoch);
+        state[@"version"] = @(_version);
+        state[@"full"] = @(full);
+        if (full || _locationVersion > since) {
+            state[@"location"] = !_hasLocation ? [NSNull null] : @{
+                @"latitude": @(_latitude),
+                @"longitude": @(_longitude),
+                @"altitude": @(_altitude),
+                @"accuracy": @(_accuracy),
+                @"heading": @(_heading),
+                @"flr": @(_floor),
+                @"floorCertainty": isnan(_floorCertainty) ? [NSNull null] : @(_floorCertainty),
+                @"timestamp": @(_locationTime)
+            };
+        }
+        if (full || _statusVersion > since) {
+            state[@"status"] = _statusCode == nil ? [NSNull null] : @{
+                @"code": _statusCode,
+                @"message": _statusMessage ?: @"",
+                @"timestamp": @(_statusTime)
+            };
+        }
+        if (full || _regionVersion > since) {
+            state[@"region"] = _regionId == nil ? [NSNull null] : @{
+                @"regionId": _regionId,
+                @"regionType": @(_regionType),
+                @"timestamp": @(_regionTime)
+            };
+        }
+        if (full || _traceIdVersion > since) {
+            state[@"traceId"] = _traceId ?: [NSNull null];
+        }
+        if (full || _runningVersion > since) {
+            state[@"running"] = @(_running);
+        }
+        return state;
+    }
+}
+
+@end
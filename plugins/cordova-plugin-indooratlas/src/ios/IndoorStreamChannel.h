@@ -0,0 +1,77 @@
+
+#import <Foundation/Foundation.h>
+
+extern const NSInteger IndoorStreamChannelVersion;
+extern const NSInteger IndoorStreamChannelWindowFrames;
+extern const NSInteger IndoorStreamChannelAckEveryFrames;
+extern const NSInteger IndoorStreamChannelQueueCapacity;
+
+/**
+ *  Values per sample: latitude, longitude, altitude, accuracy, heading,
+ *  velocity, floor, timestamp, region id string index or -1, region type,
+ *  region timestamp, altitude accuracy
+ */
+enum { IndoorStreamPositionFields = 12 };
+/**
+ *  trueHeading, timestamp
+ */
+enum { IndoorStreamHeadingFields = 2 };
+/**
+ *  x, y, z, w, timestamp
+ */
+enum { IndoorStreamAttitudeFields = 5 };
+
+/**
+ *  Delivers one frame to the channel's callback, keeping it
+ */
+typedef void (^IndoorStreamSend)(NSData *frame);
+
+/**
+ *  Multiplexed binary channel for the high rate streams: positions of the
+ *  watches, heading and attitude share one long-lived callback that receives
+ *  framed ArrayBuffers instead of a plugin result per update.
+ *
+ *  A frame is little-endian uint16 version, uint16 section count and uint32
+ *  frame sequence number, then sections of uint16 stream id, uint16 fields
+ *  per sample, uint32 sample count, uint32 stream sequence number of the
+ *  first sample and uint32 samples coalesced away, followed by the samples
+ *  as float64. Stream 0 carries the strings samples refer to by index.
+ *
+ *  At most IndoorStreamChannelWindowFrames frames are unacknowledged and
+ *  JavaScript acknowledges every IndoorStreamChannelAckEveryFrames; while
+ *  the window is full sensor streams keep their latest sample and position
+ *  streams their newest IndoorStreamChannelQueueCapacity. Thread safe.
+ *  Matches StreamChannel.java.
+ */
+@interface IndoorStreamChannel : NSObject
+
+/**
+ *  Makes send the channel's callback, replacing the previous one and its streams
+ */
+- (void)openWithSend:(IndoorStreamSend)send;
+
+/**
+ *  Adds a stream; JavaScript chooses its id
+ *
+ *  @param latestOnly YES to keep only the latest sample while the window is full
+ */
+- (void)addStream:(NSInteger)streamId fields:(NSInteger)fields latestOnly:(BOOL)latestOnly;
+- (void)removeStream:(NSInteger)streamId;
+- (BOOL)hasStream:(NSInteger)streamId;
+
+/**
+ *  Index of a string for samples to refer to
+ */
+- (NSInteger)intern:(NSString *)string;
+
+/**
+ *  Queues a sample of the stream's field count and sends it if the window allows
+ */
+- (void)offer:(NSInteger)streamId sample:(const double *)sample;
+
+/**
+ *  Called when JavaScript has handled the frames up to sequence
+ */
+- (void)acknowledge:(uint32_t)sequence;
+
+@end
@@ -0,0 +1,243 @@
+
+#import "IndoorStreamChannel.h"
+#import "IndoorTraceRecorder.h"
+
+const NSInteger IndoorStreamChannelVersion = 1;
+const NSInteger IndoorStreamChannelWindowFrames = 8;
+const NSInteger IndoorStreamChannelAckEveryFrames = 4;
+const NSInteger IndoorStreamChannelQueueCapacity = 64;
+
+static const NSUInteger kFrameHeaderBytes = 8;
+static const NSUInteger kSectionHeaderBytes = 16;
+
+static void putUInt16(uint8_t *p, uint16_t value)
+{
+    value = CFSwapInt16HostToLittle(value);
+    memcpy(p, &value, 2);
+}
+
+static void putUInt32(uint8_t *p, uint32_t value)
+{
+    value = CFSwapInt32HostToLittle(value);
+    memcpy(p, &value, 4);
+}
+
+static void putDouble(uint8_t *p, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    bits = CFSwapInt64HostToLittle(bits);
+    memcpy(p, &bits, 8);
+}
+
+@interface IndoorStream : NSObject
+@property (nonatomic, assign) NSInteger streamId;
+@property (nonatomic, assign) NSInteger fields;
+@property (nonatomic, assign) NSInteger capacity;
+@property (nonatomic, strong) NSMutableData *samples;
+@property (nonatomic, assign) NSInteger head;
+@property (nonatomic, assign) NSInteger count;
+@property (nonatomic, assign) uint32_t nextSample;
+@property (nonatomic, assign) uint32_t dropped;
+@end
+
+@implementation IndoorStream
+@end
+
+@implementation IndoorStreamChannel {
+    IndoorStreamSend _send;
+    uint32_t _sequence;
+    uint32_t _acknowledged;
+    NSMutableArray<IndoorStream *> *_streams;
+    NSMutableArray<NSString *> *_strings;
+    NSMutableDictionary<NSString *, NSNumber *> *_stringIndex;
+    NSUInteger _stringsSent;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        _streams = [NSMutableArray array];
+        _strings = [NSMutableArray array];
+        _stringIndex = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+- (void)openWithSend:(IndoorStreamSend)send
+{
+    @synchronized (self) {
+        _send = [send copy];
+        _sequence = 0;
+        _acknowledged = 0;
+        _stringsSent = 0;
+        [_streams removeAllObjects];
+    }
+}
+
+- (void)addStream:(NSInteger)streamId fields:(NSInteger)fields latestOnly:(BOOL)latestOnly
+{
+    @synchronized (self) {
+        [self removeStream:streamId];
+        IndoorStream *stream = [[IndoorStream alloc] init];
+        stream.streamId = streamId;
+        stream.fields = fields;
+        stream.capacity = latestOnly ? 1 : IndoorStreamChannelQueueCapacity;
+        stream.samples = [NSMutableData dataWithLength:fields * stream.capacity * sizeof(double)];
+        [_streams addObject:stream];
+    }
+}
+
+- (void)removeStream:(NSInteger)streamId
+{
+    @synchronized (self) {
+        IndoorStream *stream = [self find:streamId];
+        if (stream != nil) {
+            [_streams removeObject:stream];
+        }
+    }
+}
+
+- (BOOL)hasStream:(NSInteger)streamId
+{
+    @synchronized (self) {
+        return [self find:streamId] != nil;
+    }
+}
+
+- (NSInteger)intern:(NSString *)string
+{
+    @synchronized (self) {
+        NSNumber *index = _stringIndex[string];
+        if (index == nil) {
+            index = @(_strings.count);
+            [_strings addObject:string];
+            _stringIndex[string] = index;
+        }
+        return [index integerValue];
+    }
+}
+
+- (void)offer:(NSInteger)streamId sample:(const double *)sample
+{
+    @synchronized (self) {
+        IndoorStream *stream = [self find:streamId];
+        if (stream == nil || _send == nil) {
+            return;
+        }
+        NSInteger slot;
+        if (stream.count == stream.capacity) {
+            slot = stream.head;
+            stream.head = (stream.head + 1) % stream.capacity;
+            stream.dropped++;
+        } else {
+            slot = (stream.head + stream.count) % stream.capacity;
+            stream.count++;
+        }
+        double *samples = stream.samples.mutableBytes;
+        memcpy(samples + slot * stream.fields, sample, stream.fields * sizeof(double));
+        stream.nextSample++;
+        [self flush];
+    }
+}
+
+- (void)acknowledge:(uint32_t)sequence
+{
+    @synchronized (self) {
+        if ((int32_t)(sequence - _acknowledged) > 0 && (int32_t)(_sequence - sequence) >= 0) {
+            _acknowledged = sequence;
+            [self flush];
+        }
+    }
+}
+
+- (IndoorStream *)find:(NSInteger)streamId
+{
+    for (IndoorStream *stream in _streams) {
+        if (stream.streamId == streamId) {
+            return stream;
+        }
+    }
+    return nil;
+}
+
+// Called with the lock held
+- (void)flush
+{
+    if (_send == nil || (NSInteger)(_sequence - _acknowledged) >= IndoorStreamChannelWindowFrames) {
+        return;
+    }
+    NSUInteger sections = 0;
+    NSUInteger bytes = kFrameHeaderBytes;
+    for (IndoorStream *stream in _streams) {
+        if (stream.count > 0) {
+            sections++;
+            bytes += kSectionHeaderBytes + stream.count * stream.fields * 8;
+        }
+    }
+    if (sections == 0) {
+        return;
+    }
+    NSMutableArray<NSData *> *strings = nil;
+    if (_stringsSent < _strings.count) {
+        strings = [NSMutableArray array];
+        bytes += kSectionHeaderBytes;
+        for (NSUInteger i = _stringsSent; i < _strings.count; i++) {
+            NSData *utf8 = [_strings[i] dataUsingEncoding:NSUTF8StringEncoding];
+            [strings addObject:utf8];
+            bytes += (8 + utf8.length + 7) & ~(NSUInteger)7;
+        }
+        sections++;
+    }
+
+    NSMutableData *frame = [NSMutableData dataWithLength:bytes];
+    uint8_t *out = frame.mutableBytes;
+    _sequence++;
+    putUInt16(out, (uint16_t)IndoorStreamChannelVersion);
+    putUInt16(out + 2, (uint16_t)sections);
+    putUInt32(out + 4, _sequence);
+    NSUInteger offset = kFrameHeaderBytes;
+    if (strings != nil) {
+        putUInt16(out + offset, 0);
+        putUInt16(out + offset + 2, 0);
+        putUInt32(out + offset + 4, (uint32_t)strings.count);
+        putUInt32(out + offset + 8, (uint32_t)_stringsSent);
+        putUInt32(out + offset + 12, 0);
+        offset += kSectionHeaderBytes;
+        for (NSUInteger i = 0; i < strings.count; i++) {
+            putUInt32(out + offset, (uint32_t)(_stringsSent + i));
+            putUInt32(out + offset + 4, (uint32_t)strings[i].length);
+            memcpy(out + offset + 8, strings[i].bytes, strings[i].length);
+            offset += (8 + strings[i].length + 7) & ~(NSUInteger)7;
+        }
+        _stringsSent = _strings.count;
+    }
+    for (IndoorStream *stream in _streams) {
+        if (stream.count == 0) {
+            continue;
+        }
+        putUInt16(out + offset, (uint16_t)stream.streamId);
+        putUInt16(out + offset + 2, (uint16_t)stream.fields);
+        putUInt32(out + offset + 4, (uint32_t)stream.count);
+        putUInt32(out + offset + 8, stream.nextSample - (uint32_t)stream.count);
+        putUInt32(out + offset + 12, stream.dropped);
+        offset += kSectionHeaderBytes;
+        const double *samples = stream.samples.bytes;
+        for (NSInteger i = 0; i < stream.count; i++) {
+            const double *sample = samples + ((stream.head + i) % stream.capacity) * stream.fields;
+            for (NSInteger f = 0; f < stream.fields; f++) {
+                putDouble(out + offset, sample[f]);
+                offset += 8;
+            }
+        }
+        stream.head = 0;
+        stream.count = 0;
+        stream.dropped = 0;
+    }
+    IndoorTraceBegin("bridge", "sendStreamFrame");
+    _send(frame);
+    IndoorTraceEnd("bridge", "sendStreamFrame");
+}
+
+@end
@@ -0,0 +1,51 @@
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  Priority lanes of the shared scheduler
+ */
+typedef NS_ENUM(NSInteger, IndoorTaskLane) {
+    IndoorTaskLaneInteractive = 0,
+    IndoorTaskLaneBackground,
+    IndoorTaskLaneIdle
+};
+
+/**
+ *  Cancels submitted tasks. Tasks that have not started are dropped; running
+ *  tasks should check isCancelled at convenient points.
+ */
+@interface IndoorCancellationToken : NSObject
+
+@property (atomic, readonly, getter=isCancelled) BOOL cancelled;
+
+- (void)cancel;
+
+@end
+
+/**
+ *  Scheduler shared by all native work of the plugin, so that subsystems do not
+ *  start their own threads or block the main thread. Lanes map onto the GCD
+ *  quality of service classes, which already provide work stealing and a
+ *  thread pool sized to the device. Matches TaskScheduler.java.
+ */
+@interface IndoorTaskScheduler : NSObject
+
++ (IndoorTaskScheduler *)sharedScheduler;
+
+- (IndoorCancellationToken *)submit:(IndoorTaskLane)lane block:(dispatch_block_t)block;
+
+/**
+ *  Schedules a task under an existing token, e.g. the steps of one request
+ */
+- (void)submit:(IndoorTaskLane)lane token:(IndoorCancellationToken *)token block:(dispatch_block_t)block;
+
+/**
+ *  Variants whose cost is accounted to the given IndoorCostAccounting
+ *  subsystem, with the lane as feature. Untagged tasks count as "scheduler".
+ */
+- (IndoorCancellationToken *)submit:(IndoorTaskLane)lane subsystem:(const char *)subsystem block:(dispatch_block_t)block;
+- (void)submit:(IndoorTaskLane)lane token:(IndoorCancellationToken *)token subsystem:(const char *)subsystem block:(dispatch_block_t)block;
+
+- (dispatch_queue_t)queueForLane:(IndoorTaskLane)lane;
+
+@end
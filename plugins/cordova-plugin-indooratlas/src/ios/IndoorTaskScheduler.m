@@ -0,0 +1,79 @@
+
+#import "IndoorTaskScheduler.h"
+#import "IndoorCostAccounting.h"
+
+static const char *const kLaneNames[] = {"interactive", "background", "idle"};
+
+@interface IndoorCancellationToken ()
+@property (atomic, readwrite, getter=isCancelled) BOOL cancelled;
+@end
+
+@implementation IndoorCancellationToken
+
+- (void)cancel
+{
+    self.cancelled = YES;
+}
+
+@end
+
+@implementation IndoorTaskScheduler
+
++ (IndoorTaskScheduler *)sharedScheduler
+{
+    static IndoorTaskScheduler *shared = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        shared = [[IndoorTaskScheduler alloc] init];
+    });
+    return shared;
+}
+
+- (dispatch_queue_t)queueForLane:(IndoorTaskLane)lane
+{
+    switch (lane) {
+        case IndoorTaskLaneInteractive:
+            // User interactive is reserved for the main thread's own work
+            return dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+        case IndoorTaskLaneBackground:
+            return dispatch_get_global_queue(QOS_CLASS_UTILITY, 0);
+        default:
+            return dispatch_get_global_queue(QOS_CLASS_BACKGROUND, 0);
+    }
+}
+
+- (IndoorCancellationToken *)submit:(IndoorTaskLane)lane block:(dispatch_block_t)block
+{
+    return [self submit:lane subsystem:IndoorCostScheduler block:block];
+}
+
+- (void)submit:(IndoorTaskLane)lane token:(IndoorCancellationToken *)token block:(dispatch_block_t)block
+{
+    [self submit:lane token:token subsystem:IndoorCostScheduler block:block];
+}
+
+- (IndoorCancellationToken *)submit:(IndoorTaskLane)lane subsystem:(const char *)subsystem block:(dispatch_block_t)block
+{
+    IndoorCancellationToken *token = [[IndoorCancellationToken alloc] init];
+    [self submit:lane token:token subsystem:subsystem block:block];
+    return token;
+}
+
+- (void)submit:(IndoorTaskLane)lane token:(IndoorCancellationToken *)token subsystem:(const char *)subsystem block:(dispatch_block_t)block
+{
+    const char *feature = kLaneNames[MIN(MAX(lane, IndoorTaskLaneInteractive), IndoorTaskLaneIdle)];
+    dispatch_async([self queueForLane:lane], ^{
+        if (token != nil && token.isCancelled) {
+            return;
+        }
+        IndoorCostEnter();
+        @try {
+            block();
+        } @catch (NSException *exception) {
+            NSLog(@"IndoorTaskScheduler: %@", exception.reason);
+        }
+        IndoorCostExit(subsystem, feature);
+    });
+}
+
+@end
@@ -0,0 +1,61 @@
+
+#import <Foundation/Foundation.h>
+
+@class IndoorTimingWheel;
+
+/**
+ *  Handle of a task scheduled on an IndoorTimingWheel
+ */
+@interface IndoorTimeout : NSObject
+
+@property (nonatomic, readonly) BOOL isPending;
+
+/**
+ *  Cancels the task if it has not run yet, returns YES if it was pending
+ */
+- (BOOL)cancel;
+
+@end
+
+/**
+ *  Hierarchical timing wheel shared by every timer of the plugin: request
+ *  timeouts, cached position expiry, dwell timers and presence TTLs.
+ *
+ *  Four levels of 64 slots cover 2^24 ticks; later deadlines wait in an
+ *  overflow list. Slots are intrusive doubly-linked lists, so scheduling and
+ *  cancelling are O(1), and a level's slot is cascaded down when the level
+ *  below wraps. Expired blocks run on the wheel's serial queue and must be
+ *  short. The wheel's dispatch timer only fires at the next occupied slot of
+ *  the lowest level or its next wrap. Matches TimingWheel.java.
+ */
+@interface IndoorTimingWheel : NSObject
+
++ (IndoorTimingWheel *)sharedWheel;
+
+/**
+ *  A wheel that only advances when advanceTo: is called, e.g. for benchmarks
+ *
+ *  @param tickMs
+ */
+- (instancetype)initWithTickMs:(int64_t)tickMs;
+
+/**
+ *  Starts the dispatch timer driving the wheel
+ */
+- (void)start;
+
+/**
+ *  Milliseconds since the wheel was created, the time base of advanceTo:
+ */
+- (int64_t)nowMs;
+
+- (IndoorTimeout *)schedule:(int64_t)delayMs block:(dispatch_block_t)block;
+- (BOOL)cancel:(IndoorTimeout *)timeout;
+- (NSUInteger)count;
+
+/**
+ *  Runs, on the calling thread, every block due at the given time. Returns the number run.
+ */
+- (NSUInteger)advanceTo:(int64_t)nowMs;
+
+@end
@@ -0,0 +1,299 @@
+
+#import "IndoorTimingWheel.h"
+#import "IndoorCostAccounting.h"
+#import <time.h>
+
+static const int64_t kDefaultTickMs = 10;
+static const int kSlotBits = 6;
+static const int kSlots = 1 << kSlotBits;
+static const int64_t kSlotMask = kSlots - 1;
+static const int kLevels = 4;
+static const int64_t kRange = 1LL << (kSlotBits * kLevels);
+
+@interface IndoorTimeout () {
+@public
+    __weak IndoorTimingWheel *_wheel;
+    dispatch_block_t _block;
+    int64_t _deadline;
+    int _level;
+    int _slot;
+    __unsafe_unretained IndoorTimeout *_prev;
+    IndoorTimeout *_next;
+}
+@end
+
+@interface IndoorTimingWheel () {
+    int64_t _tickMs;
+    uint64_t _originNanos;
+    // Slot heads own their lists through the _next links; level kLevels is the overflow list
+    IndoorTimeout *__strong _slots[kLevels + 1][kSlots];
+    int64_t _currentTick;
+    NSUInteger _pending;
+    int64_t _wakeTick;
+    dispatch_queue_t _queue;
+    dispatch_source_t _timer;
+}
+@end
+
+@implementation IndoorTimeout
+
+- (BOOL)isPending
+{
+    IndoorTimingWheel *wheel = _wheel;
+    @synchronized (wheel) {
+        return _level >= 0;
+    }
+}
+
+- (BOOL)cancel
+{
+    return [_wheel cancel:self];
+}
+
+@end
+
+@implementation IndoorTimingWheel
+
++ (IndoorTimingWheel *)sharedWheel
+{
+    static IndoorTimingWheel *shared = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        shared = [[IndoorTimingWheel alloc] initWithTickMs:kDefaultTickMs];
+        [shared start];
+    });
+    return shared;
+}
+
+- (instancetype)initWithTickMs:(int64_t)tickMs
+{
+    self = [super init];
+    if (self) {
+        _tickMs = MAX(1, tickMs);
+        _originNanos = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        _wakeTick = INT64_MAX;
+    }
+    return self;
+}
+
+- (void)start
+{
+    @synchronized (self) {
+        if (_timer != nil) {
+            return;
+        }
+        _queue = dispatch_queue_create("com.indooratlas.timingwheel", DISPATCH_QUEUE_SERIAL);
+        _timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+        __weak IndoorTimingWheel *weakSelf = self;
+        dispatch_source_set_event_handler(_timer, ^{
+            [weakSelf drive];
+        });
+        dispatch_source_set_timer(_timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        dispatch_resume(_timer);
+    }
+}
+
+- (int64_t)nowMs
+{
+    return (int64_t)((clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - _originNanos) / NSEC_PER_MSEC);
+}
+
+- (IndoorTimeout *)schedule:(int64_t)delayMs block:(dispatch_block_t)block
+{
+    int64_t nowTick = [self nowMs] / _tickMs;
+    int64_t ticks = (MAX(0, delayMs) + _tickMs - 1) / _tickMs;
+    IndoorTimeout *timeout = [[IndoorTimeout alloc] init];
+    timeout->_wheel = self;
+    timeout->_block = block;
+    BOOL wake = NO;
+    @synchronized (self) {
+        if (_pending == 0 && nowTick > _currentTick) {
+            // Nothing to cascade, skip the idle ticks
+            _currentTick = nowTick;
+        }
+        timeout->_deadline = MAX(_currentTick, nowTick + ticks);
+        [self insert:timeout];
+        _pending++;
+        if (_timer != nil && timeout->_deadline < _wakeTick) {
+            _wakeTick = timeout->_deadline;
+            wake = YES;
+        }
+    }
+    if (wake) {
+        dispatch_async(_queue, ^{
+            [self drive];
+        });
+    }
+    return timeout;
+}
+
+- (BOOL)cancel:(IndoorTimeout *)timeout
+{
+    @synchronized (self) {
+        if (timeout == nil || timeout->_level < 0) {
+            return NO;
+        }
+        [self unlink:timeout];
+        _pending--;
+        // Blocks often capture their own handle, drop the cycle
+        timeout->_block = nil;
+        return YES;
+    }
+}
+
+- (NSUInteger)count
+{
+    @synchronized (self) {
+        return _pending;
+    }
+}
+
+- (NSUInteger)advanceTo:(int64_t)nowMs
+{
+    NSMutableArray<IndoorTimeout *> *expired = [NSMutableArray array];
+    @synchronized (self) {
+        [self collectExpired:nowMs / _tickMs into:expired];
+    }
+    [self runExpired:expired];
+    return expired.count;
+}
+
+#pragma mark - Internals
+
+- (void)runExpired:(NSArray<IndoorTimeout *> *)expired
+{
+    for (IndoorTimeout *timeout in expired) {
+        @try {
+            timeout->_block();
+        } @catch (NSException *exception) {
+            NSLog(@"IndoorTimingWheel: %@", exception.reason);
+        }
+        timeout->_block = nil;
+    }
+}
+
+// Runs on the wheel queue: fires due blocks and re-arms the dispatch timer
+- (void)drive
+{
+    IndoorCostEnter();
+    NSMutableArray<IndoorTimeout *> *expired = [NSMutableArray array];
+    int64_t nowTick = [self nowMs] / _tickMs;
+    @synchronized (self) {
+        [self collectExpired:nowTick into:expired];
+        if (_pending == 0) {
+            _wakeTick = INT64_MAX;
+            dispatch_source_set_timer(_timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        } else {
+            _wakeTick = [self nextWakeTick];
+            int64_t waitMs = MAX(1, (_wakeTick - nowTick) * _tickMs);
+            dispatch_source_set_timer(_timer, dispatch_time(DISPATCH_TIME_NOW, waitMs * NSEC_PER_MSEC),
+                                      DISPATCH_TIME_FOREVER, (uint64_t)_tickMs * NSEC_PER_MSEC / 2);
+        }
+    }
+    [self runExpired:expired];
+    IndoorCostExit(IndoorCostTimers, "expire");
+}
+
+// Processes ticks up to and including nowTick. Caller holds the lock.
+- (void)collectExpired:(int64_t)nowTick into:(NSMutableArray<IndoorTimeout *> *)expired
+{
+    while (_currentTick <= nowTick && _pending > 0) {
+        int64_t tick = _currentTick;
+        if ((tick & kSlotMask) == 0) {
+            [self cascade:tick];
+        }
+        int slot = (int)(tick & kSlotMask);
+        IndoorTimeout *timeout = _slots[0][slot];
+        _slots[0][slot] = nil;
+        while (timeout != nil) {
+            IndoorTimeout *next = timeout->_next;
+            timeout->_level = -1;
+            timeout->_prev = nil;
+            timeout->_next = nil;
+            [expired addObject:timeout];
+            _pending--;
+            timeout = next;
+        }
+        _currentTick = tick + 1;
+    }
+    if (_pending == 0 && _currentTick <= nowTick) {
+        _currentTick = nowTick + 1;
+    }
+}
+
+// Moves the timers of the higher level slots that start at this tick down
+- (void)cascade:(int64_t)tick
+{
+    for (int level = 1; level <= kLevels; level++) {
+        // The overflow list is revisited whenever the top level wraps
+        int slot = level == kLevels ? 0 : (int)((tick >> (kSlotBits * level)) & kSlotMask);
+        IndoorTimeout *timeout = _slots[level][slot];
+        _slots[level][slot] = nil;
+        while (timeout != nil) {
+            IndoorTimeout *next = timeout->_next;
+            timeout->_prev = nil;
+            timeout->_next = nil;
+            [self insert:timeout];
+            timeout = next;
+        }
+        if (slot != 0) {
+            return;
+        }
+    }
+}
+
+- (void)insert:(IndoorTimeout *)timeout
+{
+    int64_t delta = timeout->_deadline - _currentTick;
+    int level;
+    int slot;
+    if (delta < kSlots) {
+        level = 0;
+        slot = (int)(timeout->_deadline & kSlotMask);
+    } else if (delta < kRange) {
+        level = 1;
+        while (delta >= (1LL << (kSlotBits * (level + 1)))) {
+            level++;
+        }
+        slot = (int)((timeout->_deadline >> (kSlotBits * level)) & kSlotMask);
+    } else {
+        level = kLevels;
+        slot = 0;
+    }
+    timeout->_level = level;
+    timeout->_slot = slot;
+    IndoorTimeout *head = _slots[level][slot];
+    timeout->_next = head;
+    if (head != nil) {
+        head->_prev = timeout;
+    }
+    _slots[level][slot] = timeout;
+}
+
+- (void)unlink:(IndoorTimeout *)timeout
+{
+    IndoorTimeout *next = timeout->_next;
+    if (timeout->_prev != nil) {
+        timeout->_prev->_next = next;
+    } else {
+        _slots[timeout->_level][timeout->_slot] = next;
+    }
+    if (next != nil) {
+        next->_prev = timeout->_prev;
+    }
+    timeout->_prev = nil;
+    timeout->_next = nil;
+    timeout->_level = -1;
+}
+
+// Next occupied slot of the lowest level, or its next wrap if it is empty
+- (int64_t)nextWakeTick
+{
+    for (int64_t tick = _currentTick; ; tick++) {
+        if ((tick & kSlotMask) == 0 || _slots[0][(int)(tick & kSlotMask)] != nil) {
+            return tick;
+        }
+    }
+}
+
+@end
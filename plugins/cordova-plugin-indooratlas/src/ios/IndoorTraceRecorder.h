@@ -0,0 +1,48 @@
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  Low overhead timeline recorder for field sessions, exported in the Chrome
+ *  trace event format and tagged with the IndoorAtlas trace id.
+ *
+ *  Hooks are plain C functions so that a disabled recorder costs one relaxed
+ *  atomic load and no message send. Every thread records into its own ring
+ *  buffer and publishes an event with a release store of its count, so
+ *  recording never takes a lock. A dump waits for writes that began before it
+ *  paused the hooks, and the events of ended threads are freed once they
+ *  belong to an older recording. Category and name must be static C strings
+ *  (literals or sel_getName(_cmd)); they are only dereferenced on export.
+ *  Matches TraceRecorder.java.
+ */
+extern const NSUInteger IndoorTraceDefaultCapacity;
+
+void IndoorTraceBegin(const char *category, const char *name);
+void IndoorTraceEnd(const char *category, const char *name);
+void IndoorTraceInstant(const char *category, const char *name);
+void IndoorTraceCounter(const char *category, const char *name, double value);
+
+/**
+ *  Operations that may end on another thread, e.g. fetches; id pairs the begin with its end
+ */
+void IndoorTraceAsyncBegin(const char *category, const char *name, uint64_t traceEventId);
+void IndoorTraceAsyncEnd(const char *category, const char *name, uint64_t traceEventId);
+
+@interface IndoorTraceRecorder : NSObject
+
+/**
+ *  Starts a new recording, dropping the previous one
+ *
+ *  @param capacityPerThread events kept per thread; older ones are overwritten
+ */
++ (void)startWithCapacity:(NSUInteger)capacityPerThread;
++ (void)stop;
++ (BOOL)isEnabled;
+
+/**
+ *  Current recording as a Chrome trace JSON object. Recording is paused while exporting.
+ *
+ *  @param traceId IndoorAtlas trace id of the positioning session, may be nil
+ */
++ (NSDictionary *)dumpWithTraceId:(NSString *)traceId;
+
+@end
@@ -0,0 +1,258 @@
+
+#import "IndoorTraceRecorder.h"
+#import <pthread.h>
+#import <sched.h>
+#import <stdatomic.h>
+#import <time.h>
+
+const NSUInteger IndoorTraceDefaultCapacity = 4096;
+
+typedef struct {
+    uint64_t nanos;
+    const char *category;
+    const char *name;
+    double value;
+    uint64_t eventId;
+    char phase;
+} IndoorTraceEvent;
+
+// Events of one thread. Only the owning thread writes. The registry is a
+// lock-free push-only list, so a buffer is never unlinked: when its thread
+// ends, a dump or start frees the events and a new thread reuses the buffer.
+typedef struct IndoorTraceBuffer {
+    struct IndoorTraceBuffer *next;
+    uint64_t tid;
+    char threadName[64];
+    int generation;
+    NSUInteger capacity;
+    IndoorTraceEvent *events;
+    _Atomic uint64_t count;
+    // Raised around a write, see record()
+    atomic_bool writing;
+    // Set by the thread-exit destructor
+    atomic_bool ended;
+    // Events freed, free for another thread to claim
+    atomic_bool reusable;
+} IndoorTraceBuffer;
+
+// What the hooks read. Whether a recording runs is kept apart, so that a dump
+// pausing the hooks never turns a recording that was stopped meanwhile back on.
+static atomic_bool sEnabled;
+// Guarded by @synchronized on the class
+static BOOL sRecording;
+static NSInteger sPauses;
+static atomic_int sGeneration;
+static _Atomic NSUInteger sCapacity = 4096;
+static uint64_t sStartNanos;
+static double sStartWallMs;
+static _Atomic(IndoorTraceBuffer *) sBuffers;
+static __thread IndoorTraceBuffer *tLocal;
+static pthread_key_t sThreadKey;
+static pthread_once_t sThreadKeyOnce = PTHREAD_ONCE_INIT;
+// Serializes dumps with reclaiming buffers of ended threads
+static NSObject *sReclaimLock;
+
+static void threadEnded(void *value)
+{
+    IndoorTraceBuffer *buffer = value;
+    tLocal = NULL;
+    atomic_store(&buffer->ended, true);
+}
+
+static void createThreadKey(void)
+{
+    pthread_key_create(&sThreadKey, threadEnded);
+    sReclaimLock = [[NSObject alloc] init];
+}
+
+static IndoorTraceBuffer *localBuffer(void)
+{
+    IndoorTraceBuffer *buffer = tLocal;
+    if (buffer == NULL) {
+        pthread_once(&sThreadKeyOnce, createThreadKey);
+        for (IndoorTraceBuffer *candidate = atomic_load(&sBuffers); candidate != NULL; candidate = candidate->next) {
+            bool reusable = true;
+            if (atomic_compare_exchange_strong(&candidate->reusable, &reusable, false)) {
+                buffer = candidate;
+                break;
+            }
+        }
+        BOOL claimed = buffer != NULL;
+        if (!claimed) {
+            buffer = calloc(1, sizeof(IndoorTraceBuffer));
+            buffer->generation = -1;
+        }
+        pthread_threadid_np(NULL, &buffer->tid);
+        if (pthread_getname_np(pthread_self(), buffer->threadName, sizeof(buffer->threadName)) != 0 || buffer->threadName[0] == 0) {
+            snprintf(buffer->threadName, sizeof(buffer->threadName), "%s", pthread_main_np() ? "main" : "thread");
+        }
+        if (!claimed) {
+            IndoorTraceBuffer *head = atomic_load(&sBuffers);
+            do {
+                buffer->next = head;
+            } while (!atomic_compare_exchange_weak(&sBuffers, &head, buffer));
+        }
+        pthread_setspecific(sThreadKey, buffer);
+        tLocal = buffer;
+    }
+    return buffer;
+}
+
+/**
+ *  Frees the events of ended threads that are not part of the given generation
+ *  and lets new threads claim their buffers. Called with sReclaimLock held;
+ *  ended threads no longer write, and dumps, the only readers, hold the lock.
+ */
+static void reclaimEnded(int generation)
+{
+    for (IndoorTraceBuffer *buffer = atomic_load(&sBuffers); buffer != NULL; buffer = buffer->next) {
+        if (!atomic_load(&buffer->ended) || buffer->generation == generation) {
+            continue;
+        }
+        free(buffer->events);
+        buffer->events = NULL;
+        buffer->capacity = 0;
+        buffer->generation = -1;
+        atomic_store(&buffer->ended, false);
+        atomic_store(&buffer->reusable, true);
+    }
+}
+
+static void record(char phase, const char *category, const char *name, double value, uint64_t eventId)
+{
+    IndoorTraceBuffer *buffer = localBuffer();
+    // A dump pauses the hooks and then waits for writing to drop, so either
+    // this sees the pause or the dump sees the flag and waits for the event.
+    // Both sides use sequentially consistent store-then-load for that.
+    atomic_store(&buffer->writing, true);
+    if (!atomic_load(&sEnabled)) {
+        atomic_store_explicit(&buffer->writing, false, memory_order_release);
+        return;
+    }
+    int generation = atomic_load_explicit(&sGeneration, memory_order_acquire);
+    if (buffer->generation != generation) {
+        NSUInteger capacity = atomic_load(&sCapacity);
+        if (buffer->capacity != capacity) {
+            free(buffer->events);
+            buffer->events = calloc(capacity, sizeof(IndoorTraceEvent));
+            buffer->capacity = capacity;
+        }
+        atomic_store_explicit(&buffer->count, 0, memory_order_release);
+        buffer->generation = generation;
+    }
+    uint64_t count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+    IndoorTraceEvent *event = &buffer->events[count % buffer->capacity];
+    event->nanos = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    event->category = category;
+    event->name = name;
+    event->value = value;
+    event->eventId = eventId;
+    event->phase = phase;
+    atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+    atomic_store_explicit(&buffer->writing, false, memory_order_release);
+}
+
+#define INDOOR_TRACE(phase, category, name, value, eventId) \
+    if (atomic_load_explicit(&sEnabled, memory_order_relaxed)) { record(phase, category, name, value, eventId); }
+
+void IndoorTraceBegin(const char *category, const char *name) { INDOOR_TRACE('B', category, name, 0, 0) }
+void IndoorTraceEnd(const char *category, const char *name) { INDOOR_TRACE('E', category, name, 0, 0) }
+void IndoorTraceInstant(const char *category, const char *name) { INDOOR_TRACE('i', category, name, 0, 0) }
+void IndoorTraceCounter(const char *category, const char *name, double value) { INDOOR_TRACE('C', category, name, value, 0) }
+void IndoorTraceAsyncBegin(const char *category, const char *name, uint64_t traceEventId) { INDOOR_TRACE('b', category, name, 0, traceEventId) }
+void IndoorTraceAsyncEnd(const char *category, const char *name, uint64_t traceEventId) { INDOOR_TRACE('e', category, name, 0, traceEventId) }
+
+@implementation IndoorTraceRecorder
+
++ (void)startWithCapacity:(NSUInteger)capacityPerThread
+{
+    @synchronized (self) {
+        atomic_store(&sEnabled, false);
+        atomic_store(&sCapacity, MAX((NSUInteger)64, capacityPerThread));
+        sStartNanos = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        sStartWallMs = [[NSDate date] timeIntervalSince1970] * 1000.0;
+        atomic_fetch_add_explicit(&sGeneration, 1, memory_order_release);
+        sRecording = YES;
+        // A running dump turns the hooks on when it is done
+        atomic_store(&sEnabled, sPauses == 0);
+    }
+    pthread_once(&sThreadKeyOnce, createThreadKey);
+    @synchronized (sReclaimLock) {
+        reclaimEnded(atomic_load(&sGeneration));
+    }
+}
+
++ (void)stop
+{
+    @synchronized (self) {
+        sRecording = NO;
+        atomic_store(&sEnabled, false);
+    }
+}
+
++ (BOOL)isEnabled
+{
+    return atomic_load(&sEnabled);
+}
+
++ (NSDictionary *)dumpWithTraceId:(NSString *)traceId
+{
+    @synchronized (self) {
+        sPauses++;
+        atomic_store(&sEnabled, false);
+    }
+    pthread_once(&sThreadKeyOnce, createThreadKey);
+    int generation = atomic_load(&sGeneration);
+    int pid = [[NSProcessInfo processInfo] processIdentifier];
+    NSMutableArray *events = [NSMutableArray array];
+    uint64_t dropped = 0;
+
+    @synchronized (sReclaimLock) {
+        reclaimEnded(generation);
+        for (IndoorTraceBuffer *buffer = atomic_load(&sBuffers); buffer != NULL; buffer = buffer->next) {
+            while (atomic_load(&buffer->writing)) {
+                sched_yield();
+            }
+            if (buffer->generation != generation) {
+                continue;
+            }
+            uint64_t count = atomic_load_explicit(&buffer->count, memory_order_acquire);
+            uint64_t first = count > buffer->capacity ? count - buffer->capacity : 0;
+            dropped += first;
+            NSNumber *tid = @(buffer->tid);
+            [events addObject:@{@"name": @"thread_name", @"ph": @"M", @"pid": @(pid), @"tid": tid,
+                                @"args": @{@"name": [NSString stringWithUTF8String:buffer->threadName]}}];
+
+            for (uint64_t i = first; i < count; i++) {
+                IndoorTraceEvent *event = &buffer->events[i % buffer->capacity];
+                NSMutableDictionary *entry = [NSMutableDictionary dictionary];
+                [entry setObject:[NSString stringWithUTF8String:event->name] forKey:@"name"];
+                [entry setObject:[NSString stringWithUTF8String:event->category] forKey:@"cat"];
+                [entry setObject:[NSString stringWithFormat:@"%c", event->phase] forKey:@"ph"];
+                [entry setObject:@((double)(int64_t)(event->nanos - sStartNanos) / 1000.0) forKey:@"ts"];
+                [entry setObject:@(pid) forKey:@"pid"];
+                [entry setObject:tid forKey:@"tid"];
+                if (event->phase == 'C') {
+                    [entry setObject:@{@"value": @(event->value)} forKey:@"args"];
+                } else if (event->phase == 'b' || event->phase == 'e') {
+                    [entry setObject:[NSString stringWithFormat:@"%llx", event->eventId] forKey:@"id"];
+                } else if (event->phase == 'i') {
+                    [entry setObject:@"t" forKey:@"s"];
+                }
+                [events addObject:entry];
+            }
+    }
+
+    NSDictionary *metadata = @{@"traceId": traceId != nil ? traceId : [NSNull null],
+                               @"platform": @"ios",
+                               @"startWallClockMs": @(sStartWallMs),
+                               @"droppedEvents": @(dropped)};
+    @synchronized (self) {
+        if (--sPauses == 0) {
+            atomic_store(&sEnabled, sRecording);
+        }
+    }
+    return @{@"traceEvents": events, @"displayTimeUnit": @"ms", @"otherData": metadata};
+}
+
+@end
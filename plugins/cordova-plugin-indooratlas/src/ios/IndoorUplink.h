@@ -0,0 +1,79 @@
+
+#import <Foundation/Foundation.h>
+
+extern const NSUInteger IndoorUplinkDefaultBatchEvents;
+extern const int64_t IndoorUplinkDefaultIntervalMs;
+
+/**
+ *  Called with the HTTP status of a request, or -1 if no response was received
+ */
+typedef void (^IndoorUplinkResponse)(NSInteger status);
+
+/**
+ *  Sends one request. The default transport uses NSURLSession.
+ */
+typedef void (^IndoorUplinkTransport)(NSURLRequest *request, IndoorUplinkResponse response);
+
+/**
+ *  Uploads fixes and events to a backend in batches instead of one request
+ *  each, so that the radio wakes up once per batch.
+ *
+ *  Items are first appended to an IndoorEventQueue of their own, which makes
+ *  the upload resumable: a batch is the next run of items after the uplink's
+ *  acknowledged offset and is only acknowledged once the backend accepted it.
+ *  A batch is sent when batchEvents items are pending or intervalMs after the
+ *  first of them, and the uplink then drains everything pending. Requests
+ *  carry the stream id and offset range of their items, so the backend can
+ *  drop duplicates. The body is the columnar encoding of encode:, deflated.
+ *  Network errors, 5xx, 408 and 429 are retried with jittered exponential
+ *  backoff; any other status rejects the batch. Matches Uplink.java.
+ */
+@interface IndoorUplink : NSObject
+
+/**
+ *  Opens the uplink's queue in a directory
+ *
+ *  @param transport nil for NSURLSession
+ */
+- (instancetype)initWithDirectory:(NSString *)path transport:(IndoorUplinkTransport)transport error:(NSError **)error;
+
+/**
+ *  Sets the backend and batching rules and enables the uplink
+ *
+ *  @param options { url, headers, batchEvents, intervalMs, backoffBaseMs, backoffMaxMs, fixes, events }
+ */
+- (BOOL)configure:(NSDictionary *)options error:(NSError **)error;
+
+/**
+ *  Stops uploading. Queued items stay on disk for the next configure.
+ */
+- (void)disable;
+
+- (BOOL)isEnabled;
+
+- (void)onFixAt:(int64_t)timeMs latitude:(double)latitude longitude:(double)longitude floor:(NSInteger)floor accuracy:(double)accuracy;
+
+- (void)onEvent:(NSDictionary *)event;
+
+/**
+ *  Syncs the queue, e.g. before the app may be suspended
+ */
+- (void)sync;
+
+- (NSDictionary *)stats;
+
+/**
+ *  Encodes a batch: magic "IAU\2"; fix count; the fix columns t, lat, lon,
+ *  floor (zigzag varint deltas, coordinates in 1e-7 degrees) and acc (varint
+ *  decimetres); event count; each event as the varint number of fixes queued
+ *  between it and the previous event, varint length and UTF-8 JSON. An event
+ *  whose fix gaps sum to k came after the first k fixes of the batch
+ */
++ (NSData *)encode:(NSArray<NSDictionary *> *)items;
+
+/**
+ *  zlib stream of the data, as sent with Content-Encoding: deflate
+ */
++ (NSData *)deflate:(NSData *)data;
+
+@end
@@ -0,0 +1,387 @@
+
+#import "IndoorUplink.h"
+#import "IndoorEventQueue.h"
+#import "IndoorTimingWheel.h"
+#import "IndoorTaskScheduler.h"
+#import "IndoorCostAccounting.h"
+#import <zlib.h>
+
+const NSUInteger IndoorUplinkDefaultBatchEvents = 500;
+const int64_t IndoorUplinkDefaultIntervalMs = 60 * 1000;
+
+static const int64_t kDefaultBackoffBaseMs = 5000;
+static const int64_t kDefaultBackoffMaxMs = 10 * 60 * 1000;
+static NSString *const kContentType = @"application/vnd.indooratlas.batch";
+static NSString *const kConsumer = @"uplink";
+static NSString *const kStreamFile = @"stream-id";
+
+static void IndoorWriteVarint(NSMutableData *out, uint64_t value)
+{
+    uint8_t bytes[10];
+    size_t n = 0;
+    while (value & ~0x7fULL) {
+        bytes[n++] = (uint8_t)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    bytes[n++] = (uint8_t)value;
+    [out appendBytes:bytes length:n];
+}
+
+static void IndoorWriteZigzag(NSMutableData *out, int64_t value)
+{
+    IndoorWriteVarint(out, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+@implementation IndoorUplink {
+    IndoorEventQueue *_queue;
+    IndoorUplinkTransport _transport;
+    NSString *_streamId;
+
+    BOOL _enabled;
+    NSURL *_url;
+    NSDictionary<NSString *, NSString *> *_headers;
+    NSUInteger _batchEvents;
+    int64_t _intervalMs;
+    int64_t _backoffBaseMs;
+    int64_t _backoffMaxMs;
+    BOOL _fixes;
+    BOOL _events;
+
+    IndoorTimeout *_timer;
+    BOOL _uploading;
+    NSUInteger _pending;
+    NSUInteger _attempt;
+
+    uint64_t _requests;
+    uint64_t _batches;
+    uint64_t _items;
+    uint64_t _rawBytes;
+    uint64_t _wireBytes;
+    uint64_t _retries;
+    uint64_t _rejected;
+    NSInteger _lastStatus;
+}
+
+- (instancetype)initWithDirectory:(NSString *)path transport:(IndoorUplinkTransport)transport error:(NSError **)error
+{
+    self = [super init];
+    if (self) {
+        _queue = [[IndoorEventQueue alloc] initWithDirectory:path maxBytes:IndoorEventQueueDefaultMaxBytes segmentBytes:IndoorEventQueueDefaultSegmentBytes error:error];
+        if (_queue == nil) {
+            return nil;
+        }
+        _transport = transport ?: ^(NSURLRequest *request, IndoorUplinkResponse response) {
+            [[[NSURLSession sharedSession] dataTaskWithRequest:request completionHandler:^(NSData *data, NSURLResponse *urlResponse, NSError *taskError) {
+                response(taskError == nil && [urlResponse isKindOfClass:[NSHTTPURLResponse class]] ? ((NSHTTPURLResponse *)urlResponse).statusCode : -1);
+            }] resume];
+        };
+        NSString *streamPath = [path stringByAppendingPathComponent:kStreamFile];
+        _streamId = [[NSString stringWithContentsOfFile:streamPath encoding:NSUTF8StringEncoding error:nil] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+        if (_streamId.length == 0) {
+            _streamId = [[NSUUID UUID] UUIDString];
+            if (![_streamId writeToFile:streamPath atomically:YES encoding:NSUTF8StringEncoding error:error]) {
+                return nil;
+            }
+        }
+        _batchEvents = IndoorUplinkDefaultBatchEvents;
+        _intervalMs = IndoorUplinkDefaultIntervalMs;
+        _backoffBaseMs = kDefaultBackoffBaseMs;
+        _backoffMaxMs = kDefaultBackoffMaxMs;
+        _fixes = YES;
+        _events = YES;
+    }
+    return self;
+}
+
+- (BOOL)configure:(NSDictionary *)options error:(NSError **)error
+{
+    NSURL *url = [options[@"url"] isKindOfClass:[NSString class]] ? [NSURL URLWithString:options[@"url"]] : nil;
+    if (url == nil) {
+        if (error) {
+            *error = [NSError errorWithDomain:@"IndoorUplink" code:0 userInfo:@{NSLocalizedDescriptionKey: @"Uplink needs a url"}];
+        }
+        return NO;
+    }
+    @synchronized (self) {
+        _url = url;
+        _headers = [options[@"headers"] isKindOfClass:[NSDictionary class]] ? options[@"headers"] : @{};
+        _batchEvents = MAX(1, options[@"batchEvents"] != nil ? [options[@"batchEvents"] integerValue] : (NSInteger)IndoorUplinkDefaultBatchEvents);
+        _intervalMs = MAX(0, options[@"intervalMs"] != nil ? [options[@"intervalMs"] longLongValue] : IndoorUplinkDefaultIntervalMs);
+        _backoffBaseMs = MAX(1, options[@"backoffBaseMs"] != nil ? [options[@"backoffBaseMs"] longLongValue] : kDefaultBackoffBaseMs);
+        _backoffMaxMs = MAX(_backoffBaseMs, options[@"backoffMaxMs"] != nil ? [options[@"backoffMaxMs"] longLongValue] : kDefaultBackoffMaxMs);
+        _fixes = options[@"fixes"] != nil ? [options[@"fixes"] boolValue] : YES;
+        _events = options[@"events"] != nil ? [options[@"events"] boolValue] : YES;
+        _enabled = YES;
+        _attempt = 0;
+        [self cancelTimer];
+        // Items left from an earlier run go right away
+        [self schedule:0];
+    }
+    return YES;
+}
+
+- (void)disable
+{
+    @synchronized (self) {
+        _enabled = NO;
+        [self cancelTimer];
+    }
+}
+
+- (BOOL)isEnabled
+{
+    @synchronized (self) {
+        return _enabled;
+    }
+}
+
+- (void)onFixAt:(int64_t)timeMs latitude:(double)latitude longitude:(double)longitude floor:(NSInteger)floor accuracy:(double)accuracy
+{
+    @synchronized (self) {
+        if (!_enabled || !_fixes) {
+            return;
+        }
+    }
+    [self append:@{@"type": @"fix", @"t": @(timeMs), @"lat": @(latitude), @"lon": @(longitude), @"floor": @(floor), @"acc": @(accuracy)}];
+}
+
+- (void)onEvent:(NSDictionary *)event
+{
+    @synchronized (self) {
+        if (!_enabled || !_events) {
+            return;
+        }
+    }
+    [self append:event];
+}
+
+- (void)append:(NSDictionary *)item
+{
+    NSError *error = nil;
+    if ([_queue append:item error:&error] < 0) {
+        NSLog(@"IndoorUplink: cannot queue item: %@", error);
+        return;
+    }
+    @synchronized (self) {
+        [self schedule:++_pending >= _batchEvents ? 0 : _intervalMs];
+    }
+}
+
+/**
+ *  Schedules an upload unless one is running or scheduled. An upload due now
+ *  replaces one scheduled later, except a retry waiting for its backoff.
+ */
+- (void)schedule:(int64_t)delayMs
+{
+    if (!_enabled || _uploading) {
+        return;
+    }
+    if (_timer != nil) {
+        if (delayMs > 0 || _attempt > 0) {
+            return;
+        }
+        [_timer cancel];
+    }
+    __weak IndoorUplink *weakSelf = self;
+    _timer = [[IndoorTimingWheel sharedWheel] schedule:delayMs block:^{
+        [[IndoorTaskScheduler sharedScheduler] submit:IndoorTaskLaneBackground subsystem:IndoorCostNetwork block:^{
+            [weakSelf upload];
+        }];
+    }];
+}
+
+- (void)cancelTimer
+{
+    [_timer cancel];
+    _timer = nil;
+}
+
+- (void)upload
+{
+    NSURL *url;
+    NSDictionary *headers;
+    NSUInteger batchEvents;
+    @synchronized (self) {
+        _timer = nil;
+        if (!_enabled || _uploading) {
+            return;
+        }
+        _uploading = YES;
+        _pending = 0;
+        url = _url;
+        headers = _headers;
+        batchEvents = _batchEvents;
+    }
+    [self uploadNext:url headers:headers batchEvents:batchEvents];
+}
+
+/**
+ *  Sends the next batch, continuing from the response until nothing is pending or a request fails
+ */
+- (void)uploadNext:(NSURL *)url headers:(NSDictionary *)headers batchEvents:(NSUInteger)batchEvents
+{
+    NSDictionary *batch = [_queue read:kConsumer maxEvents:batchEvents];
+    NSArray<NSDictionary *> *items = batch[@"events"];
+    if (items.count == 0) {
+        [self finishUpload:NO];
+        return;
+    }
+    int64_t first = [items.firstObject[@"offset"] longLongValue];
+    int64_t last = [batch[@"lastOffset"] longLongValue];
+    NSData *raw = [IndoorUplink encode:items];
+    NSData *body = [IndoorUplink deflate:raw];
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:url];
+    request.HTTPMethod = @"POST";
+    request.HTTPBody = body;
+    request.timeoutInterval = 30;
+    [headers enumerateKeysAndObjectsUsingBlock:^(id key, id value, BOOL *stop) {
+        if ([key isKindOfClass:[NSString class]] && [value isKindOfClass:[NSString class]]) {
+            [request setValue:value forHTTPHeaderField:key];
+        }
+    }];
+    [request setValue:kContentType forHTTPHeaderField:@"Content-Type"];
+    [request setValue:@"deflate" forHTTPHeaderField:@"Content-Encoding"];
+    [request setValue:_streamId forHTTPHeaderField:@"X-IA-Stream"];
+    [request setValue:[NSString stringWithFormat:@"%lld-%lld", (long long)first, (long long)last] forHTTPHeaderField:@"X-IA-Offsets"];
+    _transport(request, ^(NSInteger status) {
+        [[IndoorTaskScheduler sharedScheduler] submit:IndoorTaskLaneBackground subsystem:IndoorCostNetwork block:^{
+            @synchronized (self) {
+                self->_requests++;
+                self->_wireBytes += body.length;
+                self->_lastStatus = status;
+            }
+            if (status == -1 || status >= 500 || status == 408 || status == 429) {
+                [self finishUpload:YES];
+                return;
+            }
+            NSError *error = nil;
+            if (![self->_queue ack:kConsumer offset:last error:&error]) {
+                NSLog(@"IndoorUplink: cannot acknowledge batch: %@", error);
+                [self finishUpload:YES];
+                return;
+            }
+            @synchronized (self) {
+                if (status >= 200 && status < 300) {
+                    self->_batches++;
+                    self->_items += items.count;
+                    self->_rawBytes += raw.length;
+                } else {
+                    // The backend refuses the batch itself, retrying cannot help
+                    self->_rejected++;
+                }
+                self->_attempt = 0;
+            }
+            [self uploadNext:url headers:headers batchEvents:batchEvents];
+        }];
+    });
+}
+
+- (void)finishUpload:(BOOL)failed
+{
+    @synchronized (self) {
+        _uploading = NO;
+        if (failed) {
+            _retries++;
+            int64_t delay = MIN(_backoffMaxMs, _backoffBaseMs << MIN(_attempt, (NSUInteger)20));
+            _attempt++;
+            [self schedule:delay / 2 + (int64_t)(drand48() * (delay / 2))];
+        } else if (_pending > 0) {
+            [self schedule:_pending >= _batchEvents ? 0 : _intervalMs];
+        }
+    }
+}
+
+- (void)sync
+{
+    [_queue sync];
+}
+
+- (NSDictionary *)stats
+{
+    NSDictionary *queue = [_queue stats];
+    NSNumber *acked = queue[@"consumers"][kConsumer];
+    int64_t ackedOffset = acked != nil ? acked.longLongValue : [queue[@"firstOffset"] longLongValue] - 1;
+    @synchronized (self) {
+        return @{
+            @"enabled": @(_enabled),
+            @"streamId": _streamId,
+            @"pending": @([queue[@"nextOffset"] longLongValue] - 1 - ackedOffset),
+            @"requests": @(_requests),
+            @"batches": @(_batches),
+            @"items": @(_items),
+            @"rawBytes": @(_rawBytes),
+            @"wireBytes": @(_wireBytes),
+            @"retries": @(_retries),
+            @"rejected": @(_rejected),
+            @"backoffAttempt": @(_attempt),
+            @"lastStatus": @(_lastStatus),
+            @"queue": queue
+        };
+    }
+}
+
++ (NSData *)encode:(NSArray<NSDictionary *> *)items
+{
+    NSUInteger fixCount = 0;
+    for (NSDictionary *item in items) {
+        if ([item[@"type"] isEqual:@"fix"]) {
+            fixCount++;
+        }
+    }
+    int64_t *columns = calloc(5 * MAX(fixCount, 1), sizeof(int64_t));
+    NSMutableData *events = [NSMutableData data];
+    NSUInteger eventCount = 0;
+    NSUInteger n = 0;
+    NSUInteger fixesBefore = 0;
+    for (NSDictionary *item in items) {
+        if ([item[@"type"] isEqual:@"fix"]) {
+            columns[n] = [item[@"t"] longLongValue];
+            columns[fixCount + n] = llround([item[@"lat"] doubleValue] * 1e7);
+            columns[2 * fixCount + n] = llround([item[@"lon"] doubleValue] * 1e7);
+            columns[3 * fixCount + n] = [item[@"floor"] longLongValue];
+            columns[4 * fixCount + n] = llround([item[@"acc"] doubleValue] * 10);
+            n++;
+        } else {
+            NSMutableDictionary *event = [item mutableCopy];
+            [event removeObjectForKey:@"offset"];
+            NSData *json = [NSJSONSerialization dataWithJSONObject:event options:0 error:nil];
+            IndoorWriteVarint(events, n - fixesBefore);
+            fixesBefore = n;
+            IndoorWriteVarint(events, json.length);
+            [events appendData:json];
+            eventCount++;
+        }
+    }
+    NSMutableData *out = [NSMutableData dataWithCapacity:16 + fixCount * 12 + events.length];
+    const uint8_t magic[4] = {'I', 'A', 'U', 2};
+    [out appendBytes:magic length:4];
+    IndoorWriteVarint(out, fixCount);
+    for (NSUInteger c = 0; c < 4; c++) {
+        int64_t previous = 0;
+        for (NSUInteger i = 0; i < fixCount; i++) {
+            int64_t value = columns[c * fixCount + i];
+            IndoorWriteZigzag(out, value - previous);
+            previous = value;
+        }
+    }
+    for (NSUInteger i = 0; i < fixCount; i++) {
+        IndoorWriteVarint(out, (uint64_t)MAX(0, columns[4 * fixCount + i]));
+    }
+    IndoorWriteVarint(out, eventCount);
+    [out appendData:events];
+    free(columns);
+    return out;
+}
+
++ (NSData *)deflate:(NSData *)data
+{
+    uLongf length = compressBound(data.length);
+    NSMutableData *out = [NSMutableData dataWithLength:length];
+    if (compress2(out.mutableBytes, &length, data.bytes, data.length, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        return nil;
+    }
+    out.length = length;
+    return out;
+}
+
+@end
@@ -0,0 +1,41 @@
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+/**
+ *  Point in a venue frame, millimetres east and north of the frame origin
+ */
+typedef struct {
+    int32_t east;
+    int32_t north;
+} IndoorLocalPoint;
+
+/**
+ *  Venue-local east/north/up frame in fixed-point millimetres.
+ *
+ *  Positions are converted from WGS84 once, when they arrive from the SDK,
+ *  and are kept as int32 millimetres internally. The scales are fixed at the
+ *  origin, so the error grows with the square of the distance from it: about
+ *  10 cm at 1 km at mid latitudes. Matches VenueFrame.java.
+ */
+@interface IndoorVenueFrame : NSObject
+
+@property (nonatomic, readonly) CLLocationCoordinate2D origin;
+
+- (id)initWithOrigin:(CLLocationCoordinate2D)origin;
+
+/**
+ *  Frame whose origin is the coordinate snapped to a 0.01 degree grid, so that
+ *  frames anchored by nearby fixes in the same venue coincide
+ *
+ *  @param coordinate
+ */
++ (IndoorVenueFrame *)frameForAnchor:(CLLocationCoordinate2D)coordinate;
+
+- (double)millimetresPerDegreeLatitude;
+- (double)millimetresPerDegreeLongitude;
+
+- (IndoorLocalPoint)toLocal:(CLLocationCoordinate2D)coordinate;
+- (CLLocationCoordinate2D)toCoordinate:(IndoorLocalPoint)point;
+
+@end
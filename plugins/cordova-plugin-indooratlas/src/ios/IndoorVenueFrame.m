@@ -0,0 +1,72 @@
+
+#import "IndoorVenueFrame.h"
+
+#define WGS84_A 6378137.0
+#define WGS84_E2 6.69437999014e-3
+#define ORIGIN_GRID_DEGREES 0.01
+
+static int32_t clampMillimetres(double value)
+{
+    double rounded = round(value);
+    if (rounded > INT32_MAX) {
+        return INT32_MAX;
+    }
+    if (rounded < INT32_MIN) {
+        return INT32_MIN;
+    }
+    return (int32_t)rounded;
+}
+
+@implementation IndoorVenueFrame {
+    double millimetresPerDegreeLat;
+    double millimetresPerDegreeLon;
+}
+
+- (id)initWithOrigin:(CLLocationCoordinate2D)origin
+{
+    self = [super init];
+    if (self) {
+        _origin = origin;
+        double phi = origin.latitude * M_PI / 180.0;
+        double s = sin(phi);
+        double w = sqrt(1.0 - WGS84_E2 * s * s);
+        double meridional = WGS84_A * (1.0 - WGS84_E2) / (w * w * w);
+        double normal = WGS84_A / w;
+        millimetresPerDegreeLat = meridional * M_PI / 180.0 * 1000.0;
+        millimetresPerDegreeLon = normal * cos(phi) * M_PI / 180.0 * 1000.0;
+    }
+    return self;
+}
+
++ (IndoorVenueFrame *)frameForAnchor:(CLLocationCoordinate2D)coordinate
+{
+    CLLocationCoordinate2D origin = CLLocationCoordinate2DMake(floor(coordinate.latitude / ORIGIN_GRID_DEGREES) * ORIGIN_GRID_DEGREES,
+                                                               floor(coordinate.longitude / ORIGIN_GRID_DEGREES) * ORIGIN_GRID_DEGREES);
+    return [[IndoorVenueFrame alloc] initWithOrigin:origin];
+}
+
+- (double)millimetresPerDegreeLatitude
+{
+    return millimetresPerDegreeLat;
+}
+
+- (double)millimetresPerDegreeLongitude
+{
+    return millimetresPerDegreeLon;
+}
+
+- (IndoorLocalPoint)toLocal:(CLLocationCoordinate2D)coordinate
+{
+    IndoorLocalPoint point;
+    point.east = clampMillimetres((coordinate.longitude - _origin.longitude) * millimetresPerDegreeLon);
+    point.north = clampMillimetres((coordinate.latitude - _origin.latitude) * millimetresPerDegreeLat);
+    return point;
+}
+
+- (CLLocationCoordinate2D)toCoordinate:(IndoorLocalPoint)point
+{
+    return CLLocationCoordinate2DMake(_origin.latitude + point.north / millimetresPerDegreeLat,
+                                      _origin.longitude + point.east / millimetresPerDegreeLon);
+}
+
+@end
@@ -23,6 +23,11 @@ exports.defineAutoTests = function () {
     });
   };
 
+  // Native errors are PositionError objects on Android and strings on iOS
+  var errorMessage = function (err) {
+    return typeof err === 'string' ? err : (err && err.message) || '';
+  };
+
   var succeed = function (done, context) {
     // prevents done() to be called several times
     if (context) {
@@ -123,6 +128,577 @@ exports.defineAutoTests = function () {
       expect(typeof IndoorAtlas.setDistanceFilter).toBeDefined();
       expect(typeof IndoorAtlas.setDistanceFilter == 'function').toBe(true);
     });
+
+    it("Test.spec.30 runBenchmark should reject an unknown benchmark", function (done) {
+      IndoorAtlas.runBenchmark('noSuchBenchmark', {}).then(function () {
+        fail(done, null, 'Unexpected win');
+      }, function (err) {
+        expect(errorMessage(err)).toContain('Unknown benchmark');
+        done();
+      });
+    }, 25000);
+
+    it("Test.spec.31 computeRouteOnFloorPlan should fail with FLOOR_PLAN_UNAVAILABLE for a wrong floor plan id", function (done) {
+      var from = { lat: 65.0608, lon: 25.4410, floor: 1 };
+      var to = { lat: 65.0609, lon: 25.4411, floor: 1 };
+      IndoorAtlas.computeRouteOnFloorPlan(0, from, to, 'WrongID').then(function () {
+        fail(done, null, 'Unexpected win');
+      }, function (err) {
+        expect(err.code).toBe(PositionError.FLOOR_PLAN_UNAVAILABLE);
+        done();
+      });
+    }, 50000);
+
+    it("Test.spec.32 getCacheReport should report the budget and each cache", function (done) {
+      IndoorAtlas.getCacheReport(function (report) {
+        expect(report.budgetBytes).toBeGreaterThan(0);
+        expect(report.residentBytes).toBeLessThan(report.budgetBytes + 1);
+        expect(Array.isArray(report.caches)).toBe(true);
+        report.caches.forEach(function (cache) {
+          expect(typeof cache.name).toBe('string');
+          expect(cache.residentBytes).not.toBeLessThan(0);
+        });
+        done();
+      }, fail.bind(null, done));
+    });
+
+    it("Test.spec.33 dumpTrace should return a Chrome trace of the recording", function (done) {
+      IndoorAtlas.startTracing({ capacityPerThread: 256 }, function () {
+        IndoorAtlas.dumpTrace(function (trace) {
+          IndoorAtlas.stopTracing();
+          expect(Array.isArray(trace.traceEvents)).toBe(true);
+          expect(trace.displayTimeUnit).toBe('ms');
+          expect(trace.otherData).toBeDefined();
+          done();
+        }, fail.bind(null, done));
+      }, fail.bind(null, done));
+    });
+
+    it("Test.spec.34 getCostReport should report the period and the subsystems", function (done) {
+      IndoorAtlas.getCostReport({}, function (report) {
+        expect(report.periodMs).not.toBeLessThan(0);
+        expect(report.processCpuMs).not.toBeLessThan(0);
+        expect(typeof report.attributedCpuMs).toBe('number');
+        expect(typeof report.subsystems).toBe('object');
+        done();
+      }, fail.bind(null, done));
+    });
+
+    it("Test.spec.35 configureBackground should reject a cellLevel out of range", function (done) {
+      IndoorAtlas.configureBackground({ cellLevel: 99 }, fail.bind(null, done, null, 'Unexpected event'), function (err) {
+        expect(errorMessage(err)).toContain('cellLevel');
+        done();
+      });
+    });
+
+    it("Test.spec.36 fetchEvents should return a batch that ackEvents can acknowledge", function (done) {
+      IndoorAtlas.fetchEvents('tests', { maxEvents: 10 }, function (batch) {
+        expect(batch.consumer).toBe('tests');
+        expect(Array.isArray(batch.events)).toBe(true);
+        expect(batch.events.length).not.toBeGreaterThan(10);
+        expect(batch.pending).not.toBeLessThan(0);
+        IndoorAtlas.ackEvents('tests', batch.lastOffset, function (stats) {
+          expect(stats).toBeDefined();
+          done();
+        }, fail.bind(null, done));
+      }, fail.bind(null, done));
+    });
+
+    it("Test.spec.37 configureUplink should reject options without a url", function (done) {
+      IndoorAtlas.configureUplink({}, fail.bind(null, done, null, 'Unexpected win'), function (err) {
+        expect(errorMessage(err)).toContain('url');
+        done();
+      });
+    });
+
+    it("Test.spec.38 createProcessor should cluster positions in a worker", function (done) {
+      var processor = IndoorAtlas.createProcessor();
+      var positions = new Float64Array([65.06080, 25.44100, 65.06080, 25.44101, 65.06081, 25.44100, 65.06200, 25.44300]);
+      processor.cluster(positions, 5).then(function (clusters) {
+        processor.terminate();
+        expect(clusters.length).toBe(6);
+        expect(clusters[2]).toBe(3);
+        expect(clusters[5]).toBe(1);
+        done();
+      }, function (err) {
+        processor.terminate();
+        fail(done, null, err.message);
+      });
+    });
+
+    it("Test.spec.39 runBridgeBenchmark should measure each shape and encoding asked for", function (done) {
+      IndoorAtlas.runBridgeBenchmark({ shapes: ['position'], encodings: ['dict'], rates: [10], roundTrips: 5, streamMs: 300 }).then(function (report) {
+        expect(report.meta.options.roundTrips).toBe(5);
+        expect(report.meta.pluginVersion).toMatch(/^\d+\.\d+\.\d+/);
+        expect(report.meta.pluginVersion).toBe(cordova.require('cordova/plugin_list').metadata['cordova-plugin-indooratlas']);
+        expect(report.roundTrips.length).toBe(2);
+        expect(report.streams.length).toBe(1);
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    }, 25000);
+
+    it("Test.spec.40 getHistory should return typed arrays of equal length", function (done) {
+      IndoorAtlas.getHistory(0, Date.now(), 100).then(function (history) {
+        var points = history.times.length;
+        expect(history.fixCount).not.toBeLessThan(points);
+        expect(history.distance).not.toBeLessThan(0);
+        expect(history.times instanceof Float64Array).toBe(true);
+        expect(history.coordinates.length).toBe(2 * points);
+        expect(history.floors.length).toBe(points);
+        expect(history.accuracies.length).toBe(points);
+        expect(points).not.toBeGreaterThan(100);
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    });
+
+    it("Test.spec.41 getState should return a versioned state record", function (done) {
+      IndoorAtlas.getState().then(function (state) {
+        expect(typeof state.version).toBe('number');
+        expect(typeof state.running).toBe('boolean');
+        expect(state.location === null || typeof state.location.latitude === 'number').toBe(true);
+        return IndoorAtlas.getState().then(function (again) {
+          expect(again.version).not.toBeLessThan(state.version);
+          done();
+        });
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    });
+
+    it("Test.spec.42 fetchFloorPlans should report a failure per wrong or undefined floor plan id", function (done) {
+      IndoorAtlas.fetchFloorPlans(['WrongID', null, 42]).then(function (result) {
+        expect(result.floorPlans).toEqual([null, null, null]);
+        expect(result.errors.length).toBe(3);
+        // Errors come in the order the fetches completed
+        var byIndex = [];
+        result.errors.forEach(function (err) {
+          byIndex[err.index] = err;
+        });
+        expect(byIndex[0].id).toBe('WrongID');
+        expect(byIndex[0].code).toBe(PositionError.FLOOR_PLAN_UNAVAILABLE);
+        expect(byIndex[1].id).toBe(null);
+        expect(byIndex[1].code).toBe(PositionError.FLOOR_PLAN_UNDEFINED);
+        expect(byIndex[2].code).toBe(PositionError.FLOOR_PLAN_UNDEFINED);
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    }, 50000);
+
+    it("Test.spec.43 watchFloor should only report floor changes", function (done) {
+      var checkChange = function (change) {
+        expect(typeof change.floor).toBe('number');
+        expect(typeof change.certainty).toBe('number');
+        expect(typeof change.nearConnector).toBe('boolean');
+      };
+      IndoorAtlas.watchFloor(checkChange, checkChange, fail.bind(null, done));
+      setTimeout(function () {
+        IndoorAtlas.clearFloorWatch();
+        done();
+      }, 3000);
+    });
+
+    it("Test.spec.44 getExitGuidance should lead to the nearest exit of a built field", function (done) {
+      var graph = {
+        nodes: [
+          { latitude: 65.06080, longitude: 25.44100, floor: 1 },
+          { latitude: 65.06090, longitude: 25.44100, floor: 1 },
+          { latitude: 65.06100, longitude: 25.44100, floor: 1 }
+        ],
+        edges: [{ begin: 0, end: 1 }, { begin: 1, end: 2 }]
+      };
+      IndoorAtlas.buildExitField(JSON.stringify(graph), [{ id: 'north', node: 2 }], {}).then(function (built) {
+        expect(built.nodes).toBe(3);
+        expect(built.exits).toBe(1);
+        return IndoorAtlas.getExitGuidance({ latitude: 65.06080, longitude: 25.44100, floor: 1 });
+      }).then(function (guidance) {
+        expect(guidance.exitId).toBe('north');
+        expect(guidance.distance).toBeGreaterThan(20);
+        expect(guidance.distance).toBeLessThan(25);
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    });
+
+    it("Test.spec.51 exit fields should keep closed exits across rebuilds and apply deltas", function (done) {
+      var graph = JSON.stringify({
+        nodes: [
+          { latitude: 65.06080, longitude: 25.44100, floor: 1 },
+          { latitude: 65.06090, longitude: 25.44100, floor: 1 },
+          { latitude: 65.06100, longitude: 25.44100, floor: 1 }
+        ],
+        edges: [{ begin: 0, end: 1 }, { begin: 1, end: 2 }]
+      });
+      var exits = [{ id: 'north', node: 2 }, { id: 'south', node: 0 }];
+      var atNorth = { latitude: 65.06100, longitude: 25.44100, floor: 1 };
+      var closeDelta;
+      IndoorAtlas.buildExitField(graph, exits, {}).then(function () {
+        return IndoorAtlas.closeExit('north');
+      }).then(function (delta) {
+        closeDelta = delta;
+        return IndoorAtlas.buildExitField(graph, exits, {});
+      }).then(function (built) {
+        expect(built.closed).toEqual(['north']);
+        return IndoorAtlas.getExitGuidance(atNorth);
+      }).then(function (guidance) {
+        expect(guidance.exitId).toBe('south');
+        return IndoorAtlas.openExit('north');
+      }).then(function () {
+        // A fresh field, as the other device had when it closed the exit
+        return IndoorAtlas.buildExitField(graph, exits, {});
+      }).then(function () {
+        return IndoorAtlas.applyExitDelta(closeDelta);
+      }).then(function (applied) {
+        expect(applied.closed).toBe(true);
+        return IndoorAtlas.getExitGuidance(atNorth);
+      }).then(function (guidance) {
+        expect(guidance.exitId).toBe('south');
+        return IndoorAtlas.openExit('north');
+      }).then(function () {
+        return IndoorAtlas.buildExitField(graph, [exits[0], { node: 1 }], {});
+      }).then(function () {
+        fail(done, null, 'An exit without id was accepted');
+      }, function (err) {
+        expect(errorMessage(err)).toContain('Exit 1');
+        done();
+      });
+    });
+
+    it("Test.spec.49 cell ids should encode, nest, neighbour and cover consistently", function (done) {
+      IndoorAtlas.runBenchmark('cellId', { cells: 500 }).then(function (report) {
+        expect(report.roundTripOk).toBe(true);
+        expect(report.tokenOk).toBe(true);
+        expect(report.hierarchyOk).toBe(true);
+        expect(report.neighboursOk).toBe(true);
+        expect(report.coverOk).toBe(true);
+        expect(report.coverCells).toBeGreaterThan(0);
+        // Venue "venue-1", floor 2, (10.5 m, -3.25 m) at the finest level, the same on both platforms
+        expect(report.fixedToken).toBe('c433823555727001');
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    }, 25000);
+
+    it("Test.spec.50 route buffers should not keep legs of an earlier, longer route", function (done) {
+      // A corridor of six nodes 10 m apart
+      var graph = { nodes: [], edges: [] };
+      for (var i = 0; i < 6; i++) {
+        graph.nodes.push({ latitude: 65.0608 + i * 10 / 111320, longitude: 25.4410, floor: 1 });
+        if (i > 0) {
+          graph.edges.push({ begin: i - 1, end: i });
+        }
+      }
+      var end = graph.nodes[5], near = graph.nodes[1];
+      // Leg count and total length of an encoded route, see RouteBuffer
+      var decode = function (buffer) {
+        var view = new DataView(buffer);
+        var legs = view.getInt32(32, true);
+        var lengthsOffset = 40 + ((legs * 7 * 4 + 7) & ~7);
+        var length = 0;
+        for (var j = 0; j < legs; j++) {
+          length += view.getFloat64(lengthsOffset + j * 8, true);
+        }
+        expect(buffer.byteLength).toBe(lengthsOffset + legs * 8);
+        return { legs: legs, length: length };
+      };
+      var check = function (wayfinder, destination) {
+        wayfinder.setDestination(destination.latitude, destination.longitude, 1);
+        return Promise.all([wayfinder.getRoute(), wayfinder.getRouteBuffer()]).then(function (results) {
+          var legs = results[0].route;
+          var encoded = decode(results[1]);
+          var length = legs.reduce(function (sum, leg) { return sum + leg.length; }, 0);
+          expect(encoded.legs).toBe(legs.length);
+          expect(Math.abs(encoded.length - length)).toBeLessThan(0.01);
+          return encoded;
+        });
+      };
+      IndoorAtlas.buildWayfinder(JSON.stringify(graph)).then(function (wayfinder) {
+        wayfinder.setLocation(graph.nodes[0].latitude, graph.nodes[0].longitude, 1);
+        // The second route is filled into the pooled buffer of the first
+        return check(wayfinder, end).then(function (long) {
+          return check(wayfinder, near).then(function (short) {
+            expect(short.legs).toBeLessThan(long.legs);
+            expect(short.length).toBeLessThan(long.length);
+            done();
+          });
+        });
+      }).then(null, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    }, 25000);
+
+    it("Test.spec.52 fetchScheduler benchmark should keep host caps and not retry missing resources", function (done) {
+      IndoorAtlas.runBenchmark('fetchScheduler', { requests: 40, keys: 10, latencyMs: 20, missing: 4 }).then(function (report) {
+        expect(report.completed).toBe(true);
+        expect(report.maxConcurrentPerHost).not.toBeGreaterThan(report.perHostCap);
+        expect(report.failed).not.toBeLessThan(0);
+        expect(report.cancelled).not.toBeLessThan(0);
+        expect(report.failed + report.cancelled).not.toBeGreaterThan(report.requests);
+        // A resource the host does not have fails once, for good, and leaves the cap whole
+        expect(report.missingFailed).toBe(4);
+        expect(report.missingServerRequests).toBe(4);
+        expect(report.missingHostCap).toBe(report.perHostCap);
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    }, 60000);
+
+    it("Test.spec.53 simulateMemoryPressure should evict the cold tier before the warm one and never the critical one", function (done) {
+      function bytesByName(report) {
+        var bytes = {};
+        report.caches.forEach(function (cache) {
+          bytes[cache.name] = cache.residentBytes;
+        });
+        return bytes;
+      }
+      IndoorAtlas.getCacheReport(function (before) {
+        var initial = bytesByName(before);
+        // UI hidden is milder than running critical despite its higher level
+        IndoorAtlas.simulateMemoryPressure(20, function (hidden) {
+          hidden.caches.forEach(function (cache) {
+            if (cache.tier === 2) {
+              expect(cache.residentBytes).toBe(0);
+            } else {
+              expect(cache.residentBytes).toBe(initial[cache.name]);
+            }
+          });
+          IndoorAtlas.simulateMemoryPressure(15, function (critical) {
+            critical.caches.forEach(function (cache) {
+              if (cache.tier === 0) {
+                expect(cache.residentBytes).toBe(initial[cache.name]);
+              } else {
+                expect(cache.residentBytes).toBe(0);
+              }
+            });
+            done();
+          }, fail.bind(null, done));
+        }, fail.bind(null, done));
+      }, fail.bind(null, done));
+    });
+
+    it("Test.spec.54 routeBuffer benchmark should not allocate route buffers after the first route", function (done) {
+      // iOS encodes routes straight into the result and has no buffer pool
+      if (cordova.platformId !== 'android') {
+        pending();
+      }
+      IndoorAtlas.runBenchmark('routeBuffer', { legs: 500, routes: 50 }).then(function (report) {
+        expect(report.routes).toBe(50);
+        expect(report.warmupAllocatedBytes).not.toBeLessThan(0);
+        expect(report.steadyAllocatedBytes).toBe(0);
+        // Header, 7 int32 per leg and a float64 length per leg, see RouteBuffer.encode
+        expect(report.encodedBytesPerRoute).toBe(40 + 500 * 7 * 4 + 500 * 8);
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    }, 25000);
+
+    it("Test.spec.55 exit fields should reject deltas out of order, for another graph and with negative weights", function (done) {
+      var graph = {
+        nodes: [
+          { latitude: 65.06080, longitude: 25.44100, floor: 1 },
+          { latitude: 65.06090, longitude: 25.44100, floor: 1 },
+          { latitude: 65.06100, longitude: 25.44100, floor: 1 }
+        ],
+        edges: [{ begin: 0, end: 1 }, { begin: 1, end: 2 }]
+      };
+      var exits = [{ id: 'north', node: 2 }, { id: 'south', node: 0 }];
+      var first, second;
+      IndoorAtlas.buildExitField(JSON.stringify(graph), exits, {}).then(function () {
+        return IndoorAtlas.closeExit('north');
+      }).then(function (delta) {
+        first = delta;
+        return IndoorAtlas.closeExit('south');
+      }).then(function (delta) {
+        second = delta;
+        expect(second.baseVersion).toBe(first.version);
+        return IndoorAtlas.openExit('north');
+      }).then(function () {
+        return IndoorAtlas.openExit('south');
+      }).then(function () {
+        // Where the other device started
+        return IndoorAtlas.buildExitField(JSON.stringify(graph), exits, {});
+      }).then(function () {
+        return IndoorAtlas.applyExitDelta(second).then(function () {
+          throw new Error('A delta was applied out of order');
+        }, function (err) {
+          expect(errorMessage(err)).toContain('version');
+        });
+      }).then(function () {
+        return IndoorAtlas.applyExitDelta(first);
+      }).then(function () {
+        return IndoorAtlas.applyExitDelta(second);
+      }).then(function (applied) {
+        expect(applied.closed).toBe(true);
+        expect(applied.fingerprint).toBe(first.fingerprint);
+        // Same exits on a longer corridor
+        var longer = JSON.parse(JSON.stringify(graph));
+        longer.nodes.push({ latitude: 65.06110, longitude: 25.44100, floor: 1 });
+        longer.edges.push({ begin: 2, end: 3 });
+        return IndoorAtlas.buildExitField(JSON.stringify(longer), exits, {});
+      }).then(function () {
+        return IndoorAtlas.applyExitDelta(first).then(function () {
+          throw new Error('A delta for another graph was applied');
+        }, function (err) {
+          expect(errorMessage(err)).toContain('graph');
+        });
+      }).then(function () {
+        var negative = JSON.parse(JSON.stringify(graph));
+        negative.edges[1].weight = -5;
+        return IndoorAtlas.buildExitField(JSON.stringify(negative), exits, {}).then(function () {
+          throw new Error('A negative edge weight was accepted');
+        }, function (err) {
+          expect(errorMessage(err)).toContain('weight');
+        });
+      }).then(function () {
+        return IndoorAtlas.openExit('north');
+      }).then(function () {
+        return IndoorAtlas.openExit('south');
+      }).then(function () {
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    });
+
+    it("Test.spec.56 costAccounting benchmark should attribute CPU time to the right subsystems", function (done) {
+      IndoorAtlas.runBenchmark('costAccounting', { tasks: 10, workMs: 20 }).then(function (report) {
+        expect(report.completed).toBe(true);
+        expect(report.wakeupsOk).toBe(true);
+        expect(report.attributionOk).toBe(true);
+        expect(report.nsPerEnterExit).toBeGreaterThan(0);
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    }, 30000);
+
+    it("Test.spec.59 uplink benchmark should deliver every item in order despite injected failures", function (done) {
+      var options = { fixes: 300, eventEvery: 7, batchEvents: 20, latencyMs: 5, failureRate: 0.3, dropRate: 0.2 };
+      IndoorAtlas.runBenchmark('uplink', options).then(function (report) {
+        expect(report.completed).toBe(true);
+        expect(report.injectedFailures).toBeGreaterThan(0);
+        expect(report.received).toBe(report.items);
+        expect(report.missing).toBe(0);
+        expect(report.decodeErrors).toBe(0);
+        expect(report.orderErrors).toBe(0);
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    }, 60000);
+
+    it("Test.spec.60 deferred chains should not block a scheduler thread while a fetch stalls", function (done) {
+      IndoorAtlas.runBenchmark('deferred', { chains: 16, stallMs: 300 }).then(function (report) {
+        expect(report.deferred.completed).toBe(true);
+        expect(report.deferred.failures).toBe(0);
+        expect(report.deferred.maxProbeLatencyMs).toBeLessThan(150);
+        expect(report.nonBlocking).toBe(true);
+        expect(report.blocking.completed).toBe(true);
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    }, 60000);
+
+    it("Test.spec.61 event queue should drop only a torn last record on recovery", function (done) {
+      IndoorAtlas.runBenchmark('eventQueueRecovery', { events: 300, tornBytes: 7 }).then(function (report) {
+        expect(report.error).toBeUndefined();
+        expect(report.segments).toBeGreaterThan(1);
+        expect(report.truncatedBytes).toBeGreaterThan(0);
+        expect(report.replayed).toBe(299);
+        expect(report.lost).toBe(1);
+        expect(report.orderOk).toBe(true);
+        expect(report.appendAfterRecoveryOk).toBe(true);
+        expect(report.recoveredOk).toBe(true);
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    }, 30000);
+
+    it("Test.spec.62 stream channel should hold frames for acks, coalesce and decode every sample", function (done) {
+      IndoorAtlas.runBenchmark('streamChannel', {}).then(function (report) {
+        expect(report.windowOk).toBe(true);
+        expect(report.futureAckIgnored).toBe(true);
+        expect(report.staleAckIgnored).toBe(true);
+        expect(report.releasedFrames).toBe(1);
+        expect(report.heldBackSent).toBe(true);
+        expect(report.lowRateOk).toBe(true);
+        expect(report.coalescedOk).toBe(true);
+        expect(report.decodeOk).toBe(true);
+        expect(report.delivered + report.coalesced).toBe(report.offered);
+        done();
+      }, function (err) {
+        fail(done, null, errorMessage(err));
+      });
+    });
+  });
+
+  describe('Processor zones', function () {
+    // A right triangle with 10 m legs, its hypotenuse crossing the raster cells diagonally
+    var lat0 = 65.0608, lon0 = 25.4410;
+    var metersPerDegreeLon = 111320 * Math.cos(lat0 * Math.PI / 180);
+    var at = function (x, y, floor) {
+      return [lat0 + y / 111320, lon0 + x / metersPerDegreeLon, floor];
+    };
+    var triangle = [lat0, lon0, lat0, lon0 + 10 / metersPerDegreeLon, lat0 + 10 / 111320, lon0];
+    var processor = null;
+
+    beforeEach(function () {
+      processor = IndoorAtlas.createProcessor();
+    });
+
+    afterEach(function () {
+      processor.terminate();
+    });
+
+    it("Test.spec.46 classifyZones should tell points inside a zone from points outside", function (done) {
+      processor.compileZones([{ floor: 1, polygon: triangle }], { cellMeters: 0.25 }).then(function (stats) {
+        expect(stats.floors).toBe(1);
+        expect(stats.boundaryCells).toBeGreaterThan(0);
+        expect(stats.runs).toBeLessThan(stats.cells);
+        // Inside, outside within the raster, outside the raster and on another floor
+        var points = [].concat(at(2, 2, 1), at(8, 8, 1), at(-5, 2, 1), at(2, 2, 2));
+        return processor.classifyZones(new Float64Array(points));
+      }).then(function (result) {
+        expect(Array.prototype.slice.call(result.zones)).toEqual([0, -1, -1, -1]);
+        expect(result.counts[0]).toBe(1);
+        done();
+      }, function (err) {
+        fail(done, null, err.message);
+      });
+    });
+
+    it("Test.spec.47 classifyZones should fall back to the exact test in boundary cells", function (done) {
+      processor.compileZones([{ floor: 1, polygon: triangle }], { cellMeters: 0.25 }).then(function () {
+        // Both points lie in one boundary cell, on either side of the hypotenuse x + y = 10
+        var points = [].concat(at(4.8, 5.1, 1), at(4.96, 5.1, 1));
+        return processor.classifyZones(new Float64Array(points));
+      }).then(function (result) {
+        expect(result.zones[0]).toBe(0);
+        expect(result.zones[1]).toBe(-1);
+        done();
+      }, function (err) {
+        fail(done, null, err.message);
+      });
+    });
+
+    it("Test.spec.48 classifyZones should reject points before compileZones", function (done) {
+      processor.classifyZones(new Float64Array(at(2, 2, 1))).then(function () {
+        fail(done, null, 'Unexpected win');
+      }, function (err) {
+        expect(err.message).toContain('No zones compiled');
+        done();
+      });
+    });
   });
 
 
@@ -231,6 +807,20 @@ exports.defineAutoTests = function () {
               });
             });
 
+            it("Test.spec.57 Should be called with UNSPECIFIED_ERROR for an invalid filter", function (done) {
+              var context = this;
+              errorWatch = IndoorAtlas.watchPosition(
+                fail.bind(null, done, context, 'Unexpected win'),
+                function (err) {
+                  if (context.done) return;
+                  context.done = true;
+                  expect(err.code).toBe(PositionError.UNSPECIFIED_ERROR);
+                  expect(err.message).toBeDefined();
+                  done();
+                },
+                { filter: "accuracy < && floor" });
+            });
+
             it("Test.spec.17 On failure should return PositionError object with error code constants", function (done) {
               if (skipAndroid) {
                 pending();
@@ -303,6 +893,82 @@ exports.defineAutoTests = function () {
                     }
                   });
                 }, 25000);
+
+              it("Test.spec.45 getCurrentPosition should be answered while a filtered watch receives positions", function (done) {
+                if (skipAndroid || isIOSSim) {
+                  pending();
+                }
+
+                // The watch matches every position, which used to keep the request waiting
+                var context = this;
+                successWatch = IndoorAtlas.watchPosition(
+                  function (p) {},
+                  fail.bind(null, done, context, 'Watch failed'),
+                  { filter: "accuracy >= 0" });
+                IndoorAtlas.getCurrentPosition(function (p) {
+                  if (context.done) return;
+                  context.done = true;
+                  expect(p.coords.latitude).toBeDefined();
+                  expect(p.coords.accuracy).toBeDefined();
+                  setTimeout(function () {
+                    done();
+                  });
+                }, fail.bind(null, done, context, 'getCurrentPosition failed'));
+              }, 25000);
+
+              it("Test.spec.58 a filtered watch should not receive the positions its filter rejects", function (done) {
+                if (skipAndroid || isIOSSim) {
+                  pending();
+                }
+
+                var context = this;
+                var rejected = 0;
+                // No accuracy is negative, so the filter drops every position natively
+                var filteredWatch = IndoorAtlas.watchPosition(
+                  function (p) {
+                    rejected++;
+                  },
+                  fail.bind(null, done, context, 'Filtered watch failed'),
+                  { filter: "accuracy < 0" });
+                var received = 0;
+                successWatch = IndoorAtlas.watchPosition(function (p) {
+                  if (context.done || ++received < 3) return;
+                  context.done = true;
+                  IndoorAtlas.clearWatch(filteredWatch);
+                  expect(rejected).toBe(0);
+                  setTimeout(function () {
+                    done();
+                  });
+                }, fail.bind(null, done, context, 'Watch failed'));
+              }, 40000);
+
+              it("Test.spec.63 watchFloor should deliver the confirmed floor when it subscribes", function (done) {
+                if (skipAndroid || isIOSSim) {
+                  pending();
+                }
+
+                var context = this;
+                successWatch = IndoorAtlas.watchPosition(function (p) {
+                  if (context.watching) return;
+                  context.watching = true;
+                  // The first position confirmed its floor, so no floor change is needed
+                  var timer = setTimeout(function () {
+                    IndoorAtlas.clearFloorWatch();
+                    fail(done, context, 'No confirmed floor on subscribe');
+                  }, 2000);
+                  IndoorAtlas.watchFloor(function (change) {
+                    if (context.done) return;
+                    context.done = true;
+                    clearTimeout(timer);
+                    IndoorAtlas.clearFloorWatch();
+                    expect(typeof change.floor).toBe('number');
+                    expect(change.previousFloor).toBe(change.floor);
+                    setTimeout(function () {
+                      done();
+                    });
+                  }, null, fail.bind(null, done, context, 'watchFloor failed'));
+                }, fail.bind(null, done, context, 'Watch failed'));
+              }, 30000);
               });
             });
 
@@ -31,7 +31,9 @@ function parseSetPositionParameters(options) {
 
 function parseParameters(options) {
   var opt = {
-    timeout: Infinity
+    timeout: Infinity,
+    maximumAge: 0,
+    minimumAccuracy: Infinity
   };
 
   if (options) {
@@ -42,20 +44,159 @@ function parseParameters(options) {
         opt.timeout = options.timeout;
       }
     }
+    if (options.maximumAge !== undefined && !isNaN(options.maximumAge)) {
+      opt.maximumAge = Math.max(0, options.maximumAge);
+    }
+    if (options.minimumAccuracy !== undefined && !isNaN(options.minimumAccuracy)) {
+      opt.minimumAccuracy = Math.max(0, options.minimumAccuracy);
+    }
+    if (options.filter !== undefined) {
+      opt.filter = options.filter;
+    }
   }
   return opt;
 }
 
-function createTimeout(errorCallback, timeout) {
-  var t = setTimeout(function() {
-    clearTimeout(t);
-    t = null;
-    errorCallback({
-      code: PositionError.TIMEOUT,
-      message: "Position retrieval timed out."
-    });
-  }, timeout);
-  return t;
+// Filter expression option for the native side; null means no filter
+function nativeFilter(options) {
+  return options && options.filter ? String(options.filter) : null;
+}
+
+// Timeouts are kept by the native timing wheel; -1 means no timeout
+function nativeTimeout(timeout) {
+  return timeout === Infinity ? -1 : timeout;
+}
+
+// maximumAge and minimumAccuracy for the native side; -1 means no limit
+function nativeLimit(limit) {
+  return limit === Infinity ? -1 : limit;
+}
+
+// True if the position is recent and accurate enough for the options
+function isFreshPosition(position, options) {
+  return position !== null &&
+    Date.now() - position.timestamp <= options.maximumAge &&
+    !(position.coords.accuracy > options.minimumAccuracy);
+}
+
+// Binary stream channel shared by the high rate subscriptions, opened by the
+// first of them. See StreamChannel.java for the frame layout.
+var STREAM_ACK_EVERY_FRAMES = 4;
+var streamChannel = null;
+var watchStreams = {};   // watch id -> stream id
+var attitudeStream = 0;
+var headingStream = 0;
+
+function decodeUtf8(bytes) {
+  if (typeof TextDecoder !== 'undefined') {
+    return new TextDecoder('utf-8').decode(bytes);
+  }
+  var s = '';
+  for (var i = 0; i < bytes.length; i++) {
+    s += String.fromCharCode(bytes[i]);
+  }
+  return decodeURIComponent(escape(s));
+}
+
+var StreamChannel = function() {
+  var handlers = {};
+  var strings = [];
+  var nextId = 1;
+
+  // Samples as the objects the per-event callbacks receive
+  var decoders = {
+    position: function(v) {
+      return {
+        latitude: v[0], longitude: v[1], altitude: v[2], accuracy: v[3], heading: v[4], velocity: v[5],
+        flr: v[6], timestamp: v[7], altitudeAccuracy: isNaN(v[11]) ? undefined : v[11],
+        region: v[8] >= 0 ? { regionId: strings[v[8]], regionType: v[9], timestamp: v[10], transitionType: 0 } : undefined
+      };
+    },
+    heading: function(v) {
+      return { trueHeading: v[0], timestamp: v[1] };
+    },
+    attitude: function(v) {
+      return { x: v[0], y: v[1], z: v[2], w: v[3], timestamp: v[4] };
+    }
+  };
+
+  var dispatch = function(view, offset, id, fields, count) {
+    var handler = handlers[id];
+    if (!handler) {
+      return;
+    }
+    var values = new Array(fields);
+    for (var i = 0; i < count; i++) {
+      for (var f = 0; f < fields; f++) {
+        values[f] = view.getFloat64(offset, true);
+        offset += 8;
+      }
+      try {
+        handler.callback(handler.decode(values));
+      } catch (error) {
+        console.log('Stream listener failed: ' + error);
+      }
+    }
+  };
+
+  var receive = function(buffer) {
+    var view = new DataView(buffer);
+    var sections = view.getUint16(2, true);
+    var sequence = view.getUint32(4, true);
+    var offset = 8;
+    for (var s = 0; s < sections; s++) {
+      var id = view.getUint16(offset, true);
+      var fields = view.getUint16(offset + 2, true);
+      var count = view.getUint32(offset + 4, true);
+      offset += 16;
+      if (id === 0) {
+        for (var i = 0; i < count; i++) {
+          var index = view.getUint32(offset, true);
+          var length = view.getUint32(offset + 4, true);
+          strings[index] = decodeUtf8(new Uint8Array(buffer, offset + 8, length));
+          offset += (8 + length + 7) & ~7;
+        }
+      } else {
+        dispatch(view, offset, id, fields, count);
+        offset += count * fields * 8;
+      }
+    }
+    // Native code holds back frames until these arrive, coalescing meanwhile
+    if (sequence % STREAM_ACK_EVERY_FRAMES === 0) {
+      exec(null, null, "IndoorAtlas", "ackStreamChannel", [sequence]);
+    }
+  };
+
+  /**
+   * Routes the samples of a new stream to callback as objects of kind
+   * 'position', 'heading' or 'attitude'. Returns the stream id for native code.
+   */
+  this.subscribe = function(kind, callback) {
+    var id = nextId++;
+    handlers[id] = { decode: decoders[kind], callback: callback };
+    return id;
+  };
+
+  this.unsubscribe = function(id) {
+    delete handlers[id];
+  };
+
+  exec(receive, function(e) {
+    console.log('Stream channel failed: ' + (e && e.message ? e.message : e));
+  }, "IndoorAtlas", "openStreamChannel", []);
+};
+
+function subscribeStream(kind, callback) {
+  if (streamChannel === null) {
+    streamChannel = new StreamChannel();
+  }
+  return streamChannel.subscribe(kind, callback);
+}
+
+function unsubscribeStream(id) {
+  if (streamChannel !== null && id) {
+    streamChannel.unsubscribe(id);
+  }
 }
 
 var IndoorAtlas = {
@@ -95,16 +236,23 @@ var IndoorAtlas = {
     exec(win, fail, "IndoorAtlas", "initializeIndoorAtlas", [options]);
   },
 
+  /**
+   * options: { timeout, maximumAge, minimumAccuracy }. A position at most
+   * maximumAge milliseconds old (default 0) and at least as accurate as
+   * minimumAccuracy metres (default any) is returned right away, from
+   * lastPosition or the native last fix. Otherwise the request waits for the
+   * next such position of the running positioning session, which is only
+   * started if it is not running yet.
+   */
   getCurrentPosition: function(successCallback, errorCallback, options) {
     try {
       options = parseParameters(options);
 
-      // Timer var that will fire an error callback if no position is retrieved from native
-      // before the "timeout" param provided expires
+      // Truthy while the request is outstanding. Native fires the error callback
+      // if no position is retrieved before the "timeout" param provided expires
       var timeoutTimer = { timer: null };
       var win = function(p) {
         try {
-          clearTimeout(timeoutTimer.timer);
           if (!(timeoutTimer.timer)) {
             // Timeout already happened, or native fired error callback for
             // this geo request.
@@ -133,7 +281,6 @@ var IndoorAtlas = {
       };
 
       var fail = function(e) {
-        clearTimeout(timeoutTimer.timer);
         timeoutTimer.timer = null;
         var err = new PositionError(e.code, e.message);
         if (errorCallback) {
@@ -141,9 +288,9 @@ var IndoorAtlas = {
         }
       };
 
-      // Check our cached position, if its timestamp difference with current time is less than the maximumAge, then just
+      // Check our cached position, if it is recent and accurate enough then just
       // fire the success callback with the cached position.
-      if (IndoorAtlas.lastPosition && options.maximumAge && (((new Date()).getTime() - IndoorAtlas.lastPosition.timestamp) <= options.maximumAge)) {
+      if (isFreshPosition(IndoorAtlas.lastPosition, options)) {
         successCallback(IndoorAtlas.lastPosition);
 
         // If the cached position check failed and the timeout was set to 0, error out with a TIMEOUT error object.
@@ -155,25 +302,21 @@ var IndoorAtlas = {
 
         // Otherwise we have to call into native to retrieve a position.
       } else {
-        if (options.timeout !== Infinity) {
-          // If the timeout value was not set to Infinity (default), then
-          // set up a timeout function that will fire the error callback
-          // if no successful position was retrieved before timeout expired.
-          timeoutTimer.timer = createTimeout(fail, options.timeout);
-        } else {
-          // This is here so the check in the win function doesn't mess stuff up
-          // may seem weird but this guarantees timeoutTimer is
-          // always truthy before we call into native
-          timeoutTimer.timer = true;
-        }
-        exec(win, fail, "IndoorAtlas", "getLocation", [options.floorPlan]);
+        timeoutTimer.timer = true;
+        exec(win, fail, "IndoorAtlas", "getLocation", [options.floorPlan, nativeTimeout(options.timeout),
+          nativeLimit(options.maximumAge), nativeLimit(options.minimumAccuracy)]);
       }
       return timeoutTimer;
     }
     catch(error) { alert(error); }
   },
 
-  watchRegion: function(onEnterRegion, onExitRegion, errorCallback) {
+  /**
+   * options: { filter } where filter is an expression on regionId,
+   * regionType, transition ('enter' or 'exit') and timestamp, e.g.
+   * "transition == 'enter' && regionId == 'abc'". See watchPosition.
+   */
+  watchRegion: function(onEnterRegion, onExitRegion, errorCallback, options) {
     var id = utils.createUUID();
 
     var fail = function(e) {
@@ -193,7 +336,7 @@ var IndoorAtlas = {
       }
     };
 
-    exec(win, fail, "IndoorAtlas", "addRegionWatch", [id]);
+    exec(win, fail, "IndoorAtlas", "addRegionWatch", [id, nativeFilter(options)]);
     return id;
   },
 
@@ -211,7 +354,10 @@ var IndoorAtlas = {
     catch(error) { alert(error); }
   },
 
-  didUpdateAttitude: function(onAttitudeUpdated, errorCallback) {
+  /**
+   * options: { filter } on x, y, z, w and timestamp. See watchPosition.
+   */
+  didUpdateAttitude: function(onAttitudeUpdated, errorCallback, options) {
     var fail = function(e) {
       if (errorCallback) {
         errorCallback(e);
@@ -222,7 +368,9 @@ var IndoorAtlas = {
       onAttitudeUpdated(attitude);
     };
 
-    exec(win, fail, "IndoorAtlas", "addAttitudeCallback");
+    unsubscribeStream(attitudeStream);
+    attitudeStream = subscribeStream('attitude', win);
+    exec(win, fail, "IndoorAtlas", "addAttitudeCallback", [nativeFilter(options), attitudeStream]);
   },
 
   removeAttitudeCallback: function() {
@@ -234,10 +382,16 @@ var IndoorAtlas = {
       console.log("Attitude callback removed");
     };
 
+    unsubscribeStream(attitudeStream);
+    attitudeStream = 0;
     exec(win, fail, "IndoorAtlas", "removeAttitudeCallback");
   },
 
-  didUpdateHeading: function(onHeadingUpdated, errorCallback) {
+  /**
+   * options: { filter } on heading and timestamp, e.g. "change(heading) > 10".
+   * See watchPosition.
+   */
+  didUpdateHeading: function(onHeadingUpdated, errorCallback, options) {
     var fail = function(e) {
       if (errorCallback) {
         errorCallback(e);
@@ -248,7 +402,9 @@ var IndoorAtlas = {
       onHeadingUpdated(heading);
     };
 
-    exec(win, fail, "IndoorAtlas", "addHeadingCallback");
+    unsubscribeStream(headingStream);
+    headingStream = subscribeStream('heading', win);
+    exec(win, fail, "IndoorAtlas", "addHeadingCallback", [nativeFilter(options), headingStream]);
   },
 
   removeHeadingCallback: function() {
@@ -260,6 +416,8 @@ var IndoorAtlas = {
       console.log("Heading callback removed");
     };
 
+    unsubscribeStream(headingStream);
+    headingStream = 0;
     exec(win, fail, "IndoorAtlas", "removeHeadingCallback");
   },
 
@@ -290,16 +448,80 @@ var IndoorAtlas = {
     exec(win, fail, "IndoorAtlas", "removeStatusCallback");
   },
 
+  /**
+   * Floor changes with hysteresis, for switching floor plans and routes
+   * instead of following the floor of every position. onFloorChanged is
+   * called with { floor, previousFloor, certainty, nearConnector, timestamp }
+   * once a floor is confirmed: by a high floor certainty next to stairs,
+   * escalators or elevators of the wayfinding graph, or after the positions
+   * have stayed on it for a while. onTentativeFloor, if given, is called with
+   * { floor, confirmedFloor, certainty, nearConnector, timestamp } when the
+   * positions move to another floor before it is confirmed, and with floor
+   * equal to confirmedFloor when they return. If a floor is already
+   * confirmed, onFloorChanged is called right away with previousFloor equal
+   * to floor, followed by onTentativeFloor if a change is pending. Without a
+   * wayfinding graph every change waits for the longer dwell.
+   */
+  watchFloor: function(onFloorChanged, onTentativeFloor, errorCallback) {
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+
+    var win = function(change) {
+      if (change.confirmed) {
+        onFloorChanged({ floor: change.floor, previousFloor: change.confirmedFloor, certainty: change.certainty,
+                         nearConnector: change.nearConnector, timestamp: change.timestamp });
+      } else if (onTentativeFloor) {
+        onTentativeFloor({ floor: change.floor, confirmedFloor: change.confirmedFloor, certainty: change.certainty,
+                           nearConnector: change.nearConnector, timestamp: change.timestamp });
+      }
+    };
+
+    exec(win, fail, "IndoorAtlas", "addFloorCallback");
+  },
+
+  clearFloorWatch: function() {
+    var fail = function(e) {
+      console.log("Error while removing floor callback");
+    };
+
+    var win = function(success) {
+      console.log("Floor callback removed");
+    };
+
+    exec(win, fail, "IndoorAtlas", "removeFloorCallback");
+  },
+
+  /**
+   * options: { timeout, filter }. filter is an expression evaluated natively
+   * for each position, which is only sent to successCallback if it matches.
+   * It compares latitude, longitude, altitude, accuracy, heading, velocity,
+   * floor and timestamp with numbers or each other using == != < <= > >=,
+   * combined with &&, || and !. change(field) is the difference to the last
+   * position this watch received, e.g. "accuracy < 5 && floor == 3" or
+   * "change(floor) != 0". An invalid filter is reported to errorCallback.
+   * Positions arrive on the binary stream channel shared with heading and
+   * attitude; when JavaScript falls behind, native code coalesces them.
+   */
   watchPosition: function(successCallback, errorCallback, options) {
+    // The first position may be the last known one unless maximumAge is given
+    var first = parseParameters(options);
+    if (!options || options.maximumAge === undefined) {
+      first.maximumAge = Infinity;
+    }
     options = parseParameters(options);
 
     var id = utils.createUUID();
 
-    // Tell device to get a position ASAP, and also retrieve a reference to the timeout timer generated in getCurrentPosition
-    timers[id] = IndoorAtlas.getCurrentPosition(successCallback, errorCallback, options);
+    // Tell device to get a position ASAP, and also retrieve a reference to the timeout timer generated in getCurrentPosition.
+    // That position would bypass the filter, so filtered watches wait for the first match.
+    if (!options.filter) {
+      timers[id] = IndoorAtlas.getCurrentPosition(successCallback, errorCallback, first);
+    }
 
     var fail = function(e) {
-      clearTimeout(timers[id].timer);
       var err = new PositionError(e.code, e.message);
       if (errorCallback) {
         errorCallback(err);
@@ -307,10 +529,6 @@ var IndoorAtlas = {
     };
 
     var win = function(p) {
-      clearTimeout(timers[id].timer);
-      if (options.timeout !== Infinity) {
-        timers[id].timer = createTimeout(fail, options.timeout);
-      }
       var pos = new Position(
         {
           latitude: p.latitude,
@@ -327,11 +545,15 @@ var IndoorAtlas = {
       IndoorAtlas.lastPosition = pos;
       successCallback(pos);
     };
-    exec(win, fail, "IndoorAtlas", "addWatch", [id, options.floorPlan]);
+    watchStreams[id] = subscribeStream('position', win);
+    exec(win, fail, "IndoorAtlas", "addWatch",
+      [id, options.floorPlan, nativeTimeout(options.timeout), nativeFilter(options), watchStreams[id]]);
     return id;
   },
 
   clearWatch: function(watchId) {
+    unsubscribeStream(watchStreams[watchId]);
+    delete watchStreams[watchId];
     try {
       exec(
         function(success) {
@@ -362,24 +584,7 @@ var IndoorAtlas = {
 
   fetchFloorPlanWithId: function(floorplanId, successCallback, errorCallback){
     var win = function(p) {
-      var floorplan = new FloorPlan(
-        p.id,
-        p.name,
-        p.url,
-        p.floorLevel,
-        p.bearing,
-        p.bitmapHeight,
-        p.bitmapWidth,
-        p.heightMeters,
-        p.widthMeters,
-        p.metersToPixels,
-        p.pixelsToMeters,
-        p.bottomLeft,
-        p.center,
-        p.topLeft,
-        p.topRight
-      );
-      successCallback(floorplan);
+      successCallback(toFloorPlan(p));
     };
     var fail = function(e) {
       var err = new PositionError(e.code, e.message);
@@ -390,6 +595,35 @@ var IndoorAtlas = {
     exec(win, fail, "IndoorAtlas", "fetchFloorplan", [floorplanId]);
   },
 
+  /**
+   * Fetches the floor plans with the given ids in one call, e.g. all floors
+   * of a venue. The fetches run in parallel, cached floor plans are used
+   * right away and fetches already in flight are shared.
+   *
+   * Resolves with { floorPlans, errors } once all have completed: the
+   * FloorPlans in the order of the ids, null where a fetch failed, and a
+   * PositionError per failure with the id and index of the floor plan.
+   */
+  fetchFloorPlans: function(floorplanIds) {
+    return new Promise(function(resolve, reject) {
+      var success = function(result) {
+        resolve({
+          floorPlans: result.floorPlans.map(function(p) {
+            return p ? toFloorPlan(p) : null;
+          }),
+          errors: result.errors.map(function(e) {
+            var err = new PositionError(e.code, e.message);
+            err.id = e.id;
+            err.index = e.index;
+            return err;
+          })
+        });
+      };
+      var error = function(e) { reject(new PositionError(e.code, e.message)) };
+      exec(success, error, "IndoorAtlas", "fetchFloorPlans", [floorplanIds || []]);
+    });
+  },
+
   coordinateToPoint: function(coords, floorplanId, successCallback, errorCallback){
     var win = function(p) {
       successCallback(p);
@@ -466,6 +700,61 @@ var IndoorAtlas = {
     exec(win, fail, "IndoorAtlas", "getTraceId");
   },
 
+  /**
+   * Resolves with one consistent record of the positioning state: { version,
+   * location, status, region, traceId, running }. location is the last
+   * position with its floor and floorCertainty, status the last service
+   * status and region the region last entered and not exited, each null
+   * until known. Native updates the record once per SDK event and bumps
+   * version; after the first call only the parts that changed cross the
+   * bridge.
+   */
+  getState: function() {
+    return refreshState().then(function() {
+      return copyState();
+    });
+  },
+
+  /**
+   * Polls the state record every intervalMs (default 1000) and calls
+   * callback(state, changed) when it changed, with the names of the parts
+   * that did, e.g. ['location', 'traceId']. The first call has all parts.
+   * Returns an id for clearStateWatch.
+   */
+  watchState: function(callback, errorCallback, options) {
+    var id = utils.createUUID();
+    var watch = { epoch: 0, version: 0, timer: null };
+    var poll = function() {
+      refreshState().then(function() {
+        if (stateWatches[id] !== watch) {
+          return;
+        }
+        var changed = changedStateParts(watch.epoch, watch.version);
+        watch.epoch = stateCache.epoch;
+        watch.version = stateCache.version;
+        if (changed.length > 0) {
+          callback(copyState(), changed);
+        }
+      }, function(e) {
+        if (errorCallback) {
+          errorCallback(e);
+        }
+      });
+    };
+    stateWatches[id] = watch;
+    watch.timer = setInterval(poll, (options && options.intervalMs) || 1000);
+    poll();
+    return id;
+  },
+
+  clearStateWatch: function(watchId) {
+    var watch = stateWatches[watchId];
+    if (watch) {
+      clearInterval(watch.timer);
+      delete stateWatches[watchId];
+    }
+  },
+
   /**
    * Initialize graph with the given graph JSON
    */
@@ -477,6 +766,460 @@ var IndoorAtlas = {
       var error = function(e) { reject(e) };
       exec(success, error, "IndoorAtlas", "buildWayfinder", [graphJson]);
     });
+  },
+
+  /**
+   * Fetch the floor plan, compute a route and project it onto the floor plan
+   * natively in one call. Route points on the floor plan's floor get x and y
+   * in floor plan pixels.
+   */
+  computeRouteOnFloorPlan: function(wayfinderId, from, to, floorPlanId) {
+    return new Promise(function(resolve, reject) {
+      var success = function(result) { resolve(result) };
+      var error = function(e) { reject(e) };
+      exec(success, error, "IndoorAtlas", "computeRouteOnFloorPlan", [wayfinderId, from.lat, from.lon, from.floor, to.lat, to.lon, to.floor, floorPlanId]);
+    });
+  },
+
+  /**
+   * Precomputes the distance to the nearest open exit from every node of a
+   * wayfinding graph and from every cell of a raster per floor, for
+   * evacuation guidance. exits: [{ id, latitude, longitude, floor }], each
+   * snapped to the nearest node on its floor, or [{ id, node }].
+   * options: { cellMeters: 1 }. Exits closed in the previous field stay
+   * closed. Resolves with { version, nodes, exits, closed }, closed being
+   * the ids of the closed exits.
+   */
+  buildExitField: function(graphJson, exits, options) {
+    return new Promise(function(resolve, reject) {
+      var success = function(result) { resolve(result) };
+      var error = function(e) { reject(e) };
+      exec(success, error, "IndoorAtlas", "buildExitField", [graphJson, exits, options || {}]);
+    });
+  },
+
+  /**
+   * Guidance towards the nearest open exit from position { latitude,
+   * longitude, floor }, or from the last fix if omitted. Resolves with
+   * { version, exitId, distance, node, next }: node is where to head first
+   * and next the hop after it. exitId, distance and next are null if no open
+   * exit can be reached.
+   */
+  getExitGuidance: function(position) {
+    return new Promise(function(resolve, reject) {
+      var success = function(result) { resolve(result) };
+      var error = function(e) { reject(e) };
+      var args = position ? [position.latitude, position.longitude, position.floor] : [];
+      exec(success, error, "IndoorAtlas", "getExitGuidance", args);
+    });
+  },
+
+  /**
+   * Closes an exit and repairs the field around it. Resolves with the delta
+   * { version, baseVersion, fingerprint, exitId, closed, nodes, distances,
+   * next, exits, floors }: the version it was made from, a hash of the graph
+   * and exits, and the changed nodes with their new distance (null if
+   * unreachable), next hop node index and exit id, for the app to pass on to
+   * other devices, which apply it with applyExitDelta.
+   */
+  closeExit: function(exitId) {
+    return new Promise(function(resolve, reject) {
+      var success = function(result) { resolve(result) };
+      var error = function(e) { reject(e) };
+      exec(success, error, "IndoorAtlas", "closeExit", [exitId]);
+    });
+  },
+
+  /**
+   * Reopens a closed exit, resolves with the delta as closeExit does
+   */
+  openExit: function(exitId) {
+    return new Promise(function(resolve, reject) {
+      var success = function(result) { resolve(result) };
+      var error = function(e) { reject(e) };
+      exec(success, error, "IndoorAtlas", "openExit", [exitId]);
+    });
+  },
+
+  /**
+   * Applies a delta of closeExit or openExit from another device whose field
+   * was built from the same graph and exits. Deltas of one device must be
+   * applied in the order it made them: a delta whose baseVersion is not this
+   * field's version, or whose fingerprint differs, is rejected. Resolves with
+   * the delta as applied, with the version of this device's field.
+   */
+  applyExitDelta: function(delta) {
+    return new Promise(function(resolve, reject) {
+      var success = function(result) { resolve(result) };
+      var error = function(e) { reject(e) };
+      exec(success, error, "IndoorAtlas", "applyExitDelta", [delta]);
+    });
+  },
+
+  /**
+   * Get resident bytes per native cache and the cache budget
+   */
+  getCacheReport: function(successCallback, errorCallback) {
+    var win = function(p) {
+      successCallback(p);
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    exec(win, fail, "IndoorAtlas", "getCacheReport");
+  },
+
+  /**
+   * Evict native caches as if the system signalled memory pressure. Levels are
+   * Android's trim levels: 5 moderate, 10 low, 15 critical, 20 UI hidden,
+   * 40 background, 60 moderate background, 80 complete.
+   * Calls back with the cache report after eviction.
+   */
+  simulateMemoryPressure: function(level, successCallback, errorCallback) {
+    var win = function(p) {
+      successCallback(p);
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    exec(win, fail, "IndoorAtlas", "simulateMemoryPressure", [level]);
+  },
+
+  /**
+   * Hands geofence and proximity triggers and occupancy reporting to the
+   * native layer, which keeps evaluating them while the app is in the
+   * background. There, watchPosition, watchRegion, orientation and heading
+   * callbacks are paused and JavaScript is only woken with the events below;
+   * the watches get the latest position when the app returns.
+   *
+   * options: { triggers: [trigger], batchIntervalMs: 900000,
+   * batchMaxSamples: 3600, cellLevel: 10 }, where a trigger is either
+   * { id, regionId } or { id, latitude, longitude, radius, floor }, plus
+   * on: 'enter' | 'exit' | 'both', wake: true, cooldownMs: 60000 and an
+   * optional notification: { title, text } posted in the background.
+   *
+   * eventCallback receives { type: 'trigger', triggerId, transitionType,
+   * timestamp, background } for triggers with wake: true, and
+   * { type: 'occupancy', from, to, samples, cells: [{ cellId, samples,
+   * dwellMs }] } once per batch. Both are also stored in the event queue
+   * and carry their queue offset, see fetchEvents.
+   */
+  configureBackground: function(options, eventCallback, errorCallback) {
+    var win = function(event) {
+      eventCallback(event);
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    exec(win, fail, "IndoorAtlas", "configureBackground", [options || {}]);
+  },
+
+  /**
+   * Stops native background processing. Calls back with its counters.
+   */
+  clearBackground: function(successCallback, errorCallback) {
+    var win = function(stats) {
+      if (successCallback) {
+        successCallback(stats);
+      }
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    exec(win, fail, "IndoorAtlas", "clearBackground");
+  },
+
+  /**
+   * Reads the next batch of stored events for a consumer, oldest first.
+   * The native layer stores the events of configureBackground and region
+   * transitions no watchRegion callback received, so that they survive the
+   * WebView being suspended and the app being killed. Call on startup and
+   * on resume, then ackEvents with lastOffset and repeat while pending > 0.
+   *
+   * options: { maxEvents: 100 }. successCallback receives { consumer,
+   * events, lastOffset, pending, skipped }, where each event has its offset
+   * and skipped counts events dropped by the size bound before being read.
+   */
+  fetchEvents: function(consumer, options, successCallback, errorCallback) {
+    var win = function(batch) {
+      successCallback(batch);
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    var maxEvents = (options && options.maxEvents) || 100;
+    exec(win, fail, "IndoorAtlas", "fetchEvents", [consumer, maxEvents]);
+  },
+
+  /**
+   * Marks the events of a consumer up to and including offset as handled,
+   * so that fetchEvents does not return them again. Calls back with the
+   * queue counters.
+   */
+  ackEvents: function(consumer, offset, successCallback, errorCallback) {
+    var win = function(stats) {
+      if (successCallback) {
+        successCallback(stats);
+      }
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    exec(win, fail, "IndoorAtlas", "ackEvents", [consumer, offset]);
+  },
+
+  /**
+   * Resolves with the positions between from and to (milliseconds since the
+   * epoch, both optional), as kept by the native position history. It holds
+   * every fix received while positioning ran, also in the background and
+   * across restarts, up to a few megabytes. Long ranges are simplified to at
+   * most maxPoints (default 1000) by Douglas-Peucker; floor changes and the
+   * ends of the range are always kept.
+   *
+   * Resolves with { fixCount, distance, times, coordinates, floors,
+   * accuracies }: the number of fixes in the range, the distance walked over
+   * all of them in metres, then per point a Float64Array of timestamps, a
+   * Float64Array of latitude, longitude pairs, an Int32Array of floors and a
+   * Float64Array of accuracies in metres.
+   */
+  getHistory: function(from, to, maxPoints) {
+    return new Promise(function(resolve, reject) {
+      var success = function(buffer) { resolve(decodeHistory(buffer)) };
+      var error = function(e) { reject(e) };
+      exec(success, error, "IndoorAtlas", "getHistory", [from || 0, to || Number.MAX_SAFE_INTEGER, maxPoints || 1000]);
+    });
+  },
+
+  /**
+   * Forgets the native position history
+   */
+  clearHistory: function(successCallback, errorCallback) {
+    var win = function() {
+      if (successCallback) {
+        successCallback();
+      }
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    exec(win, fail, "IndoorAtlas", "clearHistory", []);
+  },
+
+  /**
+   * Uploads positions and events to a backend in compressed batches, so the
+   * radio wakes once per batch instead of once per fix. Items are queued on
+   * disk and retried with exponential backoff until the backend accepts
+   * them, also across app restarts. The uplink only sees positions while
+   * positioning runs for some other reason.
+   *
+   * options: { url, headers: {}, batchEvents: 500, intervalMs: 60000,
+   * backoffBaseMs: 5000, backoffMaxMs: 600000, fixes: true, events: true }.
+   * Each request is a POST with Content-Encoding: deflate and the headers
+   * X-IA-Stream and X-IA-Offsets (first-last), by which the backend can
+   * drop batches it already has. The body keeps fixes and events in columns
+   * and each event records how many fixes precede it, so the backend can
+   * restore the order they were queued in. Calls back with the uplink
+   * counters.
+   */
+  configureUplink: function(options, successCallback, errorCallback) {
+    var win = function(stats) {
+      if (successCallback) {
+        successCallback(stats);
+      }
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    exec(win, fail, "IndoorAtlas", "configureUplink", [options || {}]);
+  },
+
+  /**
+   * Stops uploading. Queued items are kept for the next configureUplink.
+   */
+  clearUplink: function(successCallback, errorCallback) {
+    var win = function(stats) {
+      if (successCallback) {
+        successCallback(stats);
+      }
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    exec(win, fail, "IndoorAtlas", "clearUplink");
+  },
+
+  /**
+   * CPU time, wall time and wakeups spent by each native subsystem
+   * (positioning, bridge, sensors, routing, timers, scheduler, storage,
+   * network) and feature since the last reset, with the CPU time of the
+   * whole process for comparison. Pass { reset: true } to start a new period after reading.
+   */
+  getCostReport: function(options, successCallback, errorCallback) {
+    var win = function(p) {
+      if (options && options.reset) {
+        exec(function() {}, function() {}, "IndoorAtlas", "resetCostReport");
+      }
+      successCallback(p);
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    exec(win, fail, "IndoorAtlas", "getCostReport");
+  },
+
+  /**
+   * Start recording a native timeline of SDK callbacks, bridge sends, routing
+   * and fetches. Options: { capacityPerThread: 4096 }, older events are
+   * overwritten when a thread's buffer is full.
+   */
+  startTracing: function(options, successCallback, errorCallback) {
+    var win = function() {
+      if (successCallback) {
+        successCallback();
+      }
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    var capacity = (options && options.capacityPerThread) || 4096;
+    exec(win, fail, "IndoorAtlas", "startTracing", [capacity]);
+  },
+
+  stopTracing: function(successCallback, errorCallback) {
+    var win = function() {
+      if (successCallback) {
+        successCallback();
+      }
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    exec(win, fail, "IndoorAtlas", "stopTracing");
+  },
+
+  /**
+   * Calls back with the recording in the Chrome trace event format, ready to
+   * load in chrome://tracing or Perfetto. otherData.traceId holds the
+   * IndoorAtlas trace id of the session.
+   */
+  dumpTrace: function(successCallback, errorCallback) {
+    var win = function(trace) {
+      successCallback(trace);
+    };
+    var fail = function(e) {
+      if (errorCallback) {
+        errorCallback(e);
+      }
+    };
+    exec(win, fail, "IndoorAtlas", "dumpTrace");
+  },
+
+  /**
+   * Starts a processing worker that keeps route simplification, clustering
+   * and heatmap compositing off the main thread. workerUrl defaults to the
+   * worker this plugin installs. See Processor.
+   */
+  createProcessor: function(workerUrl) {
+    return new Processor(workerUrl || DEFAULT_WORKER_URL);
+  },
+
+  /**
+   * Run a native benchmark, e.g. "scheduler", and resolve with its report.
+   * Options are benchmark specific, e.g. { tasks: 2000, work: 20000 }
+   */
+  runBenchmark: function(name, options) {
+    return new Promise(function(resolve, reject) {
+      var success = function(report) { resolve(report) };
+      var error = function(e) { reject(e) };
+      exec(success, error, "IndoorAtlas", "runBenchmark", [name, options || {}]);
+    });
+  },
+
+  /**
+   * Benchmark the Cordova bridge with payloads shaped like the plugin's: a
+   * position, a 500 leg route and a crowd frame of 1000 peers, each as a JSON
+   * object ("dict"), a JSON string and an ArrayBuffer ("buffer").
+   *
+   * For every shape and encoding it measures exec round trips in both
+   * directions, split into request and response legs, and native to
+   * JavaScript event streams at each rate, with one-way latency, the rate
+   * achieved and the handler's decode time. Legs and latencies compare native
+   * and JavaScript wall clocks, which agree on a device to about a
+   * millisecond. Options: { shapes, encodings, rates: [1, 10, 100, 1000],
+   * roundTrips: 100, streamMs: 3000 }. Resolves with a report that can be
+   * passed to JSON.stringify as is.
+   */
+  runBridgeBenchmark: function(options) {
+    options = options || {};
+    var shapes = options.shapes || ['position', 'route', 'crowd'];
+    var encodings = options.encodings || ['dict', 'string', 'buffer'];
+    var rates = options.rates || [1, 10, 100, 1000];
+    var roundTrips = options.roundTrips || 100;
+    var streamMs = options.streamMs || 3000;
+    var report = {
+      meta: {
+        platform: getDeviceType(),
+        userAgent: typeof navigator !== 'undefined' ? navigator.userAgent : null,
+        pluginVersion: BRIDGE_PLUGIN_VERSION,
+        timestamp: Date.now(),
+        options: { shapes: shapes, encodings: encodings, rates: rates, roundTrips: roundTrips, streamMs: streamMs }
+      },
+      roundTrips: [],
+      streams: []
+    };
+    var tasks = [];
+    shapes.forEach(function(shape) {
+      encodings.forEach(function(encoding) {
+        tasks.push(function() {
+          return bridgeRoundTrips(shape, encoding, roundTrips, false).then(function(down) {
+            var payload = down.payload;
+            delete down.payload;
+            report.roundTrips.push(down);
+            return bridgeRoundTrips(shape, encoding, roundTrips, true, payload);
+          }).then(function(up) {
+            delete up.payload;
+            report.roundTrips.push(up);
+          });
+        });
+        rates.forEach(function(rateHz) {
+          var count = Math.min(BRIDGE_MAX_EVENTS, Math.max(3, Math.round(rateHz * streamMs / 1000)));
+          tasks.push(function() {
+            return bridgeStream(shape, encoding, rateHz, count).then(function(stream) {
+              report.streams.push(stream);
+            });
+          });
+        });
+      });
+    });
+    return tasks.reduce(function(chain, task) {
+      return chain.then(task);
+    }, Promise.resolve()).then(function() {
+      return report;
+    });
   }
 };
 
@@ -502,6 +1245,35 @@ var Wayfinder = function(wayfinderId) {
     location = { lat: lat, lon: lon, floor: floor };
   }
 
+  /**
+   * Get route between the given location and destination, projected onto
+   * the given floor plan
+   */
+  this.getRouteOnFloorPlan = function(floorPlanId) {
+    if (location == null || destination == null) {
+      return Promise.resolve({ route: [] });
+    }
+    return IndoorAtlas.computeRouteOnFloorPlan(id, location, destination, floorPlanId);
+  }
+
+  /**
+   * Get route between the given location and destination as an ArrayBuffer
+   * in venue frame millimetres, for Processor.simplifyRoute. Prefer it to
+   * getRoute for long or frequent routes: the object form builds a boxed
+   * native number for every value, the buffer is written in one pass.
+   */
+  this.getRouteBuffer = function() {
+    return new Promise(function(resolve, reject) {
+      var success = function(result) { resolve(result) };
+      var error = function(e) { reject(e) };
+      if (location == null || destination == null) {
+        resolve(new ArrayBuffer(0));
+      } else {
+        exec(success, error, "IndoorAtlas", "computeRoute", [id, location.lat, location.lon, location.floor, destination.lat, destination.lon, destination.floor, true]);
+      }
+    });
+  }
+
   /**
    * Get route between the given location and destination
    */
@@ -518,4 +1290,345 @@ var Wayfinder = function(wayfinderId) {
   }
 };
 
+var DEFAULT_WORKER_URL = 'indooratlas/ProcessingWorker.js';
+
+/**
+ * Processor object, a Web Worker running ProcessingWorker.js. Every method
+ * resolves with render-ready typed arrays. The buffers of the typed arrays
+ * passed in are transferred to the worker, so the caller can no longer use
+ * them; pass a copy (slice) to keep the original.
+ */
+var Processor = function(workerUrl) {
+  var worker = new Worker(workerUrl);
+  var pending = {};
+  var nextId = 1;
+
+  worker.onmessage = function(e) {
+    var request = pending[e.data.id];
+    if (request === undefined) {
+      return;
+    }
+    delete pending[e.data.id];
+    if (e.data.error !== undefined) {
+      request.reject(new Error(e.data.error));
+    } else {
+      request.resolve(e.data.result);
+    }
+  };
+  worker.onerror = function(e) {
+    var requests = pending;
+    pending = {};
+    for (var key in requests) {
+      requests[key].reject(new Error(e.message));
+    }
+  };
+
+  var post = function(op, args, transfer) {
+    return new Promise(function(resolve, reject) {
+      var requestId = nextId++;
+      pending[requestId] = { resolve: resolve, reject: reject };
+      worker.postMessage({ id: requestId, op: op, args: args }, transfer);
+    });
+  };
+
+  /**
+   * Simplifies a route from Wayfinder.getRouteBuffer within toleranceMeters
+   * (default 0.5) and resolves with { path: Float64Array [lat, lon, ...],
+   * floors: Int32Array, length } where a new floor starts a new polyline
+   */
+  this.simplifyRoute = function(buffer, toleranceMeters) {
+    return post('route', { buffer: buffer, toleranceMeters: toleranceMeters }, [buffer]);
+  }
+
+  /**
+   * Clusters positions, a Float64Array [lat, lon, ...], into cells of
+   * cellMeters (default 5) and resolves with Float64Array [lat, lon, count, ...],
+   * most crowded first
+   */
+  this.cluster = function(positions, cellMeters) {
+    return post('cluster', { positions: positions, cellMeters: cellMeters }, [positions.buffer]);
+  }
+
+  /**
+   * Composites points, a Float64Array [lat, lon, weight, ...], into a heatmap
+   * over options { north, south, east, west, width, height, radius } and
+   * resolves with { width, height, pixels: Uint8ClampedArray } for ImageData
+   * and the bounds, which default to those of the points
+   */
+  this.heatmap = function(points, options) {
+    var args = { points: points };
+    for (var key in options) {
+      args[key] = options[key];
+    }
+    return post('heatmap', args, [points.buffer]);
+  }
+
+  /**
+   * Compiles zones, e.g. rooms or polygon geofences, [{ floor, polygon:
+   * [lat, lon, ...] }] in priority order into per floor raster label maps
+   * that stay in the worker for classifyZones. options: { cellMeters: 0.25 },
+   * between 0.1 and 0.5. Resolves with { floors, cells, runs, boundaryCells,
+   * bytes }
+   */
+  this.compileZones = function(zones, options) {
+    return post('compileZones', { zones: zones, cellMeters: options && options.cellMeters }, []);
+  }
+
+  /**
+   * Classifies points, a Float64Array [lat, lon, floor, ...], against the
+   * compiled zones and resolves with { zones: Int32Array, counts: Int32Array }:
+   * the index of the first zone containing each point, -1 for none, and the
+   * number of points per zone
+   */
+  this.classifyZones = function(points) {
+    return post('classifyZones', { points: points }, [points.buffer]);
+  }
+
+  /**
+   * Stops the worker, rejecting pending requests
+   */
+  this.terminate = function() {
+    worker.terminate();
+    worker.onerror({ message: 'Processor terminated' });
+  }
+};
+
+
+// The version cordova prepare copied from plugin.xml, so that it is only kept there
+var BRIDGE_PLUGIN_VERSION = bridgePluginVersion();
+var BRIDGE_MAX_EVENTS = 100000;
+
+function bridgePluginVersion() {
+  try {
+    var metadata = require('cordova/plugin_list').metadata;
+    return (metadata && metadata['cordova-plugin-indooratlas']) || null;
+  } catch (e) {
+    return null;
+  }
+}
+
+// Wall clock in milliseconds, at sub-millisecond resolution where available,
+// comparable with the native sentAt stamps
+function bridgeNow() {
+  if (typeof performance !== 'undefined' && performance.timeOrigin) {
+    return performance.timeOrigin + performance.now();
+  }
+  return Date.now();
+}
+
+// Native send time of a benchmark payload in its encoding
+function bridgeSentAt(payload, encoding) {
+  if (encoding === 'buffer') {
+    return new DataView(payload).getFloat64(0, true);
+  } else if (encoding === 'string') {
+    return JSON.parse(payload).sentAt;
+  }
+  return payload.sentAt;
+}
+
+function bridgeBytes(payload, encoding) {
+  if (encoding === 'buffer') {
+    return payload.byteLength;
+  } else if (encoding === 'string') {
+    return payload.length;
+  }
+  return JSON.stringify(payload).length;
+}
+
+function bridgeStats(samples) {
+  if (samples.length === 0) {
+    return { count: 0 };
+  }
+  var sorted = samples.slice().sort(function(a, b) { return a - b; });
+  var sum = 0;
+  for (var i = 0; i < sorted.length; i++) {
+    sum += sorted[i];
+  }
+  var at = function(p) {
+    return sorted[Math.min(sorted.length - 1, Math.max(0, Math.ceil(p * sorted.length) - 1))];
+  };
+  return { count: sorted.length, mean: sum / sorted.length, p50: at(0.5), p95: at(0.95), p99: at(0.99),
+    max: sorted[sorted.length - 1] };
+}
+
+function bridgeError(e) {
+  return e && e.message ? new Error(e.message) : new Error(String(e));
+}
+
+/**
+ * count exec round trips of a payload, native to JavaScript when upload is
+ * false and JavaScript to native with the given payload otherwise. Resolves
+ * with rtt, request leg and response leg statistics and the last payload.
+ */
+function bridgeRoundTrips(shape, encoding, count, upload, payload) {
+  return new Promise(function(resolve, reject) {
+    var rtt = [], request = [], response = [];
+    var last = null;
+    var next = function(i) {
+      if (i === count) {
+        resolve({ shape: shape, encoding: encoding, direction: upload ? 'up' : 'down',
+          bytes: bridgeBytes(upload ? payload : last, encoding), rttMs: bridgeStats(rtt),
+          requestMs: bridgeStats(request), responseMs: bridgeStats(response), payload: last });
+        return;
+      }
+      var start = bridgeNow();
+      var win = function(result) {
+        var end = bridgeNow();
+        var sentAt = upload ? result.sentAt : bridgeSentAt(result, encoding);
+        rtt.push(end - start);
+        request.push(sentAt - start);
+        response.push(end - sentAt);
+        last = upload ? payload : result;
+        next(i + 1);
+      };
+      var args = upload ? [shape, encoding, true, payload] : [shape, encoding, false];
+      exec(win, function(e) { reject(bridgeError(e)); }, "IndoorAtlas", "bridgeEcho", args);
+    };
+    next(0);
+  });
+}
+
+/**
+ * Streams count payloads from native code at rateHz and resolves with the
+ * one-way latency, the rate achieved in JavaScript and the time the handler
+ * spent decoding. A stream that does not finish in time is stopped.
+ */
+function bridgeStream(shape, encoding, rateHz, count) {
+  return new Promise(function(resolve, reject) {
+    var latency = [], decode = [];
+    var first = 0, last = 0, bytes = 0;
+    var guard = setTimeout(function() {
+      exec(null, null, "IndoorAtlas", "bridgeStop", []);
+    }, count * 1000 / rateHz * 3 + 10000);
+    var win = function(payload) {
+      var arrived = bridgeNow();
+      if (payload !== null && typeof payload === 'object' && payload.done === true) {
+        clearTimeout(guard);
+        var received = latency.length;
+        resolve({ shape: shape, encoding: encoding, rateHz: rateHz, requested: count, sent: payload.sent,
+          received: received, late: payload.late, nativeDurationMs: payload.durationMs, bytes: bytes,
+          achievedHz: received > 1 ? (received - 1) * 1000 / (last - first) : 0,
+          latencyMs: bridgeStats(latency), decodeMs: bridgeStats(decode) });
+        return;
+      }
+      var sentAt = bridgeSentAt(payload, encoding);
+      var decoded = bridgeNow();
+      if (latency.length === 0) {
+        first = arrived;
+        bytes = bridgeBytes(payload, encoding);
+      }
+      last = arrived;
+      latency.push(arrived - sentAt);
+      decode.push(decoded - arrived);
+    };
+    var fail = function(e) {
+      clearTimeout(guard);
+      reject(bridgeError(e));
+    };
+    exec(win, fail, "IndoorAtlas", "bridgeStream", [shape, encoding, rateHz, count]);
+  });
+}
+
+// State record of getState, merged from the native diffs. partVersions has
+// the version each part last changed at, for the watches to diff against.
+var STATE_PARTS = ['location', 'status', 'region', 'traceId', 'running'];
+var stateCache = { epoch: 0, version: 0, parts: {}, partVersions: {} };
+var stateWatches = {};   // watch id -> { epoch, version, timer }
+
+function refreshState() {
+  return new Promise(function(resolve, reject) {
+    var success = function(diff) {
+      mergeState(diff);
+      resolve();
+    };
+    exec(success, reject, "IndoorAtlas", "getState", [stateCache.version, stateCache.epoch]);
+  });
+}
+
+function mergeState(diff) {
+  if (diff.full) {
+    stateCache.parts = {};
+    stateCache.partVersions = {};
+  } else if (diff.epoch !== stateCache.epoch || diff.version < stateCache.version) {
+    // Answer to an older request, overtaken by a newer one
+    return;
+  }
+  STATE_PARTS.forEach(function(part) {
+    if (diff.hasOwnProperty(part)) {
+      stateCache.parts[part] = diff[part];
+      stateCache.partVersions[part] = diff.version;
+    }
+  });
+  stateCache.epoch = diff.epoch;
+  stateCache.version = diff.version;
+}
+
+function changedStateParts(epoch, version) {
+  return STATE_PARTS.filter(function(part) {
+    return epoch !== stateCache.epoch || stateCache.partVersions[part] > version;
+  });
+}
+
+function copyState() {
+  var state = { version: stateCache.version };
+  STATE_PARTS.forEach(function(part) {
+    var value = stateCache.parts[part];
+    state[part] = value !== undefined ? value : null;
+  });
+  return state;
+}
+
+// Layout of the getHistory payload, see PositionHistory.java
+var HISTORY_HEADER_BYTES = 48;
+
+function toFloorPlan(p) {
+  return new FloorPlan(
+    p.id,
+    p.name,
+    p.url,
+    p.floorLevel,
+    p.bearing,
+    p.bitmapHeight,
+    p.bitmapWidth,
+    p.heightMeters,
+    p.widthMeters,
+    p.metersToPixels,
+    p.pixelsToMeters,
+    p.bottomLeft,
+    p.center,
+    p.topLeft,
+    p.topRight
+  );
+}
+
+function decodeHistory(buffer) {
+  var view = new DataView(buffer);
+  var originLatitude = view.getFloat64(0, true);
+  var originLongitude = view.getFloat64(8, true);
+  var mmPerDegreeLatitude = view.getFloat64(16, true);
+  var mmPerDegreeLongitude = view.getFloat64(24, true);
+  var count = view.getInt32(44, true);
+  var times = new Float64Array(count);
+  var coordinates = new Float64Array(count * 2);
+  var floors = new Int32Array(count);
+  var accuracies = new Float64Array(count);
+  var ints = HISTORY_HEADER_BYTES + count * 8;
+  for (var i = 0; i < count; i++) {
+    times[i] = view.getFloat64(HISTORY_HEADER_BYTES + i * 8, true);
+    var base = ints + i * 16;
+    coordinates[i * 2] = originLatitude + view.getInt32(base + 4, true) / mmPerDegreeLatitude;
+    coordinates[i * 2 + 1] = originLongitude + view.getInt32(base, true) / mmPerDegreeLongitude;
+    floors[i] = view.getInt32(base + 8, true);
+    accuracies[i] = view.getInt32(base + 12, true) / 1000;
+  }
+  return {
+    fixCount: view.getInt32(40, true),
+    distance: view.getFloat64(32, true),
+    times: times,
+    coordinates: coordinates,
+    floors: floors,
+    accuracies: accuracies
+  };
+}
+
 module.exports = IndoorAtlas;
@@ -0,0 +1,570 @@
+/**
+ * Web Worker for the processing the app would otherwise do on the WebView main
+ * thread: route simplification, clustering of crowd positions, heatmap
+ * compositing and point in zone classification. It is installed as an asset, not as a js-module, and started by
+ * IndoorAtlas.createProcessor.
+ *
+ * Messages are { id, op, args } and are answered with { id, result } or
+ * { id, error }. Inputs and outputs are typed arrays whose buffers are
+ * transferred, not copied, in both directions.
+ */
+
+var ROUTE_HEADER_BYTES = 40;
+var ROUTE_STRIDE = 7;
+var METERS_PER_DEGREE_LAT = 111320;
+
+/**
+ * Decodes a route from Wayfinder.getRouteBuffer, see RouteBuffer.java:
+ * little-endian float64 origin latitude, longitude, millimetres per degree of
+ * latitude and longitude, int32 leg count and version, 7 int32 per leg and a
+ * float64 length per leg after padding to 8 bytes.
+ */
+function decodeRoute(buffer) {
+  if (!buffer || buffer.byteLength < ROUTE_HEADER_BYTES) {
+    return null;
+  }
+  var view = new DataView(buffer);
+  var legs = view.getInt32(32, true);
+  var intBytes = legs * ROUTE_STRIDE * 4;
+  var lengthsOffset = ROUTE_HEADER_BYTES + ((intBytes + 7) & ~7);
+  if (legs < 0 || buffer.byteLength < lengthsOffset + legs * 8) {
+    throw new Error('Truncated route buffer');
+  }
+  var ints = new Int32Array(legs * ROUTE_STRIDE);
+  for (var i = 0; i < ints.length; i++) {
+    ints[i] = view.getInt32(ROUTE_HEADER_BYTES + i * 4, true);
+  }
+  var length = 0;
+  for (var j = 0; j < legs; j++) {
+    length += view.getFloat64(lengthsOffset + j * 8, true);
+  }
+  return {
+    originLat: view.getFloat64(0, true),
+    originLon: view.getFloat64(8, true),
+    mmPerDegreeLat: view.getFloat64(16, true),
+    mmPerDegreeLon: view.getFloat64(24, true),
+    legs: legs,
+    ints: ints,
+    length: length
+  };
+}
+
+// Squared distance of point i from the segment a-b, all in xy pairs
+function segmentDistanceSquared(xy, i, a, b) {
+  var ax = xy[2 * a], ay = xy[2 * a + 1];
+  var dx = xy[2 * b] - ax, dy = xy[2 * b + 1] - ay;
+  var px = xy[2 * i] - ax, py = xy[2 * i + 1] - ay;
+  var lengthSquared = dx * dx + dy * dy;
+  var t = lengthSquared > 0 ? (px * dx + py * dy) / lengthSquared : 0;
+  t = t < 0 ? 0 : (t > 1 ? 1 : t);
+  var ex = px - t * dx, ey = py - t * dy;
+  return ex * ex + ey * ey;
+}
+
+/**
+ * Marks the points of xy[from..to] that Douglas-Peucker keeps, iteratively so
+ * long routes cannot overflow the stack
+ */
+function douglasPeucker(xy, from, to, toleranceSquared, keep) {
+  var stack = [from, to];
+  keep[from] = 1;
+  keep[to] = 1;
+  while (stack.length > 0) {
+    var b = stack.pop();
+    var a = stack.pop();
+    var worst = -1;
+    var worstDistance = toleranceSquared;
+    for (var i = a + 1; i < b; i++) {
+      var d = segmentDistanceSquared(xy, i, a, b);
+      if (d > worstDistance) {
+        worst = i;
+        worstDistance = d;
+      }
+    }
+    if (worst >= 0) {
+      keep[worst] = 1;
+      stack.push(a, worst, worst, b);
+    }
+  }
+}
+
+/**
+ * Route polyline simplified within toleranceMeters, per floor.
+ * Returns { path: Float64Array [lat, lon, ...], floors: Int32Array, length }
+ * where a change of floor between consecutive vertices starts a new polyline.
+ */
+function simplifyRoute(args) {
+  var route = decodeRoute(args.buffer);
+  if (route === null || route.legs === 0) {
+    return { path: new Float64Array(0), floors: new Int32Array(0), length: 0 };
+  }
+  var ints = route.ints;
+  var count = route.legs + 1;
+  var xy = new Float64Array(count * 2);
+  var floors = new Int32Array(count);
+  for (var i = 0; i < route.legs; i++) {
+    xy[2 * i] = ints[i * ROUTE_STRIDE];
+    xy[2 * i + 1] = ints[i * ROUTE_STRIDE + 1];
+    floors[i] = ints[i * ROUTE_STRIDE + 2];
+  }
+  var last = (route.legs - 1) * ROUTE_STRIDE;
+  xy[2 * route.legs] = ints[last + 3];
+  xy[2 * route.legs + 1] = ints[last + 4];
+  floors[route.legs] = ints[last + 5];
+
+  var tolerance = (args.toleranceMeters !== undefined ? args.toleranceMeters : 0.5) * 1000;
+  var keep = new Uint8Array(count);
+  var start = 0;
+  for (var j = 1; j <= count; j++) {
+    if (j === count || floors[j] !== floors[start]) {
+      douglasPeucker(xy, start, j - 1, tolerance * tolerance, keep);
+      start = j;
+    }
+  }
+
+  var kept = 0;
+  for (var k = 0; k < count; k++) {
+    kept += keep[k];
+  }
+  var path = new Float64Array(kept * 2);
+  var pathFloors = new Int32Array(kept);
+  var n = 0;
+  for (var m = 0; m < count; m++) {
+    if (keep[m]) {
+      path[2 * n] = route.originLat + xy[2 * m + 1] / route.mmPerDegreeLat;
+      path[2 * n + 1] = route.originLon + xy[2 * m] / route.mmPerDegreeLon;
+      pathFloors[n] = floors[m];
+      n++;
+    }
+  }
+  return { path: path, floors: pathFloors, length: route.length };
+}
+
+/**
+ * Groups positions [lat, lon, ...] into square cells of cellMeters and
+ * returns Float64Array [lat, lon, count, ...] with the centroid of every
+ * occupied cell, most crowded first
+ */
+function cluster(args) {
+  var positions = args.positions;
+  var cellMeters = args.cellMeters || 5;
+  var points = positions.length >> 1;
+  if (points === 0) {
+    return new Float64Array(0);
+  }
+  var lat0 = positions[0];
+  var metersPerDegreeLon = METERS_PER_DEGREE_LAT * Math.cos(lat0 * Math.PI / 180);
+  var cells = {};
+  var order = [];
+  for (var i = 0; i < points; i++) {
+    var lat = positions[2 * i], lon = positions[2 * i + 1];
+    var key = Math.floor(lat * METERS_PER_DEGREE_LAT / cellMeters) + ':' +
+      Math.floor(lon * metersPerDegreeLon / cellMeters);
+    var cell = cells[key];
+    if (cell === undefined) {
+      cell = cells[key] = { lat: 0, lon: 0, count: 0 };
+      order.push(cell);
+    }
+    cell.lat += lat;
+    cell.lon += lon;
+    cell.count++;
+  }
+  order.sort(function(a, b) { return b.count - a.count; });
+  var result = new Float64Array(order.length * 3);
+  for (var j = 0; j < order.length; j++) {
+    result[3 * j] = order[j].lat / order[j].count;
+    result[3 * j + 1] = order[j].lon / order[j].count;
+    result[3 * j + 2] = order[j].count;
+  }
+  return result;
+}
+
+var heatRamp = null;
+
+// 256 RGBA entries from transparent blue through green and yellow to red
+function buildHeatRamp() {
+  var stops = [
+    [0, 0, 0, 255, 0],
+    [0.25, 0, 128, 255, 128],
+    [0.5, 0, 220, 0, 170],
+    [0.75, 255, 220, 0, 200],
+    [1, 255, 0, 0, 230]
+  ];
+  var ramp = new Uint8ClampedArray(256 * 4);
+  for (var i = 0; i < 256; i++) {
+    var t = i / 255;
+    var s = 1;
+    while (s < stops.length - 1 && stops[s][0] < t) {
+      s++;
+    }
+    var a = stops[s - 1], b = stops[s];
+    var f = (t - a[0]) / (b[0] - a[0]);
+    for (var c = 0; c < 4; c++) {
+      ramp[4 * i + c] = a[c + 1] + (b[c + 1] - a[c + 1]) * f;
+    }
+  }
+  return ramp;
+}
+
+/**
+ * Composites points [lat, lon, weight, ...] into an RGBA image covering
+ * { north, south, east, west } at width x height pixels, each point spreading
+ * over radius pixels. Without bounds the image covers the points. Returns
+ * { width, height, pixels: Uint8ClampedArray, north, south, east, west },
+ * ready for ImageData and a ground overlay.
+ */
+function heatmap(args) {
+  var points = args.points;
+  var width = args.width || 256;
+  var height = args.height || 256;
+  var radius = args.radius || 8;
+  if (args.north === undefined) {
+    heatmapBounds(points, args);
+  }
+  var scaleX = width / (args.east - args.west);
+  var scaleY = height / (args.north - args.south);
+  var density = new Float32Array(width * height);
+
+  var kernel = new Float32Array((2 * radius + 1) * (2 * radius + 1));
+  for (var ky = -radius; ky <= radius; ky++) {
+    for (var kx = -radius; kx <= radius; kx++) {
+      var r = 1 - (kx * kx + ky * ky) / (radius * radius);
+      kernel[(ky + radius) * (2 * radius + 1) + kx + radius] = r > 0 ? r * r : 0;
+    }
+  }
+
+  var max = 0;
+  for (var i = 0; i + 2 < points.length; i += 3) {
+    var cx = Math.round((points[i + 1] - args.west) * scaleX);
+    var cy = Math.round((args.north - points[i]) * scaleY);
+    var weight = points[i + 2];
+    for (var y = Math.max(0, cy - radius); y <= Math.min(height - 1, cy + radius); y++) {
+      var row = (y - cy + radius) * (2 * radius + 1) - cx + radius;
+      for (var x = Math.max(0, cx - radius); x <= Math.min(width - 1, cx + radius); x++) {
+        var value = density[y * width + x] += kernel[row + x] * weight;
+        if (value > max) {
+          max = value;
+        }
+      }
+    }
+  }
+
+  if (heatRamp === null) {
+    heatRamp = buildHeatRamp();
+  }
+  var pixels = new Uint8ClampedArray(width * height * 4);
+  if (max > 0) {
+    var scale = 255 / max;
+    for (var p = 0; p < density.length; p++) {
+      if (density[p] > 0) {
+        var entry = Math.min(255, Math.round(density[p] * scale)) * 4;
+        pixels[4 * p] = heatRamp[entry];
+        pixels[4 * p + 1] = heatRamp[entry + 1];
+        pixels[4 * p + 2] = heatRamp[entry + 2];
+        pixels[4 * p + 3] = heatRamp[entry + 3];
+      }
+    }
+  }
+  return { width: width, height: height, pixels: pixels,
+    north: args.north, south: args.south, east: args.east, west: args.west };
+}
+
+// Bounds of the points with a 10 % margin, at least about 10 m across
+function heatmapBounds(points, bounds) {
+  var south = Infinity, north = -Infinity, west = Infinity, east = -Infinity;
+  for (var i = 0; i + 2 < points.length; i += 3) {
+    south = Math.min(south, points[i]);
+    north = Math.max(north, points[i]);
+    west = Math.min(west, points[i + 1]);
+    east = Math.max(east, points[i + 1]);
+  }
+  if (south > north) {
+    south = north = west = east = 0;
+  }
+  var marginLat = Math.max((north - south) * 0.1, 5 / METERS_PER_DEGREE_LAT);
+  var marginLon = Math.max((east - west) * 0.1, marginLat);
+  bounds.north = north + marginLat;
+  bounds.south = south - marginLat;
+  bounds.east = east + marginLon;
+  bounds.west = west - marginLon;
+}
+
+var ZONE_NONE = -1;
+var ZONE_BOUNDARY = -2;
+
+// Raster label maps of the last compileZones, used by classifyZones
+var zoneRaster = null;
+
+/**
+ * Compiles zones [{ floor, polygon: [lat, lon, ...] }] into one raster label
+ * map per floor of cellMeters cells (0.1 to 0.5, default 0.25). A cell holds
+ * the index of the first zone containing it or -1, classified at its centre;
+ * cells crossed by a zone edge are marked as boundary and are classified by
+ * exact even-odd tests at lookup. Rows are run-length encoded, so a lookup is
+ * a binary search over the few runs of one row. The maps stay in the worker.
+ * Returns { floors, cells, runs, boundaryCells, bytes }.
+ */
+function compileZones(args) {
+  var zones = args.zones || [];
+  var cellMeters = Math.min(0.5, Math.max(0.1, args.cellMeters || 0.25));
+  var lat0 = 0, lon0 = 0;
+  for (var z = 0; z < zones.length; z++) {
+    if (zones[z].polygon && zones[z].polygon.length >= 2) {
+      lat0 = zones[z].polygon[0];
+      lon0 = zones[z].polygon[1];
+      break;
+    }
+  }
+  var metersPerDegreeLon = METERS_PER_DEGREE_LAT * Math.cos(lat0 * Math.PI / 180);
+
+  var floorZones = {};
+  for (var i = 0; i < zones.length; i++) {
+    var polygon = zones[i].polygon || [];
+    var vertices = polygon.length >> 1;
+    if (vertices < 3) {
+      continue;
+    }
+    var xy = new Float64Array(2 * vertices);
+    var zone = { index: i, xy: xy, minX: Infinity, minY: Infinity, maxX: -Infinity, maxY: -Infinity };
+    for (var v = 0; v < vertices; v++) {
+      var x = xy[2 * v] = (polygon[2 * v + 1] - lon0) * metersPerDegreeLon;
+      var y = xy[2 * v + 1] = (polygon[2 * v] - lat0) * METERS_PER_DEGREE_LAT;
+      zone.minX = Math.min(zone.minX, x);
+      zone.minY = Math.min(zone.minY, y);
+      zone.maxX = Math.max(zone.maxX, x);
+      zone.maxY = Math.max(zone.maxY, y);
+    }
+    var floor = zones[i].floor | 0;
+    (floorZones[floor] = floorZones[floor] || []).push(zone);
+  }
+
+  zoneRaster = { lat0: lat0, lon0: lon0, metersPerDegreeLon: metersPerDegreeLon,
+    zoneCount: zones.length, floors: {} };
+  var stats = { floors: 0, cells: 0, runs: 0, boundaryCells: 0, bytes: 0 };
+  for (var key in floorZones) {
+    var raster = rasterizeZones(floorZones[key], cellMeters, stats);
+    zoneRaster.floors[key] = raster;
+    stats.floors++;
+    stats.runs += raster.runStarts.length;
+    stats.bytes += raster.rowOffsets.byteLength + raster.runStarts.byteLength + raster.runLabels.byteLength;
+  }
+  return stats;
+}
+
+// Label map of the zones of one floor, see compileZones
+function rasterizeZones(zones, cellMeters, stats) {
+  var minX = Infinity, minY = Infinity, maxX = -Infinity, maxY = -Infinity;
+  for (var z = 0; z < zones.length; z++) {
+    minX = Math.min(minX, zones[z].minX);
+    minY = Math.min(minY, zones[z].minY);
+    maxX = Math.max(maxX, zones[z].maxX);
+    maxY = Math.max(maxY, zones[z].maxY);
+  }
+  var width = Math.floor((maxX - minX) / cellMeters) + 1;
+  var height = Math.floor((maxY - minY) / cellMeters) + 1;
+  var labels = new Int32Array(width * height);
+  for (var c = 0; c < labels.length; c++) {
+    labels[c] = ZONE_NONE;
+  }
+  // Earlier zones are painted last and win where zones overlap
+  for (var i = zones.length - 1; i >= 0; i--) {
+    fillZone(labels, width, minX, minY, cellMeters, zones[i]);
+  }
+  for (var j = 0; j < zones.length; j++) {
+    var xy = zones[j].xy;
+    var n = xy.length >> 1;
+    for (var a = n - 1, b = 0; b < n; a = b++) {
+      markEdge(labels, width, height, (xy[2 * a] - minX) / cellMeters, (xy[2 * a + 1] - minY) / cellMeters,
+        (xy[2 * b] - minX) / cellMeters, (xy[2 * b + 1] - minY) / cellMeters);
+    }
+  }
+
+  var rowOffsets = new Int32Array(height + 1);
+  var runStarts = [];
+  var runLabels = [];
+  for (var row = 0; row < height; row++) {
+    rowOffsets[row] = runStarts.length;
+    var base = row * width;
+    for (var col = 0; col < width; col++) {
+      var label = labels[base + col];
+      if (col === 0 || label !== labels[base + col - 1]) {
+        runStarts.push(col);
+        runLabels.push(label);
+      }
+      if (label === ZONE_BOUNDARY) {
+        stats.boundaryCells++;
+      }
+    }
+  }
+  rowOffsets[height] = runStarts.length;
+  stats.cells += width * height;
+  return { x0: minX, y0: minY, cellMeters: cellMeters, width: width, height: height, zones: zones,
+    rowOffsets: rowOffsets, runStarts: new Int32Array(runStarts), runLabels: new Int32Array(runLabels) };
+}
+
+// Scanline fill of the cells whose centre is inside the zone, even-odd
+function fillZone(labels, width, x0, y0, cellMeters, zone) {
+  var xy = zone.xy;
+  var n = xy.length >> 1;
+  var firstRow = Math.max(0, Math.ceil((zone.minY - y0) / cellMeters - 0.5));
+  var lastRow = Math.floor((zone.maxY - y0) / cellMeters - 0.5);
+  var crossings = [];
+  for (var row = firstRow; row <= lastRow; row++) {
+    var yc = y0 + (row + 0.5) * cellMeters;
+    crossings.length = 0;
+    for (var a = n - 1, b = 0; b < n; a = b++) {
+      var ya = xy[2 * a + 1], yb = xy[2 * b + 1];
+      if ((ya > yc) !== (yb > yc)) {
+        crossings.push(xy[2 * a] + (yc - ya) * (xy[2 * b] - xy[2 * a]) / (yb - ya));
+      }
+    }
+    crossings.sort(function(p, q) { return p - q; });
+    for (var k = 0; k + 1 < crossings.length; k += 2) {
+      var from = Math.max(0, Math.ceil((crossings[k] - x0) / cellMeters - 0.5));
+      var to = Math.min(width, Math.ceil((crossings[k + 1] - x0) / cellMeters - 0.5));
+      for (var col = from; col < to; col++) {
+        labels[row * width + col] = zone.index;
+      }
+    }
+  }
+}
+
+// Marks every cell the segment passes through, in cell units
+function markEdge(labels, width, height, ax, ay, bx, by) {
+  var cx = Math.floor(ax), cy = Math.floor(ay);
+  var ex = Math.floor(bx), ey = Math.floor(by);
+  var dx = bx - ax, dy = by - ay;
+  var stepX = dx > 0 ? 1 : -1, stepY = dy > 0 ? 1 : -1;
+  var deltaX = dx !== 0 ? Math.abs(1 / dx) : Infinity;
+  var deltaY = dy !== 0 ? Math.abs(1 / dy) : Infinity;
+  var nextX = dx > 0 ? (cx + 1 - ax) * deltaX : (dx < 0 ? (ax - cx) * deltaX : Infinity);
+  var nextY = dy > 0 ? (cy + 1 - ay) * deltaY : (dy < 0 ? (ay - cy) * deltaY : Infinity);
+  var steps = Math.abs(ex - cx) + Math.abs(ey - cy);
+  for (var i = 0; ; i++) {
+    if (cx >= 0 && cx < width && cy >= 0 && cy < height) {
+      labels[cy * width + cx] = ZONE_BOUNDARY;
+    }
+    if (i === steps) {
+      return;
+    }
+    if (nextX < nextY) {
+      cx += stepX;
+      nextX += deltaX;
+    } else {
+      cy += stepY;
+      nextY += deltaY;
+    }
+  }
+}
+
+// Even-odd test of the zones of a floor in order, for boundary cells
+function exactZone(zones, x, y) {
+  for (var z = 0; z < zones.length; z++) {
+    var zone = zones[z];
+    if (x < zone.minX || x > zone.maxX || y < zone.minY || y > zone.maxY) {
+      continue;
+    }
+    var xy = zone.xy;
+    var n = xy.length >> 1;
+    var inside = false;
+    for (var a = n - 1, b = 0; b < n; a = b++) {
+      var ya = xy[2 * a + 1], yb = xy[2 * b + 1];
+      if ((ya > y) !== (yb > y) && x < xy[2 * a] + (y - ya) * (xy[2 * b] - xy[2 * a]) / (yb - ya)) {
+        inside = !inside;
+      }
+    }
+    if (inside) {
+      return zone.index;
+    }
+  }
+  return ZONE_NONE;
+}
+
+/**
+ * Classifies points [lat, lon, floor, ...] against the zones of the last
+ * compileZones. Returns { zones: Int32Array, counts: Int32Array }: the zone
+ * index of every point, -1 outside all zones, and the points per zone.
+ */
+function classifyZones(args) {
+  var points = args.points;
+  var count = Math.floor(points.length / 3);
+  var result = new Int32Array(count);
+  if (zoneRaster === null) {
+    throw new Error('No zones compiled');
+  }
+  var counts = new Int32Array(zoneRaster.zoneCount);
+  var lat0 = zoneRaster.lat0, lon0 = zoneRaster.lon0, metersPerDegreeLon = zoneRaster.metersPerDegreeLon;
+  var floor = null, raster = null;
+  for (var i = 0; i < count; i++) {
+    if (points[3 * i + 2] !== floor) {
+      floor = points[3 * i + 2];
+      raster = zoneRaster.floors[floor | 0] || null;
+    }
+    var label = ZONE_NONE;
+    if (raster !== null) {
+      var x = (points[3 * i + 1] - lon0) * metersPerDegreeLon;
+      var y = (points[3 * i] - lat0) * METERS_PER_DEGREE_LAT;
+      var col = Math.floor((x - raster.x0) / raster.cellMeters);
+      var row = Math.floor((y - raster.y0) / raster.cellMeters);
+      if (col >= 0 && col < raster.width && row >= 0 && row < raster.height) {
+        var lo = raster.rowOffsets[row], hi = raster.rowOffsets[row + 1] - 1;
+        var runStarts = raster.runStarts;
+        while (lo < hi) {
+          var mid = (lo + hi + 1) >> 1;
+          if (runStarts[mid] <= col) {
+            lo = mid;
+          } else {
+            hi = mid - 1;
+          }
+        }
+        label = raster.runLabels[lo];
+        if (label === ZONE_BOUNDARY) {
+          label = exactZone(raster.zones, x, y);
+        }
+      }
+    }
+    result[i] = label;
+    if (label >= 0) {
+      counts[label]++;
+    }
+  }
+  return { zones: result, counts: counts };
+}
+
+var operations = {
+  route: simplifyRoute,
+  cluster: cluster,
+  heatmap: heatmap,
+  compileZones: compileZones,
+  classifyZones: classifyZones
+};
+
+// Buffers of the typed arrays in a result, to be transferred back
+function transferables(result) {
+  if (ArrayBuffer.isView(result)) {
+    return [result.buffer];
+  }
+  var list = [];
+  for (var key in result) {
+    if (ArrayBuffer.isView(result[key])) {
+      list.push(result[key].buffer);
+    }
+  }
+  return list;
+}
+
+if (typeof self !== 'undefined' && typeof importScripts === 'function') {
+  self.onmessage = function(e) {
+    var message = e.data;
+    var operation = operations[message.op];
+    try {
+      if (!operation) {
+        throw new Error('Unknown operation ' + message.op);
+      }
+      var result = operation(message.args);
+      self.postMessage({ id: message.id, result: result }, transferables(result));
+    } catch (error) {
+      self.postMessage({ id: message.id, error: error.message });
+    }
+  };
+}
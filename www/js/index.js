@@ -68,6 +68,12 @@ var cordovaExample = {
   marker : null,
   accuracyCircle : null, //notH
   retina : window.devicePixelRatio > 1 ? true : false,
+  // Web Worker for heatmap, route and crowd processing, see IndoorAtlas.createProcessor
+  processor : null,
+  // Positions of this session as [lat, lon, weight, ...] for the heatmap
+  trail : new Float64Array(3 * 3600),
+  trailLength : 0,
+  heatmapOverlay : null,
 
   // Configures IndoorAtlas SDK with API Key and Secret
   // Set the API Keys in www/js/APIKeys.js
@@ -81,6 +87,9 @@ var cordovaExample = {
     cordovaExample.configureIA();
   },
   IAServiceConfigured: function(result) {
+    if (typeof Worker !== 'undefined' && cordovaExample.processor == null) {
+      cordovaExample.processor = IndoorAtlas.createProcessor();
+    }
     cordovaExample.initializeMap();
   },
 
@@ -90,6 +99,7 @@ var cordovaExample = {
     SpinnerPlugin.activityStop();
     try {
       var center = {lat : position.coords.latitude, lng : position.coords.longitude};
+      cordovaExample.recordTrail(center);
 
       marker.setPosition(center);
 
@@ -189,6 +199,7 @@ var cordovaExample = {
   stopPositioning: function() {
     IndoorAtlas.clearWatch(this.watchId);
     cordovaExample.stopRegionWatch();
+    cordovaExample.showHeatmap();
     /*if (groundOverlay != null) {
       groundOverlay.setMap(null);
     }
@@ -475,6 +486,42 @@ mapOverlay: function(position) {
     groundOverlay.setMap(venuemap);
   },
 
+  // Keeps the latest positions for the heatmap; the oldest are overwritten when full
+  recordTrail: function(center) {
+    var trail = cordovaExample.trail;
+    var offset = (cordovaExample.trailLength % (trail.length / 3)) * 3;
+    trail[offset] = center.lat;
+    trail[offset + 1] = center.lng;
+    trail[offset + 2] = 1;
+    cordovaExample.trailLength++;
+  },
+
+  // Shows where the user has been as a heatmap. The worker composites the
+  // image; the main thread only turns the pixels into an overlay.
+  showHeatmap: function() {
+    if (cordovaExample.processor == null || cordovaExample.trailLength == 0) {
+      return;
+    }
+    var count = Math.min(cordovaExample.trailLength, cordovaExample.trail.length / 3);
+    // The buffer is transferred to the worker, so send a copy
+    var points = cordovaExample.trail.slice(0, count * 3);
+    var size = 256 * (cordovaExample.retina ? 2 : 1);
+    cordovaExample.processor.heatmap(points, {width: size, height: size, radius: size / 32}).then(function(heat) {
+      var canvas = document.createElement('canvas');
+      canvas.width = heat.width;
+      canvas.height = heat.height;
+      canvas.getContext('2d').putImageData(new ImageData(heat.pixels, heat.width, heat.height), 0, 0);
+      var bounds = new google.maps.LatLngBounds({lat : heat.south, lng : heat.west}, {lat : heat.north, lng : heat.east});
+      if (cordovaExample.heatmapOverlay != null) {
+        cordovaExample.heatmapOverlay.setMap(null);
+      }
+      cordovaExample.heatmapOverlay = new google.maps.GroundOverlay(canvas.toDataURL(), bounds, {clickable : false});
+      cordovaExample.heatmapOverlay.setMap(venuemap);
+    }, function(error) {
+      console.log('Heatmap failed: ' + error.message);
+    });
+  },
+
   // Updates the ground overlay
   updateOverlay: function(id) {
     var win = function(floorplan) {